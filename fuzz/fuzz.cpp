@@ -1,4 +1,6 @@
 #include <tinykvm/machine.hpp>
+#include <fstream>
+#include <iterator>
 #include "helpers.cpp"
 
 static const std::vector<uint8_t> empty;
@@ -19,6 +21,13 @@ extern "C" void __msan_on_error()
 	abort();
 }
 
+#if defined(FUZZ_ELF)
+static void fuzz_setup()
+{
+	machine = new tinykvm::Machine { std::string_view{}, options };
+	machine->install_unhandled_syscall_handler([] (auto&, unsigned) {});
+}
+
 static inline void fuzz_elf_loader(const uint8_t* data, size_t len)
 {
 	using namespace tinykvm;
@@ -30,19 +39,78 @@ static inline void fuzz_elf_loader(const uint8_t* data, size_t len)
 		//printf(">>> Exception: %s\n", e.what());
 	}
 }
+#elif defined(FUZZ_SYSCALLS)
+/* Persistent mode: The guest program in guest/fuzz runs main() once
+   in a master VM, which is forked once. Each input is copied into a
+   guest buffer and run as a sequence of system calls by the guest,
+   after which the fork is reset to the master, keeping its working
+   memory. No machine is created or destroyed between inputs. */
+static constexpr size_t MAX_FUZZ_INPUT = 64UL << 10; /* Matches syscalls.c */
+static constexpr float SYSCALL_TIMEOUT = 1.0f;
+static tinykvm::Machine* master;
+static tinykvm::MachineOptions fork_options;
+static std::vector<uint8_t> guest_binary;
+static uint64_t fuzz_function;
+static uint64_t fuzz_input;
+
+static void fuzz_setup()
+{
+	/* The guest program from guest/fuzz/build.sh */
+	const char* filename = getenv("TINYKVM_FUZZ_GUEST");
+	if (filename == nullptr)
+		filename = "../guest/fuzz/syscalls";
+	std::ifstream file(filename, std::ios::binary);
+	guest_binary.assign(std::istreambuf_iterator<char>(file), {});
+	if (guest_binary.empty()) {
+		fprintf(stderr, "Could not load the guest program %s\n", filename);
+		abort();
+	}
+	fork_options.max_mem = 64ULL << 20;
+	fork_options.max_cow_mem = 32ULL << 20;
+	fork_options.reset_keep_all_work_memory = true;
+
+	master = new tinykvm::Machine { guest_binary, fork_options };
+	master->set_printer([] (const char*, size_t) {});
+	master->setup_linux({"fuzz"}, {"LC_ALL=C"});
+	master->run(TIMEOUT);
+	fuzz_function = master->address_of("fuzz_syscalls");
+	fuzz_input = master->address_of("fuzz_input");
+	if (fuzz_function == 0x0 || fuzz_input == 0x0) {
+		fprintf(stderr, "The guest program %s is missing fuzz_syscalls\n", filename);
+		abort();
+	}
+	master->prepare_copy_on_write();
+
+	machine = new tinykvm::Machine { *master, fork_options };
+	machine->set_printer([] (const char*, size_t) {});
+}
+
+static inline void fuzz_syscalls(const uint8_t* data, size_t len)
+{
+	using namespace tinykvm;
+	len = std::min(len, MAX_FUZZ_INPUT);
+	try {
+		machine->copy_to_guest(fuzz_input, data, len);
+		machine->timed_vmcall(fuzz_function, SYSCALL_TIMEOUT, len);
+	} catch (const MachineException& e) {
+		//printf(">>> Exception: %s\n", e.what());
+	}
+	machine->reset_to(*master, fork_options);
+}
+#else
+	#error "Unknown fuzzing mode"
+#endif
 
 extern "C"
 void LLVMFuzzerTestOneInput(const uint8_t* data, size_t len)
 {
 	if (machine == nullptr) {
 		tinykvm::Machine::init();
-
-		machine = new tinykvm::Machine { std::string_view{}, options };
-		machine->install_unhandled_syscall_handler([] (auto&, unsigned) {});
+		fuzz_setup();
 	}
 #if defined(FUZZ_ELF)
 	fuzz_elf_loader(data, len);
-#else
-	#error "Unknown fuzzing mode"
+#elif defined(FUZZ_SYSCALLS)
+	fuzz_syscalls(data, len);
 #endif
 }
@@ -8,5 +8,11 @@ cmake .. -DCMAKE_BUILD_TYPE=Debug
 make -j4
 popd
 
-echo "Starting: ./build/elffuzzer -fork=1 -handle_fpe=0"
-./.build/elffuzzer -max_len=8192 -handle_fpe=0 -handle_segv=0 -handle_abrt=0 $@
+# elffuzzer or syscallfuzzer. The syscall fuzzer needs guest/fuzz/build.sh.
+FUZZER=${FUZZER:-elffuzzer}
+if [ "$FUZZER" = "syscallfuzzer" ]; then
+	(cd ../guest/fuzz && ./build.sh)
+fi
+
+echo "Starting: ./build/$FUZZER -fork=1 -handle_fpe=0"
+./.build/$FUZZER -max_len=8192 -handle_fpe=0 -handle_segv=0 -handle_abrt=0 $@
@@ -1 +1,3 @@
 gcc-11 -static -O3 -march=native stream.c -o stream
+# Driven by src/streambench.cpp
+gcc-11 -static -O3 -march=native stream_tinykvm.c -o stream_tinykvm
@@ -0,0 +1,81 @@
+/* The STREAM kernels, driven by src/streambench.cpp. The host times
+   each kernel from the outside, with one vCPU (stream_kernel) or with
+   several SMP vCPUs (stream_slice), each taking a slice of the arrays.
+   See stream.c for the original benchmark and its rules. */
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef STREAM_ARRAY_SIZE
+#   define STREAM_ARRAY_SIZE 8000000
+#endif
+#define STREAM_TYPE double
+#define MAX_TASKS 64 /* Matches streambench.cpp */
+
+enum { KERNEL_COPY, KERNEL_SCALE, KERNEL_ADD, KERNEL_TRIAD };
+
+static STREAM_TYPE a[STREAM_ARRAY_SIZE];
+static STREAM_TYPE b[STREAM_ARRAY_SIZE];
+static STREAM_TYPE c[STREAM_ARRAY_SIZE];
+
+/* Written by the host before each SMP call */
+struct stream_task {
+	uint32_t kernel;
+	uint32_t slices;
+};
+struct stream_task stream_tasks[MAX_TASKS];
+
+size_t stream_elements()
+{
+	return STREAM_ARRAY_SIZE;
+}
+
+static void run_kernel(unsigned kernel, size_t begin, size_t end)
+{
+	const STREAM_TYPE scalar = 3.0;
+	switch (kernel) {
+	case KERNEL_COPY:
+		for (size_t j = begin; j < end; j++)
+			c[j] = a[j];
+		break;
+	case KERNEL_SCALE:
+		for (size_t j = begin; j < end; j++)
+			b[j] = scalar * c[j];
+		break;
+	case KERNEL_ADD:
+		for (size_t j = begin; j < end; j++)
+			c[j] = a[j] + b[j];
+		break;
+	case KERNEL_TRIAD:
+		for (size_t j = begin; j < end; j++)
+			a[j] = b[j] + scalar * c[j];
+		break;
+	}
+}
+
+void stream_kernel(unsigned kernel)
+{
+	run_kernel(kernel, 0, STREAM_ARRAY_SIZE);
+}
+
+/* timed_smpcall_dynamic(): One slice of the arrays per item */
+void stream_slice(const struct stream_task* task, uint32_t size, uint32_t index)
+{
+	(void)size;
+	const size_t slice = (STREAM_ARRAY_SIZE + task->slices - 1) / task->slices;
+	const size_t begin = index * slice;
+	size_t end = begin + slice;
+	if (end > STREAM_ARRAY_SIZE)
+		end = STREAM_ARRAY_SIZE;
+	if (begin < end)
+		run_kernel(task->kernel, begin, end);
+}
+
+int main()
+{
+	for (size_t j = 0; j < STREAM_ARRAY_SIZE; j++) {
+		a[j] = 1.0;
+		b[j] = 2.0;
+		c[j] = 0.0;
+	}
+	return 0;
+}
@@ -0,0 +1,78 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define MAX_FUZZ_INPUT (64UL << 10) /* Matches fuzz/fuzz.cpp */
+
+/* The fuzzer input is copied here before each call */
+uint8_t fuzz_input[MAX_FUZZ_INPUT];
+
+/* One system call of the input. Arguments with their bit set in
+   pointer_args are offsets into the input, which is also where
+   system calls write their results. */
+struct fuzz_syscall {
+	uint16_t nr;
+	uint8_t  pointer_args;
+	uint8_t  reserved[5];
+	uint64_t args[6];
+};
+
+/* System calls that block until the timeout, which only slows down
+   fuzzing without reaching any new code */
+static int is_blocking(unsigned nr, uint64_t arg0)
+{
+	switch (nr) {
+	case SYS_read:
+	case SYS_readv:
+	case SYS_pread64:
+		return arg0 == 0; /* stdin */
+	case SYS_pause:
+	case SYS_nanosleep:
+	case SYS_clock_nanosleep:
+	case SYS_futex:
+	case SYS_poll:
+	case SYS_ppoll:
+	case SYS_select:
+	case SYS_pselect6:
+	case SYS_epoll_wait:
+	case SYS_epoll_pwait:
+	case SYS_wait4:
+	case SYS_waitid:
+	case SYS_rt_sigsuspend:
+	case SYS_rt_sigtimedwait:
+	case SYS_accept:
+	case SYS_accept4:
+	case SYS_recvfrom:
+	case SYS_recvmsg:
+		return 1;
+	}
+	return 0;
+}
+
+long fuzz_syscalls(size_t len)
+{
+	const size_t count = len / sizeof(struct fuzz_syscall);
+	const struct fuzz_syscall* calls = (const struct fuzz_syscall *)fuzz_input;
+	long result = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		/* Copy the call, as it may be overwritten by system calls */
+		const struct fuzz_syscall call = calls[i];
+		const unsigned nr = call.nr & 0x1FF;
+		uint64_t args[6];
+		for (int a = 0; a < 6; a++) {
+			args[a] = (call.pointer_args & (1 << a))
+				? (uint64_t)&fuzz_input[call.args[a] % MAX_FUZZ_INPUT] : call.args[a];
+		}
+		if (is_blocking(nr, args[0]))
+			continue;
+		result += syscall(nr, args[0], args[1], args[2], args[3], args[4], args[5]);
+	}
+	return result;
+}
+
+int main()
+{
+	return 0;
+}
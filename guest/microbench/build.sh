@@ -0,0 +1,4 @@
+set -e
+CC=${CC:-gcc}
+
+$CC -O2 -static -std=c11 microbench.c -o microbench
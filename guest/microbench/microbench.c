@@ -0,0 +1,47 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define PAGE_SIZE 4096
+#define MAX_PAGES 4096 /* Matches src/microbench.cpp */
+
+/* Touched by main(), so that forks copy-on-write these pages */
+uint8_t cow_pages[MAX_PAGES * PAGE_SIZE];
+/* Never touched by main(), so that forks fault in zeroed pages */
+uint8_t zero_pages[MAX_PAGES * PAGE_SIZE];
+/* Host-side copies and buffer gathering */
+uint8_t buffer[MAX_PAGES * PAGE_SIZE];
+
+long bench_empty()
+{
+	return 0;
+}
+long bench_syscalls(size_t count)
+{
+	long result = 0;
+	for (size_t i = 0; i < count; i++)
+		result += syscall(SYS_getpid);
+	return result;
+}
+static void write_pages(uint8_t* pages, size_t count)
+{
+	for (size_t i = 0; i < count && i < MAX_PAGES; i++)
+		((volatile uint8_t *)pages)[i * PAGE_SIZE] = 2;
+}
+void bench_cow_pages(size_t count)
+{
+	write_pages(cow_pages, count);
+}
+void bench_zero_pages(size_t count)
+{
+	write_pages(zero_pages, count);
+}
+
+int main()
+{
+	memset(cow_pages, 1, sizeof(cow_pages));
+	memset(buffer, 1, sizeof(buffer));
+	return 0;
+}
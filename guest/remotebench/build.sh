@@ -0,0 +1,6 @@
+set -e
+CC=${CC:-gcc}
+
+$CC -O2 -static -std=c11 -Wl,-Ttext-segment=0x40400000 storage.c -o storage
+objcopy -w --extract-symbol --strip-symbol=!remote* --strip-symbol=* storage storage.syms
+$CC -O2 -static -std=c11 -Wl,--just-symbols=storage.syms main.c -o main
@@ -0,0 +1,36 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#define MAX_PAYLOAD (1UL << 20)
+
+uint8_t payload[MAX_PAYLOAD];
+extern uint64_t remote_checksum(const uint8_t* data, size_t len);
+
+/* Resumes the paused storage VM on this vCPU */
+__asm__(".global remote_resume\n"
+	".type remote_resume, @function\n"
+	"remote_resume:\n"
+	"	mov $0x10001, %eax\n"
+	"	out %eax, $0\n"
+	"	ret\n");
+extern uint64_t remote_resume(const uint8_t* data, size_t len);
+
+uint64_t bench_nothing(size_t len)
+{
+	return len;
+}
+/* Calls into remote memory, entering the remote on a page fault */
+uint64_t bench_call(size_t len)
+{
+	return remote_checksum(payload, len);
+}
+uint64_t bench_resume(size_t len)
+{
+	return remote_resume(payload, len);
+}
+
+int main()
+{
+	memset(payload, 1, sizeof(payload));
+	return 0;
+}
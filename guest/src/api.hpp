@@ -14,3 +14,119 @@ extern uint32_t crc32c_sse42(const uint8_t* buffer, size_t len);
 inline uint32_t crc32c_sse42(const char* buffer, size_t len) {
 	return crc32c_sse42((const uint8_t *)buffer, len);
 }
+
+/* Batched system calls, submitted with a single SYSCALL_BATCH system
+   call (see Machine::system_call_batch). The host writes the result
+   into each entry, and advances head past the completed entries. */
+#define KVM_SYSCALL_BATCH  0x1F710
+
+struct kvm_syscall_entry {
+	uint64_t nr;
+	uint64_t args[6];
+	int64_t  result;
+};
+
+template <uint32_t N>
+struct kvm_syscall_batch {
+	static_assert(N != 0 && (N & (N - 1)) == 0, "The number of entries must be a power of two");
+	uint32_t head = 0; /* Next entry for the host to complete */
+	uint32_t tail = 0; /* Next entry for the guest to submit */
+	uint32_t mask = N - 1;
+	uint32_t flags = 0;
+	kvm_syscall_entry entries[N] {};
+
+	/* Queues a system call, and returns its entry (nullptr when full) */
+	kvm_syscall_entry* push(uint64_t nr, uint64_t a0 = 0, uint64_t a1 = 0,
+		uint64_t a2 = 0, uint64_t a3 = 0, uint64_t a4 = 0, uint64_t a5 = 0)
+	{
+		if (tail - head == N)
+			return nullptr;
+		kvm_syscall_entry* e = &entries[tail++ & mask];
+		*e = { nr, { a0, a1, a2, a3, a4, a5 }, 0 };
+		return e;
+	}
+	/* Submits every queued system call in one VM exit,
+	   and returns the number of completed entries */
+	long submit() {
+		return syscall(KVM_SYSCALL_BATCH, this);
+	}
+};
+
+/* Ring channels, mapped in by the host with Machine::map_channel().
+   One VM produces and another consumes (single-producer and
+   single-consumer), and the counters never wrap. */
+struct kvm_channel {
+	uint32_t magic;
+	uint32_t data_offset;
+	uint64_t capacity;
+	alignas(64) uint64_t head; /* Bytes written, only written by the producer */
+	alignas(64) uint64_t tail; /* Bytes read, only written by the consumer */
+};
+
+inline size_t kvm_channel_readable(const kvm_channel* ch) {
+	return __atomic_load_n(&ch->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ch->tail, __ATOMIC_ACQUIRE);
+}
+
+/* Returns the number of bytes written, less than len when full */
+inline size_t kvm_channel_write(kvm_channel* ch, const void* data, size_t len) {
+	char* ring = (char *)ch + ch->data_offset;
+	const uint64_t head = ch->head;
+	const uint64_t tail = __atomic_load_n(&ch->tail, __ATOMIC_ACQUIRE);
+	if (len > ch->capacity - (head - tail))
+		len = ch->capacity - (head - tail);
+	const size_t offset = head % ch->capacity;
+	const size_t first = (len < ch->capacity - offset) ? len : ch->capacity - offset;
+	__builtin_memcpy(ring + offset, data, first);
+	__builtin_memcpy(ring, (const char *)data + first, len - first);
+	__atomic_store_n(&ch->head, head + len, __ATOMIC_RELEASE);
+	return len;
+}
+
+/* Returns the number of bytes read, less than len when empty */
+inline size_t kvm_channel_read(kvm_channel* ch, void* data, size_t len) {
+	const char* ring = (const char *)ch + ch->data_offset;
+	const uint64_t tail = ch->tail;
+	const uint64_t head = __atomic_load_n(&ch->head, __ATOMIC_ACQUIRE);
+	if (len > head - tail)
+		len = head - tail;
+	const size_t offset = tail % ch->capacity;
+	const size_t first = (len < ch->capacity - offset) ? len : ch->capacity - offset;
+	__builtin_memcpy(data, ring + offset, first);
+	__builtin_memcpy((char *)data + first, ring, len - first);
+	__atomic_store_n(&ch->tail, tail + len, __ATOMIC_RELEASE);
+	return len;
+}
+
+/* Versioned data regions, published by the host with SharedData.
+   The data of a version stays intact until the host has published
+   two more versions, so a copy is retried when that happened. */
+struct kvm_shared_data {
+	uint32_t magic;
+	uint32_t slot_offset;
+	uint64_t slot_size;
+	alignas(64) uint64_t version; /* Current slot is version % 2 */
+	uint64_t length[2];
+};
+
+inline uint64_t kvm_shared_data_version(const kvm_shared_data* sd) {
+	return __atomic_load_n(&sd->version, __ATOMIC_ACQUIRE);
+}
+
+/* Copies the current data, and returns its length (at most len).
+   The version of the data is stored in *version, when not null. */
+inline size_t kvm_shared_data_read(const kvm_shared_data* sd, void* data, size_t len, uint64_t* version) {
+	for (;;) {
+		const uint64_t v = __atomic_load_n(&sd->version, __ATOMIC_ACQUIRE);
+		const unsigned idx = v % 2;
+		size_t n = __atomic_load_n(&sd->length[idx], __ATOMIC_RELAXED);
+		if (n > len)
+			n = len;
+		__builtin_memcpy(data, (const char *)sd + sd->slot_offset + idx * sd->slot_size, n);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&sd->version, __ATOMIC_RELAXED) - v < 2) {
+			if (version)
+				*version = v;
+			return n;
+		}
+	}
+}
@@ -5,6 +5,7 @@ dw .vm64_rexit
 dw .vm64_preserving_entry
 dw .vm64_remote_disconnect
 dd .vm64_cpuid
+dw .vm64_chain
 
 ALIGN 0x10
 ;; The entry function, jumps to real function
@@ -57,6 +58,26 @@ ALIGN 0x10
 	pop r11
 	pop rax
 	ret  ;; RAX replaced with return value
+;; The return address of each call in a vmcall chain.
+;; RBX points to the current entry of the chain table,
+;; R12 is the number of calls left and RBP is the stack
+;; pointer of every call. They are all callee-saved.
+;; Entry: [function, rdi, rsi, rdx, rcx, r8, r9, result]
+.vm64_chain:
+	mov [rbx + 56], rax ;; The result of the call that returned
+	add rbx, 64
+	dec r12
+	jz .vm64_rexit
+	mov rsp, rbp
+	lea rax, [rel .vm64_chain]
+	push rax
+	mov rdi, [rbx + 8]
+	mov rsi, [rbx + 16]
+	mov rdx, [rbx + 24]
+	mov rcx, [rbx + 32]
+	mov r8,  [rbx + 40]
+	mov r9,  [rbx + 48]
+	jmp [rbx]
 
 %macro  vcputable 1 
 	dd %1
@@ -0,0 +1,134 @@
+/* A minimal vDSO for TinyKVM guests: time functions that read the
+   KVM clock pages of the guest kernel without leaving user mode. */
+#include <stdint.h>
+
+#define VVAR_AREA 0xFFFFFFFFFF601000UL /* Read-only copy of the KVM clock */
+
+struct kvm_wall_clock {
+	uint32_t version;
+	uint32_t sec;
+	uint32_t nsec;
+};
+struct kvm_system_time {
+	uint32_t version;
+	uint32_t pad0;
+	uint64_t tsc_timestamp;
+	uint64_t system_time;
+	uint32_t tsc_to_system_mul;
+	int8_t   tsc_shift;
+	uint8_t  flags;
+	uint8_t  pad[2];
+};
+struct timespec64 {
+	int64_t tv_sec;
+	int64_t tv_nsec;
+};
+struct timeval64 {
+	int64_t tv_sec;
+	int64_t tv_usec;
+};
+
+#define vvar_wall_clock  ((const volatile struct kvm_wall_clock*)(VVAR_AREA + 0x10))
+#define vvar_system_time ((const volatile struct kvm_system_time*)(VVAR_AREA + 0x20))
+
+static inline long vdso_syscall2(long n, long a0, long a1)
+{
+	long ret;
+	asm volatile ("syscall" : "=a"(ret) : "a"(n), "D"(a0), "S"(a1) : "rcx", "r11", "memory");
+	return ret;
+}
+static inline uint64_t rdtsc_ordered(void)
+{
+	uint32_t lo, hi;
+	asm volatile ("lfence; rdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/* Returns 0 when the clock has not been set up yet */
+static int read_kvm_clock(uint64_t* ns, int realtime)
+{
+	uint32_t version;
+	uint64_t time;
+	do {
+		version = vvar_system_time->version;
+		if (version == 0)
+			return 0;
+		asm volatile ("" ::: "memory");
+		uint64_t delta = rdtsc_ordered() - vvar_system_time->tsc_timestamp;
+		const int8_t shift = vvar_system_time->tsc_shift;
+		if (shift >= 0)
+			delta <<= shift;
+		else
+			delta >>= -shift;
+		time = (uint64_t)(((unsigned __int128)delta * vvar_system_time->tsc_to_system_mul) >> 32);
+		time += vvar_system_time->system_time;
+		asm volatile ("" ::: "memory");
+	} while ((version & 1) != 0 || version != vvar_system_time->version);
+
+	if (realtime) {
+		const uint32_t sec = vvar_wall_clock->sec;
+		if (sec == 0)
+			return 0;
+		time += (uint64_t)sec * 1000000000UL + vvar_wall_clock->nsec;
+	}
+	*ns = time;
+	return 1;
+}
+
+int __vdso_clock_gettime(long clock, struct timespec64* ts)
+{
+	int realtime;
+	switch (clock) {
+	case 0: /* CLOCK_REALTIME */
+	case 5: /* CLOCK_REALTIME_COARSE */
+		realtime = 1;
+		break;
+	case 1: /* CLOCK_MONOTONIC */
+	case 4: /* CLOCK_MONOTONIC_RAW */
+	case 6: /* CLOCK_MONOTONIC_COARSE */
+	case 7: /* CLOCK_BOOTTIME */
+		realtime = 0;
+		break;
+	default:
+		return vdso_syscall2(228, clock, (long)ts);
+	}
+	uint64_t ns;
+	if (!read_kvm_clock(&ns, realtime))
+		return vdso_syscall2(228, clock, (long)ts);
+	ts->tv_sec  = ns / 1000000000UL;
+	ts->tv_nsec = ns % 1000000000UL;
+	return 0;
+}
+
+int __vdso_gettimeofday(struct timeval64* tv, void* tz)
+{
+	uint64_t ns;
+	if (!read_kvm_clock(&ns, 1))
+		return vdso_syscall2(96, (long)tv, (long)tz);
+	if (tv) {
+		tv->tv_sec  = ns / 1000000000UL;
+		tv->tv_usec = (ns % 1000000000UL) / 1000;
+	}
+	if (tz) {
+		((int *)tz)[0] = 0;
+		((int *)tz)[1] = 0;
+	}
+	return 0;
+}
+
+long __vdso_time(long* t)
+{
+	uint64_t ns;
+	long result;
+	if (read_kvm_clock(&ns, 1))
+		result = ns / 1000000000UL;
+	else
+		result = vdso_syscall2(201, 0, 0);
+	if (t)
+		*t = result;
+	return result;
+}
+
+int clock_gettime(long, struct timespec64*) __attribute__((weak, alias("__vdso_clock_gettime")));
+int gettimeofday(struct timeval64*, void*) __attribute__((weak, alias("__vdso_gettimeofday")));
+long time(long*) __attribute__((weak, alias("__vdso_time")));
@@ -0,0 +1,5 @@
+gcc -O2 -fPIC -fno-stack-protector -fno-asynchronous-unwind-tables -fno-builtin \
+	-nostdlib -shared -Wl,-T,vdso.lds -Wl,--hash-style=both -Wl,--build-id=none \
+	-Wl,-soname=linux-vdso.so.1 -Wl,-Bsymbolic -o vdso.so vdso.c
+strip --strip-unneeded vdso.so
+xxd -i vdso.so > vdso_image.h
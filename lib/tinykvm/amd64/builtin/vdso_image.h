@@ -0,0 +1,188 @@
+unsigned char vdso_so[] = {
+  0x7f, 0x45, 0x4c, 0x46, 0x02, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x03, 0x00, 0x3e, 0x00, 0x01, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x28, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x40, 0x00, 0x38, 0x00, 0x02, 0x00, 0x40, 0x00,
+  0x0a, 0x00, 0x09, 0x00, 0x01, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0xd6, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xd6, 0x05, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x02, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x80, 0x02, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x80, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x80, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20, 0x01, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x20, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00,
+  0x08, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00,
+  0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00,
+  0x01, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+  0x01, 0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00, 0x81, 0x34, 0x30, 0x01,
+  0x04, 0x45, 0x00, 0x81, 0x01, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00,
+  0x07, 0x00, 0x00, 0x00, 0x7e, 0x55, 0xdd, 0x71, 0x00, 0xca, 0x1b, 0xb0,
+  0x86, 0x4b, 0x85, 0xe6, 0x0d, 0x8e, 0x1e, 0x82, 0x94, 0x78, 0x9e, 0x7c,
+  0x19, 0xa3, 0x43, 0x6e, 0x8b, 0x2a, 0xc6, 0x26, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00,
+  0x22, 0x00, 0x08, 0x00, 0x50, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x8b, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x16, 0x00, 0x00, 0x00,
+  0x12, 0x00, 0x08, 0x00, 0xe0, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x93, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1d, 0x00, 0x00, 0x00,
+  0x22, 0x00, 0x08, 0x00, 0xe0, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x93, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x2a, 0x00, 0x00, 0x00,
+  0x12, 0x00, 0x08, 0x00, 0x80, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x56, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x31, 0x00, 0x00, 0x00,
+  0x22, 0x00, 0x08, 0x00, 0x80, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x56, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+  0x12, 0x00, 0x08, 0x00, 0x50, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x8b, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46, 0x00, 0x00, 0x00,
+  0x11, 0x00, 0xf1, 0xff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x5f, 0x5f, 0x76,
+  0x64, 0x73, 0x6f, 0x5f, 0x63, 0x6c, 0x6f, 0x63, 0x6b, 0x5f, 0x67, 0x65,
+  0x74, 0x74, 0x69, 0x6d, 0x65, 0x00, 0x5f, 0x5f, 0x76, 0x64, 0x73, 0x6f,
+  0x5f, 0x67, 0x65, 0x74, 0x74, 0x69, 0x6d, 0x65, 0x6f, 0x66, 0x64, 0x61,
+  0x79, 0x00, 0x5f, 0x5f, 0x76, 0x64, 0x73, 0x6f, 0x5f, 0x74, 0x69, 0x6d,
+  0x65, 0x00, 0x6c, 0x69, 0x6e, 0x75, 0x78, 0x2d, 0x76, 0x64, 0x73, 0x6f,
+  0x2e, 0x73, 0x6f, 0x2e, 0x31, 0x00, 0x4c, 0x49, 0x4e, 0x55, 0x58, 0x5f,
+  0x32, 0x2e, 0x36, 0x00, 0x00, 0x00, 0x02, 0x00, 0x02, 0x00, 0x02, 0x00,
+  0x02, 0x00, 0x02, 0x00, 0x02, 0x00, 0x02, 0x00, 0x01, 0x00, 0x01, 0x00,
+  0x01, 0x00, 0x01, 0x00, 0xa1, 0xbf, 0xee, 0x0d, 0x14, 0x00, 0x00, 0x00,
+  0x1c, 0x00, 0x00, 0x00, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x01, 0x00, 0x00, 0x00, 0x02, 0x00, 0x01, 0x00, 0xf6, 0x75, 0xae, 0x03,
+  0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x0e, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xb0, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0xf5, 0xfe, 0xff, 0x6f, 0x00, 0x00, 0x00, 0x00,
+  0xe8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0xe8, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x28, 0x01, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x50, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0b, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0xfc, 0xff, 0xff, 0x6f, 0x00, 0x00, 0x00, 0x00, 0x48, 0x02, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0xfd, 0xff, 0xff, 0x6f, 0x00, 0x00, 0x00, 0x00,
+  0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1e, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0xf0, 0xff, 0xff, 0x6f, 0x00, 0x00, 0x00, 0x00, 0x38, 0x02, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x41, 0x89, 0xf0, 0x0f, 0x1f, 0x44, 0x00, 0x00,
+  0x8b, 0x34, 0x25, 0x20, 0x10, 0x60, 0xff, 0x85, 0xf6, 0x0f, 0x84, 0x91,
+  0x00, 0x00, 0x00, 0x0f, 0xae, 0xe8, 0x0f, 0x31, 0x48, 0x8b, 0x0c, 0x25,
+  0x28, 0x10, 0x60, 0xff, 0x48, 0xc1, 0xe2, 0x20, 0x89, 0xc0, 0x48, 0x09,
+  0xc2, 0x0f, 0xb6, 0x04, 0x25, 0x3c, 0x10, 0x60, 0xff, 0x48, 0x29, 0xca,
+  0x49, 0x89, 0xd1, 0x89, 0xc1, 0x49, 0xd3, 0xe1, 0xf7, 0xd9, 0x48, 0xd3,
+  0xea, 0x84, 0xc0, 0x8b, 0x04, 0x25, 0x38, 0x10, 0x60, 0xff, 0x48, 0x8b,
+  0x0c, 0x25, 0x30, 0x10, 0x60, 0xff, 0x49, 0x0f, 0x49, 0xd1, 0x40, 0xf6,
+  0xc6, 0x01, 0x75, 0xa8, 0x44, 0x8b, 0x0c, 0x25, 0x20, 0x10, 0x60, 0xff,
+  0x41, 0x39, 0xf1, 0x75, 0x9b, 0x48, 0xf7, 0xe2, 0x48, 0x0f, 0xac, 0xd0,
+  0x20, 0x48, 0x01, 0xc8, 0x45, 0x85, 0xc0, 0x74, 0x1f, 0x8b, 0x14, 0x25,
+  0x14, 0x10, 0x60, 0xff, 0x85, 0xd2, 0x74, 0x20, 0x48, 0x69, 0xd2, 0x00,
+  0xca, 0x9a, 0x3b, 0x8b, 0x0c, 0x25, 0x18, 0x10, 0x60, 0xff, 0x48, 0x01,
+  0xca, 0x48, 0x01, 0xd0, 0x48, 0x89, 0x07, 0xb8, 0x01, 0x00, 0x00, 0x00,
+  0xc3, 0x0f, 0x1f, 0x00, 0x31, 0xc0, 0xc3, 0x0f, 0x1f, 0x44, 0x00, 0x00,
+  0x53, 0x49, 0x89, 0xfa, 0x48, 0x89, 0xf3, 0x48, 0x83, 0xec, 0x10, 0x48,
+  0x83, 0xff, 0x07, 0x77, 0x57, 0xb8, 0x01, 0x00, 0x00, 0x00, 0x89, 0xf9,
+  0x48, 0xd3, 0xe0, 0xa8, 0xd2, 0x74, 0x61, 0x31, 0xf6, 0x48, 0x8d, 0x7c,
+  0x24, 0x08, 0xe8, 0x25, 0xff, 0xff, 0xff, 0x85, 0xc0, 0x74, 0x39, 0x48,
+  0xb8, 0x53, 0x5a, 0x9b, 0xa0, 0x2f, 0xb8, 0x44, 0x00, 0x48, 0x8b, 0x4c,
+  0x24, 0x08, 0x48, 0x89, 0xca, 0x48, 0xc1, 0xea, 0x09, 0x48, 0xf7, 0xe2,
+  0x31, 0xc0, 0x48, 0xc1, 0xea, 0x0b, 0x48, 0x89, 0x13, 0x48, 0x69, 0xd2,
+  0x00, 0xca, 0x9a, 0x3b, 0x48, 0x29, 0xd1, 0x48, 0x89, 0x4b, 0x08, 0x48,
+  0x83, 0xc4, 0x10, 0x5b, 0xc3, 0x0f, 0x1f, 0x00, 0xb8, 0xe4, 0x00, 0x00,
+  0x00, 0x4c, 0x89, 0xd7, 0x48, 0x89, 0xde, 0x0f, 0x05, 0x48, 0x83, 0xc4,
+  0x10, 0x5b, 0xc3, 0x0f, 0x1f, 0x44, 0x00, 0x00, 0xa8, 0x21, 0x74, 0xe4,
+  0xbe, 0x01, 0x00, 0x00, 0x00, 0xeb, 0x96, 0x0f, 0x1f, 0x44, 0x00, 0x00,
+  0x53, 0x49, 0x89, 0xfa, 0x48, 0x89, 0xf3, 0xbe, 0x01, 0x00, 0x00, 0x00,
+  0x48, 0x83, 0xec, 0x10, 0x48, 0x8d, 0x7c, 0x24, 0x08, 0xe8, 0xa6, 0xfe,
+  0xff, 0xff, 0x85, 0xc0, 0x74, 0x62, 0x4d, 0x85, 0xd2, 0x74, 0x43, 0x48,
+  0xb8, 0x53, 0x5a, 0x9b, 0xa0, 0x2f, 0xb8, 0x44, 0x00, 0x48, 0x8b, 0x4c,
+  0x24, 0x08, 0x48, 0x89, 0xca, 0x48, 0xc1, 0xea, 0x09, 0x48, 0xf7, 0xe2,
+  0x48, 0xb8, 0xcf, 0xf7, 0x53, 0xe3, 0xa5, 0x9b, 0xc4, 0x20, 0x48, 0xc1,
+  0xea, 0x0b, 0x49, 0x89, 0x12, 0x48, 0x69, 0xd2, 0x00, 0xca, 0x9a, 0x3b,
+  0x48, 0x29, 0xd1, 0x48, 0xc1, 0xe9, 0x03, 0x48, 0xf7, 0xe1, 0x48, 0xc1,
+  0xea, 0x04, 0x49, 0x89, 0x52, 0x08, 0x48, 0x85, 0xdb, 0x74, 0x07, 0x48,
+  0xc7, 0x03, 0x00, 0x00, 0x00, 0x00, 0x48, 0x83, 0xc4, 0x10, 0x31, 0xc0,
+  0x5b, 0xc3, 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00, 0xb8, 0x60, 0x00, 0x00,
+  0x00, 0x4c, 0x89, 0xd7, 0x48, 0x89, 0xde, 0x0f, 0x05, 0x48, 0x83, 0xc4,
+  0x10, 0x5b, 0xc3, 0x66, 0x66, 0x2e, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x66, 0x90, 0x48, 0x83, 0xec, 0x18, 0x49, 0x89, 0xfa, 0xbe,
+  0x01, 0x00, 0x00, 0x00, 0x48, 0x8d, 0x7c, 0x24, 0x08, 0xe8, 0x0a, 0xfe,
+  0xff, 0xff, 0x85, 0xc0, 0x74, 0x2e, 0x48, 0xba, 0x53, 0x5a, 0x9b, 0xa0,
+  0x2f, 0xb8, 0x44, 0x00, 0x48, 0x8b, 0x44, 0x24, 0x08, 0x48, 0xc1, 0xe8,
+  0x09, 0x48, 0xf7, 0xe2, 0x48, 0x89, 0xd0, 0x48, 0xc1, 0xe8, 0x0b, 0x4d,
+  0x85, 0xd2, 0x74, 0x03, 0x49, 0x89, 0x02, 0x48, 0x83, 0xc4, 0x18, 0xc3,
+  0x0f, 0x1f, 0x40, 0x00, 0x31, 0xf6, 0xb8, 0xc9, 0x00, 0x00, 0x00, 0x48,
+  0x89, 0xf7, 0x0f, 0x05, 0xeb, 0xe1, 0x00, 0x2e, 0x73, 0x68, 0x73, 0x74,
+  0x72, 0x74, 0x61, 0x62, 0x00, 0x2e, 0x67, 0x6e, 0x75, 0x2e, 0x68, 0x61,
+  0x73, 0x68, 0x00, 0x2e, 0x64, 0x79, 0x6e, 0x73, 0x79, 0x6d, 0x00, 0x2e,
+  0x64, 0x79, 0x6e, 0x73, 0x74, 0x72, 0x00, 0x2e, 0x67, 0x6e, 0x75, 0x2e,
+  0x76, 0x65, 0x72, 0x73, 0x69, 0x6f, 0x6e, 0x00, 0x2e, 0x67, 0x6e, 0x75,
+  0x2e, 0x76, 0x65, 0x72, 0x73, 0x69, 0x6f, 0x6e, 0x5f, 0x64, 0x00, 0x2e,
+  0x64, 0x79, 0x6e, 0x61, 0x6d, 0x69, 0x63, 0x00, 0x2e, 0x74, 0x65, 0x78,
+  0x74, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00,
+  0x05, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0xb0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xb0, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x34, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x0b, 0x00, 0x00, 0x00, 0xf6, 0xff, 0xff, 0x6f, 0x02, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0xe8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0xe8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x15, 0x00, 0x00, 0x00, 0x0b, 0x00, 0x00, 0x00,
+  0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x28, 0x01, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x28, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0xc0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00,
+  0x01, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x18, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1d, 0x00, 0x00, 0x00,
+  0x03, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0xe8, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xe8, 0x01, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x50, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x25, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0x6f, 0x02, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x38, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x38, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x32, 0x00, 0x00, 0x00, 0xfd, 0xff, 0xff, 0x6f,
+  0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x48, 0x02, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x48, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x38, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00,
+  0x02, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x41, 0x00, 0x00, 0x00,
+  0x06, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x80, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x02, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x20, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x4a, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0xa0, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0xa0, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x36, 0x02, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0xd6, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x50, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+unsigned int vdso_so_len = 2216;
@@ -2,6 +2,11 @@
 #define AMD64_MSR_APICBASE       0x1B
 #define AMD64_MSR_XAPIC_ENABLE   0x800
 #define AMD64_MSR_X2APIC_ENABLE  0xC00
+#define AMD64_MSR_TSC            0x10
+#define AMD64_MSR_TSC_DEADLINE   0x6E0
+#define AMD64_MSR_X2APIC_EOI     0x80B
+
+#define AMD64_LAPIC_TIMER_VECTOR 32
 
 #define AMD64_APIC_MODE_EXTINT   0x7
 #define AMD64_APIC_MODE_NMI      0x4
@@ -6,9 +6,11 @@
 #include "../machine.hpp"
 #include "../page_streaming.hpp"
 #include "../util/elf.h"
+#include <atomic>
 #include <cassert>
 #include <cstring>
 #include <stdexcept>
+#include <thread>
 //#define KVM_VERBOSE_PAGETABLES
 
 #ifdef KVM_VERBOSE_PAGETABLES
@@ -17,6 +19,10 @@
 #define CLPRINT(...) /* ... */
 #endif
 #define PDE64_CLONEABLE  (1ul << 11)
+/* A gigapage of identity-mapped memory whose page directory has not
+   been filled in yet. The entry is not present, and holds the address
+   of the page directory, which is filled in on first use. */
+#define PDE64_LAZY       (1ul << 10)
 
 namespace tinykvm {
 
@@ -24,6 +30,9 @@ namespace tinykvm {
 static constexpr uint64_t PDE64_ADDR_MASK = ~0x8000000000000FFF;
 static constexpr uint64_t PDE64_CLONED_MASK = 0x8000000000000FFF & ~(PDE64_CLONEABLE | PDE64_G);
 static constexpr uint64_t PDE64_PD_SPLIT_MASK = 0x8000000000000FFF & ~(PDE64_RW | PDE64_CLONEABLE | PDE64_G);
+/* The permissions of a leaf page, which the guest can change (eg. mprotect) */
+static constexpr uint64_t PDE64_LEAF_PERM_MASK = PDE64_RW | PDE64_USER | PDE64_NX
+	| PDE64_WRITE_THROUGH | PDE64_CACHE_DISABLE;
 
 __attribute__((cold, noinline, noreturn))
 static void memory_exception(const char*, uint64_t addr, uint64_t sz);
@@ -42,6 +51,12 @@ inline ptentry_pair pte_from_index(size_t i, uint64_t pt_base, uint64_t* pt) {
 	return {pt_base | (i << 12), pt[i] & PDE64_ADDR_MASK, 1ul << 12};
 }
 
+inline bool is_copy_on_write(uint64_t entry) {
+	/* Copy this page if it's marked cloneable
+	   and it's not already writable. */
+	return (entry & (PDE64_CLONEABLE | PDE64_RW)) == PDE64_CLONEABLE;
+}
+
 inline uint64_t index_from_pdpt_entry(uint64_t addr) {
 	return (addr >> 30) & 511;
 }
@@ -56,6 +71,27 @@ inline bool is_flagged_page(uint64_t flags, uint64_t entry) {
 	return (entry & flags) == flags;
 }
 
+/* Identity-map a gigapage with 2MB user pages, from the @first entry */
+static void fill_identity_pd(const vMemory& memory, uint64_t* pd, uint64_t giga_page, size_t first)
+{
+	uint64_t flags = PDE64_PRESENT | PDE64_PS | PDE64_USER | PDE64_RW;
+	if (!memory.executable_heap)
+		flags |= PDE64_NX;
+	const uint64_t base = flags | (giga_page << 30);
+	for (size_t i = first; i < 512; i++)
+		pd[i] = base | (i << 21);
+}
+static bool populate_lazy_gigapage(const vMemory& memory, uint64_t& pdpt_entry, uint64_t giga_page)
+{
+	if ((pdpt_entry & (PDE64_PRESENT | PDE64_LAZY)) != PDE64_LAZY)
+		return false;
+	const uint64_t pd_addr = pdpt_entry & PDE64_ADDR_MASK;
+	fill_identity_pd(memory, memory.page_at(pd_addr), giga_page, 0);
+	pdpt_entry = PDE64_PRESENT | PDE64_USER | PDE64_RW | pd_addr;
+	memory.remote_must_update_gigapages = true;
+	return true;
+}
+
 static void add_remappings(vMemory& memory,
 	const VirtualRemapping& remapping,
 	uint64_t* pml4,
@@ -95,6 +131,8 @@ static void add_remappings(vMemory& memory,
 	for (uint64_t n_pd = 0; n_pd < n_pd_pages; n_pd++)
 	{
 		const bool last_pd = (n_pd == n_pd_pages - 1);
+		// Remapping over lazily mapped memory
+		populate_lazy_gigapage(memory, pdpt[virt_giga_page], (virt_tera_page << 9) | virt_giga_page);
 		// Allocate the gigapage with 512x 2MB entries
 		if (pdpt[virt_giga_page] == 0) {
 			const auto giga_page = free_page;
@@ -138,7 +176,7 @@ static void add_remappings(vMemory& memory,
 uint64_t setup_amd64_paging(vMemory& memory,
 	std::string_view binary,
 	const std::vector<VirtualRemapping>& remappings,
-	bool split_hugepages)
+	bool split_hugepages, bool vdso, bool lazy)
 {
 	static constexpr uint64_t PD_MASK = (1ULL << 30) - 1;
 	const size_t PD_PAGES = (memory.size + PD_MASK) >> 30;
@@ -175,10 +213,34 @@ uint64_t setup_amd64_paging(vMemory& memory,
 	pml4[511] = PDE64_PRESENT | PDE64_USER | vdso_pdpt_addr;
 
 	const auto base_giga_page = (memory.physbase >> 30UL) & 511;
+	/* With lazy page tables, only the first gigapage and the ones with
+	   ELF segments are filled in now. The rest are filled in when first
+	   used, see populate_lazy_gigapage(). */
+	std::vector<bool> eager(PD_PAGES, !lazy);
+	eager.at(0) = true;
+	if (lazy && !binary.empty())
+	{
+		const auto* elf = (Elf64_Ehdr*) binary.data();
+		const auto* phdr = (Elf64_Phdr*) (binary.data() + elf->e_phoff);
+		for (const auto* hdr = phdr; hdr < phdr + elf->e_phnum; hdr++)
+		{
+			if (hdr->p_type != PT_LOAD || hdr->p_filesz == 0)
+				continue;
+			const uint64_t begin = memory.machine.image_base() + hdr->p_vaddr;
+			const uint64_t end = begin + hdr->p_filesz;
+			for (uint64_t giga = begin >> 30; giga <= ((end - 1) >> 30); giga++) {
+				if (giga >= base_giga_page && giga - base_giga_page < PD_PAGES)
+					eager.at(giga - base_giga_page) = true;
+			}
+		}
+	}
 	for (size_t n_pd = 0; n_pd < PD_PAGES; n_pd++)
 	{
 		auto& pdpt_entry = pdpt[base_giga_page+n_pd];
-		pdpt_entry = PDE64_PRESENT | PDE64_USER | PDE64_RW | pdpage_addr.at(n_pd);
+		if (eager[n_pd])
+			pdpt_entry = PDE64_PRESENT | PDE64_USER | PDE64_RW | pdpage_addr.at(n_pd);
+		else
+			pdpt_entry = PDE64_LAZY | pdpage_addr.at(n_pd);
 
 		// If this is not the first 1GB page, and there is >= 1GB left,
 		// treat this as a leaf 1GB page by setting the PS bit.
@@ -226,12 +288,10 @@ uint64_t setup_amd64_paging(vMemory& memory,
 	// Covers 1GB pages with 512x 2MB user-read-write entries
 	// NOTE: Even with executable heap, the ELF loader will still correctly
 	// apply the NX-bit to its own segments.
-	uint64_t heap_flags = PDE64_USER | PDE64_RW;
-	if (!memory.executable_heap)
-		heap_flags |= PDE64_NX;
-	for (uint64_t i = base_2mb_page+2; i < 512*PD_PAGES; i++) {
-		pd[i] = PDE64_PRESENT | PDE64_PS | heap_flags
-			| ((base_giga_page << 30) + (i << 21));
+	for (size_t n_pd = 0; n_pd < PD_PAGES; n_pd++) {
+		if (eager[n_pd])
+			fill_identity_pd(memory, &pd[n_pd * 512], base_giga_page + n_pd,
+				(n_pd == 0) ? base_2mb_page+2 : 0);
 	}
 
 	/* ELF executable area */
@@ -349,6 +409,20 @@ uint64_t setup_amd64_paging(vMemory& memory,
 	vdso_pdpt[511] = PDE64_PRESENT | PDE64_USER | PDE64_G | vsyscall_pd_addr;
 	vsyscall_pd[507] = PDE64_PRESENT | PDE64_USER | PDE64_G | vsyscall_pt_addr;
 	vsyscall_pt[0] = PDE64_PRESENT | PDE64_USER | PDE64_G | (memory.physbase + VSYS_ADDR);
+	if (vdso) {
+		// Read-only copy of the KVM clock, followed by the vDSO image
+		const auto image = vdso_image();
+		vsyscall_pt[(VDSO_VVAR_AREA >> 12) & 511] = PDE64_PRESENT | PDE64_USER | PDE64_G | PDE64_NX
+			| free_page;
+		free_page += 0x1000;
+		for (size_t off = 0; off < image.size(); off += PAGE_SIZE) {
+			const size_t len = std::min(image.size() - off, size_t(PAGE_SIZE));
+			std::memcpy(memory.at(free_page, PAGE_SIZE), image.data() + off, len);
+			vsyscall_pt[((VDSO_AREA + off) >> 12) & 511] =
+				PDE64_PRESENT | PDE64_USER | PDE64_G | free_page;
+			free_page += 0x1000;
+		}
+	}
 
 	/* Kernel area ~64KB */
 	const size_t kernel_begin_idx = PT_ADDR >> 12;
@@ -375,6 +449,66 @@ uint64_t setup_amd64_paging(vMemory& memory,
 	return free_page;
 }
 
+size_t populate_lazy_gigapages(vMemory& memory)
+{
+	auto* pml4 = memory.page_at(memory.page_tables);
+	if (!(pml4[0] & PDE64_PRESENT))
+		return 0;
+	auto* pdpt = memory.page_at(pml4[0] & PDE64_ADDR_MASK);
+	size_t populated = 0;
+	for (uint64_t j = 0; j < 512; j++)
+		populated += populate_lazy_gigapage(memory, pdpt[j], j);
+	return populated;
+}
+
+size_t merge_identity_gigapages(vMemory& memory, uint64_t begin, uint64_t end)
+{
+	/* Flags that may differ between the 2MB pages of a gigapage */
+	static constexpr uint64_t MERGE_IGNORED = PDE64_ACCESSED | PDE64_DIRTY | PDE64_G;
+	begin = std::max(begin, memory.physbase);
+	end = std::min(end, memory.physbase + memory.size);
+	auto* pml4 = memory.page_at(memory.page_tables);
+	size_t merged = 0;
+	for (uint64_t giga = (begin + PDE64_PD_SIZE - 1) & ~(PDE64_PD_SIZE - 1);
+		giga + PDE64_PD_SIZE <= end; giga += PDE64_PD_SIZE)
+	{
+		const uint64_t i = (giga >> 39) & 511;
+		if (!(pml4[i] & PDE64_PRESENT))
+			continue;
+		auto* pdpt = memory.page_at(pml4[i] & PDE64_ADDR_MASK);
+		const uint64_t j = index_from_pdpt_entry(giga);
+		populate_lazy_gigapage(memory, pdpt[j], giga >> 30);
+		if ((pdpt[j] & (PDE64_PRESENT | PDE64_PS)) != PDE64_PRESENT)
+			continue;
+		/* Every 2MB page must be an identity-mapped leaf with the same flags */
+		auto* pd = memory.page_at(pdpt[j] & PDE64_ADDR_MASK);
+		const uint64_t flags = pd[0] & ~PDE64_ADDR_MASK & ~MERGE_IGNORED;
+		uint64_t dirty = 0;
+		uint64_t k = 0;
+		for (; k < 512; k++) {
+			if ((pd[k] & PDE64_ADDR_MASK) != giga + (k << 21)
+				|| (pd[k] & ~PDE64_ADDR_MASK & ~MERGE_IGNORED) != flags)
+				break;
+			dirty |= pd[k] & PDE64_DIRTY;
+		}
+		if (k != 512 || (flags & (PDE64_PRESENT | PDE64_PS)) != (PDE64_PRESENT | PDE64_PS))
+			continue;
+		/* The page directory entry restricts the whole gigapage */
+		uint64_t leaf = giga | flags | dirty | (pdpt[j] & PDE64_NX);
+		if (!(pdpt[j] & PDE64_RW))
+			leaf &= ~PDE64_RW;
+		if (!(pdpt[j] & PDE64_USER))
+			leaf &= ~PDE64_USER;
+		pdpt[j] = leaf;
+		merged++;
+	}
+	if (merged != 0) {
+		memory.remote_must_update_gigapages = true;
+		memory.invalidate_tlb();
+	}
+	return merged;
+}
+
 static const char* pagetag_cloneable_and_global(uint64_t entry)
 {
 	if (entry & PDE64_CLONEABLE) {
@@ -446,12 +580,16 @@ static void print_pdpt(const vMemory& memory, uint64_t pdpt_base, uint64_t pdpt_
 	for (uint64_t i = 0; i < 512; i++) {
 		if (pdpt[i] & PDE64_PRESENT) {
 			uint64_t addr = pdpt_base + (i << 30);
-			printf("|-* 1GB PDPT (0x%lX): 0x%lX  W=%lu  E=%d  %s  %s\n",
-				addr, pdpt[i] & ~0xFFF,
+			const bool is_leaf = (pdpt[i] & PDE64_PS) != 0;
+			printf("|-* 1GB PDPT (0x%lX): 0x%lX  W=%lu  E=%d  %s  %s%s\n",
+				addr, pdpt[i] & PDE64_ADDR_MASK,
 				pdpt[i] & PDE64_RW, !(pdpt[i] & PDE64_NX),
 				(pdpt[i] & PDE64_USER) ? "USER" : "KERNEL",
-				pagetag_cloneable_and_global(pdpt[i]));
-			print_pd(memory, addr, pdpt[i] & ~0xFFF);
+				pagetag_cloneable_and_global(pdpt[i]),
+				is_leaf ? leaf_pagetable_bits(pdpt[i]) : "");
+			if (!is_leaf) {
+				print_pd(memory, addr, pdpt[i] & PDE64_ADDR_MASK);
+			}
 		}
 	}
 }
@@ -521,32 +659,201 @@ void foreach_page(vMemory& memory, foreach_page_t callback, bool skip_oob_addres
 			} // j
 		}
 	} // i
+	/* The callback may have changed any entry */
+	memory.invalidate_tlb();
 } // foreach_page
 void foreach_page(const vMemory& mem, foreach_page_t callback, bool skip_oob_addresses)
 {
 	foreach_page(const_cast<vMemory&>(mem), std::move(callback), skip_oob_addresses);
 }
 
-void foreach_page_makecow(vMemory& mem, uint64_t kernel_end, uint64_t shared_memory_boundary)
+size_t foreach_page_makecow(vMemory& mem, uint64_t kernel_end, uint64_t shared_memory_boundary,
+	unsigned threads, bool incremental)
 {
 	if (UNLIKELY(shared_memory_boundary < kernel_end)) {
 		memory_exception("Shared memory boundary was illegal (zero)", shared_memory_boundary, 0u);
 	}
-	foreach_page(mem,
-	[=] (uint64_t addr, uint64_t& entry, size_t /*size*/) {
-		if (addr < shared_memory_boundary) {
+	/* Protects an entry, and returns true when the entries below it
+	   must be visited as well. After a complete walk every entry below
+	   the boundary is read-only and not accessed, so a subtree that has
+	   neither been made writable nor been walked by the CPU since
+	   can be skipped in incremental mode. */
+	/* Host memory that is owned elsewhere, eg. by a Channel, is shared
+	   with the forks, so its pages are left writable. */
+	std::vector<std::pair<uint64_t, uint64_t>> external;
+	for (const auto& range : mem.mmap_ranges) {
+		if (range.external)
+			external.emplace_back(range.physbase, range.physbase + range.size);
+	}
+	auto is_external = [&external] (uint64_t entry) {
+		const uint64_t phys = entry & PDE64_ADDR_MASK;
+		for (const auto& [begin, end] : external) {
+			if (phys >= begin && phys < end)
+				return true;
+		}
+		return false;
+	};
+	auto makecow = [&] (uint64_t addr, uint64_t& entry, bool leaf) -> bool {
+		bool touched = (entry & PDE64_ACCESSED) != 0;
+		if (addr < shared_memory_boundary && !(leaf && is_external(entry))) {
 			const uint64_t flags = (PDE64_PRESENT | PDE64_RW);
 			if ((entry & flags) == flags) {
 				entry &= ~PDE64_RW;
 				entry |= PDE64_CLONEABLE | PDE64_G; // Global bit for read-only pages
+				touched = true;
 			}
 		}
 		// Clear accessed bit for *all* pages
 		// Doing this makes it possible to send a dummy request to estimate which
 		// pages are needed after a fork, for use with MAP_POPULATE-like optimizations.
 		entry &= ~PDE64_ACCESSED;
-	});
+		return touched || !incremental;
+	};
+	const uint64_t oob = mem.physbase + mem.size;
+
+	/* The upper levels are protected here, gathering each page
+	   directory (1GB of address space) as a separate unit of work. */
+	struct Subtree {
+		uint64_t  base;
+		uint64_t* pd;
+	};
+	std::vector<Subtree> subtrees;
+	size_t visited = 0;
+	auto* pml4 = mem.page_at(mem.page_tables);
+	for (size_t i = 0; i < 512; i++)
+	{
+		if (!(pml4[i] & PDE64_PRESENT))
+			continue;
+		const auto [pdpt_base, pdpt_mem, pdpt_size] = pdpt_from_index(i, pml4);
+		visited++;
+		/* A usable master runs on a copy of the PML4, and writes through
+		   it change the entries below in place. Always visit the PDPTs. */
+		makecow(pdpt_base, pml4[i], false);
+		if (pdpt_mem >= oob)
+			continue;
+		auto* pdpt = mem.page_at(pdpt_mem);
+		for (uint64_t j = 0; j < 512; j++)
+		{
+			if (!(pdpt[j] & PDE64_PRESENT))
+				continue;
+			const auto [pd_base, pd_mem, pd_size] = pd_from_index(j, pdpt_base, pdpt);
+			visited++;
+			if (!makecow(pd_base, pdpt[j], pdpt[j] & PDE64_PS) || (pdpt[j] & PDE64_PS) || pd_mem >= oob)
+				continue;
+			subtrees.push_back({pd_base, mem.page_at(pd_mem)});
+		}
+	}
+
+	/* Page directories never share page tables, so they
+	   can be protected in parallel. */
+	std::atomic<size_t> next = 0;
+	std::atomic<size_t> total = visited;
+	auto worker = [&] {
+		size_t count = 0;
+		for (size_t n = next++; n < subtrees.size(); n = next++) {
+			auto [pd_base, pd] = subtrees[n];
+			for (uint64_t k = 0; k < 512; k++)
+			{
+				if (!(pd[k] & PDE64_PRESENT))
+					continue;
+				const auto [pt_base, pt_mem, pt_size] = pt_from_index(k, pd_base, pd);
+				count++;
+				if (!makecow(pt_base, pd[k], pd[k] & PDE64_PS) || (pd[k] & PDE64_PS))
+					continue;
+				auto* pt = mem.page_at(pt_mem);
+				for (uint64_t e = 0; e < 512; e++) {
+					if (pt[e] & PDE64_PRESENT) { // 4KB page
+						makecow(pt_base | (e << 12), pt[e], true);
+						count++;
+					}
+				}
+			}
+		}
+		total += count;
+	};
+	threads = std::min<size_t>(threads, subtrees.size());
+	std::vector<std::thread> helpers;
+	for (unsigned i = 1; i < threads; i++)
+		helpers.emplace_back(worker);
+	worker();
+	for (auto& t : helpers)
+		t.join();
+	mem.invalidate_tlb();
+	return total;
+}
+size_t foreach_page_flatten(vMemory& memory, uint64_t main_page_tables)
+{
+	/* Gather every leaf user page that is backed by a memory bank. */
+	struct BankedPage {
+		uint64_t addr;
+		uint64_t phys;
+		size_t   size;
+		uint64_t perms;
+	};
+	std::vector<BankedPage> banked;
+	foreach_page(memory,
+	[&] (uint64_t addr, uint64_t& entry, size_t size) {
+		const bool leaf = (size == PDE64_PTE_SIZE) || (entry & PDE64_PS);
+		if (leaf && (entry & PDE64_USER)) {
+			const uint64_t phys = entry & PDE64_ADDR_MASK;
+			if (memory.banks.bank_of(phys) != nullptr)
+				banked.push_back({addr, phys, size, entry & PDE64_LEAF_PERM_MASK});
+		}
+	}, false);
+
+	/* Every banked page needs a page in main memory to go to, or its
+	   contents would be lost, as forks only see main memory. Its
+	   permissions go with it, which a larger main page can only take
+	   when they are unchanged. This is checked before anything is
+	   copied, so that the VM is unchanged. */
+	const uint64_t banked_page_tables = memory.page_tables;
+	memory.page_tables = main_page_tables;
+	memory.invalidate_tlb();
+	auto check_main_page = [&] (const BankedPage& bp, uint64_t addr) -> const char* {
+		const char* error = "Banked page has no main memory page to be flattened into";
+		page_at(memory, addr, [&] (uint64_t, uint64_t& entry, size_t size) {
+			const uint64_t phys = (entry & PDE64_ADDR_MASK) + (addr & (size - 1));
+			if (!memory.within(phys, PDE64_PTE_SIZE))
+				return;
+			if (size > bp.size && (entry & PDE64_LEAF_PERM_MASK) != bp.perms)
+				error = "Banked page permissions differ from its larger main memory page";
+			else
+				error = nullptr;
+		}, true);
+		return error;
+	};
+	for (const auto& bp : banked) {
+		for (uint64_t off = 0; off < bp.size; off += PDE64_PTE_SIZE) {
+			if (const char* error = check_main_page(bp, bp.addr + off); error != nullptr) {
+				memory.page_tables = banked_page_tables;
+				memory.invalidate_tlb();
+				throw MachineException(error, bp.addr + off);
+			}
+		}
+	}
+
+	/* Copy banked pages into identity-mapped main memory, using the
+	   original page tables, and mark the original entries dirty so
+	   that forks will duplicate them instead of zeroing them. The
+	   entries take the permissions of the banked pages. */
+	size_t flattened = 0;
+	for (const auto& bp : banked) {
+		const char* src = memory.banks.bank_of(bp.phys)->at(bp.phys);
+		for (uint64_t off = 0; off < bp.size; off += PDE64_PTE_SIZE) {
+			page_at(memory, bp.addr + off, [&] (uint64_t, uint64_t& entry, size_t size) {
+				const uint64_t phys = (entry & PDE64_ADDR_MASK) + ((bp.addr + off) & (size - 1));
+				CLPRINT("Flattening page 0x%lX from bank 0x%lX into 0x%lX\n",
+					bp.addr + off, bp.phys + off, phys);
+				tinykvm::page_duplicate((uint64_t*)memory.at(phys, PDE64_PTE_SIZE),
+					(const uint64_t*)&src[off]);
+				entry = (entry & ~PDE64_LEAF_PERM_MASK) | bp.perms | PDE64_DIRTY;
+				flattened++;
+			}, true);
+		}
+	}
+	return flattened;
 }
+
 std::vector<std::pair<uint64_t, uint64_t>> get_accessed_pages(const vMemory& memory)
 {
 	std::vector<std::pair<uint64_t, uint64_t>> accessed_pages;
@@ -559,6 +866,145 @@ std::vector<std::pair<uint64_t, uint64_t>> get_accessed_pages(const vMemory& mem
 	return accessed_pages;
 }
 
+struct AccessedHarvest {
+	vMemory& memory;
+	AccessedPage* pages;
+	const size_t max;
+	size_t count = 0;
+	const bool forked;
+};
+/* Returns false when the pages ran out before the whole table was harvested */
+static bool harvest_table(AccessedHarvest& h, uint64_t* table, uint64_t base, unsigned level)
+{
+	const unsigned shift = 12 + 9 * (level - 1);
+	for (uint64_t i = 0; i < 512; i++) {
+		uint64_t& entry = table[i];
+		if ((entry & (PDE64_PRESENT | PDE64_ACCESSED)) != (PDE64_PRESENT | PDE64_ACCESSED))
+			continue;
+		const uint64_t addr = base | (i << shift);
+		if (level > 1 && !(level <= 3 && (entry & PDE64_PS))) {
+			const uint64_t table_addr = entry & PDE64_ADDR_MASK;
+			/* The tables of the master (or a remote) are left alone */
+			if (h.forked && is_copy_on_write(entry))
+				continue;
+			if (!h.memory.within(table_addr, PAGE_SIZE) && h.memory.banks.bank_of(table_addr) == nullptr)
+				continue;
+			if (!harvest_table(h, h.memory.page_at(table_addr), addr, level - 1))
+				return false;
+			entry &= ~PDE64_ACCESSED;
+			continue;
+		}
+		if (h.count == h.max)
+			return false;
+		/* The dirty bit of a copy-on-write page tells whether it has contents */
+		const bool dirty = (entry & PDE64_DIRTY) && !(entry & PDE64_CLONEABLE);
+		h.pages[h.count++] = AccessedPage{ addr, 1ULL << shift, dirty };
+		entry &= ~PDE64_ACCESSED;
+		if (dirty && h.forked)
+			entry &= ~PDE64_DIRTY;
+	}
+	return true;
+}
+
+size_t harvest_accessed_pages(vMemory& memory, AccessedPage* pages, size_t max, bool forked)
+{
+	AccessedHarvest harvest { memory, pages, max, 0, forked };
+	harvest_table(harvest, memory.page_at(memory.page_tables), 0, 4);
+	memory.invalidate_tlb();
+	return harvest.count;
+}
+
+struct PageRelease {
+	vMemory& memory;
+	const uint64_t begin;
+	const uint64_t end;
+	uint64_t zero_page = 0;
+	std::vector<uint64_t> pages;
+};
+static bool releasable_page(PageRelease& r, uint64_t entry, uint64_t addr, uint64_t size)
+{
+	/* Only private pages that are wholly inside the range */
+	if ((entry & (PDE64_USER | PDE64_RW | PDE64_CLONEABLE)) != (PDE64_USER | PDE64_RW)
+		|| addr < r.begin || addr + size > r.end)
+		return false;
+	auto* bank = r.memory.banks.bank_of(entry & PDE64_ADDR_MASK & ~(size - 1));
+	if (bank == nullptr || bank->page_tables)
+		return false;
+	if (r.zero_page == 0)
+		r.zero_page = r.memory.zero_page();
+	return true;
+}
+/* Like a fresh copy-on-write page: zeroed on the next write */
+static uint64_t released_entry(PageRelease& r, uint64_t entry)
+{
+	return r.zero_page | PDE64_CLONEABLE
+		| (entry & 0x8000000000000FFF & ~(PDE64_PS | PDE64_RW | PDE64_DIRTY | PDE64_ACCESSED | PDE64_G));
+}
+static void release_hugepage(PageRelease& r, uint64_t& entry, uint64_t addr)
+{
+	if (!releasable_page(r, entry, addr, PDE64_PT_SIZE))
+		return;
+	/* A page table of zero page entries replaces the 2MB page */
+	MemoryBank::Page pt;
+	try {
+		pt = r.memory.new_table_page();
+	} catch (const MemoryException&) {
+		return;
+	}
+	const uint64_t paddr = entry & PDE64_ADDR_MASK & ~(PDE64_PT_SIZE - 1);
+	const uint64_t leaf = released_entry(r, entry);
+	for (uint64_t e = 0; e < 512; e++) {
+		pt.pmem[e] = leaf;
+		r.pages.push_back(paddr + e * PAGE_SIZE);
+	}
+	entry = pt.addr | (entry & PDE64_CLONED_MASK & ~(PDE64_PS | PDE64_DIRTY | PDE64_ACCESSED))
+		| PDE64_RW | PDE64_PRESENT;
+}
+static void release_table(PageRelease& r, uint64_t* table, uint64_t base, unsigned level)
+{
+	const unsigned shift = 12 + 9 * (level - 1);
+	const uint64_t span = 1ULL << shift;
+	for (uint64_t i = 0; i < 512; i++) {
+		const uint64_t addr = base | (i << shift);
+		if (addr + span <= r.begin)
+			continue;
+		if (addr >= r.end)
+			break;
+		uint64_t& entry = table[i];
+		if (!(entry & PDE64_PRESENT))
+			continue;
+		if (level > 1) {
+			if (level == 2 && (entry & PDE64_PS)) {
+				release_hugepage(r, entry, addr);
+				continue;
+			}
+			/* Gigapages stay, and so do the tables of the master */
+			if ((level == 3 && (entry & PDE64_PS)) || is_copy_on_write(entry))
+				continue;
+			const uint64_t table_addr = entry & PDE64_ADDR_MASK;
+			if (r.memory.banks.bank_of(table_addr) == nullptr)
+				continue;
+			release_table(r, r.memory.page_at(table_addr), addr, level - 1);
+			continue;
+		}
+		if (!releasable_page(r, entry, addr, span))
+			continue;
+		r.pages.push_back(entry & PDE64_ADDR_MASK);
+		entry = released_entry(r, entry);
+	}
+}
+
+std::vector<uint64_t> release_private_pages(vMemory& memory, uint64_t addr, size_t len)
+{
+	if (memory.banks.bank_of(memory.page_tables) == nullptr)
+		return {};
+	PageRelease release { memory, addr, addr + len, 0, {} };
+	release_table(release, memory.page_at(memory.page_tables), 0, 4);
+	if (!release.pages.empty())
+		memory.invalidate_tlb();
+	return std::move(release.pages);
+}
+
 void page_at(vMemory& memory, uint64_t addr, foreach_page_t callback, bool ignore_missing)
 {
 	auto* pml4 = memory.page_at(memory.page_tables);
@@ -567,14 +1013,21 @@ void page_at(vMemory& memory, uint64_t addr, foreach_page_t callback, bool ignor
 		const auto [pdpt_base, pdpt_mem, pdpt_size] = pdpt_from_index(i, pml4);
 		auto* pdpt = memory.page_at(pdpt_mem);
 		const uint64_t j = index_from_pdpt_entry(addr);
+		populate_lazy_gigapage(memory, pdpt[j], addr >> 30);
 		if (pdpt[j] & PDE64_PRESENT) {
 			const auto [pd_base, pd_mem, pd_size] = pd_from_index(j, pdpt_base, pdpt);
+			if (pdpt[j] & PDE64_PS) { // 1GB page
+				callback(pd_mem, pdpt[j], pd_size);
+				memory.invalidate_tlb();
+				return;
+			}
 			auto* pd = memory.page_at(pd_mem);
 			const uint64_t k = index_from_pd_entry(addr);
 			if (pd[k] & PDE64_PRESENT) {
 				const auto [pt_base, pt_mem, pt_size] = pt_from_index(k, pd_base, pd);
 				if (pd[k] & PDE64_PS) { // 2MB page
 					callback(pt_mem, pd[k], pt_size);
+					memory.invalidate_tlb();
 					return;
 				} else {
 					auto* pt = memory.page_at(pt_mem);
@@ -582,6 +1035,7 @@ void page_at(vMemory& memory, uint64_t addr, foreach_page_t callback, bool ignor
 					if (pt[e] & PDE64_PRESENT) { // 4KB page
 						const auto [pte_base, pte_mem, pte_size] = pte_from_index(e, pt_base, pt);
 						callback(pte_base, pt[e], pte_size);
+						memory.invalidate_tlb();
 						return;
 					} // pt
 					if (ignore_missing)
@@ -602,11 +1056,6 @@ void page_at(vMemory& memory, uint64_t addr, foreach_page_t callback, bool ignor
 	memory_exception("page_at: pml4 entry not present", addr, PDE64_PDPT_SIZE);
 }
 
-inline bool is_copy_on_write(uint64_t entry) {
-	/* Copy this page if it's marked cloneable
-	   and it's not already writable. */
-	return (entry & (PDE64_CLONEABLE | PDE64_RW)) == PDE64_CLONEABLE;
-}
 inline bool is_copy_on_modify(uint64_t entry) {
 	/* Copy this page if it's marked cloneable
 	   and we are going to change this page right now. */
@@ -627,6 +1076,17 @@ static void clone_and_update_entry(vMemory& memory, uint64_t& entry, uint64_t*&
 	/* Set new entry, copy flags and set as cloned */
 	entry = page.addr | (entry & PDE64_CLONED_MASK) | flags;
 	data = page.pmem;
+	memory.page_counters.copied++;
+}
+static void clone_and_update_table(vMemory& memory, uint64_t& entry, uint64_t*& data, uint64_t flags) {
+	/* Allocate new page-table page, which may be kept across resets */
+	auto page = memory.new_table_page();
+	assert((page.addr & 0x8000000000000FFF) == 0x0);
+	/* Copy all entries from old page */
+	tinykvm::page_duplicate(page.pmem, data);
+	/* Set new entry, copy flags and set as cloned */
+	entry = page.addr | (entry & PDE64_CLONED_MASK) | flags;
+	data = page.pmem;
 }
 static void zero_and_update_entry(vMemory& memory, uint64_t& entry, uint64_t*& data, uint64_t flags) {
 	/* Allocate new page, pass old vaddr to memory banks */
@@ -639,6 +1099,7 @@ static void zero_and_update_entry(vMemory& memory, uint64_t& entry, uint64_t*& d
 	/* Set new entry, copy flags and set as cloned */
 	entry = page.addr | (entry & PDE64_CLONED_MASK) | flags;
 	data = page.pmem;
+	memory.page_counters.zeroed++;
 }
 static void unsafe_update_entry(vMemory& memory, uint64_t& entry, uint64_t*& data, uint64_t flags) {
 	/* Allocate new page, pass old vaddr to memory banks */
@@ -647,6 +1108,93 @@ static void unsafe_update_entry(vMemory& memory, uint64_t& entry, uint64_t*& dat
 	/* Set new entry, copy flags and set as cloned */
 	entry = page.addr | (entry & PDE64_CLONED_MASK) | flags;
 	data = page.pmem;
+	/* The caller overwrites the whole page */
+	memory.page_counters.zeroed++;
+}
+
+/* Fill a page directory with the copy-on-write 2MB pages making up
+   a copy-on-write 1GB page. Returns the flags of the new PDPT entry. */
+static uint64_t fill_split_gigapage(uint64_t entry, uint64_t* pd)
+{
+	const uint64_t flags = entry & ~PDE64_ADDR_MASK & ~PDE64_ACCESSED;
+	const uint64_t base_address = entry & PDE64_ADDR_MASK;
+	for (size_t k = 0; k < 512; k++) {
+		pd[k] = base_address | (k << 21) | flags;
+	}
+	return (flags & (PDE64_USER | PDE64_NX)) | PDE64_RW | PDE64_PRESENT;
+}
+/* Fill a page table with the copy-on-write 4k pages making up
+   a copy-on-write 2MB page. Returns the flags of the new PD entry. */
+static uint64_t fill_split_hugepage(uint64_t entry, uint64_t* pt)
+{
+	/* Copy flags from 2MB page, except read-write and PS */
+	const uint64_t flags = entry & PDE64_PD_SPLIT_MASK & ~(uint64_t)PDE64_PS;
+	const uint64_t branch_flags = flags | PDE64_CLONEABLE | PDE64_G | PDE64_PRESENT;
+	const uint64_t base_address = entry & PDE64_ADDR_MASK;
+	for (size_t e = 0; e < 512; e++) {
+		pt[e] = base_address | (e << 12) | branch_flags;
+	}
+	/* Add read-write to the new 2MB entry */
+	return flags | PDE64_RW | PDE64_PRESENT;
+}
+
+/* Replace a copy-on-write 1GB page with a private page directory
+   of copy-on-write 2MB pages, which are then handled as usual. */
+static void split_gigapage(vMemory& memory, uint64_t& entry)
+{
+	auto page = memory.new_table_page();
+	entry = page.addr | fill_split_gigapage(entry, page.pmem);
+}
+
+/* Make a kept page table (at @level, where 1 is a page table) match
+   the corresponding master table again. Entries pointing to kept tables
+   are kept, and restored recursively, as long as the master entry is
+   still a copy-on-write branch, or a copy-on-write 2MB or 1GB page that
+   the kept table splits. Everything else is copied from the master. */
+static void restore_table(vMemory& memory, uint64_t* table, const uint64_t* master,
+	unsigned level, std::vector<uint64_t>& used_pages)
+{
+	for (size_t e = 0; e < 512; e++) {
+		const uint64_t entry = table[e];
+		const uint64_t master_entry = master[e];
+		if (level > 1 && (entry & (PDE64_PRESENT | PDE64_PS)) == PDE64_PRESENT
+			&& (master_entry & PDE64_PRESENT) && is_copy_on_write(master_entry)
+			&& memory.banks.is_table_page(entry & PDE64_ADDR_MASK))
+		{
+			const uint64_t child_addr = entry & PDE64_ADDR_MASK;
+			auto* child = memory.page_at(child_addr);
+			if (!(master_entry & PDE64_PS)) {
+				restore_table(memory, child, memory.page_at(master_entry & PDE64_ADDR_MASK),
+					level - 1, used_pages);
+				const uint64_t flags = (level == 2) ? (PDE64_RW | PDE64_PRESENT) : PDE64_RW;
+				table[e] = child_addr | (master_entry & PDE64_CLONED_MASK) | flags;
+				used_pages.push_back(child_addr);
+				continue;
+			} else if (level == 2 || level == 3) {
+				uint64_t split[512];
+				const uint64_t flags = (level == 2)
+					? fill_split_hugepage(master_entry, split)
+					: fill_split_gigapage(master_entry, split);
+				restore_table(memory, child, split, level - 1, used_pages);
+				table[e] = child_addr | flags;
+				used_pages.push_back(child_addr);
+				continue;
+			}
+		}
+		table[e] = master_entry;
+	}
+}
+
+void restore_page_tables(vMemory& memory, const uint64_t* master_pml4)
+{
+	/* The root stays the same, so that CR3 does not change. The guest
+	   flushes its TLB when it is entered after a reset, see m_just_reset. */
+	std::vector<uint64_t> used_pages;
+	used_pages.push_back(memory.page_tables);
+	restore_table(memory, memory.page_at(memory.page_tables), master_pml4, 4, used_pages);
+	/* Any tables that are no longer used can be reused */
+	memory.banks.release_table_pages(used_pages);
+	memory.invalidate_tlb();
 }
 
 WritablePage writable_page_at(vMemory& memory, uint64_t addr, uint64_t verify_flags, WritablePageOptions options)
@@ -659,24 +1207,56 @@ WritablePage writable_page_at(vMemory& memory, uint64_t addr, uint64_t verify_fl
 		auto* pdpt = memory.page_at(pdpt_mem);
 		/* Make copy of page if needed */
 		if (is_copy_on_write(pml4[i])) {
+			memory.invalidate_tlb();
 			if (memory.main_memory_writes) {
 				unlock_identity_mapped_entry(pml4[i]);
 			} else {
-				clone_and_update_entry(memory, pml4[i], pdpt, PDE64_RW);
+				clone_and_update_table(memory, pml4[i], pdpt, PDE64_RW);
 				CLPRINT("-> Cloning a PML4 entry %lu: 0x%lX at %p\n", i, pml4[i], pdpt);
 			}
 			assert(!is_copy_on_write(pml4[i]) && (pml4[i] & PDE64_PRESENT));
 		}
 		const uint64_t j = index_from_pdpt_entry(addr);
+		populate_lazy_gigapage(memory, pdpt[j], addr >> 30);
+		if (UNLIKELY((pdpt[j] & (PDE64_PRESENT | PDE64_PS)) == (PDE64_PRESENT | PDE64_PS))) {
+			/* 1GB page: Unlock it in place, or split it into 2MB pages */
+			if (is_copy_on_write(pdpt[j])) {
+				memory.invalidate_tlb();
+				memory.remote_must_update_gigapages = true;
+				if (memory.main_memory_writes) {
+					unlock_identity_mapped_entry(pdpt[j]);
+					memory.increment_unlocked_pages(512 * 512);
+				} else {
+					split_gigapage(memory, pdpt[j]);
+					CLPRINT("-> Splitting a 1GB page, addr=0x%lX\n", addr);
+				}
+			}
+			if (pdpt[j] & PDE64_PS) {
+				if (UNLIKELY((pdpt[j] & verify_flags) != verify_flags)) {
+					memory_exception("page_at: pt entry not user writable", addr, pdpt[j]);
+				}
+				const auto [pd_base, pd_mem, pd_size] = pd_from_index(j, pdpt_base, pdpt);
+				if (UNLIKELY(memory.banks.dirty_page_logging()) && (pdpt[j] & PDE64_USER)) {
+					memory.record_host_write(addr, pd_mem, PDE64_PD_SIZE);
+				}
+				auto* data = (char *)memory.page_at(pd_mem);
+				return WritablePage {
+					.page = data + (addr & (PDE64_PD_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1)),
+					.entry = pdpt[j],
+					.size = PDE64_PD_SIZE,
+				};
+			}
+		}
 		if (pdpt[j] & PDE64_PRESENT) {
 			const auto [pd_base, pd_mem, pd_size] = pd_from_index(j, pdpt_base, pdpt);
 			auto* pd = memory.page_at(pd_mem);
 			/* Make copy of page if needed */
 			if (is_copy_on_write(pdpt[j])) {
+				memory.invalidate_tlb();
 				if (memory.main_memory_writes) {
 					unlock_identity_mapped_entry(pdpt[j]);
 				} else {
-					clone_and_update_entry(memory, pdpt[j], pd, PDE64_RW);
+					clone_and_update_table(memory, pdpt[j], pd, PDE64_RW);
 					memory.remote_must_update_gigapages = true;
 					CLPRINT("-> Cloning a PDPT entry: 0x%lX\n", pdpt[j]);
 				}
@@ -695,6 +1275,7 @@ WritablePage writable_page_at(vMemory& memory, uint64_t addr, uint64_t verify_fl
 				/* Make copy of page if needed (not likely) */
 				if (UNLIKELY(is_copy_on_write(pd[k]))) {
 					/* Copy-on-write 2MB page */
+					memory.invalidate_tlb();
 
 					/* NOTE: Make sure we are re-reading pd[k] */
 					if (memory.main_memory_writes) {
@@ -703,25 +1284,16 @@ WritablePage writable_page_at(vMemory& memory, uint64_t addr, uint64_t verify_fl
 							memory.increment_unlocked_pages(512);
 						}
 						goto entry_is_no_longer_copy_on_write;
-					} else if (memory.split_hugepages && (pd[k] & PDE64_PS)) { // 2MB page
+					} else if ((pd[k] & PDE64_PS) && memory.split_hugepage_at(addr)) { // 2MB page
 						CLPRINT("-> Splitting a 2MB page, addr=0x%lX rw=%lu cloneable=%lu\n",
 							addr, pd[k] & PDE64_RW, pd[k] & PDE64_CLONEABLE);
-						/* Remove PS flag */
-						pd[k] &= ~(uint64_t)PDE64_PS;
-						/* Copy flags from 2MB page, except read-write */
-						uint64_t flags = pd[k] & PDE64_PD_SPLIT_MASK;
-						uint64_t branch_flags = flags | PDE64_CLONEABLE | PDE64_G | PDE64_PRESENT;
 						/* Allocate pagetable page and fill 4k entries.
-						NOTE: new_page() makes page not a candidate for
+						NOTE: new_table_page() makes page not a candidate for
 						sequentialization for eg. vmcommit() later on. */
-						auto page = memory.new_page();
-						const uint64_t base_address = pd[k] & PDE64_ADDR_MASK;
-						for (size_t e = 0; e < 512; e++) {
-							page.pmem[e] = base_address | (e << 12) | branch_flags;
-						}
-						/* Update 2MB entry, add read-write */
-						pd[k] = page.addr | flags | PDE64_RW | PDE64_PRESENT;
+						auto page = memory.new_table_page();
+						pd[k] = page.addr | fill_split_hugepage(pd[k], page.pmem);
 						pt = page.pmem;
+						memory.page_counters.split_hugepages++;
 					}
 					else if ((pd[k] & PDE64_PS)) {
 						CLPRINT("Duplicating 2MB page, addr=0x%lX rw=%lu cloneable=%lu\n",
@@ -745,22 +1317,18 @@ WritablePage writable_page_at(vMemory& memory, uint64_t addr, uint64_t verify_fl
 						/* We deliberately use DIRTY bit to know when to duplicate memory. */
 						if (dirty) {
 							/* The source page needs to be duplicated, always duplicate */
-							//std::memcpy(page.pmem, data, 2ULL << 20);
-							for (size_t e = 0; e < 512; e++) {
-								tinykvm::page_duplicate(page.pmem + e * 512, data + e * 512);
-							}
+							tinykvm::pages_duplicate(page.pmem, data, 512);
 						} else if (page.dirty) {
 							/* The new page needs to be zeroed, because it's dirty */
-							//std::memset(page.pmem, 0, 2ULL << 20); /* 2MB */
-							for (size_t e = 0; e < 512; e++) {
-								tinykvm::page_memzero(page.pmem + e * 512);
-							}
+							tinykvm::pages_memzero(page.pmem, 512);
 						}
+						memory.page_counters.hugepages++;
+						(dirty ? memory.page_counters.copied : memory.page_counters.zeroed) += 512;
 
 						/* Return 4k page offset to new duplicated page. */
 						const uint64_t e = index_from_pt_entry(addr);
 						if (pd[k] & PDE64_USER)
-							memory.record_cow_leaf_user_page(addr);
+							memory.record_cow_leaf_user_page(addr, page.addr, PDE64_PT_SIZE);
 						return WritablePage {
 							.page = (char *)page.pmem + e * PAGE_SIZE,
 							.entry = pd[k],
@@ -768,7 +1336,7 @@ WritablePage writable_page_at(vMemory& memory, uint64_t addr, uint64_t verify_fl
 						};
 					}
 
-					clone_and_update_entry(memory, pd[k], pt, PDE64_RW | PDE64_PRESENT);
+					clone_and_update_table(memory, pd[k], pt, PDE64_RW | PDE64_PRESENT);
 					CLPRINT("-> Cloning a PD entry: 0x%lX\n", pd[k]);
 				}
 
@@ -777,6 +1345,9 @@ entry_is_no_longer_copy_on_write:
 					if (UNLIKELY((pd[k] & verify_flags) != verify_flags)) {
 						memory_exception("page_at: pt entry not user writable", addr, pd[k]);
 					}
+					if (UNLIKELY(memory.banks.dirty_page_logging()) && (pd[k] & PDE64_USER)) {
+						memory.record_host_write(addr, pt_mem, PDE64_PT_SIZE);
+					}
 
 					const uint64_t e = index_from_pt_entry(addr);
 					auto* data = memory.page_at(pt_mem);
@@ -800,6 +1371,33 @@ entry_is_no_longer_copy_on_write:
 						data = memory.page_at(pt_addr);
 					}
 					if (is_copy_on_write(pt[e])) {
+						/* Host-side accesses may remember the old page */
+						memory.invalidate_tlb();
+						if (options.zero_page != 0 && (pt[e] & PDE64_USER)
+							&& !(memory.is_forkable_master() && memory.main_memory_writes)) {
+							/* Point the entry at the shared zero page. The next write
+							   allocates a private page, which is zeroed as it's not dirty. */
+							pt[e] = options.zero_page | PDE64_PRESENT
+								| (pt[e] & 0x8000000000000FFF & ~(PDE64_DIRTY | PDE64_ACCESSED));
+							CLPRINT("-> Mapping the zero page: 0x%lX\n", pt[e]);
+							return WritablePage {
+								.page = nullptr,
+								.entry = pt[e],
+								.size = PAGE_SIZE,
+							};
+						}
+						if (options.alias_page != 0 && (pt[e] & PDE64_USER)
+							&& !(memory.is_forkable_master() && memory.main_memory_writes)) {
+							pt[e] = options.alias_page | PDE64_PRESENT | PDE64_DIRTY
+								| (pt[e] & 0x8000000000000FFF & ~PDE64_ACCESSED);
+							memory.aliased_pages = true;
+							CLPRINT("-> Aliasing a page: 0x%lX\n", pt[e]);
+							return WritablePage {
+								.page = nullptr,
+								.entry = pt[e],
+								.size = PAGE_SIZE,
+							};
+						}
 						if (memory.is_forkable_master() && memory.main_memory_writes) {
 							unlock_identity_mapped_entry(pt[e]);
 							memory.increment_unlocked_pages(1);
@@ -817,8 +1415,10 @@ entry_is_no_longer_copy_on_write:
 							pt[e] |= PDE64_RW | PDE64_PRESENT;
 						}
 						if (pt[e] & PDE64_USER)
-							memory.record_cow_leaf_user_page(addr);
+							memory.record_cow_leaf_user_page(addr, pt[e] & PDE64_ADDR_MASK, PAGE_SIZE);
 						CLPRINT("-> Cloning a PT entry: 0x%lX\n", pt[e]);
+					} else if (UNLIKELY(memory.banks.dirty_page_logging()) && (pt[e] & PDE64_USER)) {
+						memory.record_host_write(addr, pt[e] & PDE64_ADDR_MASK, PAGE_SIZE);
 					}
 					if ((pt[e] & verify_flags) == verify_flags) {
 						CLPRINT("-> Returning data: %p\n", data);
@@ -840,6 +1440,32 @@ entry_is_no_longer_copy_on_write:
 	memory_exception("page_at: pml4 entry not present", addr, PDE64_PDPT_SIZE);
 }
 
+size_t fault_around_at(vMemory& memory, uint64_t addr, size_t count)
+{
+	const uint64_t page = addr & ~(uint64_t)(PAGE_SIZE-1);
+	const uint64_t end = std::min<uint64_t>((page | (PDE64_PT_SIZE-1)) + 1, page + (count+1) * PAGE_SIZE);
+	WritablePageOptions opts;
+	opts.zeroes = false;
+	size_t prepared = 0;
+	for (uint64_t vaddr = page + PAGE_SIZE; vaddr < end; vaddr += PAGE_SIZE)
+	{
+		bool candidate = false;
+		page_at(memory, vaddr, [&] (uint64_t, uint64_t& entry, size_t size) {
+			candidate = size == PAGE_SIZE && (entry & PDE64_USER) && is_copy_on_write(entry);
+		}, true);
+		if (!candidate)
+			continue;
+		try {
+			writable_page_at(memory, vaddr, PDE64_USER | PDE64_RW, opts);
+			prepared++;
+		} catch (const MemoryException&) {
+			/* Out of working memory: Leave it to the guest */
+			break;
+		}
+	}
+	return prepared;
+}
+
 char * readable_page_at(const vMemory& memory, uint64_t addr, uint64_t flags)
 {
 	CLPRINT("Resolving a readable page for 0x%lX\n", addr);
@@ -849,8 +1475,16 @@ char * readable_page_at(const vMemory& memory, uint64_t addr, uint64_t flags)
 		const auto [pdpt_base, pdpt_mem, pdpt_size] = pdpt_from_index(i, pml4);
 		auto* pdpt = memory.page_at(pdpt_mem);
 		const uint64_t j = index_from_pdpt_entry(addr);
+		populate_lazy_gigapage(memory, pdpt[j], addr >> 30);
 		if (is_flagged_page(flags, pdpt[j])) {
 			const auto [pd_base, pd_mem, pd_size] = pd_from_index(j, pdpt_base, pdpt);
+			/* Could be a 1GB page */
+			if (UNLIKELY(pdpt[j] & PDE64_PS)) {
+				auto* data = (char *)memory.page_at(pd_mem)
+					+ (addr & (PDE64_PD_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1));
+				CLPRINT("-> Returning 1GB data: %p\n", data);
+				return data;
+			}
 			auto* pd = memory.page_at(pd_mem);
 			const uint64_t k = index_from_pd_entry(addr);
 			if (is_flagged_page(flags, pd[k])) {
@@ -881,6 +1515,178 @@ char * readable_page_at(const vMemory& memory, uint64_t addr, uint64_t flags)
 	memory_exception("readable_page_at: pml4 entry not readable", addr, PDE64_PDPT_SIZE);
 }
 
+/* Merges host-contiguous pieces of a range before handing them out */
+struct RangeRun {
+	const range_callback_t& callback;
+	uint64_t addr = 0;
+	char*    data = nullptr;
+	size_t   len  = 0;
+
+	void add(uint64_t vaddr, char* ptr, size_t size) {
+		if (data != nullptr && ptr == data + len) {
+			len += size;
+			return;
+		}
+		flush();
+		addr = vaddr;
+		data = ptr;
+		len  = size;
+	}
+	void flush() {
+		if (data != nullptr)
+			callback(addr, data, len);
+		data = nullptr;
+	}
+};
+
+void readable_range_at(const vMemory& memory, uint64_t addr, size_t len, uint64_t flags, const range_callback_t& callback)
+{
+	CLPRINT("Resolving a readable range for 0x%lX, len=%zu\n", addr, len);
+	RangeRun run { callback };
+	while (len != 0)
+	{
+		/* Descend once for every page table (or 2MB page) */
+		auto* pml4 = memory.page_at(memory.page_tables);
+		const uint64_t i = (addr >> 39) & 511;
+		if (UNLIKELY(!is_flagged_page(flags, pml4[i])))
+			memory_exception("readable_range_at: pml4 entry not readable", addr, PDE64_PDPT_SIZE);
+		const auto [pdpt_base, pdpt_mem, pdpt_size] = pdpt_from_index(i, pml4);
+		auto* pdpt = memory.page_at(pdpt_mem);
+		const uint64_t j = index_from_pdpt_entry(addr);
+		populate_lazy_gigapage(memory, pdpt[j], addr >> 30);
+		if (UNLIKELY(!is_flagged_page(flags, pdpt[j])))
+			memory_exception("readable_range_at: page directory not readable", addr, PDE64_PD_SIZE);
+		const auto [pd_base, pd_mem, pd_size] = pd_from_index(j, pdpt_base, pdpt);
+		if (pdpt[j] & PDE64_PS) { // 1GB page
+			const size_t offset = addr & (PDE64_PD_SIZE - 1);
+			const size_t size = std::min<size_t>(PDE64_PD_SIZE - offset, len);
+			run.add(addr, (char *)memory.page_at(pd_mem) + offset, size);
+			addr += size;
+			len -= size;
+			continue;
+		}
+		auto* pd = memory.page_at(pd_mem);
+		const uint64_t k = index_from_pd_entry(addr);
+		if (UNLIKELY(!is_flagged_page(flags, pd[k])))
+			memory_exception("readable_range_at: page table not readable", addr, PDE64_PT_SIZE);
+		const auto [pt_base, pt_mem, pt_size] = pt_from_index(k, pd_base, pd);
+		auto* pt = memory.page_at(pt_mem);
+
+		if (pd[k] & PDE64_PS) { // 2MB page
+			const size_t offset = addr & (PDE64_PT_SIZE - 1);
+			const size_t size = std::min<size_t>(PDE64_PT_SIZE - offset, len);
+			run.add(addr, (char *)pt + offset, size);
+			addr += size;
+			len -= size;
+			continue;
+		}
+		/* Sibling entries in the same page table */
+		for (uint64_t e = index_from_pt_entry(addr); e < 512 && len != 0; e++)
+		{
+			if (UNLIKELY(!is_flagged_page(flags, pt[e]))) {
+				run.flush();
+				memory_exception("readable_range_at: pt entry not readable", addr, PDE64_PTE_SIZE);
+			}
+			const auto [pte_base, pte_mem, pte_size] = pte_from_index(e, pt_base, pt);
+			auto* data = (char *)memory.page_at(pte_mem);
+			const size_t offset = addr & (PAGE_SIZE - 1);
+			const size_t size = std::min<size_t>(PAGE_SIZE - offset, len);
+			run.add(addr, data + offset, size);
+			addr += size;
+			len -= size;
+		}
+	}
+	run.flush();
+}
+
+void writable_range_at(vMemory& memory, uint64_t addr, size_t len, uint64_t verify_flags,
+	WritablePageOptions options, const range_callback_t& callback)
+{
+	CLPRINT("Resolving a writable range for 0x%lX, len=%zu\n", addr, len);
+	RangeRun run { callback };
+	/* Logged host writes are recorded by writable_page_at() */
+	const bool fast_path = !memory.banks.dirty_page_logging();
+	auto is_private = [] (uint64_t entry) {
+		return (entry & PDE64_PRESENT) && !is_copy_on_write(entry);
+	};
+	auto is_private_leaf = [&] (uint64_t entry) {
+		return is_private(entry) && (entry & verify_flags) == verify_flags;
+	};
+	while (len != 0)
+	{
+		/* Descend once for every page table (or 2MB page), as long as
+		   every level is already private to this VM */
+		auto* pml4 = memory.page_at(memory.page_tables);
+		const uint64_t i = (addr >> 39) & 511;
+		if (fast_path && is_private(pml4[i])) {
+			const auto [pdpt_base, pdpt_mem, pdpt_size] = pdpt_from_index(i, pml4);
+			auto* pdpt = memory.page_at(pdpt_mem);
+			const uint64_t j = index_from_pdpt_entry(addr);
+			populate_lazy_gigapage(memory, pdpt[j], addr >> 30);
+			const auto [pd_base, pd_mem, pd_size] = pd_from_index(j, pdpt_base, pdpt);
+			if ((pdpt[j] & PDE64_PS) && is_private_leaf(pdpt[j])) { // 1GB page
+				const size_t offset = addr & (PDE64_PD_SIZE - 1);
+				const size_t size = std::min<size_t>(PDE64_PD_SIZE - offset, len);
+				pdpt[j] |= PDE64_DIRTY;
+				run.add(addr, (char *)memory.page_at(pd_mem) + offset, size);
+				addr += size;
+				len -= size;
+				continue;
+			} else if (!(pdpt[j] & PDE64_PS) && is_private(pdpt[j])) {
+				auto* pd = memory.page_at(pd_mem);
+				const uint64_t k = index_from_pd_entry(addr);
+				if (is_private(pd[k])) {
+					const auto [pt_base, pt_mem, pt_size] = pt_from_index(k, pd_base, pd);
+					auto* pt = memory.page_at(pt_mem);
+					if (pd[k] & PDE64_PS) { // 2MB page
+						if (is_private_leaf(pd[k])) {
+							const size_t offset = addr & (PDE64_PT_SIZE - 1);
+							const size_t size = std::min<size_t>(PDE64_PT_SIZE - offset, len);
+							pd[k] |= PDE64_DIRTY;
+							run.add(addr, (char *)pt + offset, size);
+							addr += size;
+							len -= size;
+							continue;
+						}
+					} else {
+						/* Sibling entries in the same page table */
+						uint64_t e = index_from_pt_entry(addr);
+						for (; e < 512 && len != 0 && is_private_leaf(pt[e]); e++)
+						{
+							const auto [pte_base, pte_mem, pte_size] = pte_from_index(e, pt_base, pt);
+							auto* data = (char *)memory.page_at(pte_mem);
+							const size_t offset = addr & (PAGE_SIZE - 1);
+							const size_t size = std::min<size_t>(PAGE_SIZE - offset, len);
+							pt[e] |= PDE64_DIRTY;
+							run.add(addr, data + offset, size);
+							addr += size;
+							len -= size;
+						}
+						if (len == 0 || e == 512)
+							continue;
+					}
+				}
+			}
+		}
+		/* Slow path: Copy-on-write, or anything else that needs work.
+		   Page tables may be cloned, so descend again afterwards. */
+		const size_t offset = addr & (PAGE_SIZE - 1);
+		const size_t size = std::min<size_t>(PAGE_SIZE - offset, len);
+		WritablePageOptions opts = options;
+		opts.allow_dirty = options.allow_dirty && size == PAGE_SIZE;
+		WritablePage page = writable_page_at(memory, addr & ~(PAGE_SIZE - 1), verify_flags, opts);
+		if (UNLIKELY(page.page == nullptr)) {
+			run.flush();
+			memory_exception("writable_range_at: page was not made writable", addr, PAGE_SIZE);
+		}
+		page.set_dirty();
+		run.add(addr, page.page + offset, size);
+		addr += size;
+		len -= size;
+	}
+	run.flush();
+}
+
 void memory_exception(const char* msg, uint64_t addr, uint64_t sz)
 {
 	throw MemoryException(msg, addr, sz);
@@ -7,14 +7,45 @@ namespace tinykvm {
 extern uint64_t setup_amd64_paging(vMemory&,
 	std::string_view binary,
 	const std::vector<VirtualRemapping>& remappings,
-	bool split_hugepages);
+	bool split_hugepages, bool vdso = false, bool lazy = false);
+/* Fill in every lazily mapped gigapage. Returns the number of gigapages. */
+extern size_t populate_lazy_gigapages(vMemory&);
+/* Replace uniformly mapped identity gigapages inside [begin, end)
+   with 1GB pages. Returns the number of gigapages. */
+extern size_t merge_identity_gigapages(vMemory&, uint64_t begin, uint64_t end);
 extern void print_pagetables(const vMemory&);
+/* Make the kept page tables of a fork (see reset_keep_page_tables)
+   match the master page tables again, keeping the table pages that
+   still have a place in them. The root page table stays the same. */
+extern void restore_page_tables(vMemory&, const uint64_t* master_pml4);
 
 using foreach_page_t = std::function<void(uint64_t, uint64_t&, size_t)>;
 extern void foreach_page(vMemory&, foreach_page_t callback, bool skip_oob_addresses = true);
 extern void foreach_page(const vMemory&, foreach_page_t callback, bool skip_oob_addresses = true);
-extern void foreach_page_makecow(vMemory&, uint64_t kernel_end, uint64_t shared_memory_boundary);
+/* Make every writable page below the boundary copy-on-write, and clear the
+   accessed bits, using up to @threads threads. When @incremental, subtrees
+   that have not been made writable or accessed since the last (complete)
+   walk are skipped. Returns the number of entries that were visited. */
+extern size_t foreach_page_makecow(vMemory&, uint64_t kernel_end, uint64_t shared_memory_boundary,
+	unsigned threads = 1, bool incremental = false);
+/* Copy banked leaf pages into main memory, and switch to the main page tables.
+   Returns the number of 4k pages that were flattened. */
+extern size_t foreach_page_flatten(vMemory&, uint64_t main_page_tables);
 extern std::vector<std::pair<uint64_t, uint64_t>> get_accessed_pages(const vMemory& memory);
+/* Write up to @max leaf pages with the accessed bit set into @pages, and
+   clear their accessed bits, only descending into tables whose entry has
+   the accessed bit set. Such an entry is cleared once every page below it
+   has been harvested, so when @pages runs full, the next call continues
+   where this one stopped. When @forked, dirty bits of private pages are
+   harvested as well, and tables still shared with the master are skipped.
+   Returns the number of pages written to @pages. */
+extern size_t harvest_accessed_pages(vMemory&, AccessedPage* pages, size_t max, bool forked);
+
+/* Remap the private user pages wholly inside [addr, addr+len) to the zero
+   page, copy-on-write, as if they had never been written to. A private 2MB
+   page is replaced by a page table. Returns the banked 4k pages that no
+   longer back anything, see MemoryBanks::release_pages(). */
+extern std::vector<uint64_t> release_private_pages(vMemory&, uint64_t addr, size_t len);
 
 extern void page_at(vMemory&, uint64_t addr, foreach_page_t, bool ignore_missing = false);
 struct WritablePage {
@@ -28,9 +59,27 @@ struct WritablePage {
 struct WritablePageOptions {
 	bool zeroes = false;
 	bool allow_dirty = false;
+	/* When non-zero, a copy-on-write 4k user page is remapped read-only
+	   to this zero page instead, and the returned page is nullptr. */
+	uint64_t zero_page = 0;
+	/* When non-zero, a copy-on-write 4k user page is remapped read-only
+	   to this (immutable) page instead, and the returned page is nullptr.
+	   The entry is marked dirty, so that the next write copies the page. */
+	uint64_t alias_page = 0;
 };
 extern WritablePage writable_page_at(vMemory&, uint64_t addr, uint64_t flags, WritablePageOptions = {});
 extern char * readable_page_at(const vMemory&, uint64_t addr, uint64_t flags);
+/* Resolve the host memory behind [addr, addr+len), descending the page tables
+   once per page table (2MB) instead of once per 4k page. The callback is given
+   runs of host-contiguous memory, in order. writable_range_at() makes every
+   page writable and dirty, like writable_page_at(), and only applies
+   allow_dirty to pages that are covered completely by the range. */
+using range_callback_t = std::function<void(uint64_t addr, char* data, size_t len)>;
+extern void readable_range_at(const vMemory&, uint64_t addr, size_t len, uint64_t flags, const range_callback_t&);
+extern void writable_range_at(vMemory&, uint64_t addr, size_t len, uint64_t flags, WritablePageOptions, const range_callback_t&);
+/* Make up to @count copy-on-write user pages after @addr writable, stopping
+   at the 2MB boundary. Returns the number of pages that were prepared. */
+extern size_t fault_around_at(vMemory&, uint64_t addr, size_t count);
 
 static inline bool page_is_zeroed(const uint64_t* page) {
 	for (size_t i = 0; i < 512; i += 8) {
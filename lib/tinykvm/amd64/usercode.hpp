@@ -10,6 +10,7 @@ struct user_asm_header {
 	uint16_t vm64_preserving_entry;
 	uint16_t vm64_remote_disconnect;
 	uint32_t vm64_cpuid;
+	uint16_t vm64_chain;
 
 	uint64_t translated_vm_entry(const vMemory& memory) const noexcept {
 		return memory.physbase + USER_ASM_ADDR + vm64_entry;
@@ -23,6 +24,9 @@ struct user_asm_header {
 	uint64_t translated_vm_remote_disconnect(const vMemory& memory) const noexcept {
 		return memory.physbase + USER_ASM_ADDR + vm64_remote_disconnect;
 	}
+	uint64_t translated_vm_chain(const vMemory& memory) const noexcept {
+		return memory.physbase + USER_ASM_ADDR + vm64_chain;
+	}
 	uint64_t translated_vm_cpuid(const vMemory& memory) const noexcept {
 		return memory.physbase + USER_ASM_ADDR + vm64_cpuid;
 	}
@@ -11,4 +11,10 @@ const std::array<uint8_t, 4096>& vsys_page() {
 	return vsys;
 }
 
+#include "builtin/vdso_image.h"
+
+std::string_view vdso_image() {
+	return {(const char *)vdso_so, vdso_so_len};
+}
+
 } // tinykvm
@@ -1,9 +1,20 @@
 #pragma once
 #include <array>
 #include <cstdint>
+#include <string_view>
 
 namespace tinykvm {
 	static constexpr uint64_t VSYSCALL_AREA = 0xFFFF600000;
+	/* The vDSO reads a copy of the KVM clock of the guest kernel from
+	   its own read-only page, mapped right before it. KVM writes the
+	   clock into INTR_ASM_ADDR, which holds kernel data as well. */
+	static constexpr uint64_t VDSO_VVAR_AREA = 0xFFFFFFFFFF601000;
+	static constexpr uint64_t VDSO_AREA = 0xFFFFFFFFFF602000;
 
 	const std::array<uint8_t, 4096>& vsys_page();
+	/* The prelinked vDSO ELF image (see builtin/vdso.c) */
+	std::string_view vdso_image();
+	/* The KVM wall clock and system time, at INTR_ASM_ADDR+0x10 */
+	static constexpr uint64_t VDSO_CLOCK_OFFSET = 0x10;
+	static constexpr uint64_t VDSO_CLOCK_SIZE = 0x30;
 }
@@ -0,0 +1,89 @@
+#include "channel.hpp"
+
+#include "machine.hpp"
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+
+namespace tinykvm {
+static constexpr uint64_t CHANNEL_ALIGN = 0x200000; // 2MB
+
+Channel::Channel(size_t capacity)
+{
+	if (capacity == 0)
+		throw MachineException("Channel capacity cannot be zero");
+	this->m_size = (capacity + HEADER_SIZE + CHANNEL_ALIGN - 1) & ~(CHANNEL_ALIGN - 1);
+	void* ptr = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		throw MachineException("Channel: Failed to allocate memory", m_size);
+	this->m_ptr = (char *)ptr;
+
+	auto& hdr = this->header();
+	hdr.magic = MAGIC;
+	hdr.data_offset = HEADER_SIZE;
+	hdr.capacity = this->capacity();
+	hdr.head = 0;
+	hdr.tail = 0;
+}
+Channel::~Channel()
+{
+	munmap(this->m_ptr, this->m_size);
+}
+
+size_t Channel::readable() const noexcept
+{
+	const auto& hdr = *(const Header *)m_ptr;
+	return __atomic_load_n(&hdr.head, __ATOMIC_ACQUIRE) - __atomic_load_n(&hdr.tail, __ATOMIC_ACQUIRE);
+}
+size_t Channel::writable() const noexcept
+{
+	return this->capacity() - this->readable();
+}
+
+size_t Channel::write(const void* vdata, size_t len)
+{
+	auto& hdr = this->header();
+	const uint64_t head = hdr.head;
+	const uint64_t tail = __atomic_load_n(&hdr.tail, __ATOMIC_ACQUIRE);
+	const size_t cap = this->capacity();
+	len = std::min(len, cap - size_t(head - tail));
+
+	// At most two parts, when wrapping around the end of the ring
+	const size_t offset = head % cap;
+	const size_t first = std::min(len, cap - offset);
+	std::memcpy(data() + offset, vdata, first);
+	std::memcpy(data(), (const char *)vdata + first, len - first);
+	__atomic_store_n(&hdr.head, head + len, __ATOMIC_RELEASE);
+	return len;
+}
+size_t Channel::read(void* vdata, size_t len)
+{
+	auto& hdr = this->header();
+	const uint64_t tail = hdr.tail;
+	const uint64_t head = __atomic_load_n(&hdr.head, __ATOMIC_ACQUIRE);
+	const size_t cap = this->capacity();
+	len = std::min(len, size_t(head - tail));
+
+	const size_t offset = tail % cap;
+	const size_t first = std::min(len, cap - offset);
+	std::memcpy(vdata, data() + offset, first);
+	std::memcpy((char *)vdata + first, data(), len - first);
+	__atomic_store_n(&hdr.tail, tail + len, __ATOMIC_RELEASE);
+	return len;
+}
+
+Machine::address_t Machine::map_channel(Channel& channel, address_t addr)
+{
+	if (addr == 0)
+		addr = this->mmap_allocate(channel.size(), PROT_READ | PROT_WRITE, true);
+	if (addr & (CHANNEL_ALIGN - 1))
+		throw MachineException("Channel address must be 2MB aligned", addr);
+	if (addr + channel.size() > this->max_address())
+		throw MachineException("Channel does not fit in guest memory", addr);
+	auto& range = this->map_host_range(addr, channel.ptr(), channel.size(),
+		PROT_READ | PROT_WRITE, false, "[channel]");
+	range.external = true;
+	return addr;
+}
+
+} // tinykvm
@@ -0,0 +1,52 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace tinykvm {
+
+/* A ring channel between VMs: one region of host memory that is mapped
+   into every VM it is given to with Machine::map_channel(), so that a
+   producer can stream data to a consumer without copies or remote calls.
+   The first page holds the ring header, and the ring data follows it.
+   The protocol is single-producer single-consumer: the producer only
+   advances head and the consumer only advances tail, and both are byte
+   counters that never wrap. See guest/src/api.hpp for the guest side.
+   The channel must outlive the VMs it is mapped into, and forks of a
+   VM share its channels. */
+struct Channel {
+	static constexpr uint32_t MAGIC = 0x43485231; // "CHR1"
+	static constexpr size_t HEADER_SIZE = 4096;
+	struct Header {
+		uint32_t magic;
+		uint32_t data_offset;
+		uint64_t capacity;
+		alignas(64) uint64_t head; // Bytes written, only written by the producer
+		alignas(64) uint64_t tail; // Bytes read, only written by the consumer
+	};
+
+	/* The mapping is rounded up to whole 2MB pages, with the
+	   rest of them given to the ring. */
+	Channel(size_t capacity);
+	~Channel();
+	Channel(const Channel&) = delete;
+	Channel& operator=(const Channel&) = delete;
+
+	Header& header() noexcept { return *(Header *)m_ptr; }
+	char* data() noexcept { return m_ptr + HEADER_SIZE; }
+	char* ptr() noexcept { return m_ptr; }
+	size_t size() const noexcept { return m_size; }
+	size_t capacity() const noexcept { return m_size - HEADER_SIZE; }
+	size_t readable() const noexcept;
+	size_t writable() const noexcept;
+
+	/* Host side of the protocol. Returns the number of bytes written
+	   or read, which is less than @len when the ring is full or empty. */
+	size_t write(const void* data, size_t len);
+	size_t read(void* data, size_t len);
+
+private:
+	char*  m_ptr = nullptr;
+	size_t m_size = 0;
+};
+
+} // tinykvm
@@ -0,0 +1,109 @@
+#pragma once
+#include "machine.hpp"
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <utility>
+
+namespace tinykvm
+{
+	/// @brief The coroutine returned by co_vmcall(). It starts running the
+	/// guest right away, and is done once the guest function has returned.
+	/// Until then, it can be co_await'ed from another coroutine, which is
+	/// resumed when the call completes.
+	struct VMTask {
+		struct promise_type;
+		using handle_t = std::coroutine_handle<promise_type>;
+
+		struct promise_type {
+			long result = 0;
+			std::exception_ptr exception;
+			std::coroutine_handle<> continuation;
+
+			VMTask get_return_object() noexcept {
+				return VMTask{handle_t::from_promise(*this)};
+			}
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			auto final_suspend() noexcept {
+				struct FinalAwaiter {
+					bool await_ready() const noexcept { return false; }
+					std::coroutine_handle<> await_suspend(handle_t h) noexcept {
+						if (auto next = h.promise().continuation)
+							return next;
+						return std::noop_coroutine();
+					}
+					void await_resume() const noexcept {}
+				};
+				return FinalAwaiter{};
+			}
+			void return_value(long value) noexcept { this->result = value; }
+			void unhandled_exception() noexcept { this->exception = std::current_exception(); }
+		};
+
+		bool done() const noexcept { return m_handle.done(); }
+		/// @return The return value of the guest function. Rethrows
+		/// any exception from running the guest.
+		long result() const {
+			if (m_handle.promise().exception)
+				std::rethrow_exception(m_handle.promise().exception);
+			return m_handle.promise().result;
+		}
+
+		bool await_ready() const noexcept { return this->done(); }
+		void await_suspend(std::coroutine_handle<> waiter) noexcept {
+			m_handle.promise().continuation = waiter;
+		}
+		long await_resume() const { return this->result(); }
+
+		VMTask(VMTask&& other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+		VMTask& operator=(VMTask&&) = delete;
+		~VMTask() {
+			if (m_handle)
+				m_handle.destroy();
+		}
+
+	private:
+		explicit VMTask(handle_t h) noexcept : m_handle(h) {}
+		handle_t m_handle;
+	};
+
+	/// @brief The reactor of the caller. It is handed the host fds that a
+	/// suspended VM waits on, and must resume the coroutine handle once one
+	/// of them is ready, or when the timeout (in milliseconds, -1 for none)
+	/// has expired. The handle may be resumed from within the reactor.
+	using IOReactor = std::function<void(const Machine::IOWait&, std::coroutine_handle<>)>;
+
+	/// @brief Make a SYSV function call into the VM, like timed_vmcall(),
+	/// except that a guest blocking in epoll_wait, poll or accept4 suspends
+	/// the call instead of the host thread. The fds are handed to @reactor,
+	/// and once it resumes the coroutine, the system call is completed and
+	/// the guest continues. Each run of the guest is limited by @timeout,
+	/// while time spent waiting for I/O is up to the reactor.
+	/// @return A coroutine that produces the return value of the function.
+	template <typename... Args>
+	VMTask co_vmcall(Machine& machine, IOReactor reactor,
+		Machine::address_t addr, float timeout, Args... args)
+	{
+		struct IOAwaiter {
+			Machine& machine;
+			const IOReactor& reactor;
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> h) {
+				reactor(machine.io_wait(), h);
+			}
+			void await_resume() const noexcept {}
+		};
+		struct SuspendGuard {
+			Machine& machine;
+			~SuspendGuard() { machine.set_io_suspend(false); }
+		} guard { machine };
+
+		machine.set_io_suspend(true);
+		machine.timed_vmcall(addr, timeout, args...);
+		while (machine.io_pending()) {
+			co_await IOAwaiter{machine, reactor};
+			machine.resume_io(timeout);
+		}
+		co_return machine.return_value();
+	}
+}
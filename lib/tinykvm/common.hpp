@@ -16,6 +16,7 @@
 #include <array>
 #include <cstdint>
 #include <exception>
+#include <span>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -31,6 +32,13 @@ namespace tinykvm
 		bool     blackout = false; /* Unmapped virtual area */
 	};
 
+	/* A page found by Machine::harvest_accessed_pages() */
+	struct AccessedPage {
+		uint64_t addr; /* Guest virtual address */
+		uint64_t size; /* 4KB, 2MB or 1GB */
+		bool     dirty;
+	};
+
 	struct MachineProfiling {
 		enum Location {
 			VCpuRun = 0,
@@ -42,18 +50,140 @@ namespace tinykvm
 			UserDefined = 6,
 			Count = 7
 		};
+		// A fixed-size log-linear histogram of nanosecond samples.
+		// Each power of two is split into 2^SUB_BITS linear buckets,
+		// bounding the relative error to 1/2^SUB_BITS (12.5%).
+		struct Histogram {
+			static constexpr unsigned SUB_BITS = 3;
+			static constexpr unsigned SUB_BUCKETS = 1u << SUB_BITS;
+			static constexpr unsigned MAX_EXPONENT = 43; // ~2.4 hours
+			static constexpr unsigned BUCKETS = (MAX_EXPONENT - SUB_BITS + 2) * SUB_BUCKETS;
+
+			uint64_t count = 0;
+			uint64_t total = 0;
+			uint64_t min = UINT64_MAX;
+			uint64_t max = 0;
+			std::array<uint64_t, BUCKETS> buckets {};
+
+			static constexpr unsigned bucket_of(uint64_t value) noexcept {
+				if (value < SUB_BUCKETS)
+					return value;
+				unsigned exponent = 63 - __builtin_clzll(value);
+				if (exponent > MAX_EXPONENT)
+					return BUCKETS - 1;
+				const unsigned sub = (value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1);
+				return (exponent - SUB_BITS + 1) * SUB_BUCKETS + sub;
+			}
+			/* The lowest value that lands in the given bucket */
+			static constexpr uint64_t value_of(unsigned bucket) noexcept {
+				if (bucket < SUB_BUCKETS)
+					return bucket;
+				const unsigned exponent = bucket / SUB_BUCKETS + SUB_BITS - 1;
+				const uint64_t sub = bucket % SUB_BUCKETS;
+				return (uint64_t(1) << exponent) | (sub << (exponent - SUB_BITS));
+			}
+			void record(uint64_t value) noexcept {
+				count++;
+				total += value;
+				if (value < min) min = value;
+				if (value > max) max = value;
+				buckets[bucket_of(value)]++;
+			}
+			/* The approximate value at the given percentile (0-100) */
+			uint64_t percentile(double pct) const noexcept;
+			void merge(const Histogram& other) noexcept;
+			void reset() noexcept { *this = Histogram{}; }
+		};
+		// Per-system-call statistics, with a coarse power-of-two
+		// histogram of host nanoseconds spent in the handler.
+		struct SyscallStats {
+			static constexpr unsigned BUCKETS = 32; // Up to ~4 seconds
+			uint64_t count = 0;
+			uint64_t total_ns = 0;
+			uint64_t max_ns = 0;
+			std::array<uint64_t, BUCKETS> log2_buckets {};
+
+			void record(uint64_t ns) noexcept {
+				count++;
+				total_ns += ns;
+				if (ns > max_ns) max_ns = ns;
+				const unsigned bucket = (ns == 0) ? 0 : 64 - __builtin_clzll(ns);
+				log2_buckets[(bucket < BUCKETS) ? bucket : BUCKETS - 1]++;
+			}
+			uint64_t avg_ns() const noexcept { return count ? total_ns / count : 0; }
+		};
 		// Each entry contains a list of times in nanoseconds
 		std::array<std::vector<uint64_t>, Count> times;
+		// Low-overhead mode: Samples are timed with the TSC and
+		// counted in bounded histograms, instead of being stored
+		// in the times vectors. Memory usage stays constant.
+		bool use_histograms = false;
+		std::array<Histogram, Count> histograms;
+		// Indexed by system call number. Empty unless enabled with
+		// enable_syscall_stats(), which makes Machine::system_call()
+		// time every handler.
+		std::vector<SyscallStats> syscalls;
+		void enable_syscall_stats() {
+			calibrate_tsc();
+			syscalls.resize(TINYKVM_MAX_SYSCALLS);
+		}
+		bool has_syscall_stats() const noexcept { return !syscalls.empty(); }
+		void record_syscall(unsigned nr, uint64_t ns) noexcept {
+			if (nr < syscalls.size())
+				syscalls[nr].record(ns);
+		}
+		// Visit every system call that has at least one sample
+		template <typename Callback>
+		void for_each_syscall(Callback&& callback) const {
+			for (unsigned nr = 0; nr < syscalls.size(); nr++)
+				if (syscalls[nr].count != 0)
+					callback(nr, syscalls[nr]);
+		}
 		// Print profiling results. Side effect: *sorts vectors*
 		// when user_defined is non-empty, it will use that label
 		// instead of "UserDefined"
 		void print(const char* user_defined = "") const;
+		// Add the samples of another machine, eg. to aggregate
+		// the profiling of many VMs. Both modes are merged.
+		void merge(const MachineProfiling& other);
 		// Clear all profiling samples
 		void reset() {
 			for (auto& vec : times)
 				vec.clear();
+			for (auto& hist : histograms)
+				hist.reset();
+			for (auto& stats : syscalls)
+				stats = SyscallStats{};
 		}
 		void clear() { reset(); } // Alias
+
+		// Time stamp counter, converted to nanoseconds with a
+		// multiplier calibrated by calibrate_tsc().
+		static uint64_t tsc() noexcept {
+#if defined(__x86_64__)
+			return __builtin_ia32_rdtsc();
+#else
+			return monotonic_ns();
+#endif
+		}
+		static uint64_t tsc_to_ns(uint64_t ticks) noexcept {
+			return (unsigned __int128)ticks * tsc_ns_multiplier >> 32;
+		}
+		static void calibrate_tsc();
+		static uint64_t monotonic_ns() noexcept;
+		static inline uint64_t tsc_ns_multiplier = 1ULL << 32;
+	};
+
+	/* The CPU features presented to the guest. Host passes on everything
+	   KVM supports. The x86-64 psABI levels only present the instruction
+	   set extensions of that level, together with a matching XSAVE state,
+	   so that a snapshot made on one host can be loaded on any host that
+	   supports the level. */
+	enum class CPUBaseline : uint8_t {
+		Host = 0,
+		X86_64_V2 = 2, /* SSE4.2, POPCNT, CX16 */
+		X86_64_V3 = 3, /* AVX2, FMA, BMI1/2, MOVBE */
+		X86_64_V4 = 4, /* AVX-512 F, BW, CD, DQ, VL */
 	};
 
 	struct MachineOptions {
@@ -61,24 +191,73 @@ namespace tinykvm
 		uint32_t max_cow_mem = 0;
 		uint32_t stack_size = 1600UL << 10; /* 1600KB */
 		uint32_t reset_free_work_mem = 0; /* reset_to() */
+		/* When non-zero, reset_to() pre-populates up to this many
+		   pages that were faulted in by the previous requests,
+		   moving the page faults off the next request. */
+		uint32_t reset_prefetch_pages = 0;
+		/* The number of previous requests that make up the working set */
+		uint32_t reset_prefetch_history = 1;
 		uint64_t dylink_address_hint = 0x200000; /* 2MB */
 		uint64_t heap_address_hint = 0;
+		/* The size of the brk area, reserved up front next to the stack.
+		   Its pages are only faulted in when used, so brk-based allocators
+		   can be given room to grow in large steps. 0 means BRK_MAX. */
+		uint64_t brk_size = 0;
 		uint64_t vmem_base_address = 0;
 		std::string_view binary = {};
 		std::vector<VirtualRemapping> remappings {};
 
 		bool verbose_loader = false;
+		/* Append the functions of the loaded program to the perf map
+		   of this process, /tmp/perf-<pid>.map, so that host perf can
+		   name guest code. See Machine::write_perf_map(). */
+		bool perf_map = false;
 		bool short_lived = false;
 		bool hugepages = false;
 		bool transparent_hugepages = false;
+		/* NUMA placement of main memory and memory banks: bind them
+		   to numa_node, or interleave them across all nodes. By default
+		   memory ends up on the node that first touches it. */
+		int  numa_node = -1;
+		bool numa_interleave = false;
+		/* When enabled, a fork reads a copy of the master's main memory
+		   on its own node (numa_node, or the node it is created on),
+		   made by the first fork on that node. The master must not
+		   write to its main memory afterwards. */
+		bool numa_replicate_master = false;
 		/* When enabled, master VMs will write directly
 		   to their own main memory instead of memory banks,
 		   allowing forks to immediately see changes. */
 		bool master_direct_memory_writes = false;
 		/* When enabled, split hugepages during page faults. */
 		bool split_hugepages = false;
-		/* When enabled, reset_to() will accept a different
-		   master VM than the original, but at a steep cost. */
+		/* When enabled, the page directories of each gigabyte of main
+		   memory are only filled in when first used, by a page fault or
+		   by the host, instead of when the machine is constructed.
+		   The first gigabyte, and the ones with ELF segments, are always
+		   filled in. Everything is filled in by prepare_copy_on_write(). */
+		bool lazy_page_tables = false;
+		/* With split_hugepages, forks still copy whole 2MB pages on
+		   write inside the brk heap and/or the mmap arena, where big
+		   allocations live, as long as the memory banks have room
+		   for a hugepage. Other regions are split into 4k pages. */
+		bool hugepage_cow_heap = false;
+		bool hugepage_cow_mmap = false;
+		/* When non-zero, a page fault on a copy-on-write page also
+		   prepares up to this many following pages in the same 2MB
+		   region. The window adapts to how sequential the faults are. */
+		uint16_t page_fault_around = 0;
+		/* When enabled, zeroing whole copy-on-write pages in a fork
+		   (eg. anonymous mmap, MADV_DONTNEED) maps a shared read-only
+		   zero page instead of allocating a private page. A private
+		   page is only allocated once the guest writes to it.
+		   Not used together with reset_keep_all_work_memory. */
+		bool shared_zero_page = false;
+		/* When enabled, reset_to() will accept a different master VM
+		   than the original, eg. a new version of the program. The fork
+		   keeps its VM, vCPU and memory banks, and swaps in the main
+		   memory, page tables, mmap ranges and file descriptors of the
+		   new master. Both masters must have the same CPU baseline. */
 		bool allow_reset_to_new_master = false;
 		/* When enabled, reset_to() will copy all registers
 		   from the master VM to the new VM. */
@@ -90,16 +269,120 @@ namespace tinykvm
 		   from the master VM to the forked VM instead of
 		   resetting the memory banks. */
 		bool reset_keep_all_work_memory = false;
+		/* When enabled together with reset_keep_all_work_memory,
+		   the memory banks are registered with KVM dirty page
+		   logging, and reset_to() only restores pages that were
+		   written since the previous reset. Must be set when
+		   the VM is forked, as it applies to new banks. */
+		bool reset_dirty_page_logging = false;
+		/* When enabled, the page-table pages of a fork are kept in
+		   their own memory banks across full resets. reset_to() then
+		   only restores their entries from the master, instead of
+		   cloning the page tables again during the next request.
+		   Must be set when the VM is forked. */
+		bool reset_keep_page_tables = false;
+		/* Allocate memory banks from the process-wide MemoryBankArena,
+		   recycling them between VMs instead of mmap/munmap. */
+		bool shared_bank_arena = false;
 		/* Force-relocate fixed addresses with mmap(). */
 		bool relocate_fixed_mmap = true;
 		/* Make heap executable, to support JIT. */
 		bool executable_heap = false;
+		/* Load dynamic executables (eg. the dynamic linker) from a
+		   process-wide cache of relocated images, see ProgramImage.
+		   Only the first machine for a binary parses and relocates it. */
+		bool cache_dynamic_images = false;
+		/* Map a vDSO into the guest and pass it on with AT_SYSINFO_EHDR,
+		   so that clock_gettime(), gettimeofday() and time() can read
+		   the KVM clock directly, without a system call. */
+		bool vdso = false;
+		/* Use the process-wide TimeoutEngine thread for execution
+		   timeouts, instead of a POSIX timer per vCPU. Scales to
+		   many VMs, as it creates no kernel timers per VM. */
+		bool shared_timeout_engine = false;
+		/* Fast execution timeouts: the per-vCPU timer is one-shot and
+		   left armed between calls, so that back-to-back timed calls
+		   only re-arm it when the new deadline is earlier. A signal
+		   that arrives before the current deadline (or from a stale
+		   timer of another VM on the same thread) is ignored, and
+		   one that arrives outside of KVM_RUN sets immediate_exit, so
+		   a timeout is never lost. Once the deadline has passed, the
+		   signal repeats every 20ms until the call ends, so that
+		   blocking host system calls are interrupted too.
+		   Not used with shared_timeout_engine. */
+#ifdef TINYKVM_FAST_EXECUTION_TIMEOUT
+		bool fast_execution_timeout = true;
+#else
+		bool fast_execution_timeout = false;
+#endif
+		/* Execution timeouts from the local APIC of the vCPU, in
+		   TSC-deadline mode, instead of a host timer and signal.
+		   The timer interrupt exits to the host, which checks the
+		   deadline. Arming only writes the deadline MSR, and only
+		   when no earlier deadline is pending. Blocking host system
+		   calls are never interrupted, so a call that blocks in the
+		   host can run past its timeout. Guests
+		   run with IOPL 3 and can mask interrupts, so this is only
+		   for trusted guests. Requires KVM_CAP_TSC_DEADLINE_TIMER,
+		   and overrides the shared and fast timeouts. Not used by
+		   SMP vCPUs. */
+		bool lapic_timer = false;
+		/* Sparse main memory: max_mem is only reserved, and host pages
+		   are populated on first touch. A master VM gives the pages back
+		   when its guest unmaps memory, or zeroes 2MB or more of it, and
+		   prepare_copy_on_write() gives back every page that only holds
+		   zeroes, so that large masters only cost what they use. Only
+		   for private anonymous main memory, without hugepages. */
+		bool sparse_main_memory = false;
 		/* Enable file-backed memory mappings for large files */
 		bool mmap_backed_files = false;
+		/* Share read-only file-backed mappings with every other VM in
+		   the process, through the FileMappingCache. The memory slot
+		   of each mapping is read-only, so no VM can modify it. */
+		bool shared_file_mappings = false;
+		/* The file that the binary was read from. The whole pages of
+		   read-only PT_LOAD segments are then mapped privately from the
+		   file, instead of being copied into guest memory, so machines
+		   loading the same program share them in the page cache. Only
+		   used with plain anonymous main memory (no hugepages, snapshot
+		   or memory file). The file must not change while in use. */
+		std::string binary_file;
+		/* The CPU features presented to the guest. It is recorded in
+		   snapshots, and a snapshot can only be loaded with the same
+		   baseline. Forks use the baseline of their master. */
+		CPUBaseline cpu_baseline = CPUBaseline::Host;
 		/* Enable VM snapshot by file-mapping all physical memory
 		   to the given file. The file is created if it does not exist,
 		   and must be of the correct size if it does exist. */
 		std::string snapshot_file;
+		/* Delta snapshots to stack on top of snapshot_file, in order.
+		   Each one only has the pages that changed since the snapshots
+		   below it, see Machine::save_snapshot_delta(). */
+		std::vector<std::string> snapshot_deltas;
+		/* Restore an existing snapshot_file on demand with userfaultfd,
+		   instead of mapping it. Pages are read from the file when first
+		   touched, and the pages accessed when the snapshot was saved are
+		   prefetched in the background. */
+		bool snapshot_lazy_restore = false;
+		/* Prefault the pages that were accessed when the snapshot was
+		   saved, with this many threads, when loading a snapshot_file.
+		   When 0, the kernel is only advised that they will be needed. */
+		unsigned snapshot_prefault_threads = 0;
+		/* Load the VM from a packed snapshot, made with
+		   Machine::save_packed_snapshot(), instead of a snapshot_file.
+		   The memory is decompressed into anonymous memory, and the
+		   file itself is never modified. */
+		std::string snapshot_packed_file;
+		/* Keep main memory and the snapshot state area in an anonymous
+		   memory file, which other processes can attach to once it has
+		   been sealed with Machine::share_memory(). */
+		bool memfd_main_memory = false;
+		/* Attach to the main memory of a master in another process: a
+		   sealed memory file from Machine::share_memory(), eg. received
+		   with Machine::receive_memory_fd(). It is mapped privately, so
+		   it is never modified, and the snapshot state is loaded from it.
+		   The machine does not take ownership of the descriptor. */
+		int snapshot_memfd = -1;
 		/* When using hugepages, cover the given size with
 		   hugepages, unless 0, in which case the entire
 		   main memory will be covered. */
@@ -121,8 +404,20 @@ namespace tinykvm
 
 	class MachineTimeoutException: public MachineException {
 	public:
-		using MachineException::MachineException;
+		MachineTimeoutException(const char* msg, uint64_t data = 0, uint64_t instructions = 0)
+			: MachineException(msg, data), m_instructions(instructions) {}
 		float seconds() const noexcept { return data() / 1000.0; }
+		/* Guest instructions retired before the timeout, when the
+		   machine has an instruction budget. Otherwise 0. */
+		uint64_t instructions() const noexcept { return m_instructions; }
+	private:
+		uint64_t m_instructions;
+	};
+
+	/* Thrown by a run that was cancelled with Machine::cancel() */
+	class MachineCancelledException: public MachineException {
+	public:
+		using MachineException::MachineException;
 	};
 
 	class MemoryException: public MachineException {
@@ -152,6 +447,18 @@ namespace tinykvm
 	template<class T>
 	struct is_stdstring : public std::is_same<T, std::basic_string<char>> {};
 
+	template<class T>
+	struct is_span : public std::false_type {};
+	template<class T, size_t Extent>
+	struct is_span<std::span<T, Extent>> : public std::true_type {};
+
+	/* The number of argument registers a vmcall argument takes.
+	   Spans and string views are passed as (pointer, length). */
+	template<class T>
+	constexpr unsigned vmcall_arg_registers =
+		(is_span<std::remove_cvref_t<T>>::value
+		|| std::is_same_v<std::remove_cvref_t<T>, std::string_view>) ? 2 : 1;
+
 	struct PerVCPUTable {
 		int cpuid;
 		int userval1;
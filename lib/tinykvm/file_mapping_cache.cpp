@@ -0,0 +1,118 @@
+#include "file_mapping_cache.hpp"
+
+#include <cstdio>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace tinykvm {
+static constexpr bool VERBOSE_MAPPING_CACHE = false;
+
+FileMappingCache& FileMappingCache::get()
+{
+	static FileMappingCache cache;
+	return cache;
+}
+
+FileMappingCache::~FileMappingCache()
+{
+	for (auto& [key, mapping] : m_mappings) {
+		munmap(mapping.ptr, mapping.size);
+	}
+}
+
+char* FileMappingCache::acquire(int fd, const struct stat& st, int64_t offset, size_t size)
+{
+	const Key key { uint64_t(st.st_dev), uint64_t(st.st_ino), offset, size,
+		int64_t(st.st_mtim.tv_sec) * 1'000'000'000LL + st.st_mtim.tv_nsec };
+
+	std::scoped_lock lock(m_mtx);
+	auto it = m_mappings.find(key);
+	if (it != m_mappings.end()) {
+		auto& mapping = it->second;
+		if (mapping.refs++ == 0) {
+			m_idle.erase(mapping.idle);
+			m_idle_bytes -= mapping.size;
+		}
+		m_hits++;
+		return mapping.ptr;
+	}
+
+	/* Nothing may ever write to a mapping that other VMs can see */
+	void* ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, offset);
+	if (ptr == MAP_FAILED) {
+		return nullptr;
+	}
+	m_misses++;
+	auto& mapping = m_mappings[key];
+	mapping.ptr = (char*)ptr;
+	mapping.size = size;
+	mapping.refs = 1;
+	m_by_ptr.emplace(mapping.ptr, key);
+	if constexpr (VERBOSE_MAPPING_CACHE) {
+		fprintf(stderr, "FileMappingCache: mapped %zu kB of inode %lu at %p\n",
+			size >> 10, (unsigned long)st.st_ino, ptr);
+	}
+	return mapping.ptr;
+}
+
+void FileMappingCache::release(const char* ptr)
+{
+	std::scoped_lock lock(m_mtx);
+	auto pit = m_by_ptr.find(ptr);
+	if (pit == m_by_ptr.end())
+		return;
+	auto& mapping = m_mappings.at(pit->second);
+	if (--mapping.refs == 0) {
+		mapping.idle = m_idle.insert(m_idle.end(), pit->second);
+		m_idle_bytes += mapping.size;
+		this->evict_idle();
+	}
+}
+
+void FileMappingCache::evict_idle()
+{
+	/* Must be called with the lock held */
+	while (m_idle_bytes > m_max_idle_bytes && !m_idle.empty()) {
+		auto it = m_mappings.find(m_idle.front());
+		m_idle.pop_front();
+		auto& mapping = it->second;
+		if constexpr (VERBOSE_MAPPING_CACHE) {
+			fprintf(stderr, "FileMappingCache: evicting %zu kB at %p\n",
+				mapping.size >> 10, mapping.ptr);
+		}
+		munmap(mapping.ptr, mapping.size);
+		m_idle_bytes -= mapping.size;
+		m_by_ptr.erase(mapping.ptr);
+		m_mappings.erase(it);
+	}
+}
+
+void FileMappingCache::set_max_idle_bytes(size_t bytes)
+{
+	std::scoped_lock lock(m_mtx);
+	m_max_idle_bytes = bytes;
+	this->evict_idle();
+}
+
+size_t FileMappingCache::mappings() const
+{
+	std::scoped_lock lock(m_mtx);
+	return m_mappings.size();
+}
+size_t FileMappingCache::idle_bytes() const
+{
+	std::scoped_lock lock(m_mtx);
+	return m_idle_bytes;
+}
+uint64_t FileMappingCache::hits() const
+{
+	std::scoped_lock lock(m_mtx);
+	return m_hits;
+}
+uint64_t FileMappingCache::misses() const
+{
+	std::scoped_lock lock(m_mtx);
+	return m_misses;
+}
+
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
+struct stat;
+
+namespace tinykvm {
+
+/* A process-wide cache of read-only host mappings of file ranges,
+   keyed by (device, inode, offset, size, mtime). Every VM that maps
+   the same range of an unchanged file attaches the same host memory
+   as a read-only memory slot, so only the first tenant pays for the
+   mmap and page cache population. Mappings are reference counted,
+   and unreferenced ones are kept until the idle limit is exceeded,
+   when the least recently used are unmapped. */
+struct FileMappingCache {
+	static constexpr size_t DEFAULT_MAX_IDLE_BYTES = 4ULL << 30; /* 4GB */
+	static FileMappingCache& get();
+
+	/* Returns a read-only mapping of [offset, offset + size) of fd,
+	   described by st, taking a reference. nullptr on failure. */
+	char* acquire(int fd, const struct stat& st, int64_t offset, size_t size);
+	/* Drops the reference taken by acquire(). */
+	void release(const char* ptr);
+
+	/* Limit of address space kept by unreferenced mappings */
+	void set_max_idle_bytes(size_t bytes);
+	size_t mappings() const;
+	size_t idle_bytes() const;
+	uint64_t hits() const;
+	uint64_t misses() const;
+
+	~FileMappingCache();
+private:
+	FileMappingCache() = default;
+	/* dev, ino, offset, size, mtime in nanoseconds */
+	using Key = std::tuple<uint64_t, uint64_t, int64_t, size_t, int64_t>;
+	struct Mapping {
+		char*    ptr = nullptr;
+		size_t   size = 0;
+		unsigned refs = 0;
+		std::list<Key>::iterator idle; // Valid when refs == 0
+	};
+	void evict_idle();
+
+	mutable std::mutex m_mtx;
+	std::map<Key, Mapping> m_mappings;
+	std::unordered_map<const char*, Key> m_by_ptr;
+	std::list<Key> m_idle; // Least recently released first
+	size_t   m_idle_bytes = 0;
+	size_t   m_max_idle_bytes = DEFAULT_MAX_IDLE_BYTES;
+	uint64_t m_hits = 0;
+	uint64_t m_misses = 0;
+};
+
+}
@@ -0,0 +1,154 @@
+#include "kvm_pool.hpp"
+
+#include "machine.hpp"
+#include <chrono>
+#include <cstdio>
+#include <unistd.h>
+
+namespace tinykvm {
+static constexpr bool VERBOSE_KVM_POOL = false;
+extern void create_kvm_vcpu(int vm_fd, int cpu_id, int& vcpu_fd, struct kvm_run*& run);
+extern void destroy_kvm_vcpu(int vcpu_fd, struct kvm_run* run);
+
+KvmPool& KvmPool::get()
+{
+	static KvmPool pool;
+	return pool;
+}
+KvmPool::~KvmPool()
+{
+	this->stop();
+}
+
+KvmPool::Entry KvmPool::create()
+{
+	Entry entry;
+	entry.vm_fd = Machine::create_kvm_vm();
+	try {
+		create_kvm_vcpu(entry.vm_fd, 0, entry.vcpu_fd, entry.kvm_run);
+	} catch (...) {
+		close(entry.vm_fd);
+		throw;
+	}
+	return entry;
+}
+void KvmPool::destroy(Entry& entry)
+{
+	destroy_kvm_vcpu(entry.vcpu_fd, entry.kvm_run);
+	close(entry.vm_fd);
+}
+
+void KvmPool::start(size_t depth)
+{
+	std::unique_lock lock(m_mtx);
+	if (depth == 0) {
+		lock.unlock();
+		this->stop();
+		return;
+	}
+	this->m_depth = depth;
+	this->m_ready.reserve(depth);
+	if (!m_thread.joinable()) {
+		this->m_stop = false;
+		this->m_thread = std::thread(&KvmPool::refill_loop, this);
+	}
+	m_cond.notify_all();
+}
+
+void KvmPool::stop()
+{
+	{
+		std::scoped_lock lock(m_mtx);
+		this->m_stop = true;
+		this->m_depth = 0;
+	}
+	m_cond.notify_all();
+	m_full.notify_all();
+	if (m_thread.joinable())
+		m_thread.join();
+
+	std::scoped_lock lock(m_mtx);
+	for (auto& entry : m_ready)
+		destroy(entry);
+	m_ready.clear();
+}
+
+bool KvmPool::running() const
+{
+	std::scoped_lock lock(m_mtx);
+	return this->m_depth > 0;
+}
+
+bool KvmPool::take(Entry& entry)
+{
+	std::scoped_lock lock(m_mtx);
+	if (m_depth == 0)
+		return false;
+	if (m_ready.empty()) {
+		this->m_misses++;
+		return false;
+	}
+	entry = m_ready.back();
+	m_ready.pop_back();
+	this->m_taken++;
+	m_cond.notify_one();
+	return true;
+}
+
+void KvmPool::refill_loop()
+{
+	std::unique_lock lock(m_mtx);
+	while (!m_stop)
+	{
+		if (m_ready.size() >= m_depth) {
+			m_full.notify_all();
+			m_cond.wait(lock, [this] { return m_stop || m_ready.size() < m_depth; });
+			continue;
+		}
+		/* Create outside of the lock, so that take() never waits
+		   for the kernel. */
+		lock.unlock();
+		Entry entry;
+		bool created = false;
+		try {
+			entry = create();
+			created = true;
+		} catch (const std::exception& e) {
+			if constexpr (VERBOSE_KVM_POOL) {
+				fprintf(stderr, "KvmPool: %s\n", e.what());
+			}
+		}
+		lock.lock();
+		if (!created) {
+			/* Out of file descriptors or similar, back off for a while */
+			m_cond.wait_for(lock, std::chrono::milliseconds(100), [this] { return m_stop; });
+			continue;
+		}
+		if (m_stop || m_ready.size() >= m_depth) {
+			destroy(entry);
+			continue;
+		}
+		m_ready.push_back(entry);
+		this->m_created++;
+	}
+	m_full.notify_all();
+}
+
+void KvmPool::wait_until_full() const
+{
+	std::unique_lock lock(m_mtx);
+	m_full.wait(lock, [this] { return m_stop || m_depth == 0 || m_ready.size() >= m_depth; });
+}
+
+KvmPool::Stats KvmPool::stats() const
+{
+	std::scoped_lock lock(m_mtx);
+	return Stats {
+		.ready = m_ready.size(),
+		.created = m_created,
+		.taken = m_taken,
+		.misses = m_misses,
+	};
+}
+
+} // tinykvm
@@ -0,0 +1,67 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+struct kvm_run;
+
+namespace tinykvm {
+
+/* A process-wide pool of pre-created KVM VMs. Each entry is a VM
+   file descriptor together with its first vCPU, which has kvm_run
+   mapped and the CPUID features assigned. Creating these is kernel
+   work that costs hundreds of microseconds and serializes on KVM
+   locks, so once started, a background thread keeps the pool topped
+   up and new machines (including forks) take their VM from it. When
+   the pool is empty or not started, machines create their VM inline
+   as before. The pool must be started after Machine::init(). */
+struct KvmPool {
+	struct Entry {
+		int vm_fd = -1;
+		int vcpu_fd = -1;
+		struct kvm_run* kvm_run = nullptr;
+	};
+	struct Stats {
+		size_t   ready = 0;   // Entries ready to be taken
+		uint64_t created = 0; // Entries created by the refill thread
+		uint64_t taken = 0;   // Entries taken by new machines
+		uint64_t misses = 0;  // Machines that found the pool empty
+	};
+	static KvmPool& get();
+
+	/* Keep @depth VMs ready, creating them in the background.
+	   Calling start() again changes the depth. */
+	void start(size_t depth);
+	/* Stop the refill thread and close the VMs that are ready. */
+	void stop();
+	bool running() const;
+
+	/* Take a ready VM. Returns false when none are ready. */
+	bool take(Entry&);
+
+	/* Wait until the pool is full, or it stops. */
+	void wait_until_full() const;
+	Stats stats() const;
+	~KvmPool();
+
+private:
+	KvmPool() = default;
+	void refill_loop();
+	static Entry create();
+	static void destroy(Entry&);
+
+	mutable std::mutex m_mtx;
+	mutable std::condition_variable m_cond;
+	mutable std::condition_variable m_full;
+	std::vector<Entry> m_ready;
+	size_t   m_depth = 0;
+	uint64_t m_created = 0;
+	uint64_t m_taken = 0;
+	uint64_t m_misses = 0;
+	bool     m_stop = false;
+	std::thread m_thread;
+};
+
+} // tinykvm
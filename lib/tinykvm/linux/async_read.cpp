@@ -0,0 +1,129 @@
+#include "async_read.hpp"
+
+#include "../machine.hpp"
+#include "../util/threadpool.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace tinykvm
+{
+	AsyncFileRead::AsyncFileRead()
+	{
+		m_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (m_event_fd < 0) {
+			throw MachineException("AsyncFileRead: Failed to create eventfd");
+		}
+	}
+	AsyncFileRead::~AsyncFileRead()
+	{
+		if (this->in_flight())
+			this->complete();
+		close(m_event_fd);
+	}
+
+	void AsyncFileRead::submit(ThreadPool& pool, int fd, std::vector<struct iovec> iov,
+		int64_t offset, int64_t completed)
+	{
+		m_completed = completed;
+		m_result = pool.enqueue([fd, iov = std::move(iov), offset, efd = m_event_fd] () -> int64_t {
+			const ssize_t len = (offset >= 0)
+				? preadv(fd, iov.data(), iov.size(), offset)
+				: readv(fd, iov.data(), iov.size());
+			const int64_t result = (len < 0) ? -errno : len;
+			const uint64_t one = 1;
+			[[maybe_unused]] ssize_t res = write(efd, &one, sizeof(one));
+			return result;
+		});
+	}
+
+	int64_t AsyncFileRead::complete()
+	{
+		const int64_t result = m_result.get();
+		uint64_t count;
+		[[maybe_unused]] ssize_t res = read(m_event_fd, &count, sizeof(count));
+		// A failure after a partial read is reported as the partial read
+		if (result < 0 && m_completed > 0)
+			return m_completed;
+		return (result < 0) ? result : m_completed + result;
+	}
+
+	/* Skip the first @bytes of the iovecs */
+	static std::vector<struct iovec> iovec_remainder(const struct iovec* iov, unsigned count, size_t bytes)
+	{
+		std::vector<struct iovec> result;
+		result.reserve(count);
+		for (unsigned i = 0; i < count; i++) {
+			if (bytes >= iov[i].iov_len) {
+				bytes -= iov[i].iov_len;
+				continue;
+			}
+			result.push_back({(char *)iov[i].iov_base + bytes, iov[i].iov_len - bytes});
+			bytes = 0;
+		}
+		return result;
+	}
+
+	bool Machine::offload_file_read(vCPU& cpu, int fd, const struct iovec* iov, unsigned count,
+		int64_t offset, int64_t& result)
+	{
+		if (LIKELY(!m_io_suspend) || m_file_read_pool == nullptr || &cpu != &this->vcpu)
+			return false;
+		if (m_io_wait.resumed && m_async_read != nullptr && m_async_read->in_flight()) {
+			/* The read has completed on the pool */
+			m_io_wait.resumed = false;
+			result = m_async_read->complete();
+			return true;
+		}
+
+		size_t total = 0;
+		for (unsigned i = 0; i < count; i++)
+			total += iov[i].iov_len;
+		/* Reads that the page cache can serve complete right away */
+		const ssize_t len = preadv2(fd, iov, count, offset, RWF_NOWAIT);
+		if (len == ssize_t(total) || len == 0) {
+			result = len;
+			return true;
+		}
+		if (len < 0 && errno != EAGAIN)
+			return false; // Eg. not supported: read the usual way
+		struct stat st;
+		if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+			/* Pipes and sockets: a short read is complete, and an empty
+			   one is up to the caller, which may wait with poll. */
+			if (len > 0) {
+				result = len;
+				return true;
+			}
+			return false;
+		}
+		/* A short read that reached the end of the file is complete */
+		if (len > 0) {
+			const off_t position = (offset >= 0) ? off_t(offset + len) : lseek(fd, 0, SEEK_CUR);
+			if (position >= st.st_size) {
+				result = len;
+				return true;
+			}
+		}
+
+		/* The rest of the read would block on the disk, so the pool
+		   does it while the VM is suspended on the completion event. */
+		const int64_t completed = std::max(len, ssize_t(0));
+		if (m_async_read == nullptr)
+			m_async_read.reset(new AsyncFileRead);
+		m_async_read->submit(*m_file_read_pool, fd, iovec_remainder(iov, count, completed),
+			(offset >= 0) ? offset + completed : -1, completed);
+		m_io_wait.fds.assign(1, {m_async_read->event_fd(), POLLIN, 0});
+		m_io_wait.syscall_nr = cpu.registers().rax;
+		m_io_wait.timeout_ms = -1;
+		m_io_wait.pending = true;
+		cpu.stop();
+		return true;
+	}
+
+	void Machine::set_file_read_pool(std::shared_ptr<ThreadPool> pool)
+	{
+		m_file_read_pool = std::move(pool);
+	}
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <future>
+#include <vector>
+#include <sys/uio.h>
+
+namespace tinykvm
+{
+	class ThreadPool;
+
+	/// @brief A read from a host file that runs on a thread pool while the
+	/// main vCPU of a VM is suspended, see Machine::offload_file_read().
+	/// The data is read straight into guest memory, and completion is
+	/// signalled on an eventfd, which the VM waits on like any other fd.
+	struct AsyncFileRead
+	{
+		AsyncFileRead();
+		/// @brief Waits for a read in flight, as it writes to guest memory.
+		~AsyncFileRead();
+
+		/// @brief Start reading into @iov on @pool. @offset is the file
+		/// offset, or -1 to read from (and advance) the current offset.
+		/// @completed bytes were already read, and are added to the result.
+		void submit(ThreadPool& pool, int fd, std::vector<struct iovec> iov,
+			int64_t offset, int64_t completed);
+		bool in_flight() const noexcept { return m_result.valid(); }
+		/// @brief Wait for the read to complete.
+		/// @return The number of bytes read, or a negative errno.
+		int64_t complete();
+
+		int event_fd() const noexcept { return m_event_fd; }
+
+	private:
+		int m_event_fd = -1;
+		int64_t m_completed = 0;
+		std::future<int64_t> m_result;
+	};
+}
@@ -0,0 +1,208 @@
+#include "epoll_reactor.hpp"
+
+#include <array>
+#include <cerrno>
+#include <ctime>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace tinykvm {
+
+static uint64_t reactor_time_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1'000'000'000ULL + uint64_t(ts.tv_nsec);
+}
+
+static uint32_t poll_to_epoll_events(short events)
+{
+	uint32_t result = 0;
+	if (events & POLLIN)  result |= EPOLLIN;
+	if (events & POLLPRI) result |= EPOLLPRI;
+	if (events & POLLOUT) result |= EPOLLOUT;
+	if (events & POLLRDHUP) result |= EPOLLRDHUP;
+	return result;
+}
+
+EpollReactor::EpollReactor()
+	: m_epoll_fd(epoll_create1(EPOLL_CLOEXEC))
+{
+	if (m_epoll_fd < 0) {
+		throw MachineException("EpollReactor: Failed to create epoll fd", errno);
+	}
+}
+EpollReactor::~EpollReactor()
+{
+	close(m_epoll_fd);
+}
+
+IOReactor EpollReactor::reactor()
+{
+	return [this] (const Machine::IOWait& wait, std::coroutine_handle<> handle) {
+		this->suspend(wait, handle);
+	};
+}
+
+void EpollReactor::suspend(const Machine::IOWait& wait, std::coroutine_handle<> handle)
+{
+	auto& waiter = m_waiters.emplace_back();
+	waiter.handle = handle;
+	waiter.self = std::prev(m_waiters.end());
+	waiter.fds.reserve(wait.fds.size());
+
+	bool registered = true;
+	for (const auto& pfd : wait.fds) {
+		if (!this->add_interest(pfd.fd, poll_to_epoll_events(pfd.events), waiter)) {
+			/* Eg. regular files, which are always ready */
+			registered = false;
+			break;
+		}
+	}
+	if (!registered) {
+		waiter.fired = true;
+		m_ready.push_back(&waiter);
+	} else if (wait.timeout_ms >= 0) {
+		const uint64_t deadline = reactor_time_ns() + uint64_t(wait.timeout_ms) * 1'000'000ULL;
+		waiter.deadline = m_deadlines.emplace(deadline, &waiter);
+		waiter.has_deadline = true;
+	}
+}
+
+bool EpollReactor::add_interest(int fd, uint32_t events, Waiter& waiter)
+{
+	struct epoll_event ev {};
+	ev.data.fd = fd;
+	auto it = m_interests.find(fd);
+	if (it == m_interests.end()) {
+		ev.events = events | EPOLLONESHOT;
+		if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+			return false;
+		it = m_interests.emplace(fd, Interest{}).first;
+	} else {
+		/* Merge with the interests of the other waiters, which also
+		   re-arms an fd that fired for events that nobody waits for */
+		ev.events = it->second.events | events | EPOLLONESHOT;
+		if (epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0)
+			return false;
+	}
+	it->second.events |= events;
+	it->second.waiters.push_back(&waiter);
+	waiter.fds.emplace_back(fd, events);
+	return true;
+}
+
+void EpollReactor::update_interest(int fd)
+{
+	auto it = m_interests.find(fd);
+	if (it == m_interests.end())
+		return;
+	auto& interest = it->second;
+	if (interest.waiters.empty()) {
+		epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+		m_interests.erase(it);
+		return;
+	}
+	interest.events = 0;
+	for (const auto* waiter : interest.waiters) {
+		for (const auto& [wfd, events] : waiter->fds) {
+			if (wfd == fd)
+				interest.events |= events;
+		}
+	}
+	/* The one-shot registration is re-armed for the remaining waiters */
+	struct epoll_event ev {};
+	ev.events = interest.events | EPOLLONESHOT;
+	ev.data.fd = fd;
+	epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+std::coroutine_handle<> EpollReactor::remove(Waiter& waiter)
+{
+	for (const auto& [fd, events] : waiter.fds) {
+		auto it = m_interests.find(fd);
+		if (it != m_interests.end())
+			std::erase(it->second.waiters, &waiter);
+		this->update_interest(fd);
+	}
+	if (waiter.has_deadline) {
+		m_deadlines.erase(waiter.deadline);
+	}
+	auto handle = waiter.handle;
+	m_waiters.erase(waiter.self);
+	return handle;
+}
+
+int EpollReactor::next_timeout(int max_wait_ms, uint64_t now) const
+{
+	if (!m_ready.empty())
+		return 0;
+	if (m_deadlines.empty())
+		return max_wait_ms;
+	const uint64_t deadline = m_deadlines.begin()->first;
+	if (deadline <= now)
+		return 0;
+	/* Round up, so that the deadline has passed when we wake up */
+	const uint64_t ms = (deadline - now + 999'999ULL) / 1'000'000ULL;
+	if (max_wait_ms < 0 || ms < uint64_t(max_wait_ms))
+		return int(ms);
+	return max_wait_ms;
+}
+
+size_t EpollReactor::run_once(int max_wait_ms)
+{
+	std::array<struct epoll_event, 64> events;
+	const int timeout = next_timeout(max_wait_ms, reactor_time_ns());
+	const int count = epoll_wait(m_epoll_fd, events.data(), events.size(), timeout);
+	if (count < 0 && errno != EINTR) {
+		throw MachineException("EpollReactor: epoll_wait failed", errno);
+	}
+
+	/* A waiter can fire for several fds, so collect them first */
+	std::vector<Waiter*> ready = std::move(m_ready);
+	m_ready.clear();
+	for (int i = 0; i < count; i++) {
+		const int fd = events[i].data.fd;
+		auto it = m_interests.find(fd);
+		if (it == m_interests.end())
+			continue;
+		/* Errors and hangups wake every waiter on the fd */
+		const uint32_t revents = events[i].events;
+		const bool error = revents & (EPOLLERR | EPOLLHUP);
+		bool woken = false;
+		for (auto* waiter : it->second.waiters) {
+			for (const auto& [wfd, wevents] : waiter->fds) {
+				if (wfd != fd || !(error || (revents & wevents)))
+					continue;
+				if (!waiter->fired) {
+					waiter->fired = true;
+					ready.push_back(waiter);
+				}
+				woken = true;
+				break;
+			}
+		}
+		if (!woken)
+			this->update_interest(fd);
+	}
+	const uint64_t now = reactor_time_ns();
+	for (auto it = m_deadlines.begin(); it != m_deadlines.end() && it->first <= now; ++it) {
+		if (!it->second->fired) {
+			it->second->fired = true;
+			ready.push_back(it->second);
+		}
+	}
+
+	/* Resuming may suspend the same VM again, so remove all first */
+	std::vector<std::coroutine_handle<>> handles;
+	handles.reserve(ready.size());
+	for (auto* waiter : ready) {
+		handles.push_back(this->remove(*waiter));
+	}
+	for (auto handle : handles) {
+		handle.resume();
+	}
+	return handles.size();
+}
+
+}
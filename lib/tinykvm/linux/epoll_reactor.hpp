@@ -0,0 +1,61 @@
+#pragma once
+#include "../co_vmcall.hpp"
+#include <cstdint>
+#include <list>
+#include <map>
+#include <vector>
+
+namespace tinykvm {
+
+/* A host-owned reactor for many suspended VMs. One host epoll fd
+   watches the fds that each co_vmcall() is waiting on. For guest
+   epoll_wait that is the host epoll fd of the guest epoll instance
+   (the EpollEntry), so every VM costs a single registration no matter
+   how many interests its guest has. Only the VMs whose events fired,
+   or whose system call timed out, are resumed by run_once(). */
+struct EpollReactor {
+	EpollReactor();
+	~EpollReactor();
+	EpollReactor(const EpollReactor&) = delete;
+	EpollReactor& operator=(const EpollReactor&) = delete;
+
+	/* Hand this to co_vmcall(). The reactor must outlive the calls. */
+	IOReactor reactor();
+
+	/* Wait at most max_wait_ms (-1 is forever) for events, and resume
+	   every coroutine that became ready. Returns the number resumed. */
+	size_t run_once(int max_wait_ms = -1);
+
+	size_t waiting() const noexcept { return m_waiters.size(); }
+	int fd() const noexcept { return m_epoll_fd; }
+
+private:
+	struct Waiter {
+		std::coroutine_handle<> handle;
+		std::vector<std::pair<int, uint32_t>> fds; // fd, epoll events
+		std::multimap<uint64_t, Waiter*>::iterator deadline;
+		std::list<Waiter>::iterator self;
+		bool has_deadline = false;
+		bool fired = false;
+	};
+	/* Several VMs may wait on the same host fd (eg. a shared listener),
+	   so the fd is registered once with the interests of all of them. */
+	struct Interest {
+		uint32_t events = 0;
+		std::vector<Waiter*> waiters;
+	};
+	void suspend(const Machine::IOWait&, std::coroutine_handle<>);
+	bool add_interest(int fd, uint32_t events, Waiter&);
+	void update_interest(int fd);
+	std::coroutine_handle<> remove(Waiter&);
+	int next_timeout(int max_wait_ms, uint64_t now) const;
+
+	int m_epoll_fd = -1;
+	std::list<Waiter> m_waiters;
+	std::map<int, Interest> m_interests;
+	std::multimap<uint64_t, Waiter*> m_deadlines;
+	/* Waiters that could not be registered, resumed by run_once() */
+	std::vector<Waiter*> m_ready;
+};
+
+}
@@ -3,10 +3,13 @@
 #include "../machine.hpp"
 #include "threads.hpp"
 #include <algorithm>
+#include <climits>
 #include <cstring>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -39,32 +42,120 @@ namespace tinykvm
 		if (stdin_fd < 0 || stdout_fd < 0 || stderr_fd < 0) {
 			throw std::runtime_error("TinyKVM: Failed to duplicate stdin/stdout/stderr");
 		}
-		m_fds[0] = Entry{ .real_fd = stdin_fd, .is_writable = false }; // stdin
-		m_fds[1] = Entry{ .real_fd = stdout_fd, .is_writable = true };  // stdout
-		m_fds[2] = Entry{ .real_fd = stderr_fd, .is_writable = true };  // stderr
+		insert_entry(0, Entry{ .real_fd = stdin_fd, .is_writable = false }); // stdin
+		insert_entry(1, Entry{ .real_fd = stdout_fd, .is_writable = true });  // stdout
+		insert_entry(2, Entry{ .real_fd = stderr_fd, .is_writable = true });  // stderr
 	}
 
 	FileDescriptors::~FileDescriptors()
 	{
-		for (auto& [fd, entry] : m_fds) {
-			if (entry.real_fd > 2 && !entry.is_forked) {
-				close(entry.real_fd);
-			}
+		this->close_and_clear_entries();
+		for (auto& [vfd, pooled] : m_fd_pool) {
+			if (pooled.real_fd > 2)
+				close(pooled.real_fd);
 		}
 	}
 
-	void FileDescriptors::reset_to(const FileDescriptors& other)
+	FileDescriptors::Entry& FileDescriptors::insert_entry(int vfd, const Entry& entry)
+	{
+		m_generation.modified();
+		const uint64_t index = uint64_t(int64_t(vfd) - m_table_base);
+		Slot* slot = nullptr;
+		if (unsigned(vfd) < m_stdio.size()) {
+			slot = &m_stdio[vfd];
+		} else if (index < MAX_TABLE_SIZE) {
+			if (index >= m_table.size())
+				m_table.resize(index + 1);
+			slot = &m_table[index];
+			if (!slot->used)
+				m_table_used++;
+		} else {
+			auto res = m_sparse_fds.insert_or_assign(vfd, entry);
+			if (res.second)
+				m_fd_count++;
+			return res.first->second;
+		}
+		if (!slot->used)
+			m_fd_count++;
+		slot->entry = entry;
+		slot->used = true;
+		return slot->entry;
+	}
+	bool FileDescriptors::erase_entry(int vfd)
+	{
+		m_generation.modified();
+		const uint64_t index = uint64_t(int64_t(vfd) - m_table_base);
+		if (unsigned(vfd) < m_stdio.size()) {
+			if (!m_stdio[vfd].used)
+				return false;
+			m_stdio[vfd].used = false;
+		} else if (index < m_table.size()) {
+			if (!m_table[index].used)
+				return false;
+			m_table[index].used = false;
+			m_table_used--;
+			if (m_reuse_closed_vfds)
+				m_free_vfds.push_back(vfd);
+		} else if (m_sparse_fds.erase(vfd) == 0) {
+			return false;
+		}
+		m_fd_count--;
+		return true;
+	}
+	void FileDescriptors::close_and_clear_entries()
 	{
-		// Close all current file descriptors, except if forked
-		for (auto& [fd, entry] : m_fds) {
+		auto close_entry = [] (Slot& slot) {
+			if (slot.used && slot.entry.real_fd > 2 && !slot.entry.is_forked) {
+				close(slot.entry.real_fd);
+			}
+			slot.used = false;
+		};
+		for (auto& slot : m_stdio)
+			close_entry(slot);
+		for (auto& slot : m_table)
+			close_entry(slot);
+		for (auto& [vfd, entry] : m_sparse_fds) {
 			if (entry.real_fd > 2 && !entry.is_forked) {
 				close(entry.real_fd);
 			}
 		}
-		// Clear the current file descriptors
-		m_fds.clear();
+		// The table keeps its storage for the next round
+		m_sparse_fds.clear();
+		m_virtual_files.clear();
+		m_emulated_fds.clear();
+		m_free_vfds.clear();
+		m_table_used = 0;
+		m_fd_count = 0;
+	}
+	int FileDescriptors::next_vfd()
+	{
+		// Reuse the most recently closed vfd, unless taken by manage_as()
+		while (!m_free_vfds.empty()) {
+			const int vfd = m_free_vfds.back();
+			m_free_vfds.pop_back();
+			if (find_entry(vfd) == nullptr)
+				return vfd;
+		}
+		return m_next_fd++;
+	}
+
+	void FileDescriptors::reset_to(const FileDescriptors& other)
+	{
+		// Pipes, sockets and epoll instances have state of their own in
+		// the host kernel, so they are always recreated or drained.
+		if (m_generation.unchanged_since_reset_to(other.m_generation)
+			&& m_sockets.empty() && other.m_sockets.empty()
+			&& m_epoll_fds.empty() && other.m_epoll_fds.empty())
+			return;
+		// Close all current file descriptors, except if forked, and
+		// clear the table. Forks resolve the entries of the main VM
+		// lazily, through the find_readonly_master_vm_fd callback.
+		// Pooled host objects are kept for create_socket_pairs_from().
+		this->pool_entries(other);
+		this->close_and_clear_entries();
 		m_next_fd = other.m_next_fd;
 		this->m_max_files = other.m_max_files;
+		this->m_reuse_closed_vfds = other.m_reuse_closed_vfds;
 		this->m_total_fds_opened = other.m_total_fds_opened;
 		this->m_max_total_fds_opened = other.m_max_total_fds_opened;
 		// Deep copy the master epoll FDs
@@ -90,11 +181,37 @@ namespace tinykvm
 				this->m_epoll_fds.insert_or_assign(vfd, std::move(cloned_entry));
 			}
 		}
+		// The io_uring rings are in guest memory, which forks inherit
+		this->m_io_urings = other.m_io_urings;
+		this->m_path_cache = other.m_path_cache;
+		// Virtual files have no real fd, so forks get their own copies
+		this->m_vfs = other.m_vfs;
+		for (const auto& [vfd, vfile] : other.m_virtual_files) {
+			insert_entry(vfd, {-1, false, false});
+			this->m_virtual_files.insert_or_assign(vfd, vfile);
+		}
+		// Emulated channels are copied, keeping the ends connected
+		this->m_emulated_channels = other.m_emulated_channels;
+		std::unordered_map<const Channel*, std::shared_ptr<Channel>> channels;
+		auto copy_channel = [&channels] (const std::shared_ptr<Channel>& ch) {
+			if (ch == nullptr)
+				return std::shared_ptr<Channel>();
+			auto& copy = channels[ch.get()];
+			if (copy == nullptr)
+				copy = std::make_shared<Channel>(*ch);
+			return copy;
+		};
+		for (const auto& [vfd, efd] : other.m_emulated_fds) {
+			insert_entry(vfd, {-1, efd.tx != nullptr, false});
+			this->m_emulated_fds.insert_or_assign(vfd,
+				EmulatedFd{copy_channel(efd.rx), copy_channel(efd.tx), efd.type, efd.nonblocking});
+		}
 		// For each socketpair and pipe2 pair, we need to create a new pair
 		// and add them to the list of managed file descriptors.
 		for (auto sp : other.m_sockets) {
 			this->create_socket_pairs_from(sp);
 		}
+		m_generation.reset_to(other.m_generation);
 	}
 	void FileDescriptors::create_epoll_entry_from(int vfd, EpollEntry& entry)
 	{
@@ -130,15 +247,16 @@ namespace tinykvm
 			throw std::runtime_error("TinyKVM: Too many opened fds in total, max_total_fds_opened = " +
 				std::to_string(this->m_max_total_fds_opened));
 		}
-		if (this->m_fds.size() >= this->m_max_files) {
+		if (this->m_fd_count >= this->m_max_files) {
 			close(fd);
 			throw std::runtime_error("TinyKVM: Too many open files, max_files = " +
 				std::to_string(this->m_max_files));
 		}
 		this->m_total_fds_opened ++;
 
-		m_fds[m_next_fd] = {fd, is_writable, false};
-		return m_next_fd++;
+		const int vfd = this->next_vfd();
+		insert_entry(vfd, {fd, is_writable, false});
+		return vfd;
 	}
 	int FileDescriptors::manage_duplicate(int original_vfd, int fd, bool is_socket, bool is_writable)
 	{
@@ -178,7 +296,7 @@ namespace tinykvm
 			throw std::runtime_error("TinyKVM: Too many opened fds in total, max_total_fds_opened = " +
 				std::to_string(this->m_max_total_fds_opened));
 		}
-		if (this->m_fds.size() >= this->m_max_files) {
+		if (this->m_fd_count >= this->m_max_files) {
 			close(fd);
 			throw std::runtime_error("TinyKVM: Too many open files, max_files = " +
 				std::to_string(this->m_max_files));
@@ -186,26 +304,174 @@ namespace tinykvm
 		this->m_total_fds_opened++;
 
 		Entry entry{fd, is_writable, false};
-		auto res = m_fds.insert_or_assign(vfd, entry);
+		auto& result = insert_entry(vfd, entry);
 		// Make sure we are not overwriting the vfd
 		this->m_next_fd = std::max(this->m_next_fd, vfd + 1);
-		return res.first->second;
+		return result;
+	}
+
+	int FileDescriptors::manage_virtual(VirtualFileSystem::file_t file)
+	{
+		if (this->m_max_total_fds_opened != 0 && this->m_total_fds_opened >= this->m_max_total_fds_opened) {
+			throw std::runtime_error("TinyKVM: Too many opened fds in total, max_total_fds_opened = " +
+				std::to_string(this->m_max_total_fds_opened));
+		}
+		if (this->m_fd_count >= this->m_max_files) {
+			throw std::runtime_error("TinyKVM: Too many open files, max_files = " +
+				std::to_string(this->m_max_files));
+		}
+		this->m_total_fds_opened ++;
+
+		const int vfd = this->next_vfd();
+		insert_entry(vfd, {-1, false, false});
+		m_virtual_files.insert_or_assign(vfd, VirtualFile{std::move(file), 0});
+		return vfd;
+	}
+
+	size_t FileDescriptors::Channel::write(const void* data, size_t len)
+	{
+		len = std::min(len, CAPACITY - used);
+		if (len == 0)
+			return 0;
+		if (ring.empty())
+			ring.resize(CAPACITY);
+		const size_t tail = (head + used) % CAPACITY;
+		const size_t first = std::min(len, CAPACITY - tail);
+		std::memcpy(&ring[tail], data, first);
+		std::memcpy(&ring[0], (const uint8_t *)data + first, len - first);
+		used += len;
+		return len;
+	}
+	short FileDescriptors::EmulatedFd::poll_events() const noexcept
+	{
+		short events = 0;
+		if (rx != nullptr) {
+			if (rx->readable())
+				events |= POLLIN;
+			if (!rx->is_eventfd && rx->writers == 0)
+				events |= POLLHUP;
+		}
+		if (tx != nullptr) {
+			if (!tx->is_eventfd && tx->readers == 0)
+				events |= POLLERR;
+			else if (tx->writable())
+				events |= POLLOUT;
+		}
+		return events;
+	}
+	void FileDescriptors::create_emulated(SocketType type, bool nonblocking, int vfds[2])
+	{
+		auto a = std::make_shared<Channel>();
+		switch (type) {
+		case SocketType::PIPE2:
+			vfds[0] = manage_emulated({a, nullptr, type, nonblocking});
+			vfds[1] = manage_emulated({nullptr, a, type, nonblocking});
+			break;
+		case SocketType::SOCKETPAIR: {
+			auto b = std::make_shared<Channel>();
+			vfds[0] = manage_emulated({a, b, type, nonblocking});
+			vfds[1] = manage_emulated({b, a, type, nonblocking});
+			} break;
+		case SocketType::EVENTFD:
+			a->is_eventfd = true;
+			vfds[0] = manage_emulated({a, a, type, nonblocking});
+			vfds[1] = -1;
+			break;
+		default:
+			throw std::runtime_error("TinyKVM: Invalid emulated fd type");
+		}
+	}
+	int FileDescriptors::manage_emulated(const EmulatedFd& efd)
+	{
+		if (this->m_max_total_fds_opened != 0 && this->m_total_fds_opened >= this->m_max_total_fds_opened) {
+			throw std::runtime_error("TinyKVM: Too many opened fds in total, max_total_fds_opened = " +
+				std::to_string(this->m_max_total_fds_opened));
+		}
+		if (this->m_fd_count >= this->m_max_files) {
+			throw std::runtime_error("TinyKVM: Too many open files, max_files = " +
+				std::to_string(this->m_max_files));
+		}
+		this->m_total_fds_opened ++;
+
+		const int vfd = this->next_vfd();
+		insert_entry(vfd, {-1, efd.tx != nullptr, false});
+		if (efd.rx != nullptr)
+			efd.rx->readers++;
+		if (efd.tx != nullptr)
+			efd.tx->writers++;
+		m_emulated_fds.insert_or_assign(vfd, efd);
+		return vfd;
+	}
+
+	int FileDescriptors::epoll_wait_emulated(int epoll_vfd, struct epoll_event* events,
+		int maxevents, bool& has_host_fds)
+	{
+		auto& entry = this->get_epoll_entry_for_vfd(epoll_vfd);
+		has_host_fds = !entry.epoll_fds.empty();
+		int count = 0;
+		for (auto it = entry.emulated_fds.begin(); it != entry.emulated_fds.end() && count < maxevents; )
+		{
+			auto eit = m_emulated_fds.find(it->first);
+			if (eit == m_emulated_fds.end()) {
+				// Closed fds leave the epoll instance
+				it = entry.emulated_fds.erase(it);
+				continue;
+			}
+			// Like the kernel, only flags are left of disabled entries
+			static constexpr uint32_t FLAGS = EPOLLONESHOT | EPOLLET | EPOLLEXCLUSIVE | EPOLLWAKEUP;
+			auto& ev = it->second;
+			const uint32_t ready = (ev.events & ~FLAGS) == 0 ? 0 :
+				eit->second.poll_events() & (ev.events | EPOLLERR | EPOLLHUP);
+			if (ready != 0) {
+				events[count].events = ready;
+				events[count].data = ev.data;
+				count++;
+				if (ev.events & EPOLLONESHOT)
+					ev.events &= FLAGS; // Disabled until EPOLL_CTL_MOD
+			}
+			++it;
+		}
+		return count;
+	}
+
+	VirtualFileSystem::file_t FileDescriptors::find_virtual_path(int dirvfd, const std::string& path)
+	{
+		if (!m_vfs || path.empty())
+			return nullptr;
+		std::string dir = "/";
+		if (path[0] != '/') {
+			if (dirvfd == AT_FDCWD) {
+				if (!m_current_working_directory.empty())
+					dir = m_current_working_directory;
+			} else if (const VirtualFile* vdir = get_virtual_file(dirvfd); vdir != nullptr) {
+				if (!vdir->file->is_directory())
+					return nullptr;
+				dir = vdir->file->path;
+			} else {
+				// Relative to a host directory
+				return nullptr;
+			}
+		}
+		auto file = m_vfs->find(VirtualFileSystem::normalize(dir, path));
+		if (file != nullptr && UNLIKELY(this->m_verbose)) {
+			fprintf(stderr, "TinyKVM: virtual path %s\n", file->path.c_str());
+		}
+		return file;
 	}
 
 	std::optional<const FileDescriptors::Entry*> FileDescriptors::entry_for_vfd(int vfd) const
 	{
-		auto it = m_fds.find(vfd);
-		if (it != m_fds.end()) {
-			return &it->second;
+		const Entry* entry = find_entry(vfd);
+		if (entry != nullptr) {
+			return entry;
 		}
 		return std::nullopt;
 	}
 
 	int FileDescriptors::translate(int vfd)
 	{
-		auto it = m_fds.find(vfd);
-		if (it != m_fds.end()) {
-			return it->second.real_fd;
+		if (const Entry* entry = find_entry(vfd); LIKELY(entry != nullptr)) {
+			return entry->real_fd;
 		}
 
 		if (this->m_find_ro_master_vm_fd) {
@@ -231,76 +497,26 @@ namespace tinykvm
 							if (shared_vfd == vfd)
 								continue;
 
-							auto it = m_fds.find(shared_vfd);
-							if (it != m_fds.end()) {
+							const Entry* shared = find_entry(shared_vfd);
+							if (shared != nullptr) {
 								// We are already managing this fd, so we can
 								// just return the fd.
-								const int real_fd = it->second.real_fd;
+								const int real_fd = shared->real_fd;
 								if (UNLIKELY(this->m_verbose)) {
 									fprintf(stderr, "TinyKVM: Found shared epoll fd %d (%d)\n", vfd, real_fd);
 								}
-								m_fds[vfd] = {real_fd, it->second.is_writable, true};
+								insert_entry(vfd, {real_fd, shared->is_writable, true});
 								return real_fd;
 							}
 						}
 					}
 
-					int new_fd = epoll_create1(0);
-					if (new_fd < 0) {
-						throw std::runtime_error("TinyKVM: Failed to create epoll fd");
-					}
-					// Since we are creating a new epoll fd, it's not forked
-					// Register immediately in case of exception
-					m_fds[vfd] = {new_fd, true, false};
-					if (UNLIKELY(this->m_verbose)) {
-						fprintf(stderr, "TinyKVM: Created new epoll fd %d (%d)\n", vfd, new_fd);
-					}
-					// Add all the fds to the new epoll fd
-					for (auto it : epoll_entry->epoll_fds) {
-						const int entry_vfd = it.first;
-						epoll_event& entry_event = it.second;
-						int real_fd = this->translate(entry_vfd);
-						if (real_fd < 0) {
-							throw std::runtime_error("TinyKVM: Failed to translate fd");
-						}
-						if (epoll_ctl(new_fd, EPOLL_CTL_ADD, real_fd, &entry_event) < 0) {
-							if (errno != EEXIST) {
-								throw std::runtime_error("TinyKVM: Failed to add fd to epoll");
-							}
-						}
-						if (UNLIKELY(this->m_verbose)) {
-							std::string event_str;
-							if (entry_event.events & EPOLLIN) {
-								event_str += "EPOLLIN ";
-							}
-							if (entry_event.events & EPOLLOUT) {
-								event_str += "EPOLLOUT ";
-							}
-							if (entry_event.events & EPOLLERR) {
-								event_str += "EPOLLERR ";
-							}
-							if (entry_event.events & EPOLLHUP) {
-								event_str += "EPOLLHUP ";
-							}
-							if (entry_event.events & EPOLLRDHUP) {
-								event_str += "EPOLLRDHUP ";
-							}
-							if (entry_event.events & EPOLLET) {
-								event_str += "EPOLLET ";
-							}
-							if (entry_event.events & EPOLLONESHOT) {
-								event_str += "EPOLLONESHOT ";
-							}
-							fprintf(stderr, "TinyKVM: -> Added fd %d (%d) with event [%s] data i32=%d u32=0x%X u64=0x%lX\n",
-								real_fd, entry_vfd, event_str.c_str(),
-								entry_event.data.fd, entry_event.data.u32, entry_event.data.u64);
-						}
-					}
+					const int new_fd = this->arm_epoll(vfd, *epoll_entry);
 					return new_fd;
 				}
 				// We need to manage the *same* virtual file descriptor as the main
 				// VM, so we need to set the real_fd of the new entry to the new fd.
-				m_fds[vfd] = {entry->real_fd, entry->is_writable, true};
+				insert_entry(vfd, {entry->real_fd, entry->is_writable, true});
 				return entry->real_fd;
 			}
 		}
@@ -309,12 +525,11 @@ namespace tinykvm
 
 	int FileDescriptors::translate_writable_vfd(int vfd)
 	{
-		auto it = m_fds.find(vfd);
-		if (it != m_fds.end()) {
-			if (!it->second.is_writable) {
+		if (const Entry* entry = find_entry(vfd); LIKELY(entry != nullptr)) {
+			if (!entry->is_writable) {
 				throw std::runtime_error("TinyKVM: File descriptor is not writable");
 			}
-			return it->second.real_fd;
+			return entry->real_fd;
 		}
 		if (this->m_find_ro_master_vm_fd) {
 			auto opt_entry = this->m_find_ro_master_vm_fd(vfd);
@@ -328,7 +543,7 @@ namespace tinykvm
 				}
 				// We need to manage the *same* virtual file descriptor as the main
 				// VM, so we need to set the real_fd of the new entry to the new fd.
-				m_fds[vfd] = {entry->real_fd, entry->is_writable, true};
+				insert_entry(vfd, {entry->real_fd, entry->is_writable, true});
 				return entry->real_fd;
 			}
 		}
@@ -337,27 +552,26 @@ namespace tinykvm
 
 	int FileDescriptors::translate_unless_forked(int vfd)
 	{
-		auto it = m_fds.find(vfd);
-		if (it != m_fds.end()) {
-			if (it->second.is_forked) {
+		const Entry* entry = find_entry(vfd);
+		if (entry != nullptr) {
+			if (entry->is_forked) {
 				return -1;
 			}
-			return it->second.real_fd;
+			return entry->real_fd;
 		}
 		return -1;
 	}
 	int FileDescriptors::translate_unless_forked_then(int vfd, std::function<int(const Entry&)> func, bool must_be_writable)
 	{
-		auto it = m_fds.find(vfd);
-		if (it != m_fds.end()) {
-			if (!it->second.is_writable && must_be_writable) {
+		if (const Entry* entry = find_entry(vfd); entry != nullptr) {
+			if (!entry->is_writable && must_be_writable) {
 				throw std::runtime_error("TinyKVM: File descriptor is not writable");
 			}
-			if (it->second.is_forked) {
-				fprintf(stderr, "TinyKVM: Forked file descriptor %d (%d) is not allowed\n", it->second.real_fd, vfd);
-				return func(it->second);
+			if (entry->is_forked) {
+				fprintf(stderr, "TinyKVM: Forked file descriptor %d (%d) is not allowed\n", entry->real_fd, vfd);
+				return func(*entry);
 			}
-			return it->second.real_fd;
+			return entry->real_fd;
 		}
 		if (this->m_find_ro_master_vm_fd) {
 			auto opt_entry = this->m_find_ro_master_vm_fd(vfd);
@@ -373,7 +587,7 @@ namespace tinykvm
 				// VM, so we need to set the real_fd of the new entry to the new fd.
 				const int new_fd = func(*entry);
 				const bool is_forked = false; // We just duplicated it, so we own it
-				m_fds[vfd] = {new_fd, entry->is_writable, is_forked};
+				insert_entry(vfd, {new_fd, entry->is_writable, is_forked});
 				return new_fd;
 			}
 		}
@@ -384,14 +598,18 @@ namespace tinykvm
 	bool FileDescriptors::free(int vfd)
 	{
 		if (this->free_fd_callback) {
-			if (this->free_fd_callback(vfd, m_fds.at(vfd))) {
+			Entry* entry = find_entry(vfd);
+			if (entry == nullptr) {
+				throw std::out_of_range("TinyKVM: Unknown vfd in FileDescriptors::free()");
+			}
+			if (this->free_fd_callback(vfd, *entry)) {
 				// The callback has reset the VM completely,
 				// so there is nothing to do here.
 				return true;
 			}
 		}
 
-		m_fds.erase(vfd);
+		this->erase_entry(vfd);
 
 		// Potentially remove the fd from the epoll fds
 		auto res = m_epoll_fds.erase(vfd);
@@ -400,6 +618,16 @@ namespace tinykvm
 				printf("TinyKVM: Removed epoll fd %d\n", vfd);
 			}
 		}
+		m_io_urings.erase(vfd);
+		m_virtual_files.erase(vfd);
+		if (auto eit = m_emulated_fds.find(vfd); eit != m_emulated_fds.end()) {
+			// The other end sees EOF or EPIPE when the last end is closed
+			if (eit->second.rx != nullptr)
+				eit->second.rx->readers--;
+			if (eit->second.tx != nullptr)
+				eit->second.tx->writers--;
+			m_emulated_fds.erase(eit);
+		}
 		// Potentially remove the fd from the socket pairs
 		// NOTE: If one of the sockets are closed, we remove the whole entry
 		auto it2 = std::remove_if(m_sockets.begin(), m_sockets.end(),
@@ -422,16 +650,28 @@ namespace tinykvm
 
 		if (!m_open_readable)
 			return false;
-		if (m_open_readable(modifiable_path)) {
-			if (UNLIKELY(this->m_verbose)) {
-				fprintf(stderr, "TinyKVM: allow read %s\n", modifiable_path.c_str());
+		// Relative paths depend on the working directory, and are not cached
+		const bool cacheable = m_path_cache && modifiable_path[0] == '/';
+		if (cacheable) {
+			if (auto cached = m_path_cache->readable(modifiable_path)) {
+				if (UNLIKELY(this->m_verbose)) {
+					fprintf(stderr, "TinyKVM: %s read %s (cached)\n",
+						cached->result ? "allow" : "deny", modifiable_path.c_str());
+				}
+				modifiable_path = std::move(cached->path);
+				return cached->result;
 			}
-			return true;
+		}
+		const std::string path = cacheable ? modifiable_path : std::string();
+		const bool result = m_open_readable(modifiable_path);
+		if (cacheable) {
+			m_path_cache->set_readable(path, result, modifiable_path);
 		}
 		if (UNLIKELY(this->m_verbose)) {
-			fprintf(stderr, "TinyKVM: deny read %s\n", modifiable_path.c_str());
+			fprintf(stderr, "TinyKVM: %s read %s\n",
+				result ? "allow" : "deny", modifiable_path.c_str());
 		}
-		return false;
+		return result;
 	}
 
 	bool FileDescriptors::is_writable_path(std::string& modifiable_path) const noexcept
@@ -464,6 +704,7 @@ namespace tinykvm
 
 	void FileDescriptors::set_current_working_directory(const std::string& path) noexcept
 	{
+		m_generation.modified();
 		m_current_working_directory = path;
 		// Set the current working directory fd by opening the path
 		int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
@@ -490,6 +731,18 @@ namespace tinykvm
 
 	bool FileDescriptors::resolve_symlink(std::string& modifiable_path) const noexcept
 	{
+		if (m_resolve_symlink && m_path_cache
+			&& !modifiable_path.empty() && modifiable_path[0] == '/')
+		{
+			if (auto cached = m_path_cache->symlink(modifiable_path)) {
+				modifiable_path = std::move(cached->path);
+				return cached->result;
+			}
+			const std::string path = modifiable_path;
+			const bool result = m_resolve_symlink(modifiable_path);
+			m_path_cache->set_symlink(path, result, modifiable_path);
+			return result;
+		}
 		if (m_resolve_symlink)
 		{
 			if (m_resolve_symlink(modifiable_path)) {
@@ -505,10 +758,59 @@ namespace tinykvm
 		return false;
 	}
 
+	/// Host path lookups ///
+
+	int FileDescriptors::stat_path(const std::string& real_path, struct stat& st, bool follow) const
+	{
+		// Relative paths depend on the working directory, and are not cached
+		const bool cacheable = m_path_cache && !real_path.empty() && real_path[0] == '/';
+		if (cacheable) {
+			if (auto cached = m_path_cache->stat(real_path, follow, st))
+				return *cached;
+		}
+		const int result = (follow ? ::stat(real_path.c_str(), &st) : ::lstat(real_path.c_str(), &st)) < 0 ? -errno : 0;
+		if (cacheable) {
+			m_path_cache->set_stat(real_path, follow, result, st);
+		}
+		return result;
+	}
+
+	int FileDescriptors::access_path(const std::string& real_path, int mode) const
+	{
+		const bool cacheable = m_path_cache && !real_path.empty() && real_path[0] == '/';
+		if (cacheable) {
+			if (auto cached = m_path_cache->access(real_path, mode))
+				return *cached;
+		}
+		const int result = (::access(real_path.c_str(), mode) < 0) ? -errno : 0;
+		if (cacheable) {
+			m_path_cache->set_access(real_path, mode, result);
+		}
+		return result;
+	}
+
+	int FileDescriptors::readlink_path(const std::string& real_path, std::string& target) const
+	{
+		const bool cacheable = m_path_cache && !real_path.empty() && real_path[0] == '/';
+		if (cacheable) {
+			if (auto cached = m_path_cache->readlink(real_path, target))
+				return *cached;
+		}
+		std::array<char, PATH_MAX> buffer;
+		const ssize_t len = readlinkat(m_current_working_directory_fd, real_path.c_str(), buffer.data(), buffer.size());
+		const int result = (len < 0) ? -errno : int(len);
+		target.assign(buffer.data(), std::max(len, ssize_t(0)));
+		if (cacheable) {
+			m_path_cache->set_readlink(real_path, result, target);
+		}
+		return result;
+	}
+
 	/// epoll related ///
 
 	FileDescriptors::EpollEntry& FileDescriptors::get_epoll_entry_for_vfd(int vfd)
 	{
+		m_generation.modified();
 		auto it = m_epoll_fds.find(vfd);
 		if (it != m_epoll_fds.end()) {
 			return *it->second;
@@ -520,8 +822,15 @@ namespace tinykvm
 		return *res.first->second;
 	}
 
+	void FileDescriptors::add_io_uring(int vfd, const IoUringEntry& entry)
+	{
+		m_generation.modified();
+		m_io_urings.insert_or_assign(vfd, entry);
+	}
+
 	void FileDescriptors::add_socket_pair(const SocketPair& pair)
 	{
+		m_generation.modified();
 		if (m_machine.is_forked()) {
 			// We don't manage any extra state in the forks
 			return;
@@ -561,6 +870,19 @@ namespace tinykvm
 	}
 	void FileDescriptors::create_socket_pairs_from(const SocketPair& sp)
 	{
+		// Reset the host objects from the previous reset in place
+		if (sp.type == SocketType::PIPE2 || sp.type == SocketType::SOCKETPAIR ||
+			sp.type == SocketType::EVENTFD)
+		{
+			if (this->reuse_pooled(sp))
+				return;
+		}
+		// New objects are pooled, to be reused by the next reset
+		auto manage_pooled = [this, &sp] (int vfd, int fd, bool is_socket) {
+			this->forget_armed(fd);
+			this->manage_as(vfd, fd, is_socket, true).is_pooled = true;
+			m_fd_pool.insert_or_assign(vfd, PooledFd{-1, sp.type, {}});
+		};
 		// Create a new socketpair or pipe2 pair
 		int pair[2] = {-1, -1};
 		switch (sp.type) {
@@ -570,8 +892,8 @@ namespace tinykvm
 					throw std::runtime_error("TinyKVM: Failed to create pipe2");
 				}
 				// Manage the new pair using *the same* vfd as the original pair
-				this->manage_as(sp.vfd1, pair[0], false, true);
-				this->manage_as(sp.vfd2, pair[1], false, true);
+				manage_pooled(sp.vfd1, pair[0], false);
+				manage_pooled(sp.vfd2, pair[1], false);
 				if (UNLIKELY(this->m_verbose)) {
 					fprintf(stderr, "TinyKVM: Created new pipe2 pair %d %d\n", sp.vfd1, sp.vfd2);
 				}
@@ -581,8 +903,8 @@ namespace tinykvm
 					fprintf(stderr, "TinyKVM: Failed to create socketpair\n");
 					throw std::runtime_error("TinyKVM: Failed to create socketpair");
 				}
-				this->manage_as(sp.vfd1, pair[0], true, true);
-				this->manage_as(sp.vfd2, pair[1], true, true);
+				manage_pooled(sp.vfd1, pair[0], true);
+				manage_pooled(sp.vfd2, pair[1], true);
 				if (UNLIKELY(this->m_verbose)) {
 					fprintf(stderr, "TinyKVM: Created new socketpair %d %d\n", sp.vfd1, sp.vfd2);
 				}
@@ -593,7 +915,7 @@ namespace tinykvm
 					fprintf(stderr, "TinyKVM: Failed to create eventfd2\n");
 					throw std::runtime_error("TinyKVM: Failed to create eventfd2");
 				}
-				this->manage_as(sp.vfd1, fd, false, true);
+				manage_pooled(sp.vfd1, fd, false);
 				if (UNLIKELY(this->m_verbose)) {
 					fprintf(stderr, "TinyKVM: Created new eventfd2 %d (%d)\n", sp.vfd1, fd);
 				}
@@ -607,6 +929,7 @@ namespace tinykvm
 					fprintf(stderr, "TinyKVM: Failed to duplicate a DUPFD during reset\n");
 					throw std::runtime_error("TinyKVM: Failed to duplicate a DUPFD during reset");
 				}
+				this->forget_armed(ret);
 				this->manage_as(sp.vfd2, ret, false, true);
 				if (UNLIKELY(this->m_verbose)) {
 					fprintf(stderr, "TinyKVM: Created new dupfd %d (%d)\n", sp.vfd2, ret);
@@ -633,6 +956,232 @@ namespace tinykvm
 		}
 	}
 
+	/* Discard everything that can be read from a pipe or socket */
+	static bool drain_fd(int fd)
+	{
+		int available = 0;
+		while (ioctl(fd, FIONREAD, &available) == 0) {
+			if (available <= 0)
+				return true;
+			char buffer[4096];
+			if (read(fd, buffer, std::min(size_t(available), sizeof(buffer))) <= 0)
+				return false;
+		}
+		return false;
+	}
+
+	void FileDescriptors::pool_entries(const FileDescriptors& other)
+	{
+		auto pool_entry = [this, &other] (int vfd, Entry& entry) {
+			if (!entry.is_pooled || entry.real_fd <= 2)
+				return;
+			auto it = m_fd_pool.find(vfd);
+			if (it == m_fd_pool.end())
+				return;
+			PooledFd& pooled = it->second;
+			if (pooled.real_fd > 2 && pooled.real_fd != entry.real_fd)
+				close(pooled.real_fd);
+			pooled.real_fd = entry.real_fd;
+			// The pool owns it now, so it's not closed with the entries
+			entry.real_fd = -1;
+			if (pooled.type != SocketType::EPOLL)
+				return;
+			// Remove what the guest registered on top of the master VM,
+			// while the registered fds are still open.
+			auto eit = other.m_epoll_fds.find(vfd);
+			std::erase_if(pooled.armed, [&] (const auto& armed) {
+				if (eit != other.m_epoll_fds.end() && eit->second->epoll_fds.count(armed.first))
+					return false;
+				epoll_ctl(pooled.real_fd, EPOLL_CTL_DEL, armed.second.real_fd, nullptr);
+				return true;
+			});
+		};
+		for (auto& slot : m_table) {
+			if (slot.used)
+				pool_entry(m_table_base + (&slot - m_table.data()), slot.entry);
+		}
+		for (auto& [vfd, entry] : m_sparse_fds)
+			pool_entry(vfd, entry);
+		// Objects that were in use, but were closed or changed by the guest
+		std::erase_if(m_fd_pool, [] (const auto& it) {
+			return it.second.real_fd < 0;
+		});
+	}
+
+	int FileDescriptors::take_pooled(int vfd, SocketType type)
+	{
+		auto it = m_fd_pool.find(vfd);
+		if (it == m_fd_pool.end() || it->second.real_fd < 0)
+			return -1;
+		const int real_fd = it->second.real_fd;
+		if (it->second.type != type) {
+			close(real_fd);
+			m_fd_pool.erase(it);
+			return -1;
+		}
+		it->second.real_fd = -1;
+		return real_fd;
+	}
+
+	bool FileDescriptors::reuse_pooled(const SocketPair& sp)
+	{
+		const bool is_pair = sp.type != SocketType::EVENTFD;
+		const int fd1 = this->take_pooled(sp.vfd1, sp.type);
+		const int fd2 = is_pair ? this->take_pooled(sp.vfd2, sp.type) : -1;
+		bool reusable = fd1 >= 0 && (!is_pair || fd2 >= 0);
+		if (reusable) {
+			// Reset the object to how it was when it was created
+			uint64_t count = 0;
+			switch (sp.type) {
+				case SocketType::EVENTFD:
+					reusable = read(fd1, &count, sizeof(count)) == sizeof(count) || errno == EAGAIN;
+					break;
+				case SocketType::PIPE2:
+					reusable = drain_fd(fd1);
+					break;
+				default:
+					reusable = drain_fd(fd1) && drain_fd(fd2);
+					break;
+			}
+		}
+		if (!reusable) {
+			if (fd1 >= 0)
+				close(fd1);
+			if (fd2 >= 0)
+				close(fd2);
+			return false;
+		}
+		const bool is_socket = sp.type == SocketType::SOCKETPAIR;
+		this->manage_as(sp.vfd1, fd1, is_socket, true).is_pooled = true;
+		if (is_pair)
+			this->manage_as(sp.vfd2, fd2, is_socket, true).is_pooled = true;
+		if (UNLIKELY(this->m_verbose)) {
+			fprintf(stderr, "TinyKVM: Reused pooled fds %d %d (%d %d)\n",
+				sp.vfd1, sp.vfd2, fd1, fd2);
+		}
+		return true;
+	}
+
+	void FileDescriptors::forget_armed(int real_fd)
+	{
+		// A new host fd reuses the number of a closed one, which is no
+		// longer registered with any epoll instance.
+		for (auto& [vfd, pooled] : m_fd_pool) {
+			std::erase_if(pooled.armed, [real_fd] (const auto& armed) {
+				return armed.second.real_fd == real_fd;
+			});
+		}
+	}
+
+	int FileDescriptors::arm_epoll(int vfd, const EpollEntry& epoll_entry)
+	{
+		int new_fd = this->take_pooled(vfd, SocketType::EPOLL);
+		PooledFd& pooled = m_fd_pool[vfd];
+		const bool reused = new_fd >= 0;
+		if (!reused) {
+			new_fd = epoll_create1(0);
+			if (new_fd < 0) {
+				m_fd_pool.erase(vfd);
+				throw std::runtime_error("TinyKVM: Failed to create epoll fd");
+			}
+			this->forget_armed(new_fd);
+			pooled.type = SocketType::EPOLL;
+			pooled.armed.clear();
+		}
+		// Since we are creating a new epoll fd, it's not forked
+		// Register immediately in case of exception
+		insert_entry(vfd, {new_fd, true, false, true});
+		if (UNLIKELY(this->m_verbose)) {
+			fprintf(stderr, "TinyKVM: %s epoll fd %d (%d)\n",
+				reused ? "Reusing pooled" : "Created new", vfd, new_fd);
+		}
+		// Add all the fds to the epoll fd, or re-arm the ones that
+		// may have changed since the previous reset
+		for (auto it : epoll_entry.epoll_fds) {
+			const int entry_vfd = it.first;
+			epoll_event& entry_event = it.second;
+			int real_fd = this->translate(entry_vfd);
+			if (real_fd < 0) {
+				throw std::runtime_error("TinyKVM: Failed to translate fd");
+			}
+			auto ait = pooled.armed.find(entry_vfd);
+			const bool registered = ait != pooled.armed.end() && ait->second.real_fd == real_fd;
+			// Level triggered events stay armed. An edge that the previous
+			// request consumed is only reported again after EPOLL_CTL_MOD.
+			if (registered && ait->second.as_master
+				&& !(entry_event.events & (EPOLLONESHOT | EPOLLET)))
+				continue;
+			int op = registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+			if (epoll_ctl(new_fd, op, real_fd, &entry_event) < 0) {
+				if (op == EPOLL_CTL_MOD && errno == ENOENT) {
+					op = EPOLL_CTL_ADD;
+					if (epoll_ctl(new_fd, op, real_fd, &entry_event) < 0 && errno != EEXIST)
+						throw std::runtime_error("TinyKVM: Failed to add fd to epoll");
+				} else if (errno != EEXIST) {
+					throw std::runtime_error("TinyKVM: Failed to add fd to epoll");
+				}
+			}
+			pooled.armed.insert_or_assign(entry_vfd, PooledFd::Armed{real_fd, true});
+			if (UNLIKELY(this->m_verbose)) {
+				std::string event_str;
+				if (entry_event.events & EPOLLIN) {
+					event_str += "EPOLLIN ";
+				}
+				if (entry_event.events & EPOLLOUT) {
+					event_str += "EPOLLOUT ";
+				}
+				if (entry_event.events & EPOLLERR) {
+					event_str += "EPOLLERR ";
+				}
+				if (entry_event.events & EPOLLHUP) {
+					event_str += "EPOLLHUP ";
+				}
+				if (entry_event.events & EPOLLRDHUP) {
+					event_str += "EPOLLRDHUP ";
+				}
+				if (entry_event.events & EPOLLET) {
+					event_str += "EPOLLET ";
+				}
+				if (entry_event.events & EPOLLONESHOT) {
+					event_str += "EPOLLONESHOT ";
+				}
+				fprintf(stderr, "TinyKVM: -> %s fd %d (%d) with event [%s] data i32=%d u32=0x%X u64=0x%lX\n",
+					(op == EPOLL_CTL_MOD) ? "Re-armed" : "Added",
+					real_fd, entry_vfd, event_str.c_str(),
+					entry_event.data.fd, entry_event.data.u32, entry_event.data.u64);
+			}
+		}
+		return new_fd;
+	}
+
+	void FileDescriptors::unpool(int vfd) noexcept
+	{
+		m_generation.modified();
+		if (Entry* entry = find_entry(vfd); entry != nullptr)
+			entry->is_pooled = false;
+	}
+
+	void FileDescriptors::record_epoll_ctl(int epoll_vfd, int op, int vfd, int real_fd)
+	{
+		m_generation.modified();
+		Entry* entry = find_entry(epoll_vfd);
+		auto it = m_fd_pool.find(epoll_vfd);
+		if (entry == nullptr || !entry->is_pooled || it == m_fd_pool.end()) {
+			// A duplicate of a pooled epoll fd: the changes are not
+			// tracked, so the original is not reused
+			auto eit = m_epoll_fds.find(epoll_vfd);
+			if (eit != m_epoll_fds.end()) {
+				for (const int shared_vfd : eit->second->shared_epoll_fds)
+					this->unpool(shared_vfd);
+			}
+			return;
+		}
+		if (op == EPOLL_CTL_DEL)
+			it->second.armed.erase(vfd);
+		else
+			it->second.armed.insert_or_assign(vfd, PooledFd::Armed{real_fd, false});
+	}
+
 	std::string FileDescriptors::sockaddr_to_string(const struct sockaddr_storage& addr) const
 	{
 		std::string addr_family_str;
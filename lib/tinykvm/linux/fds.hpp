@@ -1,5 +1,6 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <functional>
 #include <map>
@@ -7,7 +8,11 @@
 #include <optional>
 #include <string>
 #include <unordered_set>
+#include <vector>
 #include <sys/epoll.h>
+#include "path_cache.hpp"
+#include "vfs.hpp"
+#include "../util/state_generation.hpp"
 struct sockaddr_storage;
 struct pollfd;
 
@@ -25,6 +30,7 @@ namespace tinykvm
 			int real_fd = -1;
 			bool is_writable = false;
 			bool is_forked = false;
+			bool is_pooled = false; // Reset in place by reset_to(), see unpool()
 		};
 		using open_readable_t = std::function<bool(std::string&)>;
 		using open_writable_t = std::function<bool(std::string&)>;
@@ -41,6 +47,9 @@ namespace tinykvm
 
 		FileDescriptors(Machine& machine);
 		~FileDescriptors();
+		/// @brief Reset to the file descriptors of @other. Does nothing when
+		/// neither side was modified since the last reset, and there are no
+		/// pipes, sockets or epoll instances that need to be recreated.
 		void reset_to(const FileDescriptors& other);
 
 		/// @brief Set a new starting virtual file descriptor. This is useful
@@ -49,13 +58,23 @@ namespace tinykvm
 		/// shared between remote VMs, but it's useful to distinguish them.
 		/// @param vfd_start The new starting virtual file descriptor.
 		void set_vfd_start(int vfd_start) noexcept {
+			m_generation.modified();
 			m_next_fd = vfd_start;
+			m_free_vfds.clear();
+			// The flat table starts at the first vfd, while it's unused
+			if (m_table_used == 0) {
+				m_table.clear();
+				m_table_base = vfd_start;
+			}
 		}
 		int vfd_start() const noexcept {
 			return m_next_fd;
 		}
 
-		/// @brief Add a file descriptor to the list of managed FDs.
+		/// @brief Add a file descriptor to the list of managed FDs. Virtual
+		/// file descriptors are handed out in increasing order, and those of
+		/// closed files are reused only when enabled with
+		/// set_reuse_closed_vfds().
 		/// @param fd The real file descriptor.
 		/// @param is_socket True if the file descriptor is a socket.
 		/// @return The virtual file descriptor.
@@ -148,6 +167,7 @@ namespace tinykvm
 		/// @param max_files The maximum number of file descriptors that can be
 		/// opened.
 		void set_max_files(uint16_t max_files) noexcept {
+			m_generation.modified();
 			m_max_files = max_files;
 		}
 
@@ -163,6 +183,7 @@ namespace tinykvm
 		/// @param max_total_fds_opened The maximum number of file descriptors
 		/// that can be opened in total.
 		void set_max_total_fds_opened(uint16_t max_total_fds_opened) noexcept {
+			m_generation.modified();
 			m_max_total_fds_opened = max_total_fds_opened;
 		}
 
@@ -189,13 +210,13 @@ namespace tinykvm
 		/// Does not include sockets.
 		/// @return The number of file descriptors that are currently open.
 		uint16_t get_current_fds_opened() const noexcept {
-			return m_fds.size();
+			return m_fd_count;
 		}
 
 		/// @brief Get the number of sockets that are currently open.
 		/// @return The number of sockets that are currently open.
 		uint16_t get_current_sockets_opened() const noexcept {
-			return m_fds.size();
+			return m_fd_count;
 		}
 
 		/// @brief Set a callback for connecting a socket. This is used to check if a
@@ -271,6 +292,19 @@ namespace tinykvm
 			return m_preempt_epoll_wait;
 		}
 
+		/// @brief Let manage() hand out the virtual file descriptors of
+		/// closed files again, which keeps the fd table small for guests
+		/// that open and close many files. Off by default, so that a vfd
+		/// is never reused. Forks inherit the setting.
+		void set_reuse_closed_vfds(bool reuse) noexcept {
+			m_reuse_closed_vfds = reuse;
+			if (!reuse)
+				m_free_vfds.clear();
+		}
+		bool reuse_closed_vfds() const noexcept {
+			return m_reuse_closed_vfds;
+		}
+
 		/// @brief Enable or disable accepting connections. This is used to
 		/// pre-emptively decide if accept4() should be called or not.
 		void set_accepting_connections(bool accepting) noexcept {
@@ -283,10 +317,12 @@ namespace tinykvm
 		{
 			std::unordered_map<int, struct epoll_event> epoll_fds;
 			std::unordered_set<int> shared_epoll_fds;
+			// Emulated fds are never registered with the host
+			std::unordered_map<int, struct epoll_event> emulated_fds;
 		};
 		EpollEntry& get_epoll_entry_for_vfd(int vfd);
 		const auto& get_epoll_entries() const { return m_epoll_fds; }
-		auto& get_epoll_entries() { return m_epoll_fds; }
+		auto& get_epoll_entries() { m_generation.modified(); return m_epoll_fds; }
 		void create_epoll_entry_from(int vfd, EpollEntry& entry);
 		enum SocketType : int {
 			INVALID,
@@ -295,6 +331,7 @@ namespace tinykvm
 			EVENTFD,
 			DUPFD,
 			LISTEN,
+			EPOLL, // Only used by the fd pool
 		};
 		struct SocketPair
 		{
@@ -304,14 +341,225 @@ namespace tinykvm
 		};
 		void add_socket_pair(const SocketPair&);
 		const auto& get_socket_pairs() const { return m_sockets; }
-		auto& get_socket_pairs() { return m_sockets; }
+		auto& get_socket_pairs() { m_generation.modified(); return m_sockets; }
 		void create_socket_pairs_from(const SocketPair& pair);
 
+		/// @brief Forks keep the eventfds, pipes, socketpairs and epoll
+		/// instances that reset_to() creates, and on the next reset they
+		/// are drained and re-armed in place instead of being recreated.
+		/// The guest can change these objects in ways that cannot be
+		/// undone in place (eg. fcntl(), shutdown() or epoll_ctl()), and
+		/// then the object is closed on the next reset instead.
+		/// @param vfd The virtual file descriptor that was changed.
+		void unpool(int vfd) noexcept;
+		/// @brief Record a successful epoll_ctl() by the guest on a pooled
+		/// epoll instance, so that the next reset can undo it in place.
+		void record_epoll_ctl(int epoll_vfd, int op, int vfd, int real_fd);
+		size_t pooled_fds() const noexcept { return m_fd_pool.size(); }
+
+		/// @brief An emulated io_uring instance. The rings live in guest
+		/// memory, and are processed synchronously by io_uring_enter().
+		struct IoUringEntry
+		{
+			uint64_t ring_addr = 0;  // SQ and CQ rings (single mmap)
+			uint64_t sqes_addr = 0;  // Submission queue entries
+			uint32_t sq_entries = 0;
+			uint32_t cq_entries = 0;
+		};
+		void add_io_uring(int vfd, const IoUringEntry& entry);
+		const IoUringEntry* get_io_uring_for_vfd(int vfd) const noexcept {
+			if (m_io_urings.empty())
+				return nullptr;
+			auto it = m_io_urings.find(vfd);
+			return (it != m_io_urings.end()) ? &it->second : nullptr;
+		}
+
+		/// @brief Cache lookups of absolute paths: the results of the
+		/// open_readable and resolve_symlink callbacks, and host stat(),
+		/// access() and readlink() results. Relative paths depend on the
+		/// working directory, and are not cached. The callbacks must give the same answer
+		/// for a path every time, in every VM sharing the cache. Forks share
+		/// the cache of the VM they are reset to.
+		/// @param cache The cache, or nullptr to disable caching.
+		void set_path_cache(std::shared_ptr<PathCache> cache) noexcept {
+			m_generation.modified();
+			m_path_cache = std::move(cache);
+		}
+		PathCache* path_cache() const noexcept {
+			return m_path_cache.get();
+		}
+
+		/// @brief stat() or lstat() a real path on the host, using the path
+		/// cache when enabled.
+		/// @return 0 or a negative errno.
+		int stat_path(const std::string& real_path, struct stat& st, bool follow) const;
+		/// @brief access() a real path on the host, using the path cache.
+		/// @return 0 or a negative errno.
+		int access_path(const std::string& real_path, int mode) const;
+		/// @brief readlink() a real path on the host, relative to the current
+		/// working directory, using the path cache.
+		/// @return The length of the target, or a negative errno.
+		int readlink_path(const std::string& real_path, std::string& target) const;
+
+		/// @brief Serve guest file access from an in-memory filesystem. Paths
+		/// found in it are opened, read, stat'ed and listed without any host
+		/// system calls, and without consulting the open_readable callback.
+		/// Other paths fall back to the host. Forks inherit the filesystem.
+		/// @param vfs The filesystem, which may be shared with other VMs.
+		void set_virtual_filesystem(std::shared_ptr<VirtualFileSystem> vfs) noexcept {
+			m_generation.modified();
+			m_vfs = std::move(vfs);
+		}
+		VirtualFileSystem* virtual_filesystem() const noexcept {
+			return m_vfs.get();
+		}
+
+		/// @brief An open file or directory in the virtual filesystem. It has
+		/// a vfd like any other file, but no real file descriptor.
+		struct VirtualFile
+		{
+			VirtualFileSystem::file_t file;
+			uint64_t offset = 0; // Byte offset, or directory entry index
+		};
+		/// @brief Look up a path in the virtual filesystem, relative to
+		/// @dirvfd, which is AT_FDCWD or an open virtual directory.
+		/// @return The file, or nullptr if the host should handle the path.
+		VirtualFileSystem::file_t find_virtual_path(int dirvfd, const std::string& path);
+		/// @brief Open a file in the virtual filesystem.
+		/// @return The virtual file descriptor.
+		int manage_virtual(VirtualFileSystem::file_t file);
+		VirtualFile* get_virtual_file(int vfd) noexcept {
+			if (m_virtual_files.empty())
+				return nullptr;
+			m_generation.modified(); // The offset is advanced
+			auto it = m_virtual_files.find(vfd);
+			return (it != m_virtual_files.end()) ? &it->second : nullptr;
+		}
+
+		/// @brief Emulate the pipes, socketpairs and eventfds that the guest
+		/// creates in host memory, instead of creating host kernel objects.
+		/// Cooperative guest threads run on one vCPU, so their producer and
+		/// consumer traffic then needs no host system calls, and a reset
+		/// copies them instead of recreating them. Emulated fds can be read,
+		/// written, polled and added to epoll instances. Forks inherit the
+		/// setting.
+		void set_emulated_channels(bool emulated) noexcept {
+			m_generation.modified();
+			m_emulated_channels = emulated;
+		}
+		bool emulated_channels() const noexcept {
+			return m_emulated_channels;
+		}
+
+		/// @brief The buffer of an emulated pipe or socketpair direction,
+		/// or the counter of an emulated eventfd.
+		struct Channel
+		{
+			static constexpr size_t CAPACITY = 65536; // Like a Linux pipe
+			std::vector<uint8_t> ring; // Allocated on the first write
+			size_t   head = 0; // Read position in the ring
+			size_t   used = 0; // Bytes in the ring
+			uint64_t counter = 0; // Value of an eventfd
+			bool     is_eventfd = false;
+			bool     semaphore = false; // EFD_SEMAPHORE
+			uint16_t readers = 0; // Open ends reading from the channel
+			uint16_t writers = 0; // Open ends writing to the channel
+
+			bool readable() const noexcept {
+				return is_eventfd ? counter > 0 : used > 0;
+			}
+			bool writable() const noexcept {
+				return is_eventfd ? counter < UINT64_MAX - 1 : used < CAPACITY;
+			}
+			/// @brief Append up to CAPACITY - used bytes of @data.
+			/// @return The number of bytes appended.
+			size_t write(const void* data, size_t len);
+			/// @brief Remove @len bytes that have been read.
+			void consume(size_t len) noexcept {
+				head = (head + len) % CAPACITY;
+				used -= len;
+			}
+		};
+		/// @brief An emulated pipe end, socketpair end or eventfd. It has
+		/// a vfd like any other file, but no real file descriptor.
+		struct EmulatedFd
+		{
+			std::shared_ptr<Channel> rx; // Read from, if readable
+			std::shared_ptr<Channel> tx; // Written to, if writable
+			SocketType type = INVALID;
+			bool nonblocking = false;
+
+			/// @brief The current poll() events of the fd.
+			short poll_events() const noexcept;
+		};
+		/// @brief Create an emulated pipe, socketpair or eventfd.
+		/// @param vfds The new vfds. An eventfd has only the first.
+		void create_emulated(SocketType type, bool nonblocking, int vfds[2]);
+		/// @brief Add another vfd for an emulated fd, eg. for dup().
+		int manage_emulated(const EmulatedFd& efd);
+		EmulatedFd* get_emulated_fd(int vfd) noexcept {
+			if (m_emulated_fds.empty())
+				return nullptr;
+			m_generation.modified(); // The channels are read or written
+			auto it = m_emulated_fds.find(vfd);
+			return (it != m_emulated_fds.end()) ? &it->second : nullptr;
+		}
+		bool has_emulated_fds() const noexcept {
+			return !m_emulated_fds.empty();
+		}
+		/// @brief Collect the ready emulated fds of an epoll instance, like
+		/// epoll_wait() does. EPOLLET is treated as level-triggered.
+		/// @param has_host_fds Set when host fds are registered as well.
+		/// @return The number of events.
+		int epoll_wait_emulated(int epoll_vfd, struct epoll_event* events, int maxevents,
+			bool& has_host_fds);
+
 		std::string sockaddr_to_string(const struct sockaddr_storage& addr) const;
 
 	private:
+		/* Virtual fds are handed out densely from the vfd start, so they
+		   index a flat table directly. stdin/stdout/stderr have their own
+		   slots, and the rare vfd far outside the table goes in a map. */
+		struct Slot
+		{
+			Entry entry;
+			bool  used = false;
+		};
+		static constexpr size_t MAX_TABLE_SIZE = 65536;
+		Entry* find_entry(int vfd) noexcept {
+			const uint64_t index = uint64_t(int64_t(vfd) - m_table_base);
+			if (unsigned(vfd) < m_stdio.size())
+				return m_stdio[vfd].used ? &m_stdio[vfd].entry : nullptr;
+			if (index < m_table.size())
+				return m_table[index].used ? &m_table[index].entry : nullptr;
+			if (m_sparse_fds.empty())
+				return nullptr;
+			auto it = m_sparse_fds.find(vfd);
+			return (it != m_sparse_fds.end()) ? &it->second : nullptr;
+		}
+		const Entry* find_entry(int vfd) const noexcept {
+			return const_cast<FileDescriptors*>(this)->find_entry(vfd);
+		}
+		Entry& insert_entry(int vfd, const Entry&);
+		bool erase_entry(int vfd);
+		void close_and_clear_entries();
+		int next_vfd();
+		void pool_entries(const FileDescriptors& other);
+		int take_pooled(int vfd, SocketType type);
+		bool reuse_pooled(const SocketPair& sp);
+		void forget_armed(int real_fd);
+		int arm_epoll(int vfd, const EpollEntry& entry);
+
 		Machine& m_machine;
-		std::map<int, Entry> m_fds;
+		std::vector<Slot> m_table;
+		std::array<Slot, 3> m_stdio;
+		std::map<int, Entry> m_sparse_fds;
+		/* Closed vfds inside the table, reused by manage() when enabled */
+		std::vector<int> m_free_vfds;
+		bool m_reuse_closed_vfds = false;
+		int64_t  m_table_base = VFD_START;
+		unsigned m_table_used = 0;
+		unsigned m_fd_count = 0;
 		int m_next_fd = VFD_START;
 		std::string m_current_working_directory;
 		int m_current_working_directory_fd = -1;
@@ -327,6 +575,27 @@ namespace tinykvm
 
 		std::map<int, std::shared_ptr<EpollEntry>> m_epoll_fds;
 		std::vector<SocketPair> m_sockets;
+		struct PooledFd
+		{
+			int real_fd = -1; // -1 while in use by the fork
+			SocketType type = INVALID;
+			// Epoll: the registered vfds, and whether they are still
+			// registered the way the master VM registered them
+			struct Armed
+			{
+				int real_fd = -1;
+				bool as_master = false;
+			};
+			std::unordered_map<int, Armed> armed;
+		};
+		std::map<int, PooledFd> m_fd_pool;
+		std::map<int, IoUringEntry> m_io_urings;
+		std::shared_ptr<VirtualFileSystem> m_vfs;
+		std::shared_ptr<PathCache> m_path_cache;
+		std::map<int, VirtualFile> m_virtual_files;
+		std::map<int, EmulatedFd> m_emulated_fds;
+		bool m_emulated_channels = false;
+		StateGeneration m_generation;
 
 	public:
 		connect_socket_t   connect_socket_callback;
@@ -0,0 +1,357 @@
+#include "io_uring.hpp"
+
+#include "../machine.hpp"
+#include <bit>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace tinykvm {
+static constexpr bool VERBOSE_IO_URING = false;
+static constexpr uint32_t IO_URING_MAX_ENTRIES = 4096;
+static constexpr unsigned IO_URING_MAX_IOVECS = 64;
+static constexpr uint64_t PageMask = vMemory::PageSize() - 1;
+
+/* The SQ and CQ rings share one guest mapping (IORING_FEAT_SINGLE_MMAP):
+   The SQ header, then the CQ header, then the CQEs and finally the SQ
+   index array. The SQEs are in a mapping of their own. */
+static constexpr uint32_t SQ_HEAD    = 0;
+static constexpr uint32_t SQ_TAIL    = 4;
+static constexpr uint32_t SQ_MASK    = 8;
+static constexpr uint32_t SQ_ENTRIES = 12;
+static constexpr uint32_t SQ_FLAGS   = 16;
+static constexpr uint32_t SQ_DROPPED = 20;
+static constexpr uint32_t CQ_HEAD    = 64;
+static constexpr uint32_t CQ_TAIL    = 68;
+static constexpr uint32_t CQ_MASK    = 72;
+static constexpr uint32_t CQ_ENTRIES = 76;
+static constexpr uint32_t CQ_OVERFLOW= 80;
+static constexpr uint32_t CQ_FLAGS   = 84;
+static constexpr uint32_t CQ_CQES    = 128;
+static constexpr uint32_t SQ_ARRAY(uint32_t cq_entries) {
+	return CQ_CQES + cq_entries * sizeof(io_uring_cqe);
+}
+
+struct GuestIOvec
+{
+	uint64_t iov_base;
+	uint64_t iov_len;
+};
+
+static uint32_t read_u32(Machine& machine, uint64_t addr)
+{
+	uint32_t value;
+	machine.copy_from_guest(&value, addr, sizeof(value));
+	return value;
+}
+static void write_u32(Machine& machine, uint64_t addr, uint32_t value)
+{
+	machine.copy_to_guest(addr, &value, sizeof(value));
+}
+
+static void io_uring_setup(vCPU& cpu)
+{
+	auto& regs = cpu.registers();
+	auto& machine = cpu.machine();
+	const uint32_t entries = regs.rdi;
+	const uint64_t g_params = regs.rsi;
+
+	io_uring_params params;
+	machine.copy_from_guest(&params, g_params, sizeof(params));
+
+	uint32_t sq_entries = entries;
+	uint32_t cq_entries = 0;
+	const bool clamp = (params.flags & IORING_SETUP_CLAMP) != 0;
+	if ((params.flags & ~(IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP)) != 0 || entries == 0) {
+		/* SQPOLL, IOPOLL, attached work queues etc. are not supported */
+		regs.rax = -EINVAL;
+	} else if (entries > IO_URING_MAX_ENTRIES && !clamp) {
+		regs.rax = -EINVAL;
+	} else {
+		sq_entries = std::bit_ceil(std::min(sq_entries, IO_URING_MAX_ENTRIES));
+		cq_entries = 2 * sq_entries;
+		if (params.flags & IORING_SETUP_CQSIZE) {
+			cq_entries = params.cq_entries;
+			if (cq_entries > 2 * IO_URING_MAX_ENTRIES && clamp)
+				cq_entries = 2 * IO_URING_MAX_ENTRIES;
+			if (cq_entries == 0 || cq_entries > 2 * IO_URING_MAX_ENTRIES)
+				cq_entries = 0;
+			else
+				cq_entries = std::bit_ceil(std::max(cq_entries, sq_entries));
+		}
+		regs.rax = (cq_entries != 0) ? 0 : -EINVAL;
+	}
+
+	if (regs.rax == 0)
+	{
+		const int real_fd = eventfd(0, EFD_CLOEXEC);
+		const int vfd = (real_fd >= 0) ? machine.fds().manage(real_fd, false, true) : -1;
+		if (UNLIKELY(vfd < 0)) {
+			regs.rax = -errno;
+			if (real_fd >= 0)
+				close(real_fd);
+		} else {
+			const size_t ring_size =
+				(SQ_ARRAY(cq_entries) + sq_entries * sizeof(uint32_t) + PageMask) & ~PageMask;
+			const size_t sqes_size =
+				(sq_entries * sizeof(io_uring_sqe) + PageMask) & ~PageMask;
+			FileDescriptors::IoUringEntry entry;
+			entry.ring_addr = machine.mmap_allocate(ring_size, PROT_READ | PROT_WRITE);
+			entry.sqes_addr = machine.mmap_allocate(sqes_size, PROT_READ | PROT_WRITE);
+			entry.sq_entries = sq_entries;
+			entry.cq_entries = cq_entries;
+			machine.memzero(entry.ring_addr, ring_size);
+			machine.memzero(entry.sqes_addr, sqes_size);
+			write_u32(machine, entry.ring_addr + SQ_MASK, sq_entries - 1);
+			write_u32(machine, entry.ring_addr + SQ_ENTRIES, sq_entries);
+			write_u32(machine, entry.ring_addr + CQ_MASK, cq_entries - 1);
+			write_u32(machine, entry.ring_addr + CQ_ENTRIES, cq_entries);
+			machine.fds().add_io_uring(vfd, entry);
+
+			params.sq_entries = sq_entries;
+			params.cq_entries = cq_entries;
+			params.features = IORING_FEAT_SINGLE_MMAP;
+			params.sq_off = {};
+			params.sq_off.head = SQ_HEAD;
+			params.sq_off.tail = SQ_TAIL;
+			params.sq_off.ring_mask = SQ_MASK;
+			params.sq_off.ring_entries = SQ_ENTRIES;
+			params.sq_off.flags = SQ_FLAGS;
+			params.sq_off.dropped = SQ_DROPPED;
+			params.sq_off.array = SQ_ARRAY(cq_entries);
+			params.cq_off = {};
+			params.cq_off.head = CQ_HEAD;
+			params.cq_off.tail = CQ_TAIL;
+			params.cq_off.ring_mask = CQ_MASK;
+			params.cq_off.ring_entries = CQ_ENTRIES;
+			params.cq_off.overflow = CQ_OVERFLOW;
+			params.cq_off.cqes = CQ_CQES;
+			params.cq_off.flags = CQ_FLAGS;
+			machine.copy_to_guest(g_params, &params, sizeof(params));
+			regs.rax = vfd;
+		}
+	}
+	cpu.set_registers(regs);
+	if constexpr (VERBOSE_IO_URING) {
+		fprintf(stderr, "io_uring_setup(entries=%u, flags=0x%X) = %lld (sq=%u cq=%u)\n",
+			entries, params.flags, regs.rax, sq_entries, cq_entries);
+	}
+}
+
+/* Gather the guest buffers of a read or write SQE */
+template <typename BufferType>
+static size_t sqe_buffers(Machine& machine, const io_uring_sqe& sqe,
+	bool vectored, ScratchIOVec<BufferType>& buffers)
+{
+	auto gather = [&] (uint64_t addr, size_t len) {
+		if constexpr (std::is_same_v<BufferType, Machine::WrBuffer>)
+			machine.writable_buffers_from_range(buffers, addr, len);
+		else
+			machine.gather_buffers_from_range(buffers, addr, len);
+	};
+	if (!vectored) {
+		gather(sqe.addr, sqe.len);
+		return sqe.len;
+	}
+	std::array<GuestIOvec, IO_URING_MAX_IOVECS> vecs;
+	machine.copy_from_guest(vecs.data(), sqe.addr, sqe.len * sizeof(GuestIOvec));
+	size_t total = 0;
+	for (size_t i = 0; i < sqe.len; i++) {
+		gather(vecs[i].iov_base, vecs[i].iov_len);
+		total += vecs[i].iov_len;
+	}
+	return total;
+}
+
+static int64_t result_of(ssize_t res)
+{
+	return (res < 0) ? -errno : res;
+}
+
+static int64_t io_uring_perform(vCPU& cpu, const io_uring_sqe& sqe)
+{
+	auto& machine = cpu.machine();
+	const int vfd = sqe.fd;
+	/* Offset -1 means the current file position */
+	const bool use_position = (sqe.off == ~0ULL);
+	const bool vectored = (sqe.opcode == IORING_OP_READV || sqe.opcode == IORING_OP_WRITEV);
+	if (UNLIKELY(vectored && sqe.len > IO_URING_MAX_IOVECS))
+		return -EINVAL;
+	switch (sqe.opcode) {
+	case IORING_OP_NOP:
+		return 0;
+	case IORING_OP_READ:
+	case IORING_OP_READV: {
+		const int fd = machine.fds().translate(vfd);
+		auto& buffers = cpu.io_wrbuffers();
+		sqe_buffers(machine, sqe, vectored, buffers);
+		if (use_position)
+			return result_of(readv(fd, (const iovec *)buffers.data(), buffers.size()));
+		return result_of(preadv64(fd, (const iovec *)buffers.data(), buffers.size(), sqe.off));
+	}
+	case IORING_OP_WRITE:
+	case IORING_OP_WRITEV: {
+		auto& buffers = cpu.io_buffers();
+		const size_t bytes =
+			sqe_buffers(machine, sqe, vectored, buffers);
+		if (vfd == 1 || vfd == 2) {
+			for (const auto& buffer : buffers)
+				machine.print(buffer.ptr, buffer.len);
+			return bytes;
+		}
+		const int fd = machine.fds().translate_writable_vfd(vfd);
+		if (use_position)
+			return result_of(writev(fd, (const iovec *)buffers.data(), buffers.size()));
+		return result_of(pwritev64(fd, (const iovec *)buffers.data(), buffers.size(), sqe.off));
+	}
+	case IORING_OP_SEND: {
+		const int fd = machine.fds().translate_writable_vfd(vfd);
+		auto& buffers = cpu.io_buffers();
+		sqe_buffers(machine, sqe, false, buffers);
+		struct msghdr msg {};
+		msg.msg_iov = (iovec *)buffers.data();
+		msg.msg_iovlen = buffers.size();
+		return result_of(sendmsg(fd, &msg, sqe.msg_flags | MSG_NOSIGNAL));
+	}
+	case IORING_OP_RECV: {
+		const int fd = machine.fds().translate(vfd);
+		auto& buffers = cpu.io_wrbuffers();
+		sqe_buffers(machine, sqe, false, buffers);
+		struct msghdr msg {};
+		msg.msg_iov = (iovec *)buffers.data();
+		msg.msg_iovlen = buffers.size();
+		return result_of(recvmsg(fd, &msg, sqe.msg_flags));
+	}
+	case IORING_OP_FSYNC: {
+		const int fd = machine.fds().translate_writable_vfd(vfd);
+		if (sqe.fsync_flags & IORING_FSYNC_DATASYNC)
+			return result_of(fdatasync(fd));
+		return result_of(fsync(fd));
+	}
+	default:
+		return -EINVAL;
+	}
+}
+
+static void io_uring_enter(vCPU& cpu)
+{
+	auto& regs = cpu.registers();
+	auto& machine = cpu.machine();
+	const int vfd = regs.rdi;
+	const uint32_t to_submit = regs.rsi;
+
+	const auto* ring = machine.fds().get_io_uring_for_vfd(vfd);
+	if (UNLIKELY(ring == nullptr)) {
+		regs.rax = -EOPNOTSUPP;
+		cpu.set_registers(regs);
+		return;
+	}
+	const uint64_t rb = ring->ring_addr;
+	const uint32_t sq_mask = ring->sq_entries - 1;
+	const uint32_t cq_mask = ring->cq_entries - 1;
+	const uint64_t sq_array = rb + SQ_ARRAY(ring->cq_entries);
+	uint32_t sq_head = read_u32(machine, rb + SQ_HEAD);
+	const uint32_t sq_tail = read_u32(machine, rb + SQ_TAIL);
+	const uint32_t cq_head = read_u32(machine, rb + CQ_HEAD);
+	uint32_t cq_tail = read_u32(machine, rb + CQ_TAIL);
+	uint32_t dropped = 0;
+
+	uint32_t submitted = 0;
+	bool cancel_link = false;
+	while (submitted < to_submit && sq_head != sq_tail)
+	{
+		/* Completions are never dropped: Stop when the CQ is full */
+		if (cq_tail - cq_head >= ring->cq_entries)
+			break;
+		const uint32_t index = read_u32(machine, sq_array + (sq_head & sq_mask) * sizeof(uint32_t));
+		sq_head++;
+		if (UNLIKELY(index >= ring->sq_entries)) {
+			dropped++;
+			continue;
+		}
+		io_uring_sqe sqe;
+		machine.copy_from_guest(&sqe, ring->sqes_addr + index * sizeof(io_uring_sqe), sizeof(sqe));
+
+		int64_t res;
+		if (cancel_link) {
+			res = -ECANCELED;
+		} else if (sqe.flags & ~(IOSQE_IO_LINK | IOSQE_IO_DRAIN | IOSQE_ASYNC)) {
+			/* Fixed files and buffer selection are not supported.
+			   Draining is implicit, as entries complete in order. */
+			res = -EINVAL;
+		} else {
+			try {
+				res = io_uring_perform(cpu, sqe);
+			} catch (const MemoryException&) {
+				res = -EFAULT;
+			} catch (const std::exception&) {
+				res = -EBADF;
+			}
+		}
+		/* A failed entry cancels the rest of its link chain */
+		if (sqe.flags & IOSQE_IO_LINK)
+			cancel_link = cancel_link || res < 0;
+		else
+			cancel_link = false;
+		if constexpr (VERBOSE_IO_URING) {
+			fprintf(stderr, "io_uring: op=%u fd=%d len=%u = %ld\n",
+				sqe.opcode, sqe.fd, sqe.len, res);
+		}
+
+		io_uring_cqe cqe {};
+		cqe.user_data = sqe.user_data;
+		cqe.res = res;
+		machine.copy_to_guest(rb + CQ_CQES + (cq_tail & cq_mask) * sizeof(io_uring_cqe),
+			&cqe, sizeof(cqe));
+		cq_tail++;
+		submitted++;
+	}
+	write_u32(machine, rb + SQ_HEAD, sq_head);
+	write_u32(machine, rb + CQ_TAIL, cq_tail);
+	if (UNLIKELY(dropped != 0))
+		write_u32(machine, rb + SQ_DROPPED, read_u32(machine, rb + SQ_DROPPED) + dropped);
+
+	if (submitted == 0 && to_submit != 0 && sq_head != sq_tail)
+		regs.rax = -EBUSY;
+	else
+		regs.rax = submitted;
+	cpu.set_registers(regs);
+	if constexpr (VERBOSE_IO_URING) {
+		fprintf(stderr, "io_uring_enter(fd=%d, to_submit=%u) = %lld\n",
+			vfd, to_submit, regs.rax);
+	}
+}
+
+bool io_uring_mmap(vCPU& cpu, int vfd, uint64_t offset)
+{
+	const auto* ring = cpu.machine().fds().get_io_uring_for_vfd(vfd);
+	if (LIKELY(ring == nullptr))
+		return false;
+	auto& regs = cpu.registers();
+	switch (offset) {
+	case IORING_OFF_SQ_RING:
+	case IORING_OFF_CQ_RING:
+		regs.rax = ring->ring_addr;
+		break;
+	case IORING_OFF_SQES:
+		regs.rax = ring->sqes_addr;
+		break;
+	default:
+		regs.rax = -EINVAL;
+	}
+	cpu.set_registers(regs);
+	return true;
+}
+
+void install_io_uring_system_calls()
+{
+	Machine::install_syscall_handler(SYS_io_uring_setup, io_uring_setup);
+	Machine::install_syscall_handler(SYS_io_uring_enter, io_uring_enter);
+}
+
+} // tinykvm
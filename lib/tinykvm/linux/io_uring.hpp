@@ -0,0 +1,14 @@
+#pragma once
+#include <cstdint>
+
+namespace tinykvm {
+	struct vCPU;
+
+	/* io_uring emulation: The SQ and CQ rings are allocated in guest
+	   memory by io_uring_setup(), and io_uring_enter() completes every
+	   submitted entry synchronously, in order, with a single exit. */
+	void install_io_uring_system_calls();
+	/* mmap() of an io_uring fd returns the guest address of a ring.
+	   Returns false when vfd is not an io_uring instance. */
+	bool io_uring_mmap(vCPU& cpu, int vfd, uint64_t offset);
+}
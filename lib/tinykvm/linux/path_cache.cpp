@@ -0,0 +1,151 @@
+#include "path_cache.hpp"
+
+#include <mutex>
+
+namespace tinykvm
+{
+	PathCache::PathCache(std::chrono::milliseconds ttl, size_t max_entries)
+		: m_ttl(ttl), m_max_entries(max_entries)
+	{
+	}
+
+	const PathCache::Entry* PathCache::find(const std::string& path) const
+	{
+		/* Must be called with the lock held */
+		auto it = m_entries.find(path);
+		if (it == m_entries.end() || it->second.expiry < clock::now())
+			return nullptr;
+		return &it->second;
+	}
+
+	PathCache::Entry* PathCache::find_or_create(const std::string& path)
+	{
+		/* Must be called with the lock held exclusively */
+		const auto now = clock::now();
+		auto it = m_entries.find(path);
+		if (it == m_entries.end()) {
+			if (m_entries.size() >= m_max_entries) {
+				std::erase_if(m_entries, [now] (const auto& it) {
+					return it.second.expiry < now;
+				});
+				if (m_entries.size() >= m_max_entries)
+					return nullptr;
+			}
+			it = m_entries.try_emplace(path).first;
+		} else if (it->second.expiry >= now) {
+			return &it->second;
+		} else {
+			it->second = Entry{};
+		}
+		it->second.expiry = (m_ttl.count() != 0) ? now + m_ttl : clock::time_point::max();
+		return &it->second;
+	}
+
+	std::optional<PathCache::Lookup> PathCache::readable(const std::string& path) const
+	{
+		std::shared_lock lock(m_mtx);
+		const Entry* entry = find(path);
+		if (entry == nullptr || !entry->readable) {
+			m_misses++;
+			return std::nullopt;
+		}
+		m_hits++;
+		return entry->readable;
+	}
+	void PathCache::set_readable(const std::string& path, bool result, const std::string& real_path)
+	{
+		std::unique_lock lock(m_mtx);
+		if (Entry* entry = find_or_create(path); entry != nullptr)
+			entry->readable = Lookup{result, real_path};
+	}
+
+	std::optional<PathCache::Lookup> PathCache::symlink(const std::string& path) const
+	{
+		std::shared_lock lock(m_mtx);
+		const Entry* entry = find(path);
+		if (entry == nullptr || !entry->symlink) {
+			m_misses++;
+			return std::nullopt;
+		}
+		m_hits++;
+		return entry->symlink;
+	}
+	void PathCache::set_symlink(const std::string& path, bool result, const std::string& target)
+	{
+		std::unique_lock lock(m_mtx);
+		if (Entry* entry = find_or_create(path); entry != nullptr)
+			entry->symlink = Lookup{result, target};
+	}
+
+	std::optional<int> PathCache::stat(const std::string& path, bool follow, struct stat& st) const
+	{
+		std::shared_lock lock(m_mtx);
+		const Entry* entry = find(path);
+		if (entry == nullptr || !entry->stat_result[follow]) {
+			m_misses++;
+			return std::nullopt;
+		}
+		m_hits++;
+		st = entry->st[follow];
+		return entry->stat_result[follow];
+	}
+	void PathCache::set_stat(const std::string& path, bool follow, int result, const struct stat& st)
+	{
+		std::unique_lock lock(m_mtx);
+		if (Entry* entry = find_or_create(path); entry != nullptr) {
+			entry->stat_result[follow] = result;
+			entry->st[follow] = st;
+		}
+	}
+
+	std::optional<int> PathCache::access(const std::string& path, int mode) const
+	{
+		std::shared_lock lock(m_mtx);
+		const Entry* entry = find(path);
+		if (entry == nullptr || !entry->access_result[mode & 7]) {
+			m_misses++;
+			return std::nullopt;
+		}
+		m_hits++;
+		return entry->access_result[mode & 7];
+	}
+	void PathCache::set_access(const std::string& path, int mode, int result)
+	{
+		std::unique_lock lock(m_mtx);
+		if (Entry* entry = find_or_create(path); entry != nullptr)
+			entry->access_result[mode & 7] = result;
+	}
+
+	std::optional<int> PathCache::readlink(const std::string& path, std::string& target) const
+	{
+		std::shared_lock lock(m_mtx);
+		const Entry* entry = find(path);
+		if (entry == nullptr || !entry->readlink_result) {
+			m_misses++;
+			return std::nullopt;
+		}
+		m_hits++;
+		target = entry->readlink_target;
+		return entry->readlink_result;
+	}
+	void PathCache::set_readlink(const std::string& path, int result, const std::string& target)
+	{
+		std::unique_lock lock(m_mtx);
+		if (Entry* entry = find_or_create(path); entry != nullptr) {
+			entry->readlink_result = result;
+			entry->readlink_target = target;
+		}
+	}
+
+	void PathCache::clear()
+	{
+		std::unique_lock lock(m_mtx);
+		m_entries.clear();
+	}
+
+	size_t PathCache::size() const
+	{
+		std::shared_lock lock(m_mtx);
+		return m_entries.size();
+	}
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <sys/stat.h>
+
+namespace tinykvm
+{
+	/// @brief Remembers the results of path lookups: what the readable-path
+	/// and symlink callbacks decided for a guest path, and what the host
+	/// returned for stat(), lstat(), access() and readlink() of a real path.
+	/// Runtimes probe the same paths over and over, and with a cache only
+	/// the first probe calls into the host. A master VM and its forks share
+	/// one cache. Entries expire after a time-to-live, and the cache can be
+	/// cleared when the files it describes are known to have changed.
+	struct PathCache
+	{
+		static constexpr size_t DEFAULT_MAX_ENTRIES = 4096;
+		using clock = std::chrono::steady_clock;
+		struct Lookup
+		{
+			bool result = false;
+			std::string path; // The modified path
+		};
+
+		/// @param ttl How long entries stay valid. Zero means forever.
+		/// @param max_entries The number of paths to remember.
+		PathCache(std::chrono::milliseconds ttl, size_t max_entries = DEFAULT_MAX_ENTRIES);
+
+		/// @brief Cached results of FileDescriptors::is_readable_path().
+		std::optional<Lookup> readable(const std::string& path) const;
+		void set_readable(const std::string& path, bool result, const std::string& real_path);
+
+		/// @brief Cached results of FileDescriptors::resolve_symlink().
+		std::optional<Lookup> symlink(const std::string& path) const;
+		void set_symlink(const std::string& path, bool result, const std::string& target);
+
+		/// @brief Cached host stat() or lstat() of a real path.
+		/// @return 0 or a negative errno, or nothing when not cached.
+		std::optional<int> stat(const std::string& path, bool follow, struct stat& st) const;
+		void set_stat(const std::string& path, bool follow, int result, const struct stat& st);
+
+		/// @brief Cached host access() of a real path, for one mode.
+		std::optional<int> access(const std::string& path, int mode) const;
+		void set_access(const std::string& path, int mode, int result);
+
+		/// @brief Cached host readlink() of a real path.
+		/// @return The length of the target or a negative errno.
+		std::optional<int> readlink(const std::string& path, std::string& target) const;
+		void set_readlink(const std::string& path, int result, const std::string& target);
+
+		/// @brief Forget everything, eg. after files have changed.
+		void clear();
+		size_t size() const;
+		uint64_t hits() const noexcept { return m_hits; }
+		uint64_t misses() const noexcept { return m_misses; }
+
+	private:
+		struct Entry
+		{
+			clock::time_point expiry;
+			std::optional<Lookup> readable;
+			std::optional<Lookup> symlink;
+			std::optional<int> stat_result[2]; // lstat, stat
+			struct stat st[2];
+			std::optional<int> access_result[8]; // By R_OK|W_OK|X_OK
+			std::optional<int> readlink_result;
+			std::string readlink_target;
+		};
+		const Entry* find(const std::string& path) const;
+		Entry* find_or_create(const std::string& path);
+
+		const clock::duration m_ttl;
+		const size_t m_max_entries;
+		mutable std::shared_mutex m_mtx;
+		std::unordered_map<std::string, Entry> m_entries;
+		mutable std::atomic<uint64_t> m_hits = 0;
+		mutable std::atomic<uint64_t> m_misses = 0;
+	};
+}
@@ -6,6 +6,15 @@ namespace tinykvm {
 Signals::Signals() {}
 Signals::~Signals() {}
 
+void Signals::reset_to(const Signals& other)
+{
+	if (m_generation.unchanged_since_reset_to(other.m_generation))
+		return;
+	this->signals = other.signals;
+	this->m_per_thread = other.m_per_thread;
+	m_generation.reset_to(other.m_generation);
+}
+
 SignalAction& Signals::get(int sig) {
 	if (sig > 0)
 		return signals.at(sig-1);
@@ -19,7 +28,7 @@ void Signals::enter(vCPU& cpu, int sig)
 
 	auto& sigact = signals.at(sig);
 	if (sigact.altstack) {
-		const int tid = cpu.machine().threads().gettid();
+		const int tid = cpu.machine().threads().gettid(cpu);
 		// Change to alternate per-thread stack
 		auto& stack = per_thread(tid).stack;
 		// But only if non-zero
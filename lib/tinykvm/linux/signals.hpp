@@ -1,5 +1,6 @@
 #pragma once
 #include "../forward.hpp"
+#include "../util/state_generation.hpp"
 #include <array>
 #include <map>
 #include <memory>
@@ -43,11 +44,17 @@ struct Signals {
 	// TODO: Lock this in the future, for multiproessing
 	auto& per_thread(int tid) { return m_per_thread[tid]; }
 
+	/* Does nothing when neither side was modified since the last reset */
+	void reset_to(const Signals& other);
+	/* Called by Machine::signals() on every access */
+	void modified() noexcept { m_generation.modified(); }
+
 	Signals();
 	~Signals();
 private:
 	std::array<SignalAction, 64> signals {};
 	std::map<int, SignalPerThread> m_per_thread;
+	StateGeneration m_generation;
 };
 
 
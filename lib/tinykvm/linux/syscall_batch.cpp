@@ -0,0 +1,99 @@
+#include "../machine.hpp"
+#include <cerrno>
+#include <sys/syscall.h>
+
+namespace tinykvm {
+static constexpr bool VERBOSE_SYSCALL_BATCH = false;
+
+/* Only system calls that complete without blocking, and that do
+   not change the control flow of the guest, may be batched. */
+static bool is_batchable(uint64_t nr)
+{
+	switch (nr) {
+	case SYS_write:
+	case SYS_writev:
+	case SYS_pwrite64:
+	case SYS_pwritev:
+	case SYS_sendto:
+	case SYS_sendmsg:
+	case SYS_close:
+	case SYS_lseek:
+	case SYS_stat:
+	case SYS_fstat:
+	case SYS_lstat:
+	case SYS_newfstatat:
+	case SYS_statx:
+	case SYS_access:
+	case SYS_faccessat:
+	case SYS_fcntl:
+	case SYS_getpid:
+	case SYS_gettid:
+	case SYS_clock_gettime:
+	case SYS_gettimeofday:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void Machine::system_call_batch(vCPU& cpu)
+{
+	auto& regs = cpu.registers();
+	const uint64_t ring_addr = regs.rdi;
+	SyscallRing ring;
+	this->copy_from_guest(&ring, ring_addr, sizeof(ring));
+
+	const uint32_t entries = ring.mask + 1;
+	const uint32_t count = ring.tail - ring.head;
+	if (UNLIKELY(entries == 0 || (entries & ring.mask) != 0 || entries > SYSCALL_BATCH_MAX
+		|| count > entries))
+	{
+		regs.rax = -EINVAL;
+		cpu.set_registers(regs);
+		return;
+	}
+	const uint64_t entries_addr = ring_addr + sizeof(SyscallRing);
+
+	/* Each batched system call sees its own arguments in the registers */
+	const tinykvm_x86regs saved_regs = regs;
+	uint32_t completed = 0;
+	for (; completed < count; completed++)
+	{
+		const uint64_t entry_addr = entries_addr
+			+ ((ring.head + completed) & ring.mask) * sizeof(SyscallBatchEntry);
+		SyscallBatchEntry entry;
+		this->copy_from_guest(&entry, entry_addr, sizeof(entry));
+
+		if (LIKELY(is_batchable(entry.nr))) {
+			auto& sregs = cpu.registers();
+			sregs.rax = entry.nr;
+			sregs.rdi = entry.args[0];
+			sregs.rsi = entry.args[1];
+			sregs.rdx = entry.args[2];
+			sregs.r10 = entry.args[3];
+			sregs.r8  = entry.args[4];
+			sregs.r9  = entry.args[5];
+			this->system_call(cpu, entry.nr);
+			entry.result = cpu.registers().rax;
+		} else {
+			entry.result = -ENOSYS;
+		}
+		if constexpr (VERBOSE_SYSCALL_BATCH) {
+			fprintf(stderr, "Batched system call %lu = %ld\n", entry.nr, entry.result);
+		}
+		this->copy_to_guest(entry_addr + offsetof(SyscallBatchEntry, result),
+			&entry.result, sizeof(entry.result));
+		if (UNLIKELY(cpu.stopped))
+			break;
+	}
+
+	/* Hand the completed entries back to the guest */
+	ring.head += completed;
+	this->copy_to_guest(ring_addr + offsetof(SyscallRing, head), &ring.head, sizeof(ring.head));
+
+	cpu.registers() = saved_regs;
+	cpu.registers().rax = completed;
+	cpu.set_registers(cpu.registers());
+}
+
+} // tinykvm
@@ -1,5 +1,7 @@
 #include "../machine.hpp"
+#include "io_uring.hpp"
 #include "threads.hpp"
+#include <array>
 #include <cstring>
 #include <fcntl.h>
 #include <netinet/in.h>
@@ -18,13 +20,16 @@
 #include <sys/prctl.h>
 #include <sys/random.h>
 #include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/time.h>
 #include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/utsname.h>
+#include <dirent.h>
 #include <unistd.h>
 #ifndef SYS_faccessat2
 #define SYS_faccessat2  439
@@ -53,6 +58,215 @@ static int sanitize_at_flags(int flags)
 	return (flags & (AT_EMPTY_PATH)) | AT_SYMLINK_NOFOLLOW;
 }
 
+/* Copy from a host fd to the print callback, for sendfile to stdout */
+static ssize_t copy_fd_to_print(Machine& machine, int fd, off_t* offset, size_t count)
+{
+	std::array<char, 16384> buffer;
+	size_t total = 0;
+	while (total < count) {
+		const size_t chunk = std::min(count - total, buffer.size());
+		const ssize_t n = (offset != nullptr)
+			? pread(fd, buffer.data(), chunk, *offset) : read(fd, buffer.data(), chunk);
+		if (n < 0 && total == 0)
+			return -1;
+		if (n <= 0)
+			break;
+		machine.print(buffer.data(), n);
+		if (offset != nullptr)
+			*offset += n;
+		total += n;
+	}
+	return total;
+}
+
+/* Move data between two host fds, without it passing through guest
+   memory. The optional 64-bit offsets are in guest memory, and are
+   updated when the transfer succeeds. */
+template <typename Func>
+static int64_t fd_transfer(vCPU& cpu, int in_vfd, uint64_t g_off_in,
+	int out_vfd, uint64_t g_off_out, Func&& transfer)
+{
+	auto& machine = cpu.machine();
+	const int in_fd = machine.fds().translate(in_vfd);
+	const int out_fd = machine.fds().translate_writable_vfd(out_vfd);
+	loff_t off_in = 0;
+	loff_t off_out = 0;
+	if (g_off_in != 0x0)
+		machine.copy_from_guest(&off_in, g_off_in, sizeof(off_in));
+	if (g_off_out != 0x0)
+		machine.copy_from_guest(&off_out, g_off_out, sizeof(off_out));
+
+	const ssize_t result = transfer(
+		in_fd, (g_off_in != 0x0) ? &off_in : nullptr,
+		out_fd, (g_off_out != 0x0) ? &off_out : nullptr);
+	if (result < 0)
+		return -errno;
+	if (g_off_in != 0x0)
+		machine.copy_to_guest(g_off_in, &off_in, sizeof(off_in));
+	if (g_off_out != 0x0)
+		machine.copy_to_guest(g_off_out, &off_out, sizeof(off_out));
+	return result;
+}
+
+/* Read from a file in the virtual filesystem at the given offset */
+static int64_t virtual_read(Machine& machine, const FileDescriptors::VirtualFile& vfile,
+	uint64_t g_buf, size_t bytes, uint64_t offset)
+{
+	if (vfile.file->is_directory())
+		return -EISDIR;
+	const std::string& data = vfile.file->data;
+	if (offset >= data.size())
+		return 0;
+	const size_t len = std::min(bytes, size_t(data.size() - offset));
+	machine.copy_to_guest(g_buf, &data[offset], len);
+	return len;
+}
+
+/* Read from an emulated pipe, socketpair or eventfd. Returns -EAGAIN
+   when there is nothing to read yet, see emulated_syscall_result(). */
+static int64_t emulated_read(Machine& machine, FileDescriptors::EmulatedFd& efd,
+	uint64_t g_buf, size_t bytes)
+{
+	auto* ch = efd.rx.get();
+	if (ch == nullptr)
+		return -EBADF;
+	if (ch->is_eventfd) {
+		if (bytes < sizeof(uint64_t))
+			return -EINVAL;
+		if (ch->counter == 0)
+			return -EAGAIN;
+		const uint64_t value = ch->semaphore ? 1 : ch->counter;
+		machine.copy_to_guest(g_buf, &value, sizeof(value));
+		ch->counter -= value;
+		return sizeof(value);
+	}
+	const size_t len = std::min(bytes, ch->used);
+	if (len == 0)
+		return (bytes == 0 || ch->writers == 0) ? 0 : -EAGAIN;
+	const size_t first = std::min(len, FileDescriptors::Channel::CAPACITY - ch->head);
+	machine.copy_to_guest(g_buf, &ch->ring[ch->head], first);
+	if (len > first)
+		machine.copy_to_guest(g_buf + first, &ch->ring[0], len - first);
+	ch->consume(len);
+	return len;
+}
+/* Write to an emulated pipe, socketpair or eventfd. Returns -EAGAIN
+   when the channel is full. Like MSG_NOSIGNAL, there is no SIGPIPE. */
+static int64_t emulated_write(Machine& machine, FileDescriptors::EmulatedFd& efd,
+	uint64_t g_buf, size_t bytes)
+{
+	auto* ch = efd.tx.get();
+	if (ch == nullptr)
+		return -EBADF;
+	if (ch->is_eventfd) {
+		uint64_t value;
+		if (bytes < sizeof(value))
+			return -EINVAL;
+		machine.copy_from_guest(&value, g_buf, sizeof(value));
+		if (value == UINT64_MAX)
+			return -EINVAL;
+		if (value > UINT64_MAX - 1 - ch->counter)
+			return -EAGAIN;
+		ch->counter += value;
+		return sizeof(value);
+	}
+	if (ch->readers == 0)
+		return -EPIPE;
+	const size_t len = std::min(bytes, FileDescriptors::Channel::CAPACITY - ch->used);
+	if (len == 0)
+		return (bytes == 0) ? 0 : -EAGAIN;
+	machine.foreach_memory(g_buf, len,
+		[ch] (std::string_view buffer) {
+			ch->write(buffer.data(), buffer.size());
+		});
+	return len;
+}
+/* Set the result of a system call on an emulated fd. A blocking read or
+   write that cannot proceed lets the other guest threads run instead,
+   as one of them has to be at the other end. The system call is issued
+   again when the thread is resumed, so the guest never sees it fail.
+   A lone thread would block forever, which is a deadlock. */
+static void emulated_syscall_result(vCPU& cpu, bool nonblocking, int64_t result)
+{
+	auto& regs = cpu.registers();
+	if (result == -EAGAIN && !nonblocking) {
+		/* Back to the syscall instruction, with the number in RAX */
+		const uint64_t sysnum = regs.rax;
+		regs.rcx -= 2;
+		cpu.set_registers(regs);
+		if (cpu.machine().threads().suspend_and_yield(sysnum))
+			return;
+		regs.rcx += 2;
+		cpu.set_registers(regs);
+		throw MachineException("Deadlock: Blocking on an emulated fd with no other thread to run", sysnum);
+	}
+	regs.rax = result;
+	cpu.set_registers(regs);
+}
+
+static void stat_to_statx(const struct stat& st, struct statx& stx)
+{
+	std::memset(&stx, 0, sizeof(stx));
+	stx.stx_mask = STATX_BASIC_STATS;
+	stx.stx_blksize = st.st_blksize;
+	stx.stx_nlink = st.st_nlink;
+	stx.stx_uid = st.st_uid;
+	stx.stx_gid = st.st_gid;
+	stx.stx_mode = st.st_mode;
+	stx.stx_ino = st.st_ino;
+	stx.stx_size = st.st_size;
+	stx.stx_blocks = st.st_blocks;
+	stx.stx_atime.tv_sec = st.st_atim.tv_sec;
+	stx.stx_atime.tv_nsec = st.st_atim.tv_nsec;
+	stx.stx_ctime.tv_sec = st.st_ctim.tv_sec;
+	stx.stx_ctime.tv_nsec = st.st_ctim.tv_nsec;
+	stx.stx_mtime.tv_sec = st.st_mtim.tv_sec;
+	stx.stx_mtime.tv_nsec = st.st_mtim.tv_nsec;
+	stx.stx_dev_major = major(st.st_dev);
+	stx.stx_dev_minor = minor(st.st_dev);
+}
+
+/* List a virtual directory into a linux_dirent64 buffer. The offset
+   of the open directory is the index of the next entry, where the
+   first two are "." and "..". */
+static int64_t virtual_getdents64(Machine& machine, FileDescriptors::VirtualFile& vdir,
+	uint64_t g_buf, size_t bytes)
+{
+	if (!vdir.file->is_directory())
+		return -ENOTDIR;
+	auto* vfs = machine.fds().virtual_filesystem();
+	std::array<char, 4096> buffer;
+	const size_t capacity = std::min(bytes, buffer.size());
+	size_t total = 0;
+	while (true) {
+		std::string name;
+		VirtualFileSystem::file_t entry;
+		if (vdir.offset < 2) {
+			name = (vdir.offset == 0) ? "." : "..";
+			entry = vdir.file;
+		} else if (vfs == nullptr || !vfs->read_directory(*vdir.file, vdir.offset - 2, name, entry)) {
+			break;
+		}
+		const size_t reclen = (offsetof(struct dirent64, d_name) + name.size() + 1 + 7) & ~size_t(7);
+		if (total + reclen > capacity) {
+			if (total == 0)
+				return -EINVAL;
+			break;
+		}
+		auto* dent = (struct dirent64 *)&buffer[total];
+		dent->d_ino = entry->st.st_ino;
+		dent->d_off = vdir.offset + 1;
+		dent->d_reclen = reclen;
+		dent->d_type = entry->is_directory() ? DT_DIR : DT_REG;
+		std::memcpy(dent->d_name, name.c_str(), name.size() + 1);
+		total += reclen;
+		vdir.offset++;
+	}
+	if (total > 0)
+		machine.copy_to_guest(g_buf, buffer.data(), total);
+	return total;
+}
+
 void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 {
 	Machine::install_unhandled_syscall_handler(
@@ -68,17 +282,42 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 		SYS_read, [] (vCPU& cpu) { // READ
 			auto& regs = cpu.registers();
 			const int vfd = int(regs.rdi);
+			if (auto* vfile = cpu.machine().fds().get_virtual_file(vfd); vfile != nullptr) {
+				const int64_t result = virtual_read(cpu.machine(), *vfile, regs.rsi, regs.rdx, vfile->offset);
+				if (result > 0)
+					vfile->offset += result;
+				regs.rax = result;
+				cpu.set_registers(regs);
+				SYSPRINT("read(vfd=%d (virtual), data=0x%llX, size=%llu) = %lld\n",
+					vfd, regs.rsi, regs.rdx, regs.rax);
+				return;
+			}
+			if (auto* efd = cpu.machine().fds().get_emulated_fd(vfd); efd != nullptr) {
+				emulated_syscall_result(cpu, efd->nonblocking,
+					emulated_read(cpu.machine(), *efd, regs.rsi, regs.rdx));
+				SYSPRINT("read(vfd=%d (emulated), data=0x%llX, size=%llu) = %lld\n",
+					vfd, regs.rsi, regs.rdx, regs.rax);
+				return;
+			}
 			int fd = cpu.machine().fds().translate(vfd);
-			std::vector<tinykvm::Machine::WrBuffer> buffers;
+			auto& buffers = cpu.io_wrbuffers();
 
 			/* Writable readv buffers */
 			auto bufcount = cpu.machine().writable_buffers_from_range(
 				buffers, regs.rsi, regs.rdx);
 
 			ssize_t result = 0;
-			if (bufcount == 1) {
+			if (int64_t offloaded; cpu.machine().offload_file_read(cpu, fd,
+					(const struct iovec *)&buffers[0], bufcount, -1, offloaded)) {
+				if (cpu.machine().io_pending())
+					return; // Suspended until the read completes
+				result = offloaded;
+				errno = -offloaded;
+			} else if (bufcount == 1) {
+				BlockingCall blocking { cpu };
 				result = read(fd, buffers[0].ptr, buffers[0].len);
 			} else {
+				BlockingCall blocking { cpu };
 				result = readv(fd, (struct iovec *)&buffers[0], bufcount);
 			}
 			if (UNLIKELY(result < 0)) {
@@ -114,14 +353,22 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 					vfd, vfd, regs.rsi, bytes, regs.rax);
 				return;
 			}
+			if (auto* efd = cpu.machine().fds().get_emulated_fd(vfd); efd != nullptr) {
+				emulated_syscall_result(cpu, efd->nonblocking,
+					emulated_write(cpu.machine(), *efd, regs.rsi, bytes));
+				SYSPRINT("write(vfd=%d (emulated), data=0x%llX, size=%zu) = %lld\n",
+					vfd, regs.rsi, bytes, regs.rax);
+				return;
+			}
 			if (vfd != 1 && vfd != 2) {
 				/* Use gather-buffers and writev */
-				std::vector<tinykvm::Machine::Buffer> buffers;
+				auto& buffers = cpu.io_buffers();
 				const auto bufcount =
 					cpu.machine().gather_buffers_from_range(buffers, regs.rsi, bytes);
 
 				/* Complain about writes outside of existing FDs */
 				const int fd = cpu.machine().fds().translate_writable_vfd(regs.rdi);
+				BlockingCall blocking { cpu };
 				if (bufcount > 1) {
 					regs.rax = writev(fd, (const struct iovec *)buffers.data(), bufcount);
 				} else {
@@ -152,6 +399,12 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 				/* Silently ignore close on stdin/stdout/stderr */
 				real_fd = vfd;
 				regs.rax = 0;
+			} else if (cpu.machine().fds().get_virtual_file(vfd) != nullptr
+				|| cpu.machine().fds().get_emulated_fd(vfd) != nullptr) {
+				/* Virtual and emulated files have no real fd */
+				if (cpu.machine().fds().free(vfd))
+					return;
+				regs.rax = 0;
 			} else {
 				auto opt_entry = cpu.machine().fds().entry_for_vfd(vfd);
 				if (opt_entry.has_value()) {
@@ -185,6 +438,14 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			const auto vpath = regs.rdi;
 
 			std::string path = cpu.machine().memcstring(vpath, PATH_MAX);
+			if (auto vfile = cpu.machine().fds().find_virtual_path(AT_FDCWD, path)) {
+				cpu.machine().copy_to_guest(regs.rsi, &vfile->st, sizeof(vfile->st));
+				regs.rax = 0;
+				cpu.set_registers(regs);
+				SYSPRINT("stat(path=%s, data=0x%llX) = %lld (virtual)\n",
+					path.c_str(), regs.rsi, regs.rax);
+				return;
+			}
 			if (UNLIKELY(!cpu.machine().fds().is_readable_path(path))) {
 				regs.rax = -EACCES;
 				cpu.set_registers(regs);
@@ -194,8 +455,8 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			}
 
 			struct stat vstat;
-			const int result = syscall(SYS_stat, path.c_str(), &vstat);
-			regs.rax = (result == 0) ? 0 : -errno;
+			const int result = cpu.machine().fds().stat_path(path, vstat, true);
+			regs.rax = result;
 			if (result == 0) {
 				cpu.machine().copy_to_guest(regs.rsi, &vstat, sizeof(vstat));
 			}
@@ -209,6 +470,27 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 
 			int fd = regs.rdi;
 			try {
+				if (auto* vfile = cpu.machine().fds().get_virtual_file(fd); vfile != nullptr) {
+					cpu.machine().copy_to_guest(regs.rsi, &vfile->file->st, sizeof(vfile->file->st));
+					regs.rax = 0;
+					cpu.set_registers(regs);
+					SYSPRINT("FSTAT to vfd=%lld (virtual), data=0x%llX = %lld\n",
+						regs.rdi, regs.rsi, regs.rax);
+					return;
+				}
+				if (auto* efd = cpu.machine().fds().get_emulated_fd(fd); efd != nullptr) {
+					struct stat vstat {};
+					vstat.st_mode = (efd->type == FileDescriptors::SocketType::PIPE2) ? (S_IFIFO | 0600)
+						: (efd->type == FileDescriptors::SocketType::SOCKETPAIR) ? (S_IFSOCK | 0777) : 0600;
+					vstat.st_nlink = 1;
+					vstat.st_blksize = 4096;
+					cpu.machine().copy_to_guest(regs.rsi, &vstat, sizeof(vstat));
+					regs.rax = 0;
+					cpu.set_registers(regs);
+					SYSPRINT("FSTAT to vfd=%lld (emulated), data=0x%llX = %lld\n",
+						regs.rdi, regs.rsi, regs.rax);
+					return;
+				}
 				fd = cpu.machine().fds().translate(regs.rdi);
 				struct stat vstat;
 				regs.rax = fstat(fd, &vstat);
@@ -229,7 +511,11 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			auto& regs = cpu.registers();
 			const auto vpath = regs.rdi;
 			std::string path = cpu.machine().memcstring(vpath, PATH_MAX);
-			if (UNLIKELY(!cpu.machine().fds().is_readable_path(path))) {
+			if (auto vfile = cpu.machine().fds().find_virtual_path(AT_FDCWD, path)) {
+				// The virtual filesystem has no symlinks
+				cpu.machine().copy_to_guest(regs.rsi, &vfile->st, sizeof(vfile->st));
+				regs.rax = 0;
+			} else if (UNLIKELY(!cpu.machine().fds().is_readable_path(path))) {
 				// Some paths are extremely annoyingly "required" by some guests
 				// in order to proceed with things *unrelated* to the path.
 				const std::string& cwd = cpu.machine().fds().current_working_directory();
@@ -252,13 +538,11 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 				}
 			} else {
 				struct stat vstat;
-				const int result = syscall(SYS_lstat, path.c_str(), &vstat);
+				const int result = cpu.machine().fds().stat_path(path, vstat, false);
 				if (result == 0) {
 					cpu.machine().copy_to_guest(regs.rsi, &vstat, sizeof(vstat));
-					regs.rax = 0;
-				} else {
-					regs.rax = -errno;
 				}
+				regs.rax = result;
 			}
 			cpu.set_registers(regs);
 			SYSPRINT("LSTAT to path=%s, data=0x%llX = %lld\n",
@@ -269,6 +553,26 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			auto& regs = cpu.registers();
 			int fd = regs.rdi;
 			try {
+				if (auto* vfile = cpu.machine().fds().get_virtual_file(fd); vfile != nullptr) {
+					const int64_t offset = regs.rsi;
+					int64_t base = -1;
+					if (regs.rdx == SEEK_SET)
+						base = 0;
+					else if (regs.rdx == SEEK_CUR)
+						base = vfile->offset;
+					else if (regs.rdx == SEEK_END && !vfile->file->is_directory())
+						base = vfile->file->data.size();
+					if (base < 0 || base + offset < 0) {
+						regs.rax = -EINVAL;
+					} else {
+						vfile->offset = base + offset;
+						regs.rax = vfile->offset;
+					}
+					cpu.set_registers(regs);
+					SYSPRINT("lseek(vfd=%lld (virtual), offset=%lld, whence=%lld) = %lld\n",
+						regs.rdi, regs.rsi, regs.rdx, regs.rax);
+					return;
+				}
 				fd = cpu.machine().fds().translate(regs.rdi);
 				regs.rax = lseek(fd, regs.rsi, regs.rdx);
 				if (int(regs.rax) < 0) {
@@ -286,7 +590,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			auto& regs = cpu.registers();
 			const unsigned guest_count = regs.rsi;
 			auto *fds = cpu.machine().template writable_memarray<struct pollfd>(regs.rdi, guest_count);
-			const int timeout = int(regs.rdx);
+			int timeout = int(regs.rdx);
 			// Check if we have a callback for poll, and if we do potentially
 			// skip the syscall if the callback returns false.
 			if (auto& callback = cpu.machine().fds().poll_callback; callback) {
@@ -296,8 +600,16 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			std::array<struct pollfd, 256> host_fds;
 			std::array<unsigned, 256> host_fds_indexes;
 			unsigned host_fds_count = 0;
+			unsigned emulated_ready = 0;
 			for (unsigned i = 0; i < guest_count; i++)
 			{
+				// Emulated fds are polled without the host
+				if (auto* efd = cpu.machine().fds().get_emulated_fd(fds[i].fd); efd != nullptr) {
+					fds[i].revents = efd->poll_events() & (fds[i].events | POLLERR | POLLHUP);
+					if (fds[i].revents != 0)
+						emulated_ready++;
+					continue;
+				}
 				// Translate the fd
 				const int fd = cpu.machine().fds().translate(fds[i].fd);
 				if (fd < 0) {
@@ -309,11 +621,17 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 				host_fds_indexes.at(host_fds_count) = i;
 				host_fds_count++;
 			}
+			if (emulated_ready > 0)
+				timeout = 0;
+			// A co_vmcall() suspends the guest instead of blocking
+			if (cpu.machine().suspend_for_io(cpu, host_fds.data(), host_fds_count, timeout))
+				return;
 			if (host_fds_count == 0) {
-				regs.rax = 0;
+				regs.rax = emulated_ready;
 			} else {
 				// Call poll on the host
 				const int real_timeout = cpu.machine().is_forked() ? timeout : std::min(1, timeout);
+				BlockingCall blocking { cpu };
 				regs.rax = poll(host_fds.data(), host_fds_count, real_timeout);
 				if (int(regs.rax) < 0) {
 					regs.rax = -errno;
@@ -325,6 +643,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 						const unsigned index = host_fds_indexes.at(i);
 						fds[index].revents = host_fds[i].revents;
 					}
+					regs.rax += emulated_ready;
 				}
 			}
 			cpu.set_registers(regs);
@@ -346,6 +665,12 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 				// mmap to file fd
 				const int vfd = int(regs.r8);
 				const int64_t voff = regs.r9;
+				if (UNLIKELY(io_uring_mmap(cpu, vfd, voff))) {
+					PRINTMMAP("mmap(io_uring vfd=%d, offset=0x%lX) = 0x%llX\n",
+						vfd, voff, regs.rax);
+					return;
+				}
+				const auto* vfile = cpu.machine().fds().get_virtual_file(vfd);
 				const int real_fd = cpu.machine().fds().translate(vfd);
 				const bool mmap_backed_files = cpu.machine().memory.mmap_backed_files;
 				const uint64_t read_length = regs.rsi; // Don't align the read length
@@ -370,7 +695,17 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 				// Readv into the area
 				regs.rax = ~0ULL;
 
-				if (cpu.machine().memory.mmap_backed_files && dst >= cpu.machine().mmap_start() && is_somewhat_large && !cpu.machine().is_forked())
+				if (vfile != nullptr)
+				{
+					// Copy from the virtual file, zeroing the rest of the mapping
+					const int64_t copied = (voff < 0) ? -EINVAL
+						: virtual_read(cpu.machine(), *vfile, dst, read_length, voff);
+					if (copied >= 0) {
+						cpu.machine().memzero(dst + copied, length - copied);
+						regs.rax = dst;
+					}
+				}
+				else if (cpu.machine().memory.mmap_backed_files && dst >= cpu.machine().mmap_start() && is_somewhat_large && !cpu.machine().is_forked())
 				{
 					// Use mmap area for large reads
 					if (cpu.machine().mmap_backed_area(real_fd, voff, prot, dst, read_length)) {
@@ -384,9 +719,9 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 					}
 				}
 
-				if (regs.rax == ~0ULL)
+				if (regs.rax == ~0ULL && vfile == nullptr)
 				{
-					std::vector<tinykvm::Machine::WrBuffer> buffers;
+					auto& buffers = cpu.io_wrbuffers();
 					const size_t cnt =
 						cpu.machine().writable_buffers_from_range(buffers, dst, read_length);
 					// Seek to the given offset in the file and read the contents into guest memory
@@ -467,6 +802,8 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			const uint64_t old_size = (regs.rsi + PageMask) & ~PageMask;
 			[[maybe_unused]] bool relaxed =
 				cpu.machine().mmap_unmap(old_base, old_size);
+			// The working memory behind the range can be used again
+			cpu.machine().release_pages(old_base, old_size);
 			// Because we do not support MMAP fully, we will just return 0 here.
 			regs.rax = 0;
 			cpu.set_registers(regs);
@@ -574,7 +911,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 		{
 			auto& regs = cpu.registers();
 			if (regs.rdi != 0x0) {
-				auto& ss = cpu.machine().signals().per_thread(cpu.machine().threads().gettid()).stack;
+				auto& ss = cpu.machine().signals().per_thread(cpu.machine().threads().gettid(cpu)).stack;
 				cpu.machine().copy_from_guest(&ss, regs.rdi, sizeof(ss));
 
 				SYSPRINT("sigaltstack(altstack SP=0x%lX  flags=0x%X  size=0x%lX)\n",
@@ -619,6 +956,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 				} else {
 					int arg = 0;
 					cpu.machine().copy_from_guest(&arg, regs.rdx, sizeof(arg));
+					cpu.machine().fds().unpool(regs.rdi);
 					const int result = ioctl(fd, FIONBIO, &arg);
 					if (result < 0) {
 						regs.rax = -errno;
@@ -663,15 +1001,30 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			const uint64_t g_buf = regs.rsi;
 			const size_t   bytes = regs.rdx;
 			const off64_t  offset = regs.r10;
+			if (auto* vfile = cpu.machine().fds().get_virtual_file(vfd); vfile != nullptr) {
+				regs.rax = (offset < 0) ? -EINVAL : virtual_read(cpu.machine(), *vfile, g_buf, bytes, offset);
+				cpu.set_registers(regs);
+				SYSPRINT("pread64(fd=%d (virtual), buf=0x%lX, size=%zu, offset=%lu) = %lld\n",
+					 vfd, g_buf, bytes, offset, regs.rax);
+				return;
+			}
 			const int fd = cpu.machine().fds().translate(vfd);
 
 			// Readv into the area
-			std::vector<tinykvm::Machine::WrBuffer> buffers;
+			auto& buffers = cpu.io_wrbuffers();
 			const auto bufcount =
 				cpu.machine().writable_buffers_from_range(buffers, g_buf, bytes);
 
-			ssize_t result =
-				preadv64(fd, (iovec *)&buffers[0], bufcount, offset);
+			ssize_t result = 0;
+			if (int64_t offloaded; cpu.machine().offload_file_read(cpu, fd,
+					(const struct iovec *)&buffers[0], bufcount, offset, offloaded)) {
+				if (cpu.machine().io_pending())
+					return; // Suspended until the read completes
+				result = offloaded;
+				errno = -offloaded;
+			} else {
+				result = preadv64(fd, (iovec *)&buffers[0], bufcount, offset);
+			}
 			if (result < 0) {
 				regs.rax = -errno;
 			}
@@ -692,7 +1045,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			const int fd = cpu.machine().fds().translate_writable_vfd(vfd);
 
 			// writev into the area
-			std::vector<tinykvm::Machine::Buffer> buffers;
+			auto& buffers = cpu.io_buffers();
 			const auto bufcount =
 				cpu.machine().gather_buffers_from_range(buffers, g_buf, bytes);
 
@@ -706,6 +1059,73 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			SYSPRINT("pwrite64(fd=%d, buf=0x%llX, size=%llu, offset=%llu) = %lld\n",
 					 vfd, g_buf, bytes, offset, regs.rax);
 		});
+	Machine::install_syscall_handler( // sendfile
+		SYS_sendfile, [](vCPU& cpu) {
+			auto& regs = cpu.registers();
+			const int out_vfd = regs.rdi;
+			const int in_vfd = regs.rsi;
+			const uint64_t g_offset = regs.rdx;
+			const size_t count = regs.r10;
+			const int in_fd = cpu.machine().fds().translate(in_vfd);
+
+			off_t offset = 0;
+			if (g_offset != 0x0)
+				cpu.machine().copy_from_guest(&offset, g_offset, sizeof(offset));
+			ssize_t result;
+			if (out_vfd == 1 || out_vfd == 2) {
+				/* Standard output is the print callback */
+				result = copy_fd_to_print(cpu.machine(), in_fd,
+					(g_offset != 0x0) ? &offset : nullptr, count);
+			} else {
+				const int out_fd = cpu.machine().fds().translate_writable_vfd(out_vfd);
+				BlockingCall blocking { cpu };
+				result = sendfile(out_fd, in_fd, (g_offset != 0x0) ? &offset : nullptr, count);
+			}
+			if (result < 0) {
+				regs.rax = -errno;
+			} else {
+				regs.rax = result;
+				if (g_offset != 0x0)
+					cpu.machine().copy_to_guest(g_offset, &offset, sizeof(offset));
+			}
+			SYSPRINT("sendfile(out=%d, in=%d, offset=0x%lX, count=%zu) = %lld\n",
+				out_vfd, in_vfd, g_offset, count, regs.rax);
+			cpu.set_registers(regs);
+		});
+	Machine::install_syscall_handler( // splice
+		SYS_splice, [](vCPU& cpu) {
+			auto& regs = cpu.registers();
+			const int in_vfd = regs.rdi;
+			const uint64_t g_off_in = regs.rsi;
+			const int out_vfd = regs.rdx;
+			const uint64_t g_off_out = regs.r10;
+			const size_t len = regs.r8;
+			const unsigned flags = regs.r9;
+			regs.rax = fd_transfer(cpu, in_vfd, g_off_in, out_vfd, g_off_out,
+				[len, flags] (int in_fd, loff_t* off_in, int out_fd, loff_t* off_out) {
+					return splice(in_fd, off_in, out_fd, off_out, len, flags);
+				});
+			SYSPRINT("splice(in=%d, out=%d, len=%zu, flags=0x%X) = %lld\n",
+				in_vfd, out_vfd, len, flags, regs.rax);
+			cpu.set_registers(regs);
+		});
+	Machine::install_syscall_handler( // copy_file_range
+		SYS_copy_file_range, [](vCPU& cpu) {
+			auto& regs = cpu.registers();
+			const int in_vfd = regs.rdi;
+			const uint64_t g_off_in = regs.rsi;
+			const int out_vfd = regs.rdx;
+			const uint64_t g_off_out = regs.r10;
+			const size_t len = regs.r8;
+			const unsigned flags = regs.r9;
+			regs.rax = fd_transfer(cpu, in_vfd, g_off_in, out_vfd, g_off_out,
+				[len, flags] (int in_fd, loff_t* off_in, int out_fd, loff_t* off_out) {
+					return copy_file_range(in_fd, off_in, out_fd, off_out, len, flags);
+				});
+			SYSPRINT("copy_file_range(in=%d, out=%d, len=%zu, flags=0x%X) = %lld\n",
+				in_vfd, out_vfd, len, flags, regs.rax);
+			cpu.set_registers(regs);
+		});
 	Machine::install_syscall_handler( // writev
 		SYS_writev, [](vCPU& cpu) {
 			auto& regs = cpu.registers();
@@ -748,6 +1168,30 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 				regs.rax = written;
 				fd = vfd;
 			}
+			else if (auto* efd = cpu.machine().fds().get_emulated_fd(vfd); efd != nullptr)
+			{
+				std::array<g_iovec, 64> vecs;
+				cpu.machine().copy_from_guest(vecs.data(), regs.rsi, count * sizeof(g_iovec));
+				int64_t written = 0;
+				for (size_t i = 0; i < count; i++)
+				{
+					const int64_t result = emulated_write(cpu.machine(), *efd,
+						vecs[i].iov_base, vecs[i].iov_len);
+					if (result < 0) {
+						// An error after a partial write is not reported
+						if (written == 0)
+							written = result;
+						break;
+					}
+					written += result;
+					if (size_t(result) < vecs[i].iov_len)
+						break;
+				}
+				emulated_syscall_result(cpu, efd->nonblocking, written);
+				SYSPRINT("writev(%d (emulated), 0x%llX, %u) = %lld\n",
+						 vfd, regs.rsi, count, regs.rax);
+				return;
+			}
 			else
 			{
 				fd = cpu.machine().fds().translate_writable_vfd(vfd);
@@ -755,7 +1199,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 				{
 					std::array<g_iovec, 64> vecs;
 					cpu.machine().copy_from_guest(vecs.data(), regs.rsi, count * sizeof(g_iovec));
-					std::vector<tinykvm::Machine::Buffer> buffers;
+					auto& buffers = cpu.io_buffers();
 
 					for (size_t i = 0; i < count; i++)
 					{
@@ -789,17 +1233,17 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			const uint64_t vpath = regs.rdi;
 			std::string path = cpu.machine().memcstring(vpath, PATH_MAX);
 			const int mode = regs.rsi;
-			if (UNLIKELY(!cpu.machine().fds().is_readable_path(path)))
+			if (auto vfile = cpu.machine().fds().find_virtual_path(AT_FDCWD, path))
 			{
-				regs.rax = -EACCES;
+				regs.rax = (mode & W_OK) ? -EROFS : 0;
 			}
-			else if (UNLIKELY(access(path.c_str(), mode) < 0))
+			else if (UNLIKELY(!cpu.machine().fds().is_readable_path(path)))
 			{
-				regs.rax = -errno;
+				regs.rax = -EACCES;
 			}
 			else
 			{
-				regs.rax = 0;
+				regs.rax = cpu.machine().fds().access_path(path, mode);
 			}
 			cpu.set_registers(regs);
 			SYSPRINT("access(path=%s (0x%lX), mode=0x%X) = %lld\n",
@@ -812,7 +1256,14 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			const uint64_t g_pipefd = regs.rdi;
 			const int flags = regs.rsi;
 			int pipefd[2];
-			if (UNLIKELY(pipe2(pipefd, flags) < 0))
+			if (cpu.machine().fds().emulated_channels())
+			{
+				cpu.machine().fds().create_emulated(FileDescriptors::SocketType::PIPE2,
+					flags & O_NONBLOCK, pipefd);
+				cpu.machine().copy_to_guest(g_pipefd, pipefd, sizeof(pipefd));
+				regs.rax = 0;
+			}
+			else if (UNLIKELY(pipe2(pipefd, flags) < 0))
 			{
 				regs.rax = -errno;
 			}
@@ -864,6 +1315,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 #ifdef MREMAP_DONTUNMAP
 				if ((flags & MREMAP_DONTUNMAP) == 0) {
 					cpu.machine().mmap_unmap(old_addr, old_len);
+					cpu.machine().release_pages(old_addr, old_page_len);
 				}
 #endif
 				regs.rax = new_addr;
@@ -896,8 +1348,14 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 		SYS_madvise, [](vCPU& cpu) { // MADVISE
 			auto& regs = cpu.registers();
 			regs.rax = 0;
+			if (regs.rdx == MADV_DONTNEED || regs.rdx == MADV_FREE)
+			{
+				// Private pages are unmapped, and read as zeroes afterwards
+				cpu.machine().release_pages(regs.rdi, regs.rsi);
+			}
 			if (regs.rdx == MADV_DONTNEED)
 			{
+				// Whatever remains still has to be zeroed
 				cpu.machine().memzero(regs.rdi, regs.rsi);
 			}
 			cpu.set_registers(regs);
@@ -909,6 +1367,13 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			auto& regs = cpu.registers();
 			int fd = regs.rdi;
 			try {
+				if (auto* efd = cpu.machine().fds().get_emulated_fd(fd); efd != nullptr) {
+					const auto copy = *efd; // Not a reference into the map
+					regs.rax = cpu.machine().fds().manage_emulated(copy);
+					cpu.set_registers(regs);
+					SYSPRINT("dup(vfd=%lld (emulated)) = %lld\n", regs.rdi, regs.rax);
+					return;
+				}
 				fd = cpu.machine().fds().translate(fd);
 				const int new_fd = dup(fd);
 				if (new_fd < 0)
@@ -1036,6 +1501,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 				regs.rax = -EINVAL;
 			} else {
 				cpu.machine().copy_from_guest(optval.data(), g_optval, optlen);
+				cpu.machine().fds().unpool(regs.rdi);
 				if (setsockopt(fd, level, optname, optval.data(), optlen) < 0) {
 					regs.rax = -errno;
 				} else {
@@ -1094,6 +1560,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 				{
 					regs.rax = -EPERM;
 				} else {
+					BlockingCall blocking { cpu };
 					if (UNLIKELY(connect(fd, (struct sockaddr *)&addr, addrlen) < 0)) {
 						regs.rax = -errno;
 					}
@@ -1188,7 +1655,17 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 				if (!callback(vfd, fd, flags))
 					return;
 			}
-			const int result = accept4(fd, (struct sockaddr *)&addr, &addrlen, flags);
+			// A co_vmcall() suspends the guest until a connection arrives,
+			// unless the listener is non-blocking and accept4 should fail
+			const int fl = fcntl(fd, F_GETFL);
+			int timeout = (fl >= 0 && (fl & O_NONBLOCK)) ? 0 : -1;
+			const struct pollfd pfd { fd, POLLIN, 0 };
+			if (cpu.machine().suspend_for_io(cpu, &pfd, 1, timeout))
+				return;
+			const int result = [&] {
+				BlockingCall blocking { cpu };
+				return accept4(fd, (struct sockaddr *)&addr, &addrlen, flags);
+			}();
 			if (UNLIKELY(result < 0))
 			{
 				regs.rax = -errno;
@@ -1276,6 +1753,16 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			// int socketpair(int domain, int type, int protocol, int sv[2]);
 			const uint64_t g_sv = regs.r10;
 			int sv[2] = { 0, 0 };
+			if (cpu.machine().fds().emulated_channels()) {
+				cpu.machine().fds().create_emulated(FileDescriptors::SocketType::SOCKETPAIR,
+					int(regs.rsi) & SOCK_NONBLOCK, sv);
+				cpu.machine().copy_to_guest(g_sv, sv, sizeof(sv));
+				regs.rax = 0;
+				SYSPRINT("socketpair(AF_UNIX, SOCK_STREAM, 0, 0x%lX) = %lld {%d, %d} (emulated)\n",
+					g_sv, regs.rax, sv[0], sv[1]);
+				cpu.set_registers(regs);
+				return;
+			}
 			const int res = socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK, 0, sv);
 			if (UNLIKELY(res < 0))
 			{
@@ -1317,6 +1804,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 				else
 				{
 					fd = cpu.machine().fds().translate(vfd);
+					cpu.machine().fds().unpool(vfd);
 					regs.rax = ::shutdown(fd, regs.rsi);
 					if (int(regs.rax) < 0)
 						regs.rax = -errno;
@@ -1340,6 +1828,13 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			const uint64_t g_addr = regs.r8;
 			const socklen_t addrlen = regs.r9;
 			int fd = -1;
+			if (auto* efd = cpu.machine().fds().get_emulated_fd(vfd); efd != nullptr) {
+				emulated_syscall_result(cpu, efd->nonblocking || (flags & MSG_DONTWAIT),
+					emulated_write(cpu.machine(), *efd, g_buf, bytes));
+				SYSPRINT("sendto(fd=%d (emulated), buf=0x%lX, len=%lu) = %lld\n",
+					vfd, g_buf, bytes, regs.rax);
+				return;
+			}
 			try {
 				if (UNLIKELY(bytes > 512UL << 20)) // 512MB
 				{
@@ -1354,7 +1849,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 				{
 					fd = cpu.machine().fds().translate_writable_vfd(vfd);
 					// Gather memory buffers from the guest
-					std::vector<tinykvm::Machine::Buffer> buffers;
+					auto& buffers = cpu.io_buffers();
 					const auto bufcount =
 						cpu.machine().gather_buffers_from_range(buffers, g_buf, bytes);
 
@@ -1380,6 +1875,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 						regs.rax = -EPERM;
 					} else
 					{
+						BlockingCall blocking { cpu };
 						ssize_t result = sendmsg(fd, &msg, flags);
 						if (UNLIKELY(result < 0)) {
 							regs.rax = -errno;
@@ -1408,6 +1904,18 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			const uint64_t g_addr = regs.r8;
 			const uint64_t g_addrlen = regs.r9;
 			int fd = -1;
+			if (auto* efd = cpu.machine().fds().get_emulated_fd(vfd); efd != nullptr) {
+				// The address of a socketpair peer is unnamed
+				if (g_addrlen != 0x0) {
+					const socklen_t addrlen = 0;
+					cpu.machine().copy_to_guest(g_addrlen, &addrlen, sizeof(addrlen));
+				}
+				emulated_syscall_result(cpu, efd->nonblocking || (flags & MSG_DONTWAIT),
+					emulated_read(cpu.machine(), *efd, g_buf, bytes));
+				SYSPRINT("recvfrom(fd=%d (emulated), buf=0x%lX, len=%lu) = %lld\n",
+					vfd, g_buf, bytes, regs.rax);
+				return;
+			}
 			try {
 				if (UNLIKELY(bytes > 64UL << 20)) // 64MB
 				{
@@ -1417,7 +1925,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 				else
 				{
 					fd = cpu.machine().fds().translate(vfd);
-					std::vector<tinykvm::Machine::WrBuffer> buffers;
+					auto& buffers = cpu.io_wrbuffers();
 					const auto bufcount =
 						cpu.machine().writable_buffers_from_range(buffers, g_buf, bytes);
 					// We can't use recvfrom here, but there is recvmsg()
@@ -1431,7 +1939,11 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 					msg.msg_control = nullptr;
 					msg.msg_controllen = 0;
 					msg.msg_flags = 0;
-					ssize_t result = recvmsg(fd, &msg, flags);
+					ssize_t result;
+					{
+						BlockingCall blocking { cpu };
+						result = recvmsg(fd, &msg, flags);
+					}
 					if (UNLIKELY(result < 0))
 					{
 						regs.rax = -errno;
@@ -1484,7 +1996,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 				const uint64_t g_iov = (uintptr_t)msg.msg_iov;
 				cpu.machine().copy_from_guest(iovecs.data(), g_iov, msg.msg_iovlen * sizeof(GuestIOvec));
 				// Gather iovec information from the guest
-				std::vector<tinykvm::Machine::WrBuffer> buffers;
+				auto& buffers = cpu.io_wrbuffers();
 				size_t bufcount = 0;
 				for (size_t i = 0; i < msg.msg_iovlen; i++)
 				{
@@ -1515,7 +2027,11 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 					msg_recv.msg_controllen = msg.msg_controllen;
 				}
 				// Perform the recvmsg
-				ssize_t result = recvmsg(fd, &msg_recv, flags);
+				ssize_t result;
+				{
+					BlockingCall blocking { cpu };
+					result = recvmsg(fd, &msg_recv, flags);
+				}
 				if (UNLIKELY(result < 0)) {
 					regs.rax = -errno;
 				} else {
@@ -1552,7 +2068,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 				fd = cpu.machine().fds().translate_writable_vfd(vfd);
 				struct msghdr msg {};
 				cpu.machine().copy_from_guest(&msg, g_msg, sizeof(msg));
-				std::vector<tinykvm::Machine::Buffer> buffers;
+				auto& buffers = cpu.io_buffers();
 				std::array<GuestIOvec, 128> iovecs;
 				if (msg.msg_iovlen > iovecs.size())
 				{
@@ -1600,6 +2116,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 				else
 				{
 					// Perform the sendmsg
+					BlockingCall blocking { cpu };
 					ssize_t result = sendmsg(fd, &msg_send, flags);
 					if (UNLIKELY(result < 0)) {
 						regs.rax = -errno;
@@ -1671,7 +2188,18 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			try {
 				fd = cpu.machine().fds().translate(vfd);
 				regs.rax = 0;
-				if (fd < 0)
+				if (auto* efd = cpu.machine().fds().get_emulated_fd(vfd); efd != nullptr)
+				{
+					if (cmd == F_GETFL)
+						regs.rax = efd->nonblocking ? O_NONBLOCK : 0;
+					else if (cmd == F_SETFL)
+						efd->nonblocking = (regs.rdx & O_NONBLOCK) != 0;
+					else if (cmd == F_GETFD)
+						regs.rax = 0x1;
+					else if (cmd != F_SETFD)
+						regs.rax = -EINVAL;
+				}
+				else if (fd < 0)
 				{
 					regs.rax = -EBADF;
 				}
@@ -1700,6 +2228,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 					const int writable_fd = cpu.machine().fds().translate(vfd);
 					const int allowed_flags = O_NONBLOCK;
 					const int flags = regs.rdx & allowed_flags;
+					cpu.machine().fds().unpool(vfd);
 					if (fcntl(writable_fd, F_SETFL, flags) < 0)
 					{
 						regs.rax = -errno;
@@ -1880,7 +2409,6 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			std::string path = cpu.machine().memcstring(regs.rdi, PATH_MAX);
 			const uint64_t g_buf = regs.rsi;
 			const size_t bufsiz = regs.rdx;
-			std::array<char, PATH_MAX> buf;
 			// Check if the symlink resolves to anything
 			if (cpu.machine().fds().resolve_symlink(path))
 			{
@@ -1888,7 +2416,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 				// return buffer to the guest.
 				cpu.machine().copy_to_guest(g_buf, path.c_str(), path.size());
 				regs.rax = path.size();
-			} else if (bufsiz > buf.size()) {
+			} else if (bufsiz > PATH_MAX) {
 				regs.rax = -EINVAL;
 			} else if (UNLIKELY(!cpu.machine().fds().is_readable_path(path))) {
 				// This should be a permission error or EACCES, but some run-times
@@ -1897,16 +2425,17 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 				regs.rax = -EINVAL;
 			} else {
 				// Read the link
-				const int guest_cwd = cpu.machine().fds().current_working_directory_fd();
-				ssize_t result = readlinkat(guest_cwd, path.c_str(), buf.data(), bufsiz);
+				std::string target;
+				const int result = cpu.machine().fds().readlink_path(path, target);
 				if (result < 0)
 				{
-					regs.rax = -errno;
+					regs.rax = result;
 				}
 				else
 				{
-					cpu.machine().copy_to_guest(g_buf, buf.data(), result);
-					regs.rax = result;
+					const size_t len = std::min(target.size(), bufsiz);
+					cpu.machine().copy_to_guest(g_buf, target.data(), len);
+					regs.rax = len;
 				}
 			}
 			cpu.set_registers(regs);
@@ -2163,6 +2692,13 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 		SYS_getdents64, [](vCPU& cpu) { // GETDENTS64
 			auto& regs = cpu.registers();
 
+			if (auto* vdir = cpu.machine().fds().get_virtual_file(regs.rdi); vdir != nullptr) {
+				regs.rax = virtual_getdents64(cpu.machine(), *vdir, regs.rsi, regs.rdx);
+				cpu.set_registers(regs);
+				SYSPRINT("GETDENTS64 to vfd=%lld (virtual), data=0x%llX = %lld\n",
+					regs.rdi, regs.rsi, regs.rax);
+				return;
+			}
 			int fd = cpu.machine().fds().translate(regs.rdi);
 
 			char buffer[2048];
@@ -2251,6 +2787,26 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			std::string path = cpu.machine().memcstring(vpath, PATH_MAX);
 			std::string real_path;
 			bool write_flags = (flags & (O_WRONLY | O_RDWR)) != 0x0;
+			if (!write_flags && cpu.machine().fds().virtual_filesystem() != nullptr)
+			{
+				try {
+					if (auto vfile = cpu.machine().fds().find_virtual_path(vfd, path)) {
+						if ((regs.rdx & O_DIRECTORY) && !vfile->is_directory())
+							regs.rax = -ENOTDIR;
+						else
+							regs.rax = cpu.machine().fds().manage_virtual(std::move(vfile));
+						cpu.set_registers(regs);
+						SYSPRINT("OPENAT fd=%d path=%s = %lld (virtual)\n",
+							vfd, path.c_str(), regs.rax);
+						return;
+					}
+				} catch (const std::exception& e) {
+					regs.rax = -EMFILE;
+					cpu.set_registers(regs);
+					SYSPRINT("OPENAT fd=%d path=%s failed: %s\n", vfd, path.c_str(), e.what());
+					return;
+				}
+			}
 			if (!write_flags)
 			{
 				try {
@@ -2360,6 +2916,17 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			try {
 				path = cpu.machine().memcstring(vpath, PATH_MAX);
 
+				auto* vfile = cpu.machine().fds().get_virtual_file(vfd);
+				auto vpfile = (vfile != nullptr && path.empty()) ? vfile->file
+					: cpu.machine().fds().find_virtual_path(vfd, path);
+				if (vpfile != nullptr) {
+					cpu.machine().copy_to_guest(buffer, &vpfile->st, sizeof(vpfile->st));
+					regs.rax = 0;
+					cpu.set_registers(regs);
+					SYSPRINT("NEWFSTATAT to vfd=%lld, path=%s, data=0x%llX = %lld (virtual)\n",
+						regs.rdi, path.c_str(), buffer, regs.rax);
+					return;
+				}
 				if (vfd != AT_FDCWD) {
 					// Use existing vfd
 					fd = cpu.machine().fds().translate(int(regs.rdi));
@@ -2382,15 +2949,15 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 					// If path is empty, use AT_EMPTY_PATH to operate on the fd
 					flags = (path.empty() && vfd != AT_FDCWD) ? AT_EMPTY_PATH : 0;
 
-					struct stat64 vstat {};
-					// Path is in allow-list
-					const int result = syscall(SYS_newfstatat, fd, path.c_str(), &vstat, flags);
+					struct stat vstat {};
+					// Path is in allow-list. Absolute paths can be cached.
+					const int result = (!path.empty() && path[0] == '/')
+						? cpu.machine().fds().stat_path(path, vstat, true)
+						: (syscall(SYS_newfstatat, fd, path.c_str(), &vstat, flags) < 0 ? -errno : 0);
 					if (result == 0) {
 						cpu.machine().copy_to_guest(buffer, &vstat, sizeof(vstat));
-						regs.rax = 0;
-					} else {
-						regs.rax = -errno;
 					}
+					regs.rax = result;
 				}
 			} catch (...) {
 				regs.rax = -1;
@@ -2413,6 +2980,22 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 		{
 			/* SYS eventfd2 */
 			auto& regs = cpu.registers();
+			if (cpu.machine().fds().emulated_channels()) {
+				// int eventfd(unsigned int initval, int flags);
+				const int flags = regs.rsi;
+				int vfds[2];
+				auto& fds = cpu.machine().fds();
+				fds.create_emulated(FileDescriptors::SocketType::EVENTFD,
+					flags & EFD_NONBLOCK, vfds);
+				auto& channel = *fds.get_emulated_fd(vfds[0])->rx;
+				channel.counter = uint32_t(regs.rdi);
+				channel.semaphore = (flags & EFD_SEMAPHORE) != 0;
+				regs.rax = vfds[0];
+				cpu.set_registers(regs);
+				SYSPRINT("eventfd2(%u, 0x%X) = %lld (emulated)\n",
+					unsigned(regs.rdi), flags, regs.rax);
+				return;
+			}
 			const int real_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
 			const int vfd = cpu.machine().fds().manage(real_fd, false, true);
 			if (UNLIKELY(vfd < 0)) {
@@ -2519,7 +3102,29 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			const int fd = cpu.machine().fds().translate(vfd);
 			const uint64_t g_event = regs.r10;
 			struct epoll_event event {};
-			if (epollfd > 0 && fd >= 0 && epollfd != fd)
+			if (auto* efd = cpu.machine().fds().get_emulated_fd(vfd); efd != nullptr && epollfd > 0)
+			{
+				// Emulated fds are only known to the emulated side of the epoll
+				if (g_event != 0x0 && op != EPOLL_CTL_DEL) {
+					cpu.machine().copy_from_guest(&event, g_event, sizeof(event));
+				}
+				auto& registered = cpu.machine().fds().get_epoll_entry_for_vfd(regs.rdi).emulated_fds;
+				const bool exists = registered.count(vfd) != 0;
+				if (op == EPOLL_CTL_ADD && exists) {
+					regs.rax = -EEXIST;
+				} else if ((op == EPOLL_CTL_MOD || op == EPOLL_CTL_DEL) && !exists) {
+					regs.rax = -ENOENT;
+				} else if (op == EPOLL_CTL_ADD || op == EPOLL_CTL_MOD) {
+					registered[vfd] = event;
+					regs.rax = 0;
+				} else if (op == EPOLL_CTL_DEL) {
+					registered.erase(vfd);
+					regs.rax = 0;
+				} else {
+					regs.rax = -EINVAL;
+				}
+			}
+			else if (epollfd > 0 && fd >= 0 && epollfd != fd)
 			{
 				if (g_event != 0x0) {
 					cpu.machine().copy_from_guest(&event, g_event, sizeof(event));
@@ -2535,6 +3140,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 					} else if (op == EPOLL_CTL_DEL) {
 						ee.epoll_fds.erase(vfd);
 					}
+					cpu.machine().fds().record_epoll_ctl(regs.rdi, op, vfd, fd);
 					regs.rax = 0;
 				}
 			} else if (epollfd < 0 || fd < 0) {
@@ -2581,33 +3187,67 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			const int vfd = regs.rdi;
 			const uint64_t g_events = regs.rsi;
 			const int maxevents = std::min(size_t(regs.rdx), guest_events.size());
-			const int timeout = regs.r10;
+			int timeout = regs.r10;
 			const int epollfd = cpu.machine().fds().translate(vfd);
 			if (const auto& callback = cpu.machine().fds().epoll_wait_callback; callback) {
 				if (!callback(vfd, epollfd, timeout))
 					return;
 			}
+			// Emulated fds are ready without asking the host
+			int emulated = 0;
+			if (cpu.machine().fds().has_emulated_fds())
+			{
+				bool has_host_fds = true;
+				emulated = cpu.machine().fds().epoll_wait_emulated(vfd,
+					guest_events.data(), maxevents, has_host_fds);
+				if (!has_host_fds) {
+					regs.rax = emulated;
+					if (emulated > 0) {
+						cpu.machine().copy_to_guest(g_events, guest_events.data(),
+							emulated * sizeof(struct epoll_event));
+					}
+					cpu.set_registers(regs);
+					// Another guest thread has to make the fds ready
+					if (emulated == 0 && timeout != 0)
+						cpu.machine().threads().suspend_and_yield(-EINTR);
+					SYSPRINT("epoll_wait(fd=%d (emulated), g_events=0x%lX, maxevents=%d, timeout=%d) = %d\n",
+						vfd, g_events, maxevents, timeout, emulated);
+					return;
+				}
+				if (emulated > 0)
+					timeout = 0;
+			}
+			// A co_vmcall() suspends the guest until the epoll fd is readable
+			const struct pollfd pfd { epollfd, POLLIN, 0 };
+			if (cpu.machine().suspend_for_io(cpu, &pfd, 1, timeout))
+				return;
 			int result = -1;
-			if (cpu.machine().fds().preempt_epoll_wait()) {
+			{
+				BlockingCall blocking { cpu };
+				if (cpu.machine().fds().preempt_epoll_wait() && timeout != 0) {
 #ifdef SYS_epoll_pwait2
-				// Only wait for 250us, as we are *not* pre-empting the guest
-				const struct timespec ts {
-					.tv_sec = 0,
-					.tv_nsec = 25000000,
-				};
-				// Use syscall wrapper since RHEL9 has new enough kernel but not glibc
-				result = syscall(SYS_epoll_pwait2, epollfd, guest_events.data(),
-					maxevents, &ts, nullptr);
+					// Only wait for 250us, as we are *not* pre-empting the guest
+					const struct timespec ts {
+						.tv_sec = 0,
+						.tv_nsec = 25000000,
+					};
+					// Use syscall wrapper since RHEL9 has new enough kernel but not glibc
+					result = syscall(SYS_epoll_pwait2, epollfd, guest_events.data() + emulated,
+						maxevents - emulated, &ts, nullptr);
 #else
-				epoll_pwait(epollfd, guest_events.data(),
-					maxevents, 250, nullptr);
+					epoll_pwait(epollfd, guest_events.data() + emulated,
+						maxevents - emulated, 250, nullptr);
 #endif
+				}
+				else
+				{
+					// Wait for as long as the timeout
+					result = epoll_wait(epollfd, guest_events.data() + emulated,
+						maxevents - emulated, timeout);
+				}
 			}
-			else
-			{
-				// Wait for as long as the timeout
-				result = epoll_wait(epollfd, guest_events.data(), maxevents, timeout);
-			}
+			if (emulated > 0)
+				result = std::max(result, 0) + emulated;
 			if (UNLIKELY(cpu.timed_out())) {
 				throw MachineTimeoutException("epoll_wait timed out");
 			}
@@ -2756,7 +3396,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			{
 				std::array<struct mmsghdr, 1024> guest_msgs;
 				std::array<GuestIOvec, 1024> guest_iovecs;
-				std::vector<tinykvm::Machine::Buffer> buffers;
+				auto& buffers = cpu.io_buffers();
 				// Fetch the mmsghdrs from the guest
 				cpu.machine().copy_from_guest(guest_msgs.data(), g_buf, vcnt * sizeof(struct mmsghdr));
 				// For each mmsghdr, fetch the iovec and sockaddr
@@ -2818,6 +3458,94 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			SYSPRINT("sendmmsg(fd=%d, buf=0x%lX, count=%d) = %lld\n",
 					 fd, g_buf, vcnt, regs.rax);
 		});
+	Machine::install_syscall_handler(
+		SYS_recvmmsg, [](vCPU& cpu) { // recvmmsg
+			auto& regs = cpu.registers();
+			const int vfd = regs.rdi;
+			const uint64_t g_buf = regs.rsi;
+			/* Receiving fewer messages than asked for is allowed */
+			const unsigned vcnt = std::min(unsigned(regs.rdx), 64u);
+			const int flags = regs.r10;
+			const uint64_t g_timeout = regs.r8;
+			const int fd = cpu.machine().fds().translate(vfd);
+			if (fd > 0 && vcnt > 0)
+			{
+				std::array<struct mmsghdr, 64> guest_msgs;
+				std::array<struct mmsghdr, 64> msgs;
+				std::array<struct sockaddr_storage, 64> addrs;
+				std::array<GuestIOvec, 64> guest_iovecs;
+				std::array<size_t, 64> first_buffer;
+				auto& buffers = cpu.io_wrbuffers();
+				cpu.machine().copy_from_guest(guest_msgs.data(), g_buf, vcnt * sizeof(struct mmsghdr));
+				// Gather the iovecs of every message into one list
+				for (unsigned i = 0; i < vcnt; ++i)
+				{
+					const auto& ghdr = guest_msgs[i].msg_hdr;
+					if (ghdr.msg_iovlen > guest_iovecs.size()) {
+						regs.rax = -EINVAL;
+						cpu.set_registers(regs);
+						return;
+					}
+					cpu.machine().copy_from_guest(guest_iovecs.data(),
+						(uintptr_t)ghdr.msg_iov, ghdr.msg_iovlen * sizeof(GuestIOvec));
+					first_buffer[i] = buffers.size();
+					for (size_t j = 0; j < ghdr.msg_iovlen; ++j) {
+						cpu.machine().writable_buffers_from_range(buffers,
+							guest_iovecs[j].iov_base, guest_iovecs[j].iov_len);
+					}
+					auto& hdr = msgs[i].msg_hdr;
+					hdr = {};
+					if (ghdr.msg_name != nullptr && ghdr.msg_namelen > 0) {
+						hdr.msg_name = &addrs[i];
+						hdr.msg_namelen = std::min<socklen_t>(ghdr.msg_namelen, sizeof(addrs[i]));
+					}
+					msgs[i].msg_len = 0;
+				}
+				// The buffer list is complete, so its storage is stable
+				for (unsigned i = 0; i < vcnt; ++i)
+				{
+					const size_t end = (i + 1 < vcnt) ? first_buffer[i + 1] : buffers.size();
+					msgs[i].msg_hdr.msg_iov = (struct iovec *)&buffers[first_buffer[i]];
+					msgs[i].msg_hdr.msg_iovlen = end - first_buffer[i];
+				}
+				struct timespec ts;
+				if (g_timeout != 0x0)
+					cpu.machine().copy_from_guest(&ts, g_timeout, sizeof(ts));
+
+				const int result = recvmmsg(fd, msgs.data(), vcnt, flags,
+					(g_timeout != 0x0) ? &ts : nullptr);
+				if (result < 0) {
+					regs.rax = -errno;
+				} else {
+					for (int i = 0; i < result; ++i)
+					{
+						auto& ghdr = guest_msgs[i].msg_hdr;
+						const auto& hdr = msgs[i].msg_hdr;
+						if (hdr.msg_name != nullptr) {
+							cpu.machine().copy_to_guest((uintptr_t)ghdr.msg_name, hdr.msg_name,
+								std::min(hdr.msg_namelen, ghdr.msg_namelen));
+							ghdr.msg_namelen = hdr.msg_namelen;
+						}
+						// Control messages are not forwarded
+						ghdr.msg_controllen = 0;
+						ghdr.msg_flags = hdr.msg_flags;
+						guest_msgs[i].msg_len = msgs[i].msg_len;
+					}
+					cpu.machine().copy_to_guest(g_buf, guest_msgs.data(), result * sizeof(struct mmsghdr));
+					// The remaining time is written back, like Linux does
+					if (g_timeout != 0x0)
+						cpu.machine().copy_to_guest(g_timeout, &ts, sizeof(ts));
+					regs.rax = result;
+				}
+			}
+			else
+			{
+				regs.rax = -EBADF;
+			}
+			cpu.set_registers(regs);
+			SYSPRINT("recvmmsg(fd=%d, buf=0x%lX, count=%u, flags=0x%X) = %lld\n",
+					 vfd, g_buf, vcnt, flags, regs.rax);
+		});
 	Machine::install_syscall_handler(
 		SYS_getrandom, [](vCPU& cpu) { // getrandom
 			auto& regs = cpu.registers();
@@ -2855,9 +3583,24 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 
 			try {
 				path = cpu.machine().memcstring(vpath, PATH_MAX);
+				auto* vfile = cpu.machine().fds().get_virtual_file(vfd);
+				auto vpfile = (vfile != nullptr && path.empty()) ? vfile->file
+					: cpu.machine().fds().find_virtual_path(vfd, path);
+				if (vpfile != nullptr) {
+					struct statx vstat;
+					stat_to_statx(vpfile->st, vstat);
+					cpu.machine().copy_to_guest(buffer, &vstat, sizeof(vstat));
+					regs.rax = 0;
+					cpu.set_registers(regs);
+					SYSPRINT("STATX to vfd=%lld, path=%s, data=0x%llX = %lld (virtual)\n",
+						regs.rdi, path.c_str(), buffer, regs.rax);
+					return;
+				}
+				bool readable = true;
 				if (!path.empty()) {
 					if (UNLIKELY(!cpu.machine().fds().is_readable_path(path))) {
 						regs.rax = -EPERM;
+						readable = false;
 					}
 				}
 				// Translate from vfd when fd != AT_FDCWD
@@ -2865,8 +3608,18 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 					fd = cpu.machine().fds().translate(vfd);
 
 				struct statx vstat;
-				const int result =
-					statx(fd, path.c_str(), flags, mask, &vstat);
+				int result = 0;
+				if (readable && cpu.machine().fds().path_cache() != nullptr && !path.empty() && path[0] == '/') {
+					// Cached lookups answer with the basic stats
+					struct stat st;
+					result = cpu.machine().fds().stat_path(path, st, false);
+					if (result == 0)
+						stat_to_statx(st, vstat);
+					else
+						errno = -result;
+				} else {
+					result = statx(fd, path.c_str(), flags, mask, &vstat);
+				}
 				if (result == 0) {
 					cpu.machine().copy_to_guest(buffer, &vstat, sizeof(vstat));
 					regs.rax = 0;
@@ -3115,14 +3868,7 @@ void Machine::setup_linux_system_calls(bool unsafe_syscalls)
 			SYSPRINT("fchdir(fd=%d (%d)) = %lld\n",
 					 fd, vfd, regs.rax);
 		});
-		Machine::install_syscall_handler(SYS_io_uring_setup,
-		[](vCPU& cpu) { // io_uring_setup
-			auto& regs = cpu.registers();
-			regs.rax = -ENOSYS;
-			cpu.set_registers(regs);
-			SYSPRINT("io_uring_setup(...) = %lld\n",
-					 regs.rax);
-		});
+		install_io_uring_system_calls();
 		Machine::install_syscall_handler(SYS_inotify_init1,
 		[](vCPU& cpu) { // inotify_init1
 			auto& regs = cpu.registers();
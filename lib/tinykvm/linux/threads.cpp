@@ -1,15 +1,43 @@
 #include "threads.hpp"
 
 #include "../machine.hpp"
+#include "../smp.hpp"
 #include <linux/kvm.h>
 #include <linux/futex.h>
 #include <cassert>
+#include <chrono>
+#include <sched.h>
 #include <stdexcept>
 #define THPRINT(fmt, ...) \
 	if (UNLIKELY(cpu.machine().m_verbose_thread_syscalls)) fprintf(stderr, fmt, __VA_ARGS__);
 
 namespace tinykvm {
 
+static uint64_t futex_time_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1'000'000'000ULL + uint64_t(ts.tv_nsec);
+}
+
+/* FUTEX_WAIT has a relative timeout, BITSET an absolute one.
+   Returns the time left in nanoseconds, or -1 for no timeout. */
+static int64_t futex_timeout_ns(vCPU& cpu, const tinykvm_x86regs& regs)
+{
+	if (regs.r10 == 0x0)
+		return -1;
+	struct timespec ts;
+	cpu.machine().copy_from_guest(&ts, regs.r10, sizeof(ts));
+	int64_t timeout_ns = ts.tv_sec * 1'000'000'000LL + ts.tv_nsec;
+	if ((regs.rsi & 0xF) == FUTEX_WAIT_BITSET) {
+		struct timespec now;
+		clock_gettime((regs.rsi & FUTEX_CLOCK_REALTIME)
+			? CLOCK_REALTIME : CLOCK_MONOTONIC, &now);
+		timeout_ns -= now.tv_sec * 1'000'000'000LL + now.tv_nsec;
+	}
+	return std::max<int64_t>(timeout_ns, 0);
+}
+
 Thread::Thread(MultiThreading& mtr, int t, uint64_t tls, uint64_t stack)
 	: mt(mtr), tid(t)
 {
@@ -25,6 +53,12 @@ Thread::Thread(MultiThreading& mtr, const Thread& other)
 {}
 
 void Thread::suspend(uint64_t return_value)
+{
+	this->park(return_value);
+	// add to suspended (NB: can throw)
+	mt.m_suspended.push_back(this);
+}
+void Thread::park(uint64_t return_value)
 {
 	// GPRs
 	this->stored_regs = mt.machine.registers();
@@ -32,8 +66,6 @@ void Thread::suspend(uint64_t return_value)
 	// thread pointer
 	const auto& sregs = mt.machine.get_special_registers();
 	this->fsbase = sregs.fs.base;
-	// add to suspended (NB: can throw)
-	mt.m_suspended.push_back(this);
 }
 struct tinykvm_x86regs Thread::activate()
 {
@@ -64,16 +96,18 @@ void Thread::exit()
 		// clear the thread id in the parent
 		const uint32_t value = 0;
 		mt.machine.copy_to_guest(this->clear_tid, &value, sizeof(value));
+		// wake up any joiners
+		mt.futex_wake(this->clear_tid, INT32_MAX);
 	}
 	auto& thr = this->mt;
-	// delete this thread
-	thr.erase_thread(this->tid);
-
+	const int tid = this->tid;
 	if (exiting_myself)
 	{
 		// resume next thread in suspended list
 		thr.wakeup_next();
 	}
+	// delete this thread
+	thr.erase_thread(tid);
 }
 
 MultiThreading::MultiThreading(Machine& m)
@@ -85,6 +119,8 @@ MultiThreading::MultiThreading(Machine& m)
 
 void MultiThreading::reset_to(const MultiThreading& other)
 {
+	if (m_generation.unchanged_since_reset_to(other.m_generation))
+		return;
 	const int old_current_tid = m_current->tid;
 	const int new_current_tid = other.m_current->tid;
 	if (new_current_tid != old_current_tid) {
@@ -95,6 +131,7 @@ void MultiThreading::reset_to(const MultiThreading& other)
 
 	m_threads.clear();
 	m_suspended.clear();
+	m_futex_table.clear();
 
 	/* Copy each thread, new MT ref */
 	for (const auto& it : other.m_threads) {
@@ -106,14 +143,27 @@ void MultiThreading::reset_to(const MultiThreading& other)
 	for (const auto* t : other.m_suspended) {
 		m_suspended.push_back(get_thread(t->tid));
 	}
+	/* Copy each futex waiter by pointer lookup */
+	for (const auto& [addr, waiters] : other.m_futex_table) {
+		auto& queue = m_futex_table[addr];
+		for (const auto& waiter : waiters) {
+			queue.push_back({get_thread(waiter.thread->tid), waiter.bitset, waiter.deadline});
+		}
+	}
+	m_futex_blocked = other.m_futex_blocked;
+	m_futex_timed = other.m_futex_timed;
 	/* Translate current thread */
 	m_current = get_thread(other.m_current->tid);
 
 	thread_counter = other.thread_counter;
+	m_generation.reset_to(other.m_generation);
 }
 void MultiThreading::set_to_and_suspend_others(int tid)
 {
 	this->m_suspended.clear();
+	this->m_futex_table.clear();
+	this->m_futex_blocked = 0;
+	this->m_futex_timed = 0;
 	for (auto& [otid, thread] : m_threads) {
 		if (otid != tid) {
 			m_suspended.push_back(&thread);
@@ -133,6 +183,17 @@ Thread* MultiThreading::get_thread(int tid) /* or nullptr */
 	return &it->second;
 }
 
+Thread& MultiThreading::get_thread(vCPU& cpu)
+{
+	/* NB: SMP vCPU ids start at 1 */
+	if (m_max_parallel != 0 && cpu.cpu_id > 0) {
+		const size_t slot = cpu.cpu_id - 1;
+		if (slot < m_vcpu_threads.size() && m_vcpu_threads[slot] != nullptr)
+			return *m_vcpu_threads[slot];
+	}
+	return *m_current;
+}
+
 Thread& MultiThreading::create(int tid)
 {
 	auto it = m_threads.try_emplace(tid, *this, tid, 0, 0);
@@ -169,6 +230,8 @@ Thread& MultiThreading::create(
 bool MultiThreading::suspend_and_yield(int64_t result)
 {
 	auto& thread = get_thread();
+	if (m_futex_timed != 0)
+		this->futex_expire(futex_time_ns());
 	// don't go through the ardous yielding process when alone
 	if (m_suspended.empty()) {
 		return false;
@@ -183,10 +246,24 @@ void MultiThreading::erase_thread(int tid)
 {
 	auto it = m_threads.find(tid);
 	assert(it != m_threads.end());
+	if (m_futex_blocked != 0)
+		this->futex_unblock(tid);
 	m_threads.erase(it);
 }
 void MultiThreading::wakeup_next()
 {
+	// threads whose futex timeout passed can run again
+	if (m_futex_timed != 0)
+		this->futex_expire(futex_time_ns());
+	if (m_suspended.empty() && m_futex_blocked != 0) {
+		if (!this->schedule_blocked()) {
+			// Deadlock reached: a spurious wakeup is allowed
+			auto it = m_futex_table.begin();
+			Thread* thread = it->second.front().thread;
+			this->futex_unblock(thread->tid);
+			m_suspended.push_back(thread);
+		}
+	}
 	// resume a waiting thread
 	assert(!m_suspended.empty());
 	auto* next = m_suspended.front();
@@ -195,6 +272,260 @@ void MultiThreading::wakeup_next()
 	next->resume();
 }
 
+void MultiThreading::set_parallel(unsigned max_vcpus, uint32_t ticks)
+{
+	if (m_parallel_running != 0) {
+		throw MachineException("Parallel threads are still running", m_parallel_running);
+	}
+	this->m_max_parallel = max_vcpus;
+	this->m_parallel_ticks = ticks;
+	this->m_vcpu_threads.assign(max_vcpus, nullptr);
+	this->m_vcpu_busy.assign(max_vcpus, 0);
+}
+
+long MultiThreading::clone_parallel(vCPU& parent,
+	int flags, uint64_t ctid, uint64_t ptid, uint64_t stack, uint64_t tls)
+{
+	/* Called with vMemory::mtx_smp held */
+	auto it = std::find(m_vcpu_busy.begin(), m_vcpu_busy.end(), 0);
+	if (it == m_vcpu_busy.end())
+		return -EAGAIN;
+	const size_t slot = it - m_vcpu_busy.begin();
+
+	Thread& thread = this->create(flags, ctid, ptid, stack, tls);
+	m_vcpu_threads[slot] = &thread;
+	m_vcpu_busy[slot] = 1;
+	m_parallel_running++;
+
+	/* The child continues where the parent is in the system call
+	   handler, with the same privilege level, returning 0. */
+	auto regs = parent.registers();
+	regs.rax = 0;
+	regs.rsp = stack;
+	struct kvm_sregs sregs = parent.get_special_registers();
+	sregs.fs.base = thread.fsbase;
+	const uint32_t ticks = (m_parallel_ticks != 0) ? m_parallel_ticks : parent.timer_ticks;
+
+	machine.smp().async_call(slot, [this, slot, sregs, regs, ticks] (vCPU& cpu) {
+		this->run_parallel(cpu, slot, sregs, regs, ticks);
+	});
+	return thread.tid;
+}
+
+void MultiThreading::run_parallel(vCPU& cpu, size_t slot,
+	const struct kvm_sregs& parent_sregs, const tinykvm_x86regs& regs, uint32_t ticks)
+{
+	/* Keep the per-vCPU TSS and vCPU table */
+	struct kvm_sregs sregs = parent_sregs;
+	sregs.tr = cpu.get_special_registers().tr;
+	sregs.gs = cpu.get_special_registers().gs;
+	cpu.set_special_registers(sregs);
+	cpu.set_registers(regs);
+
+	try {
+		cpu.run(ticks);
+	} catch (const std::exception& e) {
+		fprintf(stderr, "Parallel thread exception: %s\n", e.what());
+	}
+
+	/* The thread exited or failed: CLONE_CHILD_CLEARTID and wake
+	   any joiners, after releasing the serializer. The vCPU is only
+	   handed out again once nothing here needs the serializer. */
+	auto& serializer = machine.main_memory().mtx_smp;
+	uint64_t clear_tid = 0;
+	{
+		std::scoped_lock lock(serializer);
+		Thread* thread = m_vcpu_threads.at(slot);
+		clear_tid = thread->clear_tid;
+		if (clear_tid != 0) {
+			const uint32_t value = 0;
+			try {
+				machine.copy_to_guest(clear_tid, &value, sizeof(value));
+			} catch (...) {
+				clear_tid = 0;
+			}
+		}
+		this->erase_thread(thread->tid);
+		m_vcpu_threads[slot] = nullptr;
+	}
+	if (clear_tid != 0)
+		this->futex_wake(clear_tid, INT32_MAX);
+
+	std::scoped_lock lock(serializer);
+	m_vcpu_busy[slot] = 0;
+	m_parallel_running--;
+}
+
+long MultiThreading::futex_wait(vCPU& cpu, uint64_t addr, uint32_t val, int64_t timeout_ns)
+{
+	std::unique_lock<std::mutex> lock(m_futex_mtx);
+	uint32_t value;
+	{
+		std::scoped_lock mem(machine.main_memory().mtx_smp);
+		machine.copy_from_guest(&value, addr, sizeof(value));
+	}
+	if (value != val)
+		return -EAGAIN;
+
+	const auto deadline = std::chrono::steady_clock::now()
+		+ std::chrono::nanoseconds(std::max<int64_t>(timeout_ns, 0));
+	auto& queue = m_futexes[addr];
+	queue.waiters++;
+	long result = 0;
+	bool timed_out = false;
+	while (queue.wakeups == 0) {
+		/* Wake up regularly to check for execution timeouts */
+		queue.cond.wait_for(lock, std::chrono::milliseconds(10));
+		if (queue.wakeups != 0)
+			break;
+		if (timeout_ns >= 0 && std::chrono::steady_clock::now() >= deadline) {
+			result = -ETIMEDOUT;
+			break;
+		}
+		if (cpu.timed_out()) {
+			timed_out = true;
+			break;
+		}
+	}
+	if (result == 0 && !timed_out)
+		queue.wakeups--;
+	if (--queue.waiters == 0)
+		m_futexes.erase(addr);
+	lock.unlock();
+
+	if (timed_out)
+		throw MachineTimeoutException("Timeout Exception", cpu.timer_ticks);
+	return result;
+}
+
+long MultiThreading::futex_wake(uint64_t addr, uint32_t count, uint32_t bitset)
+{
+	if (!this->is_parallel()) {
+		auto it = m_futex_table.find(addr);
+		if (it == m_futex_table.end())
+			return 0;
+		auto& queue = it->second;
+		uint32_t woken = 0;
+		for (auto w = queue.begin(); w != queue.end() && woken < count; ) {
+			if ((w->bitset & bitset) == 0) {
+				++w;
+				continue;
+			}
+			/* The thread returns 0 from FUTEX_WAIT */
+			m_suspended.push_back(w->thread);
+			if (w->deadline != 0)
+				m_futex_timed--;
+			m_futex_blocked--;
+			w = queue.erase(w);
+			woken++;
+		}
+		if (queue.empty())
+			m_futex_table.erase(it);
+		return woken;
+	}
+	/* Parallel waiters do not keep a bitset, so every wake matches */
+	std::scoped_lock lock(m_futex_mtx);
+	auto it = m_futexes.find(addr);
+	if (it == m_futexes.end())
+		return 0;
+	auto& queue = it->second;
+	const uint32_t woken = std::min(count, queue.waiters - queue.wakeups);
+	queue.wakeups += woken;
+	if (woken != 0)
+		queue.cond.notify_all();
+	return woken;
+}
+
+bool MultiThreading::futex_block(vCPU& cpu, uint64_t addr, uint32_t bitset, int64_t timeout_ns)
+{
+	auto& thread = get_thread(cpu);
+	const uint64_t deadline = (timeout_ns >= 0)
+		? futex_time_ns() + std::max<uint64_t>(timeout_ns, 1) : 0;
+	/* The wait returns 0 when woken, and -ETIMEDOUT on expiry */
+	thread.park(0);
+	m_futex_table[addr].push_back({&thread, bitset, deadline});
+	m_futex_blocked++;
+	if (deadline != 0)
+		m_futex_timed++;
+
+	if (m_suspended.empty() && m_futex_timed == 0) {
+		/* Nothing can ever wake this thread up */
+		this->futex_unblock(thread.tid);
+		return false;
+	}
+	this->wakeup_next();
+	return true;
+}
+
+void MultiThreading::futex_expire(uint64_t now)
+{
+	for (auto it = m_futex_table.begin(); it != m_futex_table.end(); ) {
+		auto& queue = it->second;
+		for (auto w = queue.begin(); w != queue.end(); ) {
+			if (w->deadline == 0 || w->deadline > now) {
+				++w;
+				continue;
+			}
+			w->thread->stored_regs.rax = -ETIMEDOUT;
+			m_suspended.push_back(w->thread);
+			m_futex_timed--;
+			m_futex_blocked--;
+			w = queue.erase(w);
+		}
+		it = queue.empty() ? m_futex_table.erase(it) : std::next(it);
+	}
+}
+
+void MultiThreading::futex_unblock(int tid)
+{
+	for (auto it = m_futex_table.begin(); it != m_futex_table.end(); ++it) {
+		auto& queue = it->second;
+		for (auto w = queue.begin(); w != queue.end(); ++w) {
+			if (w->thread->tid != tid)
+				continue;
+			if (w->deadline != 0)
+				m_futex_timed--;
+			m_futex_blocked--;
+			queue.erase(w);
+			if (queue.empty())
+				m_futex_table.erase(it);
+			return;
+		}
+	}
+}
+
+bool MultiThreading::schedule_blocked()
+{
+	/* No thread is runnable: sleep until the earliest futex timeout */
+	if (m_futex_timed == 0)
+		return false;
+	uint64_t deadline = UINT64_MAX;
+	for (const auto& [addr, queue] : m_futex_table) {
+		for (const auto& waiter : queue) {
+			if (waiter.deadline != 0)
+				deadline = std::min(deadline, waiter.deadline);
+		}
+	}
+	auto& cpu = machine.cpu();
+	struct timespec ts;
+	ts.tv_sec  = deadline / 1'000'000'000ULL;
+	ts.tv_nsec = deadline % 1'000'000'000ULL;
+	/* The execution timer interrupts the sleep */
+	while (!cpu.timed_out()) {
+		if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) != EINTR) {
+			this->futex_expire(futex_time_ns());
+			return true;
+		}
+	}
+	throw MachineTimeoutException("Timeout Exception", cpu.timer_ticks);
+}
+
+void Machine::set_parallel_threads(unsigned max_vcpus, float thread_timeout)
+{
+	this->threads().set_parallel(max_vcpus, to_ticks(thread_timeout));
+	this->m_parallel_threads = max_vcpus != 0;
+}
+
 const struct MultiThreading& Machine::threads() const {
 	if (UNLIKELY(!m_mt)) {
 		m_mt.reset(new MultiThreading(*const_cast<Machine*>(this)));
@@ -205,6 +536,7 @@ struct MultiThreading& Machine::threads() {
 	if (UNLIKELY(!m_mt)) {
 		m_mt.reset(new MultiThreading(*this));
 	}
+	m_mt->modified();
 	return *m_mt;
 }
 
@@ -213,7 +545,13 @@ void Machine::setup_multithreading()
 	Machine::install_syscall_handler(
 		24, [] (vCPU& cpu) { // sched_yield
 			THPRINT("sched_yield on tid=%d\n",
-				cpu.machine().threads().get_thread().tid);
+				cpu.machine().threads().get_thread(cpu).tid);
+			if (cpu.machine().has_parallel_threads()) {
+				auto& regs = cpu.registers();
+				regs.rax = sched_yield();
+				cpu.set_registers(regs);
+				return;
+			}
 			cpu.machine().threads().suspend_and_yield();
 		});
 	Machine::install_syscall_handler(
@@ -228,7 +566,7 @@ void Machine::setup_multithreading()
 			if (stack == 0x0) {
 				// Allocate a new stack, aligned up from FSBASE to RSP
 				// We assume that RSP also contains some extra data
-				const uint64_t oldstk_top     = cpu.machine().threads().get_thread().fsbase;
+				const uint64_t oldstk_top     = cpu.machine().threads().get_thread(cpu).fsbase;
 				const uint64_t oldstk_current = cpu.registers().rsp - 0x100;
 				size_t size = oldstk_top - oldstk_current;
 				if (size > 0x1000000) {
@@ -248,8 +586,15 @@ void Machine::setup_multithreading()
 				// Don't set TLS if not requested
 				tls = cpu.get_special_registers().fs.base;
 			}
+			if (cpu.machine().has_parallel_threads()) {
+				regs.rax = cpu.machine().threads().clone_parallel(cpu, flags, ctid, ptid, stack, tls);
+				THPRINT(">>> clone(func=0x%llX, stack=0x%llX, flags=%llX, tls=0x%lX) = %lld (parallel)\n",
+					func, stack, flags, tls, regs.rax);
+				cpu.set_registers(regs);
+				return;
+			}
 
-			auto& parent = cpu.machine().threads().get_thread();
+			auto& parent = cpu.machine().threads().get_thread(cpu);
 			auto& thread = cpu.machine().threads().create(flags, ctid, ptid, stack, tls);
 			THPRINT(">>> clone(func=0x%llX, stack=0x%llX, flags=%llX,"
 					" parent=%d, ctid=0x%llX ptid=0x%llX, tls=0x%lX) = %d\n",
@@ -294,8 +639,15 @@ void Machine::setup_multithreading()
 				// Don't set TLS if not requested
 				tls = cpu.get_special_registers().fs.base;
 			}
+			if (cpu.machine().has_parallel_threads()) {
+				regs.rax = cpu.machine().threads().clone_parallel(cpu, flags, ctid, ptid, stack, tls);
+				THPRINT(">>> clone3(stack=0x%lX, flags=%lX, tls=0x%lX) = %lld (parallel)\n",
+					stack, flags, tls, regs.rax);
+				cpu.set_registers(regs);
+				return;
+			}
 
-			Thread& parent = cpu.machine().threads().get_thread();
+			Thread& parent = cpu.machine().threads().get_thread(cpu);
 			Thread& thread = cpu.machine().threads().create(flags, ctid, ptid, stack, tls);
 			THPRINT(">>> clone3(stack=0x%lX, flags=%lX,"
 					" parent=%d, ctid=0x%lX ptid=0x%lX, tls=0x%lX) = %d\n",
@@ -318,10 +670,14 @@ void Machine::setup_multithreading()
 			if (cpu.machine().has_threads()) {
 				auto& regs = cpu.registers();
 				[[maybe_unused]] const uint32_t status = regs.rdi;
-				auto& thread = cpu.machine().threads().get_thread();
+				auto& thread = cpu.machine().threads().get_thread(cpu);
 				THPRINT(">>> Exit on tid=%d, exit code = %d\n",
 					thread.tid, (int) status);
-				if (thread.tid != 1) {
+				if (thread.tid != 1 && cpu.machine().has_parallel_threads()) {
+					/* The vCPU owner cleans up after the thread */
+					cpu.stop();
+					return;
+				} else if (thread.tid != 1) {
 					thread.exit();
 					return;
 				}
@@ -335,7 +691,7 @@ void Machine::setup_multithreading()
 			/* SYS gettid */
 			auto& regs = cpu.registers();
 			if (cpu.machine().has_threads()) {
-				regs.rax = cpu.machine().threads().get_thread().tid;
+				regs.rax = cpu.machine().threads().get_thread(cpu).tid;
 				THPRINT("gettid() = %lld\n", regs.rax);
 			} else {
 				regs.rax = 1; /* Main thread */
@@ -351,14 +707,37 @@ void Machine::setup_multithreading()
 			const uint32_t val = regs.rdx;
 			THPRINT("Futex on: 0x%llX  val=%d\n", regs.rdi, val);
 
-			if ((futex_op & 0xF) == FUTEX_WAIT || (futex_op & 0xF) == FUTEX_WAIT_BITSET) {
+			auto& mt = cpu.machine().threads();
+			const int op = futex_op & 0xF;
+			if (cpu.machine().has_parallel_threads()) {
+				if (op == FUTEX_WAIT || op == FUTEX_WAIT_BITSET) {
+					regs.rax = mt.futex_wait(cpu, addr, val, futex_timeout_ns(cpu, regs));
+				} else if (op == FUTEX_WAKE || op == FUTEX_WAKE_BITSET) {
+					regs.rax = mt.futex_wake(addr, val);
+				} else {
+					regs.rax = -ENOSYS;
+				}
+				THPRINT("FUTEX: op=%d uaddr=0x%lX val=%u = %lld (parallel)\n",
+					op, (long) addr, val, regs.rax);
+				cpu.set_registers(regs);
+				return;
+			}
+
+			if (op == FUTEX_WAIT || op == FUTEX_WAIT_BITSET) {
+				const uint32_t bitset = (op == FUTEX_WAIT_BITSET) ? regs.r9 : FUTEX_BITSET_MATCH_ANY;
 				uint32_t futexVal;
 				cpu.machine().copy_from_guest(&futexVal, addr, sizeof(futexVal));
 				THPRINT("FUTEX: Waiting for unlock... uaddr=%u val=%u\n", futexVal, val);
-				if (futexVal == val) {
-					if (cpu.machine().threads().suspend_and_yield(-EAGAIN)) {
-						return;
-					}
+				const int64_t timeout_ns = futex_timeout_ns(cpu, regs);
+				if (bitset == 0) {
+					regs.rax = -EINVAL;
+				} else if (futexVal != val) {
+					regs.rax = -EAGAIN;
+				} else if (timeout_ns == 0) {
+					regs.rax = -ETIMEDOUT;
+				} else if (mt.futex_block(cpu, addr, bitset, timeout_ns)) {
+					return;
+				} else {
 					// Deadlock reached. XXX: Force-unlock to continue
 					// execution.
 					THPRINT("FUTEX: Deadlock reached on uaddr=0x%lX, val=%u\n", (long) addr, val);
@@ -366,15 +745,11 @@ void Machine::setup_multithreading()
 					cpu.machine().copy_to_guest(addr, &futexVal, sizeof(futexVal));
 					regs.rax = 0;
 					//throw std::runtime_error("DEADLOCK_REACHED");
-				} else {
-					regs.rax = 0;
 				}
-			} else if ((futex_op & 0xF) == FUTEX_WAKE || (futex_op & 0xF) == FUTEX_WAKE_BITSET) {
-				THPRINT("FUTEX: Waking others on uaddr=0x%lX, val=%u\n", (long) addr, val);
-				if (cpu.machine().threads().suspend_and_yield(0)) {
-					return;
-				}
-				regs.rax = 0;
+			} else if (op == FUTEX_WAKE || op == FUTEX_WAKE_BITSET) {
+				const uint32_t bitset = (op == FUTEX_WAKE_BITSET) ? regs.r9 : FUTEX_BITSET_MATCH_ANY;
+				regs.rax = (bitset != 0) ? mt.futex_wake(addr, val, bitset) : -EINVAL;
+				THPRINT("FUTEX: Woke %lld on uaddr=0x%lX, val=%u\n", regs.rax, (long) addr, val);
 			}
 			else {
 				throw std::runtime_error("Unimplemented futex op: " + std::to_string(futex_op & 0xF));
@@ -385,7 +760,7 @@ void Machine::setup_multithreading()
 		218, [] (vCPU& cpu) {
 			/* SYS set_tid_address */
 			auto& regs = cpu.registers();
-			auto& thread = cpu.machine().threads().get_thread();
+			auto& thread = cpu.machine().threads().get_thread(cpu);
 			/* Sets clear_tid and returns tid */
 			thread.clear_tid = regs.rdi;
 			regs.rax = thread.tid;
@@ -398,7 +773,7 @@ void Machine::setup_multithreading()
 			auto& regs = cpu.registers();
 			[[maybe_unused]] int tid = 0;
 			if (cpu.machine().has_threads()) {
-				tid = cpu.machine().threads().get_thread().tid;
+				tid = cpu.machine().threads().get_thread(cpu).tid;
 			}
 
 			const int sig = regs.rdx;
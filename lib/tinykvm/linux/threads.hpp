@@ -1,12 +1,18 @@
 #pragma once
 #include "../forward.hpp"
+#include "../util/state_generation.hpp"
+#include <condition_variable>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
+struct kvm_sregs;
 
 namespace tinykvm {
 	struct Machine;
 	struct MultiThreading;
+	struct vCPU;
 
 struct Thread {
 	struct MultiThreading& mt;
@@ -16,6 +22,7 @@ struct Thread {
 	uint64_t clear_tid;
 
 	void suspend(uint64_t rv);
+	void park(uint64_t rv);
 	struct tinykvm_x86regs activate();
 	void resume();
 	void exit();
@@ -27,7 +34,10 @@ struct Thread {
 struct MultiThreading {
 	Thread& get_thread();
 	Thread* get_thread(int tid); /* or nullptr */
+	/* The thread running on the given vCPU */
+	Thread& get_thread(vCPU&);
 	int gettid() { return get_thread().tid; }
+	int gettid(vCPU& cpu) { return get_thread(cpu).tid; }
 
 	Thread& create(int tid);
 	Thread& create(int flags, uint64_t ctid, uint64_t ptid,
@@ -36,18 +46,75 @@ struct MultiThreading {
 	void erase_thread(int tid);
 	void wakeup_next();
 
+	/* Does nothing when neither side was modified since the last reset */
 	void reset_to(const MultiThreading& other);
+	/* Called by Machine::threads() on every access */
+	void modified() noexcept { m_generation.modified(); }
 	void set_to_and_suspend_others(int tid);
 	size_t size() const { return m_threads.size(); }
 	const std::map<int, Thread>& threads() const { return m_threads; }
 
+	/* Parallel mode: Each thread created with clone() or clone3()
+	   runs on its own SMP vCPU, up to max_vcpus threads at a time.
+	   Thread bookkeeping and all system calls, except futex, sleep
+	   and exit, are serialized by vMemory::mtx_smp. Futexes become
+	   real cross-vCPU waits. */
+	void set_parallel(unsigned max_vcpus, uint32_t ticks);
+	bool is_parallel() const noexcept { return m_max_parallel != 0; }
+	/* Returns the new TID, or a negative error. */
+	long clone_parallel(vCPU& parent, int flags, uint64_t ctid, uint64_t ptid,
+		uint64_t stack, uint64_t tls);
+	long futex_wait(vCPU&, uint64_t addr, uint32_t val, int64_t timeout_ns);
+	/* Wakes up to count waiters on addr, in either mode. Returns the
+	   number of threads woken. */
+	long futex_wake(uint64_t addr, uint32_t count, uint32_t bitset = ~0u);
+	size_t parallel_threads() const noexcept { return m_parallel_running; }
+
+	/* Cooperative mode: the current thread waits on addr until a
+	   futex_wake() matching its bitset, or until timeout_ns (-1 is
+	   none) has passed, when it returns -ETIMEDOUT. Other threads run
+	   meanwhile, and when none can, the host sleeps until the earliest
+	   timeout. Returns false when no thread could be run at all. */
+	bool futex_block(vCPU&, uint64_t addr, uint32_t bitset, int64_t timeout_ns);
+	size_t futex_waiters() const noexcept { return m_futex_blocked; }
+
 	MultiThreading(Machine&);
 	Machine& machine;
 private:
+	void run_parallel(vCPU&, size_t slot, const struct kvm_sregs&, const tinykvm_x86regs&, uint32_t ticks);
+	void futex_expire(uint64_t now);
+	void futex_unblock(int tid);
+	bool schedule_blocked();
+
 	std::map<int, Thread> m_threads;
 	std::vector<Thread*> m_suspended;
 	Thread* m_current = nullptr;
 	int thread_counter = 1;
+
+	/* Parallel mode: the thread on each SMP vCPU, or nullptr */
+	std::vector<Thread*> m_vcpu_threads;
+	/* Busy until the previous thread on the vCPU has fully finished */
+	std::vector<uint8_t> m_vcpu_busy;
+	unsigned m_max_parallel = 0;
+	uint32_t m_parallel_ticks = 0;
+	size_t m_parallel_running = 0;
+	struct FutexQueue {
+		std::condition_variable cond;
+		uint32_t waiters = 0;
+		uint32_t wakeups = 0;
+	};
+	std::unordered_map<uint64_t, FutexQueue> m_futexes;
+	std::mutex m_futex_mtx;
+	/* Cooperative mode: threads blocked on each futex, in FIFO order */
+	struct FutexWaiter {
+		Thread*  thread;
+		uint32_t bitset;
+		uint64_t deadline; /* CLOCK_MONOTONIC ns, 0 is none */
+	};
+	std::unordered_map<uint64_t, std::vector<FutexWaiter>> m_futex_table;
+	size_t m_futex_blocked = 0;
+	size_t m_futex_timed = 0;
+	StateGeneration m_generation;
 	friend struct Thread;
 };
 
@@ -0,0 +1,193 @@
+#include "vfs.hpp"
+
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace tinykvm
+{
+	static constexpr dev_t VFS_DEVICE = 0x564653; // "VFS"
+
+	VirtualFileSystem::VirtualFileSystem()
+	{
+		this->make_directories("/");
+	}
+
+	std::string VirtualFileSystem::normalize(const std::string& dir, const std::string& path)
+	{
+		const std::string full = (!path.empty() && path[0] == '/') ? path : dir + "/" + path;
+		std::vector<std::string_view> parts;
+		size_t pos = 0;
+		while (pos < full.size()) {
+			size_t end = full.find('/', pos);
+			if (end == std::string::npos)
+				end = full.size();
+			const std::string_view part(&full[pos], end - pos);
+			if (part == "..") {
+				if (!parts.empty())
+					parts.pop_back();
+			} else if (!part.empty() && part != ".") {
+				parts.push_back(part);
+			}
+			pos = end + 1;
+		}
+		if (parts.empty())
+			return "/";
+		std::string result;
+		for (auto part : parts) {
+			result += '/';
+			result += part;
+		}
+		return result;
+	}
+
+	std::shared_ptr<VirtualFileSystem::File> VirtualFileSystem::make_directories(const std::string& path)
+	{
+		/* Must be called with the lock held */
+		auto it = m_files.find(path);
+		if (it != m_files.end())
+			return it->second;
+
+		auto dir = std::make_shared<File>();
+		dir->path = path;
+		dir->st.st_dev = VFS_DEVICE;
+		dir->st.st_ino = m_next_ino++;
+		dir->st.st_mode = S_IFDIR | 0555;
+		dir->st.st_nlink = 2;
+		dir->st.st_blksize = 4096;
+		clock_gettime(CLOCK_REALTIME, &dir->st.st_mtim);
+		dir->st.st_atim = dir->st.st_ctim = dir->st.st_mtim;
+		m_files.emplace(path, dir);
+		m_misses.erase(path);
+
+		if (path != "/") {
+			const size_t slash = path.rfind('/');
+			const std::string parent = (slash == 0) ? "/" : path.substr(0, slash);
+			this->make_directories(parent);
+			m_children[parent].push_back(path.substr(slash + 1));
+		}
+		return dir;
+	}
+
+	void VirtualFileSystem::insert(const std::string& path, std::string contents, mode_t mode)
+	{
+		/* Must be called with the lock held */
+		if (path == "/")
+			return;
+		auto file = std::make_shared<File>();
+		file->path = path;
+		file->data = std::move(contents);
+		file->st.st_dev = VFS_DEVICE;
+		file->st.st_mode = S_IFREG | (mode & 07777);
+		file->st.st_nlink = 1;
+		file->st.st_size = file->data.size();
+		file->st.st_blksize = 4096;
+		file->st.st_blocks = (file->data.size() + 511) / 512;
+		clock_gettime(CLOCK_REALTIME, &file->st.st_mtim);
+		file->st.st_atim = file->st.st_ctim = file->st.st_mtim;
+		m_misses.erase(path);
+
+		auto it = m_files.find(path);
+		if (it != m_files.end()) {
+			// Replacing a file keeps its inode and its directory entry
+			file->st.st_ino = it->second->st.st_ino;
+			it->second = std::move(file);
+			return;
+		}
+		file->st.st_ino = m_next_ino++;
+		m_files.emplace(path, std::move(file));
+
+		const size_t slash = path.rfind('/');
+		const std::string parent = (slash == 0) ? "/" : path.substr(0, slash);
+		this->make_directories(parent);
+		m_children[parent].push_back(path.substr(slash + 1));
+	}
+
+	void VirtualFileSystem::add_file(const std::string& path, std::string contents, mode_t mode)
+	{
+		std::scoped_lock lock(m_mtx);
+		this->insert(normalize("/", path), std::move(contents), mode);
+	}
+
+	bool VirtualFileSystem::add_host_file(const std::string& path, const std::string& host_path)
+	{
+		const int fd = open(host_path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+			close(fd);
+			return false;
+		}
+		std::string contents(st.st_size, '\0');
+		size_t total = 0;
+		while (total < contents.size()) {
+			const ssize_t len = read(fd, contents.data() + total, contents.size() - total);
+			if (len <= 0)
+				break;
+			total += len;
+		}
+		close(fd);
+		contents.resize(total);
+		this->add_file(path, std::move(contents), st.st_mode & 0555);
+		return true;
+	}
+
+	void VirtualFileSystem::set_loader(loader_t loader)
+	{
+		std::scoped_lock lock(m_mtx);
+		m_loader = std::move(loader);
+	}
+
+	VirtualFileSystem::file_t VirtualFileSystem::find(const std::string& path)
+	{
+		loader_t loader;
+		{
+			std::scoped_lock lock(m_mtx);
+			auto it = m_files.find(path);
+			if (it != m_files.end())
+				return it->second;
+			if (!m_loader || m_misses.count(path))
+				return nullptr;
+			loader = m_loader;
+		}
+
+		/* The loader may be slow, so other VMs are not kept waiting */
+		std::string contents;
+		const bool found = loader(path, contents);
+
+		std::scoped_lock lock(m_mtx);
+		auto it = m_files.find(path);
+		if (it != m_files.end())
+			return it->second; // Added while loading
+		if (!found) {
+			if (m_misses.insert(path).second) {
+				m_miss_order.push_back(path);
+				if (m_miss_order.size() > MAX_MISSES) {
+					m_misses.erase(m_miss_order.front());
+					m_miss_order.pop_front();
+				}
+			}
+			return nullptr;
+		}
+		this->insert(path, std::move(contents), 0444);
+		return m_files.at(path);
+	}
+
+	bool VirtualFileSystem::read_directory(const File& dir, size_t index, std::string& name, file_t& entry) const
+	{
+		std::scoped_lock lock(m_mtx);
+		auto it = m_children.find(dir.path);
+		if (it == m_children.end() || index >= it->second.size())
+			return false;
+		name = it->second[index];
+		entry = m_files.at((dir.path == "/" ? "" : dir.path) + "/" + name);
+		return true;
+	}
+
+	size_t VirtualFileSystem::size() const
+	{
+		std::scoped_lock lock(m_mtx);
+		return m_files.size();
+	}
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+namespace tinykvm
+{
+	/// @brief A read-only filesystem in host memory. When a VM has one,
+	/// guest opens, reads, stats and directory listings of the paths in it
+	/// are served without any host system calls, and paths that aren't in
+	/// it fall back to the host as usual. Files are added up front, or
+	/// loaded through a callback the first time a path is looked up. One
+	/// instance can be shared by many VMs, and is inherited by forks.
+	struct VirtualFileSystem
+	{
+		struct File
+		{
+			std::string path;  // Absolute and normalized
+			std::string data;  // Contents of regular files
+			struct stat st {};
+			bool is_directory() const noexcept { return S_ISDIR(st.st_mode); }
+		};
+		using file_t = std::shared_ptr<const File>;
+		static constexpr size_t MAX_MISSES = 4096;
+		/// @brief Called with the absolute path of a path that is not known.
+		/// Return true, with the contents, to add it as a regular file. Paths
+		/// that the loader returns false for are remembered as misses, up to
+		/// MAX_MISSES of the most recent ones. The loader is called without
+		/// holding the lock, and may be called concurrently.
+		using loader_t = std::function<bool(const std::string& path, std::string& contents)>;
+
+		VirtualFileSystem();
+
+		/// @brief Add a regular file, or replace its contents. Open file
+		/// descriptors keep the old contents. Parent directories are created.
+		/// @param path The absolute path of the file.
+		/// @param contents The contents of the file.
+		/// @param mode The permission bits of the file.
+		void add_file(const std::string& path, std::string contents, mode_t mode = 0444);
+
+		/// @brief Add a file with the contents of a host file, read now.
+		/// @return False if the host file could not be read.
+		bool add_host_file(const std::string& path, const std::string& host_path);
+
+		/// @brief Set the callback that lazily loads unknown paths.
+		void set_loader(loader_t loader);
+
+		/// @brief Find a file or directory, loading it if necessary.
+		/// @param path An absolute, normalized path. See normalize().
+		/// @return The file, or nullptr if the path is not in the filesystem.
+		file_t find(const std::string& path);
+
+		/// @brief Get the entry at @index of a directory listing.
+		/// @return False when there are no more entries.
+		bool read_directory(const File& dir, size_t index, std::string& name, file_t& entry) const;
+
+		/// @return The number of files and directories.
+		size_t size() const;
+
+		/// @brief Make an absolute path from @path, relative to @dir when
+		/// it is not absolute, and remove ".", ".." and repeated slashes.
+		static std::string normalize(const std::string& dir, const std::string& path);
+
+	private:
+		std::shared_ptr<File> make_directories(const std::string& path);
+		void insert(const std::string& path, std::string contents, mode_t mode);
+
+		mutable std::mutex m_mtx;
+		std::map<std::string, std::shared_ptr<File>> m_files;
+		/* Names in each directory, in the order they were added */
+		std::map<std::string, std::vector<std::string>> m_children;
+		std::set<std::string> m_misses;
+		std::deque<std::string> m_miss_order; // Oldest first
+		loader_t m_loader;
+		uint64_t m_next_ino = 1;
+	};
+}
@@ -1,14 +1,21 @@
 #include "machine.hpp"
 
+#include "kvm_pool.hpp"
 #include "linux/threads.hpp"
+#include "remote_concurrency.hpp"
 #include "smp.hpp"
+#include "linux/async_read.hpp"
+#include "program_image.hpp"
 #include "util/scoped_profiler.hpp"
 #include "util/threadpool.h"
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <fcntl.h>
 #include <linux/kvm.h>
+#include <mutex>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 extern "C" int close(int);
 //#define KVM_VERBOSE_MEMORY
 
@@ -38,30 +45,36 @@ Machine::Machine(std::string_view binary, const MachineOptions& options)
 	  m_mt   {nullptr} /* Explicitly */
 {
 	assert(kvm_fd != -1 && "Call Machine::init() first");
-	if (options.mmap_backed_files && !options.snapshot_file.empty()) {
+	if (options.mmap_backed_files && (!options.snapshot_file.empty() || !options.snapshot_packed_file.empty()
+		|| options.snapshot_memfd >= 0 || options.memfd_main_memory)) {
 		throw MachineException("Cannot have VM snapshot with mmap-backed files at the same time");
 	}
 
-	this->fd = create_kvm_vm();
+	this->m_cpu_baseline = options.cpu_baseline;
+	this->create_vm_and_vcpu(options);
 
 	install_memory(0, memory.vmem(), false);
 
 	this->vcpu.init(0, *this, options);
 
-	if (memory.has_loadable_snapshot_state()) {
-		this->m_loaded_from_snapshot = this->load_snapshot_state();
-		if (this->m_loaded_from_snapshot) {
-			if (options.verbose_loader) {
-				printf("Loaded VM snapshot state\n");
-			}
-			return;
-		}
-		// If the file does not exist, or anything else failed, we continue
-		// to do a normal cold start.
+	if (this->load_snapshot_if_present(options))
+		return;
+
+	if (options.cache_dynamic_images && !binary.empty() && is_dynamic_elf(binary).is_dynamic) {
+		this->m_program_image = ProgramImage::cached(binary, options);
+		this->m_program_image->install(*this);
+		if (options.perf_map)
+			this->write_perf_map();
+		struct tinykvm_regs regs {};
+		this->setup_registers(regs);
+		this->set_registers(regs);
+		return;
 	}
 
 	if (!binary.empty()) {
 		this->elf_loader(binary, options);
+		if (options.perf_map)
+			this->write_perf_map();
 	}
 
 	this->setup_long_mode(options);
@@ -70,13 +83,15 @@ Machine::Machine(std::string_view binary, const MachineOptions& options)
 	   above the default BRK start address. */
 	if (m_brk_address < m_kernel_end) {
 		m_brk_address = m_kernel_end;
-		/* We would like at least BRK_MAX bytes of space for the BRK area,
+		/* We would like at least brk_size bytes of space for the BRK area,
 		   so we need to allocate it on the heap if it is too small. */
-		if (this->m_brk_address + BRK_MAX > this->m_brk_end_address)
+		const uint64_t brk_bytes = brk_size(options);
+		if (this->m_brk_address + brk_bytes > this->m_brk_end_address)
 		{
-			this->m_brk_address = mmap_allocate(BRK_MAX);
-			this->m_brk_end_address = this->m_brk_address + BRK_MAX;
+			this->m_brk_address = mmap_allocate(brk_bytes);
+			this->m_brk_end_address = this->m_brk_address + brk_bytes;
 		}
+		this->m_brk_begin_address = this->m_brk_address;
 	}
 
 	struct tinykvm_regs regs {};
@@ -89,22 +104,84 @@ Machine::Machine(const std::vector<uint8_t>& bin, const MachineOptions& opts)
 Machine::Machine(std::span<const uint8_t> bin, const MachineOptions& opts)
 	: Machine(std::string_view{(const char*)bin.data(), bin.size()}, opts) {}
 
+__attribute__ ((cold))
+Machine::Machine(const ProgramImage& image, const MachineOptions& options)
+	: m_forked {false},
+	  m_just_reset {false},
+	  m_relocate_fixed_mmap {options.relocate_fixed_mmap},
+	  memory { vMemory::New(*this, options,
+	  	options.vmem_base_address, options.vmem_base_address + 0x100000, options.max_mem)
+	  },
+	  m_mt   {nullptr} /* Explicitly */
+{
+	assert(kvm_fd != -1 && "Call Machine::init() first");
+	image.validate(options);
+	if (options.mmap_backed_files && (!options.snapshot_file.empty() || !options.snapshot_packed_file.empty()
+		|| options.snapshot_memfd >= 0 || options.memfd_main_memory)) {
+		throw MachineException("Cannot have VM snapshot with mmap-backed files at the same time");
+	}
+
+	this->m_cpu_baseline = options.cpu_baseline;
+	this->create_vm_and_vcpu(options);
+
+	install_memory(0, memory.vmem(), false);
+
+	this->vcpu.init(0, *this, options);
+
+	if (this->load_snapshot_if_present(options))
+		return;
+
+	/* The ELF loader and the page tables were set up by the image */
+	image.install(*this);
+	if (options.verbose_loader) {
+		printf("Installed program image of %zu bytes\n", image.memory_size());
+	}
+
+	struct tinykvm_regs regs {};
+	/* Store the registers, so that Machine is ready to go */
+	this->setup_registers(regs);
+	this->set_registers(regs);
+}
+
+bool Machine::load_snapshot_if_present(const MachineOptions& options)
+{
+	if (memory.has_loadable_snapshot_state()) {
+		memory.load_snapshot_deltas(options.snapshot_deltas);
+		this->m_loaded_from_snapshot = this->load_snapshot_state(options);
+		if (this->m_loaded_from_snapshot) {
+			if (options.verbose_loader) {
+				printf("Loaded VM snapshot state\n");
+			}
+			return true;
+		}
+		// If the file does not exist, or anything else failed, we continue
+		// to do a normal cold start.
+	}
+	else if (!options.snapshot_deltas.empty()) {
+		throw MachineException("Delta snapshots need an existing snapshot_file");
+	}
+	return false;
+}
+
 Machine::Machine(const Machine& other, const MachineOptions& options)
 	: m_prepped {false},
 	  m_forked  {true},
 	  m_just_reset {true},
 	  m_relocate_fixed_mmap {options.relocate_fixed_mmap},
 	  m_binary {options.binary.empty() ? other.m_binary : options.binary},
+	  m_program_image {other.m_program_image},
 	  memory   {*this, options, other.memory},
 	  m_image_base    {other.m_image_base},
 	  m_stack_address {other.m_stack_address},
 	  m_heap_address  {other.m_heap_address},
+	  m_brk_begin_address {other.m_brk_begin_address},
 	  m_brk_address   {other.m_brk_address},
 	  m_brk_end_address {other.m_brk_end_address},
 	  m_start_address {other.m_start_address},
 	  m_kernel_end    {other.m_kernel_end},
 	  m_mmap_cache    {other.m_mmap_cache},
-	  m_mt     {nullptr}
+	  m_mt     {nullptr},
+	  m_syscall_table {other.m_syscall_table}
 {
 	assert(kvm_fd != -1 && "Call Machine::init() first");
 	if (!other.m_prepped || other.memory.main_memory_writes) {
@@ -113,7 +190,8 @@ Machine::Machine(const Machine& other, const MachineOptions& options)
 
 	/* Unfortunately we have to create a new VM because
 	   memory is tied to VMs and not vCPUs. */
-	this->fd = create_kvm_vm();
+	this->m_cpu_baseline = other.m_cpu_baseline;
+	this->create_vm_and_vcpu(options);
 
 	/* Reuse pre-CoWed pagetable from the master machine */
 	this->install_memory(0, memory.vmem(), false);
@@ -141,6 +219,10 @@ Machine::Machine(const Machine& other, const MachineOptions& options)
 		m_mt.reset(new MultiThreading{*this});
 		m_mt->reset_to(*other.m_mt);
 	}
+	if (other.m_signals != nullptr) {
+		m_signals.reset(new Signals);
+		m_signals->reset_to(*other.m_signals);
+	}
 	/* Loan file descriptors from the master machine */
 	if (other.m_fds != nullptr) {
 		m_fds.reset(new FileDescriptors{*this});
@@ -156,6 +238,9 @@ Machine::Machine(const Machine& other, const MachineOptions& options)
 __attribute__ ((cold))
 Machine::~Machine()
 {
+	/* Asynchronous remote calls may still be running on our vCPUs */
+	if (m_remote_async != nullptr)
+		this->smp_wait();
 	vcpu.deinit();
 	close(this->fd);
 }
@@ -168,6 +253,16 @@ void Machine::reset_to(std::string_view binary, const MachineOptions& options)
 	}
 	/* Disconnect from the remote, if it's still connected */
 	this->remote_disconnect();
+	/* Our page tables no longer hold any remote entries */
+	this->m_remote_pdpt_version = 0;
+	/* Results of unfinished asynchronous remote calls are dropped */
+	this->m_remote_async_calls.clear();
+	/* A cancellation that arrived after the last run is dropped */
+	this->vcpu.clear_cancel();
+	/* SMP vCPUs must not touch memory while it is being reset */
+	this->smp_wait();
+	/* Neither may a file read in flight */
+	this->m_async_read = nullptr;
 
 	this->m_mmap_cache = {};
 	this->m_mt.reset(nullptr);
@@ -192,45 +287,51 @@ bool Machine::reset_to(const Machine& other, const MachineOptions& options)
 
 	/* Disconnect from the remote, if it's still connected */
 	this->remote_disconnect();
+	/* Our page tables no longer hold any remote entries */
+	this->m_remote_pdpt_version = 0;
+	/* Results of unfinished asynchronous remote calls are dropped */
+	this->m_remote_async_calls.clear();
+	/* A cancellation that arrived after the last run is dropped */
+	this->vcpu.clear_cancel();
+	/* SMP vCPUs must not touch memory while it is being reset */
+	this->smp_wait();
+	/* Neither may a file read in flight */
+	if (m_async_read != nullptr && m_async_read->in_flight())
+		m_async_read->complete();
 
 	bool full_reset = false;
 	if (UNLIKELY(this->m_binary.begin() != other.m_binary.begin() ||
 		memory.compare(other.memory) == false))
 	{
 		if (options.allow_reset_to_new_master == false) {
-			throw MachineException("Swapping main memories not enabled (experimental)");
+			throw MachineException("Swapping main memories not enabled");
 		}
 		if (options.reset_keep_all_work_memory) {
 			throw MachineException("Cannot reset to new Machine with old work memory");
 		}
-
-		/* This could be dangerous, but we will allow it anyway,
-		   for those who dare to mutate an existing VM in prod. */
-		this->m_binary = other.m_binary;
-		this->m_image_base    = other.m_image_base;
-		this->m_stack_address = other.m_stack_address;
-		this->m_heap_address  = other.m_heap_address;
-		this->m_brk_address   = other.m_brk_address;
-		this->m_brk_end_address = other.m_brk_end_address;
-		this->m_start_address = other.m_start_address;
-		this->m_kernel_end    = other.m_kernel_end;
-		memory.fork_reset(other.memory, options);
-		/* Unfortunately we need to both delete and reinstall main mem */
-		this->delete_memory(0);
-		this->install_memory(0, memory.vmem(), true);
-		/* Swap remote memory, when enabled. */
-		if (this->has_remote()) {
-			this->delete_memory(1);
-			this->install_memory(1, remote().memory.vmem(), true);
+		if (other.m_cpu_baseline != this->m_cpu_baseline) {
+			/* CPUID cannot be changed once the vCPU has run */
+			throw MachineException("Cannot reset to new Machine with another CPU baseline");
 		}
+		this->rebase_to(other, options);
 		full_reset = true;
 	} else {
+		/* Learn the working set of the previous request,
+		   before a full reset drops the banks that hold it */
+		if (options.reset_prefetch_pages != 0) {
+			memory.record_working_set(options.reset_prefetch_history);
+		}
 		full_reset = memory.fork_reset(other, options);
 	}
 
 	this->m_just_reset = full_reset;
-	this->m_mmap_cache = other.m_mmap_cache;
+	this->m_mmap_cache.restore_from(other.m_mmap_cache);
 	this->vcpu.last_fault_address = 0;
+	this->m_io_wait.pending = false;
+	this->m_io_wait.resumed = false;
+	if (m_smp != nullptr) {
+		m_smp->reset();
+	}
 
 	if (other.has_threads() && has_threads()) {
 		this->m_mt->reset_to(*other.m_mt);
@@ -240,11 +341,24 @@ bool Machine::reset_to(const Machine& other, const MachineOptions& options)
 	} else {
 		m_mt = nullptr;
 	}
+	/* Signal handlers, threads and file descriptors are only copied
+	   again when they were modified since the previous reset. */
+	if (other.m_signals != nullptr) {
+		if (m_signals == nullptr)
+			m_signals.reset(new Signals);
+		m_signals->reset_to(*other.m_signals);
+	} else {
+		m_signals = nullptr;
+	}
 	/* Reset the file descriptors */
 	this->fds().reset_to(other.fds());
 
 	if (full_reset) {
 		this->setup_cow_mode(&other);
+		/* Pre-populate the learned working set */
+		if (options.reset_prefetch_pages != 0) {
+			memory.prefetch_working_set(options.reset_prefetch_pages);
+		}
 	}
 
 	if (options.reset_copy_all_registers) {
@@ -261,6 +375,41 @@ bool Machine::reset_to(const Machine& other, const MachineOptions& options)
 	return full_reset;
 }
 
+void Machine::rebase_to(const Machine& other, const MachineOptions& options)
+{
+	/* Rebase onto a new master, eg. a new version of the program. The
+	   VM, the vCPU and the memory banks are kept, while main memory,
+	   page tables and mmap ranges are swapped in from the new master.
+	   Registers, threads, signals and file descriptors are copied by
+	   the full reset that follows. */
+	this->m_binary = other.m_binary;
+	this->m_program_image = other.m_program_image;
+	this->m_image_base    = other.m_image_base;
+	this->m_stack_address = other.m_stack_address;
+	this->m_heap_address  = other.m_heap_address;
+	this->m_brk_begin_address = other.m_brk_begin_address;
+	this->m_brk_address   = other.m_brk_address;
+	this->m_brk_end_address = other.m_brk_end_address;
+	this->m_start_address = other.m_start_address;
+	this->m_kernel_end    = other.m_kernel_end;
+	this->m_syscall_table = other.m_syscall_table;
+	/* The page tables of the new master live in its main memory, and
+	   fork_reset() makes the banks start over from those. */
+	memory.fork_reset(other.memory, options);
+	/* KVM cannot move the host address of a memory slot, so main
+	   memory is re-registered. Installing it the same way as a new
+	   fork does keeps the rebased fork indistinguishable from one. */
+	this->delete_memory(0);
+	this->install_memory(0, memory.vmem(), false);
+	/* Ranges shared by both masters keep their memory slots */
+	memory.rebase_mmap_ranges(other);
+	/* Swap remote memory, when enabled. */
+	if (this->has_remote()) {
+		this->delete_memory(1);
+		this->install_memory(1, remote().memory.vmem(), false);
+	}
+}
+
 uint64_t Machine::stack_push(__u64& sp, const void* data, size_t length)
 {
 	sp = (sp - length) & ~(uint64_t) 0x7; // maintain word alignment
@@ -287,12 +436,22 @@ uint64_t Machine::stack_push_cstr(__u64& sp, const char* string, size_t length)
 	return sp;
 }
 
+uint64_t Machine::stack_push_view(__u64& sp, std::string_view string)
+{
+	sp = (sp - (string.size() + 1)) & ~(uint64_t) 0x7; // maintain word alignment
+	copy_to_guest(sp, string.data(), string.size(), true);
+	const uint8_t zero = 0;
+	copy_to_guest(sp + string.size(), &zero, sizeof(zero), true);
+	return sp;
+}
+
 void Machine::install_memory(uint32_t idx, const VirtualMem& mem,
-	[[maybe_unused]] bool readonly)
+	[[maybe_unused]] bool readonly, bool log_dirty)
 {
 	const struct kvm_userspace_memory_region memreg {
 		.slot = idx,
-		.flags = readonly ? (uint32_t)KVM_MEM_READONLY : 0u,
+		.flags = (readonly ? (uint32_t)KVM_MEM_READONLY : 0u)
+			| (log_dirty ? (uint32_t)KVM_MEM_LOG_DIRTY_PAGES : 0u),
 		.guest_phys_addr = mem.physbase,
 		.memory_size = mem.size,
 		.userspace_addr = (uintptr_t) mem.ptr,
@@ -322,6 +481,15 @@ void Machine::delete_memory(uint32_t idx)
 		machine_exception("Failed to delete guest memory region", idx);
 	}
 }
+void Machine::get_dirty_log(uint32_t idx, uint64_t* bitmap)
+{
+	struct kvm_dirty_log log {};
+	log.slot = idx;
+	log.dirty_bitmap = bitmap;
+	if (UNLIKELY(ioctl(this->fd, KVM_GET_DIRTY_LOG, &log) < 0)) {
+		machine_exception("Failed to retrieve dirty page log", idx);
+	}
+}
 uint64_t Machine::translate(uint64_t virt) const
 {
 	struct kvm_translation tr;
@@ -346,9 +514,90 @@ long Machine::return_value() const
 	return registers().rdi;
 }
 
+struct OutputBuffer
+{
+	std::mutex mtx; // SMP vCPUs print too
+	std::vector<char> data;
+	size_t capacity = 0;
+	bool whole_lines = false;
+	Machine::batch_printer_func batch_printer;
+
+	void hand_over(Machine::printer_func& printer, const struct iovec* iov, size_t count)
+	{
+		if (batch_printer) {
+			batch_printer(iov, count);
+			return;
+		}
+		for (size_t i = 0; i < count; i++)
+			printer((const char *)iov[i].iov_base, iov[i].iov_len);
+	}
+};
+
 void Machine::print(const char* buffer, size_t len)
 {
-	m_printer(buffer, len);
+	if (LIKELY(m_output == nullptr)) {
+		m_printer(buffer, len);
+		return;
+	}
+	auto& out = *m_output;
+	std::scoped_lock lock(out.mtx);
+	if (out.data.size() + len <= out.capacity) {
+		out.data.insert(out.data.end(), buffer, buffer + len);
+		return;
+	}
+	/* The buffer is full. Hand over what is buffered, and as much of
+	   the new output as possible, in one batch. */
+	size_t keep = 0;
+	if (out.whole_lines) {
+		const void* nl = memrchr(buffer, '\n', len);
+		if (nl != nullptr) {
+			keep = len - ((const char *)nl - buffer + 1);
+			if (keep > out.capacity)
+				keep = 0;
+		}
+	}
+	const struct iovec iov[2] = {
+		{ out.data.data(), out.data.size() },
+		{ (void *)buffer, len - keep },
+	};
+	const bool buffered = !out.data.empty();
+	out.hand_over(m_printer, buffered ? &iov[0] : &iov[1], buffered ? 2 : 1);
+	out.data.assign(buffer + len - keep, buffer + len);
+}
+
+void Machine::flush_output()
+{
+	if (m_output == nullptr)
+		return;
+	auto& out = *m_output;
+	std::scoped_lock lock(out.mtx);
+	if (out.data.empty())
+		return;
+	const struct iovec iov { out.data.data(), out.data.size() };
+	out.hand_over(m_printer, &iov, 1);
+	out.data.clear();
+}
+
+void Machine::set_output_buffering(size_t capacity, bool whole_lines)
+{
+	this->flush_output();
+	if (capacity == 0 && (m_output == nullptr || !m_output->batch_printer)) {
+		m_output = nullptr;
+		return;
+	}
+	if (m_output == nullptr)
+		m_output.reset(new OutputBuffer);
+	m_output->capacity = capacity;
+	m_output->whole_lines = whole_lines;
+	m_output->data.reserve(capacity);
+}
+
+void Machine::set_batch_printer(batch_printer_func pf)
+{
+	this->flush_output();
+	if (m_output == nullptr)
+		m_output.reset(new OutputBuffer);
+	m_output->batch_printer = std::move(pf);
 }
 
 void Machine::run(float timeout)
@@ -362,6 +611,116 @@ void Machine::run_in_usermode(float timeout)
 	this->run(timeout);
 }
 
+void Machine::timed_vmcall_chain(std::span<const ChainCall> calls,
+	std::span<uint64_t> results, float timeout)
+{
+	if (calls.empty())
+		return;
+	if (calls.size() > MAX_VMCALL_CHAIN || results.size() < calls.size())
+		throw MachineException("Invalid vmcall chain", calls.size());
+	/* The chain table is read by the trampoline in usercode.asm */
+	struct ChainEntry {
+		uint64_t addr;
+		uint64_t args[6];
+		uint64_t result;
+	};
+	static_assert(sizeof(ChainEntry) == 64);
+	std::array<ChainEntry, MAX_VMCALL_CHAIN> table;
+	for (size_t i = 0; i < calls.size(); i++) {
+		table[i].addr = calls[i].addr;
+		std::copy(calls[i].args.begin(), calls[i].args.end(), table[i].args);
+		table[i].result = 0;
+	}
+	__u64 sp = this->stack_address();
+	const uint64_t table_addr =
+		stack_push(sp, table.data(), calls.size() * sizeof(ChainEntry));
+	/* Every call in the chain starts with the same stack pointer */
+	sp &= ~(uint64_t) 0xF;
+
+	auto& regs = vcpu.registers();
+	const auto& first = calls.front();
+	this->setup_call(regs, first.addr, sp,
+		first.args[0], first.args[1], first.args[2],
+		first.args[3], first.args[4], first.args[5]);
+	/* Return into the trampoline instead of exiting */
+	const uint64_t chain = this->chain_address();
+	this->copy_to_guest(regs.rsp, &chain, sizeof(chain));
+	regs.rbx = table_addr;
+	regs.r12 = calls.size();
+	regs.rbp = sp;
+	vcpu.set_registers(regs);
+	this->run(timeout);
+
+	this->copy_from_guest(table.data(), table_addr, calls.size() * sizeof(ChainEntry));
+	for (size_t i = 0; i < calls.size(); i++)
+		results[i] = table[i].result;
+}
+
+void Machine::set_instruction_budget(uint64_t instructions)
+{
+	if (instructions != 0 && !vcpu.budget_open())
+		throw MachineException("Unable to open a guest instruction counter", errno);
+	vcpu.instruction_budget = instructions;
+}
+
+bool Machine::run_timeslice(float slice)
+{
+	/* Slices are timed in milliseconds, and zero means no timeout */
+	vcpu.preemptible = true;
+	vcpu.preempted = false;
+	try {
+		this->run(std::max(slice, 0.001f));
+	} catch (...) {
+		vcpu.preemptible = false;
+		throw;
+	}
+	vcpu.preemptible = false;
+	return !vcpu.preempted;
+}
+
+bool Machine::suspend_for_io(vCPU& cpu, const struct pollfd* fds, unsigned count, int& timeout)
+{
+	if (LIKELY(!m_io_suspend) || &cpu != &this->vcpu)
+		return false;
+	if (m_io_wait.resumed) {
+		/* The system call is completed without blocking */
+		m_io_wait.resumed = false;
+		timeout = 0;
+		return false;
+	}
+	if (timeout == 0 || count == 0)
+		return false;
+	m_io_wait.fds.assign(fds, fds + count);
+	for (auto& pfd : m_io_wait.fds)
+		pfd.revents = 0;
+	if (::poll(m_io_wait.fds.data(), count, 0) != 0)
+		return false; // Ready (or failed), no need to wait
+	m_io_wait.syscall_nr = cpu.registers().rax;
+	m_io_wait.timeout_ms = timeout;
+	m_io_wait.pending = true;
+	cpu.stop();
+	return true;
+}
+
+void Machine::resume_io(float timeout)
+{
+	if (UNLIKELY(!m_io_wait.pending)) {
+		throw MachineException("resume_io: The VM is not waiting for I/O");
+	}
+	m_io_wait.pending = false;
+	m_io_wait.resumed = true;
+	/* The registers still hold the system call arguments */
+	this->system_call(vcpu, m_io_wait.syscall_nr);
+	m_io_wait.resumed = false;
+	/* Return to the guest as SYSRET would, as the vCPU
+	   was stopped in the middle of the system call stub. */
+	auto& regs = vcpu.registers();
+	regs.rip = regs.rcx;
+	regs.rflags = regs.r11;
+	vcpu.set_registers(regs);
+	this->run_in_usermode(timeout);
+}
+
 __attribute__((cold, noreturn))
 void Machine::machine_exception(const char* msg, uint64_t data)
 {
@@ -369,9 +728,9 @@ void Machine::machine_exception(const char* msg, uint64_t data)
 }
 
 __attribute__((cold, noreturn))
-void Machine::timeout_exception(const char* msg, uint32_t data)
+void Machine::timeout_exception(const char* msg, uint32_t data, uint64_t instructions)
 {
-	throw MachineTimeoutException(msg, data);
+	throw MachineTimeoutException(msg, data, instructions);
 }
 
 __attribute__ ((cold))
@@ -408,6 +767,25 @@ void Machine::init()
 	Machine::kvm_fd = kvm_open();
 }
 
+void Machine::create_vm_and_vcpu(const MachineOptions& options)
+{
+	/* Take a pre-created VM with its first vCPU, when available.
+	   The in-kernel local APIC must exist before the vCPU. */
+	KvmPool::Entry entry;
+	if (!options.lapic_timer && KvmPool::get().take(entry)) {
+		this->fd = entry.vm_fd;
+		this->vcpu.adopt(entry.vcpu_fd, entry.kvm_run);
+		return;
+	}
+	/* vCPU::init() creates the vCPU */
+	this->fd = create_kvm_vm();
+	if (options.lapic_timer && ioctl(this->fd, KVM_CREATE_IRQCHIP, 0) < 0) {
+		close(this->fd);
+		this->fd = -1;
+		machine_exception("Failed to KVM_CREATE_IRQCHIP");
+	}
+}
+
 __attribute__ ((cold))
 int Machine::create_kvm_vm()
 {
@@ -3,6 +3,8 @@
 #include "memory.hpp"
 #include "memory_bank.hpp"
 #include "mmap_cache.hpp"
+#include "sampling_profiler.hpp"
+#include "syscall_trace.hpp"
 #include "linux/fds.hpp"
 #include "linux/signals.hpp"
 #include "vcpu.hpp"
@@ -10,10 +12,22 @@
 #include <cassert>
 #include <functional>
 #include <memory>
+#include <poll.h>
 #include <span>
+#include <sys/syscall.h>
 #include <vector>
+struct iovec;
 
 namespace tinykvm {
+class ThreadPool;
+struct AsyncFileRead;
+struct Channel;
+struct OutputBuffer;
+struct ProgramImage;
+struct RemoteAsync;
+struct RemoteAsyncResult;
+struct RemoteConcurrency;
+struct SymbolIndex;
 
 struct Machine
 {
@@ -22,6 +36,7 @@ struct Machine
 	using numbered_syscall_t = void(*)(vCPU&, unsigned);
 	using io_callback_t = void(*)(vCPU&, unsigned, unsigned);
 	using printer_func = std::function<void(const char*, size_t)>;
+	using batch_printer_func = std::function<void(const struct iovec*, size_t)>;
 	using mmap_func_t = std::function<void(vCPU&, address_t, size_t, int, int, int, address_t)>;
 
 	/* Setup Linux env and run through main */
@@ -31,6 +46,21 @@ struct Machine
 					const std::vector<std::string>& env = {});
 	void run(float timeout_secs = 0.f);
 	void run_in_usermode(float timeout_secs = 0.f);
+	/* Run, or continue a preempted run, for at most one time slice.
+	   Returns false when the slice expired, with the VM paused where
+	   it was instead of a timeout exception. See MachineScheduler. */
+	bool run_timeslice(float slice_secs);
+	bool preempted() const noexcept { return vcpu.preempted; }
+	/* Instruction budgets: Each run of the main vCPU, eg. each vmcall,
+	   may retire at most this many guest instructions, counted by a
+	   host perf counter that excludes the host. Exceeding it throws a
+	   MachineTimeoutException with instructions(). Unlike timeouts, it
+	   does not depend on the load of the host. 0 disables the budget.
+	   Throws when the host has no usable PMU (see perf_event_paranoid). */
+	void set_instruction_budget(uint64_t instructions);
+	uint64_t instruction_budget() const noexcept { return vcpu.instruction_budget; }
+	/* Guest instructions retired by the last run with a budget */
+	uint64_t instructions_executed() const noexcept { return vcpu.instructions_executed; }
 	void enter_usermode();
 
 	/* Make a SYSV function call into the VM, with no timeout */
@@ -43,17 +73,69 @@ struct Machine
 	void timed_vmcall(address_t, float timeout, Args&&...);
 	template <typename... Args> constexpr
 	void timed_vmcall_stack(address_t, address_t stk, float timeout, Args&&...);
+	/* One call in a vmcall chain, with integral arguments only */
+	struct ChainCall {
+		address_t addr;
+		std::array<uint64_t, 6> args {};
+	};
+	static constexpr size_t MAX_VMCALL_CHAIN = 64;
+	/* Make several SYSV function calls back to back, with one entry
+	   into usermode and one timeout for the whole chain. Each call
+	   returns straight into the next one through a guest trampoline,
+	   without exiting the VM. The return value of each call is written
+	   to @results, which must hold at least one result per call. */
+	void timed_vmcall_chain(std::span<const ChainCall> calls,
+		std::span<uint64_t> results, float timeout = 0.f);
 	/* Retrieve optional return value from a vmcall */
 	long return_value() const;
 	/* Resume the VM from a paused state */
 	void vmresume(float timeout_secs = 0.f);
 
+	/* Guest I/O that the main vCPU is suspended on, see co_vmcall.hpp */
+	struct IOWait {
+		std::vector<struct pollfd> fds; // Host fds and the events waited for
+		int  timeout_ms = -1;  // The timeout of the guest system call
+		unsigned syscall_nr = 0;
+		bool pending = false;
+		bool resumed = false;
+	};
+	/// @brief When enabled, epoll_wait, poll and accept4 stop the main
+	/// vCPU instead of blocking the host thread, leaving the host fds
+	/// to wait for in io_wait(). Used by co_vmcall().
+	void set_io_suspend(bool enabled) noexcept { m_io_suspend = enabled; }
+	bool io_pending() const noexcept { return m_io_wait.pending; }
+	const IOWait& io_wait() const noexcept { return m_io_wait; }
+	/// @brief Complete the system call the guest is suspended in, without
+	/// blocking, and resume the guest with the given timeout.
+	void resume_io(float timeout_secs = 0.f);
+	/// @brief Called by system call handlers that may block on @fds.
+	/// @return True when the vCPU has been stopped, waiting for I/O. When
+	/// the call is being resumed, @timeout is set to zero instead.
+	bool suspend_for_io(vCPU&, const struct pollfd* fds, unsigned count, int& timeout);
+	/// @brief When set, and I/O suspension is enabled, reads from regular
+	/// files that miss the host page cache run on @pool, and the main vCPU
+	/// is suspended until they complete, like for other guest I/O. Other
+	/// VMs keep running on the host thread in the meantime.
+	/// @param pool A thread pool, which may be shared, or nullptr.
+	void set_file_read_pool(std::shared_ptr<ThreadPool> pool);
+	/// @brief Called by read system call handlers, with the host iovecs.
+	/// @return False when the caller should read as usual. Otherwise, either
+	/// the vCPU has been stopped waiting for the read (io_pending()), or
+	/// @result holds the result of the read.
+	bool offload_file_read(vCPU&, int fd, const struct iovec* iov, unsigned count,
+		int64_t offset, int64_t& result);
+
 	auto& cpu() noexcept { return this->vcpu; }
 	const auto& cpu() const noexcept { return this->vcpu; }
 
 	bool is_forkable() const noexcept { return m_prepped; }
 	void stop(bool = true);
 	bool stopped() const noexcept { return vcpu.stopped; }
+	/// @brief Cancel the running request, from any thread. The vCPU is
+	/// kicked out of the guest right away, and the run throws
+	/// MachineCancelledException. When nothing is running, the next run
+	/// is cancelled instead, unless the machine is reset first.
+	void cancel() { vcpu.cancel(); }
 	bool reset_to(const Machine&, const MachineOptions&); // true = full reset
 	void reset_to(std::string_view binary, const MachineOptions&);
 
@@ -64,15 +146,20 @@ struct Machine
 	/* Fill an array of buffers pointing to complete guest virtual [addr, len].
 	   Throws an exception if there was a protection violation.
 	   Returns the number of buffers filled, or an exception if not enough. */
-	struct Buffer { const char* ptr; size_t len; };
+	using Buffer = IOBuffer;
 	size_t gather_buffers_from_range(size_t cnt, Buffer[], address_t addr, size_t len) const;
 	size_t gather_buffers_from_range(std::vector<Buffer>&, address_t addr, size_t len) const;
+	size_t gather_buffers_from_range(ScratchIOVec<Buffer>&, address_t addr, size_t len) const;
 	/* Same as above, but all buffers have pre-allocated writable pages. */
-	struct WrBuffer { char* ptr; size_t len; };
+	using WrBuffer = IOWrBuffer;
 	size_t writable_buffers_from_range(std::vector<WrBuffer>&, address_t addr, size_t len);
+	size_t writable_buffers_from_range(ScratchIOVec<WrBuffer>&, address_t addr, size_t len);
 	/* Lazily create CoW mmap-backed area from an open file descriptor, return the mmap pointer */
 	bool mmap_backed_area(int fd, int off, int prot, address_t dst, size_t size);
 	bool has_mmap_backed_area(int fd, int off, address_t addr, size_t size) const;
+	/* Map a ring channel into this VM at @addr (2MB aligned), or at a new
+	   mmap address when zero. Returns the guest address of the channel. */
+	address_t map_channel(Channel&, address_t addr = 0);
 	/* Build std::string from zero-terminated memory. */
 	std::string copy_from_cstring(address_t src, size_t maxlen = 65535u) const;
 	/* Build std::string from buffer, length in memory. */
@@ -114,6 +201,15 @@ struct Machine
 	void foreach_memory(address_t src, size_t size, std::function<void(const std::string_view)>) const;
 	/* Efficiently copy between machines */
 	void copy_from_machine(address_t dst, Machine& src, address_t sa, size_t size);
+	/* Zero-copy variant for large transfers into a fork that splits
+	   hugepages: whole pages that are immutable in @src (copy-on-write
+	   or read-only) are mapped read-only into this VM's page tables,
+	   and are only copied on the next write. The rest is copied. @src
+	   must share memory with this VM: itself, its remote, or a fork of
+	   the same master. Returns the number of bytes that were aliased.
+	   Meant for a guest that is not inside a system call, which could
+	   hold stale translations. */
+	size_t alias_from_machine(address_t dst, Machine& src, address_t sa, size_t size);
 
 	template <typename T>
 	uint64_t stack_push(__u64& sp, const T&);
@@ -121,6 +217,8 @@ struct Machine
 	uint64_t stack_push(__u64& sp, const std::string&);
 	uint64_t stack_push_cstr(__u64& sp, const char*);
 	uint64_t stack_push_cstr(__u64& sp, const char*, size_t);
+	/* Push a zero-terminated copy of a string that may not be terminated */
+	uint64_t stack_push_view(__u64& sp, std::string_view);
 	template <typename T>
 	uint64_t stack_push_std_array(__u64& sp, const T&, size_t N = T::size());
 
@@ -141,7 +239,69 @@ struct Machine
 	static void install_syscall_handler(unsigned idx, syscall_t h) { m_syscalls.at(idx) = h; }
 	static void install_unhandled_syscall_handler(numbered_syscall_t h) { m_unhandled_syscall = h; }
 	static auto get_syscall_handler(unsigned idx) { return m_syscalls.at(idx); }
+	/* A system call handler table that replaces the process-wide one
+	   for a single machine, and is inherited by its forks. A table can
+	   be assembled at compile time with make(), so that a restricted
+	   tenant dispatches straight to its own minimal handlers, or be
+	   derived at run-time from the process-wide handlers. */
+	struct SyscallTable {
+		using entry_t = std::pair<unsigned, syscall_t>;
+		std::array<syscall_t, TINYKVM_MAX_SYSCALLS> handlers {};
+		numbered_syscall_t unhandled = nullptr;
+
+		template <size_t N>
+		static constexpr SyscallTable make(const entry_t (&entries)[N],
+			numbered_syscall_t unhandled = nullptr)
+		{
+			SyscallTable table;
+			for (const auto& [idx, handler] : entries)
+				table.handlers.at(idx) = handler;
+			table.unhandled = unhandled;
+			return table;
+		}
+		/* A copy of the process-wide system call handlers */
+		static SyscallTable from_global()
+		{
+			SyscallTable table;
+			table.handlers = m_syscalls;
+			table.unhandled = m_unhandled_syscall;
+			return table;
+		}
+		constexpr SyscallTable& install(unsigned idx, syscall_t handler) {
+			handlers.at(idx) = handler;
+			return *this;
+		}
+		constexpr SyscallTable& remove(unsigned idx) {
+			handlers.at(idx) = nullptr;
+			return *this;
+		}
+	};
+	/* Use the given table for this machine and forks created from it
+	   afterwards, or nullptr for the process-wide handlers. The table
+	   must outlive every machine using it. */
+	void set_syscall_table(const SyscallTable* table) noexcept { m_syscall_table = table; }
+	const SyscallTable* syscall_table() const noexcept { return m_syscall_table; }
 	void system_call(vCPU&, unsigned no);
+	/* Batched system calls: The guest queues entries in a ring in its
+	   own memory, and submits them all with a single SYSCALL_BATCH
+	   system call (rdi = ring address). The results are written back
+	   into each entry, and the number of completed entries is returned.
+	   Guests can use kvm_syscall_batch from guest/src/api.hpp. */
+	struct SyscallBatchEntry {
+		uint64_t nr;
+		uint64_t args[6];
+		int64_t  result;
+	};
+	struct SyscallRing {
+		uint32_t head;  // Next entry for the host to complete
+		uint32_t tail;  // Next entry for the guest to submit
+		uint32_t mask;  // Number of entries minus one (power of two)
+		uint32_t flags;
+		/* SyscallBatchEntry entries[mask + 1]; */
+	};
+	static constexpr unsigned SYSCALL_BATCH = 0x1F710;
+	static constexpr uint32_t SYSCALL_BATCH_MAX = 4096;
+	void system_call_batch(vCPU&);
 	static void install_input_handler(io_callback_t h) { m_on_input = h; }
 	static void install_output_handler(io_callback_t h) { m_on_output = h; }
 
@@ -161,11 +321,13 @@ struct Machine
 	address_t entry_address() const noexcept;
 	address_t preserving_entry_address() const noexcept;
 	address_t exit_address() const noexcept;
+	address_t chain_address() const noexcept;
 	void set_stack_address(address_t addr) { this->m_stack_address = addr; }
 	address_t kernel_end_address() const noexcept { return m_kernel_end; }
 	address_t max_address() const noexcept { return memory.physbase + memory.size; }
 
 	static constexpr uint64_t BRK_MAX = 0x22000;
+	address_t brk_begin_address() const noexcept { return this->m_brk_begin_address; }
 	address_t brk_address() const noexcept { return this->m_brk_address; }
 	address_t brk_end_address() const noexcept { return this->m_brk_end_address; }
 	void set_brk_address(address_t addr) { this->m_brk_address = addr; }
@@ -174,6 +336,32 @@ struct Machine
 	address_t mmap_allocate(size_t bytes, int prot = 0x3, bool huge = false);
 	address_t mmap_fixed_allocate(uint64_t addr, size_t bytes, bool is_fixed, int prot = 0x3);
 	bool      mmap_unmap(uint64_t addr, size_t size);
+	/* Unmap the private pages of a copy-on-write VM wholly inside
+	   [addr, addr+len), which read as zeroes afterwards, and give their
+	   working memory back to the banks. A master VM that is not yet
+	   prepared for forking, with sparse_main_memory, gives the host
+	   pages of its main memory back instead. Returns the number of pages. */
+	size_t    release_pages(address_t addr, size_t len);
+	/* With sparse_main_memory: Give back the host pages of main memory
+	   that only hold zeroes, before prepare_copy_on_write(), which also
+	   calls this. Returns the number of pages. */
+	size_t    reclaim_main_memory();
+	/* Memory balloon: The host asks a long-lived guest to hand back
+	   @pages pages of working memory with set_memory_pressure(). The
+	   guest polls with MEMORY_BALLOON (rdi = 0), which returns the
+	   number of pages still wanted, and hands back unused ranges with
+	   MEMORY_BALLOON (rdi = 1, rsi = addr, rdx = len), which releases
+	   them like release_pages() and returns the number of pages. Pages
+	   released by munmap() and madvise() count towards the request too. */
+	void   set_memory_pressure(size_t pages) noexcept { m_memory_pressure = pages; }
+	size_t memory_pressure() const noexcept { return m_memory_pressure; }
+	static constexpr unsigned MEMORY_BALLOON = 0x1F714;
+	void   memory_balloon(vCPU&);
+	/* Working memory that is resident but no longer in use, eg. pages
+	   kept across resets, and can be reclaimed without the guest. */
+	size_t reclaimable_pages() const noexcept { return memory.banks.reclaimable_pages(); }
+	/* Give the reclaimable pages back to the kernel. Returns the number of pages. */
+	size_t trim_working_memory() { return memory.banks.trim(); }
 	bool relocate_fixed_mmap() const noexcept { return m_relocate_fixed_mmap; }
 	bool mmap_relax(uint64_t addr, size_t size, size_t new_size);
 	void do_mmap_callback(vCPU&, address_t, size_t, int, int, int, address_t);
@@ -182,6 +370,14 @@ struct Machine
 	uint64_t address_of(std::string_view symbol, const std::vector<uint8_t>&) const;
 	uint64_t address_of(std::string_view symbol, std::string_view binary = {}) const;
 	std::string resolve(uint64_t rip, std::string_view binary = {}) const;
+	/* The symbol index behind address_of() and resolve(), built once
+	   per binary and shared by the machines that use it */
+	std::shared_ptr<const SymbolIndex> symbol_index(std::string_view binary = {}) const;
+	/* Append the functions of the program, at their guest addresses, to
+	   a perf map file (by default /tmp/perf-<pid>.map). Each program is
+	   written once per file and image base. Returns the number of
+	   functions written. */
+	size_t write_perf_map(const std::string& path = {}) const;
 
 	bool smp_active() const noexcept;
 	int  smp_active_count() const noexcept;
@@ -194,6 +390,14 @@ struct Machine
 	const struct MultiThreading& threads() const;
 	struct MultiThreading& threads();
 	static void setup_multithreading();
+	/// @brief Run guest threads created with clone() and clone3() in parallel
+	/// on SMP vCPUs, instead of cooperatively on the main vCPU.
+	/// @param max_vcpus The number of threads that can run at the same time,
+	/// not counting the main thread. Zero disables parallel threads.
+	/// @param thread_timeout Execution timeout of each thread. When zero, the
+	/// timeout of the creating thread is used.
+	void set_parallel_threads(unsigned max_vcpus, float thread_timeout = 0.0f);
+	bool has_parallel_threads() const noexcept { return m_parallel_threads; }
 
 	/* Memory maps */
 	const auto& mmap_cache() const noexcept { return m_mmap_cache; }
@@ -209,6 +413,17 @@ struct Machine
 
 	void set_printer(printer_func pf = m_default_printer) { m_printer = std::move(pf); }
 	void print(const char*, size_t);
+	/// @brief Buffer guest output to stdout and stderr, and hand it to the
+	/// printer in batches: when @capacity bytes are buffered, and when the
+	/// vCPU stops running. With @whole_lines, a batch handed over because
+	/// the buffer is full ends at a newline, when there is one. A capacity
+	/// of zero disables buffering, flushing what is buffered.
+	void set_output_buffering(size_t capacity, bool whole_lines = false);
+	/// @brief Receive buffered output as an array of iovecs, eg. for writev().
+	/// Without a batch printer, the printer is called once per iovec.
+	void set_batch_printer(batch_printer_func pf);
+	/// @brief Hand all buffered guest output to the printer.
+	void flush_output();
 	void print_registers() const { vcpu.print_registers(); }
 	void print_pagetables() const;
 	void print_exception_handlers() const;
@@ -219,9 +434,21 @@ struct Machine
 		bool quit = false;
 	};
 	void print_remote_gdb_backtrace(const std::string& filename, const RemoteGDBOptions& opts);
-
-	void install_memory(uint32_t idx, const VirtualMem&, bool ro);
+	/// @brief Unwind the guest stack of the main vCPU, in-process and
+	/// without GDB. The frame pointer chain is followed as long as it
+	/// leads into known functions. When it ends right away, eg. in
+	/// programs built without frame pointers, the stack is instead
+	/// scanned for return addresses into known functions, which may
+	/// include stale frames. The first address is the current RIP.
+	std::vector<address_t> backtrace_addresses(size_t max_frames = 32) const;
+	/// @brief The backtrace symbolized with resolve(), one frame per line,
+	/// eg. to attach to the log line of a MachineException.
+	std::string backtrace(size_t max_frames = 32) const;
+
+	void install_memory(uint32_t idx, const VirtualMem&, bool ro, bool log_dirty = false);
 	void delete_memory(uint32_t idx);
+	/* Retrieve (and clear) the KVM dirty page bitmap of a memory slot */
+	void get_dirty_log(uint32_t idx, uint64_t* bitmap);
 	vMemory& main_memory() noexcept;
 	const vMemory& main_memory() const noexcept;
 	std::string_view binary() const noexcept { return m_binary; }
@@ -234,6 +461,37 @@ struct Machine
 	size_t banked_memory_allocated_bytes() const noexcept { return banked_memory_allocated_pages() * vMemory::PageSize(); }
 	size_t banked_memory_capacity_pages() const noexcept; // How many pages is the VM allowed to allocate in total
 	size_t banked_memory_capacity_bytes() const noexcept { return banked_memory_capacity_pages() * vMemory::PageSize(); }
+	/* A breakdown of the memory used by this VM, in pages. Walks
+	   the page tables, so it is meant for occasional sampling. */
+	struct MemoryStats {
+		/* Working memory: in use, the most in use since the last
+		   reset, backed by host memory and the maximum allowed. */
+		size_t used_pages = 0;
+		size_t peak_used_pages = 0;
+		size_t allocated_pages = 0;
+		size_t capacity_pages = 0;
+		size_t released_pages = 0;    // See release_pages()
+		size_t reclaimable_pages = 0; // See reclaimable_pages()
+		/* Working memory handed out since the last reset */
+		size_t copied_pages = 0;      // Copy-on-write copies of master pages
+		size_t zeroed_pages = 0;      // Zero-filled, or overwritten by the host
+		size_t table_pages = 0;       // Page tables
+		size_t hugepages = 0;         // 2MB pages, also counted as 512 pages above
+		/* Private pages mapped into the guest now, by where they are */
+		size_t heap_pages = 0;        // The brk area
+		size_t stack_pages = 0;       // The main stack
+		size_t mmap_pages = 0;        // The mmap arena
+		size_t other_pages = 0;       // Eg. the program image
+		size_t mapped_hugepages = 0;  // 2MB pages, also counted as 512 pages above
+		size_t mapped_table_pages = 0;
+		/* Host memory of files mapped into the guest, see mmap_backed_files */
+		size_t file_backed_pages = 0;
+		/* Main memory made writable in place, see master_direct_memory_writes */
+		size_t unlocked_pages = 0;
+		/* Host pages of main memory, when this VM owns it */
+		size_t resident_main_pages = 0;
+	};
+	MemoryStats memory_stats() const;
 
 	template <typename... Args> constexpr
 	void setup_call(tinykvm_x86regs&, uint64_t addr, uint64_t rsp, Args&&... args);
@@ -242,10 +500,39 @@ struct Machine
 	   When @max_work_mem is non-zero, the master VM can still
 	   be used after preparation. */
 	void prepare_copy_on_write(size_t max_work_mem = 0, uint64_t shared_memory_boundary = UINT64_MAX);
+	/* Spread the page-table walk of prepare_copy_on_write() over @threads
+	   threads. When @incremental, preparing the same master again only
+	   revisits the parts of the page tables that were made writable or
+	   accessed since the last time. */
+	void set_copy_on_write_preparation(unsigned threads, bool incremental) {
+		m_makecow_threads = threads; m_makecow_incremental = incremental;
+	}
+	/* The shared memory boundary of the last prepare_copy_on_write().
+	   Pages at and above it are shared by the master and its forks. */
+	uint64_t shared_memory_boundary() const noexcept { return m_makecow_boundary; }
 	void set_main_memory_writable(bool v) { memory.main_memory_writes = v; }
+	/* Back the user pages of this prepared master with pages of the
+	   process-wide PageDedupStore, sharing identical pages with other
+	   masters. Writes still make private copies, and forks copy-on-write
+	   from the shared pages as usual. Should happen before forking.
+	   Returns the number of pages now shared with other masters. Does
+	   nothing for hugepage and snapshot file backed main memory. */
+	size_t deduplicate_pages();
+	/* Map the whole gigapages of main memory inside [addr, addr+size) with
+	   1GB pages, where they are still uniformly mapped with 2MB pages. Meant
+	   for large read-mostly data, eg. above the shared memory boundary.
+	   Must happen before prepare_copy_on_write(). Copy-on-write splits
+	   a 1GB page into 2MB pages. Returns the number of 1GB pages. */
+	size_t map_gigapages(address_t addr, size_t size);
+	static bool gigapages_supported();
 	bool is_forked() const noexcept { return m_forked; }
 	bool uses_cow_memory() const noexcept { return m_forked || m_prepped; }
 	std::vector<std::pair<uint64_t, uint64_t>> get_accessed_pages() const;
+	/* Incrementally find the pages that the guest has accessed since the
+	   previous harvest, clearing their accessed bits. In forks, the dirty
+	   bits of private pages are cleared too. Returns the number of pages
+	   written to @pages, and when that is @max, there may be more left. */
+	size_t harvest_accessed_pages(AccessedPage* pages, size_t max);
 
 	/* Remote VM through address space merging */
 	void remote_connect(Machine& other, bool connect_now = false);
@@ -255,24 +542,139 @@ struct Machine
 	void ipre_remote_resume_now(bool save_all_regs, std::function<void(Machine&)> before);
 	void ipre_permanent_remote_resume_now(bool store_fsbase_rdi = true);
 	address_t remote_disconnect();
-	bool has_remote() const noexcept { return m_remote != nullptr; }
+	/* Remote sessions: Connect to the remote once, make any number of
+	   calls into it, and disconnect at the end. Each call runs a remote
+	   function on this VM's vCPU with the remote's FSBASE, on this VM's
+	   stack below the red zone, and returns its result. The calls are
+	   not given a timeout of their own: inside a system call handler
+	   they are covered by the timeout of the running call. The session
+	   must be ended even when a call throws. */
+	void remote_session_begin();
+	template <typename... Args>
+	long remote_session_call(address_t func, Args&&... args);
+	void remote_session_end();
+	bool in_remote_session() const noexcept { return m_remote_session; }
+	/* Batched remote calls: The guest passes an array of entries with
+	   a single REMOTE_CALL_BATCH system call (rdi = entries, rsi = count),
+	   and every call is made within one remote session. The results are
+	   written back into each entry, and the number of completed calls
+	   is returned. Functions outside of remote memory fail with -EFAULT. */
+	struct RemoteCallEntry {
+		uint64_t function;
+		uint64_t args[4];
+		int64_t  result;
+	};
+	static constexpr unsigned REMOTE_CALL_BATCH = 0x1F711;
+	static constexpr uint32_t REMOTE_CALL_BATCH_MAX = 256;
+	void remote_call_batch(vCPU&);
+	/* Concurrent remote: Let several callers into this remote VM at the
+	   same time, instead of one at a time. Each caller borrows one of
+	   @tls_bases (the TLS of a guest thread in this VM) for the length
+	   of its connection, or when empty, the TLS of every guest thread.
+	   Entry points added with remote_add_shared_entry() run in parallel
+	   with each other, while calls into other functions run alone. */
+	void remote_enable_concurrency(std::vector<address_t> tls_bases = {});
+	void remote_add_shared_entry(address_t entry);
+	bool has_remote_concurrency() const noexcept { return m_remote_concurrency != nullptr; }
+	/* Asynchronous remote calls: A call is queued to one of the remote
+	   VM's own SMP vCPUs, instead of running on the caller's vCPU, and
+	   the caller collects the result later with its ticket. The remote
+	   must allow it with remote_enable_async(), giving each of @vcpus
+	   a stack and every call @timeout seconds. More than one vCPU needs
+	   remote_enable_concurrency() or a remote serializer, so that calls
+	   do not share the TLS of the main thread. The call runs entirely
+	   inside the remote VM, so the arguments are passed by value and
+	   may not point into the caller. remote_async_result() returns 0
+	   when the call completed, -EAGAIN while it is still running (unless
+	   @wait is set), -ENOENT for an unknown ticket and -EIO when the
+	   call failed. Guests use REMOTE_CALL_ASYNC (rdi = RemoteCallEntry,
+	   returns the ticket) and REMOTE_CALL_WAIT (rdi = ticket, rsi =
+	   result address, rdx = wait), with the same return values. */
+	void remote_enable_async(unsigned vcpus = 1, float timeout = 4.0f);
+	bool has_remote_async() const noexcept { return m_remote_async != nullptr; }
+	uint64_t remote_call_async(address_t func, const std::array<uint64_t, 4>& args = {});
+	long remote_async_result(uint64_t ticket, int64_t& result, bool wait);
+	size_t remote_async_pending() const noexcept { return m_remote_async_calls.size(); }
+	static constexpr unsigned REMOTE_CALL_ASYNC = 0x1F712;
+	static constexpr unsigned REMOTE_CALL_WAIT  = 0x1F713;
+	static constexpr uint32_t REMOTE_CALL_ASYNC_MAX = 64; // Pending per caller
+	void remote_call_async(vCPU&);
+	void remote_call_wait(vCPU&);
+	bool has_remote() const noexcept { return remote_ptr() != nullptr; }
 	bool is_remote_connected() const noexcept;
 	bool is_foreign_address(address_t addr) const noexcept;
 	uint32_t remote_connection_count() const noexcept { return m_remote_connections; }
 	const Machine& remote() const;
 	Machine& remote();
 
+	/* VM exits of the main vCPU, by reason */
+	const ExitCounters& exit_counters() const noexcept { return vcpu.exits; }
+	void reset_exit_counters() noexcept { vcpu.exits.reset(); }
+	/// @brief CPU time and exit counts of the main vCPU, since the machine
+	/// was created. Forks count their own. Cheap, and safe to call from
+	/// other threads while the machine runs, eg. to bill or throttle.
+	CpuStats cpu_stats() const { return vcpu.cpu_stats(); }
+
 	/* Profiling */
 	MachineProfiling* profiling() noexcept { return m_profiling.get(); }
 	const MachineProfiling* profiling() const noexcept { return m_profiling.get(); }
 	bool is_profiling() const noexcept { return m_profiling != nullptr; }
-	void set_profiling(bool enable) {
+	/// @brief Enable/disable profiling. With histograms enabled, samples
+	/// are timed with the TSC and counted in fixed-size histograms, which
+	/// is cheap enough to leave on in production.
+	void set_profiling(bool enable, bool histograms = false) {
 		if (enable && m_profiling == nullptr) {
+			if (histograms)
+				MachineProfiling::calibrate_tsc();
 			m_profiling.reset(new MachineProfiling);
+			m_profiling->use_histograms = histograms;
 		} else if (!enable) {
 			m_profiling.reset();
 		}
 	}
+	/// @brief Enable per-system-call counts, host time and histograms.
+	/// Enables profiling if needed. Scrape with profiling()->for_each_syscall().
+	void set_syscall_profiling(bool enable) {
+		if (enable) {
+			if (m_profiling == nullptr)
+				m_profiling.reset(new MachineProfiling);
+			m_profiling->enable_syscall_stats();
+		} else if (m_profiling != nullptr) {
+			m_profiling->syscalls.clear();
+		}
+	}
+
+	/// @brief Enable/disable the sampling profiler of guest code, which
+	/// records the guest call stack @frequency_hz times per second of
+	/// host CPU time. A lower rate means fewer extra VM exits.
+	/// Write out the results with sampling_profiler()->write_collapsed_stacks().
+	void set_sampling_profiler(bool enable,
+		unsigned frequency_hz = SamplingProfiler::DEFAULT_FREQUENCY,
+		unsigned max_depth = SamplingProfiler::DEFAULT_MAX_DEPTH)
+	{
+		if (enable)
+			m_sampler.reset(new SamplingProfiler(frequency_hz, max_depth));
+		else
+			m_sampler.reset();
+	}
+	SamplingProfiler* sampling_profiler() noexcept { return m_sampler.get(); }
+	const SamplingProfiler* sampling_profiler() const noexcept { return m_sampler.get(); }
+
+	/// @brief Enable/disable the binary trace of system calls, which keeps
+	/// the last @capacity system calls in a ring buffer. Unlike verbose
+	/// system calls it is cheap enough to leave on. Dump it with
+	/// syscall_trace()->dump(), or set syscall_trace()->dump_path to
+	/// dump it whenever the guest raises an exception.
+	void set_syscall_trace(bool enable,
+		size_t capacity = SyscallTrace::DEFAULT_CAPACITY)
+	{
+		if (enable)
+			m_syscall_trace.reset(new SyscallTrace(capacity));
+		else
+			m_syscall_trace.reset();
+	}
+	SyscallTrace* syscall_trace() noexcept { return m_syscall_trace.get(); }
+	const SyscallTrace* syscall_trace() const noexcept { return m_syscall_trace.get(); }
 
 	/// @brief Enable/disable verbose system calls. When enabled, every system call
 	/// will be printed to the console, in a trace-like format.
@@ -300,39 +702,89 @@ struct Machine
 	   start state area in memory. Any failure will throw an
 	   exception. The memory must have been pre-allocated. */
 	void save_snapshot_state_now(const std::vector<std::pair<uint64_t, uint64_t>>& populate_pages = {}) const;
+	/* Store the snapshot state, and write it along with every page
+	   that changed since the VM was loaded from its snapshot_file and
+	   snapshot_deltas into a delta snapshot file. The delta can then be
+	   stacked on top of the same snapshots with snapshot_deltas.
+	   Returns the number of pages in the delta. */
+	size_t save_snapshot_delta(const std::string& filename,
+		const std::vector<std::pair<uint64_t, uint64_t>>& populate_pages = {}) const;
+	/* Store the snapshot state, and write it along with all of memory
+	   to a packed snapshot file, which can be loaded with the
+	   snapshot_packed_file option. Identical pages are stored once,
+	   zero pages are left out, and the rest is compressed in blocks.
+	   Returns the size of the file. */
+	size_t save_packed_snapshot(const std::string& filename,
+		const std::vector<std::pair<uint64_t, uint64_t>>& populate_pages = {}) const;
+	/* Store the snapshot state in the memory file of a master made
+	   with memfd_main_memory, and seal it, so that machines in other
+	   processes can attach to it with the snapshot_memfd option. The
+	   master keeps running on private copies of its pages. Returns the
+	   memory file, which is owned by the master. */
+	int share_memory(const std::vector<std::pair<uint64_t, uint64_t>>& populate_pages = {});
+	/* Pass a shared memory file over a connected unix socket, and
+	   receive it on the other end. The received descriptor belongs
+	   to the caller. */
+	static void send_memory_fd(int socket, int memfd);
+	static int receive_memory_fd(int socket);
 	/* Check if the VM was loaded from a snapshot state. */
 	bool has_snapshot_state() const noexcept { return m_loaded_from_snapshot; }
+	/* The CPU features presented to the guest, see MachineOptions */
+	CPUBaseline cpu_baseline() const noexcept { return m_cpu_baseline; }
+	/* Whether machines on this host can use the given CPU baseline */
+	static bool cpu_baseline_supported(CPUBaseline);
 	/* Get pointer to user area in snapshot state memory, or nullptr
 	   if no snapshot state is present. */
 	void* get_snapshot_state_user_area() const;
+	/* Time spent prefaulting snapshot memory when loading, in seconds */
+	float snapshot_prefault_time() const noexcept { return m_snapshot_prefault_time; }
 
 	static void init();
 	static void setup_linux_system_calls(bool unsafe_syscalls = false);
 	Machine(const std::vector<uint8_t>& binary, const MachineOptions&);
 	Machine(std::string_view binary, const MachineOptions&);
 	Machine(std::span<const uint8_t> binary, const MachineOptions&);
+	/* Construct a new machine from a program that is already loaded,
+	   see ProgramImage. */
+	Machine(const ProgramImage&, const MachineOptions&);
 	Machine(const Machine& other, const MachineOptions&);
 	~Machine();
 
 private:
+	void profile_system_call(vCPU&, unsigned no);
+	void dispatch_system_call(vCPU&, unsigned no);
 	void setup_registers(tinykvm_x86regs &);
 	void setup_argv(__u64&, const std::vector<std::string>&, const std::vector<std::string>&);
 	void setup_linux(__u64&, const std::vector<std::string>&, const std::vector<std::string>&);
 	void elf_loader(std::string_view binary, const MachineOptions&);
-	void elf_load_ph(std::string_view binary, const MachineOptions&, const void*);
+	void elf_load_ph(std::string_view binary, const MachineOptions&, const void*, int binary_fd);
 	void dynamic_linking(std::string_view binary, const MachineOptions&);
 	bool relocate_section(const char* section_name, const char* sym_section);
 	void setup_long_mode(const MachineOptions&);
+	void vdso_sync_clock();
+	static uint64_t brk_size(const MachineOptions& options) noexcept {
+		const uint64_t size = options.brk_size != 0 ? options.brk_size : BRK_MAX;
+		return (size + vMemory::PageSize() - 1) & ~(vMemory::PageSize() - 1);
+	}
 	void setup_cow_mode(const Machine*); // After prepare_copy_on_write and forking
+	void rebase_to(const Machine&, const MachineOptions&); // reset_to() a new master
+	void makecow(uint64_t shared_memory_boundary); // prepare_copy_on_write
 	[[noreturn]] static void machine_exception(const char*, uint64_t = 0);
-	[[noreturn]] static void timeout_exception(const char*, uint32_t = 0);
+	[[noreturn]] static void timeout_exception(const char*, uint32_t = 0, uint64_t instructions = 0);
 	void smp_vcpu_broadcast(std::function<void(vCPU&)>);
-	address_t remote_activate_now();
+	address_t remote_activate_now(address_t entry = 0);
+	/* A concurrent remote has one caller per host thread */
+	Machine* remote_ptr() const noexcept { return LIKELY(m_remote_concurrency == nullptr) ? m_remote : t_remote_caller; }
+	void remote_set_caller(Machine* caller) noexcept;
+	VirtualMem& map_host_range(address_t virt, char* ptr, size_t size, int prot, bool shared, std::string name);
 	void remote_pfault_permanent_ipre(uint64_t return_stack, uint64_t return_address);
 	void remote_update_gigapage_mappings(Machine& other, bool forced = false);
+	void remote_session_run();
+	void remote_async_run(vCPU&, size_t idx);
 	/* Prepare for resume with a pagetable reload */
 	void prepare_vmresume(address_t fsbase = 0, bool reload_pagetables = true);
-	bool load_snapshot_state();
+	bool load_snapshot_state(const MachineOptions&);
+	bool load_snapshot_if_present(const MachineOptions&);
 
 	vCPU  vcpu;
 	int   fd = 0;
@@ -340,27 +792,45 @@ private:
 	bool  m_forked = false;
 	bool  m_just_reset = false;
 	bool  m_loaded_from_snapshot = false;
+	float m_snapshot_prefault_time = 0.0f;
 	bool  m_remote_pfaults = false;
 	bool  m_permanent_remote_connection = false;
 	bool  m_relocate_fixed_mmap = false;
+	bool  m_vdso = false;
+	address_t m_vdso_clock = 0; // The vvar page of the vDSO, once found
+	CPUBaseline m_cpu_baseline = CPUBaseline::Host;
 	bool  m_verbose_system_calls = false;
 	bool  m_verbose_mmap_syscalls = false;
 	bool  m_verbose_thread_syscalls = false;
+	bool  m_parallel_threads = false;
+	bool  m_io_suspend = false;
+	bool  m_makecow_incremental = false;
+	unsigned m_makecow_threads = 1;
+	/* The boundary of the last complete prepare_copy_on_write() */
+	uint64_t m_makecow_boundary = 0;
+	/* Pages the host wants the guest to hand back, see MEMORY_BALLOON */
+	size_t m_memory_pressure = 0;
 	void* m_userdata = nullptr;
 
 	std::string_view m_binary;
+	std::shared_ptr<const ProgramImage> m_program_image; // Owns m_binary, when cached
 
 	vMemory memory;  // guest memory
 
 	address_t m_image_base = 0x0;
 	address_t m_stack_address;
 	address_t m_heap_address;
+	address_t m_brk_begin_address = 0x0;
 	address_t m_brk_address;
 	address_t m_brk_end_address;
 	address_t m_start_address;
 	address_t m_kernel_end;
 
 	MMapCache m_mmap_cache;
+	IOWait m_io_wait;
+	std::shared_ptr<ThreadPool> m_file_read_pool;
+	std::unique_ptr<AsyncFileRead> m_async_read;
+	std::unique_ptr<OutputBuffer> m_output;
 	mutable std::unique_ptr<MultiThreading> m_mt;
 
 	mutable std::unique_ptr<SMP> m_smp;
@@ -369,11 +839,32 @@ private:
 
 	Machine* m_remote = nullptr;
 	uint32_t m_remote_connections = 0;
+	/* The version of the remote PDPT entries in our page tables */
+	uint64_t m_remote_pdpt_version = 0;
+	/* The TLS borrowed from a concurrent remote while connected */
+	uint64_t m_remote_tls_base = 0;
+	bool     m_remote_shared = false;
+	std::unique_ptr<RemoteConcurrency> m_remote_concurrency;
+	static thread_local Machine* t_remote_caller;
+	/* The state to return to when the remote session ends */
+	bool     m_remote_session = false;
+	bool     m_remote_session_stopped = false;
+	uint64_t m_remote_session_stack = 0;
+	tinykvm_x86regs m_remote_session_regs {};
+	std::unique_ptr<struct kvm_sregs> m_remote_session_sregs;
+	/* Asynchronous calls into this VM, and our own calls still pending */
+	std::unique_ptr<RemoteAsync> m_remote_async;
+	std::vector<std::pair<uint64_t, std::shared_ptr<RemoteAsyncResult>>> m_remote_async_calls;
+	uint64_t m_remote_async_tickets = 0;
 
 	std::unique_ptr<MachineProfiling> m_profiling = nullptr;
+	std::unique_ptr<SamplingProfiler> m_sampler = nullptr;
+	std::unique_ptr<SyscallTrace> m_syscall_trace = nullptr;
+	mutable std::shared_ptr<const SymbolIndex> m_symbol_index = nullptr;
 
 	/* How to print exceptions, register dumps etc. */
 	printer_func m_printer = m_default_printer;
+	const SyscallTable* m_syscall_table = nullptr;
 
 	static std::array<syscall_t, TINYKVM_MAX_SYSCALLS> m_syscalls;
 	static numbered_syscall_t m_unhandled_syscall;
@@ -383,10 +874,17 @@ private:
 	static printer_func       m_default_printer;
 	static mmap_func_t        m_mmap_func;
 
+	void create_vm_and_vcpu(const MachineOptions&);
 	static int create_kvm_vm();
 	static int kvm_fd;
-	static void* create_vcpu_timer();
+	/* @clock is a clockid_t, CLOCK_MONOTONIC by default,
+	   and @signo is the signal, SIGUSR2 by default */
+	static void* create_vcpu_timer(const void* owner = nullptr, int clock = 1, int signo = 12);
 	friend struct vCPU;
+	friend struct ProgramImage;
+	friend struct KvmPool;
+	friend struct Pipeline;
+	friend struct SamplingProfiler;
 };
 
 #include "machine_inline.hpp"
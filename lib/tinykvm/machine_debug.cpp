@@ -1,5 +1,6 @@
 #include "machine.hpp"
 
+#include "symbol_index.hpp"
 #include <cstring>
 #include <stdexcept>
 #include <unistd.h>
@@ -79,4 +80,91 @@ void Machine::print_remote_gdb_backtrace(
 	}
 }
 
+std::vector<Machine::address_t> Machine::backtrace_addresses(size_t max_frames) const
+{
+	static constexpr size_t SCAN_BYTES = 8192;
+	static constexpr uint64_t MAX_FRAME_SIZE = 1ULL << 20;
+	std::vector<address_t> frames;
+	if (max_frames == 0)
+		return frames;
+	/* After a CPU exception, start where the guest was interrupted */
+	auto regs = this->registers();
+	if (vcpu.exception_frame.rip != 0) {
+		regs.rip = vcpu.exception_frame.rip;
+		regs.rsp = vcpu.exception_frame.rsp;
+	}
+	frames.push_back(regs.rip);
+
+	const auto index = this->symbol_index();
+	if (index->error() != nullptr)
+		return frames;
+	/* A return address follows a call inside a known function */
+	auto is_return_address = [&] (uint64_t addr) {
+		if (addr <= m_image_base)
+			return false;
+		bool exact = false;
+		return index->function_at(addr - 1 - m_image_base, exact) != nullptr && exact;
+	};
+	/* Reads up to the end of the page. Faults end the walk. */
+	auto read_words = [this] (uint64_t addr, uint64_t* words, size_t count) -> size_t {
+		if (addr & 0x7)
+			return 0;
+		count = std::min(count, (vMemory::PageSize() - (addr & (vMemory::PageSize() - 1))) / 8);
+		try {
+			this->unsafe_copy_from_guest(words, addr, count * 8);
+		} catch (const std::exception&) {
+			return 0;
+		}
+		return count;
+	};
+
+	/* Frame pointers: [rbp] is the previous rbp, [rbp + 8] the return address */
+	uint64_t rbp = regs.rbp;
+	while (frames.size() < max_frames && rbp >= regs.rsp)
+	{
+		uint64_t frame[2];
+		if (read_words(rbp, frame, 2) != 2 || !is_return_address(frame[1]))
+			break;
+		frames.push_back(frame[1]);
+		if (frame[0] <= rbp || frame[0] - rbp > MAX_FRAME_SIZE)
+			break;
+		rbp = frame[0];
+	}
+	if (frames.size() > 1)
+		return frames;
+
+	/* Stack scanning */
+	uint64_t words[512];
+	const uint64_t scan_end = regs.rsp + SCAN_BYTES;
+	for (uint64_t sp = regs.rsp & ~0x7ULL; sp < scan_end && frames.size() < max_frames; )
+	{
+		const size_t count = read_words(sp, words,
+			std::min<size_t>(std::size(words), (scan_end - sp) / 8));
+		if (count == 0)
+			break;
+		for (size_t i = 0; i < count && frames.size() < max_frames; i++) {
+			if (is_return_address(words[i]))
+				frames.push_back(words[i]);
+		}
+		sp += count * 8;
+	}
+	return frames;
+}
+
+std::string Machine::backtrace(size_t max_frames) const
+{
+	std::string result;
+	const auto frames = this->backtrace_addresses(max_frames);
+	for (size_t i = 0; i < frames.size(); i++)
+	{
+		char buffer[64];
+		const int len = snprintf(buffer, sizeof(buffer), "#%zu 0x%lX in ", i, frames[i]);
+		result.append(buffer, len);
+		/* Return addresses are resolved to their call instruction */
+		result.append(this->resolve(i == 0 ? frames[i] : frames[i] - 1));
+		result.push_back('\n');
+	}
+	return result;
+}
+
 } // namespace tinykvm
@@ -2,11 +2,19 @@
 
 #include <cassert>
 #include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <set>
 #include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tuple>
+#include <unistd.h>
 #ifdef TINYKVM_ARCH_AMD64
 #include "amd64/idt.hpp" // interrupt_header()
 #include "amd64/paging.hpp"
 #endif
+#include "symbol_index.hpp"
 #include "util/elf.hpp"
 
 namespace tinykvm {
@@ -52,6 +60,34 @@ DynamicElf is_dynamic_elf(std::string_view binary)
 	}
 }
 
+/* Open MachineOptions::binary_file, when its segments can be mapped
+   into main memory. Returns -1 when they have to be copied instead. */
+static int open_binary_file(std::string_view binary, const MachineOptions& options)
+{
+	if (options.binary_file.empty() || options.hugepages
+		|| !options.snapshot_file.empty() || !options.snapshot_packed_file.empty()
+		|| options.memfd_main_memory || options.snapshot_memfd >= 0)
+		return -1;
+	const int fd = open(options.binary_file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	/* It should be the same file, which is cheap to check for */
+	struct stat st;
+	Elf64_Ehdr ehdr;
+	if (fstat(fd, &st) < 0 || size_t(st.st_size) != binary.size()
+		|| pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr)
+		|| memcmp(&ehdr, binary.data(), sizeof(ehdr)) != 0)
+	{
+		if (options.verbose_loader) {
+			printf("* Binary file %s does not match the binary, copying segments\n",
+				options.binary_file.c_str());
+		}
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
 void Machine::elf_loader(std::string_view binary, const MachineOptions& options)
 {
 	if (UNLIKELY(binary.size() < sizeof(Elf64_Ehdr))) {
@@ -95,6 +131,12 @@ void Machine::elf_loader(std::string_view binary, const MachineOptions& options)
 	this->m_heap_address = 0x0;
 	uint64_t image_begin = ~0UL;
 
+	const int binary_fd = open_binary_file(binary, options);
+	struct CloseFd {
+		int fd;
+		~CloseFd() { if (fd >= 0) close(fd); }
+	} close_binary_fd { binary_fd };
+
 	int seg = 0;
 	for (const auto* hdr = phdr; hdr < phdr + program_headers; hdr++)
 	{
@@ -123,7 +165,7 @@ void Machine::elf_loader(std::string_view binary, const MachineOptions& options)
 				if (seg > MAX_LOADABLE_SEGMENTS)
 					throw MachineException("Too many loadable segments");
 				// loadable program segments
-				this->elf_load_ph(binary, options, hdr);
+				this->elf_load_ph(binary, options, hdr, binary_fd);
 				break;
 			case PT_GNU_STACK:
 				//printf("GNU_STACK: 0x%lX\n", hdr->p_vaddr);
@@ -165,7 +207,8 @@ void Machine::elf_loader(std::string_view binary, const MachineOptions& options)
 	const uint32_t STACK_SIZE = (options.stack_size + PageMask()) & ~PageMask();
 	this->m_stack_address = this->m_heap_address + STACK_SIZE;
 	this->m_brk_address   = this->m_stack_address;
-	this->m_brk_end_address = this->m_stack_address + BRK_MAX;
+	this->m_brk_begin_address = this->m_brk_address;
+	this->m_brk_end_address = this->m_stack_address + brk_size(options);
 	this->m_brk_end_address = (this->m_brk_end_address + 0x1FFFFF) & ~0x1FFFFF; // 2MB align
 	this->m_heap_address = this->m_brk_end_address;
 
@@ -188,7 +231,7 @@ void Machine::elf_loader(std::string_view binary, const MachineOptions& options)
 	}
 }
 
-void Machine::elf_load_ph(std::string_view binary, const MachineOptions& options, const void* vphdr)
+void Machine::elf_load_ph(std::string_view binary, const MachineOptions& options, const void* vphdr, int binary_fd)
 {
 	const auto* hdr = (const Elf64_Phdr*) vphdr;
 
@@ -217,7 +260,29 @@ void Machine::elf_load_ph(std::string_view binary, const MachineOptions& options
 		throw MachineException("Bogus ELF segment virtual base", hdr->p_vaddr);
 	}
 	if (memory.safely_within(load_address, len)) {
-		std::memcpy(memory.at(load_address), src, len);
+		char* dst = memory.at(load_address);
+		/* The whole pages of read-only segments are mapped from the
+		   binary file, over main memory. Partial pages are copied. */
+		const uint64_t first = (load_address + PageMask()) & ~PageMask();
+		const uint64_t last  = (load_address + len) & ~PageMask();
+		const uint64_t file_offset = hdr->p_offset + (first - load_address);
+		if (binary_fd >= 0 && !(hdr->p_flags & PF_W) && first < last
+			&& (file_offset & PageMask()) == 0)
+		{
+			if (mmap(dst + (first - load_address), last - first, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_FIXED, binary_fd, file_offset) == MAP_FAILED) {
+				throw MachineException("Failed to map ELF segment from the binary file", load_address);
+			}
+			if (options.verbose_loader) {
+				printf("* Mapped %lu bytes of the segment from %s\n",
+					last - first, options.binary_file.c_str());
+			}
+			std::memcpy(dst, src, first - load_address);
+			std::memcpy(dst + (last - load_address), src + (last - load_address),
+				load_address + len - last);
+			return;
+		}
+		std::memcpy(dst, src, len);
 	} else {
 		if (options.verbose_loader) {
 			printf("Segment at %p is too large or not safely within physical base at %p. Size: %zu vs %p\n",
@@ -250,34 +315,29 @@ static const Elf64_Sym* elf_sym_index(std::string_view binary, const Elf64_Shdr*
 	auto* symtab = elf_offset<Elf64_Sym>(binary, shdr->sh_offset);
 	return &symtab[symidx];
 }
-static const Elf64_Sym* resolve_symbol(std::string_view binary, const char* name)
+std::shared_ptr<const SymbolIndex> Machine::symbol_index(std::string_view binary) const
 {
-	if (UNLIKELY(binary.empty())) return nullptr;
-	const auto* sym_hdr = section_by_name(binary, ".symtab");
-	if (UNLIKELY(sym_hdr == nullptr)) return nullptr;
-	const auto* str_hdr = section_by_name(binary, ".strtab");
-	if (UNLIKELY(str_hdr == nullptr)) return nullptr;
-
-	const auto* symtab = elf_sym_index(binary, sym_hdr, 0);
-	const size_t symtab_ents = sym_hdr->sh_size / sizeof(Elf64_Sym);
-	const char* strtab = elf_offset<char>(binary, str_hdr->sh_offset);
-
-	for (size_t i = 0; i < symtab_ents; i++)
-	{
-		const char* symname = &strtab[symtab[i].st_name];
-		if (strcmp(symname, name) == 0) {
-			return &symtab[i];
+	if (binary.empty() || (binary.data() == m_binary.data() && binary.size() == m_binary.size())) {
+		if (m_symbol_index == nullptr
+			|| m_symbol_index->binary().data() != m_binary.data()
+			|| m_symbol_index->binary().size() != m_binary.size())
+		{
+			m_symbol_index = SymbolIndex::get(m_binary);
 		}
+		return m_symbol_index;
 	}
-	return nullptr;
+	return SymbolIndex::get(binary);
 }
 
 uint64_t Machine::address_of(std::string_view name, std::string_view binary) const
 {
 	if (binary.empty())
 		binary = this->m_binary;
-	const auto* sym = resolve_symbol(binary, name.data());
-	return (sym) ? this->m_image_base + sym->st_value : 0x0;
+	if (UNLIKELY(binary.empty())) return 0x0;
+	uint64_t value = 0;
+	if (!symbol_index(binary)->lookup(name, value))
+		return 0x0;
+	return this->m_image_base + value;
 }
 uint64_t Machine::address_of(std::string_view name, const std::vector<uint8_t>& binary) const
 {
@@ -290,55 +350,60 @@ std::string Machine::resolve(uint64_t rip, std::string_view binary) const
 		binary = m_binary;
 
 	if (UNLIKELY(binary.empty())) return "(no binary)";
-	const auto* sym_hdr = section_by_name(binary, ".symtab");
-	if (UNLIKELY(sym_hdr == nullptr)) return "(no symbols)";
-	const auto* str_hdr = section_by_name(binary, ".strtab");
-	if (UNLIKELY(str_hdr == nullptr)) return "(no strings)";
+	const auto index = symbol_index(binary);
+	if (UNLIKELY(index->error() != nullptr)) return index->error();
 
 	if (UNLIKELY(rip < this->m_image_base)) return "(error: rip < image base)";
 	const address_t relative_rip = rip - this->m_image_base;
 
-	const auto* symtab = elf_sym_index(binary, sym_hdr, 0);
-	const size_t symtab_ents = sym_hdr->sh_size / sizeof(Elf64_Sym);
-	const char* strtab = elf_offset<char>(binary, str_hdr->sh_offset);
+	/// If we don't find a direct match, return the closest one
+	bool exact = false;
+	const auto* func = index->function_at(relative_rip, exact);
+	if (func == nullptr)
+		return "(unknown)";
 
 	char result[2048];
-	uint64_t second_best_address = ~0ULL;
-	const Elf64_Sym* second_best = nullptr;
-	for (size_t i = 0; i < symtab_ents; i++)
-	{
-		/* Only look at functions (for now). Old-style symbols have no FUNC. */
-		if (symtab[i].st_info & STT_FUNC) {
-			/* Direct matches only (for now) */
-			if (relative_rip >= symtab[i].st_value && relative_rip < symtab[i].st_value + symtab[i].st_size)
-			{
-				const uint64_t offset = relative_rip - symtab[i].st_value;
-				int len = snprintf(result, sizeof(result),
-					"%s + 0x%lX", &strtab[symtab[i].st_name], offset);
-				if (len > 0)
-					return std::string(result, len);
-				else
-					return std::string(&strtab[symtab[i].st_name]);
-			}
-			else if (relative_rip >= symtab[i].st_value && second_best_address > symtab[i].st_value)
-			{
-				// We found a better match, but not exact
-				second_best_address = symtab[i].st_value;
-				second_best = &symtab[i];
-			}
-		}
+	const int len = snprintf(result, sizeof(result),
+		"%.*s + 0x%lX", int(func->name.size()), func->name.data(),
+		relative_rip - func->address);
+	if (len > 0)
+		return std::string(result, std::min<size_t>(len, sizeof(result) - 1));
+	else
+		return std::string(func->name);
+}
+
+size_t Machine::write_perf_map(const std::string& path) const
+{
+	static std::mutex perf_map_mtx;
+	/* (file, image base, hash of the binary) already written */
+	static std::set<std::tuple<std::string, uint64_t, size_t>> perf_map_written;
+
+	if (m_binary.empty())
+		return 0;
+	const std::string filename = !path.empty() ? path
+		: "/tmp/perf-" + std::to_string(getpid()) + ".map";
+	const size_t hash = std::hash<std::string_view>{}(m_binary);
+	const auto index = this->symbol_index();
+
+	std::scoped_lock lock(perf_map_mtx);
+	if (!perf_map_written.emplace(filename, m_image_base, hash).second)
+		return 0;
+	FILE* file = fopen(filename.c_str(), "a");
+	if (file == nullptr) {
+		perf_map_written.erase({filename, m_image_base, hash});
+		throw MachineException("Failed to open perf map file", errno);
+	}
+	/* START SIZE symbolname, in hex without 0x */
+	size_t written = 0;
+	for (const auto& func : index->function_table()) {
+		if (func.size == 0 || func.name.empty())
+			continue;
+		fprintf(file, "%lx %lx %.*s\n", m_image_base + func.address, func.size,
+			int(func.name.size()), func.name.data());
+		written++;
 	}
-	/// If we didn't find a direct match, return the closest one
-	if (second_best != nullptr) {
-		int len = snprintf(result, sizeof(result),
-			"%s + 0x%lX", &strtab[second_best->st_name],
-			relative_rip - second_best->st_value);
-		if (len > 0)
-			return std::string(result, len);
-		else
-			return std::string(&strtab[second_best->st_name]);
-	}
-	return "(unknown)";
+	fclose(file);
+	return written;
 }
 
 bool Machine::relocate_section(const char* section_name, const char* sym_section)
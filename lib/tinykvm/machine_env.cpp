@@ -6,6 +6,9 @@
 #include <random>
 #include <sys/auxv.h>
 #include "util/elf.hpp"
+#ifdef TINYKVM_ARCH_AMD64
+#include "amd64/vdso.hpp"
+#endif
 
 namespace tinykvm {
 using address_t = Machine::address_t;
@@ -171,6 +174,11 @@ void Machine::setup_linux(__u64& rsp,
 
 	// Canary / randomness
 	push_aux(argv, {AT_RANDOM, canary_addr});
+#ifdef TINYKVM_ARCH_AMD64
+	if (this->m_vdso) {
+		push_aux(argv, {AT_SYSINFO_EHDR, VDSO_AREA});
+	}
+#endif
 	push_aux(argv, {AT_NULL, 0});
 
 	// from this point on the stack is starting, pointing @ argc
@@ -14,12 +14,73 @@ inline void Machine::stop(bool s)
 
 inline void Machine::system_call(vCPU& cpu, unsigned idx)
 {
+	/* With parallel guest threads, system calls are serialized,
+	   except those that block or that serialize themselves:
+	   sched_yield, futex, clock_nanosleep and batches. Host calls
+	   that can block, like read(), release the serializer while
+	   blocking, see BlockingCall. */
+	std::unique_lock<std::mutex> serializer;
+	if (UNLIKELY(m_parallel_threads) && idx != SYS_sched_yield && idx != SYS_futex
+		&& idx != SYS_clock_nanosleep && idx != SYSCALL_BATCH)
+	{
+		serializer = std::unique_lock<std::mutex>(memory.mtx_smp);
+	}
+	/* Blocking host calls release it, see BlockingCall */
+	struct SerializerScope {
+		vCPU& cpu;
+		SerializerScope(vCPU& c, std::unique_lock<std::mutex>& s) : cpu(c) { cpu.serializer = &s; }
+		~SerializerScope() { cpu.serializer = nullptr; }
+	} scope { cpu, serializer };
+	if (UNLIKELY(m_syscall_trace != nullptr)) {
+		auto& rec = m_syscall_trace->begin(cpu.cpu_id, idx, cpu.registers());
+		const uint64_t seq = rec.seq;
+		this->profile_system_call(cpu, idx);
+		m_syscall_trace->end(rec, seq, cpu.registers().rax);
+		return;
+	}
+	this->profile_system_call(cpu, idx);
+}
+
+inline void Machine::profile_system_call(vCPU& cpu, unsigned idx)
+{
+	if (UNLIKELY(m_profiling != nullptr && m_profiling->has_syscall_stats())) {
+		const uint64_t t0 = MachineProfiling::tsc();
+		this->dispatch_system_call(cpu, idx);
+		const uint64_t t1 = MachineProfiling::tsc();
+		m_profiling->record_syscall(idx, MachineProfiling::tsc_to_ns(t1 - t0));
+		return;
+	}
+	this->dispatch_system_call(cpu, idx);
+}
+
+inline void Machine::dispatch_system_call(vCPU& cpu, unsigned idx)
+{
+	const auto* table = m_syscall_table;
 	if (idx < m_syscalls.size()) {
-		const auto handler = m_syscalls[idx];
+		const auto handler = (table == nullptr) ? m_syscalls[idx] : table->handlers[idx];
 		if (handler != nullptr) {
 			handler(cpu);
 			return;
 		}
+	} else if (idx == SYSCALL_BATCH) {
+		this->system_call_batch(cpu);
+		return;
+	} else if (idx == REMOTE_CALL_BATCH) {
+		this->remote_call_batch(cpu);
+		return;
+	} else if (idx == REMOTE_CALL_ASYNC) {
+		this->remote_call_async(cpu);
+		return;
+	} else if (idx == REMOTE_CALL_WAIT) {
+		this->remote_call_wait(cpu);
+		return;
+	} else if (idx == MEMORY_BALLOON) {
+		this->memory_balloon(cpu);
+		return;
+	}
+	if (UNLIKELY(table != nullptr && table->unhandled != nullptr)) {
+		table->unhandled(cpu, idx);
+		return;
 	}
 	m_unhandled_syscall(cpu, idx);
 }
@@ -64,34 +125,47 @@ void Machine::setup_call(tinykvm_x86regs& regs,
 	}
 	regs.rsp = rsp;
 	[[maybe_unused]] unsigned iargs = 0;
+	[[maybe_unused]] auto next_reg = [&iargs, &regs] () -> unsigned long long& {
+		switch (iargs++) {
+		case 0: return regs.rdi;
+		case 1: return regs.rsi;
+		case 2: return regs.rdx;
+		case 3: return regs.rcx;
+		case 4: return regs.r8;
+		case 5: return regs.r9;
+		}
+		throw MachineException("Too many vmcall arguments");
+	};
+	/* Everything that is not passed in a register is copied onto the
+	   guest stack, below the new stack pointer, and passed by address.
+	   There are no host allocations, and the stack is reused by every
+	   call. */
 	([&] {
-		auto& reg = [iargs, &regs] () mutable -> unsigned long long& {
-			if (iargs == 0)
-				return regs.rdi;
-			else if (iargs == 1)
-				return regs.rsi;
-			else if (iargs == 2)
-				return regs.rdx;
-			else if (iargs == 3)
-				return regs.rcx;
-			else if (iargs == 4)
-				return regs.r8;
-			else if (iargs == 5)
-				return regs.r9;
-			throw MachineException("Too many vmcall arguments");
-		}();
-		if constexpr (std::is_integral_v<std::remove_cvref_t<Args>>) {
-			reg = args;
-			iargs ++;
-		} else if constexpr (is_stdstring<Args>::value) {
-			reg = stack_push(regs.rsp, args.c_str(), args.size()+1);
-			iargs ++;
-		} else if constexpr (is_string<Args>::value) {
-			reg = stack_push_cstr(regs.rsp, args);
-			iargs ++;
-		} else if constexpr (std::is_pod_v<std::remove_reference<Args>>) {
-			reg = stack_push(regs.rsp, args);
-			iargs ++;
+		using T = std::remove_cvref_t<Args>;
+		if constexpr (std::is_integral_v<T> || std::is_enum_v<T>) {
+			next_reg() = args;
+		} else if constexpr (is_stdstring<T>::value) {
+			next_reg() = stack_push(regs.rsp, args.c_str(), args.size()+1);
+		} else if constexpr (is_string<T>::value) {
+			next_reg() = stack_push_cstr(regs.rsp, args);
+		} else if constexpr (std::is_same_v<T, std::string_view>) {
+			/* (const char*, size_t), and zero-terminated */
+			next_reg() = stack_push_view(regs.rsp, args);
+			next_reg() = args.size();
+		} else if constexpr (is_span<T>::value) {
+			/* (const T*, size_t) with the number of elements */
+			static_assert(std::is_trivially_copyable_v<typename T::element_type>,
+				"vmcall span elements must be trivially copyable");
+			next_reg() = stack_push(regs.rsp, args.data(), args.size_bytes());
+			next_reg() = args.size();
+		} else if constexpr (std::is_pointer_v<T>) {
+			/* A copy of the pointed-to struct, passed by address */
+			static_assert(std::is_trivially_copyable_v<std::remove_pointer_t<T>>,
+				"vmcall pointer arguments must point to trivially copyable types");
+			next_reg() = stack_push(regs.rsp, args, sizeof(*args));
+		} else if constexpr (std::is_trivially_copyable_v<T>) {
+			/* A copy of the struct, passed by address */
+			next_reg() = stack_push(regs.rsp, &args, sizeof(T));
 		} else {
 			static_assert(always_false<decltype(args)>, "Unknown vmcall argument type");
 		}
@@ -187,6 +261,18 @@ void Machine::timed_vmcall_stack(uint64_t addr, uint64_t stk, float timeout, Arg
 	this->run(timeout);
 }
 
+template <typename... Args> inline
+long Machine::remote_session_call(address_t addr, Args&&... args)
+{
+	if (UNLIKELY(!m_remote_session))
+		throw MachineException("No remote session. Did you call 'remote_session_begin()'?");
+	auto& regs = vcpu.registers();
+	this->setup_call(regs, addr, m_remote_session_stack, std::forward<Args> (args)...);
+	vcpu.set_registers(regs);
+	this->remote_session_run();
+	return this->return_value();
+}
+
 inline uint64_t Machine::stack_push(__u64& sp, const std::string& string)
 {
 	return stack_push(sp, string.data(), string.size()+1); /* zero */
@@ -222,5 +308,6 @@ inline bool Machine::memory_safe_at(uint64_t a, size_t s) const
 
 inline Signals& Machine::signals() {
 	if (m_signals == nullptr) m_signals.reset(new Signals);
+	m_signals->modified();
 	return *m_signals;
 }
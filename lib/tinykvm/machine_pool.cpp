@@ -0,0 +1,209 @@
+#include "machine_pool.hpp"
+
+#include <cstdio>
+#include <ctime>
+#include <unistd.h>
+
+namespace tinykvm {
+static constexpr bool VERBOSE_POOL = false;
+
+static uint64_t pool_time_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1'000'000'000ULL + uint64_t(ts.tv_nsec);
+}
+
+MachinePool::MachinePool(const Machine& master, const MachineOptions& options,
+		size_t num_vms, size_t reset_workers)
+	: m_master(master), m_options(options),
+	  m_workers(std::max(reset_workers, size_t(1)), 0, false)
+{
+	if (!master.is_forkable()) {
+		throw MachineException("MachinePool: master VM is not forkable");
+	}
+	/* Releasing must never block on a full queue. */
+	m_workers.set_queue_size_limit(num_vms);
+
+	const pid_t tid = gettid();
+	m_slots.resize(num_vms);
+	m_ready.reserve(num_vms);
+	for (auto& slot : m_slots) {
+		slot.vm.reset(new Machine{master, options});
+		slot.owner = tid;
+		m_lookup.emplace(slot.vm.get(), &slot);
+		m_ready.push_back(&slot);
+	}
+	m_stats.ready = m_ready.size();
+	m_live = num_vms;
+}
+
+MachinePool::~MachinePool()
+{
+	this->wait_for_resets();
+}
+
+MachinePool::Slot& MachinePool::slot_of(Machine& vm)
+{
+	auto it = m_lookup.find(&vm);
+	if (UNLIKELY(it == m_lookup.end())) {
+		throw MachineException("MachinePool: VM does not belong to this pool");
+	}
+	return *it->second;
+}
+
+Machine& MachinePool::hand_out(Slot& slot)
+{
+	/* The execution timeout timer is bound to the thread
+	   that created it. Only re-create it when necessary. */
+	const pid_t tid = gettid();
+	if (slot.owner != tid) {
+		slot.vm->migrate_to_this_thread();
+		slot.owner = tid;
+	}
+	return *slot.vm;
+}
+
+Machine& MachinePool::acquire()
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	if (UNLIKELY(m_ready.empty())) {
+		m_stats.acquire_waits++;
+		m_ready_cond.wait(lock, [this] { return !m_ready.empty() || m_live == 0; });
+		if (UNLIKELY(m_ready.empty())) {
+			throw MachineException("MachinePool: every VM in the pool has been lost");
+		}
+	}
+	Slot* slot = m_ready.back();
+	m_ready.pop_back();
+	slot->acquired = true;
+	m_stats.acquired++;
+	m_stats.ready = m_ready.size();
+	lock.unlock();
+	return hand_out(*slot);
+}
+
+Machine* MachinePool::try_acquire()
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	if (m_ready.empty())
+		return nullptr;
+	Slot* slot = m_ready.back();
+	m_ready.pop_back();
+	slot->acquired = true;
+	m_stats.acquired++;
+	m_stats.ready = m_ready.size();
+	lock.unlock();
+	return &hand_out(*slot);
+}
+
+void MachinePool::release(Machine& vm)
+{
+	Slot* slot = nullptr;
+	{
+		std::scoped_lock lock(m_mtx);
+		slot = &slot_of(vm);
+		if (UNLIKELY(!slot->acquired)) {
+			throw MachineException("MachinePool: VM was released twice");
+		}
+		slot->acquired = false;
+		slot->released_ns = pool_time_ns();
+		m_stats.acquired--;
+		m_resetting++;
+		m_stats.resetting = m_resetting;
+	}
+	m_workers.enqueue([this, slot] {
+		this->reset_slot(*slot);
+	});
+}
+
+void MachinePool::reset_slot(Slot& slot)
+{
+	/* The reset is over even when re-forking fails below,
+	   or wait_for_resets() and the destructor would hang. */
+	struct ResetDone {
+		MachinePool& pool;
+		~ResetDone() {
+			std::scoped_lock lock(pool.m_mtx);
+			pool.m_resetting--;
+			pool.m_stats.resetting = pool.m_resetting;
+			if (pool.m_resetting == 0)
+				pool.m_idle_cond.notify_all();
+		}
+	} done { *this };
+	const uint64_t t0 = pool_time_ns();
+	bool full_reset = false;
+	bool failed = false;
+	try {
+		full_reset = slot.vm->reset_to(m_master, m_options);
+	} catch (const std::exception& e) {
+		if constexpr (VERBOSE_POOL) {
+			fprintf(stderr, "MachinePool: reset failed (%s), re-forking\n", e.what());
+		}
+		failed = true;
+	}
+	/* A VM that cannot be reset is replaced by a new fork, which
+	   is built outside of the lock. If that fails too, the slot
+	   is dead and the pool shrinks. */
+	std::unique_ptr<Machine> replaced;
+	std::unique_ptr<Machine> fork;
+	if (failed) {
+		try {
+			fork.reset(new Machine{m_master, m_options});
+		} catch (const std::exception& e) {
+			if constexpr (VERBOSE_POOL) {
+				fprintf(stderr, "MachinePool: re-forking failed (%s)\n", e.what());
+			}
+		}
+	}
+	const uint64_t t1 = pool_time_ns();
+
+	std::scoped_lock lock(m_mtx);
+	if (failed) {
+		m_lookup.erase(slot.vm.get());
+		replaced = std::move(slot.vm);
+		if (fork == nullptr) {
+			m_live--;
+			m_stats.failed_resets++;
+			m_stats.lost++;
+			/* Waiters fail instead of hanging when nothing is left */
+			if (m_live == 0)
+				m_ready_cond.notify_all();
+			return;
+		}
+		slot.vm = std::move(fork);
+		slot.owner = gettid();
+		m_lookup.emplace(slot.vm.get(), &slot);
+	}
+	const uint64_t lag = t1 - slot.released_ns;
+	m_stats.resets++;
+	m_stats.full_resets += full_reset;
+	m_stats.failed_resets += failed;
+	m_stats.reset_time_total_ns += t1 - t0;
+	m_stats.reset_lag_total_ns += lag;
+	m_stats.reset_lag_max_ns = std::max(m_stats.reset_lag_max_ns, lag);
+
+	m_ready.push_back(&slot);
+	m_stats.ready = m_ready.size();
+	m_ready_cond.notify_one();
+}
+
+void MachinePool::wait_for_resets()
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	m_idle_cond.wait(lock, [this] { return m_resetting == 0; });
+}
+
+size_t MachinePool::depth() const
+{
+	std::scoped_lock lock(m_mtx);
+	return m_ready.size();
+}
+
+MachinePool::Stats MachinePool::stats() const
+{
+	std::scoped_lock lock(m_mtx);
+	return m_stats;
+}
+
+} // tinykvm
@@ -0,0 +1,97 @@
+#pragma once
+#include "machine.hpp"
+#include <condition_variable>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "util/threadpool.h"
+
+namespace tinykvm
+{
+	/// @brief A pool of forked VMs that are reset ahead of time.
+	/// Finished VMs are handed back with release(), after which a
+	/// background worker resets them to the master. acquire() then
+	/// hands out an already reset VM without doing any work on the
+	/// request thread, apart from migrating the execution timer.
+	/// The master must remain alive and unchanged while the pool
+	/// is in use.
+	struct MachinePool {
+		struct Stats {
+			size_t   ready = 0;        // VMs ready to be acquired
+			size_t   resetting = 0;    // VMs queued or being reset
+			size_t   acquired = 0;     // VMs currently handed out
+			uint64_t resets = 0;       // Completed resets
+			uint64_t full_resets = 0;  // Resets that required a full reset
+			uint64_t failed_resets = 0;// Resets that threw and re-forked
+			uint64_t lost = 0;         // VMs that could not be re-forked
+			uint64_t acquire_waits = 0;// acquire() calls that had to block
+			uint64_t reset_lag_total_ns = 0; // Sum of release -> ready times
+			uint64_t reset_lag_max_ns = 0;
+			uint64_t reset_time_total_ns = 0; // Sum of time spent in reset_to()
+			uint64_t reset_lag_avg_ns() const noexcept {
+				return resets ? reset_lag_total_ns / resets : 0;
+			}
+		};
+
+		/// @brief Fork @num_vms VMs from @master and start @reset_workers
+		/// background threads that reset released VMs.
+		/// @param master A forkable master VM (prepare_copy_on_write)
+		/// @param options Options used for forking and for reset_to()
+		/// @param num_vms The number of forks to create
+		/// @param reset_workers The number of background reset threads
+		MachinePool(const Machine& master, const MachineOptions& options,
+			size_t num_vms, size_t reset_workers = 1);
+		~MachinePool();
+
+		/// @brief Acquire a ready VM, blocking until one is available.
+		/// Throws when every VM has been lost to failed re-forks.
+		/// @return A reset VM, owned by the pool.
+		Machine& acquire();
+
+		/// @brief Acquire a ready VM, if one is available.
+		/// @return A reset VM, or nullptr when none are ready.
+		Machine* try_acquire();
+
+		/// @brief Hand a VM back to the pool. It will be reset in the
+		/// background and become available to acquire() afterwards.
+		/// @param vm A VM previously returned from acquire()
+		void release(Machine& vm);
+
+		/// @brief Wait until every released VM has been reset.
+		void wait_for_resets();
+
+		/// @return The number of VMs ready to be acquired.
+		size_t depth() const;
+		/// @return The number of VMs the pool was created with,
+		/// including those lost to failed re-forks (Stats::lost).
+		size_t size() const noexcept { return m_slots.size(); }
+		Stats stats() const;
+
+		const Machine& master() const noexcept { return m_master; }
+
+	private:
+		struct Slot {
+			std::unique_ptr<Machine> vm;
+			pid_t    owner = 0;       // Thread that owns the vCPU timer
+			uint64_t released_ns = 0; // When the VM was handed back
+			bool     acquired = false;
+		};
+		Slot& slot_of(Machine&);
+		Machine& hand_out(Slot&);
+		void reset_slot(Slot&);
+
+		const Machine& m_master;
+		const MachineOptions m_options;
+		std::vector<Slot> m_slots;
+		std::unordered_map<const Machine*, Slot*> m_lookup;
+		std::vector<Slot*> m_ready;
+		size_t m_resetting = 0;
+		size_t m_live = 0; // Slots that have not been lost
+		Stats m_stats;
+
+		mutable std::mutex m_mtx;
+		std::condition_variable m_ready_cond;
+		std::condition_variable m_idle_cond;
+		ThreadPool m_workers;
+	};
+}
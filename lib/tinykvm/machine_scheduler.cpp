@@ -0,0 +1,154 @@
+#include "machine_scheduler.hpp"
+
+#include <cstdio>
+#include <ctime>
+#include <unistd.h>
+
+namespace tinykvm {
+static constexpr bool VERBOSE_SCHEDULER = false;
+
+static uint64_t scheduler_time_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1'000'000'000ULL + uint64_t(ts.tv_nsec);
+}
+
+MachineScheduler::MachineScheduler(const Options& options)
+	: m_options(options)
+{
+	const size_t threads = std::max(options.threads, size_t(1));
+	m_threads.reserve(threads);
+	for (size_t i = 0; i < threads; i++) {
+		m_threads.emplace_back([this] { this->worker(); });
+	}
+}
+
+MachineScheduler::~MachineScheduler()
+{
+	this->wait_idle();
+	{
+		std::scoped_lock lock(m_mtx);
+		m_stop = true;
+	}
+	m_ready_cond.notify_all();
+	for (auto& thread : m_threads)
+		thread.join();
+}
+
+void MachineScheduler::submit(Call call)
+{
+	if (UNLIKELY(call.vm == nullptr || !call.setup)) {
+		throw MachineException("MachineScheduler: Call needs a VM and a setup function");
+	}
+	auto task = std::make_unique<Task>();
+	task->call = std::move(call);
+
+	std::scoped_lock lock(m_mtx);
+	m_active++;
+	this->enqueue(std::move(task));
+}
+
+void MachineScheduler::enqueue(std::unique_ptr<Task> task)
+{
+	/* Must be called with the lock held */
+	const auto& call = task->call;
+	const uint64_t tenant_ns = m_tenants[call.tenant].cpu_ns;
+	m_ready.emplace(Key{-call.priority, tenant_ns, m_sequence++}, std::move(task));
+	m_ready_cond.notify_one();
+}
+
+bool MachineScheduler::run_slice(Task& task, std::exception_ptr& error)
+{
+	Machine& vm = *task.call.vm;
+	/* The execution timer is bound to the thread that created it */
+	const pid_t tid = gettid();
+	if (task.owner != tid) {
+		vm.migrate_to_this_thread();
+		task.owner = tid;
+	}
+	try {
+		if (!task.started) {
+			task.call.setup(vm);
+			task.started = true;
+		}
+		return vm.run_timeslice(m_options.time_slice);
+	} catch (...) {
+		error = std::current_exception();
+		return true;
+	}
+}
+
+void MachineScheduler::worker()
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	while (true) {
+		m_ready_cond.wait(lock, [this] { return m_stop || !m_ready.empty(); });
+		if (m_ready.empty())
+			return;
+		auto task = std::move(m_ready.begin()->second);
+		m_ready.erase(m_ready.begin());
+		lock.unlock();
+
+		std::exception_ptr error;
+		const uint64_t t0 = scheduler_time_ns();
+		bool finished = this->run_slice(*task, error);
+		const uint64_t elapsed = scheduler_time_ns() - t0;
+		task->cpu_ns += elapsed;
+
+		const float limit = task->call.cpu_limit;
+		if (!finished && limit > 0.f && task->cpu_ns >= uint64_t(limit * 1e9)) {
+			finished = true;
+			error = std::make_exception_ptr(MachineTimeoutException(
+				"MachineScheduler: CPU time limit exceeded", uint32_t(limit * 1000)));
+		}
+
+		lock.lock();
+		auto& tenant = m_tenants[task->call.tenant];
+		tenant.cpu_ns += elapsed;
+		tenant.slices++;
+		if (!finished) {
+			tenant.preemptions++;
+			this->enqueue(std::move(task));
+			continue;
+		}
+		tenant.calls++;
+		lock.unlock();
+
+		if (task->call.done) {
+			try {
+				task->call.done(*task->call.vm, error);
+			} catch (const std::exception& e) {
+				if constexpr (VERBOSE_SCHEDULER) {
+					fprintf(stderr, "MachineScheduler: done callback threw: %s\n", e.what());
+				}
+			}
+		}
+		task.reset();
+
+		lock.lock();
+		if (--m_active == 0)
+			m_idle_cond.notify_all();
+	}
+}
+
+void MachineScheduler::wait_idle()
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	m_idle_cond.wait(lock, [this] { return m_active == 0; });
+}
+
+size_t MachineScheduler::active() const
+{
+	std::scoped_lock lock(m_mtx);
+	return m_active;
+}
+
+MachineScheduler::TenantStats MachineScheduler::tenant_stats(uint32_t tenant) const
+{
+	std::scoped_lock lock(m_mtx);
+	auto it = m_tenants.find(tenant);
+	return (it != m_tenants.end()) ? it->second : TenantStats{};
+}
+
+} // tinykvm
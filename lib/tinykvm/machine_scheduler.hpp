@@ -0,0 +1,104 @@
+#pragma once
+#include "machine.hpp"
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+namespace tinykvm
+{
+	/// @brief Runs calls into many VMs over a few host threads, one time
+	/// slice at a time. When a slice expires the VM is paused, instead of
+	/// timing out, and queued again. The next call to run is the one with
+	/// the highest priority, and then the one whose tenant has used the
+	/// least CPU time, so that short requests are not stuck behind heavy
+	/// tenants. A VM must only have one call submitted at a time.
+	struct MachineScheduler {
+		struct Options {
+			size_t threads = 1;         // Host worker threads
+			float  time_slice = 0.002f; // Seconds per run of a VM
+		};
+		struct TenantStats {
+			uint64_t cpu_ns = 0;      // Time spent running the tenant's VMs
+			uint64_t slices = 0;      // Time slices run
+			uint64_t preemptions = 0; // Slices that expired
+			uint64_t calls = 0;       // Completed calls
+		};
+		using setup_t = std::function<void(Machine&)>;
+		using done_t = std::function<void(Machine&, std::exception_ptr)>;
+		struct Call {
+			Machine* vm = nullptr;
+			/* Prepares the registers for the call, on a worker thread,
+			   without running the VM. Eg. using Machine::setup_call(). */
+			setup_t  setup;
+			/* Called on a worker thread once the call has completed. The
+			   exception is set when the call failed, or ran out of time. */
+			done_t   done;
+			uint32_t tenant = 0;
+			int      priority = 0;   // Higher priorities run first
+			float    cpu_limit = 0.f;// Seconds of CPU time, 0 is no limit
+		};
+
+		MachineScheduler(const Options&);
+		~MachineScheduler();
+
+		/// @brief Queue a call. It is started on the next free worker.
+		void submit(Call call);
+		/// @brief Queue a SYSV function call into @vm, with arguments.
+		template <typename... Args>
+		void submit_vmcall(Machine& vm, Machine::address_t func, uint32_t tenant,
+			int priority, done_t done, Args... args);
+
+		/// @brief Wait until every submitted call has completed.
+		void wait_idle();
+		/// @return The calls that are queued or running.
+		size_t active() const;
+		TenantStats tenant_stats(uint32_t tenant) const;
+
+	private:
+		struct Task {
+			Call     call;
+			bool     started = false;
+			pid_t    owner = 0;  // Thread that owns the vCPU timer
+			uint64_t cpu_ns = 0;
+		};
+		/* Priority (highest first), tenant CPU time, then FIFO */
+		using Key = std::tuple<int, uint64_t, uint64_t>;
+		void enqueue(std::unique_ptr<Task>);
+		void worker();
+		bool run_slice(Task&, std::exception_ptr&);
+
+		const Options m_options;
+		std::multimap<Key, std::unique_ptr<Task>> m_ready;
+		std::unordered_map<uint32_t, TenantStats> m_tenants;
+		uint64_t m_sequence = 0;
+		size_t   m_active = 0;
+		bool     m_stop = false;
+
+		mutable std::mutex m_mtx;
+		std::condition_variable m_ready_cond;
+		std::condition_variable m_idle_cond;
+		std::vector<std::thread> m_threads;
+	};
+
+	template <typename... Args> inline
+	void MachineScheduler::submit_vmcall(Machine& vm, Machine::address_t func,
+		uint32_t tenant, int priority, done_t done, Args... args)
+	{
+		this->submit(Call{
+			.vm = &vm,
+			.setup = [func, args...] (Machine& m) {
+				auto& regs = m.registers();
+				m.setup_call(regs, func, m.stack_address(), args...);
+				m.set_registers(regs);
+			},
+			.done = std::move(done),
+			.tenant = tenant,
+			.priority = priority,
+		});
+	}
+}
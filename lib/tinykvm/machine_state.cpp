@@ -1,5 +1,7 @@
 #include "machine.hpp"
 
+#include <atomic>
+#include <chrono>
 #include <cstring>
 #include <fcntl.h>
 #include <linux/kvm.h>
@@ -7,6 +9,7 @@
 #include <span>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <thread>
 #include <unistd.h>
 #ifdef TINYKVM_ARCH_AMD64
 #include "amd64/amd64.hpp"
@@ -14,6 +17,11 @@
 #endif
 #include "linux/fds.hpp"
 #include "linux/threads.hpp"
+#include "snapshot_restore.hpp"
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
 
 namespace tinykvm {
 
@@ -60,9 +68,14 @@ struct ColdStartSocketPair {
 };
 
 struct SnapshotState {
-	static constexpr uint32_t MAGIC = 0x564D4353; // 'VMCS'
+	static constexpr uint32_t MAGIC = 0x564D4354; // 'VMCT'
 	uint32_t magic;
 	uint32_t size;
+	/* The CPU features the guest has seen. With the Host baseline,
+	   the hash of the host CPUID tells if the snapshot was made
+	   on another kind of host. */
+	CPUBaseline cpu_baseline;
+	uint64_t host_cpu_features;
 	tinykvm_x86regs    regs;
 	kvm_sregs          sregs;
 	tinykvm_x86fpuregs fpu;
@@ -74,6 +87,7 @@ struct SnapshotState {
 	Machine::address_t m_image_base;
 	Machine::address_t m_stack_address;
 	Machine::address_t m_heap_address;
+	Machine::address_t m_brk_begin_address;
 	Machine::address_t m_brk_address;
 	Machine::address_t m_brk_end_address;
 	Machine::address_t m_start_address;
@@ -100,7 +114,43 @@ struct SnapshotState {
 		return ret;
 	}
 };
-bool Machine::load_snapshot_state()
+/* Fault in the given host memory ranges, with the pages divided
+   between the calling thread and @threads - 1 helper threads. The
+   helpers inherit the CPU affinity (and so the NUMA node) of the
+   caller. Returns the number of bytes that were prefaulted. */
+static size_t prefault_ranges(const std::vector<std::pair<char*, size_t>>& ranges, unsigned threads)
+{
+	static constexpr size_t CHUNK_SIZE = 2UL << 20;
+	std::vector<std::pair<char*, size_t>> chunks;
+	size_t total = 0;
+	for (auto [ptr, len] : ranges) {
+		total += len;
+		for (size_t off = 0; off < len; off += CHUNK_SIZE)
+			chunks.emplace_back(ptr + off, std::min(CHUNK_SIZE, len - off));
+	}
+	std::atomic<size_t> next = 0;
+	auto worker = [&] {
+		for (size_t i = next++; i < chunks.size(); i = next++) {
+			auto [ptr, len] = chunks[i];
+			// Map the pages without copying them, just like a read fault
+			if (madvise(ptr, len, MADV_POPULATE_READ) == 0)
+				continue;
+			// Older kernels: touch each page instead
+			for (size_t off = 0; off < len; off += vMemory::PageSize())
+				*(volatile char*)(ptr + off);
+		}
+	};
+	threads = std::min<size_t>(threads, chunks.size());
+	std::vector<std::thread> helpers;
+	for (unsigned i = 1; i < threads; i++)
+		helpers.emplace_back(worker);
+	worker();
+	for (auto& t : helpers)
+		t.join();
+	return total;
+}
+
+bool Machine::load_snapshot_state(const MachineOptions& options)
 {
 	if (!memory.has_loadable_snapshot_state()) {
 		return false;
@@ -120,11 +170,27 @@ bool Machine::load_snapshot_state()
 		fprintf(stderr, "Invalid snapshot state size: %u\n", state.size);
 		throw std::runtime_error("Invalid snapshot state size");
 	}
+	extern uint64_t host_cpu_features_hash();
+	if (state.cpu_baseline != this->m_cpu_baseline) {
+		throw std::runtime_error("Snapshot was made with a different CPU baseline");
+	}
+	if (state.cpu_baseline == CPUBaseline::Host && state.host_cpu_features != host_cpu_features_hash()) {
+		fprintf(stderr, "Warning: Snapshot was made on a host with different CPU features."
+			" Use a CPU baseline to make portable snapshots.\n");
+	}
 
 	// Load the state into the VM
 	try {
 		this->set_registers(state.regs);
-		this->set_special_registers(state.sregs);
+		auto sregs = state.sregs;
+#ifdef TINYKVM_ARCH_AMD64
+		if (state.cpu_baseline != CPUBaseline::Host) {
+			// Keep the protection features of this host
+			constexpr uint64_t CR4_HOST = CR4_UMIP | CR4_SMEP | CR4_SMAP;
+			sregs.cr4 = (sregs.cr4 & ~CR4_HOST) | (this->get_special_registers().cr4 & CR4_HOST);
+		}
+#endif
+		this->set_special_registers(sregs);
 		this->set_fpu_registers(state.fpu);
 		this->m_prepped = state.m_prepped;
 		this->m_forked = state.m_forked;
@@ -133,6 +199,7 @@ bool Machine::load_snapshot_state()
 		this->m_image_base = state.m_image_base;
 		this->m_stack_address = state.m_stack_address;
 		this->m_heap_address = state.m_heap_address;
+		this->m_brk_begin_address = state.m_brk_begin_address;
 		this->m_brk_address = state.m_brk_address;
 		this->m_brk_end_address = state.m_brk_end_address;
 		this->m_start_address = state.m_start_address;
@@ -140,9 +207,14 @@ bool Machine::load_snapshot_state()
 		this->m_mmap_cache.current() = state.mmap_current;
 		this->memory.main_memory_writes = state.main_memory_writes;
 		this->memory.page_tables = state.m_page_tables;
+		this->memory.remote_must_update_gigapages = true;
+		this->m_remote_pdpt_version = 0;
+		this->memory.invalidate_tlb();
 
 		void* current = state.current;
 		// Load populate pages
+		std::vector<std::pair<uint64_t, uint64_t>> prefetch;
+		std::vector<std::pair<char*, size_t>> prefault;
 		for (unsigned i = 0; i < state.num_access_ranges; i++) {
 			ColdStartAccessedRange* range = state.next<ColdStartAccessedRange>(current);
 			if (range->start >= MemoryBanks::ARENA_BASE_ADDRESS || range->start < kernel_end_address())
@@ -150,12 +222,33 @@ bool Machine::load_snapshot_state()
 			try {
 				//printf("Populating pages from 0x%lX -> 0x%lX\n", range->start, range->end);
 				char* page = this->memory.get_userpage_at(range->start);
-				madvise(page, range->end - range->start, MADV_WILLNEED | MADV_RANDOM);
+				if (this->memory.snapshot_restore) {
+					prefetch.emplace_back(page - this->memory.ptr, range->end - range->start);
+				} else if (options.snapshot_prefault_threads > 0) {
+					prefault.emplace_back(page, range->end - range->start);
+				} else {
+					madvise(page, range->end - range->start, MADV_WILLNEED);
+				}
 			} catch (const std::exception& e) {
 				fprintf(stderr, "Failed to access page at 0x%lX: %s\n", range->start, e.what());
 				continue;
 			}
 		}
+		// Restoring on demand: fetch the hot pages in the background
+		if (!prefetch.empty()) {
+			this->memory.snapshot_restore->prefetch(std::move(prefetch));
+		}
+		if (!prefault.empty()) {
+			const auto t0 = std::chrono::steady_clock::now();
+			const size_t bytes = prefault_ranges(prefault, options.snapshot_prefault_threads);
+			this->m_snapshot_prefault_time = std::chrono::duration<float>(
+				std::chrono::steady_clock::now() - t0).count();
+			if (options.verbose_loader) {
+				printf("Prefaulted %zu KiB of snapshot memory in %.2f ms using %u threads\n",
+					bytes >> 10, this->m_snapshot_prefault_time * 1e3f,
+					options.snapshot_prefault_threads);
+			}
+		}
 
 		// Load the thread states
 		ColdStartThreads* threads = state.next<ColdStartThreads>(current);
@@ -218,6 +311,9 @@ void Machine::save_snapshot_state_now(const std::vector<std::pair<uint64_t, uint
 	try {
 		state.magic = SnapshotState::MAGIC;
 		state.size  = 0; // Invalid (for now)
+		extern uint64_t host_cpu_features_hash();
+		state.cpu_baseline = this->m_cpu_baseline;
+		state.host_cpu_features = host_cpu_features_hash();
 		state.regs  = this->registers();
 		state.sregs = this->get_special_registers();
 		state.fpu   = this->fpu_registers();
@@ -228,6 +324,7 @@ void Machine::save_snapshot_state_now(const std::vector<std::pair<uint64_t, uint
 		state.m_image_base = this->m_image_base;
 		state.m_stack_address = this->m_stack_address;
 		state.m_heap_address = this->m_heap_address;
+		state.m_brk_begin_address = this->m_brk_begin_address;
 		state.m_brk_address = this->m_brk_address;
 		state.m_brk_end_address = this->m_brk_end_address;
 		state.m_start_address = this->m_start_address;
@@ -356,12 +453,15 @@ void* vMemory::get_snapshot_state_area() const
 bool vMemory::has_loadable_snapshot_state() const noexcept
 {
 	if (this->has_snapshot_area()) {
-		void* area = this->get_snapshot_state_area();
-		uint32_t* magic = reinterpret_cast<uint32_t*>(area);
-		return *magic == SnapshotState::MAGIC;
+		return is_loadable_snapshot_state(this->get_snapshot_state_area());
 	}
 	return false;
 }
+bool vMemory::is_loadable_snapshot_state(const void* area) noexcept
+{
+	const uint32_t* magic = reinterpret_cast<const uint32_t*>(area);
+	return *magic == SnapshotState::MAGIC;
+}
 void* Machine::get_snapshot_state_user_area() const
 {
 	if (!this->memory.has_snapshot_area()) {
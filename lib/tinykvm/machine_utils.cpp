@@ -1,7 +1,9 @@
 #include "machine.hpp"
+#include "file_mapping_cache.hpp"
 
 #include <algorithm>
 #include <cstring>
+#include <mutex>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
@@ -11,9 +13,39 @@
 static constexpr bool VERBOSE_FILE_BACKED_MMAP = false;
 
 namespace tinykvm {
+/* Accesses this large walk the page tables once per 2MB, while
+   smaller accesses are served page by page from the software TLB. */
+static constexpr size_t RANGE_WALK_MIN = 4 * 4096;
+static constexpr uint64_t USER_READABLE = (1UL << 0) | (1UL << 2); // Present, user
+/* Zeroing this much sparse main memory gives the pages back instead */
+static constexpr size_t SPARSE_DISCARD_MIN = 2ULL << 20;
+
+/* Remote pages must be resolved through the remote's page tables */
+static bool range_walkable(const Machine& machine, uint64_t addr, size_t len)
+{
+	if (len < RANGE_WALK_MIN)
+		return false;
+	if (!machine.has_remote())
+		return true;
+	const auto& rmem = machine.remote().main_memory();
+	return addr + len <= rmem.physbase || addr >= rmem.remote_end;
+}
 
 void Machine::memzero(address_t addr, size_t len)
 {
+	/* Large ranges of sparse main memory are given back instead,
+	   which also avoids populating them */
+	if (len >= SPARSE_DISCARD_MIN && memory.sparse && !uses_cow_memory()
+		&& memory.safely_within(addr, len))
+	{
+		const address_t begin = (addr + PageMask()) & ~PageMask();
+		const address_t end = (addr + len) & ~PageMask();
+		if (memory.discard(begin, end - begin) != 0) {
+			this->memzero(addr, begin - addr);
+			this->memzero(end, addr + len - end);
+			return;
+		}
+	}
 	while (len != 0)
 	{
 		const size_t offset = addr & PageMask();
@@ -30,8 +62,18 @@ void Machine::memzero(address_t addr, size_t len)
 				}
 			}, true); // Ignore missing pages
 		if (UNLIKELY(must_be_zeroed)) {
-			auto* page = memory.get_writable_page(addr & ~PageMask(), memory.expectedUsermodeFlags(), true, false);
-			std::memset(&page[offset], 0, size);
+			if (size == vMemory::PageSize() && memory.shared_zero_page && !memory.is_forkable_master() && !has_remote()) {
+				/* Whole copy-on-write pages can use the shared zero page */
+				WritablePageOptions opts;
+				opts.zeroes = true;
+				opts.zero_page = memory.zero_page();
+				auto page = writable_page_at(memory, addr, memory.expectedUsermodeFlags(), opts);
+				if (page.page != nullptr)
+					std::memset(page.page, 0, size);
+			} else {
+				auto* page = memory.get_writable_page(addr & ~PageMask(), memory.expectedUsermodeFlags(), true, false);
+				std::memset(&page[offset], 0, size);
+			}
 		}
 
 		addr += size;
@@ -44,20 +86,40 @@ void Machine::copy_to_guest(address_t addr, const void* vsrc, size_t len, bool z
 	if (uses_cow_memory() || !memory.safely_within(addr, len))
 	{
 		auto* src = (const uint8_t *)vsrc;
+		if (len >= RANGE_WALK_MIN) {
+			WritablePageOptions opts;
+			opts.allow_dirty = true;
+			opts.zeroes = zeroes;
+			writable_range_at(memory, addr, len, memory.expectedUsermodeFlags(), opts,
+				[&src] (uint64_t, char* data, size_t size) {
+					std::memcpy(data, src, size);
+					src += size;
+				});
+			return;
+		}
 		while (len != 0)
 		{
 			const size_t offset = addr & PageMask();
 			const size_t size = std::min(vMemory::PageSize() - offset, len);
-			const bool full_page = (size == vMemory::PageSize());
-			WritablePageOptions opts;
-			opts.allow_dirty = full_page;
-			opts.zeroes = zeroes;
-			// Get a writable page, possibly allocating a new one
-			WritablePage page = writable_page_at(memory, addr & ~PageMask(), memory.expectedUsermodeFlags(), opts);
-			// Page is always dirty
-			page.set_dirty();
+			// Remote pages change with the remote's page tables, not ours
+			const bool use_tlb = !memory.banks.dirty_page_logging()
+				&& !(has_remote() && is_foreign_address(addr));
+			char* page_data = use_tlb ? memory.tlb_lookup(addr, vMemory::TLB_WRITE) : nullptr;
+			if (page_data == nullptr) {
+				const bool full_page = (size == vMemory::PageSize());
+				WritablePageOptions opts;
+				opts.allow_dirty = full_page;
+				opts.zeroes = zeroes;
+				// Get a writable page, possibly allocating a new one
+				WritablePage page = writable_page_at(memory, addr & ~PageMask(), memory.expectedUsermodeFlags(), opts);
+				// Page is always dirty
+				page.set_dirty();
+				page_data = page.page;
+				// Host writes are recorded per write while dirty pages are logged
+				if (use_tlb)
+					memory.tlb_insert(addr, page_data, vMemory::TLB_KERNEL | vMemory::TLB_USER | vMemory::TLB_WRITE);
+			}
 			// Copy data to the page
-			char* page_data = page.page;
 			std::memcpy(&page_data[offset], src, size);
 
 			addr += size;
@@ -76,6 +138,14 @@ void Machine::copy_from_guest(void* vdst, address_t addr, size_t len) const
 	if (uses_cow_memory() || !memory.safely_within(addr, len))
 	{
 		auto* dst = (uint8_t *)vdst;
+		if (range_walkable(*this, addr, len)) {
+			readable_range_at(memory, addr, len, USER_READABLE,
+				[&dst] (uint64_t, char* data, size_t size) {
+					std::memcpy(dst, data, size);
+					dst += size;
+				});
+			return;
+		}
 		while (len != 0)
 		{
 			const size_t offset = addr & PageMask();
@@ -121,6 +191,18 @@ size_t Machine::gather_buffers_from_range(
 	size_t cnt, Buffer buffers[], address_t addr, size_t len) const
 {
 	size_t index = 0;
+	if (range_walkable(*this, addr, len)) {
+		readable_range_at(memory, addr, len, USER_READABLE,
+			[&] (uint64_t, char* data, size_t size) {
+				if (UNLIKELY(index == cnt)) {
+					throw MemoryException("Out of buffers", index, cnt);
+				}
+				buffers[index].ptr = data;
+				buffers[index].len = size;
+				index ++;
+			});
+		return index;
+	}
 	Buffer* last = nullptr;
 	while (len != 0 && index < cnt)
 	{
@@ -145,10 +227,23 @@ size_t Machine::gather_buffers_from_range(
 	}
 	return index;
 }
-size_t Machine::gather_buffers_from_range(
-	std::vector<Buffer>& buffers, address_t addr, size_t len) const
+/* The buffer lists merge physically contiguous pages */
+template <typename Container>
+static size_t gather_buffers_into(const Machine& machine,
+	Container& buffers, uint64_t addr, size_t len)
 {
-	Buffer* last = nullptr;
+	const auto& memory = machine.main_memory();
+	if (range_walkable(machine, addr, len)) {
+		readable_range_at(memory, addr, len, USER_READABLE,
+			[&buffers] (uint64_t, char* data, size_t size) {
+				buffers.emplace_back();
+				auto& buffer = buffers.back();
+				buffer.ptr = data;
+				buffer.len = size;
+			});
+		return buffers.size();
+	}
+	Machine::Buffer* last = nullptr;
 	while (len != 0)
 	{
 		const size_t offset = addr & PageMask();
@@ -169,10 +264,11 @@ size_t Machine::gather_buffers_from_range(
 	}
 	return buffers.size();
 }
-size_t Machine::writable_buffers_from_range(
-	std::vector<WrBuffer>& buffers, address_t addr, size_t len)
+template <typename Container>
+static size_t writable_buffers_into(vMemory& memory,
+	Container& buffers, uint64_t addr, size_t len)
 {
-	WrBuffer* last = nullptr;
+	Machine::WrBuffer* last = nullptr;
 	while (len != 0)
 	{
 		auto wpage = writable_page_at(memory, addr & ~PageMask(), memory.expectedUsermodeFlags());
@@ -209,12 +305,92 @@ size_t Machine::writable_buffers_from_range(
 	return buffers.size();
 }
 
+size_t Machine::gather_buffers_from_range(
+	std::vector<Buffer>& buffers, address_t addr, size_t len) const
+{
+	return gather_buffers_into(*this, buffers, addr, len);
+}
+size_t Machine::gather_buffers_from_range(
+	ScratchIOVec<Buffer>& buffers, address_t addr, size_t len) const
+{
+	return gather_buffers_into(*this, buffers, addr, len);
+}
+size_t Machine::writable_buffers_from_range(
+	std::vector<WrBuffer>& buffers, address_t addr, size_t len)
+{
+	return writable_buffers_into(memory, buffers, addr, len);
+}
+size_t Machine::writable_buffers_from_range(
+	ScratchIOVec<WrBuffer>& buffers, address_t addr, size_t len)
+{
+	return writable_buffers_into(memory, buffers, addr, len);
+}
+
+VirtualMem& Machine::map_host_range(address_t virt_base, char* real_addr,
+	size_t size_memory, int prot, bool shared, std::string filename)
+{
+	// Host memory becomes new guest physical memory after the
+	// existing mappings, and [virt_base, +size) is pointed at it
+	address_t& mmap_phys_base = memory.mmap_physical;
+	// XXX: This isn't so important because you can only create these
+	// in master VMs, which don't use memory banks.
+	const int region_idx = memory.allocate_region_idx();
+	if constexpr (VERBOSE_FILE_BACKED_MMAP) {
+		printf("mmap: inserting physical %zu kB at 0x%lX -> 0x%lX, phys 0x%lX region %d\n",
+			size_memory / 1024, virt_base, virt_base + size_memory, mmap_phys_base, region_idx);
+	}
+	// Now we need to install this memory region as guest physical memory
+	this->install_memory(region_idx, VirtualMem(mmap_phys_base, (char*)real_addr, size_memory), shared);
+	// Record the mmap range
+	this->memory.mmap_ranges.emplace_back(mmap_phys_base, (char*)real_addr, virt_base, size_memory, std::move(filename));
+	// Set the bank index for the new mmap range
+	this->memory.mmap_ranges.back().bank_idx = region_idx;
+	this->memory.mmap_ranges.back().shared = shared;
+	// XXX: TODO: madvise(MADV_DONTNEED) on the old pages using gather_buffers_from_range
+	// With the new physical memory, we now need to create pagetable entries
+	// we'll do it the slow way by allocating the same range and for each page redirect it to the new phys
+	for (address_t i = 0; i < size_memory; )
+	{
+		static constexpr address_t PDE64_USER = (1UL << 2);
+		const address_t phys = mmap_phys_base + i;
+		const address_t virt = virt_base + i;
+		WritablePage writable_page = writable_page_at(memory, virt, PDE64_USER | 1);
+		if (writable_page.page == nullptr) {
+			throw MemoryException("Failed to allocate writable page for mmap", virt, vMemory::PageSize());
+		}
+
+		static constexpr uint64_t PDE64_ADDR_MASK = ~0x8000000000000FFF;
+		if (writable_page.size != vMemory::PageSize()) {
+			const address_t pv = writable_page.entry & PDE64_ADDR_MASK;
+			// Check if the page is unaligned
+			if ((pv & (writable_page.size - 1)) != 0) {
+				throw MemoryException("Unaligned page for mmap (cannot use)", virt, writable_page.size);
+			}
+		}
+
+		writable_page.entry &= ~PDE64_ADDR_MASK; // Clear the address bits
+		writable_page.entry |= (phys & PDE64_ADDR_MASK); // Set the new physical
+		writable_page.set_protections(prot);
+		writable_page.set_dirty(); // Mark the page as dirty
+		if constexpr (VERBOSE_FILE_BACKED_MMAP) {
+			printf("mmap: allocating page at 0x%lX -> 0x%lX, phys 0x%lX size %zu entry 0x%lX prot 0x%X\n",
+				virt, virt + vMemory::PageSize(), phys, writable_page.size, writable_page.entry, prot);
+		}
+		i += writable_page.size;
+	}
+	// The range now points at other host memory
+	memory.invalidate_tlb();
+	mmap_phys_base += size_memory;
+	// Force-align mmap_phys_base to 2MB
+	mmap_phys_base = (mmap_phys_base + 0x1FFFFFLL) & ~0x1FFFFFLL;
+	return this->memory.mmap_ranges.back();
+}
+
 bool Machine::mmap_backed_area(
 	int fd, int off, int prot, address_t virt_base, size_t size_bytes)
 {
 	static constexpr bool MANUAL_PREADV = false;
 	ScopedProfiler<MachineProfiling::MMapFiles> prof(profiling());
-	address_t& mmap_phys_base = memory.mmap_physical;
 
 	// Find the actual length of the file
 	struct stat st;
@@ -280,7 +456,14 @@ bool Machine::mmap_backed_area(
 
 	if (size_memory > 0) {
 		void* real_addr = nullptr;
-		if constexpr (!MANUAL_PREADV) {
+		// Read-only mappings can be shared with other VMs
+		const bool shared = memory.shared_file_mappings && !(prot & PROT_WRITE) && !MANUAL_PREADV;
+		if (shared) {
+			real_addr = FileMappingCache::get().acquire(fd, st, off, size_memory);
+			if (real_addr == nullptr) {
+				return false;
+			}
+		} else if constexpr (!MANUAL_PREADV) {
 			real_addr = mmap(nullptr, size_memory, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, off);
 		} else {
 			real_addr = mmap(nullptr, size_memory, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
@@ -289,15 +472,6 @@ bool Machine::mmap_backed_area(
 			return false; // Failed to mmap the area
 		}
 
-		// XXX: This isn't so important because you can only create these
-		// in master VMs, which don't use memory banks.
-		const int region_idx = memory.allocate_region_idx();
-		if constexpr (VERBOSE_FILE_BACKED_MMAP) {
-			printf("mmap: inserting physical %zu kB at 0x%lX -> 0x%lX, phys 0x%lX region %d\n",
-				size_memory / 1024, virt_base, virt_base + size_memory, mmap_phys_base, region_idx);
-		}
-		// Now we need to install this memory region as guest physical memory
-		this->install_memory(region_idx, VirtualMem(mmap_phys_base, (char*)real_addr, size_memory), false);
 		// Discover the filename of the fd
 		char fd_path[64];
 		snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
@@ -313,45 +487,7 @@ bool Machine::mmap_backed_area(
 		if constexpr (VERBOSE_FILE_BACKED_MMAP) {
 			printf("mmap: fd %d is file '%s'\n", fd, filename.c_str());
 		}
-		// Record the mmap range
-		this->memory.mmap_ranges.emplace_back(mmap_phys_base, (char*)real_addr, virt_base, size_memory, std::move(filename));
-		// Set the bank index for the new mmap range
-		this->memory.mmap_ranges.back().bank_idx = region_idx;
-		// XXX: TODO: madvise(MADV_DONTNEED) on the old pages using gather_buffers_from_range
-		// With the new physical memory, we now need to create pagetable entries
-		// we'll do it the slow way by allocating the same range and for each page redirect it to the new phys
-		for (address_t i = 0; i < size_memory; )
-		{
-			static constexpr address_t PDE64_USER = (1UL << 2);
-			const address_t phys = mmap_phys_base + i;
-			const address_t virt = virt_base + i;
-			WritablePage writable_page = writable_page_at(memory, virt, PDE64_USER | 1);
-			if (writable_page.page == nullptr) {
-				throw MemoryException("Failed to allocate writable page for mmap", virt, vMemory::PageSize());
-			}
-
-			static constexpr uint64_t PDE64_ADDR_MASK = ~0x8000000000000FFF;
-			if (writable_page.size != vMemory::PageSize()) {
-				const address_t pv = writable_page.entry & PDE64_ADDR_MASK;
-				// Check if the page is unaligned
-				if ((pv & (writable_page.size - 1)) != 0) {
-					throw MemoryException("Unaligned page for mmap (cannot use)", virt, writable_page.size);
-				}
-			}
-
-			writable_page.entry &= ~PDE64_ADDR_MASK; // Clear the address bits
-			writable_page.entry |= (phys & PDE64_ADDR_MASK); // Set the new physical
-			writable_page.set_protections(prot);
-			writable_page.set_dirty(); // Mark the page as dirty
-			if constexpr (VERBOSE_FILE_BACKED_MMAP) {
-				printf("mmap: allocating page at 0x%lX -> 0x%lX, phys 0x%lX size %zu entry 0x%lX prot 0x%X\n",
-					virt, virt + vMemory::PageSize(), phys, writable_page.size, writable_page.entry, prot);
-			}
-			i += writable_page.size;
-		}
-		mmap_phys_base += size_memory;
-		// Force-align mmap_phys_base to 2MB
-		mmap_phys_base = (mmap_phys_base + 0x1FFFFFLL) & ~0x1FFFFFLL;
+		this->map_host_range(virt_base, (char*)real_addr, size_memory, prot, shared, std::move(filename));
 	} // size_memory > 0
 
 	if constexpr (MANUAL_PREADV) {
@@ -381,7 +517,7 @@ bool Machine::mmap_backed_area(
 
 	if constexpr (VERBOSE_FILE_BACKED_MMAP) {
 		printf("mmap: allocated %zu/%zu bytes at 0x%lX, phys 0x%lX\n",
-			size_memory, size, virt_base, mmap_phys_base);
+			size_memory, size, virt_base, memory.mmap_physical);
 	}
 	return true;
 }
@@ -439,6 +575,56 @@ void Machine::copy_from_machine(address_t addr, Machine& src, address_t sa, size
 	}
 }
 
+size_t Machine::alias_from_machine(address_t addr, Machine& src, address_t sa, size_t len)
+{
+	static constexpr uint64_t PDE64_RW = (1UL << 1);
+	static constexpr uint64_t PDE64_USER = (1UL << 2);
+	static constexpr uint64_t PDE64_ADDR_MASK = ~0x8000000000000FFF;
+	/* The source pages must be guest-physical memory in this VM too,
+	   and must never be written to in place. Only forks have page
+	   tables of their own to alias into. */
+	const bool shared_memory = &src == this || (this->has_remote() && &this->remote() == &src)
+		|| src.main_memory().compare(memory);
+	if (!this->is_forked() || !shared_memory || src.main_memory().main_memory_writes
+		|| (addr & PageMask()) != (sa & PageMask()))
+	{
+		this->copy_from_machine(addr, src, sa, len);
+		return 0;
+	}
+	/* Copy the unaligned head */
+	const size_t head = std::min(len, (vMemory::PageSize() - (addr & PageMask())) & PageMask());
+	if (head != 0) {
+		this->copy_from_machine(addr, src, sa, head);
+		addr += head; sa += head; len -= head;
+	}
+
+	const auto& smem = src.main_memory();
+	size_t aliased = 0;
+	for (; len >= vMemory::PageSize(); addr += vMemory::PageSize(), sa += vMemory::PageSize(), len -= vMemory::PageSize())
+	{
+		uint64_t phys = 0;
+		page_at(src.memory, sa, [&] (uint64_t, uint64_t& entry, size_t size) {
+			if ((entry & (PDE64_USER | PDE64_RW)) == PDE64_USER)
+				phys = ((entry & PDE64_ADDR_MASK) + (sa & (size - 1))) & ~PageMask();
+		}, true);
+		/* Only identity-mapped main memory lives as long as the VM */
+		if (phys != 0 && phys >= smem.physbase && phys < smem.physbase + smem.size) {
+			WritablePageOptions opts;
+			opts.alias_page = phys;
+			auto wpage = writable_page_at(memory, addr, PDE64_USER, opts);
+			if (wpage.page == nullptr) {
+				aliased += vMemory::PageSize();
+				continue;
+			}
+		}
+		this->copy_from_machine(addr, src, sa, vMemory::PageSize());
+	}
+	/* Copy the unaligned tail */
+	if (len != 0)
+		this->copy_from_machine(addr, src, sa, len);
+	return aliased;
+}
+
 void Machine::string_or_view(address_t src, size_t len,
 	std::function<void(std::string_view)> sv_cb, std::function<void(std::string)> str_cb) const
 {
@@ -637,6 +823,75 @@ std::string Machine::memcstring(address_t src, size_t maxlen) const
 	return result;
 }
 
+uint64_t MachineProfiling::monotonic_ns() noexcept
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1'000'000'000ULL + uint64_t(ts.tv_nsec);
+}
+
+void MachineProfiling::calibrate_tsc()
+{
+#if defined(__x86_64__)
+	static std::once_flag calibrated;
+	std::call_once(calibrated, [] {
+		/* Measure the TSC frequency against the monotonic clock */
+		const uint64_t t0 = monotonic_ns();
+		const uint64_t c0 = tsc();
+		uint64_t t1;
+		do {
+			t1 = monotonic_ns();
+		} while (t1 - t0 < 5'000'000); // 5ms
+		const uint64_t c1 = tsc();
+		if (c1 > c0)
+			tsc_ns_multiplier = ((unsigned __int128)(t1 - t0) << 32) / (c1 - c0);
+	});
+#endif
+}
+
+uint64_t MachineProfiling::Histogram::percentile(double pct) const noexcept
+{
+	if (count == 0)
+		return 0;
+	const uint64_t target = std::max<uint64_t>(1, uint64_t(count * pct / 100.0 + 0.5));
+	uint64_t seen = 0;
+	for (unsigned i = 0; i < BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= target)
+			return std::clamp(value_of(i), min, max);
+	}
+	return max;
+}
+
+void MachineProfiling::Histogram::merge(const Histogram& other) noexcept
+{
+	this->count += other.count;
+	this->total += other.total;
+	this->min = std::min(this->min, other.min);
+	this->max = std::max(this->max, other.max);
+	for (unsigned i = 0; i < BUCKETS; i++)
+		this->buckets[i] += other.buckets[i];
+}
+
+void MachineProfiling::merge(const MachineProfiling& other)
+{
+	for (size_t i = 0; i < Count; i++) {
+		times[i].insert(times[i].end(), other.times[i].begin(), other.times[i].end());
+		histograms[i].merge(other.histograms[i]);
+	}
+	if (other.has_syscall_stats() && !this->has_syscall_stats())
+		this->syscalls.resize(other.syscalls.size());
+	for (size_t nr = 0; nr < other.syscalls.size(); nr++) {
+		const auto& src = other.syscalls[nr];
+		auto& dst = this->syscalls[nr];
+		dst.count += src.count;
+		dst.total_ns += src.total_ns;
+		dst.max_ns = std::max(dst.max_ns, src.max_ns);
+		for (unsigned b = 0; b < SyscallStats::BUCKETS; b++)
+			dst.log2_buckets[b] += src.log2_buckets[b];
+	}
+}
+
 void MachineProfiling::print(const char* user_defined) const {
 	std::array<std::string, 7> locnames = {
 		"vCPU Run",
@@ -665,6 +920,17 @@ void MachineProfiling::print(const char* user_defined) const {
 		printf("  %s: %lu samples, total = %luns, max = %luns, min = %luns, median = %luns\n",
 			locnames[i].c_str(), vec.size(), total, maxv, minv, median);
 	}
+	for (size_t i = 0; i < locnames.size(); i++) {
+		const auto& hist = this->histograms[i];
+		if (hist.count == 0) continue;
+		printf("  %s: %lu samples, total = %luns, max = %luns, min = %luns, median = %luns, p99 = %luns\n",
+			locnames[i].c_str(), hist.count, hist.total, hist.max, hist.min,
+			hist.percentile(50.0), hist.percentile(99.0));
+	}
+	this->for_each_syscall([] (unsigned nr, const SyscallStats& stats) {
+		printf("  Syscall %u: %lu calls, total = %luns, avg = %luns, max = %luns\n",
+			nr, stats.count, stats.total_ns, stats.avg_ns(), stats.max_ns);
+	});
 }
 
 } // tinykvm
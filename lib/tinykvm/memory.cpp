@@ -1,4 +1,7 @@
 #include "machine.hpp"
+#include "file_mapping_cache.hpp"
+#include "numa.hpp"
+#include "page_dedup.hpp"
 #include <algorithm>
 #include <cstring>
 #include <fcntl.h>
@@ -9,6 +12,7 @@
 #include <unistd.h>
 #include <unordered_set>
 #include "page_streaming.hpp"
+#include "snapshot_restore.hpp"
 #ifdef TINYKVM_ARCH_AMD64
 #include "amd64/amd64.hpp"
 #include "amd64/memory_layout.hpp"
@@ -21,6 +25,70 @@ namespace tinykvm {
 #define USERMODE_FLAGS (0x7 | 1UL << 63) /* USER, READ/WRITE, PRESENT, NX */
 static constexpr bool VERBOSE_MMAP = false;
 
+/* A single read-only page of zeroes, shared by every VM in the process. */
+static char* host_zero_page()
+{
+	static char* page = [] {
+		void* ptr = mmap(nullptr, vMemory::PageSize(), PROT_READ,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED)
+			throw MemoryException("Failed to allocate the shared zero page", 0, vMemory::PageSize());
+		return (char *)ptr;
+	}();
+	return page;
+}
+
+/* The software TLB of this host thread, for one memory at a time */
+struct SoftTLB {
+	static constexpr size_t ENTRIES = 32; // Direct-mapped
+	struct Entry {
+		uint64_t vpage = ~0ULL;
+		char*    page = nullptr;
+		unsigned access = 0;
+	};
+	const vMemory* memory = nullptr;
+	uint64_t generation = 0;
+	std::array<Entry, ENTRIES> entries;
+
+	bool current(const vMemory* mem, uint64_t gen) noexcept {
+		if (LIKELY(memory == mem && generation == gen))
+			return true;
+		memory = mem;
+		generation = gen;
+		entries.fill(Entry{});
+		return false;
+	}
+};
+static thread_local SoftTLB t_tlb;
+static uint64_t tlb_generations = 0;
+
+uint64_t vMemory::new_tlb_generation() noexcept
+{
+	return __atomic_add_fetch(&tlb_generations, 1, __ATOMIC_RELAXED);
+}
+void vMemory::invalidate_tlb() const noexcept
+{
+	__atomic_store_n(&this->tlb_generation, new_tlb_generation(), __ATOMIC_RELEASE);
+}
+char* vMemory::tlb_lookup(uint64_t addr, unsigned access) const noexcept
+{
+	auto& tlb = t_tlb;
+	if (!tlb.current(this, __atomic_load_n(&this->tlb_generation, __ATOMIC_ACQUIRE)))
+		return nullptr;
+	const uint64_t vpage = addr >> 12;
+	const auto& entry = tlb.entries[vpage % SoftTLB::ENTRIES];
+	if (entry.vpage == vpage && (entry.access & access) == access)
+		return entry.page;
+	return nullptr;
+}
+void vMemory::tlb_insert(uint64_t addr, char* page, unsigned access) const noexcept
+{
+	auto& tlb = t_tlb;
+	tlb.current(this, __atomic_load_n(&this->tlb_generation, __ATOMIC_ACQUIRE));
+	const uint64_t vpage = addr >> 12;
+	tlb.entries[vpage % SoftTLB::ENTRIES] = { vpage, page, access };
+}
+
 vMemory::vMemory(Machine& m, const MachineOptions& options,
 	uint64_t ph, uint64_t sf, char* p, size_t s, int fd, bool own)
 	: machine(m), physbase(ph), safebase(sf),
@@ -29,8 +97,18 @@ vMemory::vMemory(Machine& m, const MachineOptions& options,
 	  owned(own), snapshot_fd(fd),
 	  main_memory_writes(options.master_direct_memory_writes),
 	  split_hugepages(options.split_hugepages),
+	  hugepage_cow_heap(options.hugepage_cow_heap),
+	  hugepage_cow_mmap(options.hugepage_cow_mmap),
+	  shared_zero_page(options.shared_zero_page && !options.reset_keep_all_work_memory),
 	  executable_heap(options.executable_heap),
 	  mmap_backed_files(options.mmap_backed_files),
+	  shared_file_mappings(options.shared_file_mappings),
+	  dedup_capable(own && options.snapshot_file.empty() && !options.hugepages
+		&& !options.memfd_main_memory && options.snapshot_memfd < 0),
+	  sparse(options.sparse_main_memory && own && options.snapshot_file.empty()
+		&& !options.hugepages && !options.memfd_main_memory && options.snapshot_memfd < 0),
+	  numa_node((own && !options.numa_interleave) ? options.numa_node : -1),
+	  master_ptr(p),
 	  banks(m, options)
 {
 	// Main memory is not always starting at 0x0
@@ -49,6 +127,15 @@ vMemory::vMemory(Machine& m, const MachineOptions& options,
 
 	this->mmap_physical = MMAP_PHYS_BASE + ((physbase == 0) ? 0x0 : 0x2000000000);
 	this->mmap_physical_begin = this->mmap_physical;
+	this->snapshot_packed = !options.snapshot_packed_file.empty();
+	if (own && options.memfd_main_memory && options.snapshot_memfd < 0)
+		this->memfd = fd;
+	if (options.snapshot_lazy_restore && !this->snapshot_packed && fd >= 0
+		&& options.snapshot_memfd < 0 && !options.memfd_main_memory
+		&& this->has_loadable_snapshot_state()) {
+		// The file is still open, and the memory is empty
+		this->snapshot_restore.reset(new SnapshotRestore(fd, this->ptr, this->size));
+	}
 	if constexpr (VERBOSE_MMAP) {
 		fprintf(stderr, "vMemory: physbase=0x%lX safebase=0x%lX size=0x%zX mmap_physical=0x%lX bank_physical=0x%lX\n",
 			physbase, safebase, size, mmap_physical_begin, banks.arena_begin());
@@ -61,15 +148,61 @@ vMemory::vMemory(Machine& m, const MachineOptions& options, const vMemory& other
 	this->mmap_physical_begin = other.mmap_physical_begin;
 	this->mmap_physical = other.mmap_physical;
 	this->remote_end = other.remote_end;
+	this->master_ptr = other.master_ptr;
 	banks.init_from(other.banks);
+	if (options.numa_replicate_master && other.owned) {
+		int node = options.numa_node;
+		if (node < 0 && numa_nodes() > 1)
+			node = numa_current_node();
+		if (node >= 0 && node != other.numa_node) {
+			char* replica = other.numa_replica(node);
+			if (replica != nullptr)
+				this->ptr = replica;
+		}
+	}
+}
+char* vMemory::numa_replica(int node) const
+{
+	std::scoped_lock lock(this->numa_mtx);
+	auto it = this->numa_replicas.find(node);
+	if (it != this->numa_replicas.end())
+		return it->second;
+	char* replica = (char*) mmap(NULL, this->size, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+	if (replica == MAP_FAILED)
+		return nullptr;
+	/* A copy that is not on the node is no better than the original */
+	if (!numa_bind(replica, this->size, node, false)) {
+		munmap(replica, this->size);
+		return nullptr;
+	}
+	/* Untouched pages already read as zeroes */
+	for (size_t off = 0; off < this->size; off += PageSize()) {
+		const auto* page = (const uint64_t *)&this->ptr[off];
+		const bool zero = std::all_of(page, page + PageSize() / sizeof(uint64_t),
+			[] (uint64_t word) { return word == 0; });
+		if (!zero)
+			page_duplicate((uint64_t *)&replica[off], page);
+	}
+	this->numa_replicas.emplace(node, replica);
+	return replica;
 }
 vMemory::~vMemory()
 {
+	this->snapshot_restore = nullptr;
 	if (this->owned) {
 		munmap(this->ptr, this->size);
+		if (!this->dedup_pages.empty())
+			PageDedupStore::get().release(this->dedup_pages);
+		for (auto& it : this->numa_replicas)
+			munmap(it.second, this->size);
+		if (this->memfd >= 0)
+			close(this->memfd);
 
 		for (auto& mmap_files : this->mmap_ranges) {
-			if (mmap_files.ptr != nullptr) {
+			if (mmap_files.shared) {
+				FileMappingCache::get().release(mmap_files.ptr);
+			} else if (mmap_files.ptr != nullptr && !mmap_files.external) {
 				munmap(mmap_files.ptr, mmap_files.size);
 			}
 		}
@@ -108,7 +241,7 @@ void vMemory::install_mmap_ranges(const Machine &other)
 		}
 		// Install the mmap range in a new memory slot
 		const unsigned region_idx = this->allocate_region_idx();
-		machine.install_memory(region_idx, range, false);
+		machine.install_memory(region_idx, range, range.shared);
 		// Record the mmap range
 		auto new_range = range;
 		new_range.bank_idx = region_idx;
@@ -133,6 +266,44 @@ void vMemory::delete_foreign_mmap_ranges()
 		}
 	}
 }
+void vMemory::rebase_mmap_ranges(const Machine& new_master)
+{
+	const auto& wanted = new_master.main_memory().mmap_ranges;
+	auto same_range = [] (const VirtualMem& a, const VirtualMem& b) {
+		return a.physbase == b.physbase && a.size == b.size
+			&& a.ptr == b.ptr && a.shared == b.shared;
+	};
+	/* Ranges backed by the same host memory (eg. shared file mappings)
+	   keep their memory slot, the rest are removed. */
+	std::vector<VirtualMem> kept;
+	for (const auto& range : this->mmap_ranges) {
+		const bool keep = std::any_of(wanted.begin(), wanted.end(),
+			[&] (const VirtualMem& other) { return same_range(range, other); });
+		if (keep) {
+			kept.push_back(range);
+		} else {
+			machine.delete_memory(range.bank_idx);
+			this->m_bank_idx_free_list.push_back(range.bank_idx);
+		}
+	}
+	this->mmap_ranges = std::move(kept);
+	for (const auto& range : wanted)
+	{
+		const bool installed = std::any_of(this->mmap_ranges.begin(), this->mmap_ranges.end(),
+			[&] (const VirtualMem& existing) { return same_range(existing, range); });
+		if (installed)
+			continue;
+		const unsigned region_idx = this->allocate_region_idx();
+		machine.install_memory(region_idx, range, range.shared);
+		auto new_range = range;
+		new_range.bank_idx = region_idx;
+		this->mmap_ranges.push_back(new_range);
+	}
+	this->mmap_physical_begin = new_master.main_memory().mmap_physical_begin;
+	this->mmap_physical = new_master.main_memory().mmap_physical;
+	this->executable_heap = new_master.main_memory().executable_heap;
+	this->remote_end = new_master.main_memory().remote_end;
+}
 void vMemory::delete_foreign_banks()
 {
 	for (auto slot_idx : this->foreign_banks) {
@@ -145,27 +316,153 @@ void vMemory::delete_foreign_banks()
 	this->foreign_banks.clear();
 }
 
-bool vMemory::compare(const vMemory& other)
+bool vMemory::compare(const vMemory& other) const noexcept
 {
-	return this->ptr == other.ptr;
+	return this->master_ptr == other.master_ptr;
 }
 
-void vMemory::record_cow_leaf_user_page(uint64_t addr)
+void vMemory::record_cow_leaf_user_page(uint64_t addr, uint64_t paddr, size_t size)
 {
-	// When running forked, record page address to be restored in fork_reset.
+	// When running forked, record page to be restored in fork_reset.
 	// Pages are assumed to be leaf user pages.
 	if (machine.is_forked()) {
-		auto it = std::lower_bound(cow_written_pages.begin(), cow_written_pages.end(), addr);
-		cow_written_pages.insert(it, addr);
+		this->record_host_write(addr, paddr, size);
+	}
+}
+void vMemory::record_host_write(uint64_t addr, uint64_t paddr, size_t size)
+{
+	// KVM only logs writes made by the guest, so pages handed out
+	// for writing to the host must be tracked separately.
+	if (auto* bank = banks.bank_of(paddr); bank != nullptr) {
+		bank->track_leaf_page(paddr & ~(size - 1), addr & ~(size - 1), size);
+	}
+}
+void vMemory::restore_cow_pages(const vMemory& master)
+{
+	const bool dirty_log = banks.dirty_page_logging();
+	std::vector<uint64_t> bitmap;
+	for (auto& bank : banks) {
+		if (bank.cow_pages.empty())
+			continue;
+		if (dirty_log) {
+			// Only restore pages written to since the previous reset.
+			bitmap.resize(bank.cow_pages.size());
+			machine.get_dirty_log(bank.idx, bitmap.data());
+		}
+
+		// Pages that are consecutive in both the bank and the master
+		// are copied as one batch.
+		size_t run_begin = 0, run_pages = 0;
+		auto flush_run = [&] {
+			if (run_pages == 0)
+				return;
+			pages_duplicate((uint64_t*)&bank.mem[run_begin * PageSize()],
+				(const uint64_t*)master.safely_at(bank.page_vaddr[run_begin], run_pages * PageSize()),
+				run_pages);
+			run_pages = 0;
+		};
+		for (size_t w = 0; w < bank.cow_pages.size(); w++) {
+			uint64_t word = bank.cow_pages[w];
+			if (dirty_log) {
+				word &= bitmap[w] | bank.host_dirty[w];
+				bank.host_dirty[w] = 0;
+			}
+			while (word != 0) {
+				const size_t p = w * 64 + __builtin_ctzll(word);
+				word &= word - 1;
+				// This is a writable page, we will copy it using the "real"
+				// address from the master VM.
+				if (run_pages != 0 && p == run_begin + run_pages
+					&& bank.page_vaddr[p] == bank.page_vaddr[run_begin] + run_pages * PageSize()) {
+					run_pages++;
+					continue;
+				}
+				flush_run();
+				run_begin = p;
+				run_pages = 1;
+			}
+		}
+		flush_run();
+	}
+}
+
+void vMemory::record_working_set(size_t history)
+{
+	std::vector<uint64_t> pages;
+	for (const auto& bank : banks) {
+		for (size_t w = 0; w < bank.cow_pages.size(); w++) {
+			uint64_t word = bank.cow_pages[w];
+			while (word != 0) {
+				const size_t p = w * 64 + __builtin_ctzll(word);
+				word &= word - 1;
+				pages.push_back(bank.page_vaddr[p]);
+			}
+		}
+	}
+	std::sort(pages.begin(), pages.end());
+	if (!prefetched_pages.empty()) {
+		// Prefetched pages only belong to the working set if the
+		// guest actually accessed them during the last request.
+		std::erase_if(pages, [&] (uint64_t vaddr) {
+			if (!std::binary_search(prefetched_pages.begin(), prefetched_pages.end(), vaddr))
+				return false;
+			bool accessed = false;
+			tinykvm::page_at(*this, vaddr, [&] (uint64_t, uint64_t& entry, size_t) {
+				accessed = (entry & PDE64_ACCESSED) != 0;
+			}, true);
+			return !accessed;
+		});
+	}
+
+	history = std::max(history, size_t(1));
+	if (working_set.size() != history) {
+		working_set.resize(history);
+		working_set_idx = 0;
 	}
+	working_set.at(working_set_idx) = std::move(pages);
+	working_set_idx = (working_set_idx + 1) % history;
+}
+size_t vMemory::prefetch_working_set(size_t max_pages)
+{
+	prefetched_pages.clear();
+	for (const auto& pages : working_set) {
+		prefetched_pages.insert(prefetched_pages.end(), pages.begin(), pages.end());
+	}
+	std::sort(prefetched_pages.begin(), prefetched_pages.end());
+	prefetched_pages.erase(
+		std::unique(prefetched_pages.begin(), prefetched_pages.end()),
+		prefetched_pages.end());
+	if (prefetched_pages.size() > max_pages)
+		prefetched_pages.resize(max_pages);
+
+	size_t count = 0;
+	WritablePageOptions opts;
+	opts.zeroes = false;
+	for (const uint64_t vaddr : prefetched_pages) {
+		try {
+			writable_page_at(*this, vaddr, PDE64_USER | PDE64_RW, opts);
+			// The CPU sets the accessed bit if the guest uses the page
+			tinykvm::page_at(*this, vaddr, [] (uint64_t, uint64_t& entry, size_t) {
+				entry &= ~PDE64_ACCESSED;
+			}, true);
+			count++;
+		} catch (const MemoryException&) {
+			// The page is no longer writable, or we ran out of
+			// working memory. Either way, the guest will fault.
+		}
+	}
+	return count;
 }
 
 bool vMemory::fork_reset(const Machine& main_vm, const MachineOptions& options)
 {
-	if (options.reset_keep_all_work_memory) {
+	this->invalidate_tlb();
+	this->page_counters = {};
+	banks.reset_peak_used_pages();
+	if (options.reset_keep_all_work_memory && !this->aliased_pages) {
 		// With this method, instead of resetting the memory banks,
-		// and the pagetables, which requires an expensive mov cr3,
-		// we will iterate the pagetables and copy non-CoW pages
+		// and the pagetables, which requires a mov cr3 on the next
+		// entry, we will iterate the pagetables and copy non-CoW pages
 		// from the master VM to this forked VM. This is a gamble
 		// that it's cheaper to copy than the TLB flushes that happen
 		// from the mov cr3.
@@ -180,27 +477,12 @@ bool vMemory::fork_reset(const Machine& main_vm, const MachineOptions& options)
 			if (used > uint64_t(options.reset_free_work_mem)) {
 				//fprintf(stderr, "Freeing %zu bytes of work memory\n", used);
 				this->banks.reset(options);
-				cow_written_pages.clear();
 				return true;
 			}
 		}
 		// Restore the original memory from the master VM.
 		try {
-		for (const uint64_t addr : cow_written_pages) {
-			tinykvm::page_at(*this, addr, [&](uint64_t addr, uint64_t& entry, uint64_t page_size) {
-				static constexpr uint64_t PDE64_ADDR_MASK = ~0x8000000000000FFF;
-				const uint64_t bank_addr = entry & PDE64_ADDR_MASK;
-				//fprintf(stderr, "Copying virtual page %016lx from physical %016lx with size %lu\n",
-				//	addr, bank_addr, page_size);
-
-				// This is a writable page, we will copy it using the "real"
-				// address from the master VM.
-				auto* our_page = this->safely_at(bank_addr, page_size);
-				// Find the page in the main VM
-				page_duplicate((uint64_t*)our_page,
-					(const uint64_t*)main_vm.main_memory().safely_at(addr, page_size));
-			}, false);
-		}
+		this->restore_cow_pages(main_vm.main_memory());
 		return false;
 		} catch (const std::exception& e) {
 			/// XXX: Silently ignore the exception, as we will just completely reset the memory banks
@@ -210,15 +492,18 @@ bool vMemory::fork_reset(const Machine& main_vm, const MachineOptions& options)
 	}
 	// Reset the memory banks (also fallback if the above fails)
 	banks.reset(options);
-	cow_written_pages.clear();
+	this->aliased_pages = false;
 	return true;
 }
 void vMemory::fork_reset(const vMemory& other, const MachineOptions& options)
 {
+	this->invalidate_tlb();
+	this->page_counters = {};
 	this->physbase = other.physbase;
 	this->safebase = other.safebase;
 	this->owned    = false;
 	this->ptr  = other.ptr;
+	this->master_ptr = other.master_ptr;
 	this->size = other.size;
 	banks.reset(options);
 }
@@ -263,6 +548,9 @@ uint64_t* vMemory::page_at(uint64_t addr) const
 			return (uint64_t *)(vmem.ptr + (addr - vmem.physbase));
 		}
 	}
+	if (addr == ZERO_PAGE_ADDRESS && zero_page_idx >= 0) {
+		return (uint64_t *)host_zero_page();
+	}
 	/* Remote machine always last resort */
 	if (machine.has_remote()) {
 		return machine.remote().main_memory().page_at(addr);
@@ -369,6 +657,8 @@ vMemory::AllocationResult vMemory::allocate_mapped_memory(
 			memory_exception("Failed to allocate guest memory", 0, size);
 		}
 	}
+	/* Before the memory is touched, which would place it */
+	numa_bind(ptr, size, options.numa_node, options.numa_interleave);
 	int advice = 0x0;
 	if (!options.short_lived) {
 		advice |= MADV_MERGEABLE;
@@ -427,6 +717,29 @@ vMemory::AllocationResult
 		}
 		ptr = (char*) mmap(NULL, size, PROT_READ | PROT_WRITE,
 			MAP_SHARED | MAP_NORESERVE, fd, 0);
+	} else if (options.snapshot_lazy_restore) {
+		// Only read the state area now, and the memory on demand,
+		// once the memory is registered by SnapshotRestore.
+		ptr = (char*) mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (ptr == MAP_FAILED) {
+			close(fd);
+			memory_exception("Failed to mmap VM snapshot memory", 0, size);
+		}
+		const size_t state_offset = size - ColdStartStateSize();
+		if (pread(fd, ptr + state_offset, ColdStartStateSize(), state_offset) != ssize_t(ColdStartStateSize())) {
+			munmap(ptr, size);
+			close(fd);
+			throw std::runtime_error("Failed to read VM snapshot state: " + filename);
+		}
+		if (is_loadable_snapshot_state(ptr + state_offset)) {
+			// The file stays open for SnapshotRestore
+			return AllocationResult{ptr, size - ColdStartStateSize(), fd};
+		}
+		// Nothing to restore, so map the file as usual
+		munmap(ptr, size);
+		ptr = (char*) mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_NORESERVE, fd, 0);
 	} else {
 		// Map an existing file, which should not be modified on disk
 		ptr = (char*) mmap(NULL, size, PROT_READ | PROT_WRITE,
@@ -449,6 +762,16 @@ vMemory vMemory::New(Machine& m, const MachineOptions& options,
 		throw MachineException("Invalid physical memory alignment. Must be at least 2MB aligned.", phys);
 	// Over-allocate in order to avoid trouble with 2MB-aligned operations
 	size = vMemory::overaligned_memsize(size);
+	// Decompress a packed snapshot into anonymous memory
+	if (!options.snapshot_packed_file.empty()) {
+		const auto [res_ptr, res_size, fd] = allocate_packed_memory(options, size);
+		return vMemory(m, options, phys, safe, res_ptr, res_size, fd);
+	}
+	// Attach to, or create, a memory file that can be shared
+	if (options.snapshot_memfd >= 0 || options.memfd_main_memory) {
+		const auto [res_ptr, res_size, fd] = allocate_memfd_memory(options, size);
+		return vMemory(m, options, phys, safe, res_ptr, res_size, fd);
+	}
 	// Use file-backed memory if requested
 	if (!options.snapshot_file.empty()) {
 		const auto [res_ptr, res_size, fd] = allocate_filebacked_memory(options, size);
@@ -464,14 +787,144 @@ VirtualMem vMemory::vmem() const
 	return VirtualMem::New(physbase, ptr, size, remote_end);
 }
 
+size_t vMemory::discard(uint64_t addr, size_t len)
+{
+	const uint64_t begin = std::max((addr + PageMask()) & ~PageMask(), physbase);
+	const uint64_t end = std::min((addr + len) & ~PageMask(), physbase + size);
+	if (!this->sparse || begin >= end)
+		return 0;
+	if (madvise(ptr + (begin - physbase), end - begin, MADV_DONTNEED) != 0)
+		return 0;
+	return (end - begin) / PageSize();
+}
+size_t vMemory::discard_zero_pages()
+{
+	if (!this->sparse)
+		return 0;
+	/* The residency of one 2MB chunk at a time, so that
+	   large and mostly untouched memory is cheap to walk */
+	static constexpr size_t CHUNK = 2ULL << 20;
+	unsigned char resident[CHUNK / PageSize()];
+	size_t discarded = 0;
+	for (size_t offset = 0; offset < this->size; offset += CHUNK)
+	{
+		char* chunk = this->ptr + offset;
+		const size_t pages = std::min(CHUNK, this->size - offset) / PageSize();
+		if (mincore(chunk, pages * PageSize(), resident) != 0)
+			continue;
+		/* Pages that are not resident extend a run, for free */
+		size_t run_begin = 0, run_zeroes = 0;
+		for (size_t p = 0; p <= pages; p++)
+		{
+			const char* page = chunk + p * PageSize();
+			if (p < pages && (!(resident[p] & 1) || page_is_zeroed((const uint64_t *)page))) {
+				run_zeroes += (resident[p] & 1);
+				continue;
+			}
+			if (run_zeroes > 0 && madvise(chunk + run_begin * PageSize(),
+					(p - run_begin) * PageSize(), MADV_DONTNEED) == 0)
+				discarded += run_zeroes;
+			run_begin = p + 1;
+			run_zeroes = 0;
+		}
+	}
+	return discarded;
+}
+size_t vMemory::resident_pages() const
+{
+	static constexpr size_t CHUNK = 2ULL << 20;
+	unsigned char resident[CHUNK / PageSize()];
+	size_t count = 0;
+	for (size_t offset = 0; offset < this->size; offset += CHUNK)
+	{
+		const size_t pages = std::min(CHUNK, this->size - offset) / PageSize();
+		if (mincore(this->ptr + offset, pages * PageSize(), resident) != 0)
+			continue;
+		for (size_t p = 0; p < pages; p++)
+			count += (resident[p] & 1);
+	}
+	return count;
+}
+
+thread_local PageReserve* vMemory::current_page_reserve = nullptr;
+
 MemoryBank::Page vMemory::new_page()
 {
-	return banks.get_available_bank(1u).get_next_page(1u);
+	PageReserve* reserve = current_page_reserve;
+	if (reserve != nullptr && reserve->count > 0 && reserve->banks == &banks
+		&& reserve->generation == banks.generation())
+	{
+		return reserve->pages[--reserve->count];
+	}
+	return banks.get_page();
+}
+MemoryBank::Page vMemory::new_table_page()
+{
+	this->page_counters.tables++;
+	if (banks.keep_page_tables())
+		return banks.get_table_page();
+	return this->new_page();
+}
+void vMemory::refill_page_reserve(PageReserve& reserve)
+{
+	unsigned first = 0;
+	{
+		std::scoped_lock lock(this->mtx_smp);
+		if (reserve.banks != &banks || reserve.generation != banks.generation()) {
+			/* Pages from before a reset are no longer ours */
+			reserve.banks = &banks;
+			reserve.generation = banks.generation();
+			reserve.count = 0;
+		} else if (reserve.count >= PageReserve::LOW_WATER) {
+			return;
+		}
+		first = reserve.count;
+		try {
+			while (reserve.count < PageReserve::PAGES) {
+				reserve.pages[reserve.count] = banks.get_page();
+				reserve.count++;
+			}
+		} catch (const MemoryException&) {
+			/* Out of memory is reported by new_page() when it happens */
+		}
+	}
+	for (unsigned i = first; i < reserve.count; i++) {
+		auto& page = reserve.pages[i];
+		if (page.dirty) {
+			page_memzero(page.pmem);
+			page.dirty = false;
+		}
+	}
 }
 MemoryBank::Page vMemory::new_hugepage()
 {
 	return banks.get_available_bank(512u).get_next_page(512u);
 }
+bool vMemory::split_hugepage_at(uint64_t addr) const noexcept
+{
+	if (!split_hugepages)
+		return false;
+	const bool in_heap = hugepage_cow_heap &&
+		addr >= machine.stack_address() && addr < machine.brk_end_address();
+	const bool in_mmap = hugepage_cow_mmap &&
+		addr >= machine.mmap_start() && addr < machine.mmap_current();
+	if (in_heap || in_mmap) {
+		/* Fall back to splitting when out of hugepage-sized room. */
+		return !banks.room_for_hugepage();
+	}
+	return true;
+}
+
+uint64_t vMemory::zero_page()
+{
+	if (zero_page_idx < 0) {
+		const unsigned idx = this->allocate_region_idx();
+		machine.install_memory(idx,
+			VirtualMem(ZERO_PAGE_ADDRESS, host_zero_page(), PageSize()), true);
+		this->zero_page_idx = idx;
+	}
+	return ZERO_PAGE_ADDRESS;
+}
 
 char* vMemory::get_writable_page(uint64_t addr, uint64_t flags, bool zeroes, bool dirty)
 {
@@ -497,8 +950,12 @@ char* vMemory::get_kernelpage_at(uint64_t addr) const
 		return machine.remote().main_memory().get_kernelpage_at(addr);
 	}
 #ifdef TINYKVM_ARCH_AMD64
+	if (char* page = this->tlb_lookup(addr, TLB_KERNEL); page != nullptr)
+		return page;
 	constexpr uint64_t flags = PDE64_PRESENT;
-	return readable_page_at(*this, addr, flags);
+	char* page = readable_page_at(*this, addr, flags);
+	this->tlb_insert(addr, page, TLB_KERNEL);
+	return page;
 #else
 #error "Implement me!"
 #endif
@@ -511,8 +968,12 @@ char* vMemory::get_userpage_at(uint64_t addr) const
 		return machine.remote().main_memory().get_userpage_at(addr);
 	}
 #ifdef TINYKVM_ARCH_AMD64
+	if (char* page = this->tlb_lookup(addr, TLB_USER); page != nullptr)
+		return page;
 	constexpr uint64_t flags = PDE64_PRESENT | PDE64_USER;
-	return readable_page_at(*this, addr, flags);
+	char* page = readable_page_at(*this, addr, flags);
+	this->tlb_insert(addr, page, TLB_KERNEL | TLB_USER);
+	return page;
 #else
 #error "Implement me!"
 #endif
@@ -522,13 +983,134 @@ std::vector<std::pair<uint64_t, uint64_t>> Machine::get_accessed_pages() const
 {
 	return tinykvm::get_accessed_pages(this->main_memory());
 }
+size_t Machine::harvest_accessed_pages(AccessedPage* pages, size_t max)
+{
+	return tinykvm::harvest_accessed_pages(this->memory, pages, max, this->is_forked());
+}
+size_t Machine::deduplicate_pages()
+{
+	if (!this->m_prepped || this->is_forked()) {
+		throw MachineException("Only prepared master VMs can be deduplicated");
+	}
+	if (!memory.dedup_capable || memory.snapshot_restore != nullptr) {
+		return 0;
+	}
+	/* The user pages below the shared memory boundary */
+	const uint64_t begin = std::max(memory.physbase, (uint64_t)this->kernel_end_address());
+	const uint64_t end = std::min(memory.physbase + memory.size, m_makecow_boundary);
+	if (begin >= end) {
+		return 0;
+	}
+	std::vector<uint64_t> previous;
+	previous.swap(memory.dedup_pages);
+	const size_t shared = PageDedupStore::get().deduplicate(
+		memory.ptr + (begin - memory.physbase), end - begin, memory.dedup_pages);
+	/* Pages that are deduplicated again are referenced twice now */
+	if (!previous.empty())
+		PageDedupStore::get().release(previous);
+	return shared;
+}
+size_t Machine::release_pages(address_t addr, size_t len)
+{
+	if (!this->uses_cow_memory() && memory.safely_within(addr, len))
+		return memory.discard(addr, len);
+	/* Other vCPUs could still have the pages in their TLBs */
+	if (!this->uses_cow_memory() || this->smp_active())
+		return 0;
+	auto pages = tinykvm::release_private_pages(this->memory, addr, len);
+	if (pages.empty())
+		return 0;
+	memory.banks.release_pages(pages);
+	/* The entries now point at the zero page, so the page tables
+	   can no longer be restored in place, see fork_reset(). */
+	memory.aliased_pages = true;
+	vcpu.flush_tlb();
+	m_memory_pressure -= std::min(m_memory_pressure, pages.size());
+	return pages.size();
+}
+size_t Machine::reclaim_main_memory()
+{
+	/* Forks read the main memory of a prepared master */
+	if (this->uses_cow_memory())
+		return 0;
+	return memory.discard_zero_pages();
+}
+void Machine::memory_balloon(vCPU& cpu)
+{
+	auto& regs = cpu.registers();
+	switch (regs.rdi) {
+	case 0: /* How many pages the host wants back */
+		regs.rax = m_memory_pressure;
+		break;
+	case 1: /* Hand back [rsi, rsi + rdx) */
+		regs.rax = this->release_pages(regs.rsi, regs.rdx);
+		break;
+	default:
+		regs.rax = -EINVAL;
+	}
+	cpu.set_registers(regs);
+}
 size_t Machine::banked_memory_pages() const noexcept
 {
 	size_t count = 0;
 	for (const auto& bank : memory.banks) {
 		count += bank.n_used;
 	}
-	return count;
+	return count - memory.banks.released_pages();
+}
+Machine::MemoryStats Machine::memory_stats() const
+{
+	static constexpr uint64_t PDE64_ADDR_MASK = ~0x8000000000000FFF;
+	MemoryStats stats;
+	const auto& banks = memory.banks;
+	stats.used_pages = this->banked_memory_pages();
+	stats.peak_used_pages = std::max(banks.peak_used_pages(), stats.used_pages);
+	stats.allocated_pages = this->banked_memory_allocated_pages();
+	stats.capacity_pages = this->banked_memory_capacity_pages();
+	stats.released_pages = banks.released_pages();
+	stats.reclaimable_pages = banks.reclaimable_pages();
+	stats.copied_pages = memory.page_counters.copied;
+	stats.zeroed_pages = memory.page_counters.zeroed;
+	stats.table_pages = memory.page_counters.tables;
+	stats.hugepages = memory.page_counters.hugepages;
+	stats.unlocked_pages = memory.unlocked_memory_pages();
+	if (memory.owned)
+		stats.resident_main_pages = memory.resident_pages();
+	for (const auto& range : memory.mmap_ranges)
+		stats.file_backed_pages += range.size / vMemory::PageSize();
+
+	const uint64_t brk_begin = this->brk_begin_address();
+	const uint64_t brk_end = this->brk_end_address();
+	const uint64_t stack_begin = m_stack_address - std::min<uint64_t>(m_stack_address,
+		MachineOptions{}.stack_size);
+	const uint64_t mmap_begin = this->mmap_start();
+	const uint64_t mmap_end = this->mmap_current();
+
+	auto& banks_rw = const_cast<MemoryBanks&>(banks);
+	tinykvm::foreach_page(this->memory,
+	[&] (uint64_t addr, uint64_t& entry, size_t size) {
+		const uint64_t paddr = entry & PDE64_ADDR_MASK;
+		const MemoryBank* bank = banks_rw.bank_of(paddr);
+		if (bank == nullptr)
+			return;
+		const bool leaf = (size == vMemory::PageSize()) || (entry & PDE64_PS);
+		if (!leaf) {
+			stats.mapped_table_pages++;
+			return;
+		}
+		const size_t pages = size / vMemory::PageSize();
+		if (pages > 1)
+			stats.mapped_hugepages++;
+		if (addr >= brk_begin && addr < brk_end)
+			stats.heap_pages += pages;
+		else if (addr >= stack_begin && addr < m_stack_address)
+			stats.stack_pages += pages;
+		else if (addr >= mmap_begin && addr < mmap_end)
+			stats.mmap_pages += pages;
+		else
+			stats.other_pages += pages;
+	}, false);
+	return stats;
 }
 size_t Machine::banked_memory_allocated_pages() const noexcept
 {
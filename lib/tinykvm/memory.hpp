@@ -3,21 +3,25 @@
 #include "memory_bank.hpp"
 #include "virtual_mem.hpp"
 #include <cstddef>
+#include <memory>
 #include <mutex>
 #include <string_view>
+#include <unordered_map>
 
 namespace tinykvm {
 struct Machine;
 struct MemoryBanks;
+struct SnapshotRestore;
 
 struct vMemory {
 	static constexpr uint64_t MMAP_PHYS_BASE = 0x4000000000;
+	/* Guest-physical address of the read-only shared zero page */
+	static constexpr uint64_t ZERO_PAGE_ADDRESS = MemoryBanks::ARENA_BASE_ADDRESS - 0x1000;
 	static constexpr uint64_t PageSize() {
 		return 4096u;
 	}
 
 	Machine& machine;
-	std::vector<uint64_t> cow_written_pages{};
 	uint64_t physbase;
 	uint64_t safebase;
 	uint64_t page_tables;
@@ -31,16 +35,69 @@ struct vMemory {
 	int    snapshot_fd = -1;
 	/* Remote end pointer for this memory */
 	uint64_t remote_end = 0;
-	bool     remote_must_update_gigapages = true;
+	/* Set whenever a gigabyte entry changes, even from const paths
+	   that populate lazy gigapages. */
+	mutable bool remote_must_update_gigapages = true;
+	/* Pre-built PDPT entries covering this memory, which callers copy
+	   into their own page tables. Rebuilt (with a new version) when
+	   remote_must_update_gigapages is set. */
+	std::vector<uint64_t> remote_pdpt_entries;
+	uint64_t remote_pdpt_version = 0;
 	/* Use memory banks only for page tables, write directly
 	   to main memory. Used with is_forkable_master(). */
 	bool   main_memory_writes = false;
 	/* Split into small pages (4K) when reaching a leaf hugepage. */
 	bool   split_hugepages = true;
+	/* Copy whole hugepages in the heap and mmap arena, even when splitting. */
+	bool   hugepage_cow_heap = false;
+	bool   hugepage_cow_mmap = false;
+	/* Page table entries point at pages of other VMs, so the
+	   page tables must be reset along with the working memory */
+	bool   aliased_pages = false;
+	/* Map the shared zero page when zeroing whole CoW pages */
+	bool   shared_zero_page = false;
+	int    zero_page_idx = -1;
 	/* Executable heap */
 	bool   executable_heap = false;
 	/* Enable file-backed memory mappings for large files */
 	bool   mmap_backed_files = true;
+	/* Attach read-only file mappings from the FileMappingCache */
+	bool   shared_file_mappings = false;
+	/* Main memory is private anonymous 4k pages, which can be
+	   replaced by pages of the PageDedupStore */
+	bool   dedup_capable = false;
+	std::vector<uint64_t> dedup_pages; // Pool offsets, one reference each
+	/* Main memory is private anonymous 4k pages, populated on first
+	   touch, and unused pages are given back, see sparse_main_memory */
+	bool   sparse = false;
+	/* Give back the host pages of main memory wholly inside
+	   [addr, addr+len), which read as zeroes afterwards.
+	   Returns the number of pages. */
+	size_t discard(uint64_t addr, size_t len);
+	/* Give back the resident host pages of main memory that only
+	   hold zeroes. Returns the number of pages. */
+	size_t discard_zero_pages();
+	/* The host pages of main memory that are resident */
+	size_t resident_pages() const;
+	/* The NUMA node main memory is bound to, or -1 */
+	int    numa_node = -1;
+	/* Main memory of the master, which is ptr unless this fork
+	   reads a copy of it on another NUMA node. Copies are made by
+	   numa_replica(), owned by the master and made read-only in
+	   spirit: the master must not write to its main memory. */
+	char*  master_ptr;
+	mutable std::mutex numa_mtx;
+	mutable std::unordered_map<int, char*> numa_replicas;
+	char*  numa_replica(int node) const;
+	/* Working memory handed out since the last reset, by what
+	   it holds, see Machine::memory_stats() */
+	struct PageCounters {
+		size_t copied = 0;    // Copy-on-write copies of master pages
+		size_t zeroed = 0;    // Zero-filled, or overwritten by the host
+		size_t tables = 0;    // Page-table pages
+		size_t hugepages = 0; // 2MB pages, also counted as 512 pages above
+		size_t split_hugepages = 0; // 2MB pages split into 4k pages
+	} page_counters;
 	/* Dynamic page memory */
 	MemoryBanks banks; // fault-in memory banks
 	/* mmap-ranges */
@@ -48,9 +105,31 @@ struct vMemory {
 	std::vector<unsigned> foreign_banks;
 	uint64_t mmap_physical_begin = MMAP_PHYS_BASE;
 	uint64_t mmap_physical = MMAP_PHYS_BASE;
+	/* Learned working set: the CoW pages of the previous requests,
+	   and the pages that were prefetched for the current request. */
+	std::vector<std::vector<uint64_t>> working_set;
+	std::vector<uint64_t> prefetched_pages;
+	size_t working_set_idx = 0;
 	/* SMP mutex */
 	std::mutex mtx_smp;
 	bool smp_guards_enabled = false;
+	/* The page reserve of the vCPU handling a page fault on this
+	   thread, if any. new_page() takes from it before the banks. */
+	static thread_local PageReserve* current_page_reserve;
+	/* Top up a reserve, taking mtx_smp only while allocating */
+	void refill_page_reserve(PageReserve&);
+	/* Software TLB: Each host thread remembers the host pages of the
+	   guest pages it resolved, until the generation of this memory
+	   changes. Anything that changes or removes a page table entry
+	   must call invalidate_tlb(). Generations are unique process-wide. */
+	static constexpr unsigned TLB_KERNEL = 0x1; // Present
+	static constexpr unsigned TLB_USER   = 0x2; // Present and user
+	static constexpr unsigned TLB_WRITE  = 0x4; // Private, writable and dirty
+	char* tlb_lookup(uint64_t addr, unsigned access) const noexcept;
+	void  tlb_insert(uint64_t addr, char* page, unsigned access) const noexcept;
+	void  invalidate_tlb() const noexcept;
+	static uint64_t new_tlb_generation() noexcept;
+	mutable uint64_t tlb_generation = new_tlb_generation();
 
 	/* Unsafe */
 	bool within(uint64_t addr, size_t asize) const noexcept {
@@ -72,8 +151,17 @@ struct vMemory {
 	char *get_writable_page(uint64_t addr, uint64_t flags, bool zeroes, bool dirty);
 	MemoryBank::Page new_page();
 	MemoryBank::Page new_hugepage();
+	/* A page for a cloned or split page table, which comes from the
+	   page-table banks when they are kept across resets. The page
+	   must be completely overwritten, as it is not zeroed. */
+	MemoryBank::Page new_table_page();
+	/* Install the shared zero page, if needed, and return its address */
+	uint64_t zero_page();
+	/* Copy-on-write policy for writes to a leaf 2MB page at addr */
+	bool split_hugepage_at(uint64_t addr) const noexcept;
 
-	bool compare(const vMemory& other);
+	/* Both have the same main memory, or copies of it */
+	bool compare(const vMemory& other) const noexcept;
 	/* When a main VM has direct memory writes enabled, it can
 	   write directly to its own memory, but in order to constrain
 	   the memory usage, we need to keep track of the number of
@@ -86,7 +174,11 @@ struct vMemory {
 	VirtualMem vmem() const;
 
 	[[noreturn]] static void memory_exception(const char*, uint64_t, uint64_t, bool oom = false);
-	void record_cow_leaf_user_page(uint64_t addr);
+	void record_cow_leaf_user_page(uint64_t addr, uint64_t paddr, size_t size);
+	void record_host_write(uint64_t addr, uint64_t paddr, size_t size);
+	void restore_cow_pages(const vMemory& master);
+	void record_working_set(size_t history);
+	size_t prefetch_working_set(size_t max_pages);
 	bool fork_reset(const Machine&, const MachineOptions&); // Returns true if a full reset was done
 	void fork_reset(const vMemory& other, const MachineOptions&);
 	static vMemory New(Machine&, const MachineOptions&, uint64_t phys, uint64_t safe, size_t size);
@@ -102,6 +194,9 @@ struct vMemory {
 	void install_mmap_ranges(const Machine& other);
 	void delete_foreign_mmap_ranges();
 	void delete_foreign_banks();
+	/* Swap in the mmap ranges of a new master, keeping the memory
+	   slots of ranges that are identical in both masters. */
+	void rebase_mmap_ranges(const Machine& new_master);
 	/* Loan memory from another machine */
 	vMemory(Machine&, const MachineOptions&, const vMemory& other);
 	~vMemory();
@@ -114,6 +209,7 @@ struct vMemory {
 		return 2UL << 20; // 2MB
 	}
 	bool has_loadable_snapshot_state() const noexcept;
+	static bool is_loadable_snapshot_state(const void* area) noexcept;
 	void* get_snapshot_state_area() const;
 	int get_snapshot_memory_fd() const noexcept {
 		return snapshot_fd;
@@ -121,10 +217,34 @@ struct vMemory {
 	bool has_snapshot_area() const noexcept {
 		return snapshot_fd != -1;
 	}
+	/* Identify the base snapshot, and stack the delta snapshots on top
+	   of it. Must be called before anything writes to the memory. */
+	void load_snapshot_deltas(const std::vector<std::string>& deltas);
+	/* Write the pages that changed since load_snapshot_deltas() to a
+	   delta snapshot file. Returns the number of pages written. */
+	size_t save_snapshot_delta(const std::string& filename) const;
+	/* Write the memory to a packed snapshot file, with deduplicated
+	   pages, no zero pages and compressed blocks. Returns the size. */
+	size_t save_packed_snapshot(const std::string& filename) const;
+	/* The base snapshot and the deltas on top of it, or 0 when the
+	   memory was not loaded from a snapshot. */
+	uint64_t snapshot_chain_id = 0;
+	/* Hashes of the pages loaded from delta snapshots */
+	std::unordered_map<uint64_t, uint64_t> snapshot_delta_pages;
+	/* Fills in the memory from the snapshot file on demand */
+	std::unique_ptr<SnapshotRestore> snapshot_restore;
+	/* The memory was loaded from a packed snapshot */
+	bool snapshot_packed = false;
+	/* The memory file of MachineOptions::memfd_main_memory, owned
+	   by the master, and sealed once it is shared */
+	int  memfd = -1;
+	bool memfd_sealed = false;
 private:
 	using AllocationResult = std::tuple<char*, size_t, int>;
 	static AllocationResult allocate_mapped_memory(const MachineOptions&, size_t size);
 	static AllocationResult allocate_filebacked_memory(const MachineOptions&, size_t size);
+	static AllocationResult allocate_packed_memory(const MachineOptions&, size_t size);
+	static AllocationResult allocate_memfd_memory(const MachineOptions&, size_t size);
 	std::vector<unsigned> m_bank_idx_free_list;
 };
 
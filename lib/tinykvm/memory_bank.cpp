@@ -2,7 +2,10 @@
 
 #include "common.hpp"
 #include "machine.hpp"
+#include "numa.hpp"
+#include "page_streaming.hpp"
 #include "virtual_mem.hpp"
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <malloc.h>
@@ -23,6 +26,12 @@ MemoryBanks::MemoryBanks(Machine& machine, const MachineOptions& options)
 	}
 	this->set_max_pages(options.max_cow_mem / vMemory::PageSize(),
 		options.hugepages_arena_size / vMemory::PageSize());
+	this->m_dirty_page_logging = options.reset_dirty_page_logging
+		&& options.reset_keep_all_work_memory;
+	this->m_shared_arena = options.shared_bank_arena;
+	this->m_keep_page_tables = options.reset_keep_page_tables;
+	this->m_numa_node = options.numa_node;
+	this->m_numa_interleave = options.numa_interleave;
 }
 void MemoryBanks::init_from(const MemoryBanks& other)
 {
@@ -61,9 +70,12 @@ char* MemoryBanks::try_alloc(size_t N, bool try_hugepages)
 			MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_HUGETLB, -1, 0);
 	}
 	if (ptr == MAP_FAILED) {
-		return (char*) mmap(NULL, N * vMemory::PageSize(), PROT_READ | PROT_WRITE,
+		ptr = (char*) mmap(NULL, N * vMemory::PageSize(), PROT_READ | PROT_WRITE,
 			MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+		if (ptr == MAP_FAILED)
+			return ptr;
 	}
+	numa_bind(ptr, N * vMemory::PageSize(), m_numa_node, m_numa_interleave);
 	return ptr;
 }
 
@@ -76,7 +88,15 @@ MemoryBank& MemoryBanks::allocate_new_bank(uint64_t addr, unsigned pages)
 	if (try_hugepages) {
 		pages = m_hugepage_pages;
 	}
-	char* mem = this->try_alloc(pages, try_hugepages);
+	const bool from_arena = m_shared_arena && !try_hugepages
+		&& pages == MemoryBank::N_PAGES;
+	MemoryBankArena::Allocation alloc {nullptr, 0};
+	if (from_arena) {
+		alloc = MemoryBankArena::get().acquire();
+	} else {
+		alloc.mem = this->try_alloc(pages, try_hugepages);
+	}
+	char* mem = alloc.mem;
 	if (mem == nullptr) {
 		pages = 16;
 		mem = this->try_alloc(pages, false);
@@ -85,14 +105,19 @@ MemoryBank& MemoryBanks::allocate_new_bank(uint64_t addr, unsigned pages)
 
 	const size_t size = pages * vMemory::PageSize();
 	if (mem != nullptr) {
-		m_mem.emplace_back(*this, mem, addr, pages, m_idx);
+		auto& bank = m_mem.emplace_back(*this, mem, addr, pages, m_idx);
+		if (from_arena && mem == alloc.mem) {
+			/* Recycled banks are lazily zeroed */
+			bank.from_arena = true;
+			bank.n_dirty = alloc.n_dirty;
+		}
 
 		VirtualMem vmem { addr, mem, size };
 		if constexpr (VERBOSE_MEMORY_BANK) {
 			printf("  Allocated bank %zu (slot %u) at 0x%lX with %u pages (%zu KiB)\n",
 				m_mem.size(), m_idx, addr, pages, size >> 10);
 		}
-		m_machine.install_memory(m_idx++, vmem, false);
+		m_machine.install_memory(m_idx++, vmem, false, m_dirty_page_logging);
 
 		return m_mem.back();
 	}
@@ -106,7 +131,7 @@ MemoryBank& MemoryBanks::get_available_bank(size_t pages)
 	/* Try to find room for the pages. */
 	for (unsigned idx = 0; idx < m_mem.size(); idx++) {
 		auto& bank = m_mem.at(idx);
-		if (bank.room_for(pages)) {
+		if (!bank.page_tables && bank.room_for(pages)) {
 			if constexpr (VERBOSE_MEMORY_BANK) {
 				printf("Reusing bank slot=%u at 0x%lX with %zu/%u used pages\n",
 					bank.idx, bank.addr, bank.n_used + pages, bank.n_pages);
@@ -120,26 +145,35 @@ MemoryBank& MemoryBanks::get_available_bank(size_t pages)
 			printf("Allocating new bank at 0x%lX with total pages %u/%u\n",
 				m_arena_next, m_num_pages, m_max_pages);
 		}
-		auto& bank = this->allocate_new_bank(m_arena_next, MemoryBank::N_PAGES);
-		m_num_pages += bank.n_pages;
-		m_arena_next += bank.size();
-		return bank;
+		return this->allocate_next_bank();
 	}
 	/* Find room but with possible fragmentation. */
 	if (pages == MemoryBank::N_HUGEPAGES) {
 		for (unsigned idx = 0; idx < m_mem.size(); idx++) {
 			auto& bank = m_mem.at(idx);
 			const unsigned n_used = (bank.n_used + MemoryBank::N_HUGEPAGES - 1) & ~(MemoryBank::N_HUGEPAGES - 1);
-			if (n_used + pages <= bank.n_pages) {
+			if (!bank.page_tables && n_used + pages <= bank.n_pages) {
 				if constexpr (VERBOSE_MEMORY_BANK) {
 					printf("Reusing bank (fragmented) slot=%u at 0x%lX with %zu/%u used pages\n",
 						bank.idx, bank.addr, n_used + pages, bank.n_pages);
 				}
+				m_used_pages += n_used - bank.n_used;
 				bank.n_used = n_used;
 				return bank;
 			}
 		}
 	}
+	this->out_of_working_memory(pages);
+}
+MemoryBank& MemoryBanks::allocate_next_bank()
+{
+	auto& bank = this->allocate_new_bank(m_arena_next, MemoryBank::N_PAGES);
+	m_num_pages += bank.n_pages;
+	m_arena_next += bank.size();
+	return bank;
+}
+void MemoryBanks::out_of_working_memory(size_t pages) const
+{
 	if constexpr (VERBOSE_MEMORY_BANK) {
 		fprintf(stderr, "Out of working memory requesting %zu pages, %u vs %u max pages\n",
 			pages, m_num_pages, m_max_pages);
@@ -147,6 +181,128 @@ MemoryBank& MemoryBanks::get_available_bank(size_t pages)
 	throw MemoryException("Out of working memory",
 		m_num_pages * vMemory::PageSize(), m_max_pages * vMemory::PageSize(), true);
 }
+MemoryBank::Page MemoryBanks::get_table_page()
+{
+	if (!m_free_tables.empty()) {
+		const uint64_t paddr = m_free_tables.back();
+		m_free_tables.pop_back();
+		auto* bank = this->bank_of(paddr);
+		return {(uint64_t *)bank->at(paddr), paddr, vMemory::PageSize(), true};
+	}
+	for (auto& bank : m_mem) {
+		if (bank.page_tables && bank.room_for(1u))
+			return bank.get_next_page(1u);
+	}
+	/* The first bank may be backed by hugepages, which is for data */
+	if (m_mem.empty())
+		this->get_available_bank(1u);
+	/* The first page-table bank is always allowed, like the first bank */
+	const bool first = std::none_of(m_mem.begin(), m_mem.end(),
+		[] (const MemoryBank& bank) { return bank.page_tables; });
+	if (!first && m_num_pages >= m_max_pages)
+		this->out_of_working_memory(1u);
+	/* Page-table banks are small, but take up a whole bank slot
+	   in the arena, so that bank_of() can still index the banks. */
+	auto& bank = this->allocate_new_bank(m_arena_next, TABLE_BANK_PAGES);
+	bank.page_tables = true;
+	m_num_pages += bank.n_pages;
+	m_arena_next += MemoryBank::N_PAGES * vMemory::PageSize();
+	return bank.get_next_page(1u);
+}
+bool MemoryBanks::is_table_page(uint64_t paddr) noexcept
+{
+	auto* bank = this->bank_of(paddr);
+	return bank != nullptr && bank->page_tables;
+}
+void MemoryBanks::release_table_pages(std::vector<uint64_t>& used_pages)
+{
+	std::sort(used_pages.begin(), used_pages.end());
+	m_free_tables.clear();
+	for (const auto& bank : m_mem) {
+		if (!bank.page_tables)
+			continue;
+		for (uint32_t p = 0; p < bank.n_used; p++) {
+			const uint64_t paddr = bank.addr + p * vMemory::PageSize();
+			if (!std::binary_search(used_pages.begin(), used_pages.end(), paddr))
+				m_free_tables.push_back(paddr);
+		}
+	}
+}
+MemoryBank::Page MemoryBanks::get_page()
+{
+	if (!m_released.empty()) {
+		const uint64_t paddr = m_released.back();
+		m_released.pop_back();
+		m_used_pages++;
+		m_peak_used_pages = std::max(m_peak_used_pages, m_used_pages);
+		auto* bank = this->bank_of(paddr);
+		return {(uint64_t *)bank->at(paddr), paddr, vMemory::PageSize(), true};
+	}
+	return this->get_available_bank(1u).get_next_page(1u);
+}
+void MemoryBanks::release_pages(std::vector<uint64_t>& pages)
+{
+	std::sort(pages.begin(), pages.end());
+	for (size_t i = 0; i < pages.size(); )
+	{
+		auto* bank = this->bank_of(pages[i]);
+		/* Consecutive pages are given back to the kernel together */
+		size_t n = 1;
+		while (i + n < pages.size() && pages[i + n] == pages[i] + n * vMemory::PageSize()
+			&& bank->within(pages[i + n], vMemory::PageSize()))
+			n++;
+		madvise(bank->at(pages[i]), n * vMemory::PageSize(), MADV_DONTNEED);
+		for (size_t p = 0; p < n; p++) {
+			const size_t idx = (pages[i + p] - bank->addr) / vMemory::PageSize();
+			if (!bank->cow_pages.empty())
+				bank->cow_pages[idx / 64] &= ~(1UL << (idx % 64));
+			if (!bank->host_dirty.empty())
+				bank->host_dirty[idx / 64] &= ~(1UL << (idx % 64));
+			m_released.push_back(pages[i + p]);
+		}
+		m_used_pages -= n;
+		i += n;
+	}
+}
+size_t MemoryBanks::reclaimable_pages() const noexcept
+{
+	size_t count = 0;
+	for (const auto& bank : m_mem) {
+		if (!bank.page_tables && bank.n_dirty > bank.n_used)
+			count += bank.n_dirty - bank.n_used;
+	}
+	return count;
+}
+size_t MemoryBanks::trim()
+{
+	size_t count = 0;
+	for (auto& bank : m_mem) {
+		if (bank.page_tables || bank.n_dirty <= bank.n_used)
+			continue;
+		const uint32_t pages = bank.n_dirty - bank.n_used;
+		/* Hugepage banks can only give back whole hugepages */
+		if (madvise(bank.at(bank.addr + bank.n_used * vMemory::PageSize()),
+				pages * vMemory::PageSize(), MADV_DONTNEED) != 0)
+			continue;
+		bank.n_dirty = bank.n_used;
+		count += pages;
+	}
+	return count;
+}
+bool MemoryBanks::room_for_hugepage() const noexcept
+{
+	if (m_num_pages < m_max_pages)
+		return true;
+	for (const auto& bank : m_mem) {
+		if (bank.page_tables)
+			continue;
+		/* Same as get_available_bank(), allowing fragmentation */
+		const unsigned n_used = (bank.n_used + MemoryBank::N_HUGEPAGES - 1) & ~(MemoryBank::N_HUGEPAGES - 1);
+		if (n_used + MemoryBank::N_HUGEPAGES <= bank.n_pages)
+			return true;
+	}
+	return false;
+}
 void MemoryBanks::reset(const MachineOptions& options)
 {
 	/* New maximum pages total in banks. */
@@ -157,6 +313,9 @@ void MemoryBanks::reset(const MachineOptions& options)
 
 	/* Instead of removing the banks, give memory back to kernel */
 	for (size_t i = 1u; i < m_mem.size(); i++) {
+		/* Arena banks stay populated, and are lazily zeroed instead. */
+		if (m_mem[i].from_arena || m_mem[i].page_tables)
+			continue;
 		/* WARNING: MADV_FREE *does not* immediately free, so use MADV_DONTNEED instead. */
 		if (m_mem[i].dirty_size() > 0)
 			madvise(m_mem[i].mem, m_mem[i].dirty_size(), MADV_DONTNEED);
@@ -164,9 +323,200 @@ void MemoryBanks::reset(const MachineOptions& options)
 	}
 
 	/* Reset page usage for remaining banks */
+	this->m_generation++;
+	this->m_released.clear();
+	this->m_used_pages = 0;
 	for (auto& bank : m_mem) {
+		/* Page tables are restored in place, see restore_page_tables() */
+		if (bank.page_tables) {
+			m_used_pages += bank.n_used;
+			continue;
+		}
 		bank.n_used = 0;
+		/* Pages will be handed out again, possibly as page tables. */
+		std::fill(bank.cow_pages.begin(), bank.cow_pages.end(), 0);
+		std::fill(bank.host_dirty.begin(), bank.host_dirty.end(), 0);
+	}
+	this->m_peak_used_pages = m_used_pages;
+}
+MemoryBank* MemoryBanks::bank_of(uint64_t paddr) noexcept
+{
+	/* Banks are allocated back-to-back in the arena, so unless
+	   the first bank is an oversized hugepage bank, the index
+	   can be calculated directly. */
+	const uint64_t bank_size = MemoryBank::N_PAGES * vMemory::PageSize();
+	const size_t idx = (paddr - m_arena_begin) / bank_size;
+	if (LIKELY(paddr >= m_arena_begin && idx < m_mem.size())) {
+		auto& bank = m_mem[idx];
+		if (bank.within(paddr, vMemory::PageSize()))
+			return &bank;
+	}
+	for (auto& bank : m_mem) {
+		if (bank.within(paddr, vMemory::PageSize()))
+			return &bank;
+	}
+	return nullptr;
+}
+
+MemoryBankArena& MemoryBankArena::get()
+{
+	static MemoryBankArena arena;
+	return arena;
+}
+MemoryBankArena::~MemoryBankArena()
+{
+	{
+		std::scoped_lock lock(m_mtx);
+		this->m_stop_zeroing = true;
+	}
+	m_zero_cond.notify_all();
+	if (m_zero_thread.joinable())
+		m_zero_thread.join();
+}
+void MemoryBankArena::configure(size_t max_cached_banks, bool hugepages, size_t zeroed_reserve)
+{
+	std::scoped_lock lock(m_mtx);
+	this->m_max_cached = max_cached_banks;
+	this->m_hugepages = hugepages;
+	this->m_zeroed_reserve = zeroed_reserve;
+	if (zeroed_reserve > 0 && !m_zero_thread.joinable()) {
+		this->m_zero_thread = std::thread(&MemoryBankArena::zeroing_loop, this);
 	}
+	m_zero_cond.notify_one();
+}
+size_t MemoryBankArena::clean_banks() const noexcept
+{
+	return std::count_if(m_free.begin(), m_free.end(),
+		[] (const Allocation& alloc) { return alloc.n_dirty == 0; });
+}
+bool MemoryBankArena::needs_zeroing() const noexcept
+{
+	const size_t clean = clean_banks();
+	return clean < m_zeroed_reserve && clean < m_free.size();
+}
+void MemoryBankArena::zeroing_loop()
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	while (true) {
+		m_zero_cond.wait(lock, [this] {
+			return m_stop_zeroing || needs_zeroing();
+		});
+		if (m_stop_zeroing)
+			return;
+		/* Take the most recently released dirty bank out of the cache */
+		auto it = std::find_if(m_free.rbegin(), m_free.rend(),
+			[] (const Allocation& alloc) { return alloc.n_dirty != 0; });
+		Allocation alloc = *it;
+		m_free.erase(std::next(it).base());
+		m_zeroing++;
+		lock.unlock();
+
+		/* Non-temporal stores, in order to not pollute the caches
+		   of the vCPU threads with pages they have yet to touch. */
+		for (size_t p = 0; p < alloc.n_dirty; p++) {
+			page_stream_memzero((uint64_t *)&alloc.mem[p * vMemory::PageSize()]);
+		}
+		page_stream_fence();
+		if constexpr (VERBOSE_MEMORY_BANK) {
+			printf("Arena: zeroed %u pages of bank %p\n", alloc.n_dirty, alloc.mem);
+		}
+		alloc.n_dirty = 0;
+
+		lock.lock();
+		m_zeroing--;
+		m_free.push_back(alloc);
+		if (!needs_zeroing())
+			m_idle_cond.notify_all();
+	}
+}
+void MemoryBankArena::wait_for_zeroing()
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	if (!m_zero_thread.joinable())
+		return;
+	m_idle_cond.wait(lock, [this] {
+		return m_zeroing == 0 && !needs_zeroing();
+	});
+}
+size_t MemoryBankArena::zeroed_banks() const
+{
+	std::scoped_lock lock(m_mtx);
+	return clean_banks();
+}
+MemoryBankArena::Allocation MemoryBankArena::acquire()
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	if (!m_free.empty()) {
+		/* Prefer banks that have already been zeroed */
+		auto it = std::find_if(m_free.rbegin(), m_free.rend(),
+			[] (const Allocation& alloc) { return alloc.n_dirty == 0; });
+		if (it == m_free.rend())
+			it = m_free.rbegin();
+		const Allocation alloc = *it;
+		m_free.erase(std::next(it).base());
+		m_zero_cond.notify_one();
+		return alloc;
+	}
+	const bool hugepages = m_hugepages;
+	m_allocated++;
+	lock.unlock();
+
+	char* ptr = (char*)MAP_FAILED;
+	if (hugepages) {
+		ptr = (char*) mmap(NULL, BankSize(), PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_HUGETLB, -1, 0);
+	}
+	if (ptr == MAP_FAILED) {
+		ptr = (char*) mmap(NULL, BankSize(), PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+		if (ptr != MAP_FAILED && hugepages) {
+			madvise(ptr, BankSize(), MADV_HUGEPAGE);
+		}
+	}
+	if (ptr == MAP_FAILED) {
+		lock.lock();
+		m_allocated--;
+		return {nullptr, 0};
+	}
+	if constexpr (VERBOSE_MEMORY_BANK) {
+		printf("Arena: allocated new bank at %p\n", ptr);
+	}
+	return {ptr, 0};
+}
+void MemoryBankArena::release(char* mem, uint32_t n_dirty)
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	if (m_free.size() < m_max_cached) {
+		m_free.push_back({mem, n_dirty});
+		if (n_dirty != 0)
+			m_zero_cond.notify_one();
+		return;
+	}
+	m_allocated--;
+	lock.unlock();
+	munmap(mem, BankSize());
+}
+void MemoryBankArena::trim()
+{
+	std::vector<Allocation> free_list;
+	{
+		std::scoped_lock lock(m_mtx);
+		free_list.swap(m_free);
+		m_allocated -= free_list.size();
+	}
+	for (auto& alloc : free_list) {
+		munmap(alloc.mem, BankSize());
+	}
+}
+size_t MemoryBankArena::cached_banks() const
+{
+	std::scoped_lock lock(m_mtx);
+	return m_free.size();
+}
+size_t MemoryBankArena::allocated_banks() const
+{
+	std::scoped_lock lock(m_mtx);
+	return m_allocated;
 }
 
 MemoryBank::MemoryBank(MemoryBanks& b, char* p, uint64_t a, uint32_t np, uint16_t x)
@@ -179,6 +529,10 @@ MemoryBank::MemoryBank(MemoryBanks& b, char* p, uint64_t a, uint32_t np, uint16_
 }
 MemoryBank::~MemoryBank()
 {
+	if (this->from_arena) {
+		MemoryBankArena::get().release(this->mem, this->n_dirty);
+		return;
+	}
 	munmap(this->mem, this->n_pages * vMemory::PageSize());
 }
 
@@ -198,9 +552,29 @@ MemoryBank::Page MemoryBank::get_next_page(size_t pages)
 	const bool dirty = this->n_used < this->n_dirty;
 	this->n_used += pages;
 	this->n_dirty = std::max(this->n_used, this->n_dirty);
+	banks.m_used_pages += pages;
+	banks.m_peak_used_pages = std::max(banks.m_peak_used_pages, banks.m_used_pages);
 	return {(uint64_t *)&mem[offset], addr + offset, pages * vMemory::PageSize(), dirty};
 }
 
+void MemoryBank::track_leaf_page(uint64_t paddr, uint64_t vaddr, size_t size)
+{
+	if (UNLIKELY(cow_pages.empty())) {
+		cow_pages.resize((n_pages + 63) / 64);
+		page_vaddr.resize(n_pages);
+		if (banks.dirty_page_logging())
+			host_dirty.resize(cow_pages.size());
+	}
+	const size_t first = (paddr - this->addr) / vMemory::PageSize();
+	const size_t count = size / vMemory::PageSize();
+	for (size_t p = first; p < first + count && p < n_pages; p++) {
+		page_vaddr[p] = vaddr + (p - first) * vMemory::PageSize();
+		cow_pages[p / 64] |= 1UL << (p % 64);
+		if (!host_dirty.empty())
+			host_dirty[p / 64] |= 1UL << (p % 64);
+	}
+}
+
 VirtualMem MemoryBank::to_vmem() const noexcept
 {
 	return VirtualMem {this->addr, this->mem, this->size()};
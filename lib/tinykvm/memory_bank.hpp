@@ -1,5 +1,8 @@
 #pragma once
 #include <array>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include "common.hpp"
 #include "virtual_mem.hpp"
@@ -19,7 +22,19 @@ struct MemoryBank {
 	uint32_t       n_dirty = 0;
 	const uint32_t n_pages;
 	const uint16_t idx;
+	/* Memory belongs to the process-wide MemoryBankArena */
+	bool from_arena = false;
+	/* Bank only holds page-table pages, which survive resets */
+	bool page_tables = false;
 	MemoryBanks& banks;
+	/* Bitmap of pages backing copy-on-write leaf user pages, and
+	   the guest virtual address of each page, so that they can be
+	   restored from the master without walking the page tables.
+	   With dirty page logging, host_dirty has the pages written
+	   by the host since the last reset. Allocated on first use. */
+	std::vector<uint64_t> cow_pages;
+	std::vector<uint64_t> host_dirty;
+	std::vector<uint64_t> page_vaddr;
 
 	bool within(uint64_t a, uint64_t s) const noexcept {
 		return (a >= addr) && (a + s <= addr + this->size()) && (a <= a + s);
@@ -43,20 +58,120 @@ struct MemoryBank {
 	Page get_next_page(size_t n_pages);
 
 	VirtualMem to_vmem() const noexcept;
+	/* Remember that [paddr, paddr+size) backs the guest virtual
+	   address vaddr, and that it has been written to. */
+	void track_leaf_page(uint64_t paddr, uint64_t vaddr, size_t size);
 
 	MemoryBank(MemoryBanks&, char*, uint64_t, uint32_t n, uint16_t idx);
 	~MemoryBank();
 };
 
+/* A small run of pages taken out of the banks ahead of time by one
+   SMP vCPU, so that page faults only hold mtx_smp while editing the
+   page tables. Pages are zeroed when the reserve is filled, outside
+   of the lock. The reserve is stale once the banks have been reset. */
+struct PageReserve {
+	static constexpr unsigned PAGES = 32;
+	static constexpr unsigned LOW_WATER = 8;
+
+	const void* banks = nullptr;
+	uint32_t generation = 0;
+	unsigned count = 0;
+	std::array<MemoryBank::Page, PAGES> pages;
+};
+
+/* A process-wide cache of memory bank allocations, shared by all
+   VMs using MachineOptions::shared_bank_arena. Banks are handed back
+   when a VM is destroyed and recycled without zeroing: their dirty
+   page count is preserved, so pages are lazily zeroed on first use.
+   Optionally, a background thread keeps a reserve of cached banks
+   zeroed ahead of time, so that page faults only need to map them. */
+struct MemoryBankArena {
+	struct Allocation {
+		char*    mem;
+		uint32_t n_dirty;
+	};
+	static MemoryBankArena& get();
+
+	/* Configure the maximum number of cached banks, and whether
+	   new bank allocations should try to use 2MB hugepages. When
+	   zeroed_reserve is non-zero, a background thread zeroes cached
+	   banks until that many are clean. */
+	void configure(size_t max_cached_banks, bool hugepages, size_t zeroed_reserve = 0);
+	Allocation acquire();
+	void release(char* mem, uint32_t n_dirty);
+	/* Unmap all cached banks */
+	void trim();
+	size_t cached_banks() const;
+	size_t zeroed_banks() const;
+	size_t allocated_banks() const;
+	/* Wait until the background thread has nothing more to zero */
+	void wait_for_zeroing();
+	~MemoryBankArena();
+
+	static constexpr size_t BankSize() noexcept {
+		return MemoryBank::N_PAGES * 4096ul;
+	}
+
+private:
+	void zeroing_loop();
+	bool needs_zeroing() const noexcept;
+	size_t clean_banks() const noexcept;
+
+	mutable std::mutex m_mtx;
+	std::vector<Allocation> m_free;
+	size_t m_max_cached = 1024;
+	size_t m_allocated = 0;
+	bool   m_hugepages = false;
+	/* Background zeroing */
+	size_t m_zeroed_reserve = 0;
+	size_t m_zeroing = 0;
+	bool   m_stop_zeroing = false;
+	std::condition_variable m_zero_cond;
+	std::condition_variable m_idle_cond;
+	std::thread m_zero_thread;
+};
+
 struct MemoryBanks {
 	static constexpr unsigned FIRST_BANK_IDX = 2;
 	static constexpr uint64_t ARENA_BASE_ADDRESS = 0x7000000000;
+	static constexpr unsigned TABLE_BANK_PAGES = 64;
 
 	MemoryBanks(Machine&, const MachineOptions&);
 	void init_from(const MemoryBanks&);
 
 	MemoryBank& get_available_bank(size_t n_pages);
+	bool room_for_hugepage() const noexcept;
 	void reset(const MachineOptions&);
+	/* With MachineOptions::reset_keep_page_tables, page-table pages
+	   are handed out from banks of their own, which reset() leaves
+	   alone. Pages that are no longer part of the page tables after
+	   a reset are recycled with release_table_pages(), which is given
+	   every page that is still in use. */
+	bool keep_page_tables() const noexcept { return m_keep_page_tables; }
+	MemoryBank::Page get_table_page();
+	bool is_table_page(uint64_t paddr) noexcept;
+	void release_table_pages(std::vector<uint64_t>& used_pages);
+	size_t free_table_pages() const noexcept { return m_free_tables.size(); }
+	/* A single data page, preferring the pages released by the guest */
+	MemoryBank::Page get_page();
+	/* Give back data pages that no longer back anything, eg. after
+	   munmap(), until the next reset. Their memory is returned to
+	   the kernel, and they are handed out again before new banks. */
+	void release_pages(std::vector<uint64_t>& pages);
+	size_t released_pages() const noexcept { return m_released.size(); }
+	/* Pages in use, and the most pages in use since the last reset */
+	size_t used_pages() const noexcept { return m_used_pages; }
+	size_t peak_used_pages() const noexcept { return m_peak_used_pages; }
+	void reset_peak_used_pages() noexcept { m_peak_used_pages = m_used_pages; }
+	/* Resident data pages that are not in use, eg. pages written to
+	   before the last reset, which are kept until they are needed. */
+	size_t reclaimable_pages() const noexcept;
+	/* Give the reclaimable pages back to the kernel. They are zero
+	   when handed out again. Returns the number of pages. */
+	size_t trim();
+	/* Incremented by reset(), invalidating every PageReserve */
+	uint32_t generation() const noexcept { return m_generation; }
 	void set_max_pages(size_t new_max, size_t new_hugepages);
 	size_t max_pages() const noexcept { return m_max_pages; }
 	uint64_t arena_begin() const noexcept { return m_arena_begin; }
@@ -65,6 +180,8 @@ struct MemoryBanks {
 	}
 
 	bool using_hugepages() const noexcept { return m_hugepage_pages > 0; }
+	bool dirty_page_logging() const noexcept { return m_dirty_page_logging; }
+	MemoryBank* bank_of(uint64_t paddr) noexcept;
 	size_t banks_with_hugepages() const noexcept { return m_hugepage_pages / MemoryBank::N_PAGES; }
 
 	auto begin() { return m_mem.begin(); }
@@ -76,6 +193,8 @@ struct MemoryBanks {
 
 private:
 	MemoryBank& allocate_new_bank(uint64_t addr, unsigned pages);
+	MemoryBank& allocate_next_bank();
+	[[noreturn]] void out_of_working_memory(size_t pages) const;
 	char* try_alloc(size_t N, bool try_hugepages);
 
 	std::vector<MemoryBank> m_mem;
@@ -83,11 +202,25 @@ private:
 	uint64_t m_arena_begin;
 	uint64_t m_arena_next;
 	uint16_t m_idx;
+	uint32_t m_generation = 0;
 	/* Number of initial banks that will allocate backing memory using hugepages */
 	uint32_t m_hugepage_pages = 0;
 	uint32_t m_num_pages = 0;
 	/* Max number of pages in all the banks */
 	uint32_t m_max_pages;
+	/* Banks are installed with KVM_MEM_LOG_DIRTY_PAGES */
+	bool m_dirty_page_logging = false;
+	/* Banks are allocated from the MemoryBankArena */
+	bool m_shared_arena = false;
+	/* Page-table banks are kept across resets */
+	bool m_keep_page_tables = false;
+	/* NUMA policy of new banks, see MachineOptions::numa_node */
+	int  m_numa_node = -1;
+	bool m_numa_interleave = false;
+	std::vector<uint64_t> m_free_tables;
+	std::vector<uint64_t> m_released;
+	uint32_t m_used_pages = 0;
+	uint32_t m_peak_used_pages = 0;
 
 	friend struct MemoryBank;
 };
@@ -5,39 +5,53 @@ static constexpr size_t MMAP_COLLISION_TRESHOLD = 512ULL << 20; // 512MB
 static constexpr uint64_t PageMask = vMemory::PageSize()-1;
 static constexpr bool VERBOSE_MMAP_CACHE = false;
 
+uint64_t MMapCache::new_generation() noexcept
+{
+	static uint64_t generations = 0;
+	return __atomic_add_fetch(&generations, 1, __ATOMIC_RELAXED);
+}
+
+void MMapCache::add_free(uint64_t addr, uint64_t size)
+{
+	m_free_ranges.emplace(addr, Range{addr, size});
+	m_free_by_size.emplace(size, addr);
+}
+MMapCache::RangeMap::iterator MMapCache::erase_free(RangeMap::iterator it)
+{
+	m_free_by_size.erase({it->second.size, it->first});
+	return m_free_ranges.erase(it);
+}
+
 MMapCache::Range MMapCache::find(uint64_t size)
 {
-	auto it = m_free_ranges.begin();
-	while (it != m_free_ranges.end())
-	{
-		auto& r = *it;
-		if (r.size >= size) {
-			const Range result { r.addr, size };
-			if (r.size > size) {
-				r.addr += size;
-				r.size -= size;
-			} else {
-				m_free_ranges.erase(it);
-			}
-			if constexpr (VERBOSE_MMAP_CACHE)
-				printf("MMapCache: Found free range %lx %lx\n", result.addr, result.addr + result.size);
-			return result;
-		}
-		++it;
+	auto it = m_free_by_size.lower_bound({size, 0});
+	if (it == m_free_by_size.end())
+		return Range{};
+
+	const auto [free_size, free_addr] = *it;
+	const Range result { free_addr, size };
+	erase_free(m_free_ranges.find(free_addr));
+	if (free_size > size) {
+		add_free(free_addr + size, free_size - size);
 	}
-	return Range{};
+	this->changed();
+	if constexpr (VERBOSE_MMAP_CACHE)
+		printf("MMapCache: Found free range %lx %lx\n", result.addr, result.addr + result.size);
+	return result;
 }
 
-const MMapCache::Range* MMapCache::find_collision(const std::vector<Range>& ranges, const Range& r)
+const MMapCache::Range* MMapCache::find_collision(const RangeMap& ranges, const Range& r) const
 {
-	for (auto& line : ranges)
-	{
-		if (line.overlaps(r.addr, r.size))
-		{
-			// Collision with another range
-			return &line;
-		}
+	// Only the last range starting at or below r.addr, and
+	// the first one starting above it can overlap
+	auto it = ranges.upper_bound(r.addr);
+	if (it != ranges.begin()) {
+		auto& below = std::prev(it)->second;
+		if (below.overlaps(r.addr, r.size))
+			return &below;
 	}
+	if (it != ranges.end() && it->second.overlaps(r.addr, r.size))
+		return &it->second;
 	return nullptr;
 }
 
@@ -56,93 +70,95 @@ void MMapCache::insert_free(uint64_t addr, uint64_t size)
 		throw MemoryException("MMapCache: Collision detected inserting free range", addr, size);
 	}
 	// Connect existing ranges if they are adjacent
-	for (Range& free_range : m_free_ranges)
+	uint64_t begin = addr;
+	uint64_t end = addr + size;
+	bool merged = false;
+	auto above = m_free_ranges.lower_bound(addr);
+	if (above != m_free_ranges.begin())
 	{
-		if (free_range.addr + free_range.size == addr)
+		auto below = std::prev(above);
+		if (below->second.addr + below->second.size == addr)
 		{
 			if constexpr (VERBOSE_MMAP_CACHE)
-				printf("MMapCache: Merging free range *above* %lx %lx with result %lx %lx\n",
-					free_range.addr, free_range.addr + free_range.size,
-					free_range.addr, free_range.addr + free_range.size + size);
-
-			free_range.size += size;
-			return;
-		}
-		else if (free_range.addr == addr + size)
-		{
-			if constexpr (VERBOSE_MMAP_CACHE)
-				printf("MMapCache: Merging free range *below* %lx %lx with result %lx %lx\n",
-					free_range.addr, free_range.addr + free_range.size,
-					addr, addr + size + free_range.size);
-			free_range.addr = addr;
-			free_range.size += size;
-			return;
+				printf("MMapCache: Merging free range *above* %lx %lx\n",
+					below->second.addr, below->second.addr + below->second.size);
+			begin = below->second.addr;
+			erase_free(below);
+			merged = true;
 		}
 	}
+	if (above != m_free_ranges.end() && above->second.addr == end)
+	{
+		if constexpr (VERBOSE_MMAP_CACHE)
+			printf("MMapCache: Merging free range *below* %lx %lx\n",
+				above->second.addr, above->second.addr + above->second.size);
+		end += above->second.size;
+		erase_free(above);
+		merged = true;
+	}
 
-	if (m_free_ranges.size() >= m_max_tracked_ranges) {
+	if (!merged && m_free_ranges.size() >= m_max_tracked_ranges) {
 		throw MemoryException("MMapCache: Too many free ranges", addr, size);
 	}
-	m_free_ranges.push_back({addr, size});
+	add_free(begin, end - begin);
+	this->changed();
 }
 void MMapCache::insert_used(uint64_t addr, uint64_t size)
 {
-	if (!m_used_ranges.empty()) {
-		if (m_used_ranges.back().addr + m_used_ranges.back().size == addr) {
-			m_used_ranges.back().size += size;
+	this->changed();
+	auto above = m_used_ranges.lower_bound(addr);
+	if (above != m_used_ranges.begin())
+	{
+		auto& below = std::prev(above)->second;
+		if (below.addr + below.size == addr) {
+			below.size += size;
+			if (above != m_used_ranges.end() && above->second.addr == addr + size) {
+				below.size += above->second.size;
+				m_used_ranges.erase(above);
+			}
 			return;
 		}
 	}
+	if (above != m_used_ranges.end() && above->second.addr == addr + size) {
+		const uint64_t above_size = above->second.size;
+		m_used_ranges.erase(above);
+		m_used_ranges.emplace(addr, Range{addr, size + above_size});
+		return;
+	}
 	if (m_used_ranges.size() >= m_max_tracked_ranges) {
 		throw MemoryException("MMapCache: Too many used ranges", addr, size);
 	}
-	m_used_ranges.push_back({addr, size});
+	m_used_ranges.emplace(addr, Range{addr, size});
 }
 
-void MMapCache::remove(uint64_t addr, uint64_t size, std::vector<Range>& ranges)
+void MMapCache::remove(uint64_t addr, uint64_t size, RangeMap& ranges)
 {
-	for (auto it = ranges.begin(); it != ranges.end();)
+	const bool free = &ranges == &m_free_ranges;
+	const uint64_t end = addr + size;
+	auto add = [&] (uint64_t a, uint64_t s) {
+		if (free)
+			add_free(a, s);
+		else
+			ranges.emplace(a, Range{a, s});
+	};
+	this->changed();
+
+	auto it = ranges.upper_bound(addr);
+	if (it != ranges.begin())
+		--it;
+	while (it != ranges.end() && it->second.addr < end)
 	{
-		Range& r = *it;
-		if (r.overlaps(addr, size))
-		{
-			if (addr <= r.addr && addr + size >= r.addr + r.size)
-			{
-				// The range fully overlaps the given range
-				it = ranges.erase(it);
-				continue;
-			}
-			else if (addr < r.addr)
-			{
-				// The removed range is below/before the given range
-				// since it doesn't cover the whole range, we know that
-				// the range remains and addr doesn't change
-				r.size -= (addr + size) - r.addr;
-				r.addr = addr + size;
-				++it;
-				continue;
-			}
-			else // addr >= r.addr
-			{
-				// The removed range is above the given range
-				r.size = addr - r.addr;
-				if (r.size == 0)
-				{
-					it = ranges.erase(it);
-				}
-				else
-				{
-					++it;
-				}
-				continue;
-			}
-			throw MemoryException("Unreachable", addr, size);
+		const Range r = it->second;
+		if (!r.overlaps(addr, size)) {
+			++it;
+			continue;
 		}
-		else ++it;
-	}
-	if (find_collision(ranges, { addr, size }))
-	{
-		throw MemoryException("MMapCache: Failed to remove range", addr, size);
+		it = free ? erase_free(it) : ranges.erase(it);
+		// Keep what remains below and above the removed range
+		if (r.addr < addr)
+			add(r.addr, addr - r.addr);
+		if (r.addr + r.size > end)
+			add(end, r.addr + r.size - end);
 	}
 }
 void MMapCache::remove_free(uint64_t addr, uint64_t size)
@@ -154,6 +170,19 @@ void MMapCache::remove_used(uint64_t addr, uint64_t size)
 	remove(addr, size, m_used_ranges);
 }
 
+void MMapCache::restore_from(const MMapCache& other)
+{
+	this->m_mm = other.m_mm;
+	this->m_track_used_ranges = other.m_track_used_ranges;
+	this->m_max_tracked_ranges = other.m_max_tracked_ranges;
+	if (this->m_generation != other.m_generation) {
+		this->m_free_ranges = other.m_free_ranges;
+		this->m_free_by_size = other.m_free_by_size;
+		this->m_used_ranges = other.m_used_ranges;
+		this->m_generation = other.m_generation;
+	}
+}
+
 Machine::address_t Machine::mmap_allocate(size_t bytes, int prot, bool huge)
 {
 	(void)prot;
@@ -1,5 +1,9 @@
-#include <array>
+#pragma once
+#include <cstddef>
 #include <cstdint>
+#include <map>
+#include <set>
+#include <utility>
 
 namespace tinykvm
 {
@@ -18,13 +22,16 @@ namespace tinykvm
 				return (this->addr == mem) && (this->addr + this->size == mem + memsize);
 			}
 		};
+		/* Non-overlapping ranges, keyed by their address */
+		using RangeMap = std::map<uint64_t, Range>;
 
 		uint64_t& current() noexcept { return m_mm; }
 		const uint64_t& current() const noexcept { return m_mm; }
 
+		/* Best fit: the smallest free range that fits, lowest address first */
 		Range find(uint64_t size);
 
-		const Range* find_collision(const std::vector<Range>& ranges, const Range& r);
+		const Range* find_collision(const RangeMap& ranges, const Range& r) const;
 
 		void insert_free(uint64_t addr, uint64_t size);
 		void insert_used(uint64_t addr, uint64_t size);
@@ -34,13 +41,27 @@ namespace tinykvm
 		bool track_used_ranges() const noexcept { return m_track_used_ranges; }
 		void set_track_used_ranges(bool track) noexcept { m_track_used_ranges = track; }
 
-		const std::vector<Range>& free_ranges() const noexcept { return m_free_ranges; }
-		const std::vector<Range>& used_ranges() const noexcept { return m_used_ranges; }
+		const RangeMap& free_ranges() const noexcept { return m_free_ranges; }
+		const RangeMap& used_ranges() const noexcept { return m_used_ranges; }
+
+		/* Become a copy of @other, eg. the cache of a master VM. The
+		   ranges are only copied when either side has changed them. */
+		void restore_from(const MMapCache& other);
 	private:
-		void remove(uint64_t addr, uint64_t size, std::vector<Range>& ranges);
-		std::vector<Range> m_free_ranges;
-		std::vector<Range> m_used_ranges;
+		void add_free(uint64_t addr, uint64_t size);
+		RangeMap::iterator erase_free(RangeMap::iterator it);
+		void remove(uint64_t addr, uint64_t size, RangeMap& ranges);
+		void changed() noexcept { m_generation = new_generation(); }
+		static uint64_t new_generation() noexcept;
+
+		RangeMap m_free_ranges;
+		/* (size, addr) of every free range, for best-fit lookups */
+		std::set<std::pair<uint64_t, uint64_t>> m_free_by_size;
+		RangeMap m_used_ranges;
 		uint64_t m_mm = 0x0;
+		/* Unique per change of the ranges, process-wide. Copies
+		   share it until one of them changes. */
+		uint64_t m_generation = 0;
 		bool m_track_used_ranges = true;
 		size_t m_max_tracked_ranges = 4096;
 	};
@@ -0,0 +1,54 @@
+#include "numa.hpp"
+
+#include <cstdio>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace tinykvm {
+/* Nodes in the masks given to mbind() */
+static constexpr int MAX_NODES = 1024;
+static constexpr int MASK_BITS = 8 * sizeof(unsigned long);
+
+bool numa_bind(void* ptr, size_t size, int node, bool interleave)
+{
+	if (node < 0 && !interleave)
+		return true;
+	unsigned long mask[MAX_NODES / MASK_BITS] {};
+	int mode = MPOL_BIND;
+	if (interleave) {
+		mode = MPOL_INTERLEAVE;
+		for (int n = 0; n < numa_nodes() && n < MAX_NODES; n++)
+			mask[n / MASK_BITS] |= 1UL << (n % MASK_BITS);
+	} else if (node < MAX_NODES) {
+		mask[node / MASK_BITS] |= 1UL << (node % MASK_BITS);
+	} else {
+		return false;
+	}
+	return syscall(SYS_mbind, ptr, size, mode, mask, MAX_NODES, 0) == 0;
+}
+
+int numa_nodes()
+{
+	static const int nodes = [] {
+		/* eg. "0-1" or "0" */
+		FILE* f = fopen("/sys/devices/system/node/possible", "r");
+		if (f == nullptr)
+			return 1;
+		int first = 0, last = 0;
+		const int n = fscanf(f, "%d-%d", &first, &last);
+		fclose(f);
+		return (n == 2) ? last + 1 : 1;
+	}();
+	return nodes;
+}
+
+int numa_current_node()
+{
+	unsigned cpu = 0, node = 0;
+	if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+		return 0;
+	return node;
+}
+
+} // tinykvm
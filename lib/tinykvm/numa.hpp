@@ -0,0 +1,15 @@
+#pragma once
+#include <cstddef>
+
+namespace tinykvm {
+	/* Set the memory policy of [ptr, ptr + size) before it is first
+	   touched: bind it to @node, or interleave it across all nodes.
+	   Does nothing when @node is negative and @interleave is unset.
+	   Returns false when the kernel refused the policy, in which case
+	   the memory is placed as usual (first touch). */
+	extern bool numa_bind(void* ptr, size_t size, int node, bool interleave);
+	/* The number of possible NUMA nodes, at least one */
+	extern int numa_nodes();
+	/* The node of the CPU the calling thread is running on */
+	extern int numa_current_node();
+}
@@ -0,0 +1,199 @@
+#include "page_dedup.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string_view>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace tinykvm {
+static constexpr bool VERBOSE_DEDUP = false;
+static constexpr uint64_t PAGE_SIZE = 4096;
+/* Address space reserved for the read-only view of the pool. Released
+   offsets are only reused when it runs out, as pages of the same master
+   that are given consecutive offsets can be mapped together. */
+static constexpr uint64_t POOL_CAPACITY = 64ULL << 30; /* 64GB */
+static constexpr uint64_t POOL_GROWTH = 64ULL << 20; /* 64MB */
+static constexpr uint64_t NO_OFFSET = ~0ULL;
+
+static uint64_t hash_page(const char* page)
+{
+	return std::hash<std::string_view>{}(std::string_view(page, PAGE_SIZE));
+}
+static bool page_is_zero(const char* page)
+{
+	const auto* words = (const uint64_t *)page;
+	for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+		if (words[i] != 0)
+			return false;
+	}
+	return true;
+}
+
+PageDedupStore& PageDedupStore::get()
+{
+	static PageDedupStore store;
+	return store;
+}
+
+PageDedupStore::PageDedupStore()
+{
+	this->m_fd = memfd_create("tinykvm-dedup", MFD_CLOEXEC);
+	if (this->m_fd < 0)
+		return;
+	void* view = mmap(nullptr, POOL_CAPACITY, PROT_READ,
+		MAP_SHARED | MAP_NORESERVE, this->m_fd, 0);
+	if (view == MAP_FAILED) {
+		close(this->m_fd);
+		this->m_fd = -1;
+		return;
+	}
+	this->m_view = (char *)view;
+}
+PageDedupStore::~PageDedupStore()
+{
+	/* Masters still holding pool pages keep the file alive */
+	if (this->m_view != nullptr)
+		munmap(this->m_view, POOL_CAPACITY);
+	if (this->m_fd >= 0)
+		close(this->m_fd);
+}
+
+uint64_t PageDedupStore::insert(const char* page, uint64_t hash)
+{
+	uint64_t offset = NO_OFFSET;
+	if (m_slots.size() * PAGE_SIZE < POOL_CAPACITY) {
+		offset = m_slots.size() * PAGE_SIZE;
+		if (offset + PAGE_SIZE > m_file_size) {
+			if (ftruncate(m_fd, m_file_size + POOL_GROWTH) != 0)
+				return NO_OFFSET;
+			m_file_size += POOL_GROWTH;
+		}
+		m_slots.emplace_back();
+	} else if (!m_free.empty()) {
+		offset = m_free.back();
+		m_free.pop_back();
+	} else {
+		return NO_OFFSET;
+	}
+	if (pwrite(m_fd, page, PAGE_SIZE, offset) != ssize_t(PAGE_SIZE)) {
+		m_free.push_back(offset);
+		return NO_OFFSET;
+	}
+	m_slots[offset / PAGE_SIZE] = Slot{hash, 1};
+	m_by_hash.emplace(hash, offset);
+	m_pool_pages++;
+	return offset;
+}
+
+size_t PageDedupStore::deduplicate(char* ptr, size_t size, std::vector<uint64_t>& offsets)
+{
+	if (m_fd < 0 || size == 0)
+		return 0;
+	const size_t pages = size / PAGE_SIZE;
+	/* Pages that were never touched are not worth reading */
+	std::vector<unsigned char> resident(pages);
+	if (mincore(ptr, pages * PAGE_SIZE, resident.data()) != 0)
+		resident.assign(pages, 1);
+
+	std::scoped_lock lock(m_mtx);
+	size_t shared = 0;
+	uint64_t run_begin = 0, run_offset = 0;
+	size_t run_pages = 0;
+	auto flush_run = [&] {
+		if (run_pages == 0)
+			return;
+		void* res = mmap(ptr + run_begin, run_pages * PAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_FIXED, m_fd, run_offset);
+		if (res == MAP_FAILED)
+			throw std::runtime_error("PageDedupStore: Failed to map pool pages");
+		run_pages = 0;
+	};
+
+	for (size_t p = 0; p < pages; p++)
+	{
+		const char* page = ptr + p * PAGE_SIZE;
+		if (!(resident[p] & 1) || page_is_zero(page)) {
+			flush_run();
+			continue;
+		}
+		const uint64_t hash = hash_page(page);
+		uint64_t offset = NO_OFFSET;
+		auto range = m_by_hash.equal_range(hash);
+		for (auto it = range.first; it != range.second; ++it) {
+			if (std::memcmp(m_view + it->second, page, PAGE_SIZE) == 0) {
+				offset = it->second;
+				m_slots[offset / PAGE_SIZE].refs++;
+				shared++;
+				break;
+			}
+		}
+		if (offset == NO_OFFSET) {
+			offset = this->insert(page, hash);
+			if (offset == NO_OFFSET) {
+				flush_run();
+				continue;
+			}
+		}
+		offsets.push_back(offset);
+		m_references++;
+
+		const uint64_t addr = p * PAGE_SIZE;
+		if (run_pages > 0 && run_begin + run_pages * PAGE_SIZE == addr
+			&& run_offset + run_pages * PAGE_SIZE == offset) {
+			run_pages++;
+			continue;
+		}
+		flush_run();
+		run_begin = addr;
+		run_offset = offset;
+		run_pages = 1;
+	}
+	flush_run();
+	if constexpr (VERBOSE_DEDUP) {
+		fprintf(stderr, "PageDedupStore: %zu pages shared, %zu pages in pool\n",
+			shared, m_pool_pages);
+	}
+	return shared;
+}
+
+void PageDedupStore::unref(uint64_t offset)
+{
+	auto& slot = m_slots.at(offset / PAGE_SIZE);
+	m_references--;
+	if (--slot.refs != 0)
+		return;
+	auto range = m_by_hash.equal_range(slot.hash);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second == offset) {
+			m_by_hash.erase(it);
+			break;
+		}
+	}
+	fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, PAGE_SIZE);
+	m_free.push_back(offset);
+	m_pool_pages--;
+}
+
+void PageDedupStore::release(const std::vector<uint64_t>& offsets)
+{
+	std::scoped_lock lock(m_mtx);
+	for (const uint64_t offset : offsets) {
+		this->unref(offset);
+	}
+}
+
+size_t PageDedupStore::pool_pages() const
+{
+	std::scoped_lock lock(m_mtx);
+	return m_pool_pages;
+}
+size_t PageDedupStore::references() const
+{
+	std::scoped_lock lock(m_mtx);
+	return m_references;
+}
+
+} // tinykvm
@@ -0,0 +1,53 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace tinykvm {
+
+/* A process-wide pool of page contents, shared between master VMs.
+   Pages with identical contents are backed by a single page of an
+   in-memory file, which every master maps privately in place of its
+   own copy. Any write, by the guest or the host, makes a private copy
+   of the page again, so nothing can ever change a page that other VMs
+   can see. Pool pages are reference counted, and the ones no longer
+   referenced are punched out of the file. */
+struct PageDedupStore {
+	static PageDedupStore& get();
+
+	/* Replace the non-zero resident pages of [ptr, ptr + size) with
+	   pool pages, appending their pool offsets to @offsets, which
+	   hold one reference each. Returns the number of pages that were
+	   already in the pool, and are now shared. */
+	size_t deduplicate(char* ptr, size_t size, std::vector<uint64_t>& offsets);
+	/* Drops the references taken by deduplicate() */
+	void release(const std::vector<uint64_t>& offsets);
+
+	/* Pages in the pool, and references to them */
+	size_t pool_pages() const;
+	size_t references() const;
+
+	~PageDedupStore();
+private:
+	PageDedupStore();
+	uint64_t insert(const char* page, uint64_t hash); // Must hold the lock
+	void unref(uint64_t offset); // Must hold the lock
+
+	struct Slot {
+		uint64_t hash = 0;
+		unsigned refs = 0;
+	};
+	mutable std::mutex m_mtx;
+	int   m_fd = -1;
+	char* m_view = nullptr; // Read-only view of the whole pool
+	std::unordered_multimap<uint64_t, uint64_t> m_by_hash; // hash -> offset
+	std::vector<Slot> m_slots; // By offset / page size
+	std::vector<uint64_t> m_free; // Punched out offsets
+	uint64_t m_file_size = 0;
+	size_t   m_pool_pages = 0;
+	size_t   m_references = 0;
+};
+
+}
@@ -1,61 +1,39 @@
 #include "page_streaming.hpp"
 
+#include <cpuid.h>
+#include <cstring>
 #include <x86intrin.h>
 
 namespace tinykvm {
+static constexpr size_t PAGE_WORDS = 4096 / sizeof(uint64_t);
+/* Batches from this size are copied with non-temporal stores */
+static constexpr size_t STREAM_PAGES = 64;
 
-#ifdef ENABLE_AVX2_PAGE_UTILS
-void page_duplicate(uint64_t* dest, const uint64_t* source)
+static void generic_page_duplicate(uint64_t* dest, const uint64_t* source)
 {
-#if defined(__AVX2__)
-	for (size_t i = 0; i < 16; i++) {
-		auto i0 = _mm256_stream_load_si256((__m256i *)&source[4 * 0]);
-		auto i1 = _mm256_stream_load_si256((__m256i *)&source[4 * 1]);
-		auto i2 = _mm256_stream_load_si256((__m256i *)&source[4 * 2]);
-		auto i3 = _mm256_stream_load_si256((__m256i *)&source[4 * 3]);
-		auto i4 = _mm256_stream_load_si256((__m256i *)&source[4 * 4]);
-		auto i5 = _mm256_stream_load_si256((__m256i *)&source[4 * 5]);
-		auto i6 = _mm256_stream_load_si256((__m256i *)&source[4 * 6]);
-		auto i7 = _mm256_stream_load_si256((__m256i *)&source[4 * 7]);
-
-		_mm256_stream_pd((double *)&dest[4 * 0], *(__m256d *) &i0);
-		_mm256_stream_pd((double *)&dest[4 * 1], *(__m256d *) &i1);
-		_mm256_stream_pd((double *)&dest[4 * 2], *(__m256d *) &i2);
-		_mm256_stream_pd((double *)&dest[4 * 3], *(__m256d *) &i3);
-		_mm256_stream_pd((double *)&dest[4 * 4], *(__m256d *) &i4);
-		_mm256_stream_pd((double *)&dest[4 * 5], *(__m256d *) &i5);
-		_mm256_stream_pd((double *)&dest[4 * 6], *(__m256d *) &i6);
-		_mm256_stream_pd((double *)&dest[4 * 7], *(__m256d *) &i7);
-		dest   += 4 * 8;
-		source += 4 * 8;
-	}
-#else
 	std::memcpy(dest, source, 4096);
-#endif
 }
-
-void page_memzero(uint64_t* dest)
+static void generic_page_memzero(uint64_t* dest)
 {
-#if defined(__AVX2__)
-	auto iz = _mm256_setzero_si256();
-	for (size_t i = 0; i < 16; i++) {
-		_mm256_stream_pd((double *)&dest[4 * 0], *(__m256d *) &iz);
-		_mm256_stream_pd((double *)&dest[4 * 1], *(__m256d *) &iz);
-		_mm256_stream_pd((double *)&dest[4 * 2], *(__m256d *) &iz);
-		_mm256_stream_pd((double *)&dest[4 * 3], *(__m256d *) &iz);
-		_mm256_stream_pd((double *)&dest[4 * 4], *(__m256d *) &iz);
-		_mm256_stream_pd((double *)&dest[4 * 5], *(__m256d *) &iz);
-		_mm256_stream_pd((double *)&dest[4 * 6], *(__m256d *) &iz);
-		_mm256_stream_pd((double *)&dest[4 * 7], *(__m256d *) &iz);
-		dest   += 4 * 8;
-	}
-#else
 	std::memset(dest, 0, 4096);
-#endif
 }
-#endif
 
-void avx2_page_duplicate(uint64_t* dest, const uint64_t* source)
+/* Enhanced (or fast short) REP MOVSB/STOSB */
+static void erms_page_duplicate(uint64_t* dest, const uint64_t* source)
+{
+	size_t count = 4096;
+	asm volatile("rep movsb"
+		: "+D"(dest), "+S"(source), "+c"(count) : : "memory");
+}
+static void erms_page_memzero(uint64_t* dest)
+{
+	size_t count = 4096;
+	asm volatile("rep stosb"
+		: "+D"(dest), "+c"(count) : "a"(0) : "memory");
+}
+
+__attribute__((target("avx2")))
+static void avx2_page_duplicate(uint64_t* dest, const uint64_t* source)
 {
 	for (size_t i = 0; i < 16; i++) {
 		auto i0 = _mm256_load_si256((__m256i *)&source[4 * 0]);
@@ -67,31 +45,165 @@ void avx2_page_duplicate(uint64_t* dest, const uint64_t* source)
 		auto i6 = _mm256_load_si256((__m256i *)&source[4 * 6]);
 		auto i7 = _mm256_load_si256((__m256i *)&source[4 * 7]);
 
-		_mm256_store_si256((__m256i *)&dest[4 * 0], *(__m256i *) &i0);
-		_mm256_store_si256((__m256i *)&dest[4 * 1], *(__m256i *) &i1);
-		_mm256_store_si256((__m256i *)&dest[4 * 2], *(__m256i *) &i2);
-		_mm256_store_si256((__m256i *)&dest[4 * 3], *(__m256i *) &i3);
-		_mm256_store_si256((__m256i *)&dest[4 * 4], *(__m256i *) &i4);
-		_mm256_store_si256((__m256i *)&dest[4 * 5], *(__m256i *) &i5);
-		_mm256_store_si256((__m256i *)&dest[4 * 6], *(__m256i *) &i6);
-		_mm256_store_si256((__m256i *)&dest[4 * 7], *(__m256i *) &i7);
+		_mm256_store_si256((__m256i *)&dest[4 * 0], i0);
+		_mm256_store_si256((__m256i *)&dest[4 * 1], i1);
+		_mm256_store_si256((__m256i *)&dest[4 * 2], i2);
+		_mm256_store_si256((__m256i *)&dest[4 * 3], i3);
+		_mm256_store_si256((__m256i *)&dest[4 * 4], i4);
+		_mm256_store_si256((__m256i *)&dest[4 * 5], i5);
+		_mm256_store_si256((__m256i *)&dest[4 * 6], i6);
+		_mm256_store_si256((__m256i *)&dest[4 * 7], i7);
 		dest   += 4 * 8;
 		source += 4 * 8;
 	}
 }
-void avx2_page_dupliteit(uint64_t* dest, const uint64_t* source)
+__attribute__((target("avx2")))
+static void avx2_page_memzero(uint64_t* dest)
 {
-	for (size_t i = 0; i < 16; i++) {
-		#pragma unroll(8)
-		for (int j = 0; j < 8; j++) {
-			__m256i zmm = _mm256_load_si256((__m256i *)&source[4 * j]);
-			int is_zero = _mm256_testz_si256(zmm, zmm);
-			if (is_zero == 0)
-			_mm256_store_si256((__m256i *)&dest[4 * j], zmm);
+	const auto iz = _mm256_setzero_si256();
+	for (size_t i = 0; i < PAGE_WORDS; i += 4 * 8) {
+		for (size_t j = 0; j < 8; j++)
+			_mm256_store_si256((__m256i *)&dest[i + 4 * j], iz);
+	}
+}
+__attribute__((target("avx2")))
+static void avx2_page_stream_duplicate(uint64_t* dest, const uint64_t* source)
+{
+	for (size_t i = 0; i < PAGE_WORDS; i += 4 * 8) {
+		for (size_t j = 0; j < 8; j++) {
+			const auto v = _mm256_load_si256((__m256i *)&source[i + 4 * j]);
+			_mm256_stream_si256((__m256i *)&dest[i + 4 * j], v);
 		}
-		dest   += 4 * 8;
-		source += 4 * 8;
 	}
 }
+__attribute__((target("avx2")))
+static void avx2_page_stream_memzero(uint64_t* dest)
+{
+	const auto iz = _mm256_setzero_si256();
+	for (size_t i = 0; i < PAGE_WORDS; i += 4 * 8) {
+		for (size_t j = 0; j < 8; j++)
+			_mm256_stream_si256((__m256i *)&dest[i + 4 * j], iz);
+	}
+}
+
+__attribute__((target("avx512f")))
+static void avx512_page_stream_duplicate(uint64_t* dest, const uint64_t* source)
+{
+	for (size_t i = 0; i < PAGE_WORDS; i += 8 * 4) {
+		const auto v0 = _mm512_load_si512((const void *)&source[i + 8 * 0]);
+		const auto v1 = _mm512_load_si512((const void *)&source[i + 8 * 1]);
+		const auto v2 = _mm512_load_si512((const void *)&source[i + 8 * 2]);
+		const auto v3 = _mm512_load_si512((const void *)&source[i + 8 * 3]);
+		_mm512_stream_si512((__m512i *)&dest[i + 8 * 0], v0);
+		_mm512_stream_si512((__m512i *)&dest[i + 8 * 1], v1);
+		_mm512_stream_si512((__m512i *)&dest[i + 8 * 2], v2);
+		_mm512_stream_si512((__m512i *)&dest[i + 8 * 3], v3);
+	}
+}
+__attribute__((target("avx512f")))
+static void avx512_page_stream_memzero(uint64_t* dest)
+{
+	const auto iz = _mm512_setzero_si512();
+	for (size_t i = 0; i < PAGE_WORDS; i += 8 * 4) {
+		for (size_t j = 0; j < 4; j++)
+			_mm512_stream_si512((__m512i *)&dest[i + 8 * j], iz);
+	}
+}
+
+/* SSE2 is part of x86-64, so this always works */
+static void sse2_page_stream_duplicate(uint64_t* dest, const uint64_t* source)
+{
+	for (size_t i = 0; i < 4096 / sizeof(__m128i); i += 8) {
+		for (size_t j = 0; j < 8; j++) {
+			const auto v = _mm_load_si128((const __m128i *)source + i + j);
+			_mm_stream_si128((__m128i *)dest + i + j, v);
+		}
+	}
+}
+static void sse2_page_stream_memzero(uint64_t* dest)
+{
+	const auto iz = _mm_setzero_si128();
+	for (size_t i = 0; i < 4096 / sizeof(__m128i); i += 8) {
+		_mm_stream_si128((__m128i *)dest + i + 0, iz);
+		_mm_stream_si128((__m128i *)dest + i + 1, iz);
+		_mm_stream_si128((__m128i *)dest + i + 2, iz);
+		_mm_stream_si128((__m128i *)dest + i + 3, iz);
+		_mm_stream_si128((__m128i *)dest + i + 4, iz);
+		_mm_stream_si128((__m128i *)dest + i + 5, iz);
+		_mm_stream_si128((__m128i *)dest + i + 6, iz);
+		_mm_stream_si128((__m128i *)dest + i + 7, iz);
+	}
+}
+
+std::vector<PageKernel> page_kernels(bool streaming)
+{
+	__builtin_cpu_init();
+	std::vector<PageKernel> kernels;
+	if (streaming) {
+		if (__builtin_cpu_supports("avx512f"))
+			kernels.push_back({"avx512-nt", avx512_page_stream_duplicate, avx512_page_stream_memzero});
+		if (__builtin_cpu_supports("avx2"))
+			kernels.push_back({"avx2-nt", avx2_page_stream_duplicate, avx2_page_stream_memzero});
+		kernels.push_back({"sse2-nt", sse2_page_stream_duplicate, sse2_page_stream_memzero});
+		return kernels;
+	}
+	unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+	bool erms = false, fsrm = false;
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		erms = (ebx & (1u << 9)) != 0; // EBX bit 9
+		fsrm = (edx & (1u << 4)) != 0; // EDX bit 4
+	}
+	/* With fast short REP MOVSB, microcode beats vector loops on 4k */
+	if (fsrm)
+		kernels.push_back({"fsrm", erms_page_duplicate, erms_page_memzero});
+	if (__builtin_cpu_supports("avx2"))
+		kernels.push_back({"avx2", avx2_page_duplicate, avx2_page_memzero});
+	if (erms && !fsrm)
+		kernels.push_back({"erms", erms_page_duplicate, erms_page_memzero});
+	kernels.push_back({"generic", generic_page_duplicate, generic_page_memzero});
+	return kernels;
+}
+
+PageKernel page_kernel = {"generic", generic_page_duplicate, generic_page_memzero};
+PageKernel page_stream_kernel = {"sse2-nt", sse2_page_stream_duplicate, sse2_page_stream_memzero};
+
+__attribute__((constructor))
+static void select_page_kernels()
+{
+	page_kernel = page_kernels(false).front();
+	page_stream_kernel = page_kernels(true).front();
+}
+
+void page_stream_memzero(uint64_t* dest)
+{
+	page_stream_kernel.memzero(dest);
+}
+void page_stream_fence()
+{
+	_mm_sfence();
+}
+
+void pages_duplicate(uint64_t* dest, const uint64_t* source, size_t count)
+{
+	if (count >= STREAM_PAGES) {
+		for (size_t p = 0; p < count; p++)
+			page_stream_kernel.duplicate(dest + p * PAGE_WORDS, source + p * PAGE_WORDS);
+		page_stream_fence();
+		return;
+	}
+	for (size_t p = 0; p < count; p++)
+		page_kernel.duplicate(dest + p * PAGE_WORDS, source + p * PAGE_WORDS);
+}
+void pages_memzero(uint64_t* dest, size_t count)
+{
+	if (count >= STREAM_PAGES) {
+		for (size_t p = 0; p < count; p++)
+			page_stream_kernel.memzero(dest + p * PAGE_WORDS);
+		page_stream_fence();
+		return;
+	}
+	for (size_t p = 0; p < count; p++)
+		page_kernel.memzero(dest + p * PAGE_WORDS);
+}
 
 } // tinykvm
@@ -1,25 +1,40 @@
+#pragma once
+#include <cstddef>
 #include <cstdint>
-#include <cstring>
-//#define ENABLE_AVX2_PAGE_UTILS
+#include <vector>
 
 namespace tinykvm {
-	extern void avx2_page_duplicate(uint64_t* dest, const uint64_t* source);
-	extern void avx2_page_dupliteit(uint64_t* dest, const uint64_t* source);
+	/* A page copy and zero kernel. Pages must be 4k-aligned. */
+	struct PageKernel {
+		const char* name;
+		void (*duplicate)(uint64_t* dest, const uint64_t* source);
+		void (*memzero)(uint64_t* dest);
+	};
+	/* The kernels are chosen from CPUID when the library is loaded.
+	   page_kernel keeps the pages in the cache, as they are usually
+	   about to be used (eg. copy-on-write faults). page_stream_kernel
+	   uses non-temporal stores, and must be followed by page_stream_fence(). */
+	extern PageKernel page_kernel;
+	extern PageKernel page_stream_kernel;
+	/* Every kernel that this CPU can run, best first */
+	extern std::vector<PageKernel> page_kernels(bool streaming);
+
+	/* Zero a page using non-temporal stores, followed by page_stream_fence() */
+	extern void page_stream_memzero(uint64_t* dest);
+	extern void page_stream_fence();
+	/* Copy or zero @count consecutive pages. Big batches bypass the
+	   caches, as they would otherwise only evict what is in them. */
+	extern void pages_duplicate(uint64_t* dest, const uint64_t* source, size_t count);
+	extern void pages_memzero(uint64_t* dest, size_t count);
 
-#ifdef ENABLE_AVX2_PAGE_UTILS
-	extern void page_duplicate(uint64_t* dest, const uint64_t* source);
-	extern void page_memzero(uint64_t* dest);
-#else
 	inline void page_duplicate(uint64_t* dest, const uint64_t* source)
 	{
-		//std::memcpy(dest, source, 4096);
-		avx2_page_duplicate(dest, source);
+		page_kernel.duplicate(dest, source);
 	}
 
 	inline void page_memzero(uint64_t* dest)
 	{
-		std::memset(dest, 0, 4096);
+		page_kernel.memzero(dest);
 	}
-#endif
 
 }
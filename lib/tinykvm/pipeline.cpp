@@ -0,0 +1,178 @@
+#include "pipeline.hpp"
+
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace tinykvm {
+static constexpr uint64_t HANDOFF_ALIGN = 0x200000; // 2MB
+
+Pipeline::Pipeline(std::vector<Stage> stages, const Options& options)
+	: m_options(options),
+	  m_slot_size((options.slot_size + vMemory::PageSize() - 1) & ~(vMemory::PageSize() - 1)),
+	  m_workers(options.threads != 0 ? options.threads : std::max(stages.size(), size_t(1)), 0, false)
+{
+	if (stages.empty())
+		throw MachineException("Pipeline: No stages");
+	if (options.depth == 0 || options.slot_size == 0)
+		throw MachineException("Pipeline: Depth and slot size cannot be zero");
+	/* Each stage has at most one queued call */
+	m_workers.set_queue_size_limit(stages.size());
+
+	for (size_t i = 0; i < stages.size(); i++) {
+		if (stages[i].vm == nullptr || stages[i].func == 0x0)
+			throw MachineException("Pipeline: Stage without a VM or function", i);
+	}
+
+	const size_t size = (options.depth * m_slot_size + HANDOFF_ALIGN - 1) & ~(HANDOFF_ALIGN - 1);
+	m_buffers.resize(stages.size() + 1);
+	auto map_buffer = [] (Machine& vm, const Buffer& buffer) {
+		const auto addr = vm.mmap_allocate(buffer.size, PROT_READ | PROT_WRITE, true);
+		auto& range = vm.map_host_range(addr, buffer.ptr, buffer.size,
+			PROT_READ | PROT_WRITE, false, "[pipeline]");
+		range.external = true;
+		return addr;
+	};
+	try {
+		for (auto& buffer : m_buffers) {
+			void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+			if (ptr == MAP_FAILED)
+				throw MachineException("Pipeline: Failed to allocate handoff buffer", size);
+			buffer.ptr = (char *)ptr;
+			buffer.size = size;
+		}
+		/* Map the input and output buffers of each stage into its VM */
+		m_stages.resize(stages.size());
+		for (size_t i = 0; i < stages.size(); i++) {
+			auto& st = m_stages[i];
+			st.stage = stages[i];
+			st.input  = map_buffer(*st.stage.vm, m_buffers[i]);
+			st.output = map_buffer(*st.stage.vm, m_buffers[i + 1]);
+		}
+	} catch (...) {
+		for (auto& buffer : m_buffers) {
+			if (buffer.ptr != nullptr)
+				munmap(buffer.ptr, buffer.size);
+		}
+		throw;
+	}
+
+	m_items.resize(options.depth);
+	for (size_t i = 0; i < m_items.size(); i++) {
+		m_items[i].slot = i;
+		m_free.push_back(&m_items[i]);
+	}
+}
+
+Pipeline::~Pipeline()
+{
+	this->wait_idle();
+	for (auto& buffer : m_buffers) {
+		if (buffer.ptr != nullptr)
+			munmap(buffer.ptr, buffer.size);
+		buffer.ptr = nullptr;
+	}
+}
+
+void Pipeline::submit(const void* data, size_t len, done_t done)
+{
+	if (len > m_slot_size)
+		throw MachineException("Pipeline: Input does not fit in a slot", len);
+	std::unique_lock<std::mutex> lock(m_mtx);
+	/* Backpressure: wait for a free slot */
+	m_free_cond.wait(lock, [this] { return !m_free.empty(); });
+	Item* item = m_free.back();
+	m_free.pop_back();
+	lock.unlock();
+
+	std::memcpy(slot_of(m_buffers.front(), *item), data, len);
+	item->length = len;
+	item->error = nullptr;
+	item->done = std::move(done);
+
+	lock.lock();
+	this->schedule(0, item);
+}
+
+void Pipeline::schedule(size_t stage, Item* item)
+{
+	/* Called with the lock held. A stage runs one item at a time, and
+	   items arrive in order, so each stage sees them in order too. */
+	auto& st = m_stages[stage];
+	if (st.busy) {
+		st.pending.push_back(item);
+		return;
+	}
+	st.busy = true;
+	m_workers.enqueue([this, stage, item] { this->run(stage, item); });
+}
+
+void Pipeline::run(size_t stage, Item* item)
+{
+	auto& st = m_stages[stage];
+	Machine& vm = *st.stage.vm;
+	/* The execution timer is bound to the thread that created it */
+	const pid_t tid = gettid();
+	if (st.owner != tid) {
+		vm.migrate_to_this_thread();
+		st.owner = tid;
+	}
+	const uint64_t offset = item->slot * m_slot_size;
+	try {
+		vm.timed_vmcall(st.stage.func, m_options.timeout,
+			st.input + offset, uint64_t(item->length), st.output + offset, uint64_t(m_slot_size));
+		const long result = vm.return_value();
+		if (result < 0 || size_t(result) > m_slot_size)
+			throw MachineException("Pipeline: Stage failed", result);
+		item->length = result;
+	} catch (...) {
+		item->error = std::current_exception();
+	}
+
+	const bool last = item->error != nullptr || stage + 1 == m_stages.size();
+	std::unique_lock<std::mutex> lock(m_mtx);
+	st.busy = false;
+	if (!st.pending.empty()) {
+		Item* next = st.pending.front();
+		st.pending.pop_front();
+		this->schedule(stage, next);
+	}
+	if (!last) {
+		this->schedule(stage + 1, item);
+		return;
+	}
+	lock.unlock();
+	this->finish(item);
+}
+
+void Pipeline::finish(Item* item)
+{
+	/* The output is read in place, from the last buffer */
+	std::string_view output;
+	if (item->error == nullptr)
+		output = { slot_of(m_buffers.back(), *item), item->length };
+	if (item->done)
+		item->done(output, item->error);
+	item->done = nullptr;
+	item->error = nullptr;
+
+	std::scoped_lock lock(m_mtx);
+	m_free.push_back(item);
+	m_free_cond.notify_one();
+	if (m_free.size() == m_items.size())
+		m_idle_cond.notify_all();
+}
+
+void Pipeline::wait_idle()
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	m_idle_cond.wait(lock, [this] { return m_free.size() == m_items.size(); });
+}
+
+size_t Pipeline::in_flight() const
+{
+	std::scoped_lock lock(m_mtx);
+	return m_items.size() - m_free.size();
+}
+
+} // tinykvm
@@ -0,0 +1,94 @@
+#pragma once
+#include "machine.hpp"
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <vector>
+#include "util/threadpool.h"
+
+namespace tinykvm
+{
+	/// @brief A chain of VMs (eg. decode -> transform -> encode), where the
+	/// output of each stage is the input of the next. Adjacent stages share
+	/// a handoff buffer of host memory, mapped into both VMs, so a stage
+	/// writes its output directly where the next stage reads it, and no
+	/// data is copied between stages. Each stage function is called as:
+	///   long stage(const void* in, size_t in_len, void* out, size_t out_cap)
+	/// and returns the length of its output, or a negative value on error.
+	/// Stages run on a thread pool, one item at a time per VM, so that all
+	/// stages can work on different items at the same time. At most
+	/// @depth items are in flight, after which submit() blocks.
+	/// The stage VMs must not be reset while the pipeline is in use, and
+	/// must not run after it is destroyed, as it owns the handoff buffers.
+	struct Pipeline {
+		struct Options {
+			size_t depth = 4;               // Items in flight, and slots per buffer
+			size_t slot_size = 1ULL << 20;  // Largest input and output of a stage
+			size_t threads = 0;             // Worker threads, 0 is one per stage
+			float  timeout = 1.0f;          // Seconds per stage call
+		};
+		struct Stage {
+			Machine* vm = nullptr;
+			Machine::address_t func = 0x0;
+		};
+		/// @brief Called on a worker thread when an item has passed through
+		/// every stage, or a stage failed. The output is only valid during
+		/// the call, as the slot is then reused. Must not throw.
+		using done_t = std::function<void(std::string_view output, std::exception_ptr)>;
+
+		Pipeline(std::vector<Stage> stages, const Options&);
+		~Pipeline();
+
+		/// @brief Copy @len bytes into the input of the first stage, and
+		/// start the item. Blocks while @depth items are in flight.
+		void submit(const void* data, size_t len, done_t done);
+		void submit(std::string_view data, done_t done) {
+			this->submit(data.data(), data.size(), std::move(done));
+		}
+		/// @brief Wait until every submitted item has completed.
+		void wait_idle();
+		/// @return The items that are queued or running.
+		size_t in_flight() const;
+		size_t stages() const noexcept { return m_stages.size(); }
+
+	private:
+		struct Item {
+			size_t   slot = 0;
+			size_t   length = 0;
+			std::exception_ptr error;
+			done_t   done;
+		};
+		struct StageState {
+			Stage    stage;
+			Machine::address_t input = 0;  // Guest address of the input buffer
+			Machine::address_t output = 0; // Guest address of the output buffer
+			pid_t    owner = 0;   // Thread that owns the vCPU timer, 0 is unknown
+			bool     busy = false;
+			std::deque<Item*> pending;
+		};
+		struct Buffer {
+			char*  ptr = nullptr;
+			size_t size = 0;
+		};
+		void schedule(size_t stage, Item*);
+		void run(size_t stage, Item*);
+		void finish(Item*);
+		char* slot_of(const Buffer& buffer, const Item& item) const noexcept {
+			return buffer.ptr + item.slot * m_slot_size;
+		}
+
+		const Options m_options;
+		const size_t m_slot_size;
+		std::vector<StageState> m_stages;
+		/* Buffer N is the input of stage N, and the output of stage N-1 */
+		std::vector<Buffer> m_buffers;
+		std::vector<Item> m_items;
+		std::vector<Item*> m_free;
+
+		mutable std::mutex m_mtx;
+		std::condition_variable m_free_cond;
+		std::condition_variable m_idle_cond;
+		ThreadPool m_workers;
+	};
+}
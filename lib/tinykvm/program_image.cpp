@@ -0,0 +1,177 @@
+#include "program_image.hpp"
+
+#include "machine.hpp"
+#include "util/elf.hpp"
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+namespace tinykvm {
+static constexpr uint64_t PAGE_SIZE = vMemory::PageSize();
+
+static bool same_remappings(const std::vector<VirtualRemapping>& a, const std::vector<VirtualRemapping>& b)
+{
+	return std::equal(a.begin(), a.end(), b.begin(), b.end(),
+		[] (const VirtualRemapping& x, const VirtualRemapping& y) {
+			return x.phys == y.phys && x.virt == y.virt && x.size == y.size
+				&& x.writable == y.writable && x.executable == y.executable
+				&& x.blackout == y.blackout;
+		});
+}
+
+ProgramImage::ProgramImage(std::string_view binary, const MachineOptions& options)
+	: m_binary(binary),
+	  m_max_mem(options.max_mem),
+	  m_vmem_base_address(options.vmem_base_address),
+	  m_remappings(options.remappings),
+	  m_vdso(options.vdso),
+	  m_split_hugepages(options.split_hugepages),
+	  m_executable_heap(options.executable_heap),
+	  m_dylink_address_hint(options.dylink_address_hint),
+	  m_heap_address_hint(options.heap_address_hint),
+	  m_brk_size(options.brk_size),
+	  m_stack_size(options.stack_size)
+{
+	/* The image is whatever a cold start leaves behind */
+	MachineOptions opts = options;
+	opts.cache_dynamic_images = false;
+	opts.snapshot_file.clear();
+	opts.snapshot_deltas.clear();
+	opts.snapshot_packed_file.clear();
+	opts.memfd_main_memory = false;
+	opts.snapshot_memfd = -1;
+	Machine machine { std::string_view(m_binary), opts };
+	const auto& memory = machine.main_memory();
+
+	this->m_image_base = machine.m_image_base;
+	this->m_stack_address = machine.m_stack_address;
+	this->m_heap_address = machine.m_heap_address;
+	this->m_brk_begin_address = machine.m_brk_begin_address;
+	this->m_brk_address = machine.m_brk_address;
+	this->m_brk_end_address = machine.m_brk_end_address;
+	this->m_start_address = machine.m_start_address;
+	this->m_kernel_end = machine.m_kernel_end;
+	this->m_mmap_cache = machine.m_mmap_cache;
+
+	/* New memory is zeroed, so only the non-zero pages are kept */
+	auto add_range = [&] (uint64_t begin, uint64_t end) {
+		begin &= ~(PAGE_SIZE - 1);
+		end = (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+		for (uint64_t addr = begin; addr < end; ) {
+			auto is_zero = [&] (uint64_t page) {
+				const char* p = memory.at(page, PAGE_SIZE);
+				return std::all_of(p, p + PAGE_SIZE, [] (char c) { return c == 0; });
+			};
+			if (is_zero(addr)) {
+				addr += PAGE_SIZE;
+				continue;
+			}
+			uint64_t run_end = addr + PAGE_SIZE;
+			while (run_end < end && !is_zero(run_end))
+				run_end += PAGE_SIZE;
+			const char* src = memory.at(addr, run_end - addr);
+			m_ranges.push_back({addr, std::vector<char>(src, src + (run_end - addr))});
+			addr = run_end;
+		}
+	};
+	/* Kernel pages and page tables */
+	add_range(memory.physbase, this->m_kernel_end);
+	/* Loaded segments, including .bss, which relocations may touch */
+	if (m_binary.empty())
+		return;
+	const auto* elf = elf_header(m_binary);
+	const auto* phdr = elf_offset_array<Elf64_Phdr>(m_binary, elf->e_phoff, elf->e_phnum);
+	for (const auto* hdr = phdr; hdr < phdr + elf->e_phnum; hdr++)
+	{
+		if (hdr->p_type != PT_LOAD || hdr->p_memsz == 0)
+			continue;
+		const uint64_t begin = this->m_image_base + hdr->p_vaddr;
+		const uint64_t end = std::min(begin + hdr->p_memsz, memory.physbase + memory.size);
+		if (begin < end)
+			add_range(std::max(begin, this->m_kernel_end), end);
+	}
+}
+
+size_t ProgramImage::memory_size() const noexcept
+{
+	size_t total = 0;
+	for (const auto& range : m_ranges)
+		total += range.data.size();
+	return total;
+}
+
+void ProgramImage::validate(const MachineOptions& options) const
+{
+	if (options.max_mem != m_max_mem || options.vmem_base_address != m_vmem_base_address
+		|| options.vdso != m_vdso || options.split_hugepages != m_split_hugepages
+		|| options.executable_heap != m_executable_heap
+		|| !same_remappings(options.remappings, m_remappings))
+	{
+		throw MachineException("Program image has a different memory layout than the machine");
+	}
+}
+
+bool ProgramImage::matches(std::string_view binary, const MachineOptions& options) const
+{
+	return binary == std::string_view(m_binary)
+		&& options.max_mem == m_max_mem && options.vmem_base_address == m_vmem_base_address
+		&& options.vdso == m_vdso && options.split_hugepages == m_split_hugepages
+		&& options.executable_heap == m_executable_heap
+		&& options.dylink_address_hint == m_dylink_address_hint
+		&& options.heap_address_hint == m_heap_address_hint
+		&& options.brk_size == m_brk_size
+		&& options.stack_size == m_stack_size
+		&& same_remappings(options.remappings, m_remappings);
+}
+
+static std::mutex image_cache_mtx;
+static std::unordered_multimap<size_t, std::shared_ptr<const ProgramImage>> image_cache;
+
+std::shared_ptr<const ProgramImage> ProgramImage::cached(std::string_view binary, const MachineOptions& options)
+{
+	const size_t hash = std::hash<std::string_view>{}(binary);
+	std::scoped_lock lock(image_cache_mtx);
+	auto [begin, end] = image_cache.equal_range(hash);
+	for (auto it = begin; it != end; ++it) {
+		if (it->second->matches(binary, options))
+			return it->second;
+	}
+	/* Loading while holding the lock, so that each image is made once */
+	auto image = std::make_shared<const ProgramImage>(binary, options);
+	image_cache.emplace(hash, image);
+	return image;
+}
+
+void ProgramImage::clear_cache()
+{
+	std::scoped_lock lock(image_cache_mtx);
+	image_cache.clear();
+}
+
+size_t ProgramImage::cache_size()
+{
+	std::scoped_lock lock(image_cache_mtx);
+	return image_cache.size();
+}
+
+void ProgramImage::install(Machine& machine) const
+{
+	auto& memory = machine.main_memory();
+	for (const auto& range : m_ranges) {
+		std::memcpy(memory.at(range.addr, range.data.size()), range.data.data(), range.data.size());
+	}
+	machine.m_binary = m_binary;
+	machine.m_image_base = m_image_base;
+	machine.m_stack_address = m_stack_address;
+	machine.m_heap_address = m_heap_address;
+	machine.m_brk_begin_address = m_brk_begin_address;
+	machine.m_brk_address = m_brk_address;
+	machine.m_brk_end_address = m_brk_end_address;
+	machine.m_start_address = m_start_address;
+	machine.m_kernel_end = m_kernel_end;
+	machine.m_mmap_cache = m_mmap_cache;
+	machine.m_vdso = m_vdso;
+}
+
+}
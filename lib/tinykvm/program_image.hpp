@@ -0,0 +1,82 @@
+#pragma once
+#include "common.hpp"
+#include "mmap_cache.hpp"
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace tinykvm {
+struct Machine;
+
+/* An ELF program that has been loaded once, ready to become the
+   memory of any number of new machines. The image is made by
+   cold-starting a machine from the binary, and keeps everything the
+   loader wrote into memory: the kernel pages, the initial page tables
+   and the loaded (and relocated) segments, together with the addresses
+   the loader settled on. A machine constructed from the image copies
+   these into its memory, instead of parsing the ELF and building the
+   page tables again.
+
+   The image owns a copy of the binary, which its machines refer to,
+   so it must outlive them. Machines must use the same memory layout
+   as the image: max_mem, vmem_base_address, remappings, vdso,
+   split_hugepages and executable_heap. Loader options (eg. stack_size
+   and the address hints) are taken from the image. */
+struct ProgramImage
+{
+	ProgramImage(std::string_view binary, const MachineOptions&);
+
+	std::string_view binary() const noexcept { return m_binary; }
+	/* Bytes of guest memory copied into each new machine */
+	size_t memory_size() const noexcept;
+	/* Throws if a machine with these options can't use the image */
+	void validate(const MachineOptions&) const;
+
+	/* A process-wide cache of images, keyed by the contents of the
+	   binary and the options that shape its image. Used by machines
+	   with MachineOptions::cache_dynamic_images, which keep their
+	   image alive, so clearing the cache is always safe. */
+	static std::shared_ptr<const ProgramImage> cached(std::string_view binary, const MachineOptions&);
+	static void clear_cache();
+	static size_t cache_size();
+
+private:
+	void install(Machine&) const;
+	bool matches(std::string_view binary, const MachineOptions&) const;
+
+	struct Range {
+		uint64_t addr;
+		std::vector<char> data;
+	};
+	std::string m_binary;
+	std::vector<Range> m_ranges;
+
+	/* Memory layout */
+	uint64_t m_max_mem;
+	uint64_t m_vmem_base_address;
+	std::vector<VirtualRemapping> m_remappings;
+	bool m_vdso;
+	bool m_split_hugepages;
+	bool m_executable_heap;
+	/* Loader options */
+	uint64_t m_dylink_address_hint;
+	uint64_t m_heap_address_hint;
+	uint64_t m_brk_size;
+	uint32_t m_stack_size;
+
+	/* Loader results */
+	uint64_t m_image_base;
+	uint64_t m_stack_address;
+	uint64_t m_heap_address;
+	uint64_t m_brk_begin_address;
+	uint64_t m_brk_address;
+	uint64_t m_brk_end_address;
+	uint64_t m_start_address;
+	uint64_t m_kernel_end;
+	MMapCache m_mmap_cache;
+
+	friend struct Machine;
+};
+
+}
@@ -1,26 +1,99 @@
 #include "machine.hpp"
+#include "remote_concurrency.hpp"
+#include "smp.hpp"
 #include "amd64/idt.hpp"
 #include "amd64/usercode.hpp"
 #include "linux/threads.hpp"
 #include "util/scoped_profiler.hpp"
+#include <cerrno>
+#include <algorithm>
+#include <cstddef>
 #include <linux/kvm.h>
 #include <thread>
 
 namespace tinykvm {
 static constexpr bool VERBOSE_REMOTE = false;
+thread_local Machine* Machine::t_remote_caller = nullptr;
 
 Machine& Machine::remote()
 {
 	if (this->has_remote())
-		return *m_remote;
+		return *remote_ptr();
 	throw MachineException("Remote not enabled");
 }
 const Machine& Machine::remote() const
 {
 	if (this->has_remote())
-		return *m_remote;
+		return *remote_ptr();
 	throw MachineException("Remote not enabled");
 }
+void Machine::remote_set_caller(Machine* caller) noexcept
+{
+	if (this->m_remote_concurrency != nullptr)
+		t_remote_caller = caller;
+	else
+		this->m_remote = caller;
+}
+
+RemoteConcurrency::RemoteConcurrency(std::vector<uint64_t> tls_bases)
+	: m_free_tls(std::move(tls_bases)), m_slots(m_free_tls.size())
+{
+}
+uint64_t RemoteConcurrency::acquire(uint64_t entry, bool& shared)
+{
+	// The call-kind lock is taken first, so that a caller
+	// running alone always finds a free TLS
+	shared = entry != 0 && this->is_shared_entry(entry);
+	if (shared)
+		m_rwlock.lock_shared();
+	else
+		m_rwlock.lock();
+
+	std::unique_lock lock(m_mtx);
+	m_cond.wait(lock, [this] { return !m_free_tls.empty(); });
+	const uint64_t tls_base = m_free_tls.back();
+	m_free_tls.pop_back();
+	return tls_base;
+}
+void RemoteConcurrency::release(uint64_t tls_base, bool shared)
+{
+	{
+		std::scoped_lock lock(m_mtx);
+		m_free_tls.push_back(tls_base);
+	}
+	m_cond.notify_one();
+	if (shared)
+		m_rwlock.unlock_shared();
+	else
+		m_rwlock.unlock();
+}
+
+void Machine::remote_enable_concurrency(std::vector<address_t> tls_bases)
+{
+	if (this->m_remote != nullptr || this->m_permanent_remote_connection)
+		throw MachineException("Concurrent remote cannot be connected to another VM");
+	if (tls_bases.empty()) {
+		if (this->has_threads()) {
+			for (const auto& it : this->threads().threads())
+				tls_bases.push_back(it.second.fsbase);
+		} else {
+			tls_bases.push_back(this->get_fsgs().first);
+		}
+	}
+	for (const auto tls_base : tls_bases) {
+		if (tls_base == 0)
+			throw MachineException("Concurrent remote needs a TLS base for every caller");
+	}
+	this->m_remote_concurrency.reset(new RemoteConcurrency(std::move(tls_bases)));
+	// Callers fault in pages and page tables at the same time
+	this->memory.smp_guards_enabled = true;
+}
+void Machine::remote_add_shared_entry(address_t entry)
+{
+	if (this->m_remote_concurrency == nullptr)
+		throw MachineException("Concurrent remote not enabled");
+	this->m_remote_concurrency->add_shared_entry(entry);
+}
 
 void Machine::permanent_remote_connect(Machine& other)
 {
@@ -32,32 +105,35 @@ void Machine::permanent_remote_connect(Machine& other)
 
 void Machine::remote_update_gigapage_mappings(Machine& remote, bool forced)
 {
-	if (remote.memory.remote_must_update_gigapages || forced)
-	{
-		remote.memory.remote_must_update_gigapages = false;
-
-		auto& caller = *this;
-		const auto remote_vmem = remote.main_memory().vmem();
-		static constexpr uint64_t PDE64_ADDR_MASK = ~0x8000000000000FFF;
-		auto* main_pml4 = caller.main_memory().page_at(caller.main_memory().page_tables);
-		auto* main_pdpt = caller.main_memory().page_at(main_pml4[0] & PDE64_ADDR_MASK);
-
-		auto* remote_pml4 = remote.main_memory().page_at(remote.main_memory().page_tables);
-		auto* remote_pdpt = remote.main_memory().page_at(remote_pml4[0] & PDE64_ADDR_MASK);
+	static constexpr uint64_t PDE64_ADDR_MASK = ~0x8000000000000FFF;
+	const auto remote_vmem = remote.main_memory().vmem();
+	// Gigabyte starting index and end index (rounded up)
+	const auto begin = remote_vmem.physbase >> 30;
+	const auto end   = (remote_vmem.remote_end + 0x3FFFFFFF) >> 30;
 
-		// Gigabyte starting index and end index (rounded up)
-		const auto begin = remote_vmem.physbase >> 30;
-		const auto end   = (remote_vmem.remote_end + 0x3FFFFFFF) >> 30;
+	auto& rmem = remote.memory;
+	if (rmem.remote_must_update_gigapages)
+	{
+		// The remote publishes its gigabyte entries once per change,
+		// instead of every caller walking its page tables
+		rmem.remote_must_update_gigapages = false;
+		auto* remote_pml4 = rmem.page_at(rmem.page_tables);
+		auto* remote_pdpt = rmem.page_at(remote_pml4[0] & PDE64_ADDR_MASK);
+		rmem.remote_pdpt_entries.assign(&remote_pdpt[begin], &remote_pdpt[end]);
+		rmem.remote_pdpt_version++;
+	}
 
-		for (size_t i = begin; i < end; i++) {
-			if constexpr (VERBOSE_REMOTE) {
-				if (main_pdpt[i] != remote_pdpt[i]) {
-					fprintf(stderr, "Updating remote PDPT entry %zu from 0x%lX to 0x%lX\n",
-						i, main_pdpt[i], remote_pdpt[i]);
-				}
-			}
-			main_pdpt[i] = remote_pdpt[i];
+	if (this->m_remote_pdpt_version != rmem.remote_pdpt_version || forced)
+	{
+		auto* main_pml4 = memory.page_at(memory.page_tables);
+		auto* main_pdpt = memory.page_at(main_pml4[0] & PDE64_ADDR_MASK);
+		if constexpr (VERBOSE_REMOTE) {
+			fprintf(stderr, "Updating remote PDPT entries %lu-%lu to version %lu\n",
+				begin, end, rmem.remote_pdpt_version);
 		}
+		std::copy(rmem.remote_pdpt_entries.begin(), rmem.remote_pdpt_entries.end(), &main_pdpt[begin]);
+		this->m_remote_pdpt_version = rmem.remote_pdpt_version;
+		this->memory.invalidate_tlb();
 	}
 
 	if (this->memory.foreign_banks.size() < remote.memory.banks.size()) {
@@ -96,9 +172,16 @@ void Machine::remote_connect(Machine& remote, bool connect_now)
 
 	if (connect_now)
 	{
-		// Copy gigabyte entries covered by remote memory into these page tables
-		this->remote_update_gigapage_mappings(remote, true);
-		remote.m_remote = this; // Mutual
+		// Copy gigabyte entries covered by remote memory into these page tables,
+		// unless the latest version is already in place
+		if (remote.m_remote_concurrency != nullptr) {
+			// Other callers may be changing the remote page tables
+			std::scoped_lock lock(remote.memory.mtx_smp);
+			this->remote_update_gigapage_mappings(remote);
+		} else {
+			this->remote_update_gigapage_mappings(remote);
+		}
+		remote.remote_set_caller(this); // Mutual
 	}
 
 	// Finalize
@@ -305,19 +388,40 @@ void Machine::remote_pfault_permanent_ipre(uint64_t return_stack, uint64_t retur
 	caller.enter_usermode();
 }
 
-Machine::address_t Machine::remote_activate_now()
+Machine::address_t Machine::remote_activate_now(address_t entry)
 {
 	if (this->m_remote == nullptr)
 		throw MachineException("Remote not enabled");
 
-	this->remote_connect(*this->m_remote, true);
+	auto* concurrency = this->m_remote->m_remote_concurrency.get();
+	if (concurrency != nullptr)
+	{
+		this->m_remote_tls_base = concurrency->acquire(entry, this->m_remote_shared);
+		if constexpr (VERBOSE_REMOTE) {
+			fprintf(stderr, "Concurrent remote: entry 0x%lX TLS 0x%lX (%s)\n",
+				entry, this->m_remote_tls_base, this->m_remote_shared ? "shared" : "alone");
+		}
+		try {
+			this->remote_connect(*this->m_remote, true);
+		} catch (...) {
+			concurrency->release(this->m_remote_tls_base, this->m_remote_shared);
+			this->m_remote_tls_base = 0;
+			throw;
+		}
+	} else {
+		this->remote_connect(*this->m_remote, true);
+	}
 	this->m_remote_connections++;
 
 	// Set current FSBASE to remote original FSBASE
 	vcpu.remote_original_tls_base = get_fsgs().first;
 
 	auto& remote = *this->m_remote;
-	if (remote.cpu().remote_serializer != nullptr)
+	if (concurrency != nullptr)
+	{
+		// Already holding a TLS of the remote
+	}
+	else if (remote.cpu().remote_serializer != nullptr)
 	{
 		// Use the remote serializer for this vCPU
 		remote.cpu().remote_serializer->lock();
@@ -344,12 +448,14 @@ Machine::address_t Machine::remote_activate_now()
 			return it->second.fsbase;
 		}
 	}
-	remote.m_remote = this; // Set halfway state
+	remote.remote_set_caller(this); // Set halfway state
 	// Set the vCPU machine to the remote machine
 	this->vcpu.set_original_machine(this);
 	this->vcpu.set_machine(&remote);
 	// Return FSBASE of remote, which can be set more efficiently
 	// in the mini-kernel assembly
+	if (concurrency != nullptr)
+		return this->m_remote_tls_base;
 	return remote.get_fsgs().first;
 }
 Machine::address_t Machine::remote_disconnect()
@@ -358,8 +464,14 @@ Machine::address_t Machine::remote_disconnect()
 		return 0;
 
 	auto& remote = *this->m_remote;
-	remote.m_remote = nullptr; // Clear halfway state
-	if (remote.cpu().remote_serializer != nullptr)
+	remote.remote_set_caller(nullptr); // Clear halfway state
+	if (remote.m_remote_concurrency != nullptr)
+	{
+		// Return the TLS, letting the next caller in
+		remote.m_remote_concurrency->release(this->m_remote_tls_base, this->m_remote_shared);
+		this->m_remote_tls_base = 0;
+	}
+	else if (remote.cpu().remote_serializer != nullptr)
 	{
 		// Unlock the remote serializer
 		remote.cpu().remote_serializer->unlock();
@@ -385,6 +497,7 @@ Machine::address_t Machine::remote_disconnect()
 	{
 		main_pdpt[i] = 0; // Clear entry
 	}
+	this->m_remote_pdpt_version = 0;
 
 	// Restore original FSBASE
 	auto tls_base = this->vcpu.remote_original_tls_base;
@@ -395,6 +508,324 @@ Machine::address_t Machine::remote_disconnect()
 	}
 	return tls_base;
 }
+void Machine::remote_session_begin()
+{
+	if (this->m_remote_session)
+		throw MachineException("Remote session already active");
+	if (is_remote_connected())
+		throw MachineException("Remote already connected");
+	ScopedProfiler<MachineProfiling::RemoteResume> prof(profiling());
+
+	// Remember where to return to when the session ends
+	if (this->m_remote_session_sregs == nullptr)
+		this->m_remote_session_sregs = std::make_unique<kvm_sregs>();
+	this->m_remote_session_regs = this->registers();
+	*this->m_remote_session_sregs = this->get_special_registers();
+	this->m_remote_session_stopped = vcpu.stopped;
+	// The calls use the stack below the current one, skipping the
+	// red zone, or the main stack if this VM has never been run
+	const uint64_t rsp = (this->registers().rsp != 0) ? this->registers().rsp : this->stack_address();
+	this->m_remote_session_stack = (rsp - 128) & ~uint64_t(0xF);
+
+	const auto remote_fsbase = this->remote_activate_now();
+	auto& sregs = vcpu.get_special_registers();
+	sregs.fs.base = remote_fsbase;
+	vcpu.set_special_registers(sregs);
+	this->m_remote_session = true;
+}
+void Machine::remote_session_run()
+{
+	// Run directly, so that the execution timeout of a running call
+	// (if any) is left untouched
+	vcpu.stopped = false;
+	while (vcpu.run_once());
+}
+void Machine::remote_session_end()
+{
+	if (!this->m_remote_session)
+		return;
+	this->m_remote_session = false;
+	this->remote_disconnect();
+
+	auto restore = [this] {
+		vcpu.set_special_registers(*this->m_remote_session_sregs);
+		vcpu.registers() = this->m_remote_session_regs;
+		vcpu.set_registers(vcpu.registers());
+		vcpu.stopped = this->m_remote_session_stopped;
+	};
+	try {
+		// The remote memory is no longer mapped in, but it may still
+		// be in the TLB. The entry code reloads CR3 before jumping to
+		// the exit code.
+		auto& regs = vcpu.registers();
+		regs = {};
+		regs.rflags = 2 | (3 << 12);
+		regs.rip = this->entry_address();
+		regs.r15 = this->exit_address();
+		regs.rsp = this->m_remote_session_stack;
+		vcpu.set_registers(regs);
+		this->enter_usermode();
+		this->remote_session_run();
+	} catch (...) {
+		restore();
+		throw;
+	}
+	restore();
+}
+
+void Machine::remote_call_batch(vCPU& cpu)
+{
+	auto& regs = cpu.registers();
+	const uint64_t entries_addr = regs.rdi;
+	const uint64_t count = regs.rsi;
+	auto finish = [&cpu] (int64_t result) {
+		cpu.registers().rax = result;
+		cpu.set_registers(cpu.registers());
+	};
+	if (UNLIKELY(&cpu != &this->vcpu || !this->has_remote())) {
+		finish(-ENOSYS);
+		return;
+	}
+	if (UNLIKELY(this->m_remote_session || this->is_remote_connected())) {
+		finish(-EBUSY);
+		return;
+	}
+	if (UNLIKELY(count > REMOTE_CALL_BATCH_MAX)) {
+		finish(-EINVAL);
+		return;
+	}
+	if (count == 0) {
+		finish(0);
+		return;
+	}
+	std::array<RemoteCallEntry, REMOTE_CALL_BATCH_MAX> entries;
+	this->copy_from_guest(entries.data(), entries_addr, count * sizeof(RemoteCallEntry));
+
+	// One connection for every call in the batch
+	this->remote_session_begin();
+	uint64_t completed = 0;
+	try {
+		for (; completed < count; completed++)
+		{
+			auto& entry = entries[completed];
+			if (LIKELY(this->is_foreign_address(entry.function))) {
+				entry.result = this->remote_session_call(entry.function,
+					entry.args[0], entry.args[1], entry.args[2], entry.args[3]);
+			} else {
+				entry.result = -EFAULT;
+			}
+			if constexpr (VERBOSE_REMOTE) {
+				fprintf(stderr, "Batched remote call 0x%lX = %ld\n", entry.function, entry.result);
+			}
+			this->copy_to_guest(entries_addr + completed * sizeof(RemoteCallEntry)
+				+ offsetof(RemoteCallEntry, result), &entry.result, sizeof(entry.result));
+		}
+	} catch (...) {
+		this->remote_session_end();
+		throw;
+	}
+	this->remote_session_end();
+	finish(completed);
+}
+
+void RemoteAsyncResult::complete(int64_t result, bool failed)
+{
+	{
+		std::scoped_lock lock(m_mtx);
+		m_result = result;
+		m_failed = failed;
+		m_done = true;
+	}
+	m_cond.notify_all();
+}
+bool RemoteAsyncResult::get(int64_t& result, bool& failed, bool wait)
+{
+	std::unique_lock lock(m_mtx);
+	if (!m_done) {
+		if (!wait)
+			return false;
+		m_cond.wait(lock, [this] { return m_done; });
+	}
+	result = m_result;
+	failed = m_failed;
+	return true;
+}
+
+RemoteAsync::RemoteAsync(std::vector<uint64_t> stks, uint32_t t, uint64_t tls)
+	: stacks(std::move(stks)), ticks(t), tls_base(tls), m_busy(stacks.size(), false)
+{
+}
+int RemoteAsync::submit(Call&& call)
+{
+	std::scoped_lock lock(m_mtx);
+	m_queue.push_back(std::move(call));
+	auto it = std::find(m_busy.begin(), m_busy.end(), false);
+	if (it == m_busy.end())
+		return -1;
+	*it = true;
+	return it - m_busy.begin();
+}
+bool RemoteAsync::next(size_t idx, Call& call)
+{
+	std::scoped_lock lock(m_mtx);
+	if (m_queue.empty()) {
+		m_busy.at(idx) = false;
+		return false;
+	}
+	call = std::move(m_queue.front());
+	m_queue.pop_front();
+	return true;
+}
+
+void Machine::remote_enable_async(unsigned vcpus, float timeout)
+{
+	static constexpr size_t REMOTE_ASYNC_STACK = 256UL << 10; // 256KB
+	if (vcpus == 0)
+		throw MachineException("Asynchronous remote calls need at least one vCPU");
+	if (this->m_remote_async != nullptr)
+		throw MachineException("Asynchronous remote calls already enabled");
+	// Without either, every vCPU would run its calls on the same TLS
+	if (vcpus > 1 && this->m_remote_concurrency == nullptr && vcpu.remote_serializer == nullptr)
+		throw MachineException("Asynchronous remote calls on several vCPUs need concurrency or a serializer", vcpus);
+
+	std::vector<address_t> stacks;
+	for (unsigned i = 0; i < vcpus; i++) {
+		stacks.push_back(this->mmap_allocate(REMOTE_ASYNC_STACK) + REMOTE_ASYNC_STACK);
+	}
+	// The TLS of the main thread, unless calls borrow one from a concurrent remote
+	const uint64_t tls_base = this->get_fsgs().first;
+	this->m_remote_async.reset(new RemoteAsync(std::move(stacks), to_ticks(timeout), tls_base));
+	// Create the vCPUs now, as callers may submit from many threads
+	for (unsigned i = 0; i < vcpus; i++) {
+		this->smp().async_call(i, [] (vCPU&) {});
+	}
+	this->smp_wait();
+	// The vCPUs fault in pages and page tables alongside the callers
+	this->memory.smp_guards_enabled = true;
+}
+
+uint64_t Machine::remote_call_async(address_t func, const std::array<uint64_t, 4>& args)
+{
+	if (!this->has_remote())
+		throw MachineException("Remote not enabled. Did you call 'remote_connect()'?");
+	auto& remote = *this->remote_ptr();
+	if (remote.m_remote_async == nullptr)
+		throw MachineException("Asynchronous calls not enabled. Did you call 'remote_enable_async()'?");
+	if (!this->is_foreign_address(func))
+		throw MachineException("Asynchronous remote call outside of remote memory", func);
+	if (this->m_remote_async_calls.size() >= REMOTE_CALL_ASYNC_MAX)
+		throw MachineException("Too many asynchronous remote calls pending", REMOTE_CALL_ASYNC_MAX);
+
+	auto result = std::make_shared<RemoteAsyncResult>();
+	const uint64_t ticket = ++this->m_remote_async_tickets;
+	this->m_remote_async_calls.emplace_back(ticket, result);
+
+	const int idx = remote.m_remote_async->submit({func, args, std::move(result)});
+	if (idx >= 0) {
+		remote.smp().async_call(idx, [&remote, idx] (vCPU& cpu) {
+			remote.remote_async_run(cpu, idx);
+		});
+	}
+	if constexpr (VERBOSE_REMOTE) {
+		fprintf(stderr, "Asynchronous remote call 0x%lX ticket %lu (vCPU %d)\n", func, ticket, idx);
+	}
+	return ticket;
+}
+
+long Machine::remote_async_result(uint64_t ticket, int64_t& result, bool wait)
+{
+	auto it = std::find_if(m_remote_async_calls.begin(), m_remote_async_calls.end(),
+		[ticket] (const auto& call) { return call.first == ticket; });
+	if (it == m_remote_async_calls.end())
+		return -ENOENT;
+	bool failed = false;
+	if (!it->second->get(result, failed, wait))
+		return -EAGAIN;
+	m_remote_async_calls.erase(it);
+	return failed ? -EIO : 0;
+}
+
+void Machine::remote_async_run(vCPU& cpu, size_t idx)
+{
+	auto& async = *this->m_remote_async;
+	RemoteAsync::Call call;
+	while (async.next(idx, call))
+	{
+		int64_t result = 0;
+		bool failed = false;
+		// Take a TLS the same way a synchronous caller would
+		uint64_t tls_base = async.tls_base;
+		bool shared = false;
+		if (m_remote_concurrency != nullptr)
+			tls_base = m_remote_concurrency->acquire(call.function, shared);
+		else if (vcpu.remote_serializer != nullptr)
+			vcpu.remote_serializer->lock();
+		try {
+			auto sregs = cpu.get_special_registers();
+			sregs.fs.base = tls_base;
+			cpu.set_special_registers(sregs);
+
+			tinykvm_x86regs regs;
+			this->setup_call(regs, call.function, async.stacks.at(idx),
+				call.args[0], call.args[1], call.args[2], call.args[3]);
+			cpu.set_registers(regs);
+			cpu.run(async.ticks);
+			result = cpu.registers().rax;
+		} catch (const std::exception& e) {
+			if constexpr (VERBOSE_REMOTE) {
+				fprintf(stderr, "Asynchronous remote call 0x%lX failed: %s\n", call.function, e.what());
+			}
+			failed = true;
+		}
+		if (m_remote_concurrency != nullptr)
+			m_remote_concurrency->release(tls_base, shared);
+		else if (vcpu.remote_serializer != nullptr)
+			vcpu.remote_serializer->unlock();
+
+		call.result->complete(result, failed);
+		call = {};
+	}
+}
+
+void Machine::remote_call_async(vCPU& cpu)
+{
+	auto& regs = cpu.registers();
+	auto finish = [&cpu] (int64_t result) {
+		cpu.registers().rax = result;
+		cpu.set_registers(cpu.registers());
+	};
+	if (UNLIKELY(&cpu != &this->vcpu || !this->has_remote() || !this->remote().has_remote_async())) {
+		finish(-ENOSYS);
+		return;
+	}
+	RemoteCallEntry entry;
+	this->copy_from_guest(&entry, regs.rdi, sizeof(entry));
+	if (UNLIKELY(!this->is_foreign_address(entry.function))) {
+		finish(-EFAULT);
+		return;
+	}
+	if (UNLIKELY(this->m_remote_async_calls.size() >= REMOTE_CALL_ASYNC_MAX)) {
+		finish(-EAGAIN);
+		return;
+	}
+	finish(this->remote_call_async(entry.function,
+		{entry.args[0], entry.args[1], entry.args[2], entry.args[3]}));
+}
+
+void Machine::remote_call_wait(vCPU& cpu)
+{
+	auto& regs = cpu.registers();
+	const uint64_t ticket = regs.rdi;
+	const uint64_t result_addr = regs.rsi;
+	const bool wait = regs.rdx != 0;
+	int64_t result = 0;
+	const long status = this->remote_async_result(ticket, result, wait);
+	if (status == 0 && result_addr != 0)
+		this->copy_to_guest(result_addr, &result, sizeof(result));
+	regs.rax = status;
+	cpu.set_registers(regs);
+}
+
 bool Machine::is_remote_connected() const noexcept
 {
 	return this->m_remote != nullptr && this->vcpu.remote_original_tls_base != 0;
@@ -403,7 +834,7 @@ bool Machine::is_remote_connected() const noexcept
 bool Machine::is_foreign_address(address_t addr) const noexcept
 {
 	if (this->has_remote()) {
-		const auto& rmem = this->m_remote->main_memory();
+		const auto& rmem = this->remote_ptr()->main_memory();
 		bool test = addr >= rmem.physbase && addr < rmem.remote_end;
 		if constexpr (VERBOSE_REMOTE) {
 			printf("Address 0x%lX is in remote memory 0x%lX-0x%lX? %s\n",
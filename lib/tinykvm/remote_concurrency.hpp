@@ -0,0 +1,82 @@
+#pragma once
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_set>
+#include <vector>
+
+namespace tinykvm {
+
+/* Lets several callers be connected to one remote VM at the same time.
+   Each connection borrows the TLS of one of the remote's guest threads,
+   waiting for one to become free. Calls into shared (read-mostly) entry
+   points run in parallel with each other, while a call into any other
+   entry point runs alone. */
+struct RemoteConcurrency {
+	RemoteConcurrency(std::vector<uint64_t> tls_bases);
+
+	/* Borrow a TLS base for a call into @entry. An @entry of zero
+	   is never shared. */
+	uint64_t acquire(uint64_t entry, bool& shared);
+	void release(uint64_t tls_base, bool shared);
+
+	/* Shared entry points must be added before callers connect */
+	void add_shared_entry(uint64_t entry) { m_shared_entries.insert(entry); }
+	bool is_shared_entry(uint64_t entry) const { return m_shared_entries.count(entry) != 0; }
+	size_t slots() const noexcept { return m_slots; }
+
+private:
+	std::shared_mutex m_rwlock;
+	std::mutex m_mtx;
+	std::condition_variable m_cond;
+	std::vector<uint64_t> m_free_tls;
+	std::unordered_set<uint64_t> m_shared_entries;
+	const size_t m_slots;
+};
+
+/* The result of an asynchronous remote call, shared between the
+   caller and the remote vCPU that runs it */
+struct RemoteAsyncResult {
+	void complete(int64_t result, bool failed);
+	/* Returns false when not done, and @wait is not set */
+	bool get(int64_t& result, bool& failed, bool wait);
+
+private:
+	std::mutex m_mtx;
+	std::condition_variable m_cond;
+	bool m_done = false;
+	bool m_failed = false;
+	int64_t m_result = 0;
+};
+
+/* Calls queued to run on the remote VM's own SMP vCPUs. A vCPU keeps
+   taking queued calls until there are none left, and then goes idle. */
+struct RemoteAsync {
+	struct Call {
+		uint64_t function = 0;
+		std::array<uint64_t, 4> args {};
+		std::shared_ptr<RemoteAsyncResult> result;
+	};
+	RemoteAsync(std::vector<uint64_t> stacks, uint32_t ticks, uint64_t tls_base);
+
+	/* Queue @call, returning the index of an idle vCPU that must
+	   be started, or -1 when a busy vCPU will pick it up */
+	int submit(Call&& call);
+	/* Take the next call for vCPU @idx, or mark it idle */
+	bool next(size_t idx, Call& call);
+
+	const std::vector<uint64_t> stacks; // Top of each vCPU stack
+	const uint32_t ticks;
+	const uint64_t tls_base;
+
+private:
+	std::mutex m_mtx;
+	std::deque<Call> m_queue;
+	std::vector<bool> m_busy;
+};
+
+} // tinykvm
@@ -0,0 +1,173 @@
+#include "sampling_profiler.hpp"
+
+#include "machine.hpp"
+#include <cstring>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace tinykvm {
+	/* See tinykvm_timer_signal_handler() */
+	extern thread_local const void* sampling_owner;
+
+SamplingProfiler::SamplingProfiler(unsigned frequency_hz, unsigned max_depth)
+	: m_frequency(frequency_hz != 0 ? frequency_hz : DEFAULT_FREQUENCY),
+	  m_max_depth(max_depth != 0 ? max_depth : 1)
+{
+	m_scratch.reserve(m_max_depth + 1);
+}
+SamplingProfiler::~SamplingProfiler()
+{
+	if (m_timer != nullptr) {
+		this->disarm();
+		timer_delete((timer_t)m_timer);
+	}
+}
+
+void SamplingProfiler::arm()
+{
+	const int tid = (int)syscall(SYS_gettid);
+	if (m_timer != nullptr && m_timer_tid != tid) {
+		timer_delete((timer_t)m_timer);
+		m_timer = nullptr;
+	}
+	if (m_timer == nullptr) {
+		/* Host CPU time of this thread, which includes time in the guest.
+		   Time spent blocked outside of the guest is not sampled. SIGPROF
+		   is installed with SA_RESTART, so that host system calls made on
+		   behalf of the guest are not interrupted by a sample. */
+		m_timer = Machine::create_vcpu_timer(this, CLOCK_THREAD_CPUTIME_ID, SIGPROF);
+		m_timer_tid = tid;
+	}
+	const long period_ns = 1'000'000'000L / m_frequency;
+	const struct itimerspec its {
+		.it_interval = { .tv_sec = period_ns / 1'000'000'000L, .tv_nsec = period_ns % 1'000'000'000L },
+		.it_value    = { .tv_sec = period_ns / 1'000'000'000L, .tv_nsec = period_ns % 1'000'000'000L },
+	};
+	sampling_owner = this;
+	timer_settime((timer_t)m_timer, 0, &its, nullptr);
+}
+void SamplingProfiler::disarm()
+{
+	if (m_timer == nullptr)
+		return;
+	const struct itimerspec its {};
+	timer_settime((timer_t)m_timer, 0, &its, nullptr);
+	if (sampling_owner == this)
+		sampling_owner = nullptr;
+}
+
+void SamplingProfiler::sample(const vCPU& cpu)
+{
+	const auto& regs = cpu.registers();
+	const auto& machine = cpu.machine();
+	m_scratch.clear();
+	m_scratch.push_back(regs.rip);
+	/* Walk the frame pointers: [rbp] is the callers frame pointer,
+	   and [rbp + 8] is the return address into the caller. Stacks
+	   grow down, so each frame must be above the previous one. */
+	uint64_t fp = regs.rbp;
+	while (m_scratch.size() <= m_max_depth && fp != 0 && (fp & 7) == 0)
+	{
+		uint64_t frame[2];
+		try {
+			machine.unsafe_copy_from_guest(frame, fp, sizeof(frame));
+		} catch (const MemoryException&) {
+			break;
+		}
+		if (frame[1] == 0)
+			break;
+		m_scratch.push_back(frame[1]);
+		if (frame[0] <= fp)
+			break;
+		fp = frame[0];
+	}
+	this->record(m_scratch.data(), m_scratch.size());
+}
+
+void SamplingProfiler::record(const uint64_t* frames, size_t count)
+{
+	m_samples++;
+	std::vector<uint64_t> stack(frames, frames + count);
+	auto it = m_stacks.find(stack);
+	if (it != m_stacks.end()) {
+		it->second++;
+	} else if (m_stacks.size() < max_stacks) {
+		m_stacks.emplace(std::move(stack), 1);
+	} else {
+		m_dropped++;
+	}
+}
+
+size_t SamplingProfiler::StackHash::operator() (const std::vector<uint64_t>& stack) const noexcept
+{
+	size_t hash = stack.size();
+	for (const uint64_t addr : stack)
+		hash ^= addr + 0x9E3779B97F4A7C15ULL + (hash << 6) + (hash >> 2);
+	return hash;
+}
+
+std::string SamplingProfiler::collapsed_stacks(const Machine& machine) const
+{
+	/* Every address is only resolved once */
+	std::unordered_map<uint64_t, std::string> symbols;
+	auto symbol_of = [&] (uint64_t addr) -> const std::string& {
+		auto it = symbols.find(addr);
+		if (it != symbols.end())
+			return it->second;
+		std::string name = machine.resolve(addr);
+		if (name.empty() || name[0] == '(') {
+			char buffer[32];
+			const int len = snprintf(buffer, sizeof(buffer), "0x%lX", (unsigned long)addr);
+			name.assign(buffer, len);
+		} else {
+			/* Samples are aggregated by function */
+			const size_t offset = name.find(" + 0x");
+			if (offset != std::string::npos)
+				name.resize(offset);
+		}
+		return symbols.emplace(addr, std::move(name)).first->second;
+	};
+
+	std::unordered_map<std::string, uint64_t> lines;
+	std::string line;
+	for (const auto& [stack, count] : m_stacks)
+	{
+		line.clear();
+		for (size_t i = stack.size(); i-- > 0; )
+		{
+			/* Return addresses can be just past the end of the
+			   calling function, so they are resolved one byte earlier */
+			const uint64_t addr = (i == 0) ? stack[i] : stack[i] - 1;
+			if (!line.empty())
+				line += ';';
+			line += symbol_of(addr);
+		}
+		lines[line] += count;
+	}
+
+	std::string result;
+	for (const auto& [stack, count] : lines) {
+		result += stack;
+		result += ' ';
+		result += std::to_string(count);
+		result += '\n';
+	}
+	return result;
+}
+
+void SamplingProfiler::write_collapsed_stacks(const Machine& machine, FILE* file) const
+{
+	const std::string stacks = this->collapsed_stacks(machine);
+	fwrite(stacks.data(), 1, stacks.size(), file);
+}
+
+void SamplingProfiler::reset()
+{
+	m_stacks.clear();
+	m_samples = 0;
+	m_dropped = 0;
+}
+
+} // tinykvm
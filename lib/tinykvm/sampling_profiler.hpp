@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace tinykvm {
+struct Machine;
+struct vCPU;
+
+/* A statistical profiler of guest code. While enabled, a SIGPROF timer
+   interrupts the vCPU at the given rate of host thread CPU time,
+   and the guest call stack is recorded: RIP and the return
+   addresses found by walking the frame pointers. Samples are
+   aggregated by call stack, and can be written out symbolized, in
+   the collapsed-stack format of flame graph tools:
+     main;compute;memcpy 42
+   Guests must be built with -fno-omit-frame-pointer for complete
+   stacks. Otherwise only RIP and whatever RBP happens to point to
+   is recorded. The overhead is one extra VM exit per sample. */
+struct SamplingProfiler {
+	static constexpr unsigned DEFAULT_FREQUENCY = 99; /* Hz */
+	static constexpr unsigned DEFAULT_MAX_DEPTH = 64;
+	static constexpr size_t   DEFAULT_MAX_STACKS = 16384;
+
+	SamplingProfiler(unsigned frequency_hz = DEFAULT_FREQUENCY,
+		unsigned max_depth = DEFAULT_MAX_DEPTH);
+	~SamplingProfiler();
+
+	/* Record the current call stack of a stopped vCPU */
+	void sample(const vCPU&);
+	/* Record a call stack, innermost frame first */
+	void record(const uint64_t* frames, size_t count);
+
+	/* Symbolize the samples with Machine::resolve(), one line per
+	   call stack, outermost frame first. Frames that do not resolve
+	   to a symbol are written as their address. */
+	std::string collapsed_stacks(const Machine&) const;
+	void write_collapsed_stacks(const Machine&, FILE*) const;
+
+	uint64_t samples() const noexcept { return m_samples; }
+	/* Samples that were not recorded, as there were too many stacks */
+	uint64_t dropped_samples() const noexcept { return m_dropped; }
+	size_t unique_stacks() const noexcept { return m_stacks.size(); }
+	unsigned frequency() const noexcept { return m_frequency; }
+	void reset();
+
+	/* Start and stop the sampling timer on the calling thread.
+	   Used by vCPU::run(). */
+	void arm();
+	void disarm();
+
+	/* Upper bound of unique call stacks kept in memory */
+	size_t max_stacks = DEFAULT_MAX_STACKS;
+
+private:
+	struct StackHash {
+		size_t operator() (const std::vector<uint64_t>& stack) const noexcept;
+	};
+	std::unordered_map<std::vector<uint64_t>, uint64_t, StackHash> m_stacks;
+	std::vector<uint64_t> m_scratch;
+	uint64_t m_samples = 0;
+	uint64_t m_dropped = 0;
+	unsigned m_frequency;
+	unsigned m_max_depth;
+	void*    m_timer = nullptr;
+	int      m_timer_tid = -1;
+};
+
+} // tinykvm
@@ -0,0 +1,68 @@
+#include "shared_data.hpp"
+
+#include "machine.hpp"
+#include <cstring>
+#include <sys/mman.h>
+
+namespace tinykvm {
+static constexpr uint64_t SHARED_DATA_ALIGN = 0x200000; // 2MB
+
+SharedData::SharedData(Machine& master, size_t slot_size, uint64_t addr)
+	: m_master(master)
+{
+	if (slot_size == 0)
+		throw MachineException("SharedData slot size cannot be zero");
+	if (master.is_forked())
+		throw MachineException("SharedData must be laid out in a master VM");
+	this->m_slot_size = (slot_size + vMemory::PageSize() - 1) & ~(vMemory::PageSize() - 1);
+	this->m_size = (HEADER_SIZE + 2 * m_slot_size + SHARED_DATA_ALIGN - 1) & ~(SHARED_DATA_ALIGN - 1);
+
+	if (addr == 0)
+		addr = master.mmap_allocate(m_size, PROT_READ, true);
+	if (addr & (SHARED_DATA_ALIGN - 1))
+		throw MachineException("SharedData address must be 2MB aligned", addr);
+	/* The host writes directly into the pages that forks read */
+	if (!master.main_memory().within(addr, m_size))
+		throw MachineException("SharedData must be in main memory", addr);
+	if (master.uses_cow_memory() && addr < master.shared_memory_boundary())
+		throw MachineException("SharedData must be above the shared memory boundary", addr);
+	this->m_addr = addr;
+	this->m_ptr = master.main_memory().at(addr, m_size);
+
+	std::memset(m_ptr, 0, HEADER_SIZE);
+	auto& hdr = this->header();
+	hdr.magic = MAGIC;
+	hdr.slot_offset = HEADER_SIZE;
+	hdr.slot_size = m_slot_size;
+}
+
+uint64_t SharedData::publish(const void* data, size_t len)
+{
+	if (len > m_slot_size)
+		throw MachineException("SharedData: Data does not fit in a slot", len);
+	/* Below the boundary the pages are copy-on-write, and forks
+	   would keep reading their own copies. */
+	if (m_master.uses_cow_memory() && m_addr < m_master.shared_memory_boundary())
+		throw MachineException("SharedData must be above the shared memory boundary", m_addr);
+	auto& hdr = this->header();
+	const uint64_t next = hdr.version + 1;
+	const unsigned idx = next % 2;
+	std::memcpy(slot(idx), data, len);
+	__atomic_store_n(&hdr.length[idx], len, __ATOMIC_RELAXED);
+	__atomic_store_n(&hdr.version, next, __ATOMIC_RELEASE);
+	return next;
+}
+
+std::string_view SharedData::current() const noexcept
+{
+	const auto& hdr = this->header();
+	const unsigned idx = hdr.version % 2;
+	return { slot(idx), size_t(hdr.length[idx]) };
+}
+
+uint64_t SharedData::version() const noexcept
+{
+	return __atomic_load_n(&header().version, __ATOMIC_ACQUIRE);
+}
+
+} // tinykvm
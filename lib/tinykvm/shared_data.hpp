@@ -0,0 +1,61 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace tinykvm {
+struct Machine;
+
+/* A versioned, read-only data region (eg. configuration or routing
+   tables) that the host keeps up to date while forks are running.
+   The region lives in the main memory of a master VM, above the
+   shared memory boundary given to prepare_copy_on_write(), so that
+   the master and all its forks see the same pages. The first page
+   holds the header, followed by two data slots. New versions are
+   written into the slot that is not current, and then published
+   by advancing the version word, which readers load atomically.
+   A reader that started on the current version may keep using its
+   slot until the version has advanced by two. There is a single
+   publisher, on the host. See guest/src/api.hpp for the guest side. */
+struct SharedData {
+	static constexpr uint32_t MAGIC = 0x53484431; // "SHD1"
+	static constexpr size_t HEADER_SIZE = 4096;
+	struct Header {
+		uint32_t magic;
+		uint32_t slot_offset;
+		uint64_t slot_size;
+		alignas(64) uint64_t version; // Publications so far, current slot is version % 2
+		uint64_t length[2];
+	};
+
+	/* Lay out a region for up to @slot_size bytes of data in @master,
+	   at @addr (2MB aligned), or at a new mmap address when zero. The
+	   region is rounded up to whole 2MB pages. When the master is not
+	   yet prepared for forking, pass address() as the shared memory
+	   boundary to prepare_copy_on_write(), after allocating the region. */
+	SharedData(Machine& master, size_t slot_size, uint64_t addr = 0);
+
+	/* Host side of the protocol. Copies @len bytes into the slot that
+	   is not current, and makes it current. Returns the new version. */
+	uint64_t publish(const void* data, size_t len);
+	uint64_t publish(std::string_view data) { return publish(data.data(), data.size()); }
+	/* The data of the current version */
+	std::string_view current() const noexcept;
+
+	uint64_t version() const noexcept;
+	uint64_t address() const noexcept { return m_addr; }
+	size_t size() const noexcept { return m_size; }
+	size_t slot_size() const noexcept { return m_slot_size; }
+
+private:
+	Header& header() const noexcept { return *(Header *)m_ptr; }
+	char* slot(unsigned idx) const noexcept { return m_ptr + HEADER_SIZE + idx * m_slot_size; }
+
+	Machine& m_master;
+	char*    m_ptr = nullptr;
+	uint64_t m_addr = 0;
+	size_t   m_size = 0;
+	size_t   m_slot_size = 0;
+};
+
+} // tinykvm
@@ -2,8 +2,18 @@
 
 #include "machine.hpp"
 #include <cassert>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
 #include <linux/kvm.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 namespace tinykvm {
 
@@ -37,6 +47,58 @@ void Machine::smp_vcpu_broadcast(std::function<void(vCPU&)> callback)
 	smp().broadcast(std::move(callback));
 }
 
+/* Parse a kernel CPU list, eg. "0-3,8-11" */
+static std::vector<int> parse_cpu_list(const std::string& list)
+{
+	std::vector<int> cpus;
+	size_t pos = 0;
+	while (pos < list.size()) {
+		char* end = nullptr;
+		const long first = strtol(&list[pos], &end, 10);
+		if (end == &list[pos])
+			break;
+		long last = first;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		for (long c = first; c <= last; c++)
+			cpus.push_back(c);
+		pos = end - list.data();
+		if (pos < list.size() && list[pos] == ',')
+			pos++;
+		else
+			break;
+	}
+	return cpus;
+}
+static std::vector<int> numa_node_cpus(int node)
+{
+	std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+	std::string list;
+	if (!std::getline(file, list))
+		return {};
+	return parse_cpu_list(list);
+}
+/* The NUMA node of a host CPU is named by a nodeN link in its sysfs
+   directory. Without NUMA support there is no link, and one node. */
+static int host_cpu_numa_node(int cpu)
+{
+	if (cpu < 0)
+		return -1;
+	const std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+	DIR* dir = opendir(path.c_str());
+	if (dir == nullptr)
+		return -1;
+	int node = 0;
+	while (struct dirent* ent = readdir(dir)) {
+		if (strncmp(ent->d_name, "node", 4) == 0 && isdigit(ent->d_name[4])) {
+			node = atoi(&ent->d_name[4]);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
 SMP::~SMP()
 {
 	m_cpus.clear();
@@ -44,12 +106,10 @@ SMP::~SMP()
 
 
 SMP::MPvCPU::MPvCPU(int c, Machine& m)
-	: thpool(1, 0, false)
 {
-	/* We store the CPU ID in GSBASE register
-	   XXX: We do not make sure that vCPUs stay on a specific
-	   thread here, which will decimate performance. */
-	auto f = thpool.enqueue([this, c, &m] {
+	/* We store the CPU ID in GSBASE register. The vCPU
+	   stays on the slot thread for its whole lifetime. */
+	slot.call([this, c, &m] {
 		this->cpu.smp_init(c, m);
 	});
 }
@@ -58,10 +118,9 @@ SMP::MPvCPU::~MPvCPU() {}
 
 void SMP::MPvCPU::blocking_message(std::function<void(vCPU&)> func)
 {
-	auto res = thpool.enqueue([this, func] {
+	slot.call([this, &func] {
 		func(this->cpu);
 	});
-	res.get();
 }
 
 void SMP::MPvCPU::async_exec(MPvCPU_data& data)
@@ -75,7 +134,10 @@ void SMP::MPvCPU::async_exec(MPvCPU_data& data)
 		This means it is *NOT* possible to schedule more than
 		one execution at the same time due to regs race.
 	*/
-	thpool.enqueue([&data] {
+	slot.wait();
+	this->m_data = &data;
+	slot.post([] (void* arg) {
+		auto& data = *static_cast<MPvCPU*> (arg)->m_data;
 		auto& vcpu = *data.vcpu;
 		try {
 			/*printf("Working from vCPU %d, RIP=0x%llX  RSP=0x%llX  ARG=0x%llX\n",
@@ -89,13 +151,81 @@ void SMP::MPvCPU::async_exec(MPvCPU_data& data)
 			printf("SMP memory exception: %s (addr=0x%lX, size=0x%lX)\n",
 				e.what(), e.addr(), e.size());
 			vcpu.decrement_smp_count();
-			throw;
 		} catch (const std::exception& e) {
 			printf("SMP exception: %s\n", e.what());
 			vcpu.decrement_smp_count();
-			throw;
 		}
-	});
+	}, this);
+}
+
+void SMP::MPvCPU::async_exec_dynamic(MPvCPU_data& data)
+{
+	slot.wait();
+	this->m_data = &data;
+	slot.post([] (void* arg) {
+		auto& self = *static_cast<MPvCPU*> (arg);
+		auto& data = *self.m_data;
+		auto& vcpu = *data.vcpu;
+		auto& work = *data.work;
+		self.stats = {};
+		try {
+			const uint64_t t0 = MachineProfiling::monotonic_ns();
+			const uint64_t deadline = t0 + uint64_t(data.ticks) * 1'000'000ULL;
+			while (true) {
+				const uint32_t begin =
+					work.next.fetch_add(work.chunk, std::memory_order_relaxed);
+				if (begin >= work.items)
+					break;
+				const uint32_t end = std::min(work.items - begin, work.chunk) + begin;
+				self.stats.chunks++;
+
+				for (uint32_t idx = begin; idx < end; idx++) {
+					/* Re-enter the guest function with the next item. The
+					   return address is still on the stack from setup_call. */
+					auto regs = data.regs;
+					regs.rdi = work.array + uint64_t(idx) * work.item_size;
+					regs.rsi = work.item_size;
+					regs.rdx = idx;
+					vcpu.set_registers(regs);
+
+					uint32_t ticks = 0;
+					if (data.ticks != 0) {
+						const uint64_t now = MachineProfiling::monotonic_ns();
+						if (UNLIKELY(now >= deadline))
+							throw MachineTimeoutException("SMP work timeout", data.ticks);
+						ticks = std::max<uint64_t>(1, (deadline - now) / 1'000'000ULL);
+					}
+					vcpu.run(ticks);
+					self.stats.items++;
+				}
+			}
+			self.stats.busy_ns = MachineProfiling::monotonic_ns() - t0;
+			vcpu.decrement_smp_count();
+
+		} catch (const tinykvm::MemoryException& e) {
+			printf("SMP memory exception: %s (addr=0x%lX, size=0x%lX)\n",
+				e.what(), e.addr(), e.size());
+			vcpu.decrement_smp_count();
+		} catch (const std::exception& e) {
+			printf("SMP exception: %s\n", e.what());
+			vcpu.decrement_smp_count();
+		}
+	}, this);
+}
+
+void SMP::MPvCPU::async_call(std::function<void(vCPU&)> func)
+{
+	slot.wait();
+	this->m_async_func = std::move(func);
+	slot.post([] (void* arg) {
+		auto& self = *static_cast<MPvCPU*> (arg);
+		try {
+			self.m_async_func(self.cpu);
+		} catch (const std::exception& e) {
+			printf("SMP exception: %s\n", e.what());
+		}
+		self.cpu.decrement_smp_count();
+	}, this);
 }
 
 SMP::MPvCPU_data* SMP::smp_allocate_vcpu_data(size_t num_cpus)
@@ -114,6 +244,7 @@ void SMP::prepare_cpus(size_t num_cpus)
 			/* NB: The cpu ids start at 1..2..3.. */
 			const int c = 1 + m_cpus.size();
 			m_cpus.emplace_back(c, machine());
+			this->apply_placement(m_cpus.size() - 1);
 		}
 		//printf("%zu SMP vCPUs initialized\n", this->m_cpus.size());
 	}
@@ -135,6 +266,81 @@ void vCPU::decrement_smp_count()
 	}
 }
 
+void SMP::MPvCPU::pin_to(int host_cpu)
+{
+	int err = 0;
+	slot.call([host_cpu, &err] {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(host_cpu, &set);
+		err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	});
+	if (err != 0) {
+		throw MachineException("SMP: Failed to pin vCPU thread", host_cpu);
+	}
+	this->pinned_cpu = host_cpu;
+}
+
+int SMP::memory_numa_node() const
+{
+	const auto& mem = machine().main_memory();
+	int node = -1;
+	if (syscall(SYS_get_mempolicy, &node, nullptr, 0,
+			mem.ptr, MPOL_F_NODE | MPOL_F_ADDR) < 0)
+		return -1;
+	return node;
+}
+
+void SMP::set_placement(const Placement& placement)
+{
+	std::vector<int> cpus = placement.host_cpus;
+	if (placement.numa_local) {
+		const int node = this->memory_numa_node();
+		if (node < 0) {
+			throw MachineException("SMP: Unable to find the NUMA node of main memory");
+		}
+		const auto node_cpus = numa_node_cpus(node);
+		if (cpus.empty()) {
+			cpus = node_cpus;
+		} else {
+			std::erase_if(cpus, [&] (int c) {
+				return std::find(node_cpus.begin(), node_cpus.end(), c) == node_cpus.end();
+			});
+		}
+		if (cpus.empty()) {
+			throw MachineException("SMP: No host CPUs left on the memory NUMA node", node);
+		}
+	}
+	this->m_host_cpus = std::move(cpus);
+	for (size_t c = 0; c < m_cpus.size(); c++)
+		this->apply_placement(c);
+}
+
+void SMP::apply_placement(size_t idx)
+{
+	if (m_host_cpus.empty())
+		return;
+	m_cpus.at(idx).pin_to(m_host_cpus[idx % m_host_cpus.size()]);
+}
+
+std::vector<SMP::PlacementInfo> SMP::placement()
+{
+	std::vector<PlacementInfo> results;
+	results.reserve(m_cpus.size());
+	for (auto& mp : m_cpus) {
+		mp.blocking_message([&] (vCPU& cpu) {
+			const int host_cpu = sched_getcpu();
+			results.push_back(PlacementInfo{
+				.vcpu_id = cpu.cpu_id,
+				.pinned_cpu = mp.pinned_cpu,
+				.host_cpu = host_cpu,
+				.numa_node = host_cpu_numa_node(host_cpu),
+			});
+		});
+	}
+	return results;
+}
+
 void SMP::broadcast(std::function<void(vCPU &)> func)
 {
 	for (auto& cpu : this->m_cpus) {
@@ -164,6 +370,43 @@ void SMP::timed_smpcall_array(size_t num_cpus,
 	}
 }
 
+void SMP::timed_smpcall_dynamic(size_t num_cpus,
+	address_t stack_base, uint32_t stack_size,
+	address_t addr, float timeout,
+	address_t array, uint32_t array_isize,
+	uint32_t items, uint32_t chunk)
+{
+	assert(num_cpus != 0);
+	this->prepare_cpus(num_cpus);
+	auto* data = smp_allocate_vcpu_data(num_cpus);
+
+	auto work = std::make_shared<WorkQueue>();
+	work->items = items;
+	work->chunk = std::max(chunk, 1u);
+	work->item_size = array_isize;
+	work->array = array;
+
+	__sync_fetch_and_add(&m_smp_active, num_cpus);
+
+	for (size_t c = 0; c < num_cpus; c++) {
+		data[c].vcpu = &m_cpus[c].cpu;
+		data[c].ticks = to_ticks(timeout);
+		data[c].work = work;
+		/* Arguments are filled in per item by the vCPU */
+		machine().setup_call(data[c].regs, addr,
+			stack_base + (c+1) * stack_size);
+		m_cpus[c].async_exec_dynamic(data[c]);
+	}
+}
+
+void SMP::async_call(size_t cpu_index, std::function<void(vCPU&)> func)
+{
+	this->prepare_cpus(cpu_index + 1);
+	__sync_fetch_and_add(&m_smp_active, 1);
+
+	m_cpus[cpu_index].async_call(std::move(func));
+}
+
 void SMP::timed_smpcall_clone(size_t num_cpus,
 	address_t stack_base, uint32_t stack_size,
 	float timeout, const tinykvm_x86regs& regs)
@@ -188,8 +431,31 @@ void SMP::timed_smpcall_clone(size_t num_cpus,
 void SMP::wait()
 {
 	for (size_t c = 0; c < m_cpus.size(); c++) {
-		m_cpus[c].thpool.wait_until_nothing_in_flight();
+		m_cpus[c].wait();
+	}
+}
+
+void SMP::reset()
+{
+	for (auto& mp : m_cpus) {
+		mp.cpu.last_fault_address = 0;
+		mp.stats = {};
+	}
+}
+
+std::vector<SMP::WorkStats> SMP::work_stats(unsigned cpus)
+{
+	if (cpus == 0 || cpus > m_cpus.size())
+		cpus = m_cpus.size();
+
+	std::vector<WorkStats> results;
+	results.resize(cpus);
+	for (size_t c = 0; c < cpus; c++) {
+		m_cpus[c].blocking_message([&] (auto&) {
+			results[c] = m_cpus[c].stats;
+		});
 	}
+	return results;
 }
 
 std::vector<long> SMP::gather_return_values(unsigned cpus)
@@ -1,9 +1,10 @@
 #pragma once
 #include "machine.hpp"
+#include <atomic>
 #include <deque>
 #include <functional>
 #include <vector>
-#include "util/threadpool.h"
+#include "util/command_slot.hpp"
 
 namespace tinykvm
 {
@@ -18,35 +19,110 @@ namespace tinykvm
 			address_t stack, uint32_t stack_size,
 			address_t addr, float tmo,
 			address_t array, uint32_t array_item_size);
+		/// @brief Process @items array items of @array_item_size bytes each,
+		/// with the array items handed out dynamically to @cpus vCPUs. Each
+		/// vCPU claims @chunk items at a time from a shared index, and runs
+		/// the guest function once per item as:
+		///   void func(void* item, uint32_t item_size, uint32_t index);
+		/// The function is re-entered with the next item when it returns,
+		/// without a full setup_call(), so it must return normally. The
+		/// timeout covers the whole call on each vCPU. Use work_stats()
+		/// after wait() to see how the items were distributed.
+		void timed_smpcall_dynamic(size_t cpus,
+			address_t stack, uint32_t stack_size,
+			address_t addr, float tmo,
+			address_t array, uint32_t array_item_size,
+			uint32_t items, uint32_t chunk = 1);
 		void timed_smpcall_clone(size_t num_cpus,
 			address_t stack_base, uint32_t stack_size,
 			float timeout, const tinykvm_x86regs& regs);
 
+		/// @brief Run @func on the SMP vCPU at @cpu_index (0 is the first SMP
+		/// vCPU), creating vCPUs as needed. Exceptions are printed and dropped.
+		void async_call(size_t cpu_index, std::function<void(vCPU&)> func);
+
 		int smp_active() const noexcept { return m_smp_active; }
 		void wait();
+		/// @brief Called by Machine::reset_to() once the vCPUs are idle.
+		/// The vCPUs and their threads are kept, sharing the work memory
+		/// of the (forked) machine, and only per-request state is cleared.
+		void reset();
 		/* Retrieve return values from a smpcall */
 		std::vector<long> gather_return_values(unsigned cpus = 0);
 
 		void broadcast(std::function<void(vCPU&)>);
 
+		/* Per-vCPU completion stats from the last timed_smpcall_dynamic */
+		struct WorkStats {
+			uint32_t items = 0;   // Array items processed
+			uint32_t chunks = 0;  // Chunks claimed from the shared index
+			uint64_t busy_ns = 0; // Time from start until no work was left
+		};
+		std::vector<WorkStats> work_stats(unsigned cpus = 0);
+
+		/* Host placement of the vCPU threads */
+		struct Placement {
+			/* Host CPUs to pin vCPU threads to, round-robin. When empty,
+			   threads are not pinned unless numa_local is set. */
+			std::vector<int> host_cpus;
+			/* Restrict host_cpus (or all CPUs, when empty) to the NUMA
+			   node that holds the main memory of the machine. */
+			bool numa_local = false;
+		};
+		/// @brief Pin current and future vCPU threads according to
+		/// @placement. New vCPUs are pinned in prepare_cpus().
+		void set_placement(const Placement& placement);
+		struct PlacementInfo {
+			int vcpu_id;
+			int pinned_cpu; // -1 when not pinned
+			int host_cpu;   // Host CPU the thread is running on now
+			int numa_node;  // NUMA node of host_cpu
+		};
+		/// @brief Report where each vCPU thread is placed.
+		std::vector<PlacementInfo> placement();
+		/// @return The NUMA node of the main memory, or -1 if unknown.
+		int memory_numa_node() const;
+
 		Machine& machine() noexcept { return m_machine; }
 		const Machine& machine() const noexcept { return m_machine; }
 
+		/* Shared by all vCPUs in a timed_smpcall_dynamic */
+		struct WorkQueue
+		{
+			std::atomic<uint32_t> next {0};
+			uint32_t items = 0;
+			uint32_t chunk = 1;
+			uint32_t item_size = 0;
+			address_t array = 0;
+		};
 		struct MPvCPU_data
 		{
 			vCPU* vcpu = nullptr;
 			uint32_t ticks = 0;
 			struct tinykvm_x86regs regs;
+			std::shared_ptr<WorkQueue> work;
 		};
+		/* Each vCPU runs on its own thread, which receives commands
+		   through a single-entry slot without allocating. Posting a
+		   command waits for the previous one to complete. */
 		struct MPvCPU
 		{
 			void blocking_message(std::function<void(vCPU &)>);
 			void async_exec(struct MPvCPU_data &);
+			void async_exec_dynamic(struct MPvCPU_data &);
+			void async_call(std::function<void(vCPU&)>);
+			void pin_to(int host_cpu);
+			void wait() const { slot.wait(); }
 
 			MPvCPU(int, Machine &);
 			~MPvCPU();
 			vCPU cpu;
-			ThreadPool thpool;
+			WorkStats stats;
+			int pinned_cpu = -1;
+		private:
+			MPvCPU_data* m_data = nullptr;
+			std::function<void(vCPU&)> m_async_func;
+			CommandSlot slot;
 		};
 
 		SMP(Machine& m) : m_machine{m} {}
@@ -55,12 +131,14 @@ namespace tinykvm
 		MPvCPU_data* smp_allocate_vcpu_data(size_t);
 		void prepare_cpus(size_t num_cpus);
 		vCPU& smp_cpu(size_t idx);
+		void apply_placement(size_t idx);
 
 		Machine& m_machine;
 		std::deque<MPvCPU> m_cpus;
 		std::vector<const struct MPvCPU_data *> m_smp_data;
 		std::mutex m_smp_data_mtx;
 		int m_smp_active = 0;
+		std::vector<int> m_host_cpus; // Resolved from Placement
 
 		friend struct vCPU;
 	};
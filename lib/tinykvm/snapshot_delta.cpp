@@ -0,0 +1,214 @@
+#include "machine.hpp"
+
+#include <fcntl.h>
+#include <random>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace tinykvm {
+
+/* A delta snapshot file: the header, the memory offsets of the pages
+   and then the (page-aligned) pages themselves, in the same order. */
+struct SnapshotDeltaHeader {
+	static constexpr uint32_t MAGIC = 0x444D4356; // 'VCMD'
+	static constexpr uint32_t VERSION = 1;
+	uint32_t magic;
+	uint32_t version;
+	uint64_t memory_size; // Main memory and the snapshot state area
+	uint64_t parent_id;   // The chain of snapshots this delta is on top of
+	uint64_t id;
+	uint64_t pages;
+};
+static constexpr uint64_t PAGE_SIZE = vMemory::PageSize();
+
+static uint64_t hash_page(const char* page)
+{
+	return std::hash<std::string_view>{}(std::string_view(page, PAGE_SIZE));
+}
+static uint64_t page_data_offset(uint64_t pages)
+{
+	const uint64_t end = sizeof(SnapshotDeltaHeader) + pages * sizeof(uint64_t);
+	return (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+static bool read_fully(int fd, void* data, size_t len, off_t offset)
+{
+	while (len > 0) {
+		const ssize_t res = pread(fd, data, len, offset);
+		if (res <= 0)
+			return false;
+		data = (char *)data + res;
+		len -= res;
+		offset += res;
+	}
+	return true;
+}
+
+void vMemory::load_snapshot_deltas(const std::vector<std::string>& deltas)
+{
+	const uint64_t memory_size = this->size + ColdStartStateSize();
+	// The state area of the base snapshot identifies it
+	this->snapshot_chain_id = hash_page((const char *)this->get_snapshot_state_area()) ^ memory_size;
+	this->snapshot_delta_pages.clear();
+
+	for (const auto& filename : deltas)
+	{
+		const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			throw std::runtime_error("Failed to open delta snapshot: " + filename);
+		}
+		auto read_or_throw = [&] (void* data, size_t len, off_t offset) {
+			if (!read_fully(fd, data, len, offset)) {
+				close(fd);
+				throw std::runtime_error("Failed to read delta snapshot: " + filename);
+			}
+		};
+		SnapshotDeltaHeader hdr;
+		read_or_throw(&hdr, sizeof(hdr), 0);
+		if (hdr.magic != SnapshotDeltaHeader::MAGIC || hdr.version != SnapshotDeltaHeader::VERSION) {
+			close(fd);
+			throw std::runtime_error("Not a delta snapshot: " + filename);
+		}
+		if (hdr.memory_size != memory_size || hdr.pages > memory_size / PAGE_SIZE) {
+			close(fd);
+			throw std::runtime_error("Delta snapshot has incorrect memory size: " + filename);
+		}
+		if (hdr.parent_id != this->snapshot_chain_id) {
+			close(fd);
+			throw std::runtime_error("Delta snapshot is not on top of the previous snapshots: " + filename);
+		}
+		std::vector<uint64_t> offsets(hdr.pages);
+		read_or_throw(offsets.data(), offsets.size() * sizeof(uint64_t), sizeof(hdr));
+
+		// Read each run of consecutive pages with a single read
+		off_t file_offset = page_data_offset(hdr.pages);
+		for (size_t i = 0; i < offsets.size(); )
+		{
+			const uint64_t begin = offsets[i];
+			if ((begin & (PAGE_SIZE - 1)) != 0 || begin >= memory_size) {
+				close(fd);
+				throw std::runtime_error("Delta snapshot has an invalid page: " + filename);
+			}
+			size_t count = 1;
+			while (i + count < offsets.size() && offsets[i + count] == begin + count * PAGE_SIZE
+				&& offsets[i + count] < memory_size)
+				count++;
+			read_or_throw(this->ptr + begin, count * PAGE_SIZE, file_offset);
+			for (size_t p = 0; p < count; p++) {
+				const uint64_t offset = begin + p * PAGE_SIZE;
+				this->snapshot_delta_pages.insert_or_assign(offset, hash_page(this->ptr + offset));
+			}
+			file_offset += count * PAGE_SIZE;
+			i += count;
+		}
+		close(fd);
+		this->snapshot_chain_id = hdr.id;
+	}
+}
+
+size_t vMemory::save_snapshot_delta(const std::string& filename) const
+{
+	if (this->snapshot_chain_id == 0) {
+		throw std::runtime_error("Delta snapshots need a VM loaded from a snapshot_file");
+	}
+	if (this->snapshot_restore != nullptr || this->snapshot_packed) {
+		// Every restored page is anonymous memory
+		throw std::runtime_error("Delta snapshots need a snapshot_file that is mapped");
+	}
+	const uint64_t memory_size = this->size + ColdStartStateSize();
+	const uint64_t total_pages = memory_size / PAGE_SIZE;
+	const int pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+	if (pagemap_fd < 0) {
+		throw std::runtime_error("Failed to open /proc/self/pagemap");
+	}
+
+	// The snapshot files are mapped privately, so the pages that have
+	// been written to are no longer file pages, but anonymous copies.
+	static constexpr uint64_t PM_PRESENT = 1ULL << 63;
+	static constexpr uint64_t PM_SWAPPED = 1ULL << 62;
+	static constexpr uint64_t PM_FILE    = 1ULL << 61;
+	std::vector<uint64_t> offsets;
+	std::vector<uint64_t> entries(512);
+	for (uint64_t page = 0; page < total_pages; page += entries.size())
+	{
+		const size_t count = std::min<uint64_t>(entries.size(), total_pages - page);
+		const off_t pm_offset = ((uintptr_t)this->ptr / PAGE_SIZE + page) * sizeof(uint64_t);
+		if (pread(pagemap_fd, entries.data(), count * sizeof(uint64_t), pm_offset) != ssize_t(count * sizeof(uint64_t))) {
+			close(pagemap_fd);
+			throw std::runtime_error("Failed to read /proc/self/pagemap");
+		}
+		for (size_t i = 0; i < count; i++) {
+			const uint64_t pm = entries[i];
+			const bool anonymous = ((pm & PM_PRESENT) && !(pm & PM_FILE)) || (pm & PM_SWAPPED);
+			if (!anonymous)
+				continue;
+			const uint64_t offset = (page + i) * PAGE_SIZE;
+			// Unchanged pages from the deltas below are already there
+			auto it = this->snapshot_delta_pages.find(offset);
+			if (it != this->snapshot_delta_pages.end() && it->second == hash_page(this->ptr + offset))
+				continue;
+			offsets.push_back(offset);
+		}
+	}
+	close(pagemap_fd);
+
+	SnapshotDeltaHeader hdr {};
+	hdr.magic = SnapshotDeltaHeader::MAGIC;
+	hdr.version = SnapshotDeltaHeader::VERSION;
+	hdr.memory_size = memory_size;
+	hdr.parent_id = this->snapshot_chain_id;
+	std::random_device rd;
+	do {
+		hdr.id = (uint64_t(rd()) << 32) | rd();
+	} while (hdr.id == 0 || hdr.id == hdr.parent_id);
+	hdr.pages = offsets.size();
+
+	// Write to a temporary file, and replace the delta when complete
+	const std::string tmpname = filename + ".tmp";
+	const int fd = open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		throw std::runtime_error("Failed to create delta snapshot: " + tmpname);
+	}
+	auto write_fully = [&] (const void* data, size_t len, off_t offset) {
+		while (len > 0) {
+			const ssize_t res = pwrite(fd, data, len, offset);
+			if (res <= 0) {
+				close(fd);
+				unlink(tmpname.c_str());
+				throw std::runtime_error("Failed to write delta snapshot: " + tmpname);
+			}
+			data = (const char *)data + res;
+			len -= res;
+			offset += res;
+		}
+	};
+	write_fully(&hdr, sizeof(hdr), 0);
+	write_fully(offsets.data(), offsets.size() * sizeof(uint64_t), sizeof(hdr));
+	off_t file_offset = page_data_offset(hdr.pages);
+	for (size_t i = 0; i < offsets.size(); )
+	{
+		size_t count = 1;
+		while (i + count < offsets.size() && offsets[i + count] == offsets[i] + count * PAGE_SIZE)
+			count++;
+		write_fully(this->ptr + offsets[i], count * PAGE_SIZE, file_offset);
+		file_offset += count * PAGE_SIZE;
+		i += count;
+	}
+	const bool synced = fsync(fd) == 0;
+	if (close(fd) < 0 || !synced || rename(tmpname.c_str(), filename.c_str()) < 0) {
+		unlink(tmpname.c_str());
+		throw std::runtime_error("Failed to save delta snapshot: " + filename);
+	}
+	return offsets.size();
+}
+
+size_t Machine::save_snapshot_delta(const std::string& filename,
+	const std::vector<std::pair<uint64_t, uint64_t>>& populate_pages) const
+{
+	if (!this->memory.has_snapshot_area()) {
+		throw std::runtime_error("No snapshot state area allocated");
+	}
+	this->save_snapshot_state_now(populate_pages);
+	return this->memory.save_snapshot_delta(filename);
+}
+
+} // tinykvm
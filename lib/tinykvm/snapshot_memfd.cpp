@@ -0,0 +1,124 @@
+#include "machine.hpp"
+
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "numa.hpp"
+
+namespace tinykvm {
+/* Every seal that keeps the contents and size from ever changing */
+static constexpr int MEMFD_SEALS = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL;
+
+vMemory::AllocationResult
+	vMemory::allocate_memfd_memory(const MachineOptions& options, size_t size)
+{
+	size += ColdStartStateSize();
+	if (options.snapshot_memfd >= 0) {
+		// Attach to the sealed memory of a master in another process
+		const int fd = options.snapshot_memfd;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size != off_t(size)) {
+			throw std::runtime_error("Shared memory file has incorrect size");
+		}
+		const int seals = fcntl(fd, F_GET_SEALS);
+		if (seals < 0 || (seals & MEMFD_SEALS) != MEMFD_SEALS) {
+			throw std::runtime_error("Shared memory file is not sealed, see Machine::share_memory()");
+		}
+		char* ptr = (char*) mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+		if (ptr == MAP_FAILED) {
+			memory_exception("Failed to mmap shared memory file", 0, size);
+		}
+		return AllocationResult{ptr, size - ColdStartStateSize(), fd};
+	}
+	const int fd = memfd_create("tinykvm-master", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		throw std::runtime_error("Failed to create main memory file");
+	}
+	if (ftruncate(fd, size) != 0) {
+		close(fd);
+		throw std::runtime_error("Failed to set size of main memory file");
+	}
+	char* ptr = (char*) mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_NORESERVE, fd, 0);
+	if (ptr == MAP_FAILED) {
+		close(fd);
+		memory_exception("Failed to mmap main memory file", 0, size);
+	}
+	numa_bind(ptr, size, options.numa_node, options.numa_interleave);
+	return AllocationResult{ptr, size - ColdStartStateSize(), fd};
+}
+
+int Machine::share_memory(const std::vector<std::pair<uint64_t, uint64_t>>& populate_pages)
+{
+	if (memory.memfd < 0) {
+		throw MachineException("Sharing main memory needs the memfd_main_memory option");
+	}
+	if (memory.memfd_sealed) {
+		return memory.memfd;
+	}
+	this->save_snapshot_state_now(populate_pages);
+	// The file can only be sealed once nothing maps it writable
+	const size_t total = memory.size + vMemory::ColdStartStateSize();
+	if (mmap(memory.ptr, total, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, memory.memfd, 0) == MAP_FAILED)
+	{
+		throw MemoryException("Failed to remap main memory privately", memory.physbase, total);
+	}
+	memory.invalidate_tlb();
+	if (fcntl(memory.memfd, F_ADD_SEALS, MEMFD_SEALS) != 0) {
+		throw MachineException("Failed to seal main memory file", errno);
+	}
+	memory.memfd_sealed = true;
+	return memory.memfd;
+}
+
+void Machine::send_memory_fd(int socket, int memfd)
+{
+	char dummy = 'M';
+	struct iovec iov { &dummy, 1 };
+	alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))] {};
+	struct msghdr msg {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	std::memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+	if (sendmsg(socket, &msg, MSG_NOSIGNAL) != 1) {
+		throw MachineException("Failed to send memory file", errno);
+	}
+}
+
+int Machine::receive_memory_fd(int socket)
+{
+	char dummy = 0;
+	struct iovec iov { &dummy, 1 };
+	alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))] {};
+	struct msghdr msg {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(socket, &msg, MSG_CMSG_CLOEXEC) != 1) {
+		throw MachineException("Failed to receive memory file", errno);
+	}
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+		|| cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+	{
+		throw MachineException("No memory file was received");
+	}
+	int memfd = -1;
+	std::memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+	return memfd;
+}
+
+} // tinykvm
@@ -0,0 +1,289 @@
+#include "machine.hpp"
+
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <unordered_map>
+#ifdef TINYKVM_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef TINYKVM_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace tinykvm {
+
+/* A packed snapshot file: the header, then one entry per page of memory
+   (0 for a zero page, otherwise 1 + the index of a unique page), then
+   the block directory, and finally the unique pages, compressed in
+   blocks of up to BLOCK_PAGES pages each. */
+struct PackedSnapshotHeader {
+	static constexpr uint32_t MAGIC = 0x504D4356; // 'VCMP'
+	static constexpr uint32_t VERSION = 1;
+	static constexpr uint32_t BLOCK_PAGES = 64;
+	enum Codec : uint32_t {
+		NONE = 0,
+		ZSTD = 1,
+		ZLIB = 2,
+	};
+	uint32_t magic;
+	uint32_t version;
+	uint32_t codec;
+	uint32_t block_pages;
+	uint64_t memory_size; // Main memory and the snapshot state area
+	uint64_t pages;
+	uint64_t unique_pages;
+	uint64_t blocks;
+};
+struct PackedSnapshotBlock {
+	uint64_t offset;
+	uint32_t size; // Stored uncompressed when the size of the pages
+	uint32_t pages;
+};
+static constexpr uint64_t PAGE_SIZE = vMemory::PageSize();
+
+#if defined(TINYKVM_HAVE_ZSTD)
+static constexpr uint32_t DEFAULT_CODEC = PackedSnapshotHeader::ZSTD;
+#elif defined(TINYKVM_HAVE_ZLIB)
+static constexpr uint32_t DEFAULT_CODEC = PackedSnapshotHeader::ZLIB;
+#else
+static constexpr uint32_t DEFAULT_CODEC = PackedSnapshotHeader::NONE;
+#endif
+
+/* Compress @src into @dst, returning the compressed size, or 0 when
+   it's better to store the block uncompressed. */
+static size_t compress_block(uint32_t codec, const char* src, size_t len, std::vector<char>& dst)
+{
+	switch (codec) {
+#ifdef TINYKVM_HAVE_ZSTD
+	case PackedSnapshotHeader::ZSTD: {
+		dst.resize(ZSTD_compressBound(len));
+		const size_t res = ZSTD_compress(dst.data(), dst.size(), src, len, 3);
+		return (ZSTD_isError(res) || res >= len) ? 0 : res;
+	}
+#endif
+#ifdef TINYKVM_HAVE_ZLIB
+	case PackedSnapshotHeader::ZLIB: {
+		uLongf dlen = compressBound(len);
+		dst.resize(dlen);
+		if (compress2((Bytef *)dst.data(), &dlen, (const Bytef *)src, len, Z_BEST_SPEED) != Z_OK)
+			return 0;
+		return (dlen >= len) ? 0 : dlen;
+	}
+#endif
+	default:
+		return 0;
+	}
+}
+static bool decompress_block(uint32_t codec, const char* src, size_t len, char* dst, size_t dlen)
+{
+	switch (codec) {
+#ifdef TINYKVM_HAVE_ZSTD
+	case PackedSnapshotHeader::ZSTD:
+		return ZSTD_decompress(dst, dlen, src, len) == dlen;
+#endif
+#ifdef TINYKVM_HAVE_ZLIB
+	case PackedSnapshotHeader::ZLIB: {
+		uLongf outlen = dlen;
+		return uncompress((Bytef *)dst, &outlen, (const Bytef *)src, len) == Z_OK && outlen == dlen;
+	}
+#endif
+	default:
+		return false;
+	}
+}
+
+static bool is_zero_page(const char* page)
+{
+	const uint64_t* p = (const uint64_t *)page;
+	for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+		if (p[i] != 0)
+			return false;
+	}
+	return true;
+}
+
+size_t vMemory::save_packed_snapshot(const std::string& filename) const
+{
+	const uint64_t memory_size = this->size + ColdStartStateSize();
+	PackedSnapshotHeader hdr {};
+	hdr.magic = PackedSnapshotHeader::MAGIC;
+	hdr.version = PackedSnapshotHeader::VERSION;
+	hdr.codec = DEFAULT_CODEC;
+	hdr.block_pages = PackedSnapshotHeader::BLOCK_PAGES;
+	hdr.memory_size = memory_size;
+	hdr.pages = memory_size / PAGE_SIZE;
+
+	// Find the unique pages, by content
+	std::vector<uint32_t> page_map(hdr.pages);
+	std::vector<const char*> unique;
+	std::unordered_map<uint64_t, uint32_t> by_hash;
+	for (uint64_t p = 0; p < hdr.pages; p++) {
+		const char* page = this->ptr + p * PAGE_SIZE;
+		if (is_zero_page(page))
+			continue;
+		const uint64_t hash = std::hash<std::string_view>{}(std::string_view(page, PAGE_SIZE));
+		auto it = by_hash.find(hash);
+		if (it != by_hash.end() && std::memcmp(unique[it->second - 1], page, PAGE_SIZE) == 0) {
+			page_map[p] = it->second;
+			continue;
+		}
+		unique.push_back(page);
+		page_map[p] = unique.size();
+		// On a hash collision, the first page keeps the hash
+		by_hash.try_emplace(hash, unique.size());
+	}
+	hdr.unique_pages = unique.size();
+	hdr.blocks = (unique.size() + hdr.block_pages - 1) / hdr.block_pages;
+
+	// Write to a temporary file, and replace the snapshot when complete
+	const std::string tmpname = filename + ".tmp";
+	const int fd = open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		throw std::runtime_error("Failed to create packed snapshot: " + tmpname);
+	}
+	auto write_fully = [&] (const void* data, size_t len, off_t offset) {
+		while (len > 0) {
+			const ssize_t res = pwrite(fd, data, len, offset);
+			if (res <= 0) {
+				close(fd);
+				unlink(tmpname.c_str());
+				throw std::runtime_error("Failed to write packed snapshot: " + tmpname);
+			}
+			data = (const char *)data + res;
+			len -= res;
+			offset += res;
+		}
+	};
+	write_fully(&hdr, sizeof(hdr), 0);
+	write_fully(page_map.data(), page_map.size() * sizeof(uint32_t), sizeof(hdr));
+	const off_t directory_offset = sizeof(hdr) + page_map.size() * sizeof(uint32_t);
+	std::vector<PackedSnapshotBlock> blocks(hdr.blocks);
+	off_t file_offset = directory_offset + blocks.size() * sizeof(PackedSnapshotBlock);
+
+	std::vector<char> raw(hdr.block_pages * PAGE_SIZE);
+	std::vector<char> compressed;
+	for (size_t b = 0; b < blocks.size(); b++) {
+		const size_t first = b * hdr.block_pages;
+		const size_t count = std::min<size_t>(hdr.block_pages, unique.size() - first);
+		for (size_t i = 0; i < count; i++)
+			std::memcpy(&raw[i * PAGE_SIZE], unique[first + i], PAGE_SIZE);
+		const size_t len = count * PAGE_SIZE;
+		const size_t clen = compress_block(hdr.codec, raw.data(), len, compressed);
+		blocks[b] = { uint64_t(file_offset), uint32_t(clen ? clen : len), uint32_t(count) };
+		write_fully(clen ? compressed.data() : raw.data(), blocks[b].size, file_offset);
+		file_offset += blocks[b].size;
+	}
+	write_fully(blocks.data(), blocks.size() * sizeof(PackedSnapshotBlock), directory_offset);
+
+	const bool synced = fsync(fd) == 0;
+	if (close(fd) < 0 || !synced || rename(tmpname.c_str(), filename.c_str()) < 0) {
+		unlink(tmpname.c_str());
+		throw std::runtime_error("Failed to save packed snapshot: " + filename);
+	}
+	return file_offset;
+}
+
+vMemory::AllocationResult
+	vMemory::allocate_packed_memory(const MachineOptions& options, size_t size)
+{
+	size += ColdStartStateSize();
+	const std::string& filename = options.snapshot_packed_file;
+	const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::runtime_error("Failed to open packed snapshot: " + filename);
+	}
+	char* ptr = (char*)MAP_FAILED;
+	auto fail = [&] (const std::string& reason) {
+		if (ptr != MAP_FAILED)
+			munmap(ptr, size);
+		close(fd);
+		throw std::runtime_error(reason + ": " + filename);
+	};
+	auto read_fully = [&] (void* data, size_t len, off_t offset) {
+		while (len > 0) {
+			const ssize_t res = pread(fd, data, len, offset);
+			if (res <= 0)
+				fail("Failed to read packed snapshot");
+			data = (char *)data + res;
+			len -= res;
+			offset += res;
+		}
+	};
+	PackedSnapshotHeader hdr;
+	read_fully(&hdr, sizeof(hdr), 0);
+	if (hdr.magic != PackedSnapshotHeader::MAGIC || hdr.version != PackedSnapshotHeader::VERSION)
+		fail("Not a packed snapshot");
+	if (hdr.memory_size != size || hdr.pages != size / PAGE_SIZE)
+		fail("Packed snapshot has incorrect memory size");
+	if (hdr.block_pages == 0 || hdr.unique_pages > hdr.pages
+		|| hdr.blocks != (hdr.unique_pages + hdr.block_pages - 1) / hdr.block_pages)
+		fail("Packed snapshot is corrupt");
+
+	std::vector<uint32_t> page_map(hdr.pages);
+	read_fully(page_map.data(), page_map.size() * sizeof(uint32_t), sizeof(hdr));
+	std::vector<PackedSnapshotBlock> blocks(hdr.blocks);
+	const off_t directory_offset = sizeof(hdr) + page_map.size() * sizeof(uint32_t);
+	read_fully(blocks.data(), blocks.size() * sizeof(PackedSnapshotBlock), directory_offset);
+
+	// Where each unique page goes, grouped by unique page
+	std::vector<uint32_t> dest_begin(hdr.unique_pages + 1);
+	for (const uint32_t entry : page_map) {
+		if (entry > hdr.unique_pages)
+			fail("Packed snapshot is corrupt");
+		if (entry != 0)
+			dest_begin[entry]++;
+	}
+	for (size_t u = 1; u < dest_begin.size(); u++)
+		dest_begin[u] += dest_begin[u - 1];
+	std::vector<uint32_t> dests(dest_begin.back());
+	std::vector<uint32_t> fill(dest_begin.begin(), dest_begin.end() - 1);
+	for (uint64_t p = 0; p < page_map.size(); p++) {
+		if (page_map[p] != 0)
+			dests[fill[page_map[p] - 1]++] = p;
+	}
+
+	// Zero pages are elided: fresh anonymous memory is already zeroed
+	ptr = (char*) mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (ptr == MAP_FAILED)
+		fail("Failed to allocate memory for packed snapshot");
+
+	// Stream the blocks, and copy each page to where it's used
+	std::vector<char> raw(hdr.block_pages * PAGE_SIZE);
+	std::vector<char> compressed;
+	uint64_t unique_idx = 0;
+	for (const auto& block : blocks) {
+		if (block.pages == 0 || block.pages > hdr.block_pages || unique_idx + block.pages > hdr.unique_pages)
+			fail("Packed snapshot is corrupt");
+		const size_t len = block.pages * PAGE_SIZE;
+		if (block.size == len) {
+			read_fully(raw.data(), len, block.offset);
+		} else {
+			compressed.resize(block.size);
+			read_fully(compressed.data(), block.size, block.offset);
+			if (!decompress_block(hdr.codec, compressed.data(), block.size, raw.data(), len))
+				fail("Failed to decompress packed snapshot");
+		}
+		for (size_t i = 0; i < block.pages; i++, unique_idx++) {
+			for (uint32_t d = dest_begin[unique_idx]; d < dest_begin[unique_idx + 1]; d++)
+				std::memcpy(ptr + uint64_t(dests[d]) * PAGE_SIZE, &raw[i * PAGE_SIZE], PAGE_SIZE);
+		}
+	}
+	close(fd);
+	return AllocationResult{ptr, size - ColdStartStateSize(), fd};
+}
+
+size_t Machine::save_packed_snapshot(const std::string& filename,
+	const std::vector<std::pair<uint64_t, uint64_t>>& populate_pages) const
+{
+	if (!this->memory.has_snapshot_area()) {
+		throw std::runtime_error("No snapshot state area allocated");
+	}
+	this->save_snapshot_state_now(populate_pages);
+	return this->memory.save_packed_snapshot(filename);
+}
+
+} // tinykvm
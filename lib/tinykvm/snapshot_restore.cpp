@@ -0,0 +1,183 @@
+#include "snapshot_restore.hpp"
+
+#include "common.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace tinykvm {
+static constexpr uint64_t PAGE_SIZE = 4096;
+
+SnapshotRestore::SnapshotRestore(int file_fd, char* mem, size_t size)
+	: m_file_fd(file_fd), m_mem(mem), m_size(size),
+	  m_buffer(FAULT_AROUND_PAGES * PAGE_SIZE)
+{
+	// Faults from KVM happen in the kernel, so user-mode only won't do
+	m_uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if (m_uffd < 0) {
+		close(m_file_fd);
+		throw MachineException("Failed to create userfaultfd for lazy snapshot restore", errno);
+	}
+	struct uffdio_api api {};
+	api.api = UFFD_API;
+	struct uffdio_register reg {};
+	reg.range.start = (uintptr_t)mem;
+	reg.range.len = size;
+	reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+	if (ioctl(m_uffd, UFFDIO_API, &api) < 0 || ioctl(m_uffd, UFFDIO_REGISTER, &reg) < 0) {
+		const int err = errno;
+		close(m_uffd);
+		close(m_file_fd);
+		throw MachineException("Failed to register memory with userfaultfd", err);
+	}
+	m_event_fd = eventfd(0, EFD_CLOEXEC);
+	if (m_event_fd < 0) {
+		close(m_uffd);
+		close(m_file_fd);
+		throw MachineException("Failed to create eventfd for lazy snapshot restore", errno);
+	}
+	m_thread = std::thread(&SnapshotRestore::run, this);
+}
+
+SnapshotRestore::~SnapshotRestore()
+{
+	m_stop = true;
+	const uint64_t one = 1;
+	[[maybe_unused]] ssize_t res = write(m_event_fd, &one, sizeof(one));
+	m_thread.join();
+	// Without the userfaultfd, any missing pages will be zero-filled
+	close(m_uffd);
+	close(m_event_fd);
+	close(m_file_fd);
+}
+
+void SnapshotRestore::prefetch(std::vector<std::pair<uint64_t, uint64_t>> ranges)
+{
+	{
+		std::scoped_lock lock(m_mtx);
+		m_prefetch.insert(m_prefetch.end(), ranges.begin(), ranges.end());
+		m_prefetching = true;
+	}
+	const uint64_t one = 1;
+	[[maybe_unused]] ssize_t res = write(m_event_fd, &one, sizeof(one));
+}
+
+size_t SnapshotRestore::fetch(uint64_t offset, size_t pages)
+{
+	/* Returns the number of pages that were filled in, starting
+	   at offset. Pages that are already present stop the fill. */
+	pages = std::min<size_t>(pages, (m_size - offset) / PAGE_SIZE);
+	const size_t len = pages * PAGE_SIZE;
+	size_t done = 0;
+	while (done < len) {
+		const ssize_t res = pread(m_file_fd, m_buffer.data() + done, len - done, offset + done);
+		if (res <= 0) {
+			fprintf(stderr, "SnapshotRestore: Failed to read snapshot at offset 0x%lX\n", offset + done);
+			break;
+		}
+		done += res;
+	}
+	// Unreadable pages are zero-filled, instead of stalling the VM forever
+	std::fill(m_buffer.begin() + done, m_buffer.begin() + len, 0);
+
+	const bool zeroes = std::all_of(m_buffer.begin(), m_buffer.begin() + len,
+		[] (char c) { return c == 0; });
+	if (zeroes) {
+		struct uffdio_zeropage zp {};
+		zp.range.start = (uintptr_t)m_mem + offset;
+		zp.range.len = len;
+		if (ioctl(m_uffd, UFFDIO_ZEROPAGE, &zp) < 0 && zp.zeropage <= 0)
+			return 0;
+		return zp.zeropage / PAGE_SIZE;
+	}
+	struct uffdio_copy copy {};
+	copy.dst = (uintptr_t)m_mem + offset;
+	copy.src = (uintptr_t)m_buffer.data();
+	copy.len = len;
+	if (ioctl(m_uffd, UFFDIO_COPY, &copy) < 0 && copy.copy <= 0)
+		return 0;
+	return copy.copy / PAGE_SIZE;
+}
+
+void SnapshotRestore::handle_fault(uint64_t addr)
+{
+	const uint64_t offset = (addr - (uintptr_t)m_mem) & ~(PAGE_SIZE - 1);
+	if (this->fetch(offset, FAULT_AROUND_PAGES) > 0 || this->fetch(offset, 1) > 0) {
+		m_pages_faulted++;
+		return;
+	}
+	// The page was filled in by a prefetch in the meantime
+	struct uffdio_range range {};
+	range.start = (uintptr_t)m_mem + offset;
+	range.len = PAGE_SIZE;
+	ioctl(m_uffd, UFFDIO_WAKE, &range);
+}
+
+void SnapshotRestore::run()
+{
+	std::vector<std::pair<uint64_t, uint64_t>> work;
+	size_t work_idx = 0;
+	while (!m_stop)
+	{
+		struct pollfd fds[2] = {
+			{ m_uffd, POLLIN, 0 },
+			{ m_event_fd, POLLIN, 0 },
+		};
+		const bool busy = work_idx < work.size();
+		if (poll(fds, 2, busy ? 0 : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents & POLLIN) {
+			uint64_t count;
+			[[maybe_unused]] ssize_t res = read(m_event_fd, &count, sizeof(count));
+			std::scoped_lock lock(m_mtx);
+			work.insert(work.end(), m_prefetch.begin(), m_prefetch.end());
+			m_prefetch.clear();
+		}
+		// Page faults are stalling a thread, so they come first
+		if (fds[0].revents & POLLIN) {
+			struct uffd_msg msg;
+			while (read(m_uffd, &msg, sizeof(msg)) == sizeof(msg)) {
+				if (msg.event == UFFD_EVENT_PAGEFAULT)
+					this->handle_fault(msg.arg.pagefault.address);
+			}
+			continue;
+		}
+		if (work_idx < work.size()) {
+			// Prefetch a few pages at a time, between the page faults
+			auto& [offset, len] = work[work_idx];
+			const uint64_t begin = offset & ~(PAGE_SIZE - 1);
+			const uint64_t end = std::min<uint64_t>(offset + len, m_size);
+			if (begin >= end) {
+				work_idx++;
+				continue;
+			}
+			const size_t pages = std::min<size_t>(FAULT_AROUND_PAGES, (end - begin + PAGE_SIZE - 1) / PAGE_SIZE);
+			const size_t filled = this->fetch(begin, pages);
+			m_pages_prefetched += filled;
+			// Skip past a page that is already present
+			const size_t fetched = std::max<size_t>(filled, 1);
+			len = (begin + fetched * PAGE_SIZE < end) ? end - (begin + fetched * PAGE_SIZE) : 0;
+			offset = begin + fetched * PAGE_SIZE;
+			if (len == 0)
+				work_idx++;
+		}
+		if (work_idx >= work.size() && !work.empty()) {
+			work.clear();
+			work_idx = 0;
+			std::scoped_lock lock(m_mtx);
+			m_prefetching = !m_prefetch.empty();
+		}
+	}
+}
+
+} // tinykvm
@@ -0,0 +1,54 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace tinykvm {
+
+/* Restores the memory of a VM from a snapshot file on demand. The
+   memory is registered with userfaultfd, and a thread fills in each
+   page from the file the first time it is touched, by the guest or
+   by the host. The thread also prefetches the pages that were
+   accessed when the snapshot was made, whenever it's not busy
+   handling faults, so that the VM can start before it's resident. */
+struct SnapshotRestore
+{
+	/* Pages read from the file for each page fault */
+	static constexpr size_t FAULT_AROUND_PAGES = 16;
+
+	/* Restore [mem, mem + size) from the start of @file_fd, which
+	   is owned by the SnapshotRestore from now on. */
+	SnapshotRestore(int file_fd, char* mem, size_t size);
+	~SnapshotRestore();
+
+	/* Fetch these ranges of memory (offset, length) in the background */
+	void prefetch(std::vector<std::pair<uint64_t, uint64_t>> ranges);
+
+	size_t pages_faulted() const noexcept { return m_pages_faulted; }
+	size_t pages_prefetched() const noexcept { return m_pages_prefetched; }
+	bool prefetching() const noexcept { return m_prefetching; }
+
+private:
+	void run();
+	void handle_fault(uint64_t addr);
+	size_t fetch(uint64_t offset, size_t pages);
+
+	const int m_file_fd;
+	int m_uffd = -1;
+	int m_event_fd = -1;
+	char* const m_mem;
+	const size_t m_size;
+	std::vector<char> m_buffer; // Used by the thread
+	std::mutex m_mtx;
+	std::vector<std::pair<uint64_t, uint64_t>> m_prefetch;
+	std::atomic<bool> m_stop = false;
+	std::atomic<bool> m_prefetching = false;
+	std::atomic<size_t> m_pages_faulted = 0;
+	std::atomic<size_t> m_pages_prefetched = 0;
+	std::thread m_thread;
+};
+
+} // tinykvm
@@ -0,0 +1,113 @@
+#include "symbol_index.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include "util/elf.hpp"
+
+namespace tinykvm {
+static std::mutex index_cache_mtx;
+/* Keyed by the location of the binary, which is the same for all
+   machines built from it. An entry can only be reused while it is
+   alive, and while it is alive its machines keep the binary alive. */
+static std::map<std::pair<const char*, size_t>, std::weak_ptr<const SymbolIndex>> index_cache;
+
+SymbolIndex::SymbolIndex(std::string_view binary)
+	: m_binary(binary)
+{
+	if (binary.empty()) {
+		m_error = "(no binary)";
+		return;
+	}
+	const auto* sym_hdr = section_by_name(binary, ".symtab");
+	if (sym_hdr == nullptr) {
+		m_error = "(no symbols)";
+		return;
+	}
+	const auto* str_hdr = section_by_name(binary, ".strtab");
+	if (str_hdr == nullptr) {
+		m_error = "(no strings)";
+		return;
+	}
+
+	const size_t symtab_ents = sym_hdr->sh_size / sizeof(Elf64_Sym);
+	const auto* symtab = elf_offset_array<Elf64_Sym>(binary, sym_hdr->sh_offset, symtab_ents);
+	const char* strtab = elf_offset_array<char>(binary, str_hdr->sh_offset, str_hdr->sh_size);
+	const size_t strtab_size = str_hdr->sh_size;
+
+	m_by_name.reserve(symtab_ents);
+	for (size_t i = 0; i < symtab_ents; i++)
+	{
+		const auto& sym = symtab[i];
+		if (sym.st_name >= strtab_size)
+			continue;
+		const char* name = &strtab[sym.st_name];
+		const std::string_view symname(name, strnlen(name, strtab_size - sym.st_name));
+		/* The first symbol with a name wins, like a linear search */
+		m_by_name.emplace(symname, sym.st_value);
+		/* Only look at functions (for now). Old-style symbols have no FUNC. */
+		if (sym.st_info & STT_FUNC) {
+			m_functions.push_back(Function{sym.st_value, sym.st_size, symname});
+		}
+	}
+	std::stable_sort(m_functions.begin(), m_functions.end(),
+		[] (const Function& a, const Function& b) { return a.address < b.address; });
+}
+
+bool SymbolIndex::lookup(std::string_view name, uint64_t& value) const
+{
+	auto it = m_by_name.find(name);
+	if (it == m_by_name.end())
+		return false;
+	value = it->second;
+	return true;
+}
+
+const SymbolIndex::Function* SymbolIndex::function_at(uint64_t addr, bool& exact) const
+{
+	/* The first function starting after the address */
+	auto it = std::upper_bound(m_functions.begin(), m_functions.end(), addr,
+		[] (uint64_t addr, const Function& f) { return addr < f.address; });
+	if (it == m_functions.begin())
+		return nullptr;
+	/* Of the functions starting at the closest address, the first
+	   one in the symbol table that contains the address */
+	const uint64_t closest = std::prev(it)->address;
+	auto first = it;
+	while (first != m_functions.begin() && std::prev(first)->address == closest)
+		--first;
+	for (auto f = first; f != it; ++f) {
+		if (addr < f->address + f->size) {
+			exact = true;
+			return &*f;
+		}
+	}
+	exact = false;
+	return &*first;
+}
+
+std::shared_ptr<const SymbolIndex> SymbolIndex::get(std::string_view binary)
+{
+	const auto key = std::make_pair(binary.data(), binary.size());
+	std::scoped_lock lock(index_cache_mtx);
+	auto it = index_cache.find(key);
+	if (it != index_cache.end()) {
+		if (auto index = it->second.lock())
+			return index;
+	}
+	/* Forget the indexes of binaries that no machine refers to */
+	std::erase_if(index_cache, [] (const auto& entry) { return entry.second.expired(); });
+	auto index = std::make_shared<const SymbolIndex>(binary);
+	index_cache[key] = index;
+	return index;
+}
+
+size_t SymbolIndex::cache_size()
+{
+	std::scoped_lock lock(index_cache_mtx);
+	return std::count_if(index_cache.begin(), index_cache.end(),
+		[] (const auto& entry) { return !entry.second.expired(); });
+}
+
+} // tinykvm
@@ -0,0 +1,52 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace tinykvm {
+
+/* The symbols of an ELF binary, indexed by name and by address.
+   Built on first use by Machine::address_of() and Machine::resolve(),
+   and shared by every machine that refers to the same binary, eg.
+   a master VM and its forks. The index points into the .strtab of
+   the binary, which its machines keep alive. Addresses are relative
+   to the image base. */
+struct SymbolIndex
+{
+	struct Function {
+		uint64_t address;
+		uint64_t size;
+		std::string_view name;
+	};
+
+	explicit SymbolIndex(std::string_view binary);
+
+	/* The value of the first symbol with this name */
+	bool lookup(std::string_view name, uint64_t& value) const;
+	/* The function containing @addr, or the closest one before it.
+	   @exact tells which one it is. */
+	const Function* function_at(uint64_t addr, bool& exact) const;
+
+	std::string_view binary() const noexcept { return m_binary; }
+	/* Why the binary has no symbols, eg. "(no symbols)", or nullptr */
+	const char* error() const noexcept { return m_error; }
+	size_t symbols() const noexcept { return m_by_name.size(); }
+	size_t functions() const noexcept { return m_functions.size(); }
+	const std::vector<Function>& function_table() const noexcept { return m_functions; }
+
+	/* The index of a binary, shared while any machine holds it */
+	static std::shared_ptr<const SymbolIndex> get(std::string_view binary);
+	/* The number of live indexes */
+	static size_t cache_size();
+
+private:
+	std::string_view m_binary;
+	const char* m_error = nullptr;
+	std::unordered_map<std::string_view, uint64_t> m_by_name;
+	/* Sorted by address, and by symbol table order at equal addresses */
+	std::vector<Function> m_functions;
+};
+
+} // tinykvm
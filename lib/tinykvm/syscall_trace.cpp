@@ -0,0 +1,125 @@
+#include "syscall_trace.hpp"
+
+#include "common.hpp"
+#include "forward.hpp"
+#include <cstring>
+#include <vector>
+
+namespace tinykvm {
+static constexpr char TRACE_MAGIC[8] = { 'T', 'K', 'V', 'M', 'S', 'T', 'R', '1' };
+
+SyscallTrace::SyscallTrace(size_t capacity)
+{
+	size_t size = 1;
+	while (size < capacity)
+		size <<= 1;
+	m_records.reset(new Record[size] {});
+	m_mask = size - 1;
+}
+
+SyscallTrace::Record& SyscallTrace::begin(unsigned vcpu, unsigned nr,
+	const tinykvm_x86regs& regs) noexcept
+{
+	const uint64_t seq = m_next.fetch_add(1, std::memory_order_relaxed) + 1;
+	Record& rec = m_records[(seq - 1) & m_mask];
+	rec.seq = seq;
+	rec.tsc_start = MachineProfiling::tsc();
+	rec.tsc_end = 0;
+	rec.args[0] = regs.rdi;
+	rec.args[1] = regs.rsi;
+	rec.args[2] = regs.rdx;
+	rec.args[3] = regs.r10;
+	rec.args[4] = regs.r8;
+	rec.args[5] = regs.r9;
+	rec.result = 0;
+	rec.nr = nr;
+	rec.vcpu = vcpu;
+	return rec;
+}
+void SyscallTrace::end(Record& rec, uint64_t seq, uint64_t result) noexcept
+{
+	/* A blocking call may have had its record overwritten */
+	if (rec.seq != seq)
+		return;
+	rec.tsc_end = MachineProfiling::tsc();
+	rec.result = result;
+}
+
+size_t SyscallTrace::size() const noexcept
+{
+	const uint64_t recorded = this->recorded();
+	return (recorded < capacity()) ? recorded : capacity();
+}
+void SyscallTrace::reset() noexcept
+{
+	m_next.store(0, std::memory_order_relaxed);
+}
+
+bool SyscallTrace::dump(FILE* fp) const
+{
+	FileHeader hdr {};
+	std::memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.record_size = sizeof(Record);
+	hdr.count = this->size();
+	hdr.recorded = this->recorded();
+	hdr.tsc_ns_multiplier = MachineProfiling::tsc_ns_multiplier;
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		return false;
+	bool ok = true;
+	this->for_each([&] (const Record& rec) {
+		if (ok && fwrite(&rec, sizeof(rec), 1, fp) != 1)
+			ok = false;
+	});
+	return ok && fflush(fp) == 0;
+}
+bool SyscallTrace::dump(const std::string& path) const
+{
+	FILE* fp = fopen(path.c_str(), "wb");
+	if (fp == nullptr)
+		return false;
+	const bool ok = this->dump(fp);
+	return (fclose(fp) == 0) && ok;
+}
+
+long SyscallTrace::decode(FILE* in, FILE* out)
+{
+	FileHeader hdr;
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1
+		|| std::memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0
+		|| hdr.record_size != sizeof(Record))
+		return -1;
+	if (hdr.recorded > hdr.count) {
+		fprintf(out, "(%lu older system calls were overwritten)\n",
+			(unsigned long)(hdr.recorded - hdr.count));
+	}
+	auto to_ns = [&] (uint64_t ticks) -> uint64_t {
+		return (unsigned __int128)ticks * hdr.tsc_ns_multiplier >> 32;
+	};
+	long decoded = 0;
+	uint64_t first_tsc = 0;
+	Record rec;
+	for (uint32_t i = 0; i < hdr.count; i++)
+	{
+		if (fread(&rec, sizeof(rec), 1, in) != 1)
+			return -1;
+		if (i == 0)
+			first_tsc = rec.tsc_start;
+		const uint64_t ts = to_ns(rec.tsc_start - first_tsc);
+		fprintf(out, "[%4lu.%09lu] cpu%u %u (0x%lX, 0x%lX, 0x%lX, 0x%lX, 0x%lX, 0x%lX)",
+			(unsigned long)(ts / 1'000'000'000UL), (unsigned long)(ts % 1'000'000'000UL),
+			rec.vcpu, rec.nr,
+			(unsigned long)rec.args[0], (unsigned long)rec.args[1],
+			(unsigned long)rec.args[2], (unsigned long)rec.args[3],
+			(unsigned long)rec.args[4], (unsigned long)rec.args[5]);
+		if (rec.tsc_end != 0) {
+			fprintf(out, " = 0x%lX (%lu ns)\n", (unsigned long)rec.result,
+				(unsigned long)to_ns(rec.tsc_end - rec.tsc_start));
+		} else {
+			fprintf(out, " = ? (did not return)\n");
+		}
+		decoded++;
+	}
+	return decoded;
+}
+
+} // tinykvm
@@ -0,0 +1,92 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+namespace tinykvm {
+struct tinykvm_x86regs;
+
+/* A binary trace of guest system calls, kept in a fixed-size ring
+   buffer. Each system call fills in one record in place: number,
+   arguments, result and TSC timestamps, with no formatting and no
+   allocation, so it can be left on in production. Once full, the
+   oldest records are overwritten.
+   The trace can be dumped at any time with dump(), and is dumped
+   automatically when the guest raises an exception, if dump_path
+   is set. Dumps are decoded offline with decode(), or the
+   tracedecode program:
+     [  0.001234567] cpu0 1 (0x1, 0x20a0, 0x6, 0x0, 0x0, 0x0) = 0x6 (1042 ns)
+   where 1 is the system call number, and time is since the first record. */
+struct SyscallTrace {
+	static constexpr size_t DEFAULT_CAPACITY = 4096;
+
+	struct Record {
+		uint64_t seq;       // Position in the trace, starting at 1
+		uint64_t tsc_start;
+		uint64_t tsc_end;   // Zero when the call did not return
+		uint64_t args[6];
+		uint64_t result;
+		uint32_t nr;
+		uint32_t vcpu;
+	};
+	static_assert(sizeof(Record) == 88);
+
+	/* The dump file header, followed by the records, oldest first */
+	struct FileHeader {
+		char     magic[8];  // "TKVMSTR1"
+		uint32_t record_size;
+		uint32_t count;
+		uint64_t recorded;  // Records ever made, including overwritten
+		uint64_t tsc_ns_multiplier; // See MachineProfiling::tsc_to_ns()
+	};
+
+	/* @capacity is rounded up to a power of two */
+	SyscallTrace(size_t capacity = DEFAULT_CAPACITY);
+
+	/* Begin and end the record of a system call. Used by
+	   Machine::system_call(). */
+	Record& begin(unsigned vcpu, unsigned nr, const tinykvm_x86regs&) noexcept;
+	void end(Record&, uint64_t seq, uint64_t result) noexcept;
+
+	/* Records ever made, and the number still in the buffer */
+	uint64_t recorded() const noexcept { return m_next.load(std::memory_order_relaxed); }
+	size_t size() const noexcept;
+	size_t capacity() const noexcept { return m_mask + 1; }
+	void reset() noexcept;
+
+	/* Call @func on each record in the buffer, oldest first */
+	template <typename F>
+	void for_each(F&& func) const;
+
+	/* Write the trace in binary form. Returns false on failure. */
+	bool dump(FILE*) const;
+	bool dump(const std::string& path) const;
+
+	/* Decode a binary trace into text, one line per system call.
+	   Returns the number of records decoded, or -1 on a bad file. */
+	static long decode(FILE* in, FILE* out);
+
+	/* Where to dump the trace when the guest raises an exception.
+	   Empty disables automatic dumps. */
+	std::string dump_path;
+
+private:
+	std::unique_ptr<Record[]> m_records;
+	size_t m_mask;
+	/* vCPUs running system calls in parallel (futex, sched_yield)
+	   take their records concurrently */
+	std::atomic<uint64_t> m_next { 0 };
+};
+
+template <typename F>
+inline void SyscallTrace::for_each(F&& func) const
+{
+	const uint64_t end = this->recorded();
+	const uint64_t count = this->size();
+	for (uint64_t i = end - count; i < end; i++)
+		func(m_records[i & m_mask]);
+}
+
+} // tinykvm
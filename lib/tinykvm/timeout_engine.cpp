@@ -0,0 +1,191 @@
+#include "timeout_engine.hpp"
+
+#include <algorithm>
+#include <ctime>
+#include <linux/kvm.h>
+#include <signal.h>
+extern "C" void tinykvm_timer_signal_handler(int, siginfo_t*, void*);
+
+namespace tinykvm {
+static constexpr bool VERBOSE_TIMEOUT_ENGINE = false;
+
+TimeoutEngine& TimeoutEngine::get()
+{
+	static TimeoutEngine engine;
+	return engine;
+}
+TimeoutEngine::TimeoutEngine()
+	: m_current(now_tick())
+{
+	/* The kicks need the handler, as no per-vCPU timer installs it
+	   when only this engine is used. Constructed once, see get(). */
+	struct sigaction act {};
+	act.sa_sigaction = tinykvm_timer_signal_handler;
+	act.sa_flags = SA_SIGINFO;
+	sigemptyset(&act.sa_mask);
+	::sigaction(SIGUSR2, &act, nullptr);
+
+	this->m_thread = std::thread(&TimeoutEngine::timer_loop, this);
+}
+TimeoutEngine::~TimeoutEngine()
+{
+	{
+		std::scoped_lock lock(m_mtx);
+		this->m_stop = true;
+	}
+	m_cond.notify_all();
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+uint64_t TimeoutEngine::now_tick()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000 + uint64_t(ts.tv_nsec) / 1'000'000;
+}
+
+void TimeoutEngine::insert(Timer& timer)
+{
+	/* Level N holds timers that expire within SLOTS^(N+1) ticks,
+	   and they move down a level each time level N-1 wraps around. */
+	/* Overdue timers expire on the current tick */
+	uint64_t expires = std::max(timer.expires, m_current);
+	const uint64_t delta = expires - m_current;
+	unsigned level = 0;
+	while (level < LEVELS-1 && delta >= (uint64_t(1) << (SLOT_BITS * (level+1))))
+		level++;
+	/* Timers beyond the last level are parked in its furthest slot */
+	const uint64_t max_delta = (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+	if (delta > max_delta)
+		expires = m_current + max_delta;
+	const unsigned index = (expires >> (SLOT_BITS * level)) & (SLOTS-1);
+
+	Timer*& head = m_wheel[level][index];
+	timer.list = &head;
+	timer.prev = nullptr;
+	timer.next = head;
+	if (head != nullptr)
+		head->prev = &timer;
+	head = &timer;
+}
+
+void TimeoutEngine::unlink(Timer& timer)
+{
+	if (timer.prev != nullptr)
+		timer.prev->next = timer.next;
+	else
+		*timer.list = timer.next;
+	if (timer.next != nullptr)
+		timer.next->prev = timer.prev;
+	timer.prev = nullptr;
+	timer.next = nullptr;
+	timer.list = nullptr;
+}
+
+void TimeoutEngine::arm(Timer& timer, struct kvm_run* run, uint32_t milliseconds)
+{
+	run->immediate_exit = 0;
+	std::scoped_lock lock(m_mtx);
+	if (timer.armed)
+		this->unlink(timer);
+	else
+		m_armed++;
+	const uint64_t now = now_tick();
+	timer.kvm_run = run;
+	timer.thread = pthread_self();
+	timer.expires = now + milliseconds;
+	timer.armed = true;
+	const bool was_idle = (m_armed == 1);
+	if (was_idle) /* The wheel does not turn while idle */
+		this->m_current = now;
+	this->insert(timer);
+	if (was_idle)
+		m_cond.notify_one();
+}
+
+void TimeoutEngine::disarm(Timer& timer)
+{
+	std::scoped_lock lock(m_mtx);
+	if (timer.armed) {
+		this->unlink(timer);
+		timer.armed = false;
+		m_armed--;
+	}
+	if (timer.kvm_run != nullptr)
+		timer.kvm_run->immediate_exit = 0;
+}
+
+void TimeoutEngine::cascade(unsigned level)
+{
+	/* Re-insert every timer in the current slot of the given level,
+	   moving them closer to level 0 now that they are due soon. */
+	const unsigned index = (m_current >> (SLOT_BITS * level)) & (SLOTS-1);
+	Timer* timer = m_wheel[level][index];
+	m_wheel[level][index] = nullptr;
+	while (timer != nullptr) {
+		Timer* next = timer->next;
+		this->insert(*timer);
+		timer = next;
+	}
+}
+
+void TimeoutEngine::advance_to(uint64_t tick)
+{
+	while (m_current <= tick)
+	{
+		if ((m_current & (SLOTS-1)) == 0) {
+			for (unsigned level = 1; level < LEVELS; level++) {
+				this->cascade(level);
+				if (((m_current >> (SLOT_BITS * level)) & (SLOTS-1)) != 0)
+					break;
+			}
+		}
+		Timer*& slot = m_wheel[0][m_current & (SLOTS-1)];
+		Timer* timer = slot;
+		slot = nullptr;
+		while (timer != nullptr) {
+			Timer* next = timer->next;
+			if (timer->expires <= m_current) {
+				/* Kick the vCPU out of KVM_RUN */
+				timer->kvm_run->immediate_exit = 1;
+				pthread_kill(timer->thread, SIGUSR2);
+				m_kicks++;
+				if constexpr (VERBOSE_TIMEOUT_ENGINE) {
+					fprintf(stderr, "TimeoutEngine: Kicked timer %p\n", (void*)timer);
+				}
+				timer->expires = m_current + KICK_INTERVAL_MS;
+			}
+			this->insert(*timer);
+			timer = next;
+		}
+		m_current++;
+	}
+}
+
+void TimeoutEngine::timer_loop()
+{
+	std::unique_lock<std::mutex> lock(m_mtx);
+	while (!m_stop)
+	{
+		if (m_armed == 0) {
+			m_cond.wait(lock, [this] { return m_stop || m_armed != 0; });
+			continue;
+		}
+		this->advance_to(now_tick());
+		m_cond.wait_for(lock, std::chrono::milliseconds(1));
+	}
+}
+
+size_t TimeoutEngine::armed_timers() const
+{
+	std::scoped_lock lock(m_mtx);
+	return m_armed;
+}
+uint64_t TimeoutEngine::kicks() const
+{
+	std::scoped_lock lock(m_mtx);
+	return m_kicks;
+}
+
+} // tinykvm
@@ -0,0 +1,65 @@
+#pragma once
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <pthread.h>
+#include <thread>
+struct kvm_run;
+
+namespace tinykvm {
+
+/* A process-wide execution timeout engine. A single host thread
+   drives a hierarchical timer wheel with millisecond ticks, and
+   when a timeout expires it sets immediate_exit in the vCPU's
+   kvm_run and signals the vCPU thread with SIGUSR2, which makes
+   KVM_RUN return with EINTR. Expired timers keep kicking the vCPU
+   every KICK_INTERVAL_MS until disarmed, in order to also break
+   out of blocking system calls. Arming and disarming is O(1), and
+   no kernel timer objects are created per VM. */
+struct TimeoutEngine {
+	static constexpr uint32_t KICK_INTERVAL_MS = 20;
+
+	struct Timer {
+		Timer* prev = nullptr;
+		Timer* next = nullptr;
+		Timer** list = nullptr; // The head of the slot it is in
+		uint64_t expires = 0; // Absolute tick
+		struct kvm_run* kvm_run = nullptr;
+		pthread_t thread {};
+		bool armed = false;
+	};
+	static TimeoutEngine& get();
+
+	/* Arm the timer to kick the calling thread and kvm_run
+	   after the given number of milliseconds. */
+	void arm(Timer&, struct kvm_run*, uint32_t milliseconds);
+	void disarm(Timer&);
+
+	size_t armed_timers() const;
+	uint64_t kicks() const;
+	~TimeoutEngine();
+
+private:
+	TimeoutEngine();
+	static constexpr unsigned LEVELS = 4;
+	static constexpr unsigned SLOT_BITS = 6;
+	static constexpr unsigned SLOTS = 1u << SLOT_BITS;
+	void insert(Timer&);
+	void unlink(Timer&);
+	void advance_to(uint64_t tick);
+	void cascade(unsigned level);
+	void timer_loop();
+	static uint64_t now_tick();
+
+	mutable std::mutex m_mtx;
+	std::array<std::array<Timer*, SLOTS>, LEVELS> m_wheel {};
+	uint64_t m_current = 0;
+	size_t   m_armed = 0;
+	uint64_t m_kicks = 0;
+	bool     m_stop = false;
+	std::condition_variable m_cond;
+	std::thread m_thread;
+};
+
+} // tinykvm
@@ -0,0 +1,138 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <thread>
+#include <utility>
+
+namespace tinykvm {
+
+/**
+ * A single-producer, single-consumer command slot with its own
+ * worker thread. Posting a command stores a function pointer and
+ * an argument, and never allocates. The worker spins for a short
+ * while after each command, and then parks on a futex (through
+ * std::atomic::wait), so back-to-back commands avoid wakeups.
+ * Only one command can be in flight: post() first waits for the
+ * previous command to complete.
+*/
+class CommandSlot {
+public:
+	using command_t = void(*)(void* arg);
+	static constexpr unsigned SPIN_ITERATIONS = 1024;
+
+	CommandSlot() : m_thread([this] { this->worker(); }) {}
+	~CommandSlot();
+
+	/* Post a command without waiting for it to complete. */
+	void post(command_t command, void* arg);
+	/* Wait until the last posted command has completed. */
+	void wait() const;
+	bool idle() const noexcept {
+		return m_completed.load(std::memory_order_acquire) == m_posted.load(std::memory_order_relaxed);
+	}
+	/* Run a callable on the worker and wait for it, forwarding exceptions. */
+	template <typename F>
+	void call(F&& func);
+
+private:
+	/* Spinning on a single host CPU only delays the other side */
+	static unsigned spin_limit() noexcept {
+		static const unsigned limit =
+			(std::thread::hardware_concurrency() > 1) ? SPIN_ITERATIONS : 0;
+		return limit;
+	}
+	static void pause() noexcept {
+#if defined(__x86_64__)
+		__builtin_ia32_pause();
+#endif
+	}
+	void worker();
+
+	alignas(64) std::atomic<uint32_t> m_posted {0};
+	alignas(64) std::atomic<uint32_t> m_completed {0};
+	command_t m_command = nullptr;
+	void* m_arg = nullptr;
+	bool m_stop = false;
+	std::thread m_thread;
+};
+
+inline CommandSlot::~CommandSlot()
+{
+	this->post([] (void* arg) {
+		static_cast<CommandSlot*> (arg)->m_stop = true;
+	}, this);
+	m_thread.join();
+}
+
+inline void CommandSlot::post(command_t command, void* arg)
+{
+	this->wait();
+	m_command = command;
+	m_arg = arg;
+	m_posted.fetch_add(1, std::memory_order_release);
+	m_posted.notify_one();
+}
+
+inline void CommandSlot::wait() const
+{
+	const uint32_t posted = m_posted.load(std::memory_order_relaxed);
+	const unsigned limit = spin_limit();
+	for (unsigned i = 0; i < limit; i++) {
+		if (m_completed.load(std::memory_order_acquire) == posted)
+			return;
+		pause();
+	}
+	uint32_t completed;
+	while ((completed = m_completed.load(std::memory_order_acquire)) != posted) {
+		m_completed.wait(completed, std::memory_order_acquire);
+	}
+}
+
+template <typename F>
+inline void CommandSlot::call(F&& func)
+{
+	struct Call {
+		F& func;
+		std::exception_ptr exception;
+	} call { func, nullptr };
+	this->post([] (void* arg) {
+		auto& call = *static_cast<Call*> (arg);
+		try {
+			call.func();
+		} catch (...) {
+			call.exception = std::current_exception();
+		}
+	}, &call);
+	this->wait();
+	if (call.exception)
+		std::rethrow_exception(call.exception);
+}
+
+inline void CommandSlot::worker()
+{
+	const unsigned limit = spin_limit();
+	uint32_t seen = 0;
+	while (!m_stop) {
+		/* Spin, then park until the next command */
+		unsigned spins = 0;
+		while (m_posted.load(std::memory_order_acquire) == seen) {
+			if (spins < limit) {
+				spins++;
+				pause();
+			} else {
+				m_posted.wait(seen, std::memory_order_acquire);
+			}
+		}
+		seen++;
+		try {
+			m_command(m_arg);
+		} catch (...) {
+			/* Posted commands handle their own exceptions */
+		}
+		m_completed.store(seen, std::memory_order_release);
+		m_completed.notify_all();
+	}
+}
+
+} // tinykvm
@@ -28,5 +28,6 @@ namespace tinykvm {
 			return false;
 		return hdr->e_ident[EI_CLASS] == ELFCLASS64;
 	}
+	extern const Elf64_Shdr* section_by_name(std::string_view binary, const char* name); // machine_elf.cpp
 
 }
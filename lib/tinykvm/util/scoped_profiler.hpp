@@ -13,25 +13,28 @@ template <MachineProfiling::Location Which>
 struct ScopedProfiler {
 	ScopedProfiler(MachineProfiling* profiling) {
 		if (profiling) {
-			m_storage = &profiling->times.at(Which);
-			this->m_start_time = get_time_ns();
+			m_profiling = profiling;
+			if (profiling->use_histograms)
+				this->m_start_time = MachineProfiling::tsc();
+			else
+				this->m_start_time = MachineProfiling::monotonic_ns();
 		}
 	}
 
 	~ScopedProfiler() {
-		if (m_storage) {
-			const uint64_t end_time = get_time_ns();
-			m_storage->push_back(end_time - m_start_time);
+		if (m_profiling) {
+			if (m_profiling->use_histograms) {
+				const uint64_t end_time = MachineProfiling::tsc();
+				m_profiling->histograms[Which].record(
+					MachineProfiling::tsc_to_ns(end_time - m_start_time));
+			} else {
+				const uint64_t end_time = MachineProfiling::monotonic_ns();
+				m_profiling->times[Which].push_back(end_time - m_start_time);
+			}
 		}
 	}
 private:
-	static uint64_t get_time_ns() {
-		struct timespec ts;
-		clock_gettime(CLOCK_MONOTONIC, &ts);
-		return uint64_t(ts.tv_sec) * 1'000'000'000ULL + uint64_t(ts.tv_nsec);
-	}
-
-	std::vector<uint64_t>* m_storage = nullptr;
+	MachineProfiling* m_profiling = nullptr;
 	uint64_t m_start_time = 0;
 };
 
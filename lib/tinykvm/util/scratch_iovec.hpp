@@ -0,0 +1,56 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <vector>
+
+namespace tinykvm {
+
+/* Guest memory fragments, laid out like struct iovec */
+struct IOBuffer { const char* ptr; size_t len; };
+struct IOWrBuffer { char* ptr; size_t len; };
+
+/**
+ * A reusable array of buffers for building iovecs. The first N
+ * entries are stored inline, and only longer lists spill over to
+ * the heap, whose capacity is then kept for the next use. Each
+ * vCPU owns one of each kind, so the I/O system calls can gather
+ * guest memory without allocating.
+*/
+template <typename T, size_t N = 64>
+struct ScratchIOVec {
+	T* data() noexcept { return m_spilled ? m_heap.data() : m_inline.data(); }
+	const T* data() const noexcept { return m_spilled ? m_heap.data() : m_inline.data(); }
+	size_t size() const noexcept { return m_size; }
+	bool empty() const noexcept { return m_size == 0; }
+	T* begin() noexcept { return data(); }
+	T* end() noexcept { return data() + m_size; }
+	const T* begin() const noexcept { return data(); }
+	const T* end() const noexcept { return data() + m_size; }
+	T& operator[](size_t i) noexcept { return data()[i]; }
+	const T& operator[](size_t i) const noexcept { return data()[i]; }
+	T& back() noexcept { return data()[m_size - 1]; }
+
+	T& emplace_back() {
+		if (m_size < N && !m_spilled)
+			return m_inline[m_size++] = T{};
+		if (!m_spilled) {
+			m_heap.assign(m_inline.begin(), m_inline.end());
+			m_spilled = true;
+		}
+		m_size++;
+		return m_heap.emplace_back();
+	}
+	void clear() noexcept {
+		m_heap.clear();
+		m_spilled = false;
+		m_size = 0;
+	}
+
+private:
+	std::array<T, N> m_inline;
+	std::vector<T> m_heap;
+	size_t m_size = 0;
+	bool m_spilled = false;
+};
+
+}
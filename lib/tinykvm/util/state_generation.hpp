@@ -0,0 +1,38 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+namespace tinykvm {
+
+/**
+ * Tracks modifications of per-VM state, so that a fork reset can skip
+ * state that is unchanged since the previous reset. Generations come
+ * from one global counter, so they are unique across all instances:
+ * when the source of a reset still has the generation it had during
+ * the previous reset, it is the same, unmodified, source.
+*/
+struct StateGeneration {
+	void modified() noexcept { m_current = next(); }
+
+	/* True when neither this nor @other has been modified since
+	   this was last reset to @other. */
+	bool unchanged_since_reset_to(const StateGeneration& other) const noexcept {
+		return m_current == m_reset_self && other.m_current == m_reset_other;
+	}
+	void reset_to(const StateGeneration& other) noexcept {
+		m_current = next();
+		m_reset_self = m_current;
+		m_reset_other = other.m_current;
+	}
+
+private:
+	static uint64_t next() noexcept {
+		static std::atomic<uint64_t> counter { 0 };
+		return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+	}
+	uint64_t m_current = next();
+	uint64_t m_reset_self = 0;
+	uint64_t m_reset_other = 0;
+};
+
+} // tinykvm
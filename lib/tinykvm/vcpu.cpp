@@ -1,6 +1,8 @@
 #include "machine.hpp"
 
 #define _GNU_SOURCE 1
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <cstring>
 #include <cpuid.h>
@@ -19,8 +21,9 @@
 #include "amd64/paging.hpp"
 #include "amd64/memory_layout.hpp"
 #include "amd64/usercode.hpp"
+#include "amd64/vdso.hpp"
 extern "C" int close(int);
-extern "C" void tinykvm_timer_signal_handler(int);
+extern "C" void tinykvm_timer_signal_handler(int, siginfo_t*, void*);
 #define TINYKVM_USE_SYNCED_SREGS 1
 
 #ifndef SYS_gettid
@@ -38,13 +41,197 @@ struct ksigevent
 
 namespace tinykvm {
 	static struct kvm_xcrs master_xregs;
-	static struct {
+	struct CPUIDTable {
 		__u32 nent;
 		__u32 padding;
 		struct kvm_cpuid_entry2 entries[100];
-	} kvm_cpuid;
+	};
+	static CPUIDTable kvm_cpuid;
 	static long vcpu_mmap_size = 0;
 
+	/* Instruction set extensions, with the x86-64 psABI level that
+	   includes them, or 0 when no level does. A CPU baseline hides
+	   the extensions above its level, and requires the ones at or
+	   below it. Everything else (system features, mitigations and
+	   hints) is passed on from the host. */
+	enum CPUIDRegister : uint8_t { CPUID_EAX, CPUID_EBX, CPUID_ECX, CPUID_EDX };
+	struct CPUIDFeature {
+		uint32_t function;
+		uint32_t index;
+		CPUIDRegister reg;
+		uint8_t bit;
+		uint8_t level;
+	};
+	static constexpr CPUIDFeature cpuid_features[] = {
+		{ 0x1, 0, CPUID_ECX,  0, 2 }, // SSE3
+		{ 0x1, 0, CPUID_ECX,  1, 0 }, // PCLMULQDQ
+		{ 0x1, 0, CPUID_ECX,  9, 2 }, // SSSE3
+		{ 0x1, 0, CPUID_ECX, 12, 3 }, // FMA
+		{ 0x1, 0, CPUID_ECX, 13, 2 }, // CMPXCHG16B
+		{ 0x1, 0, CPUID_ECX, 19, 2 }, // SSE4.1
+		{ 0x1, 0, CPUID_ECX, 20, 2 }, // SSE4.2
+		{ 0x1, 0, CPUID_ECX, 22, 3 }, // MOVBE
+		{ 0x1, 0, CPUID_ECX, 23, 2 }, // POPCNT
+		{ 0x1, 0, CPUID_ECX, 25, 0 }, // AES
+		{ 0x1, 0, CPUID_ECX, 28, 3 }, // AVX
+		{ 0x1, 0, CPUID_ECX, 29, 3 }, // F16C
+		{ 0x1, 0, CPUID_ECX, 30, 0 }, // RDRAND
+		{ 0x7, 0, CPUID_EBX,  3, 3 }, // BMI1
+		{ 0x7, 0, CPUID_EBX,  4, 0 }, // HLE
+		{ 0x7, 0, CPUID_EBX,  5, 3 }, // AVX2
+		{ 0x7, 0, CPUID_EBX,  8, 3 }, // BMI2
+		{ 0x7, 0, CPUID_EBX, 11, 0 }, // RTM
+		{ 0x7, 0, CPUID_EBX, 16, 4 }, // AVX512F
+		{ 0x7, 0, CPUID_EBX, 17, 4 }, // AVX512DQ
+		{ 0x7, 0, CPUID_EBX, 18, 0 }, // RDSEED
+		{ 0x7, 0, CPUID_EBX, 19, 0 }, // ADX
+		{ 0x7, 0, CPUID_EBX, 21, 0 }, // AVX512IFMA
+		{ 0x7, 0, CPUID_EBX, 23, 0 }, // CLFLUSHOPT
+		{ 0x7, 0, CPUID_EBX, 24, 0 }, // CLWB
+		{ 0x7, 0, CPUID_EBX, 26, 0 }, // AVX512PF
+		{ 0x7, 0, CPUID_EBX, 27, 0 }, // AVX512ER
+		{ 0x7, 0, CPUID_EBX, 28, 4 }, // AVX512CD
+		{ 0x7, 0, CPUID_EBX, 29, 0 }, // SHA
+		{ 0x7, 0, CPUID_EBX, 30, 4 }, // AVX512BW
+		{ 0x7, 0, CPUID_EBX, 31, 4 }, // AVX512VL
+		{ 0x7, 0, CPUID_ECX,  1, 0 }, // AVX512VBMI
+		{ 0x7, 0, CPUID_ECX,  5, 0 }, // WAITPKG
+		{ 0x7, 0, CPUID_ECX,  6, 0 }, // AVX512VBMI2
+		{ 0x7, 0, CPUID_ECX,  8, 0 }, // GFNI
+		{ 0x7, 0, CPUID_ECX,  9, 0 }, // VAES
+		{ 0x7, 0, CPUID_ECX, 10, 0 }, // VPCLMULQDQ
+		{ 0x7, 0, CPUID_ECX, 11, 0 }, // AVX512VNNI
+		{ 0x7, 0, CPUID_ECX, 12, 0 }, // AVX512BITALG
+		{ 0x7, 0, CPUID_ECX, 14, 0 }, // AVX512VPOPCNTDQ
+		{ 0x7, 0, CPUID_ECX, 22, 0 }, // RDPID
+		{ 0x7, 0, CPUID_ECX, 27, 0 }, // MOVDIRI
+		{ 0x7, 0, CPUID_ECX, 28, 0 }, // MOVDIR64B
+		{ 0x7, 0, CPUID_EDX,  2, 0 }, // AVX512_4VNNIW
+		{ 0x7, 0, CPUID_EDX,  3, 0 }, // AVX512_4FMAPS
+		{ 0x7, 0, CPUID_EDX,  8, 0 }, // AVX512_VP2INTERSECT
+		{ 0x7, 0, CPUID_EDX, 14, 0 }, // SERIALIZE
+		{ 0x7, 0, CPUID_EDX, 22, 0 }, // AMX_BF16
+		{ 0x7, 0, CPUID_EDX, 23, 0 }, // AVX512_FP16
+		{ 0x7, 0, CPUID_EDX, 24, 0 }, // AMX_TILE
+		{ 0x7, 0, CPUID_EDX, 25, 0 }, // AMX_INT8
+		{ 0x7, 1, CPUID_EAX,  4, 0 }, // AVX_VNNI
+		{ 0x7, 1, CPUID_EAX,  5, 0 }, // AVX512_BF16
+		{ 0xD, 1, CPUID_EAX,  0, 0 }, // XSAVEOPT
+		{ 0xD, 1, CPUID_EAX,  1, 0 }, // XSAVEC
+		{ 0xD, 1, CPUID_EAX,  3, 0 }, // XSAVES
+		{ 0x80000001, 0, CPUID_ECX,  0, 2 }, // LAHF/SAHF
+		{ 0x80000001, 0, CPUID_ECX,  5, 3 }, // LZCNT
+		{ 0x80000001, 0, CPUID_ECX,  6, 0 }, // SSE4A
+		{ 0x80000001, 0, CPUID_ECX, 11, 0 }, // XOP
+		{ 0x80000001, 0, CPUID_ECX, 16, 0 }, // FMA4
+		{ 0x80000001, 0, CPUID_ECX, 21, 0 }, // TBM
+	};
+	/* The XSAVE state components of each level: x87 and SSE,
+	   then AVX, then the AVX-512 opmask and ZMM registers */
+	static uint64_t baseline_xcr0(CPUBaseline baseline)
+	{
+		switch (baseline) {
+		case CPUBaseline::Host:      return ~0ULL;
+		case CPUBaseline::X86_64_V2: return 0x3;
+		case CPUBaseline::X86_64_V3: return 0x7;
+		case CPUBaseline::X86_64_V4: return 0xE7;
+		}
+		return 0x3;
+	}
+	static constexpr size_t NUM_BASELINES = 5;
+	static std::array<CPUIDTable, NUM_BASELINES> baseline_cpuid;
+	static std::array<bool, NUM_BASELINES> baseline_supported;
+	static uint64_t host_cpuid_hash = 0;
+
+static kvm_cpuid_entry2* find_cpuid(CPUIDTable& table, uint32_t function, uint32_t index)
+{
+	for (uint32_t i = 0; i < table.nent; i++) {
+		auto& entry = table.entries[i];
+		if (entry.function == function && entry.index == index)
+			return &entry;
+	}
+	return nullptr;
+}
+static uint32_t& cpuid_register(kvm_cpuid_entry2& entry, CPUIDRegister reg)
+{
+	switch (reg) {
+	case CPUID_EAX: return entry.eax;
+	case CPUID_EBX: return entry.ebx;
+	case CPUID_ECX: return entry.ecx;
+	default:  return entry.edx;
+	}
+}
+
+/* Mask the host CPUID down to a psABI level, and record whether
+   the host has every extension of that level. */
+TINYKVM_COLD()
+static void initialize_baseline(CPUBaseline baseline)
+{
+	const unsigned level = unsigned(baseline);
+	CPUIDTable& table = baseline_cpuid.at(level);
+	table = kvm_cpuid;
+	bool supported = true;
+	for (const auto& feature : cpuid_features)
+	{
+		auto* entry = find_cpuid(table, feature.function, feature.index);
+		const uint32_t mask = 1u << feature.bit;
+		if (feature.level != 0 && feature.level <= level) {
+			supported = supported && entry != nullptr && (cpuid_register(*entry, feature.reg) & mask);
+		} else if (entry != nullptr) {
+			cpuid_register(*entry, feature.reg) &= ~mask;
+		}
+	}
+	/* Only the state components of the level can be enabled in XCR0,
+	   and the size of the XSAVE area follows from them. */
+	const uint64_t xcr0 = baseline_xcr0(baseline);
+	if (auto* xsave = find_cpuid(table, 0xD, 0); xsave != nullptr) {
+		supported = supported && (xsave->eax & xcr0) == xcr0;
+		xsave->eax &= xcr0;
+		xsave->edx = 0;
+		uint32_t size = 512 + 64; // Legacy area and XSAVE header
+		for (unsigned component = 2; component < 32; component++) {
+			auto* sub = find_cpuid(table, 0xD, component);
+			if ((xsave->eax & (1u << component)) && sub != nullptr)
+				size = std::max(size, sub->ebx + sub->eax);
+		}
+		xsave->ecx = size;
+	}
+	baseline_supported.at(level) = supported;
+}
+
+uint64_t host_cpu_features_hash()
+{
+	return host_cpuid_hash;
+}
+
+bool Machine::cpu_baseline_supported(CPUBaseline baseline)
+{
+	const unsigned level = unsigned(baseline);
+	return baseline == CPUBaseline::Host
+		|| (level < NUM_BASELINES && baseline_supported[level]);
+}
+
+bool Machine::gigapages_supported()
+{
+	auto* entry = find_cpuid(kvm_cpuid, 0x80000001, 0);
+	return entry != nullptr && (entry->edx & (1u << 26)); // PDPE1GB
+}
+
+/* Present the CPU baseline of the machine, instead of the host CPUID
+   that every new vCPU starts out with. Must happen before KVM_RUN. */
+static void set_baseline_cpuid(int vcpu_fd, CPUBaseline baseline)
+{
+	if (baseline == CPUBaseline::Host)
+		return;
+	const unsigned level = unsigned(baseline);
+	if (!Machine::cpu_baseline_supported(baseline)) {
+		throw MachineException("The host CPU does not support the CPU baseline", level);
+	}
+	if (ioctl(vcpu_fd, KVM_SET_CPUID2, &baseline_cpuid[level]) < 0) {
+		throw MachineException("KVM_SET_CPUID2 failed", level);
+	}
+}
+
 TINYKVM_COLD()
 void initialize_vcpu_stuff(int kvm_fd)
 {
@@ -53,24 +240,100 @@ void initialize_vcpu_stuff(int kvm_fd)
 		throw MachineException("Failed to KVM_GET_VCPU_MMAP_SIZE");
 	}
 
+	/* Registers are exchanged through kvm_run (KVM_CAP_SYNC_REGS), and
+	   there is no KVM_GET_REGS/KVM_SET_REGS fallback. Fail early instead
+	   of silently running with stale register state. */
+	int sync_regs = KVM_SYNC_X86_REGS;
+#ifdef TINYKVM_USE_SYNCED_SREGS
+	sync_regs |= KVM_SYNC_X86_SREGS;
+#endif
+	const int supported_sync_regs = ioctl(kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS);
+	if (supported_sync_regs < 0 || (supported_sync_regs & sync_regs) != sync_regs) {
+		throw MachineException("KVM_CAP_SYNC_REGS is not supported", supported_sync_regs);
+	}
+
 	/* Retrieve KVM-host CPUID features */
 	kvm_cpuid.nent = sizeof(kvm_cpuid.entries) / sizeof(kvm_cpuid.entries[0]);
 	if (ioctl(kvm_fd, KVM_GET_SUPPORTED_CPUID, &kvm_cpuid) < 0) {
 		throw MachineException("KVM_GET_SUPPORTED_CPUID failed");
 	}
+	host_cpuid_hash = std::hash<std::string_view>{}(std::string_view(
+		(const char*)kvm_cpuid.entries, kvm_cpuid.nent * sizeof(kvm_cpuid.entries[0])));
+	for (auto baseline : { CPUBaseline::X86_64_V2, CPUBaseline::X86_64_V3, CPUBaseline::X86_64_V4 })
+		initialize_baseline(baseline);
 }
 
-void* Machine::create_vcpu_timer()
+/* Create a vCPU with kvm_run mapped and the CPUID features assigned.
+   Used by vCPU::init() and to fill the KVM pool ahead of time. */
+void create_kvm_vcpu(int vm_fd, int cpu_id, int& vcpu_fd, struct kvm_run*& run)
+{
+	const int fd = ioctl(vm_fd, KVM_CREATE_VCPU, cpu_id);
+	if (UNLIKELY(fd < 0)) {
+		throw MachineException("Failed to KVM_CREATE_VCPU");
+	}
+	auto* mapping = (struct kvm_run*) ::mmap(NULL, vcpu_mmap_size,
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (UNLIKELY(mapping == MAP_FAILED)) {
+		close(fd);
+		throw MachineException("Failed to create KVM run-time mapped memory");
+	}
+	/* We only want GPRs and SREGS for now. */
+	mapping->kvm_valid_regs = KVM_SYNC_X86_REGS;
+#ifdef TINYKVM_USE_SYNCED_SREGS
+	mapping->kvm_valid_regs |= KVM_SYNC_X86_SREGS;
+#endif
+	/* Assign CPUID features to guest. I don't believe the guest
+	   can change of this, so we will only set it once. */
+	if (ioctl(fd, KVM_SET_CPUID2, &kvm_cpuid) < 0) {
+		munmap(mapping, vcpu_mmap_size);
+		close(fd);
+		throw MachineException("KVM_SET_CPUID2 failed");
+	}
+	vcpu_fd = fd;
+	run = mapping;
+}
+void destroy_kvm_vcpu(int vcpu_fd, struct kvm_run* run)
 {
-	signal(SIGUSR2, tinykvm_timer_signal_handler);
+	munmap(run, vcpu_mmap_size);
+	close(vcpu_fd);
+}
+
+void ExitCounters::merge(const ExitCounters& other) noexcept
+{
+	total += other.total;
+	interrupted += other.interrupted;
+	syscalls += other.syscalls;
+	page_faults += other.page_faults;
+	for (size_t i = 0; i < page_fault_kinds.size(); i++)
+		page_fault_kinds[i] += other.page_fault_kinds[i];
+	debug += other.debug;
+	exceptions += other.exceptions;
+	io_ports += other.io_ports;
+	mmio += other.mmio;
+	this->other += other.other;
+	for (size_t i = 0; i < by_syscall.size(); i++)
+		by_syscall[i] += other.by_syscall[i];
+}
+
+void* Machine::create_vcpu_timer(const void* owner, int clock, int signo)
+{
+	struct sigaction act {};
+	act.sa_sigaction = tinykvm_timer_signal_handler;
+	/* Execution timeouts interrupt blocking system calls,
+	   while other timers let them be restarted */
+	act.sa_flags = SA_SIGINFO | (signo != SIGUSR2 ? SA_RESTART : 0);
+	sigemptyset(&act.sa_mask);
+	::sigaction(signo, &act, nullptr);
 
 	struct ksigevent sigev {};
+	/* Fast execution timeout timers identify their vCPU */
+	sigev.sigev_value.sival_ptr = const_cast<void*>(owner);
 	sigev.sigev_notify = SIGEV_SIGNAL | SIGEV_THREAD_ID;
-	sigev.sigev_signo = SIGUSR2;
+	sigev.sigev_signo = signo;
 	sigev.sigev_tid = gettid();
 
 	timer_t timer_id {};
-	if (timer_create(CLOCK_MONOTONIC, (struct sigevent *)&sigev, &timer_id) < 0)
+	if (timer_create(clock, (struct sigevent *)&sigev, &timer_id) < 0)
 		throw MachineException("Unable to create timeout timer");
 	return timer_id;
 }
@@ -79,34 +342,28 @@ void vCPU::init(int id, Machine& machine, const MachineOptions& options)
 {
 	this->cpu_id = id;
 	this->last_fault_address = 0;
+	this->fault_around_next = 0;
+	this->fault_around_window = 0;
+	this->fault_around_max = options.page_fault_around;
 	this->m_machine = &machine;
 	if (this->fd < 0) {
-		this->fd = ioctl(machine.fd, KVM_CREATE_VCPU, this->cpu_id);
-		if (UNLIKELY(this->fd < 0)) {
-			Machine::machine_exception("Failed to KVM_CREATE_VCPU");
-		}
+		create_kvm_vcpu(machine.fd, this->cpu_id, this->fd, this->kvm_run);
 	}
-	if (this->timer_id == nullptr) {
-		this->timer_id = Machine::create_vcpu_timer();
+	this->lapic_timeout = options.lapic_timer;
+	this->shared_timeout = options.shared_timeout_engine && !this->lapic_timeout;
+	this->fast_timeout = options.fast_execution_timeout && !this->shared_timeout && !this->lapic_timeout;
+	if (this->timer_id == nullptr && !this->shared_timeout) {
+		this->timer_id = Machine::create_vcpu_timer(this->fast_timeout ? this : nullptr);
+		this->fast_timer_expiry = 0;
 	}
-	if (this->kvm_run == nullptr) {
-		kvm_run = (struct kvm_run*) ::mmap(NULL, vcpu_mmap_size,
-			PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
-		if (UNLIKELY(kvm_run == MAP_FAILED)) {
-			Machine::machine_exception("Failed to create KVM run-time mapped memory");
-		}
-
-		/* We only want GPRs and SREGS for now. */
-		kvm_run->kvm_valid_regs = KVM_SYNC_X86_REGS;
-#ifdef TINYKVM_USE_SYNCED_SREGS
-		kvm_run->kvm_valid_regs |= KVM_SYNC_X86_SREGS;
-#endif
-
-		/* Assign CPUID features to guest. I don't believe the guest
-		   can change of this, so we will only set it once. */
-		if (ioctl(this->fd, KVM_SET_CPUID2, &kvm_cpuid) < 0) {
-			Machine::machine_exception("KVM_SET_CPUID2 failed");
-		}
+	if (this->m_sregs_shadow == nullptr) {
+		/* First initialization of this vCPU */
+		set_baseline_cpuid(this->fd, machine.cpu_baseline());
+		if (this->lapic_timeout)
+			this->lapic_timer_init();
+		this->m_sregs_shadow = new kvm_sregs{};
+		this->m_sregs_shadow_valid = false;
+		this->m_sregs_synced = false;
 	}
 
 	// Only master VMs need special registers
@@ -172,7 +429,9 @@ void vCPU::init(int id, Machine& machine, const MachineOptions& options)
 	}
 
 	/* Extended control registers */
-	if (ioctl(this->fd, KVM_SET_XCRS, &master_xregs) < 0) {
+	struct kvm_xcrs xregs = master_xregs;
+	xregs.xcrs[0].value &= baseline_xcr0(machine.cpu_baseline());
+	if (ioctl(this->fd, KVM_SET_XCRS, &xregs) < 0) {
 		Machine::machine_exception("KVM_SET_XCRS failed");
 	}
 
@@ -204,6 +463,72 @@ void vCPU::init(int id, Machine& machine, const MachineOptions& options)
 	}
 }
 
+/* Put the local APIC in x2APIC mode, with its timer in TSC-deadline
+   mode delivering the timer vector of the IDT. The vCPU must not have
+   run yet, as it is given a new CPUID. */
+TINYKVM_COLD()
+void vCPU::lapic_timer_init()
+{
+	if (ioctl(Machine::kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_TSC_DEADLINE_TIMER) <= 0) {
+		throw MachineException("KVM_CAP_TSC_DEADLINE_TIMER is not supported");
+	}
+	const auto baseline = machine().cpu_baseline();
+	CPUIDTable table = (baseline == CPUBaseline::Host)
+		? kvm_cpuid : baseline_cpuid.at(unsigned(baseline));
+	auto* features = find_cpuid(table, 1, 0);
+	if (features == nullptr) {
+		throw MachineException("CPUID leaf 1 is missing");
+	}
+	features->ecx |= (1u << 21); // x2APIC
+	features->ecx |= (1u << 24); // TSC-deadline
+	if (ioctl(this->fd, KVM_SET_CPUID2, &table) < 0) {
+		Machine::machine_exception("KVM_SET_CPUID2 failed");
+	}
+
+	struct {
+		__u32 nmsrs;
+		__u32 pad = 0;
+		struct kvm_msr_entry entries[1];
+	} msrs;
+	msrs.nmsrs = 1;
+	msrs.entries[0].index = AMD64_MSR_APICBASE;
+	msrs.entries[0].data  = 0xFEE00000 | 0x100 /* BSP */ | AMD64_MSR_X2APIC_ENABLE;
+	if (ioctl(this->fd, KVM_SET_MSRS, &msrs) < (int)msrs.nmsrs) {
+		Machine::machine_exception("KVM_SET_MSRS: failed to enable x2APIC");
+	}
+
+	struct kvm_lapic_state lapic;
+	if (ioctl(this->fd, KVM_GET_LAPIC, &lapic) < 0) {
+		Machine::machine_exception("KVM_GET_LAPIC failed");
+	}
+	auto reg = [&] (unsigned offset) -> uint32_t& {
+		return *(uint32_t *)&lapic.regs[offset];
+	};
+	reg(0x80) = 0; // Task priority: accept all vectors
+	reg(0xF0) = 0x100 | AMD64_LAPIC_TIMER_VECTOR; // Software enable
+	reg(0x320) = AMD64_LAPIC_TIMER_VECTOR | (2u << 17); // TSC-deadline mode
+	for (unsigned lvt = 0x330; lvt <= 0x370; lvt += 0x10)
+		reg(lvt) = (1u << 16); // Masked
+	if (ioctl(this->fd, KVM_SET_LAPIC, &lapic) < 0) {
+		Machine::machine_exception("KVM_SET_LAPIC failed");
+	}
+
+	/* The deadline is in guest TSC ticks, which are host TSC
+	   ticks plus an offset, as long as TSC scaling is not used */
+	const int khz = ioctl(this->fd, KVM_GET_TSC_KHZ, 0);
+	if (khz <= 0) {
+		Machine::machine_exception("KVM_GET_TSC_KHZ failed");
+	}
+	this->lapic_tsc_khz = khz;
+	msrs.entries[0].index = AMD64_MSR_TSC;
+	if (ioctl(this->fd, KVM_GET_MSRS, &msrs) < (int)msrs.nmsrs) {
+		Machine::machine_exception("KVM_GET_MSRS: failed to read the TSC");
+	}
+	this->lapic_tsc_offset = int64_t(msrs.entries[0].data - __builtin_ia32_rdtsc());
+	this->lapic_deadline = 0;
+	this->lapic_armed = 0;
+}
+
 void vCPU::smp_init(int id, Machine& machine)
 {
 	this->cpu_id = id;
@@ -215,7 +540,9 @@ void vCPU::smp_init(int id, Machine& machine)
 	if (UNLIKELY(this->fd < 0)) {
 		Machine::machine_exception("Failed to KVM_CREATE_VCPU");
 	}
-	this->timer_id = Machine::create_vcpu_timer();
+	/* SMP vCPUs use the same timeout mode as the main vCPU */
+	this->fast_timeout = machine.vcpu.fast_timeout;
+	this->timer_id = Machine::create_vcpu_timer(this->fast_timeout ? this : nullptr);
 
 	kvm_run = (struct kvm_run*) ::mmap(NULL, vcpu_mmap_size,
 		PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
@@ -227,6 +554,7 @@ void vCPU::smp_init(int id, Machine& machine)
 #ifdef TINYKVM_USE_SYNCED_SREGS
 	kvm_run->kvm_valid_regs |= KVM_SYNC_X86_SREGS;
 #endif
+	this->m_sregs_shadow = new kvm_sregs{};
 
 	const kvm_mp_state state {
 		.mp_state = KVM_MP_STATE_RUNNABLE
@@ -239,9 +567,12 @@ void vCPU::smp_init(int id, Machine& machine)
 	if (ioctl(this->fd, KVM_SET_CPUID2, &kvm_cpuid) < 0) {
 		Machine::machine_exception("KVM_SET_CPUID2 failed");
 	}
+	set_baseline_cpuid(this->fd, machine.cpu_baseline());
 
 	/* Extended control registers */
-	if (ioctl(this->fd, KVM_SET_XCRS, &master_xregs) < 0) {
+	struct kvm_xcrs xregs = master_xregs;
+	xregs.xcrs[0].value &= baseline_xcr0(machine.cpu_baseline());
+	if (ioctl(this->fd, KVM_SET_XCRS, &xregs) < 0) {
 		Machine::machine_exception("KVM_SET_XCRS failed");
 	}
 
@@ -275,14 +606,99 @@ void vCPU::smp_init(int id, Machine& machine)
 
 void vCPU::deinit()
 {
+	if (this->timeout_timer.armed)
+		TimeoutEngine::get().disarm(this->timeout_timer);
 	if (this->fd > 0) {
 		close(this->fd);
 	}
 	if (kvm_run != nullptr) {
 		munmap(kvm_run, vcpu_mmap_size);
 	}
+	delete this->m_sregs_shadow;
+	this->m_sregs_shadow = nullptr;
+	delete this->m_page_reserve;
+	this->m_page_reserve = nullptr;
+
+	if (this->timer_id != nullptr)
+		timer_delete(this->timer_id);
+	if (this->m_budget_fd >= 0) {
+		close(this->m_budget_fd);
+		this->m_budget_fd = -1;
+	}
+	if (this->m_stats_fd >= 0) {
+		close(this->m_stats_fd);
+		this->m_stats_fd = -1;
+	}
+}
+
+/* The KVM statistics that CpuStats reports, in m_stats_offsets order */
+static constexpr std::array<const char*, 6> KVM_STATS_NAMES {
+	"exits", "halt_exits", "io_exits", "mmio_exits", "signal_exits", "halt_wait_ns"
+};
+
+bool vCPU::open_stats() const
+{
+	if (this->m_stats_fd >= 0)
+		return true;
+#ifdef KVM_GET_STATS_FD
+	const int stats_fd = ioctl(this->fd, KVM_GET_STATS_FD, nullptr);
+	if (stats_fd < 0)
+		return false;
+	struct kvm_stats_header header;
+	if (pread(stats_fd, &header, sizeof(header), 0) != sizeof(header)) {
+		close(stats_fd);
+		return false;
+	}
+	const size_t desc_size = sizeof(kvm_stats_desc) + header.name_size;
+	std::vector<char> descs(desc_size * header.num_desc);
+	if (pread(stats_fd, descs.data(), descs.size(), header.desc_offset) != ssize_t(descs.size())) {
+		close(stats_fd);
+		return false;
+	}
+	m_stats_offsets.fill(-1);
+	for (size_t i = 0; i < header.num_desc; i++) {
+		const auto* desc = (const kvm_stats_desc *)&descs[i * desc_size];
+		for (size_t s = 0; s < KVM_STATS_NAMES.size(); s++) {
+			if (strncmp(desc->name, KVM_STATS_NAMES[s], header.name_size) == 0)
+				m_stats_offsets[s] = header.data_offset + desc->offset;
+		}
+	}
+	this->m_stats_fd = stats_fd;
+	return true;
+#else
+	return false;
+#endif
+}
 
-	timer_delete(this->timer_id);
+CpuStats vCPU::cpu_stats() const
+{
+	CpuStats stats;
+	stats.cpu_time_ns = m_cpu_time_ns.load(std::memory_order_relaxed);
+	stats.runs = m_runs.load(std::memory_order_relaxed);
+	std::scoped_lock lock(m_stats_mtx);
+	if (!this->open_stats())
+		return stats;
+	uint64_t* counters[] {
+		&stats.exits, &stats.halt_exits, &stats.io_exits,
+		&stats.mmio_exits, &stats.signal_exits, &stats.halt_wait_ns
+	};
+	/* The counters are close together, so read them all at once */
+	int64_t begin = INT64_MAX, end = 0;
+	for (const int64_t offset : m_stats_offsets) {
+		if (offset >= 0) {
+			begin = std::min(begin, offset);
+			end = std::max(end, offset + int64_t(sizeof(uint64_t)));
+		}
+	}
+	std::array<uint64_t, 1024> data;
+	if (end <= begin || size_t(end - begin) > sizeof(data)
+		|| pread(m_stats_fd, data.data(), end - begin, begin) != end - begin)
+		return stats;
+	for (size_t s = 0; s < m_stats_offsets.size(); s++) {
+		if (m_stats_offsets[s] >= 0)
+			*counters[s] = data[(m_stats_offsets[s] - begin) / sizeof(uint64_t)];
+	}
+	return stats;
 }
 
 const tinykvm_x86regs& vCPU::registers() const
@@ -331,11 +747,36 @@ kvm_sregs& vCPU::get_special_registers()
 	if (ioctl(this->fd, KVM_GET_SREGS, &this->kvm_run->s.regs.sregs) < 0) {
 		Machine::machine_exception("KVM_GET_SREGS failed");
 	}
+#else
+	if (!this->m_sregs_synced)
+		return this->kvm_run->s.regs.sregs;
 #endif
+	/* The caller may modify the registers in-place, so remember
+	   what they were in order to detect unchanged registers. */
+	this->remember_special_registers(this->kvm_run->s.regs.sregs);
 	return this->kvm_run->s.regs.sregs;
 }
+void vCPU::remember_special_registers(const kvm_sregs& sregs)
+{
+	*this->m_sregs_shadow = sregs;
+	this->m_sregs_shadow_valid = true;
+}
 void vCPU::set_special_registers(const kvm_sregs& sregs)
 {
+	const kvm_sregs* current = nullptr;
+	if (this->m_sregs_shadow_valid)
+		current = this->m_sregs_shadow;
+#ifdef TINYKVM_USE_SYNCED_SREGS
+	else if (this->m_sregs_synced && &sregs != &this->kvm_run->s.regs.sregs)
+		current = &this->kvm_run->s.regs.sregs;
+#endif
+	if (current != nullptr && memcmp(current, &sregs, sizeof(sregs)) == 0) {
+		this->sregs_skipped++;
+		return;
+	}
+	this->sregs_updates++;
+	this->remember_special_registers(sregs);
+
 #ifdef TINYKVM_USE_SYNCED_SREGS
 	this->kvm_run->kvm_dirty_regs |= KVM_SYNC_X86_SREGS;
 
@@ -350,6 +791,17 @@ void vCPU::set_special_registers(const kvm_sregs& sregs)
 #endif
 }
 
+void vCPU::flush_tlb()
+{
+	/* KVM flushes the TLB of a vCPU when its CR3 changes. The page-level
+	   write-through bit only changes how the root table is cached, so
+	   flipping it forces a flush without help from the guest kernel. */
+	static constexpr uint64_t CR3_PWT = 1UL << 3;
+	struct kvm_sregs sregs = this->get_special_registers();
+	sregs.cr3 ^= CR3_PWT;
+	this->set_special_registers(sregs);
+}
+
 std::string_view vCPU::io_data() const
 {
 	char *p = (char *) kvm_run;
@@ -379,7 +831,25 @@ void Machine::setup_long_mode(const MachineOptions& options)
 	hdr.vm64_remote_return_addr =
 		usercode_header().translated_vm_remote_disconnect(memory);
 
-	this->m_kernel_end = setup_amd64_paging(memory, m_binary, options.remappings, options.split_hugepages);
+	this->m_kernel_end = setup_amd64_paging(memory, m_binary, options.remappings,
+		options.split_hugepages, options.vdso, options.lazy_page_tables);
+	this->m_vdso = options.vdso;
+}
+
+/* The guest kernel keeps the KVM clock in its own page, which the vDSO
+   may not read, so the vDSO reads a copy of it. KVM only re-bases the
+   clock now and then, so a copy from after the last run stays correct.
+   Forks share the copy of their master, like the clock itself. */
+void Machine::vdso_sync_clock()
+{
+	if (this->m_vdso_clock == 0) {
+		page_at(memory, VDSO_VVAR_AREA, [this] (uint64_t, uint64_t& entry, size_t) {
+			this->m_vdso_clock = entry & ~0x8000000000000FFFULL;
+		});
+	}
+	std::memcpy(memory.at(m_vdso_clock + VDSO_CLOCK_OFFSET, VDSO_CLOCK_SIZE),
+		memory.at(memory.physbase + INTR_ASM_ADDR + VDSO_CLOCK_OFFSET, VDSO_CLOCK_SIZE),
+		VDSO_CLOCK_SIZE);
 }
 
 std::pair<__u64, __u64> Machine::get_fsgs() const
@@ -417,6 +887,8 @@ void vCPU::set_vcpu_table_at(unsigned index, int value)
 
 void Machine::prepare_copy_on_write(size_t max_work_mem, uint64_t shared_memory_boundary)
 {
+	/* The pages left untouched can stay unpopulated in every fork */
+	this->reclaim_main_memory();
 	this->m_prepped = true;
 	if (max_work_mem == 0) {
 	}
@@ -431,6 +903,9 @@ void Machine::prepare_copy_on_write(size_t max_work_mem, uint64_t shared_memory_
 	// relevant user-writable pages have been made read-only and cloneable
 	//print_pagetables(this->memory);
 
+	/* Forks share the page tables, so they must be complete */
+	populate_lazy_gigapages(this->memory);
+
 	/* Make this machine runnable again using itself
 	   as the master VM. TODO: Enable hugepages for CoW mode? */
 	memory.banks.set_max_pages(max_work_mem / PAGE_SIZE, 0u);
@@ -445,8 +920,14 @@ void Machine::prepare_copy_on_write(size_t max_work_mem, uint64_t shared_memory_
 		memory.main_memory_writes = false;
 		/* If there are previously banked pages, we need to
 		   flatten them into the main memory. */
-		/// XXX: Implement memory flattening
+		const bool banked = memory.page_tables != memory.physbase + PT_ADDR;
+		if (banked) {
+			foreach_page_flatten(memory, memory.physbase + PT_ADDR);
+		}
 		memory.page_tables = memory.physbase + PT_ADDR;
+		memory.remote_must_update_gigapages = true;
+		memory.invalidate_tlb();
+		this->m_remote_pdpt_version = 0;
 		struct kvm_sregs sregs = this->get_special_registers();
 
 		/* Page table entry will be cloned at the start */
@@ -456,24 +937,57 @@ void Machine::prepare_copy_on_write(size_t max_work_mem, uint64_t shared_memory_
 		vcpu.set_special_registers(sregs);
 		this->enter_usermode();
 
-		foreach_page_makecow(this->memory, kernel_end_address(), shared_memory_boundary);
+		/* The banked pages and page tables are no longer in use. */
+		if (banked) {
+			memory.banks.reset(MachineOptions{});
+		}
+
+		this->makecow(shared_memory_boundary);
 		return;
 	}
 
 	/* This call makes this VM usable after making every page in the
 	   page tables read-only, enabling memory through page faults. */
-	foreach_page_makecow(this->memory, kernel_end_address(), shared_memory_boundary);
+	this->makecow(shared_memory_boundary);
 	this->setup_cow_mode(this);
 }
+size_t Machine::map_gigapages(address_t addr, size_t size)
+{
+	if (this->uses_cow_memory()) {
+		throw MachineException("Gigapages must be mapped before prepare_copy_on_write()");
+	}
+	if (!gigapages_supported()) {
+		throw MachineException("The host CPU does not support 1GB pages");
+	}
+	return merge_identity_gigapages(this->memory, addr, addr + size);
+}
+void Machine::makecow(uint64_t shared_memory_boundary)
+{
+	/* Incremental walks rely on a complete walk with the same boundary */
+	const bool incremental = m_makecow_incremental
+		&& m_makecow_boundary == shared_memory_boundary;
+	foreach_page_makecow(this->memory, kernel_end_address(), shared_memory_boundary,
+		m_makecow_threads, incremental);
+	this->m_makecow_boundary = shared_memory_boundary;
+}
 void Machine::setup_cow_mode(const Machine* other)
 {
 	/* Clone master PML4 page. We use the fixed PT_ADDR
 	   directly in order to avoid duplicating the memory banked
 	   page tables that allow the master VM to execute code
 	   separately from its forks, while sharing a master page table. */
-	auto pml4 = memory.new_page();
-	tinykvm::page_duplicate(pml4.pmem, other->memory.page_at(other->memory.physbase + PT_ADDR));
-	memory.page_tables = pml4.addr;
+	const uint64_t* master_pml4 = other->memory.page_at(other->memory.physbase + PT_ADDR);
+	if (memory.banks.is_table_page(memory.page_tables)) {
+		/* The page tables were kept across a reset, restore them */
+		tinykvm::restore_page_tables(memory, master_pml4);
+	} else {
+		auto pml4 = memory.new_table_page();
+		tinykvm::page_duplicate(pml4.pmem, master_pml4);
+		memory.page_tables = pml4.addr;
+	}
+	memory.remote_must_update_gigapages = true;
+	memory.invalidate_tlb();
+	this->m_remote_pdpt_version = 0;
 
 	/* Zero a new page for IST stack */
 	// XXX: This is not strictly necessary as we can
@@ -513,7 +1027,12 @@ void Machine::setup_cow_mode(const Machine* other)
 	   vCPUs, but for now we only need updated sregs. */
 	if (m_smp != nullptr) {
 		smp_vcpu_broadcast([sregs] (auto& cpu) {
-			cpu.set_special_registers(sregs);
+			/* Each vCPU keeps its own TSS and per-vCPU table */
+			auto smp_sregs = sregs;
+			const auto& current = cpu.get_special_registers();
+			smp_sregs.tr.base = current.tr.base;
+			smp_sregs.gs.base = current.gs.base;
+			cpu.set_special_registers(smp_sregs);
 		});
 	}
 }
@@ -568,5 +1087,8 @@ Machine::address_t Machine::preserving_entry_address() const noexcept {
 Machine::address_t Machine::exit_address() const noexcept {
 	return usercode_header().translated_vm_rexit(memory);
 }
+Machine::address_t Machine::chain_address() const noexcept {
+	return usercode_header().translated_vm_chain(memory);
+}
 
 } // tinykvm
@@ -1,16 +1,78 @@
 #pragma once
 #include "common.hpp"
 #include "forward.hpp"
+#include "timeout_engine.hpp"
+#include "util/scratch_iovec.hpp"
+#include <array>
+#include <atomic>
 #include <mutex>
+#include <pthread.h>
 
 namespace tinykvm
 {
 	struct Machine;
+	struct PageReserve;
+
+	/* Counts of VM exits by reason. Always on, as each exit only
+	   costs an increment or two. */
+	struct ExitCounters
+	{
+		enum PageFaultKind : unsigned {
+			PF_COPY_ON_WRITE = 0, // A copy of a master page
+			PF_ZERO,           // A new zeroed page
+			PF_HUGEPAGE,       // A copy of a whole 2MB page
+			PF_SPLIT_HUGEPAGE, // A 2MB page split into 4k pages
+			PF_REMOTE,         // Handled by the remote VM
+			PF_OTHER,          // Nothing new, eg. already mapped
+			PF_KINDS
+		};
+		uint64_t total = 0;       // Every return from KVM_RUN
+		uint64_t interrupted = 0; // Signals: timers and sampling
+		uint64_t syscalls = 0;
+		uint64_t page_faults = 0;
+		std::array<uint64_t, PF_KINDS> page_fault_kinds {};
+		uint64_t debug = 0;       // Breakpoints and single-steps
+		uint64_t exceptions = 0;  // Other CPU exceptions
+		uint64_t io_ports = 0;    // Custom input and output
+		uint64_t mmio = 0;
+		uint64_t other = 0;
+		/* By system call number. Custom system calls, which are
+		   numbered above the table, are counted in the last entry. */
+		std::array<uint32_t, TINYKVM_MAX_SYSCALLS + 1> by_syscall {};
+
+		void count_syscall(unsigned nr) noexcept {
+			syscalls++;
+			by_syscall[(nr < TINYKVM_MAX_SYSCALLS) ? nr : TINYKVM_MAX_SYSCALLS]++;
+		}
+		uint64_t syscall_count(unsigned nr) const noexcept {
+			return by_syscall[(nr < TINYKVM_MAX_SYSCALLS) ? nr : TINYKVM_MAX_SYSCALLS];
+		}
+		/* Add the counters of another vCPU */
+		void merge(const ExitCounters& other) noexcept;
+		void reset() noexcept { *this = ExitCounters{}; }
+	};
+
+	/* CPU time and exit counts of a vCPU, since it was created. The
+	   exits, halts and halt time come from the KVM binary statistics of
+	   the vCPU (Linux 5.14+), and are zero without them. */
+	struct CpuStats
+	{
+		uint64_t cpu_time_ns = 0;  // Host thread CPU time in run(), guest time included
+		uint64_t runs = 0;         // Calls to run()
+		uint64_t exits = 0;        // Guest exits, also those handled by KVM
+		uint64_t halt_exits = 0;
+		uint64_t io_exits = 0;
+		uint64_t mmio_exits = 0;
+		uint64_t signal_exits = 0; // Timeouts, cancellations and sampling
+		uint64_t halt_wait_ns = 0; // Halted, waiting for an interrupt
+	};
 
 	struct vCPU
 	{
 		void init(int id, Machine&, const MachineOptions&);
 		void smp_init(int id, Machine &);
+		/* Use a vCPU created ahead of time, before init() (see KvmPool) */
+		void adopt(int vcpu_fd, struct kvm_run* run) { this->fd = vcpu_fd; this->kvm_run = run; }
 		void deinit();
 		tinykvm_x86regs& registers();
 		const tinykvm_x86regs& registers() const;
@@ -20,10 +82,21 @@ namespace tinykvm
 		const struct kvm_sregs& get_special_registers() const;
 		struct kvm_sregs& get_special_registers();
 		void set_special_registers(const struct kvm_sregs &);
+		/* Make the next KVM_RUN start with an empty TLB, so that page
+		   table entries the host has taken away are no longer used. */
+		void flush_tlb();
 
 		void run(uint32_t tix);
 		long run_once();
 		void stop() { stopped = true; }
+		/* Make the current run() throw MachineCancelledException, or
+		   the next one, if there is none. Safe to call from any thread. */
+		void cancel();
+		/* Drop a cancellation that was not consumed by a run,
+		   eg. one that arrived just as the last run ended. */
+		void clear_cancel();
+		/* Safe to call from other threads, while the vCPU runs */
+		CpuStats cpu_stats() const;
 		void disable_timer();
 		std::string_view io_data() const;
 
@@ -50,21 +123,139 @@ namespace tinykvm
 		int fd = -1;
 		int cpu_id = 0;
 		bool stopped = true;
+		/* In a time-sliced run, the expiry of the timer pauses the vCPU
+		   instead of throwing, and the run can be continued with run().
+		   Expiry during a system call takes effect once it returns. */
+		bool preemptible = false;
+		mutable bool preempted = false;
+		/* With parallel guest threads, the system call serializer
+		   held by this vCPU during a system call, see BlockingCall */
+		std::unique_lock<std::mutex>* serializer = nullptr;
 		bool m_permanent_remote_connected = false;
 		uint8_t current_exception = 0;
 		uint32_t timer_ticks = 0;
 		void* timer_id = nullptr;
+		/* With MachineOptions::shared_timeout_engine */
+		bool shared_timeout = false;
+		TimeoutEngine::Timer timeout_timer;
+		/* With MachineOptions::fast_execution_timeout. The deadline
+		   and the armed timer expiry are CLOCK_MONOTONIC nanoseconds,
+		   and the expiry is 0 when the timer is not armed. */
+		bool fast_timeout = false;
+		uint64_t fast_timer_deadline = 0;
+		uint64_t fast_timer_expiry = 0;
+		/* With MachineOptions::lapic_timer. The deadline and the
+		   armed deadline MSR are guest TSC values, and the armed
+		   deadline is 0 when the timer is not armed. */
+		bool lapic_timeout = false;
+		uint64_t lapic_tsc_khz = 0;
+		int64_t lapic_tsc_offset = 0;
+		uint64_t lapic_deadline = 0;
+		uint64_t lapic_armed = 0;
+		/* Retired guest instructions allowed per run(), counted by a
+		   host perf counter that excludes the host. 0 is unlimited. */
+		uint64_t instruction_budget = 0;
+		uint64_t instructions_executed = 0; // By the last run()
 		uint64_t last_fault_address = 0;
+		/* Where the guest was when the last run() ended in a CPU
+		   exception, for unwinding. Zero otherwise. */
+		struct {
+			uint64_t rip = 0;
+			uint64_t rsp = 0;
+		} exception_frame;
+		/* Adaptive fault-around: the window grows while page
+		   faults keep landing right after the previous window. */
+		uint64_t fault_around_next = 0;
+		uint16_t fault_around_window = 0;
+		uint16_t fault_around_max = 0;
+		/* Special registers are only handed to KVM when they change.
+		   These count applied and skipped set_special_registers(). */
+		uint64_t sregs_updates = 0;
+		uint64_t sregs_skipped = 0;
+		ExitCounters exits;
 		uint64_t remote_return_address = 0;
 		uint64_t remote_original_tls_base = 0;
 		std::mutex* remote_serializer = nullptr;
 
+		/* Empty iovec arrays, reused by the I/O system calls */
+		ScratchIOVec<IOBuffer>& io_buffers() noexcept { m_io_buffers.clear(); return m_io_buffers; }
+		ScratchIOVec<IOWrBuffer>& io_wrbuffers() noexcept { m_io_wrbuffers.clear(); return m_io_wrbuffers; }
+
 	private:
 		struct kvm_run* kvm_run = nullptr;
 		Machine* m_machine = nullptr;
 		Machine* m_original_machine = nullptr;
+		/* The special registers as KVM last saw them, valid until the
+		   next KVM_RUN. Compared against in set_special_registers().
+		   m_sregs_synced is set once KVM_RUN has stored them in kvm_run. */
+		struct kvm_sregs* m_sregs_shadow = nullptr;
+		bool m_sregs_shadow_valid = false;
+		bool m_sregs_synced = false;
+		/* Pages taken ahead of time, for page faults under SMP */
+		PageReserve* m_page_reserve = nullptr;
+		ScratchIOVec<IOBuffer> m_io_buffers;
+		ScratchIOVec<IOWrBuffer> m_io_wrbuffers;
+		void remember_special_registers(const struct kvm_sregs&);
 
 		uint64_t vcpu_table_addr() const noexcept;
+		void fast_timer_arm(uint32_t ticks);
+		void fast_timer_rearm(uint64_t now);
+		bool fast_timer_expired();
+		void lapic_timer_init();
+		void lapic_timer_arm(uint32_t ticks);
+		void lapic_timer_write(uint64_t deadline, bool eoi);
+		long lapic_timer_interrupt();
+		uint64_t lapic_now() const noexcept;
+		bool preempt_on_expiry();
+		/* The perf counter of the instruction budget, opened on the
+		   thread that runs the vCPU */
+		int m_budget_fd = -1;
+		int m_budget_tid = -1;
+		bool budget_open();
+		void budget_arm();
+		void budget_disarm();
+		uint64_t budget_read() const;
+		[[noreturn]] void budget_exceeded();
+		/* The thread in run(), kicked by cancel() */
+		std::mutex m_cancel_mtx;
+		pthread_t m_run_thread {};
+		bool m_running = false;
+		std::atomic<bool> m_cancelled { false };
+		void run_begin();
+		void run_end();
+		/* CPU time accounting. The KVM statistics are opened on first
+		   use, and the data offsets of the CpuStats counters are found
+		   by name. */
+		uint64_t m_run_cpu_start = 0;
+		std::atomic<uint64_t> m_cpu_time_ns { 0 };
+		std::atomic<uint64_t> m_runs { 0 };
+		mutable std::mutex m_stats_mtx;
+		mutable int m_stats_fd = -1;
+		mutable std::array<int64_t, 6> m_stats_offsets {};
+		bool open_stats() const;
+		[[noreturn]] void cancelled();
+		friend struct Machine;
+	};
+
+	/* Releases the system call serializer of a vCPU around a host
+	   call that can block, eg. read() from a pipe, so that other
+	   guest threads can run, and eg. write to the pipe. Guest memory
+	   must be gathered before, and written to after. */
+	struct BlockingCall {
+		BlockingCall(vCPU& cpu) : m_lock(cpu.serializer) {
+			if (m_lock != nullptr && m_lock->owns_lock())
+				m_lock->unlock();
+			else
+				m_lock = nullptr;
+		}
+		~BlockingCall() {
+			if (m_lock != nullptr)
+				m_lock->lock();
+		}
+		BlockingCall(const BlockingCall&) = delete;
+		BlockingCall& operator=(const BlockingCall&) = delete;
+	private:
+		std::unique_lock<std::mutex>* m_lock;
 	};
 
 } // namespace tinykvm
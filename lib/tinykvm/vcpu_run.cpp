@@ -3,13 +3,18 @@
 #include "amd64/amd64.hpp"
 #include "amd64/gdt.hpp"
 #include "amd64/idt.hpp"
+#include "amd64/lapic.hpp"
 #include "amd64/memory_layout.hpp"
 #include "amd64/paging.hpp"
 #include "util/scoped_profiler.hpp"
+#include <fcntl.h>
 #include <linux/kvm.h>
+#include <linux/perf_event.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <signal.h>
+#include <unistd.h>
 static constexpr bool VERBOSE_REMOTE = false;
 #define PRINTER(printer, buffer, fmt, ...) \
 	printer(buffer, \
@@ -19,34 +24,341 @@ extern "C" int gettid();
 
 namespace tinykvm {
 	thread_local bool timer_was_triggered = false;
+	/* The vCPU with a fast execution timeout running on this thread */
+	thread_local const void* fast_timer_vcpu = nullptr;
+	thread_local struct kvm_run* fast_timer_run = nullptr;
+	thread_local timer_t fast_timer_id {};
+	/* The fast timer was re-armed from the signal handler */
+	thread_local bool fast_timer_kicked = false;
+	/* The sampling profiler armed on this thread, and its pending sample */
+	thread_local const void* sampling_owner = nullptr;
+	thread_local bool sample_was_triggered = false;
+	/* The instruction counter of the vCPU running on this thread */
+	thread_local int budget_fd = -1;
+	thread_local struct kvm_run* budget_run = nullptr;
+	thread_local bool budget_was_triggered = false;
 }
 extern "C"
-void tinykvm_timer_signal_handler(int sig) {
+void tinykvm_timer_signal_handler(int sig, siginfo_t* info, void*) {
 	// The idea is that we will not migrate this VM while
 	// it is running. This allows using TLS to determine if
 	// the timer already expired.
 	if (sig == SIGUSR2) {
-		tinykvm::timer_was_triggered = true;
+		/* Counter overflows are signalled through F_SETSIG */
+		if (info != nullptr && info->si_code > 0) {
+			if (info->si_fd == tinykvm::budget_fd && tinykvm::budget_run != nullptr) {
+				tinykvm::budget_was_triggered = true;
+				tinykvm::budget_run->immediate_exit = 1;
+			}
+			return;
+		}
+		/* A kick from vCPU::cancel(), which has set immediate_exit */
+		if (info != nullptr && info->si_code == SI_QUEUE)
+			return;
+		const void* owner = (info != nullptr && info->si_code == SI_TIMER)
+			? info->si_value.sival_ptr : nullptr;
+		if (owner == nullptr) {
+			tinykvm::timer_was_triggered = true;
+		} else if (owner == tinykvm::fast_timer_vcpu) {
+			/* Also catches the signal outside of KVM_RUN */
+			tinykvm::timer_was_triggered = true;
+			tinykvm::fast_timer_run->immediate_exit = 1;
+			/* Kick again in 20ms, like the interval timer, in case
+			   this signal did not interrupt a blocking system call. */
+			static constexpr struct itimerspec kick {
+				.it_interval = {},
+				.it_value = { .tv_sec = 0, .tv_nsec = 20'000'000L }
+			};
+			const int saved_errno = errno;
+			timer_settime(tinykvm::fast_timer_id, 0, &kick, nullptr);
+			errno = saved_errno;
+			tinykvm::fast_timer_kicked = true;
+		}
+		/* Otherwise it's a stale fast timer from a VM that is
+		   no longer running on this thread, and it is ignored. */
+	} else if (sig == SIGPROF) {
+		/* The sampling profiler interrupts KVM_RUN, without timing
+		   anything out. Host system calls are restarted. */
+		if (info != nullptr && info->si_code == SI_TIMER
+			&& info->si_value.sival_ptr == tinykvm::sampling_owner)
+			tinykvm::sample_was_triggered = true;
 	}
 }
 
 namespace tinykvm {
 	static constexpr bool VERBOSE_TIMER = false;
 
+static uint64_t monotonic_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1'000'000'000ULL + uint64_t(ts.tv_nsec);
+}
+/* Guest time is counted as CPU time of the thread in KVM_RUN */
+static uint64_t thread_cpu_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return uint64_t(ts.tv_sec) * 1'000'000'000ULL + uint64_t(ts.tv_nsec);
+}
+
+void vCPU::fast_timer_arm(uint32_t ticks)
+{
+	const uint64_t now = monotonic_ns();
+	this->fast_timer_deadline = now + uint64_t(ticks) * 1'000'000ULL;
+	kvm_run->immediate_exit = 0;
+	fast_timer_vcpu = this;
+	fast_timer_run = this->kvm_run;
+	fast_timer_id = this->timer_id;
+	/* A timer that is still armed and expires no later than
+	   the new deadline is kept. Should it expire early, it is
+	   re-armed then, costing one extra exit. */
+	if (fast_timer_expiry <= now || fast_timer_expiry > fast_timer_deadline)
+		this->fast_timer_rearm(now);
+}
+void vCPU::fast_timer_rearm(uint64_t now)
+{
+	const struct itimerspec its {
+		.it_interval = {},
+		.it_value = {
+			.tv_sec  = time_t(fast_timer_deadline / 1'000'000'000ULL),
+			.tv_nsec = long(fast_timer_deadline % 1'000'000'000ULL)
+		}
+	};
+	timer_settime(this->timer_id, TIMER_ABSTIME, &its, nullptr);
+	this->fast_timer_expiry = fast_timer_deadline;
+	fast_timer_kicked = false;
+	if constexpr (VERBOSE_TIMER) {
+		printf("Timer %p re-armed, %lu ns left\n", timer_id, fast_timer_deadline - now);
+	}
+}
+bool vCPU::fast_timer_expired()
+{
+	const uint64_t now = monotonic_ns();
+	if (now >= this->fast_timer_deadline)
+		return true;
+	/* An early signal from a timer armed for a previous call */
+	timer_was_triggered = false;
+	kvm_run->immediate_exit = 0;
+	if (fast_timer_kicked || this->fast_timer_expiry < this->fast_timer_deadline)
+		this->fast_timer_rearm(now);
+	return false;
+}
+
+uint64_t vCPU::lapic_now() const noexcept
+{
+	return __builtin_ia32_rdtsc() + this->lapic_tsc_offset;
+}
+void vCPU::lapic_timer_arm(uint32_t ticks)
+{
+	const uint64_t now = lapic_now();
+	this->lapic_deadline = now + uint64_t(ticks) * this->lapic_tsc_khz;
+	/* As with the fast timer, a pending deadline that is no later
+	   than the new one is kept, and re-armed should it fire early */
+	if (lapic_armed <= now || lapic_armed > lapic_deadline)
+		this->lapic_timer_write(lapic_deadline, false);
+	/* The timer interrupt is only delivered with IF set */
+	auto& regs = this->registers();
+	if (!(regs.rflags & 0x200)) {
+		regs.rflags |= 0x200;
+		this->set_registers(regs);
+	}
+}
+void vCPU::lapic_timer_write(uint64_t deadline, bool eoi)
+{
+	struct {
+		__u32 nmsrs;
+		__u32 pad = 0;
+		struct kvm_msr_entry entries[2];
+	} msrs;
+	msrs.nmsrs = 0;
+	if (eoi) {
+		msrs.entries[msrs.nmsrs].index = AMD64_MSR_X2APIC_EOI;
+		msrs.entries[msrs.nmsrs++].data = 0;
+	}
+	/* Writing 0 disarms the timer */
+	msrs.entries[msrs.nmsrs].index = AMD64_MSR_TSC_DEADLINE;
+	msrs.entries[msrs.nmsrs++].data = deadline;
+	if (ioctl(this->fd, KVM_SET_MSRS, &msrs) < (int)msrs.nmsrs) {
+		Machine::machine_exception("KVM_SET_MSRS: failed to arm the APIC timer");
+	}
+	this->lapic_armed = deadline;
+	if constexpr (VERBOSE_TIMER) {
+		printf("APIC timer armed at %lu\n", deadline);
+	}
+}
+/* The timer vector of the IDT exits with an OUT to its port. The
+   interrupt is acknowledged, and unless the deadline has passed,
+   the timer is re-armed and the guest returns from the interrupt. */
+long vCPU::lapic_timer_interrupt()
+{
+	this->exits.interrupted++;
+	if (this->timer_ticks == 0) {
+		/* A timer left armed by a previous timed call */
+		this->lapic_timer_write(0, true);
+		return KVM_EXIT_IO;
+	}
+	if (lapic_now() < this->lapic_deadline) {
+		this->lapic_timer_write(this->lapic_deadline, true);
+		return KVM_EXIT_IO;
+	}
+	this->lapic_timer_write(0, true);
+	if (this->preempt_on_expiry())
+		return 0;
+	Machine::timeout_exception("Timeout Exception", this->timer_ticks, this->budget_read());
+}
+
+bool vCPU::budget_open()
+{
+	const int tid = gettid();
+	if (m_budget_fd >= 0 && m_budget_tid == tid)
+		return true;
+	if (m_budget_fd >= 0) {
+		close(m_budget_fd);
+		m_budget_fd = -1;
+	}
+	struct sigaction act {};
+	act.sa_sigaction = tinykvm_timer_signal_handler;
+	act.sa_flags = SA_SIGINFO;
+	sigemptyset(&act.sa_mask);
+	::sigaction(SIGUSR2, &act, nullptr);
+
+	/* Retired instructions of this thread, while in guest mode */
+	struct perf_event_attr attr {};
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+	attr.disabled = 1;
+	attr.exclude_host = 1;
+	attr.exclude_hv = 1;
+	attr.sample_period = ~0ULL >> 1;
+	attr.wakeup_events = 1;
+	const int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	if (fd < 0)
+		return false;
+	/* The overflow signal goes to this thread, interrupting KVM_RUN */
+	struct f_owner_ex owner { .type = F_OWNER_TID, .pid = tid };
+	if (fcntl(fd, F_SETOWN_EX, &owner) < 0 || fcntl(fd, F_SETSIG, SIGUSR2) < 0
+		|| fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_ASYNC) < 0) {
+		close(fd);
+		return false;
+	}
+	m_budget_fd = fd;
+	m_budget_tid = tid;
+	return true;
+}
+void vCPU::budget_arm()
+{
+	if (!this->budget_open())
+		Machine::machine_exception("Unable to open a guest instruction counter", errno);
+	uint64_t period = this->instruction_budget;
+	ioctl(m_budget_fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(m_budget_fd, PERF_EVENT_IOC_PERIOD, &period);
+	budget_was_triggered = false;
+	budget_fd = m_budget_fd;
+	budget_run = this->kvm_run;
+	/* Counts until the first overflow, then disables itself */
+	ioctl(m_budget_fd, PERF_EVENT_IOC_REFRESH, 1);
+}
+void vCPU::budget_disarm()
+{
+	ioctl(m_budget_fd, PERF_EVENT_IOC_DISABLE, 0);
+	this->instructions_executed = this->budget_read();
+	budget_fd = -1;
+	budget_run = nullptr;
+	budget_was_triggered = false;
+	kvm_run->immediate_exit = 0;
+}
+uint64_t vCPU::budget_read() const
+{
+	uint64_t count = 0;
+	if (this->instruction_budget == 0 || m_budget_fd < 0 || ::read(m_budget_fd, &count, sizeof(count)) != sizeof(count))
+		return 0;
+	return count;
+}
+void vCPU::budget_exceeded()
+{
+	Machine::timeout_exception("Instruction budget exceeded",
+		this->timer_ticks, this->budget_read());
+}
+
+void vCPU::cancel()
+{
+	std::scoped_lock lock(m_cancel_mtx);
+	this->m_cancelled = true;
+	if (m_running) {
+		kvm_run->immediate_exit = 1;
+		pthread_sigqueue(m_run_thread, SIGUSR2, sigval{});
+	}
+}
+void vCPU::clear_cancel()
+{
+	std::scoped_lock lock(m_cancel_mtx);
+	this->m_cancelled = false;
+	if (kvm_run != nullptr)
+		kvm_run->immediate_exit = 0;
+}
+void vCPU::run_begin()
+{
+	std::scoped_lock lock(m_cancel_mtx);
+	this->m_run_thread = pthread_self();
+	this->m_running = true;
+	this->m_run_cpu_start = thread_cpu_ns();
+	/* Cancelled before the run started */
+	if (m_cancelled)
+		kvm_run->immediate_exit = 1;
+}
+void vCPU::run_end()
+{
+	std::scoped_lock lock(m_cancel_mtx);
+	this->m_running = false;
+	m_cpu_time_ns.fetch_add(thread_cpu_ns() - m_run_cpu_start, std::memory_order_relaxed);
+	m_runs.fetch_add(1, std::memory_order_relaxed);
+}
+void vCPU::cancelled()
+{
+	this->m_cancelled = false;
+	kvm_run->immediate_exit = 0;
+	throw MachineCancelledException("Execution cancelled");
+}
+
 bool vCPU::timed_out() const
 {
-	if (timer_was_triggered) {
+	if (timer_was_triggered || (this->lapic_timeout && this->timer_ticks != 0
+		&& lapic_now() >= this->lapic_deadline)) {
 		timer_was_triggered = false;
+		if (this->preemptible) {
+			this->preempted = true;
+			return false;
+		}
 		return true;
 	}
 	return false;
 }
+bool vCPU::preempt_on_expiry()
+{
+	if (!this->preemptible)
+		return false;
+	this->preempted = true;
+	this->stopped = true;
+	return true;
+}
 
 void vCPU::run(uint32_t ticks)
 {
 	timer_was_triggered = false;
+	this->exception_frame = {};
 	this->timer_ticks = ticks;
-	if (timer_ticks != 0) {
+	if (timer_ticks != 0 && this->lapic_timeout) {
+		this->lapic_timer_arm(ticks);
+	}
+	else if (timer_ticks != 0 && this->shared_timeout) {
+		TimeoutEngine::get().arm(this->timeout_timer, this->kvm_run, ticks);
+	}
+	else if (timer_ticks != 0 && this->fast_timeout) {
+		this->fast_timer_arm(ticks);
+	}
+	else if (timer_ticks != 0) {
 		const struct itimerspec its {
 			/* Interrupt every 20ms after timeout. This makes sure
 			   that we will eventually exit all blocking calls and
@@ -72,20 +384,68 @@ void vCPU::run(uint32_t ticks)
 	/* When an exception happens during KVM_RUN, we will need to
 	   intercept it, in order to disable the timeout timer.
 	   TODO: Convert timer disable to local destructor. */
+	SamplingProfiler* sampler = (this->cpu_id == 0) ? machine().sampling_profiler() : nullptr;
+	if (sampler != nullptr)
+		sampler->arm();
+	const bool budget = (this->cpu_id == 0 && this->instruction_budget != 0);
+	if (budget)
+		this->budget_arm();
+
+	this->run_begin();
+
 	try {
 		this->stopped = false;
 		while(run_once());
 	} catch (...) {
+		this->run_end();
+		if (sampler != nullptr)
+			sampler->disarm();
+		if (budget)
+			this->budget_disarm();
 		disable_timer();
+		machine().flush_output();
+		if (auto* trace = machine().syscall_trace(); trace && !trace->dump_path.empty())
+			trace->dump(trace->dump_path);
+		/* Eg. a blocking system call interrupted by the kick */
+		if (m_cancelled.load(std::memory_order_relaxed))
+			this->cancelled();
 		throw;
 	}
 
+	this->run_end();
+	if (sampler != nullptr)
+		sampler->disarm();
+	if (budget)
+		this->budget_disarm();
 	disable_timer();
+	machine().flush_output();
+	if (this->cpu_id == 0 && machine().m_vdso && !machine().uses_cow_memory())
+		machine().vdso_sync_clock();
 }
 void vCPU::disable_timer()
 {
 	timer_was_triggered = false;
-	if (timer_ticks != 0) {
+	if (timer_ticks != 0 && this->lapic_timeout) {
+		/* The timer is left armed, and ignored from now on */
+		this->timer_ticks = 0;
+	}
+	else if (timer_ticks != 0 && this->shared_timeout) {
+		this->timer_ticks = 0;
+		TimeoutEngine::get().disarm(this->timeout_timer);
+	}
+	else if (timer_ticks != 0 && this->fast_timeout) {
+		/* The timer is left armed, and ignored from now on */
+		this->timer_ticks = 0;
+		fast_timer_vcpu = nullptr;
+		fast_timer_run = nullptr;
+		kvm_run->immediate_exit = 0;
+		/* A kick fires once more, and is ignored */
+		if (fast_timer_kicked) {
+			fast_timer_kicked = false;
+			this->fast_timer_expiry = 0;
+		}
+	}
+	else if (timer_ticks != 0) {
 		this->timer_ticks = 0;
 		struct itimerspec its;
 		__builtin_memset(&its, 0, sizeof(its));
@@ -103,13 +463,32 @@ long vCPU::run_once()
 		ScopedProfiler<MachineProfiling::VCpuRun> prof(machine().profiling());
 		result = ioctl(this->fd, KVM_RUN, 0);
 	}
+	this->exits.total++;
+	/* KVM may have changed the special registers */
+	this->m_sregs_shadow_valid = false;
+	this->m_sregs_synced = true;
+	if (UNLIKELY(m_cancelled.load(std::memory_order_relaxed)))
+		this->cancelled();
 	// Handle potential KVM_RUN failure or execution timeout
 	if (UNLIKELY(result < 0)) {
-		if (this->timer_ticks) {
+		if (errno == EINTR)
+			this->exits.interrupted++;
+		if (budget_was_triggered && errno == EINTR) {
+			this->budget_exceeded();
+		} else if (sample_was_triggered && errno == EINTR && !timer_was_triggered) {
+			sample_was_triggered = false;
+			if (auto* sampler = machine().sampling_profiler())
+				sampler->sample(*this);
+			return KVM_EXIT_INTR;
+		} else if (this->timer_ticks && this->fast_timeout && errno == EINTR && !fast_timer_expired()) {
+			return KVM_EXIT_INTR;
+		} else if (this->timer_ticks) {
 			if constexpr (VERBOSE_TIMER) {
 				printf("Timer %p triggered\n", timer_id);
 			}
-			Machine::timeout_exception("Timeout Exception", this->timer_ticks);
+			if (this->preempt_on_expiry())
+				return 0;
+			Machine::timeout_exception("Timeout Exception", this->timer_ticks, this->budget_read());
 		} else if (errno == EINTR) {
 			Machine::timeout_exception("Interrupted (signal)", 0);
 		} else if (errno == EFAULT) {
@@ -125,10 +504,15 @@ long vCPU::run_once()
 		} else {
 			Machine::machine_exception("KVM_RUN failed (errno)", errno);
 		}
+	} else if (UNLIKELY(budget_was_triggered)) {
+		/* The overflow arrived after the guest had already exited */
+		this->budget_exceeded();
 	} else if (this->timer_ticks) {
 		// Occasionally we miss timer interruptions, and we must catch it via TLS.
-		if (UNLIKELY(timer_was_triggered)) {
-			Machine::timeout_exception("Timeout Exception", this->timer_ticks);
+		if (UNLIKELY(timer_was_triggered) && (!this->fast_timeout || fast_timer_expired())) {
+			if (this->preempt_on_expiry())
+				return 0;
+			Machine::timeout_exception("Timeout Exception", this->timer_ticks, this->budget_read());
 		}
 	}
 
@@ -160,6 +544,7 @@ long vCPU::run_once()
 		Machine::machine_exception("Halt from kernel space", KVM_EXIT_HLT);
 
 	case KVM_EXIT_DEBUG:
+		this->exits.debug++;
 		return KVM_EXIT_DEBUG;
 
 	case KVM_EXIT_FAIL_ENTRY:
@@ -174,6 +559,7 @@ long vCPU::run_once()
 			const char* data = ((char *)kvm_run) + kvm_run->io.data_offset;
 			const uint32_t intr = *(uint32_t *)data;
 			if (intr != 0xFFFF && intr != 0x1F778) {
+				this->exits.count_syscall(intr);
 				ScopedProfiler<MachineProfiling::Syscall> prof(machine().profiling());
 				static constexpr bool VERIFY_SYSCALL_REGS = false;
 				if constexpr (VERIFY_SYSCALL_REGS) {
@@ -212,15 +598,25 @@ long vCPU::run_once()
 				} else {
 					machine().system_call(*this, intr);
 				}
-				if (this->stopped) return 0;
+				if (this->stopped) {
+					/* The call stopped on its own, which beats preemption */
+					this->preempted = false;
+					return 0;
+				}
 				if (this->timed_out()) {
 					Machine::timeout_exception("Timeout Exception", this->timer_ticks);
 				}
+				if (UNLIKELY(this->preempted)) {
+					this->stopped = true;
+					return 0;
+				}
 				return KVM_EXIT_IO;
 			} else if (intr == 0xFFFF) {
+				this->exits.other++;
 				this->stopped = true;
 				return 0;
 			} else if (intr == 0x1F778) {
+				this->exits.count_syscall(intr);
 				// Remote VM disconnect syscall
 				if constexpr (VERBOSE_REMOTE) {
 					printf("Remote VM disconnect syscall, return=0x%lX\n",
@@ -245,11 +641,15 @@ long vCPU::run_once()
 		}
 		else if (kvm_run->io.port >= 0x80 && kvm_run->io.port < 0x100) {
 			auto intr = kvm_run->io.port - 0x80;
+			/* The timer vector reports as exception 33 */
+			if (intr == AMD64_LAPIC_TIMER_VECTOR + 1 && this->lapic_timeout)
+				return this->lapic_timer_interrupt();
 			this->current_exception = intr;
 
 			if (intr == 14) // Page fault
 			{
 				ScopedProfiler<MachineProfiling::PageFault> prof(machine().profiling());
+				this->exits.page_faults++;
 				auto& regs = registers();
 				const uint64_t addr = regs.rdi & ~(uint64_t) 0x8000000000000FFF;
 //#define VERBOSE_PAGE_FAULTS
@@ -281,6 +681,7 @@ long vCPU::run_once()
 					machine().remote_disconnect();
 					Machine::machine_exception("Kernel or zero page fault", intr);
 				} else if (machine().is_foreign_address(addr)) {
+					this->exits.page_fault_kinds[ExitCounters::PF_REMOTE]++;
 					/* Check that the error code is instruction fetch failed */
 					const uint32_t errcode = regs.rax;
 					if constexpr (VERBOSE_REMOTE) {
@@ -328,7 +729,7 @@ long vCPU::run_once()
 					}
 
 					this->remote_return_address = retaddr;
-					regs.rax = machine().remote_activate_now();
+					regs.rax = machine().remote_activate_now(addr);
 					this->set_registers(regs);
 					return KVM_EXIT_IO;
 				} else {
@@ -336,9 +737,31 @@ long vCPU::run_once()
 				}
 				this->set_registers(regs);
 
+				/* SMP vCPUs share the page tables */
+				std::unique_lock<std::mutex> smp_guard(memory.mtx_smp, std::defer_lock);
+				struct ReserveScope {
+					~ReserveScope() { vMemory::current_page_reserve = nullptr; }
+				} reserve_scope;
+				if (memory.smp_guards_enabled) {
+					/* Zeroed pages are reserved ahead of time, so that
+					   the lock is only held while editing page tables */
+					if (this->m_page_reserve == nullptr)
+						this->m_page_reserve = new PageReserve{};
+					memory.refill_page_reserve(*this->m_page_reserve);
+					smp_guard.lock();
+					vMemory::current_page_reserve = this->m_page_reserve;
+				}
+
 				WritablePageOptions zero_opts;
 				zero_opts.zeroes = false;
+				const auto counters = memory.page_counters;
 				auto result = writable_page_at(memory, addr, PDE64_USER | PDE64_RW, zero_opts);
+				this->exits.page_fault_kinds[
+					(memory.page_counters.hugepages != counters.hugepages) ? ExitCounters::PF_HUGEPAGE :
+					(memory.page_counters.split_hugepages != counters.split_hugepages) ? ExitCounters::PF_SPLIT_HUGEPAGE :
+					(memory.page_counters.copied != counters.copied) ? ExitCounters::PF_COPY_ON_WRITE :
+					(memory.page_counters.zeroed != counters.zeroed) ? ExitCounters::PF_ZERO :
+					ExitCounters::PF_OTHER]++;
 				if (machine().has_remote() && machine().remote().is_foreign_address(addr) && machine().remote().is_remote_connected()) {
 					// If a new gigapage was created, we need to update the
 					// PML4[0] 512GB page table entry in the caller VM too
@@ -350,6 +773,22 @@ long vCPU::run_once()
 					Machine::machine_exception("Page fault repeat on same address", intr);
 				}
 				this->last_fault_address = addr;
+				if (this->fault_around_max != 0) {
+					/* Sequential faults double the window, others halve it.
+					   A fault anywhere in the next page continues the run. */
+					const uint64_t page = addr & ~uint64_t(PAGE_SIZE - 1);
+					if (page == this->fault_around_next) {
+						this->fault_around_window = std::min<unsigned>(this->fault_around_max,
+							std::max(2u * this->fault_around_window, 1u));
+					} else {
+						this->fault_around_window /= 2;
+					}
+					if (this->fault_around_window != 0) {
+						fault_around_at(memory, addr, this->fault_around_window);
+					}
+					this->fault_around_next = std::min<uint64_t>((page | (PDE64_PT_SIZE-1)) + 1,
+						page + (1u + this->fault_around_window) * PAGE_SIZE);
+				}
 				if constexpr (false) {
 					char buffer[256];
 					PRINTER(machine().m_printer, buffer,
@@ -380,18 +819,22 @@ long vCPU::run_once()
 			}
 			else if (intr == 1) /* Debug trap */
 			{
+				this->exits.debug++;
 				machine().m_on_breakpoint(*this);
 				return KVM_EXIT_IO;
 			}
 			/* CPU Exception */
+			this->exits.exceptions++;
 			this->handle_exception(intr);
 			Machine::machine_exception(amd64_exception_name(intr), intr);
 		} else {
+			this->exits.io_ports++;
 			/* Custom Output handler */
 			const char* data = ((char *)kvm_run) + kvm_run->io.data_offset;
 			machine().m_on_output(*this, kvm_run->io.port, *(uint32_t *)data);
 		}
 		} else { // IN
+			this->exits.io_ports++;
 			/* Custom Input handler */
 			const char* data = ((char *)kvm_run) + kvm_run->io.data_offset;
 			machine().m_on_input(*this, kvm_run->io.port, *(uint32_t *)data);
@@ -400,6 +843,7 @@ long vCPU::run_once()
 		return KVM_EXIT_IO;
 
 	case KVM_EXIT_MMIO: {
+			this->exits.mmio++;
 			const uint64_t addr = kvm_run->mmio.phys_addr;
 			char buffer[256];
 			PRINTER(machine().m_printer, buffer,
@@ -412,6 +856,7 @@ long vCPU::run_once()
 	case KVM_EXIT_INTERNAL_ERROR:
 		Machine::machine_exception("KVM internal error");
 	}
+	this->exits.other++;
 	char buffer[256];
 	PRINTER(machine().m_printer, buffer,
 		"Unexpected exit reason %d\n", kvm_run->exit_reason);
@@ -558,6 +1003,7 @@ void vCPU::handle_exception(uint8_t intr)
 			machine().unsafe_copy_from_guest(&rfl, off+16, 8);
 			machine().unsafe_copy_from_guest(&rsp, off+24, 8);
 			machine().unsafe_copy_from_guest(&ss,  off+32, 8);
+			this->exception_frame = { .rip = rip, .rsp = rsp };
 
 			PRINTER(printer, buffer,
 				"Failing RIP: 0x%lX\n", rip);
@@ -608,8 +1054,12 @@ unsigned vCPU::exception_extra_offset(uint8_t intr)
 
 void Machine::migrate_to_this_thread()
 {
+	/* The shared timeout engine kicks whichever thread armed it */
+	if (vcpu.shared_timeout)
+		return;
 	timer_delete(vcpu.timer_id);
-	vcpu.timer_id = create_vcpu_timer();
+	vcpu.timer_id = create_vcpu_timer(vcpu.fast_timeout ? &vcpu : nullptr);
+	vcpu.fast_timer_expiry = 0;
 }
 
 } // tinykvm
@@ -10,6 +10,8 @@ struct VirtualMem {
 	uint64_t size;
 	uint64_t remote_end = 0; // End of remote vmem (for remote calls)
 	unsigned bank_idx = 0; // Optional bank index
+	bool shared = false;   // Read-only, from the FileMappingCache
+	bool external = false; // Owned elsewhere, eg. by a Channel
 	std::string filename; // Optional, for file-backed mappings
 
 	VirtualMem(uint64_t phys, char* p, uint64_t s, uint64_t vb = 0, uint64_t r = 0)
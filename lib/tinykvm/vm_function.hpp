@@ -0,0 +1,63 @@
+#pragma once
+#include "machine.hpp"
+#include <type_traits>
+#include <utility>
+
+namespace tinykvm
+{
+	template <typename F> struct VMFunction;
+
+	/// @brief A typed guest function, resolved once. The handle only holds
+	/// the guest address, so it can be shared by a master and all its forks.
+	/// The arguments are marshalled by Machine::setup_call():
+	/// - integers and enums are passed in registers
+	/// - std::string and C strings are copied, zero-terminated
+	/// - std::string_view and std::span are copied, and passed as
+	///   (pointer, length), taking two registers
+	/// - trivially copyable structs, by value or by pointer, are copied
+	///   and passed by address
+	/// Example:
+	///   VMFunction<long(std::string_view, const Header*)> on_request { master, "on_request" };
+	///   const long status = on_request(fork, path, &header);
+	template <typename R, typename... Args>
+	struct VMFunction<R(Args...)>
+	{
+		static_assert((vmcall_arg_registers<Args> + ... + 0) <= 6,
+			"Too many vmcall arguments for the argument registers");
+		static_assert(std::is_void_v<R> || std::is_integral_v<R> || std::is_enum_v<R>,
+			"VMFunction return values must be integers, enums or void");
+
+		VMFunction() = default;
+		explicit VMFunction(uint64_t address) noexcept : m_address(address) {}
+		/// @brief Resolve @symbol in the program of @machine.
+		/// Throws MachineException when the symbol is missing.
+		VMFunction(const Machine& machine, std::string_view symbol)
+			: m_address(machine.address_of(symbol))
+		{
+			if (m_address == 0x0)
+				throw MachineException("VMFunction: Missing guest symbol");
+		}
+
+		/// @brief Call the function with no timeout.
+		R operator() (Machine& machine, Args... args) const {
+			machine.vmcall(m_address, std::forward<Args> (args)...);
+			return result(machine);
+		}
+		/// @brief Call the function with a timeout in seconds.
+		R call(Machine& machine, float timeout, Args... args) const {
+			machine.timed_vmcall(m_address, timeout, std::forward<Args> (args)...);
+			return result(machine);
+		}
+
+		uint64_t address() const noexcept { return m_address; }
+		explicit operator bool() const noexcept { return m_address != 0x0; }
+
+	private:
+		static R result([[maybe_unused]] const Machine& machine) {
+			if constexpr (!std::is_void_v<R>)
+				return static_cast<R>(machine.return_value());
+		}
+		uint64_t m_address = 0x0;
+	};
+
+} // tinykvm
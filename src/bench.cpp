@@ -1,4 +1,5 @@
 #include <tinykvm/machine.hpp>
+#include <tinykvm/page_streaming.hpp>
 #include <cstring>
 #include <cstdio>
 #include <cassert>
@@ -8,6 +9,8 @@
 #include "load_file.hpp"
 
 #include <tinykvm/rsp_client.hpp>
+#include <tinykvm/util/command_slot.hpp>
+#include <tinykvm/util/threadpool.h>
 
 #define NUM_GUESTS   100
 #define NUM_RESETS   40000
@@ -25,6 +28,8 @@ static void benchmark_alternate_tenant_vmcalls(tinykvm::Machine &, size_t);
 static void benchmark_alternate_tenant_resets(tinykvm::Machine &, size_t);
 static void benchmark_multiple_vms(tinykvm::Machine&, size_t, size_t);
 static void benchmark_multiple_pooled_vms(tinykvm::Machine&, size_t, size_t);
+static void benchmark_smp_dispatch();
+static void benchmark_page_kernels();
 static std::vector<uint8_t> binary;
 
 int main(int argc, char** argv)
@@ -124,6 +129,22 @@ int main(int argc, char** argv)
 			});
 			printf("Fastest possible timed vmcall time: %lu ns\n", fastest_timed_call_time);
 
+			/* The same timed vmcall with the timer left armed between calls */
+			tinykvm::MachineOptions fast_timeout_options = options;
+			fast_timeout_options.fast_execution_timeout = true;
+			tinykvm::Machine fast_timeout_vm {binary, fast_timeout_options};
+			fast_timeout_vm.setup_linux(
+				{"kvmtest", "Hello World!\n"},
+				{"LC_TYPE=C", "LC_ALL=C", "USER=root"});
+			fast_timeout_vm.run();
+			auto fast_timed_call_time = micro_benchmark([&] {
+				fast_timeout_vm.timed_vmcall(vmcall_address, 4.0f);
+			});
+			printf("Fastest possible timed vmcall time (fast timeout): %lu ns\n", fast_timed_call_time);
+
+			benchmark_smp_dispatch();
+			benchmark_page_kernels();
+
 			static const auto simple_binary = load_file("../guest/musl/simple");
 
 			auto boot_time = micro_benchmark([&] {
@@ -692,6 +713,81 @@ long nanodiff(timespec start_time, timespec end_time)
 	return (end_time.tv_sec - start_time.tv_sec) * (long)1e9 + (end_time.tv_nsec - start_time.tv_nsec);
 }
 
+/* Round-trip dispatch to another thread: The thread pool that SMP
+   vCPUs used to be driven by, against the vCPU command slot. */
+void benchmark_smp_dispatch()
+{
+	static constexpr size_t DISPATCHES = 100000;
+	volatile size_t counter = 0;
+
+	tinykvm::ThreadPool pool { 1, 0, false };
+	auto t0 = time_now();
+	for (size_t i = 0; i < DISPATCHES; i++) {
+		pool.enqueue([&] { counter = counter + 1; }).get();
+	}
+	auto t1 = time_now();
+	printf("SMP dispatch round-trip (thread pool): %lu ns\n",
+		nanodiff(t0, t1) / DISPATCHES);
+
+	tinykvm::CommandSlot slot;
+	t0 = time_now();
+	for (size_t i = 0; i < DISPATCHES; i++) {
+		slot.call([&] { counter = counter + 1; });
+	}
+	t1 = time_now();
+	printf("SMP dispatch round-trip (command slot): %lu ns\n",
+		nanodiff(t0, t1) / DISPATCHES);
+
+	/* Fire-and-forget posting, as used by async SMP calls */
+	t0 = time_now();
+	for (size_t i = 0; i < DISPATCHES; i++) {
+		slot.post([] (void* arg) {
+			auto& c = *static_cast<volatile size_t*> (arg);
+			c = c + 1;
+		}, (void*)&counter);
+	}
+	slot.wait();
+	t1 = time_now();
+	printf("SMP dispatch post (command slot): %lu ns\n",
+		nanodiff(t0, t1) / DISPATCHES);
+}
+
+/* Every page copy and zero kernel this host can run, on a batch of
+   pages that fits in the caches, and on one that does not. */
+void benchmark_page_kernels()
+{
+	static constexpr size_t PAGES[] = { 16, 4096 };
+	const size_t size = PAGES[1] * 4096;
+	auto* src = (uint64_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_POPULATE, -1, 0);
+	auto* dst = (uint64_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_POPULATE, -1, 0);
+	std::memset(src, 0xAA, size);
+
+	printf("Page kernels: %s, streaming: %s\n",
+		tinykvm::page_kernel.name, tinykvm::page_stream_kernel.name);
+	for (const bool streaming : { false, true }) {
+		for (const auto& kernel : tinykvm::page_kernels(streaming)) {
+			for (const size_t pages : PAGES) {
+				auto copy_time = micro_benchmark([&] {
+					for (size_t p = 0; p < pages; p++)
+						kernel.duplicate(dst + p * 512, src + p * 512);
+					tinykvm::page_stream_fence();
+				});
+				auto zero_time = micro_benchmark([&] {
+					for (size_t p = 0; p < pages; p++)
+						kernel.memzero(dst + p * 512);
+					tinykvm::page_stream_fence();
+				});
+				printf("Page kernel %-10s x%-5zu copy: %lu ns/page, zero: %lu ns/page\n",
+					kernel.name, pages, copy_time / pages, zero_time / pages);
+			}
+		}
+	}
+	munmap(src, size);
+	munmap(dst, size);
+}
+
 static long micro_benchmark(std::function<void()> callback)
 {
 	callback();
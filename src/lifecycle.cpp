@@ -0,0 +1,300 @@
+#include <tinykvm/machine.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "load_file.hpp"
+
+/* Startup and lifecycle benchmark. Measures each step in the life
+   of a VM separately, and prints the results as JSON percentiles
+   in nanoseconds, so that they can be compared between versions.
+
+   lifecyclebench [options] guest.elf
+*/
+static const std::vector<std::string> PHASES {
+	"construct", "snapshot_load", "prepare_cow", "fork",
+	"reset_full", "reset_keep_memory", "first_vmcall", "vmcall",
+};
+static const std::vector<std::string> ENV {
+	"LC_TYPE=C", "LC_ALL=C", "USER=root"
+};
+
+struct Settings {
+	std::string binary_file;
+	std::string function = "bench";
+	std::string snapshot_file;
+	std::string output_file;
+	std::vector<std::string> phases = PHASES;
+	size_t samples = 100;
+	uint64_t max_mem = 256ULL << 20;
+	uint32_t max_cow_mem = 64ULL << 20;
+	bool hugepages = false;
+};
+
+static long monotonic_now()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+static long measure(const std::function<void()>& func)
+{
+	asm("" : : : "memory");
+	const long t0 = monotonic_now();
+	asm("" : : : "memory");
+	func();
+	asm("" : : : "memory");
+	const long t1 = monotonic_now();
+	asm("" : : : "memory");
+	return t1 - t0;
+}
+
+static void usage(const char* program)
+{
+	fprintf(stderr,
+		"Usage: %s [options] guest.elf\n"
+		"  --samples N         Samples per phase (default 100)\n"
+		"  --memory MB         Guest main memory (default 256)\n"
+		"  --cow-memory MB     Guest copy-on-write memory (default 64)\n"
+		"  --function NAME     Guest function to vmcall (default bench)\n"
+		"  --phases A,B,...    Phases to run (default all)\n"
+		"  --snapshot FILE     Snapshot file to create and load\n"
+		"  --hugepages         Use hugepages for main memory\n"
+		"  --output FILE       Write the JSON results to a file\n"
+		"Phases:", program);
+	for (const auto& phase : PHASES)
+		fprintf(stderr, " %s", phase.c_str());
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static std::vector<std::string> split(const std::string& list)
+{
+	std::vector<std::string> result;
+	size_t begin = 0;
+	while (begin <= list.size()) {
+		const size_t end = std::min(list.find(',', begin), list.size());
+		if (end > begin)
+			result.push_back(list.substr(begin, end - begin));
+		begin = end + 1;
+	}
+	return result;
+}
+
+static Settings parse_arguments(int argc, char** argv)
+{
+	Settings settings;
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+		auto value = [&] () -> std::string {
+			if (i + 1 >= argc) usage(argv[0]);
+			return argv[++i];
+		};
+		if (arg == "--samples") {
+			settings.samples = std::max(1ul, std::stoul(value()));
+		} else if (arg == "--memory") {
+			settings.max_mem = std::stoull(value()) << 20;
+		} else if (arg == "--cow-memory") {
+			settings.max_cow_mem = std::stoul(value()) << 20;
+		} else if (arg == "--function") {
+			settings.function = value();
+		} else if (arg == "--phases") {
+			settings.phases = split(value());
+			for (const auto& phase : settings.phases) {
+				if (std::find(PHASES.begin(), PHASES.end(), phase) == PHASES.end()) {
+					fprintf(stderr, "Unknown phase: %s\n", phase.c_str());
+					usage(argv[0]);
+				}
+			}
+		} else if (arg == "--snapshot") {
+			settings.snapshot_file = value();
+		} else if (arg == "--hugepages") {
+			settings.hugepages = true;
+		} else if (arg == "--output") {
+			settings.output_file = value();
+		} else if (arg.size() > 2 && arg.compare(0, 2, "--") == 0) {
+			usage(argv[0]);
+		} else {
+			settings.binary_file = arg;
+		}
+	}
+	if (settings.binary_file.empty())
+		usage(argv[0]);
+	return settings;
+}
+
+struct Benchmark {
+	Settings settings;
+	std::vector<uint8_t> binary;
+	tinykvm::MachineOptions options;
+	uint64_t vmcall_address = 0;
+
+	/* A master VM that has run main(), ready for forking */
+	std::unique_ptr<tinykvm::Machine> new_master(const tinykvm::MachineOptions& opts) const
+	{
+		auto vm = std::make_unique<tinykvm::Machine>(binary, opts);
+		vm->set_printer([] (const char*, size_t) {});
+		if (!vm->has_snapshot_state()) {
+			vm->setup_linux({"lifecycle"}, ENV);
+			vm->run();
+		}
+		return vm;
+	}
+	std::vector<long> run_phase(const std::string& phase);
+};
+
+std::vector<long> Benchmark::run_phase(const std::string& phase)
+{
+	const size_t N = settings.samples;
+	std::vector<long> samples;
+	samples.reserve(N);
+
+	if (phase == "construct") {
+		for (size_t i = 0; i < N; i++) {
+			std::unique_ptr<tinykvm::Machine> vm;
+			samples.push_back(measure([&] {
+				vm = std::make_unique<tinykvm::Machine>(binary, options);
+			}));
+		}
+	}
+	else if (phase == "snapshot_load") {
+		tinykvm::MachineOptions snap_options = options;
+		snap_options.snapshot_file = settings.snapshot_file;
+		unlink(settings.snapshot_file.c_str());
+		/* Create the snapshot after main() has run */
+		new_master(snap_options)->save_snapshot_state_now();
+		for (size_t i = 0; i < N; i++) {
+			std::unique_ptr<tinykvm::Machine> vm;
+			samples.push_back(measure([&] {
+				vm = std::make_unique<tinykvm::Machine>(binary, snap_options);
+			}));
+			if (!vm->has_snapshot_state()) {
+				throw std::runtime_error("Snapshot was not loaded: " + settings.snapshot_file);
+			}
+		}
+		unlink(settings.snapshot_file.c_str());
+	}
+	else if (phase == "prepare_cow") {
+		for (size_t i = 0; i < N; i++) {
+			auto master = new_master(options);
+			samples.push_back(measure([&] {
+				master->prepare_copy_on_write();
+			}));
+		}
+	}
+	else if (phase == "fork") {
+		auto master = new_master(options);
+		master->prepare_copy_on_write();
+		for (size_t i = 0; i < N; i++) {
+			std::unique_ptr<tinykvm::Machine> vm;
+			samples.push_back(measure([&] {
+				vm = std::make_unique<tinykvm::Machine>(*master, options);
+			}));
+		}
+	}
+	else if (phase == "reset_full" || phase == "reset_keep_memory") {
+		tinykvm::MachineOptions fork_options = options;
+		fork_options.reset_keep_all_work_memory = (phase == "reset_keep_memory");
+		auto master = new_master(options);
+		master->prepare_copy_on_write();
+		tinykvm::Machine vm { *master, fork_options };
+		for (size_t i = 0; i < N; i++) {
+			/* Dirty the fork, so that there is something to reset */
+			vm.timed_vmcall(vmcall_address, 4.0f);
+			samples.push_back(measure([&] {
+				vm.reset_to(*master, fork_options);
+			}));
+		}
+	}
+	else if (phase == "first_vmcall") {
+		auto master = new_master(options);
+		master->prepare_copy_on_write();
+		for (size_t i = 0; i < N; i++) {
+			tinykvm::Machine vm { *master, options };
+			samples.push_back(measure([&] {
+				vm.timed_vmcall(vmcall_address, 4.0f);
+			}));
+		}
+	}
+	else if (phase == "vmcall") {
+		auto master = new_master(options);
+		master->prepare_copy_on_write();
+		tinykvm::Machine vm { *master, options };
+		for (size_t i = 0; i < 10; i++)
+			vm.timed_vmcall(vmcall_address, 4.0f);
+		for (size_t i = 0; i < N; i++) {
+			samples.push_back(measure([&] {
+				vm.timed_vmcall(vmcall_address, 4.0f);
+			}));
+		}
+	}
+	return samples;
+}
+
+static long percentile(const std::vector<long>& sorted, double p)
+{
+	const size_t idx = std::min(sorted.size() - 1, size_t(p / 100.0 * sorted.size()));
+	return sorted[idx];
+}
+
+int main(int argc, char** argv)
+{
+	Benchmark bench;
+	bench.settings = parse_arguments(argc, argv);
+	auto& settings = bench.settings;
+	if (settings.snapshot_file.empty()) {
+		settings.snapshot_file = "/tmp/tinykvm-lifecycle-" + std::to_string(getpid()) + ".snapshot";
+	}
+	bench.binary = load_file(settings.binary_file);
+	bench.options = tinykvm::MachineOptions {
+		.max_mem = settings.max_mem,
+		.max_cow_mem = settings.max_cow_mem,
+		.hugepages = settings.hugepages,
+	};
+
+	tinykvm::Machine::init();
+	{
+		tinykvm::Machine vm { bench.binary, bench.options };
+		bench.vmcall_address = vm.address_of(settings.function);
+		if (bench.vmcall_address == 0x0) {
+			fprintf(stderr, "Error: The function '%s' is missing\n", settings.function.c_str());
+			exit(1);
+		}
+	}
+
+	FILE* out = stdout;
+	if (!settings.output_file.empty()) {
+		out = fopen(settings.output_file.c_str(), "w");
+		if (out == nullptr) {
+			fprintf(stderr, "Error: Could not open %s\n", settings.output_file.c_str());
+			exit(1);
+		}
+	}
+	fprintf(out, "{\n\t\"binary\": \"%s\",\n\t\"samples\": %zu,\n\t\"max_mem\": %lu,\n\t\"max_cow_mem\": %u,\n\t\"results\": {",
+		settings.binary_file.c_str(), settings.samples, settings.max_mem, settings.max_cow_mem);
+	for (size_t i = 0; i < settings.phases.size(); i++)
+	{
+		const auto& phase = settings.phases[i];
+		auto samples = bench.run_phase(phase);
+		std::sort(samples.begin(), samples.end());
+		long total = 0;
+		for (const long sample : samples)
+			total += sample;
+		fprintf(out, "%s\n\t\t\"%s\": { \"min\": %ld, \"mean\": %ld, \"p50\": %ld, \"p90\": %ld, \"p99\": %ld, \"max\": %ld }",
+			(i > 0) ? "," : "", phase.c_str(),
+			samples.front(), total / long(samples.size()),
+			percentile(samples, 50), percentile(samples, 90), percentile(samples, 99),
+			samples.back());
+		fflush(out);
+	}
+	fprintf(out, "\n\t}\n}\n");
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
@@ -0,0 +1,442 @@
+#include <tinykvm/machine.hpp>
+#include <tinykvm/smp.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "load_file.hpp"
+
+/* Micro-benchmarks of the hot paths. Each benchmark is measured in
+   isolation, once per parameter (a count or a size in bytes), and the
+   results are printed as JSON percentiles in nanoseconds, so that they
+   can be compared between versions. The guest program is in
+   guest/microbench. The remote_call benchmark also needs the storage
+   program in guest/remotebench.
+
+   microbench [options] microbench.elf [storage.elf]
+*/
+struct BenchmarkInfo {
+	std::string name;
+	std::string parameter; /* What the parameter means */
+	std::vector<size_t> defaults;
+};
+static const std::vector<BenchmarkInfo> BENCHMARKS {
+	{ "vmcall",          "none",          { 0 } },
+	{ "syscall",         "syscalls",      { 1, 16 } },
+	{ "cow_fault",       "pages",         { 1, 16, 256 } },
+	{ "zero_fault",      "pages",         { 1, 16, 256 } },
+	{ "reset",           "dirty_pages",   { 0, 16, 256, 4096 } },
+	{ "copy_to_guest",   "bytes",         { 64, 4096, 65536, 1048576 } },
+	{ "copy_from_guest", "bytes",         { 64, 4096, 65536, 1048576 } },
+	{ "gather_buffers",  "bytes",         { 64, 4096, 65536, 1048576 } },
+	{ "remote_call",     "bytes",         { 0, 64, 4096 } },
+	{ "smp_call",        "vcpus",         { 1, 4 } },
+	{ "snapshot_load",   "none",          { 0 } },
+};
+static const std::vector<std::string> ENV {
+	"LC_TYPE=C", "LC_ALL=C", "USER=root"
+};
+static constexpr uint64_t STORAGE_BASE = 1ULL << 30; /* 1GB */
+static constexpr size_t MAX_PAGES = 4096; /* Matches microbench.c */
+static constexpr size_t MAX_BYTES = MAX_PAGES * 4096;
+static constexpr uint32_t SMP_STACK_SIZE = 0x10000;
+
+struct Settings {
+	std::string binary_file;
+	std::string storage_file;
+	std::string snapshot_file;
+	std::string output_file;
+	std::vector<std::string> benchmarks;
+	std::vector<size_t> parameters; /* Overrides the defaults */
+	size_t samples = 1000;
+	uint64_t max_mem = 256ULL << 20;
+	uint32_t max_cow_mem = 128ULL << 20;
+};
+
+static long monotonic_now()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+static long measure(const std::function<void()>& func)
+{
+	asm("" : : : "memory");
+	const long t0 = monotonic_now();
+	asm("" : : : "memory");
+	func();
+	asm("" : : : "memory");
+	const long t1 = monotonic_now();
+	asm("" : : : "memory");
+	return t1 - t0;
+}
+
+static void usage(const char* program)
+{
+	fprintf(stderr,
+		"Usage: %s [options] microbench.elf [storage.elf]\n"
+		"  --samples N           Samples per measurement (default 1000)\n"
+		"  --memory MB           Guest main memory (default 256)\n"
+		"  --cow-memory MB       Guest copy-on-write memory (default 128)\n"
+		"  --benchmarks A,B,...  Benchmarks to run (default all)\n"
+		"  --parameters A,B,...  Parameters of every benchmark (default per benchmark)\n"
+		"  --snapshot FILE       Snapshot file to create and load\n"
+		"  --output FILE         Write the JSON results to a file\n"
+		"Benchmarks:\n", program);
+	for (const auto& info : BENCHMARKS) {
+		fprintf(stderr, "  %-18s %s:", info.name.c_str(), info.parameter.c_str());
+		for (const size_t param : info.defaults)
+			fprintf(stderr, " %zu", param);
+		fprintf(stderr, "\n");
+	}
+	exit(1);
+}
+
+static std::vector<std::string> split(const std::string& list)
+{
+	std::vector<std::string> result;
+	size_t begin = 0;
+	while (begin <= list.size()) {
+		const size_t end = std::min(list.find(',', begin), list.size());
+		if (end > begin)
+			result.push_back(list.substr(begin, end - begin));
+		begin = end + 1;
+	}
+	return result;
+}
+
+static const BenchmarkInfo* find_benchmark(const std::string& name)
+{
+	for (const auto& info : BENCHMARKS) {
+		if (info.name == name)
+			return &info;
+	}
+	return nullptr;
+}
+
+static Settings parse_arguments(int argc, char** argv)
+{
+	Settings settings;
+	std::vector<std::string> files;
+	for (const auto& info : BENCHMARKS)
+		settings.benchmarks.push_back(info.name);
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+		auto value = [&] () -> std::string {
+			if (i + 1 >= argc) usage(argv[0]);
+			return argv[++i];
+		};
+		if (arg == "--samples") {
+			settings.samples = std::max(1ul, std::stoul(value()));
+		} else if (arg == "--memory") {
+			settings.max_mem = std::stoull(value()) << 20;
+		} else if (arg == "--cow-memory") {
+			settings.max_cow_mem = std::stoul(value()) << 20;
+		} else if (arg == "--benchmarks") {
+			settings.benchmarks = split(value());
+			for (const auto& name : settings.benchmarks) {
+				if (find_benchmark(name) == nullptr) {
+					fprintf(stderr, "Unknown benchmark: %s\n", name.c_str());
+					usage(argv[0]);
+				}
+			}
+		} else if (arg == "--parameters") {
+			settings.parameters.clear();
+			for (const auto& param : split(value())) {
+				settings.parameters.push_back(std::stoul(param));
+			}
+			if (settings.parameters.empty())
+				usage(argv[0]);
+		} else if (arg == "--snapshot") {
+			settings.snapshot_file = value();
+		} else if (arg == "--output") {
+			settings.output_file = value();
+		} else if (arg.size() > 2 && arg.compare(0, 2, "--") == 0) {
+			usage(argv[0]);
+		} else {
+			files.push_back(arg);
+		}
+	}
+	if (files.empty() || files.size() > 2)
+		usage(argv[0]);
+	settings.binary_file = files[0];
+	if (files.size() > 1)
+		settings.storage_file = files[1];
+	return settings;
+}
+
+struct Benchmark {
+	Settings settings;
+	std::vector<uint8_t> binary;
+	std::vector<uint8_t> storage_binary;
+	tinykvm::MachineOptions options;
+	std::unique_ptr<tinykvm::Machine> master;
+
+	/* A VM that has run main() */
+	std::unique_ptr<tinykvm::Machine> new_vm(const tinykvm::MachineOptions& opts) const
+	{
+		auto vm = std::make_unique<tinykvm::Machine>(binary, opts);
+		vm->set_printer([] (const char*, size_t) {});
+		if (!vm->has_snapshot_state()) {
+			vm->setup_linux({"microbench"}, ENV);
+			vm->run(4.0f);
+		}
+		return vm;
+	}
+	std::unique_ptr<tinykvm::Machine> new_fork() const
+	{
+		return std::make_unique<tinykvm::Machine>(*master, options);
+	}
+	uint64_t address_of(const char* symbol) const
+	{
+		const uint64_t addr = master->address_of(symbol);
+		if (addr == 0x0)
+			throw std::runtime_error(std::string("Missing guest symbol: ") + symbol);
+		return addr;
+	}
+	std::vector<long> run(const std::string& benchmark, size_t param);
+};
+
+std::vector<long> Benchmark::run(const std::string& benchmark, size_t param)
+{
+	const size_t N = settings.samples;
+	std::vector<long> samples;
+	samples.reserve(N);
+	/* Warm up page tables and caches before measuring. @prepare
+	   runs before each sample, and is not measured. */
+	auto sample = [&] (const std::function<void()>& func,
+		const std::function<void()>& prepare = nullptr)
+	{
+		for (size_t i = 0; i < std::min(N, size_t(10)); i++) {
+			if (prepare) prepare();
+			func();
+		}
+		for (size_t i = 0; i < N; i++) {
+			if (prepare) prepare();
+			samples.push_back(measure(func));
+		}
+	};
+
+	if (benchmark == "vmcall") {
+		auto vm = new_fork();
+		const uint64_t addr = address_of("bench_empty");
+		sample([&] {
+			vm->timed_vmcall(addr, 4.0f);
+		});
+	}
+	else if (benchmark == "syscall") {
+		/* A vmcall making @param getpid() system calls */
+		auto vm = new_fork();
+		const uint64_t addr = address_of("bench_syscalls");
+		sample([&] {
+			vm->timed_vmcall(addr, 4.0f, param);
+		});
+	}
+	else if (benchmark == "cow_fault" || benchmark == "zero_fault") {
+		/* A vmcall writing to @param pages of a fork that was just
+		   reset, so that each page is faulted in again */
+		if (param > MAX_PAGES)
+			throw std::runtime_error("Too many pages");
+		auto vm = new_fork();
+		const uint64_t addr = address_of(
+			(benchmark == "cow_fault") ? "bench_cow_pages" : "bench_zero_pages");
+		sample([&] {
+			vm->timed_vmcall(addr, 4.0f, param);
+		}, [&] {
+			vm->reset_to(*master, options);
+		});
+	}
+	else if (benchmark == "reset") {
+		/* reset_to() after dirtying @param pages */
+		if (param > MAX_PAGES)
+			throw std::runtime_error("Too many pages");
+		auto vm = new_fork();
+		const uint64_t addr = address_of("bench_cow_pages");
+		sample([&] {
+			vm->reset_to(*master, options);
+		}, [&] {
+			vm->timed_vmcall(addr, 4.0f, param);
+		});
+	}
+	else if (benchmark == "copy_to_guest" || benchmark == "copy_from_guest") {
+		if (param > MAX_BYTES)
+			throw std::runtime_error("Size is too large");
+		auto vm = new_fork();
+		const uint64_t addr = address_of("buffer");
+		std::vector<uint8_t> data(param, 3);
+		/* Fault in the pages first: this measures the copy alone */
+		vm->copy_to_guest(addr, data.data(), data.size());
+		if (benchmark == "copy_to_guest") {
+			sample([&] {
+				vm->copy_to_guest(addr, data.data(), data.size());
+			});
+		} else {
+			sample([&] {
+				vm->copy_from_guest(data.data(), addr, data.size());
+			});
+		}
+	}
+	else if (benchmark == "gather_buffers") {
+		if (param > MAX_BYTES)
+			throw std::runtime_error("Size is too large");
+		auto vm = new_fork();
+		const uint64_t addr = address_of("buffer");
+		std::vector<tinykvm::Machine::Buffer> buffers;
+		buffers.reserve(param / 4096 + 2);
+		sample([&] {
+			buffers.clear();
+			vm->gather_buffers_from_range(buffers, addr, param);
+		});
+	}
+	else if (benchmark == "remote_call") {
+		/* One remote session per call, reading @param bytes of the
+		   caller from the storage VM */
+		if (storage_binary.empty())
+			throw std::runtime_error("Needs storage.elf from guest/remotebench");
+		if (param > MAX_BYTES)
+			throw std::runtime_error("Size is too large");
+		tinykvm::Machine storage { storage_binary, tinykvm::MachineOptions {
+			.max_mem = settings.max_mem,
+			.vmem_base_address = STORAGE_BASE,
+		}};
+		storage.set_printer([] (const char*, size_t) {});
+		storage.setup_linux({"storage"}, ENV);
+		storage.run(4.0f);
+		storage.registers().rip += 2; // Skip OUT instruction
+		const uint64_t checksum_addr = storage.address_of("remote_checksum");
+		if (checksum_addr == 0x0)
+			throw std::runtime_error("Missing remote_checksum in storage.elf");
+
+		tinykvm::MachineOptions remote_options = options;
+		remote_options.split_hugepages = true;
+		auto vm = new_vm(remote_options);
+		vm->remote_connect(storage);
+		const uint64_t addr = address_of("buffer");
+		sample([&] {
+			vm->remote_session_begin();
+			vm->remote_session_call(checksum_addr, addr, param);
+			vm->remote_session_end();
+		});
+		vm.reset();
+	}
+	else if (benchmark == "smp_call") {
+		/* An empty function on @param vCPUs, until all are done */
+		if (param == 0)
+			throw std::runtime_error("Needs at least one vCPU");
+		auto vm = new_vm(options);
+		const uint64_t addr = address_of("bench_empty");
+		const uint64_t stacks = vm->mmap_allocate(param * SMP_STACK_SIZE);
+		sample([&] {
+			vm->smp().timed_smpcall(param, stacks, SMP_STACK_SIZE, addr, 4.0f);
+			vm->smp_wait();
+		});
+	}
+	else if (benchmark == "snapshot_load") {
+		tinykvm::MachineOptions snap_options = options;
+		snap_options.snapshot_file = settings.snapshot_file;
+		unlink(settings.snapshot_file.c_str());
+		new_vm(snap_options)->save_snapshot_state_now();
+		sample([&] {
+			tinykvm::Machine vm { binary, snap_options };
+			if (!vm.has_snapshot_state())
+				throw std::runtime_error("Snapshot was not loaded: " + settings.snapshot_file);
+		});
+		unlink(settings.snapshot_file.c_str());
+	}
+	return samples;
+}
+
+static long percentile(const std::vector<long>& sorted, double p)
+{
+	const size_t idx = std::min(sorted.size() - 1, size_t(p / 100.0 * sorted.size()));
+	return sorted[idx];
+}
+
+int main(int argc, char** argv)
+{
+	Benchmark bench;
+	bench.settings = parse_arguments(argc, argv);
+	auto& settings = bench.settings;
+	if (settings.snapshot_file.empty()) {
+		settings.snapshot_file = "/tmp/tinykvm-microbench-" + std::to_string(getpid()) + ".snapshot";
+	}
+	bench.binary = load_file(settings.binary_file);
+	if (!settings.storage_file.empty())
+		bench.storage_binary = load_file(settings.storage_file);
+	bench.options = tinykvm::MachineOptions {
+		.max_mem = settings.max_mem,
+		.max_cow_mem = settings.max_cow_mem,
+	};
+
+	tinykvm::Machine::init();
+	tinykvm::Machine::install_unhandled_syscall_handler(
+	[] (tinykvm::vCPU& cpu, unsigned scall) {
+		if (scall == 0x10002) { // storage_wait_paused(data, result)
+			cpu.stop();
+			return;
+		}
+		auto& regs = cpu.registers();
+		regs.rax = -ENOSYS;
+		cpu.set_registers(regs);
+	});
+	bench.master = bench.new_vm(bench.options);
+	bench.master->prepare_copy_on_write();
+	if (bench.master->address_of("bench_cow_pages") == 0x0) {
+		fprintf(stderr, "Error: Build the guest in guest/microbench\n");
+		exit(1);
+	}
+
+	FILE* out = stdout;
+	if (!settings.output_file.empty()) {
+		out = fopen(settings.output_file.c_str(), "w");
+		if (out == nullptr) {
+			fprintf(stderr, "Error: Could not open %s\n", settings.output_file.c_str());
+			exit(1);
+		}
+	}
+	fprintf(out, "{\n\t\"binary\": \"%s\",\n\t\"samples\": %zu,\n\t\"max_mem\": %lu,\n\t\"max_cow_mem\": %u,\n\t\"results\": {",
+		settings.binary_file.c_str(), settings.samples, settings.max_mem, settings.max_cow_mem);
+	for (size_t i = 0; i < settings.benchmarks.size(); i++)
+	{
+		const auto& info = *find_benchmark(settings.benchmarks[i]);
+		fprintf(out, "%s\n\t\t\"%s\": { \"parameter\": \"%s\",",
+			(i > 0) ? "," : "", info.name.c_str(), info.parameter.c_str());
+		const auto& params = (settings.parameters.empty() || info.parameter == "none")
+			? info.defaults : settings.parameters;
+		for (size_t j = 0; j < params.size(); j++)
+		{
+			const size_t param = params[j];
+			fprintf(out, "%s\n\t\t\t\"%zu\": ", (j > 0) ? "," : "", param);
+			std::vector<long> samples;
+			try {
+				samples = bench.run(info.name, param);
+			} catch (const std::exception& e) {
+				/* Report the failure, and keep measuring the others */
+				fprintf(out, "{ \"error\": \"%s\" }", e.what());
+				fflush(out);
+				continue;
+			}
+			std::sort(samples.begin(), samples.end());
+			long total = 0;
+			for (const long sample : samples)
+				total += sample;
+			fprintf(out, "{ \"min\": %ld, \"mean\": %ld, \"p50\": %ld, \"p90\": %ld, \"p99\": %ld, \"max\": %ld }",
+				samples.front(), total / long(samples.size()),
+				percentile(samples, 50), percentile(samples, 90), percentile(samples, 99),
+				samples.back());
+			fflush(out);
+		}
+		fprintf(out, "\n\t\t}");
+	}
+	fprintf(out, "\n\t}\n}\n");
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
@@ -0,0 +1,370 @@
+#include <tinykvm/machine.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "load_file.hpp"
+
+/* Remote-call latency benchmark. Measures each way of calling into a
+   remote VM separately, per payload size, and prints the results as
+   JSON percentiles in nanoseconds, so that they can be compared
+   between versions. The guest programs are in guest/remotebench.
+
+   remotebench [options] main.elf storage.elf
+*/
+static const std::vector<std::string> MECHANISMS {
+	"vmcall", "pagefault", "permanent", "ipre_resume",
+	"session", "session_call", "connect", "gigapage_update",
+};
+/* Mechanisms that do not move a payload are measured once */
+static bool uses_payload(const std::string& mechanism)
+{
+	return mechanism != "connect" && mechanism != "gigapage_update";
+}
+static const std::vector<std::string> ENV {
+	"LC_TYPE=C", "LC_ALL=C", "USER=root"
+};
+static constexpr uint64_t STORAGE_BASE = 1ULL << 30; /* 1GB */
+static constexpr size_t MAX_PAYLOAD = 1UL << 20; /* Matches main.c */
+
+struct Settings {
+	std::string main_file;
+	std::string storage_file;
+	std::string output_file;
+	std::vector<std::string> mechanisms = MECHANISMS;
+	std::vector<size_t> payload_sizes { 0, 64, 4096, 65536 };
+	size_t samples = 1000;
+	uint64_t max_mem = 64ULL << 20;
+	uint32_t max_cow_mem = 16ULL << 20;
+};
+
+static long monotonic_now()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+static long measure(const std::function<void()>& func)
+{
+	asm("" : : : "memory");
+	const long t0 = monotonic_now();
+	asm("" : : : "memory");
+	func();
+	asm("" : : : "memory");
+	const long t1 = monotonic_now();
+	asm("" : : : "memory");
+	return t1 - t0;
+}
+
+static void usage(const char* program)
+{
+	fprintf(stderr,
+		"Usage: %s [options] main.elf storage.elf\n"
+		"  --samples N           Samples per measurement (default 1000)\n"
+		"  --memory MB           Guest main memory (default 64)\n"
+		"  --cow-memory MB       Guest copy-on-write memory (default 16)\n"
+		"  --mechanisms A,B,...  Mechanisms to measure (default all)\n"
+		"  --payload-sizes A,... Payload sizes in bytes (default 0,64,4096,65536)\n"
+		"  --output FILE         Write the JSON results to a file\n"
+		"Mechanisms:", program);
+	for (const auto& mechanism : MECHANISMS)
+		fprintf(stderr, " %s", mechanism.c_str());
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static std::vector<std::string> split(const std::string& list)
+{
+	std::vector<std::string> result;
+	size_t begin = 0;
+	while (begin <= list.size()) {
+		const size_t end = std::min(list.find(',', begin), list.size());
+		if (end > begin)
+			result.push_back(list.substr(begin, end - begin));
+		begin = end + 1;
+	}
+	return result;
+}
+
+static Settings parse_arguments(int argc, char** argv)
+{
+	Settings settings;
+	std::vector<std::string> files;
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+		auto value = [&] () -> std::string {
+			if (i + 1 >= argc) usage(argv[0]);
+			return argv[++i];
+		};
+		if (arg == "--samples") {
+			settings.samples = std::max(1ul, std::stoul(value()));
+		} else if (arg == "--memory") {
+			settings.max_mem = std::stoull(value()) << 20;
+		} else if (arg == "--cow-memory") {
+			settings.max_cow_mem = std::stoul(value()) << 20;
+		} else if (arg == "--mechanisms") {
+			settings.mechanisms = split(value());
+			for (const auto& mechanism : settings.mechanisms) {
+				if (std::find(MECHANISMS.begin(), MECHANISMS.end(), mechanism) == MECHANISMS.end()) {
+					fprintf(stderr, "Unknown mechanism: %s\n", mechanism.c_str());
+					usage(argv[0]);
+				}
+			}
+		} else if (arg == "--payload-sizes") {
+			settings.payload_sizes.clear();
+			for (const auto& size : split(value())) {
+				settings.payload_sizes.push_back(std::stoul(size));
+				if (settings.payload_sizes.back() > MAX_PAYLOAD) {
+					fprintf(stderr, "Payload size %s is larger than %zu\n", size.c_str(), MAX_PAYLOAD);
+					usage(argv[0]);
+				}
+			}
+			if (settings.payload_sizes.empty())
+				usage(argv[0]);
+		} else if (arg == "--output") {
+			settings.output_file = value();
+		} else if (arg.size() > 2 && arg.compare(0, 2, "--") == 0) {
+			usage(argv[0]);
+		} else {
+			files.push_back(arg);
+		}
+	}
+	if (files.size() != 2)
+		usage(argv[0]);
+	settings.main_file = files[0];
+	settings.storage_file = files[1];
+	return settings;
+}
+
+struct Benchmark {
+	Settings settings;
+	std::vector<uint8_t> main_binary;
+	std::vector<uint8_t> storage_binary;
+	tinykvm::MachineOptions options;
+	std::unique_ptr<tinykvm::Machine> storage;
+	std::unique_ptr<tinykvm::Machine> master;
+
+	/* The storage VM runs main() until it pauses, waiting for work */
+	void new_storage()
+	{
+		storage = std::make_unique<tinykvm::Machine>(storage_binary, tinykvm::MachineOptions {
+			.max_mem = settings.max_mem,
+			.vmem_base_address = STORAGE_BASE,
+		});
+		storage->setup_linux({"storage"}, ENV);
+		storage->run(4.0f);
+		storage->registers().rip += 2; // Skip OUT instruction
+	}
+	/* A master VM connected to the storage VM, ready for forking */
+	void new_master()
+	{
+		master = std::make_unique<tinykvm::Machine>(main_binary, options);
+		master->setup_linux({"main"}, ENV);
+		master->run(4.0f);
+		master->remote_connect(*storage);
+		master->set_remote_allow_page_faults(true);
+		master->prepare_copy_on_write();
+	}
+	/* Start over with a storage VM that is paused, waiting for work */
+	void restart()
+	{
+		master.reset();
+		storage.reset();
+		new_storage();
+		new_master();
+	}
+	std::unique_ptr<tinykvm::Machine> new_fork() const
+	{
+		auto vm = std::make_unique<tinykvm::Machine>(*master, options);
+		vm->set_remote_allow_page_faults(true);
+		return vm;
+	}
+	std::vector<long> run(const std::string& mechanism, size_t payload);
+};
+
+std::vector<long> Benchmark::run(const std::string& mechanism, size_t payload)
+{
+	const size_t N = settings.samples;
+	std::vector<long> samples;
+	samples.reserve(N);
+	auto sample = [&] (const std::function<void()>& func) {
+		/* Warm up page tables and caches before measuring */
+		for (size_t i = 0; i < std::min(N, size_t(10)); i++)
+			func();
+		for (size_t i = 0; i < N; i++)
+			samples.push_back(measure(func));
+	};
+
+	auto vm = new_fork();
+	const uint64_t payload_addr = vm->address_of("payload");
+	const uint64_t checksum_addr = storage->address_of("remote_checksum");
+
+	if (mechanism == "vmcall") {
+		/* The baseline: a local call that never enters the remote */
+		const uint64_t addr = vm->address_of("bench_nothing");
+		sample([&] {
+			vm->timed_vmcall(addr, 4.0f, payload);
+		});
+	}
+	else if (mechanism == "pagefault") {
+		/* remote_connect(): The remote is entered on a page fault */
+		const uint64_t addr = vm->address_of("bench_call");
+		sample([&] {
+			vm->timed_vmcall(addr, 4.0f, payload);
+		});
+	}
+	else if (mechanism == "permanent") {
+		/* permanent_remote_connect(): The storage VM is permanently
+		   connected back to this VM, and is entered on a page fault */
+		vm->permanent_remote_connect(*storage);
+		const uint64_t addr = vm->address_of("bench_call");
+		sample([&] {
+			vm->timed_vmcall(addr, 4.0f, payload);
+		});
+		/* The storage VM is now connected to this fork, which is
+		   about to be destroyed */
+		vm.reset();
+		restart();
+	}
+	else if (mechanism == "ipre_resume") {
+		/* ipre_remote_resume_now(): The paused storage VM resumes
+		   on this vCPU, see the syscall handler in main() */
+		const uint64_t addr = vm->address_of("bench_resume");
+		sample([&] {
+			vm->timed_vmcall(addr, 4.0f, payload);
+		});
+	}
+	else if (mechanism == "session") {
+		/* One host-driven remote session per call */
+		sample([&] {
+			vm->remote_session_begin();
+			vm->remote_session_call(checksum_addr, payload_addr, payload);
+			vm->remote_session_end();
+		});
+	}
+	else if (mechanism == "session_call") {
+		/* Calls within one long-lived remote session */
+		vm->remote_session_begin();
+		sample([&] {
+			vm->remote_session_call(checksum_addr, payload_addr, payload);
+		});
+		vm->remote_session_end();
+	}
+	else if (mechanism == "connect") {
+		/* Connecting when the remote gigapage entries are up to date */
+		sample([&] {
+			vm->remote_connect(*storage, true);
+		});
+	}
+	else if (mechanism == "gigapage_update") {
+		/* Connecting after the remote page tables have changed, which
+		   republishes the remote gigapage entries and copies them */
+		sample([&] {
+			storage->main_memory().remote_must_update_gigapages = true;
+			vm->remote_connect(*storage, true);
+		});
+	}
+	return samples;
+}
+
+static long percentile(const std::vector<long>& sorted, double p)
+{
+	const size_t idx = std::min(sorted.size() - 1, size_t(p / 100.0 * sorted.size()));
+	return sorted[idx];
+}
+
+int main(int argc, char** argv)
+{
+	Benchmark bench;
+	bench.settings = parse_arguments(argc, argv);
+	auto& settings = bench.settings;
+	bench.main_binary = load_file(settings.main_file);
+	bench.storage_binary = load_file(settings.storage_file);
+	bench.options = tinykvm::MachineOptions {
+		.max_mem = settings.max_mem,
+		.max_cow_mem = settings.max_cow_mem,
+		.split_hugepages = true,
+	};
+
+	tinykvm::Machine::init();
+	tinykvm::Machine::install_unhandled_syscall_handler(
+	[] (tinykvm::vCPU& cpu, unsigned scall) {
+		switch (scall) {
+		case 0x10001: { // remote_resume(data, len)
+			const uint64_t data = cpu.registers().rdi;
+			const uint64_t len  = cpu.registers().rsi;
+			cpu.machine().ipre_remote_resume_now(false,
+			[data, len] (tinykvm::Machine& m) {
+				m.copy_to_guest(m.registers().rdi, &data, sizeof(data));
+				m.registers().rax = len;
+			});
+			return;
+		}
+		case 0x10002: // storage_wait_paused(data, result)
+			cpu.stop();
+			return;
+		}
+		auto& regs = cpu.registers();
+		regs.rax = -ENOSYS;
+		cpu.set_registers(regs);
+	});
+	bench.restart();
+	if (bench.master->address_of("payload") == 0x0 ||
+		bench.storage->address_of("remote_checksum") == 0x0) {
+		fprintf(stderr, "Error: Build the guests in guest/remotebench\n");
+		exit(1);
+	}
+
+	FILE* out = stdout;
+	if (!settings.output_file.empty()) {
+		out = fopen(settings.output_file.c_str(), "w");
+		if (out == nullptr) {
+			fprintf(stderr, "Error: Could not open %s\n", settings.output_file.c_str());
+			exit(1);
+		}
+	}
+	fprintf(out, "{\n\t\"main\": \"%s\",\n\t\"storage\": \"%s\",\n\t\"samples\": %zu,\n\t\"results\": {",
+		settings.main_file.c_str(), settings.storage_file.c_str(), settings.samples);
+	for (size_t i = 0; i < settings.mechanisms.size(); i++)
+	{
+		const auto& mechanism = settings.mechanisms[i];
+		fprintf(out, "%s\n\t\t\"%s\": {", (i > 0) ? "," : "", mechanism.c_str());
+		const auto payload_sizes = uses_payload(mechanism)
+			? settings.payload_sizes : std::vector<size_t>{ 0 };
+		for (size_t j = 0; j < payload_sizes.size(); j++)
+		{
+			const size_t payload = payload_sizes[j];
+			fprintf(out, "%s\n\t\t\t\"%zu\": ", (j > 0) ? "," : "", payload);
+			std::vector<long> samples;
+			try {
+				samples = bench.run(mechanism, payload);
+			} catch (const std::exception& e) {
+				/* Report the failure, and keep measuring the others */
+				fprintf(out, "{ \"error\": \"%s\" }", e.what());
+				fflush(out);
+				bench.restart();
+				continue;
+			}
+			std::sort(samples.begin(), samples.end());
+			long total = 0;
+			for (const long sample : samples)
+				total += sample;
+			fprintf(out, "{ \"min\": %ld, \"mean\": %ld, \"p50\": %ld, \"p90\": %ld, \"p99\": %ld, \"max\": %ld }",
+				samples.front(), total / long(samples.size()),
+				percentile(samples, 50), percentile(samples, 90), percentile(samples, 99),
+				samples.back());
+			fflush(out);
+		}
+		fprintf(out, "\n\t\t}");
+	}
+	fprintf(out, "\n\t}\n}\n");
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
@@ -0,0 +1,259 @@
+#include <tinykvm/machine.hpp>
+#include <tinykvm/smp.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <vector>
+#include "load_file.hpp"
+
+/* STREAM memory bandwidth under each memory mode. The STREAM kernels
+   run in guest/STREAM/stream_tinykvm.c, on one vCPU or split across
+   SMP vCPUs, and are timed from the host. As with STREAM, the best of
+   all but the first iteration is reported, in GB/s, as JSON.
+
+   streambench [options] stream_tinykvm.elf
+*/
+static const std::vector<std::string> MODES {
+	"plain", "hugepages", "transparent_hugepages", "cow_fork", "master_direct",
+};
+static const std::vector<std::string> ENV {
+	"LC_TYPE=C", "LC_ALL=C", "USER=root"
+};
+static const char* KERNELS[] { "copy", "scale", "add", "triad" };
+/* Arrays read and written by each kernel */
+static constexpr unsigned KERNEL_ARRAYS[] { 2, 2, 3, 3 };
+static constexpr size_t MAX_TASKS = 64; /* Matches stream_tinykvm.c */
+static constexpr uint32_t SMP_STACK_SIZE = 0x10000;
+static constexpr float TIMEOUT = 30.0f;
+
+struct Settings {
+	std::string binary_file;
+	std::string output_file;
+	std::vector<std::string> modes = MODES;
+	std::vector<size_t> cpus { 1, 4 };
+	size_t ntimes = 10;
+	uint64_t max_mem = 512ULL << 20;
+};
+
+static long monotonic_now()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+static void usage(const char* program)
+{
+	fprintf(stderr,
+		"Usage: %s [options] stream_tinykvm.elf\n"
+		"  --ntimes N        Iterations of each kernel (default 10)\n"
+		"  --memory MB       Guest main memory (default 512)\n"
+		"  --cpus A,B,...    vCPU counts, 1 is a plain vmcall (default 1,4)\n"
+		"  --modes A,B,...   Memory modes to measure (default all)\n"
+		"  --output FILE     Write the JSON results to a file\n"
+		"Modes:", program);
+	for (const auto& mode : MODES)
+		fprintf(stderr, " %s", mode.c_str());
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static std::vector<std::string> split(const std::string& list)
+{
+	std::vector<std::string> result;
+	size_t begin = 0;
+	while (begin <= list.size()) {
+		const size_t end = std::min(list.find(',', begin), list.size());
+		if (end > begin)
+			result.push_back(list.substr(begin, end - begin));
+		begin = end + 1;
+	}
+	return result;
+}
+
+static Settings parse_arguments(int argc, char** argv)
+{
+	Settings settings;
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+		auto value = [&] () -> std::string {
+			if (i + 1 >= argc) usage(argv[0]);
+			return argv[++i];
+		};
+		if (arg == "--ntimes") {
+			settings.ntimes = std::max(2ul, std::stoul(value()));
+		} else if (arg == "--memory") {
+			settings.max_mem = std::stoull(value()) << 20;
+		} else if (arg == "--cpus") {
+			settings.cpus.clear();
+			for (const auto& cpus : split(value())) {
+				settings.cpus.push_back(std::stoul(cpus));
+				if (settings.cpus.back() == 0 || settings.cpus.back() > MAX_TASKS) {
+					fprintf(stderr, "vCPU count must be between 1 and %zu\n", MAX_TASKS);
+					usage(argv[0]);
+				}
+			}
+			if (settings.cpus.empty())
+				usage(argv[0]);
+		} else if (arg == "--modes") {
+			settings.modes = split(value());
+			for (const auto& mode : settings.modes) {
+				if (std::find(MODES.begin(), MODES.end(), mode) == MODES.end()) {
+					fprintf(stderr, "Unknown mode: %s\n", mode.c_str());
+					usage(argv[0]);
+				}
+			}
+		} else if (arg == "--output") {
+			settings.output_file = value();
+		} else if (arg.size() > 2 && arg.compare(0, 2, "--") == 0) {
+			usage(argv[0]);
+		} else {
+			settings.binary_file = arg;
+		}
+	}
+	if (settings.binary_file.empty())
+		usage(argv[0]);
+	return settings;
+}
+
+struct Benchmark {
+	Settings settings;
+	std::vector<uint8_t> binary;
+
+	/* Best bandwidth of each kernel, in GB/s */
+	struct Result {
+		double gbps[4] {};
+	};
+	std::vector<Result> run(const std::string& mode);
+};
+
+std::vector<Benchmark::Result> Benchmark::run(const std::string& mode)
+{
+	tinykvm::MachineOptions options {
+		.max_mem = settings.max_mem,
+		.max_cow_mem = uint32_t(std::min(settings.max_mem, uint64_t(UINT32_MAX))),
+	};
+	options.hugepages = (mode == "hugepages");
+	options.transparent_hugepages = (mode == "transparent_hugepages");
+	options.master_direct_memory_writes = (mode == "master_direct");
+
+	/* main() initializes the arrays in the master */
+	auto master = std::make_unique<tinykvm::Machine>(binary, options);
+	master->set_printer([] (const char*, size_t) {});
+	master->setup_linux({"stream"}, ENV);
+	master->run(TIMEOUT);
+
+	std::unique_ptr<tinykvm::Machine> fork;
+	tinykvm::Machine* vm = master.get();
+	if (mode == "cow_fork" || mode == "master_direct") {
+		master->prepare_copy_on_write();
+	}
+	if (mode == "cow_fork") {
+		/* The first iteration copies the arrays into the fork */
+		fork = std::make_unique<tinykvm::Machine>(*master, options);
+		vm = fork.get();
+	}
+
+	vm->timed_vmcall(vm->address_of("stream_elements"), TIMEOUT);
+	const size_t elements = vm->return_value();
+	const uint64_t kernel_addr = vm->address_of("stream_kernel");
+	const uint64_t slice_addr = vm->address_of("stream_slice");
+	const uint64_t tasks_addr = vm->address_of("stream_tasks");
+	const size_t max_cpus = *std::max_element(settings.cpus.begin(), settings.cpus.end());
+	const uint64_t stacks = vm->mmap_allocate(max_cpus * SMP_STACK_SIZE);
+
+	std::vector<Result> results;
+	for (const size_t cpus : settings.cpus)
+	{
+		Result result;
+		for (size_t n = 0; n < settings.ntimes; n++)
+		for (unsigned k = 0; k < 4; k++)
+		{
+			long t0, t1;
+			if (cpus == 1) {
+				t0 = monotonic_now();
+				vm->timed_vmcall(kernel_addr, TIMEOUT, k);
+				t1 = monotonic_now();
+			} else {
+				/* Each vCPU takes one slice of the arrays */
+				struct { uint32_t kernel, slices; } tasks[MAX_TASKS];
+				for (size_t i = 0; i < cpus; i++)
+					tasks[i] = { k, uint32_t(cpus) };
+				vm->copy_to_guest(tasks_addr, tasks, cpus * sizeof(tasks[0]));
+				t0 = monotonic_now();
+				vm->smp().timed_smpcall_dynamic(cpus, stacks, SMP_STACK_SIZE,
+					slice_addr, TIMEOUT, tasks_addr, sizeof(tasks[0]), cpus);
+				vm->smp_wait();
+				t1 = monotonic_now();
+			}
+			/* The first iteration warms up, and faults in pages */
+			if (n == 0)
+				continue;
+			const double bytes = double(KERNEL_ARRAYS[k]) * sizeof(double) * elements;
+			result.gbps[k] = std::max(result.gbps[k], bytes / double(t1 - t0));
+		}
+		results.push_back(result);
+	}
+	return results;
+}
+
+int main(int argc, char** argv)
+{
+	Benchmark bench;
+	bench.settings = parse_arguments(argc, argv);
+	auto& settings = bench.settings;
+	bench.binary = load_file(settings.binary_file);
+
+	tinykvm::Machine::init();
+	{
+		tinykvm::Machine vm { bench.binary, { .max_mem = settings.max_mem } };
+		if (vm.address_of("stream_slice") == 0x0) {
+			fprintf(stderr, "Error: Build stream_tinykvm in guest/STREAM\n");
+			exit(1);
+		}
+	}
+
+	FILE* out = stdout;
+	if (!settings.output_file.empty()) {
+		out = fopen(settings.output_file.c_str(), "w");
+		if (out == nullptr) {
+			fprintf(stderr, "Error: Could not open %s\n", settings.output_file.c_str());
+			exit(1);
+		}
+	}
+	fprintf(out, "{\n\t\"binary\": \"%s\",\n\t\"ntimes\": %zu,\n\t\"max_mem\": %lu,\n\t\"results\": {",
+		settings.binary_file.c_str(), settings.ntimes, settings.max_mem);
+	for (size_t i = 0; i < settings.modes.size(); i++)
+	{
+		const auto& mode = settings.modes[i];
+		fprintf(out, "%s\n\t\t\"%s\": ", (i > 0) ? "," : "", mode.c_str());
+		std::vector<Benchmark::Result> results;
+		try {
+			results = bench.run(mode);
+		} catch (const std::exception& e) {
+			/* Eg. no hugepages reserved. Keep measuring the others. */
+			fprintf(out, "{ \"error\": \"%s\" }", e.what());
+			fflush(out);
+			continue;
+		}
+		fprintf(out, "{");
+		for (size_t j = 0; j < results.size(); j++)
+		{
+			fprintf(out, "%s\n\t\t\t\"vcpus_%zu\": {", (j > 0) ? "," : "", settings.cpus[j]);
+			for (unsigned k = 0; k < 4; k++) {
+				fprintf(out, "%s \"%s\": %.2f", (k > 0) ? "," : "", KERNELS[k], results[j].gbps[k]);
+			}
+			fprintf(out, " }");
+		}
+		fprintf(out, "\n\t\t}");
+		fflush(out);
+	}
+	fprintf(out, "\n\t}\n}\n");
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
@@ -0,0 +1,23 @@
+#include <tinykvm/syscall_trace.hpp>
+#include <cstdio>
+
+/* Decode a system call trace written by SyscallTrace::dump() */
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s [trace file]\n", argv[0]);
+		return 1;
+	}
+	FILE* fp = fopen(argv[1], "rb");
+	if (fp == nullptr) {
+		fprintf(stderr, "Could not open %s\n", argv[1]);
+		return 1;
+	}
+	const long records = tinykvm::SyscallTrace::decode(fp, stdout);
+	fclose(fp);
+	if (records < 0) {
+		fprintf(stderr, "%s: Not a system call trace, or truncated\n", argv[1]);
+		return 1;
+	}
+	return 0;
+}
@@ -1,8 +1,47 @@
 #include <catch2/catch_test_macros.hpp>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/kvm.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <tinykvm/channel.hpp>
+#include <tinykvm/co_vmcall.hpp>
+#include <tinykvm/file_mapping_cache.hpp>
+#include <tinykvm/kvm_pool.hpp>
 #include <tinykvm/machine.hpp>
+#include <tinykvm/page_dedup.hpp>
+#include <tinykvm/page_streaming.hpp>
+#include <tinykvm/pipeline.hpp>
+#include <tinykvm/program_image.hpp>
+#include <tinykvm/shared_data.hpp>
+#include <tinykvm/linux/epoll_reactor.hpp>
+#include <tinykvm/linux/path_cache.hpp>
+#include <tinykvm/linux/threads.hpp>
+#include <tinykvm/linux/vfs.hpp>
+#include <tinykvm/smp.hpp>
+#include <tinykvm/snapshot_restore.hpp>
+#include <tinykvm/symbol_index.hpp>
+#include <tinykvm/vm_function.hpp>
+#include <tinykvm/util/threadpool.h>
+#include <tinykvm/util/command_slot.hpp>
 extern std::vector<uint8_t> build_and_load(const std::string& code);
+extern std::pair<std::string, std::vector<uint8_t>> build_and_load(const std::string& code, const std::string& args);
+extern std::vector<uint8_t> build_and_load_guest_api(const std::string& code);
 static const uint64_t MAX_MEMORY = 8ul << 20; /* 8MB */
+static const uint64_t MAX_COWMEM = 1ul << 20; /* 1MB */
 static const std::vector<std::string> env {
 	"LC_TYPE=C", "LC_ALL=C", "USER=root"
 };
@@ -27,6 +66,33 @@ int main() {
 	REQUIRE(machine.stack_address() > machine.start_address());
 }
 
+TEST_CASE("Skip unchanged special registers", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 666;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	auto sregs = machine.get_special_registers();
+	const auto updates = machine.cpu().sregs_updates;
+	const auto skipped = machine.cpu().sregs_skipped;
+
+	// Setting the same registers again is a no-op
+	machine.set_special_registers(sregs);
+	REQUIRE(machine.cpu().sregs_skipped == skipped + 1);
+	REQUIRE(machine.cpu().sregs_updates == updates);
+
+	// A changed register is handed to KVM, and so is changing it back
+	const auto fs_base = sregs.fs.base;
+	sregs.fs.base = 0x1000;
+	machine.set_special_registers(sregs);
+	sregs.fs.base = fs_base;
+	machine.set_special_registers(sregs);
+	REQUIRE(machine.cpu().sregs_updates == updates + 2);
+	REQUIRE(machine.get_special_registers().fs.base == fs_base);
+}
+
 TEST_CASE("Runtime setup and execution", "[Output]")
 {
 	const auto binary = build_and_load(R"M(
@@ -46,6 +112,57 @@ int main(int argc, char** argv) {
 	REQUIRE(machine.return_value() == 666);
 }
 
+TEST_CASE("Map read-only segments from the binary file", "[Output]")
+{
+	const auto [filename, binary] = build_and_load(R"M(
+#include <string.h>
+static const char text[8192] = "Hello from a read-only segment";
+int main() {
+	return strcmp(text, "Hello from a read-only segment") == 0 ? 666 : -1;
+})M", "");
+
+	tinykvm::Machine machine { binary, {
+		.max_mem = MAX_MEMORY,
+		.binary_file = filename,
+	} };
+	machine.setup_linux({"program"}, env);
+	machine.run(2.0f);
+
+	REQUIRE(machine.return_value() == 666);
+}
+
+TEST_CASE("Grow brk by a large step", "[Output]")
+{
+	const auto binary = build_and_load(R"M(
+#define _DEFAULT_SOURCE
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+int main() {
+	char* begin = (char*)syscall(SYS_brk, 0);
+	char* end = (char*)syscall(SYS_brk, begin + (4 << 20));
+	if (end != begin + (4 << 20))
+		return 1;
+	memset(begin, 'x', 4 << 20);
+	return 666;
+})M");
+	const uint64_t GUEST_MEMORY = 32ULL << 20; /* 32MB */
+	{
+		// The default brk area is too small, and brk() is clamped
+		tinykvm::Machine machine { binary, { .max_mem = GUEST_MEMORY } };
+		REQUIRE(machine.brk_end_address() - machine.brk_begin_address() < (4ULL << 20));
+		machine.setup_linux({"brk"}, env);
+		machine.run(2.0f);
+		REQUIRE(machine.return_value() == 1);
+	}
+	tinykvm::Machine machine { binary, { .max_mem = GUEST_MEMORY, .brk_size = 8ULL << 20 } };
+	REQUIRE(machine.brk_end_address() - machine.brk_begin_address() >= (8ULL << 20));
+	REQUIRE(machine.mmap_start() >= machine.brk_end_address());
+	machine.setup_linux({"brk"}, env);
+	machine.run(2.0f);
+	REQUIRE(machine.return_value() == 666);
+}
+
 TEST_CASE("Execution timeout", "[Output]")
 {
 	const auto binary = build_and_load(R"M(
@@ -86,3 +203,2737 @@ int main() {
 	// and the data matched 'Hello World!'.
 	REQUIRE(output_is_hello_world);
 }
+
+TEST_CASE("Read the clock through the vDSO", "[Output]")
+{
+	const auto binary = build_and_load(R"M(
+#define _POSIX_C_SOURCE 199309L
+#include <sys/auxv.h>
+#include <sys/time.h>
+#include <time.h>
+int main() {
+	struct timeval tv;
+	if (gettimeofday(&tv, NULL) != 0 || tv.tv_sec < 1600000000)
+		return 2;
+	struct timespec ts1, ts2;
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+	for (int i = 0; i < 100; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &ts2);
+		if (ts2.tv_sec < ts1.tv_sec || (ts2.tv_sec == ts1.tv_sec && ts2.tv_nsec < ts1.tv_nsec))
+			return 3;
+		ts1 = ts2;
+	}
+	if (time(NULL) < tv.tv_sec)
+		return 4;
+	return (getauxval(AT_SYSINFO_EHDR) != 0) ? 666 : 667;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY, .vdso = true } };
+	machine.setup_linux({"vdso"}, env);
+	machine.run(2.0f);
+	REQUIRE(machine.return_value() == 666);
+
+	// The same program without a vDSO reads the clock with system calls
+	tinykvm::Machine baseline { binary, { .max_mem = MAX_MEMORY } };
+	baseline.setup_linux({"vdso"}, env);
+	baseline.run(2.0f);
+	REQUIRE(baseline.return_value() == 667);
+
+	const auto& exits = machine.exit_counters();
+	const auto& baseline_exits = baseline.exit_counters();
+	REQUIRE(baseline_exits.syscall_count(SYS_clock_gettime) >= 101);
+	REQUIRE(exits.syscall_count(SYS_clock_gettime) < 10);
+	REQUIRE(exits.syscalls + 90 < baseline_exits.syscalls);
+	REQUIRE(exits.total < baseline_exits.total);
+}
+
+TEST_CASE("Submit a batch of system calls", "[Output]")
+{
+	std::string output;
+	const auto binary = build_and_load_guest_api(R"M(
+#include "api.hpp"
+#include <sys/syscall.h>
+int main() {
+	kvm_syscall_batch<4> batch;
+	auto* hello = batch.push(SYS_write, 1, (uint64_t)"Hello ", 6);
+	auto* world = batch.push(SYS_write, 1, (uint64_t)"World!", 6);
+	batch.push(SYS_getpid);
+	auto* exit = batch.push(SYS_exit, 1);
+	if (batch.push(SYS_getpid) != nullptr) // The ring is full
+		return 1;
+	if (batch.submit() != 4 || batch.head != 4)
+		return 2;
+	if (hello->result != 6 || world->result != 6)
+		return 3;
+	if (exit->result != -38) // Not batchable: -ENOSYS
+		return 4;
+	return 666;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"batch"}, env);
+	machine.set_printer([&] (const char* data, size_t size) {
+		output.append(data, size);
+	});
+	machine.run(4.0f);
+
+	REQUIRE(output == "Hello World!");
+	REQUIRE(machine.return_value() == 666);
+}
+
+TEST_CASE("Submit writes through io_uring", "[Output]")
+{
+	std::string output;
+	const auto binary = build_and_load(R"M(
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+int main() {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	const int fd = syscall(SYS_io_uring_setup, 4, &p);
+	if (fd < 0 || p.sq_entries != 4 || !(p.features & IORING_FEAT_SINGLE_MMAP))
+		return 1;
+	char* ring = mmap(NULL, p.sq_off.array + 4 * sizeof(uint32_t),
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQ_RING);
+	struct io_uring_sqe* sqes = mmap(NULL, 4 * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQES);
+	if (ring == MAP_FAILED || sqes == MAP_FAILED)
+		return 2;
+	uint32_t* sq_tail = (uint32_t *)(ring + p.sq_off.tail);
+	uint32_t* sq_array = (uint32_t *)(ring + p.sq_off.array);
+	uint32_t* cq_tail = (uint32_t *)(ring + p.cq_off.tail);
+	struct io_uring_cqe* cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+	static struct iovec iov = { "World!", 6 };
+	memset(sqes, 0, 3 * sizeof(struct io_uring_sqe));
+	sqes[0].opcode = IORING_OP_WRITE;
+	sqes[0].fd = 1;
+	sqes[0].addr = (uintptr_t)"Hello ";
+	sqes[0].len = 6;
+	sqes[0].off = -1;
+	sqes[0].user_data = 1;
+	sqes[1].opcode = IORING_OP_WRITEV;
+	sqes[1].fd = 1;
+	sqes[1].addr = (uintptr_t)&iov;
+	sqes[1].len = 1;
+	sqes[1].off = -1;
+	sqes[1].user_data = 2;
+	sqes[2].opcode = 0xFF; /* Invalid */
+	sqes[2].user_data = 3;
+	for (int i = 0; i < 3; i++)
+		sq_array[i] = i;
+	*sq_tail = 3;
+
+	if (syscall(SYS_io_uring_enter, fd, 3, 3, IORING_ENTER_GETEVENTS, NULL, 0) != 3)
+		return 3;
+	if (*cq_tail != 3)
+		return 4;
+	if (cqes[0].user_data != 1 || cqes[0].res != 6 || cqes[1].res != 6)
+		return 5;
+	if (cqes[2].user_data != 3 || cqes[2].res != -22) /* -EINVAL */
+		return 6;
+	return 666;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"io_uring"}, env);
+	machine.set_printer([&] (const char* data, size_t size) {
+		output.append(data, size);
+	});
+	machine.run(4.0f);
+
+	REQUIRE(output == "Hello World!");
+	REQUIRE(machine.return_value() == 666);
+}
+
+static void restricted_write(tinykvm::vCPU& cpu)
+{
+	auto& regs = cpu.registers();
+	regs.rax = 1234; // A restricted tenant never writes
+	cpu.set_registers(regs);
+}
+static void restricted_exit(tinykvm::vCPU& cpu)
+{
+	cpu.stop();
+}
+static void restricted_unhandled(tinykvm::vCPU& cpu, unsigned)
+{
+	auto& regs = cpu.registers();
+	regs.rax = -ENOSYS;
+	cpu.set_registers(regs);
+}
+static constexpr auto restricted_table = tinykvm::Machine::SyscallTable::make({
+	{ SYS_write, restricted_write },
+	{ SYS_exit, restricted_exit },
+	{ SYS_exit_group, restricted_exit },
+}, restricted_unhandled);
+static_assert(restricted_table.handlers[SYS_write] == restricted_write);
+static_assert(restricted_table.handlers[SYS_read] == nullptr);
+
+TEST_CASE("Per-machine system call table", "[Output]")
+{
+	const auto binary = build_and_load(R"M(
+#include <unistd.h>
+#include <sys/syscall.h>
+int main() {
+	return 0;
+}
+extern long do_write() {
+	return syscall(SYS_write, 1, "Hello World!", 12);
+}
+extern long do_getpid() {
+	return syscall(SYS_getpid);
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"table"}, env);
+	machine.run(4.0f);
+	machine.prepare_copy_on_write();
+
+	bool printed = false;
+	machine.set_printer([&] (const char*, size_t) {
+		printed = true;
+	});
+	// Forks inherit the table of the master, at the time of forking
+	machine.set_syscall_table(&restricted_table);
+	tinykvm::Machine fork { machine, { .max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM } };
+	REQUIRE(fork.syscall_table() == &restricted_table);
+
+	fork.timed_vmcall(fork.address_of("do_write"), 4.0f);
+	REQUIRE(fork.return_value() == 1234);
+	REQUIRE(!printed);
+	fork.timed_vmcall(fork.address_of("do_getpid"), 4.0f);
+	REQUIRE(fork.return_value() == -ENOSYS);
+
+	// A run-time table derived from the process-wide handlers
+	static auto derived_table = tinykvm::Machine::SyscallTable::from_global();
+	derived_table.remove(SYS_getpid);
+	fork.set_syscall_table(&derived_table);
+	fork.timed_vmcall(fork.address_of("do_write"), 4.0f);
+	REQUIRE(fork.return_value() == 12);
+	REQUIRE(printed);
+	fork.timed_vmcall(fork.address_of("do_getpid"), 4.0f);
+	REQUIRE(fork.return_value() < 0);
+}
+
+TEST_CASE("Typed vmcall arguments", "[Output]")
+{
+	const auto binary = build_and_load(R"M(
+#include <stddef.h>
+#include <string.h>
+struct header { int status; char name[12]; };
+int main() {
+	return 0;
+}
+extern long on_request(const char* path, size_t path_len,
+	const int* values, size_t count, const struct header* hdr, int factor)
+{
+	long sum = 0;
+	for (size_t i = 0; i < count; i++)
+		sum += values[i];
+	if (strlen(path) != path_len || strcmp(hdr->name, "tinykvm") != 0)
+		return -1;
+	return (path_len + sum + hdr->status) * factor;
+})M");
+	struct header { int status; char name[12]; };
+	using OnRequest = long(std::string_view, std::span<const int>, const header*, int);
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"typed"}, env);
+	machine.run(4.0f);
+
+	const tinykvm::VMFunction<OnRequest> on_request { machine, "on_request" };
+	REQUIRE(on_request);
+	REQUIRE(on_request.address() == machine.address_of("on_request"));
+
+	/* The path is not zero-terminated on the host */
+	const std::string_view path = std::string_view("/index.html?q=1").substr(0, 11);
+	const int values[] { 1, 2, 3, 4 };
+	const header hdr { .status = 200, .name = "tinykvm" };
+	REQUIRE(on_request(machine, path, values, &hdr, 2) == (11 + 10 + 200) * 2);
+	REQUIRE(on_request.call(machine, 4.0f, path, {}, &hdr, 1) == 11 + 200);
+
+	/* By value, the struct is also passed by address */
+	machine.timed_vmcall(on_request.address(), 4.0f,
+		std::string_view("/"), std::span<const int>(values, 1), hdr, 3);
+	REQUIRE(machine.return_value() == (1 + 1 + 200) * 3);
+
+	REQUIRE_THROWS_AS((tinykvm::VMFunction<long()> { machine, "does_not_exist" }),
+		tinykvm::MachineException);
+}
+
+TEST_CASE("Chained vmcalls", "[Output]")
+{
+	const auto binary = build_and_load(R"M(
+static long state = 0;
+int main() {
+	return 0;
+}
+extern long parse(long a, long b) {
+	state = a + b;
+	return state;
+}
+extern long validate(long limit) {
+	return state <= limit;
+}
+extern long render(long a, long b, long c, long d, long e, long f) {
+	return state * 1000 + a + b + c + d + e + f;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"chain"}, env);
+	machine.run(4.0f);
+
+	const std::array<tinykvm::Machine::ChainCall, 3> calls {{
+		{ machine.address_of("parse"), { 40, 2 } },
+		{ machine.address_of("validate"), { 100 } },
+		{ machine.address_of("render"), { 1, 2, 3, 4, 5, 6 } },
+	}};
+	std::array<uint64_t, 3> results {};
+	machine.reset_exit_counters();
+	machine.timed_vmcall_chain(calls, results, 4.0f);
+	REQUIRE(results[0] == 42);
+	REQUIRE(results[1] == 1);
+	REQUIRE(results[2] == 42021);
+	/* The chain ends like a normal vmcall */
+	REQUIRE(machine.return_value() == 42021);
+	/* Only the end of the chain exits the VM */
+	REQUIRE(machine.exit_counters().other == 1);
+
+	/* A single call works like timed_vmcall */
+	machine.timed_vmcall_chain(std::span(calls).subspan(1, 1), results, 4.0f);
+	REQUIRE(results[0] == 1);
+
+	/* Too few results */
+	REQUIRE_THROWS_AS(machine.timed_vmcall_chain(calls,
+		std::span(results).first(2), 4.0f), tinykvm::MachineException);
+}
+
+TEST_CASE("In-process guest backtrace", "[Output]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+}
+__attribute__((noinline))
+void crash_inner(volatile int* ptr) {
+	*ptr = 1;
+}
+__attribute__((noinline))
+extern long crash_outer(long value) {
+	crash_inner((volatile int*)value);
+	return value + 1;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.set_printer([] (const char*, size_t) {});
+	machine.setup_linux({"backtrace"}, env);
+	machine.run(4.0f);
+
+	REQUIRE_THROWS_AS(machine.timed_vmcall(machine.address_of("crash_outer"), 4.0f, 0),
+		tinykvm::MachineException);
+	const auto frames = machine.backtrace_addresses();
+	REQUIRE(frames.size() >= 2);
+	REQUIRE(machine.resolve(frames[0]).find("crash_inner") == 0);
+
+	const std::string bt = machine.backtrace();
+	REQUIRE(bt.find("#0 0x") == 0);
+	REQUIRE(bt.find("in crash_inner + 0x") != std::string::npos);
+	REQUIRE(bt.find("in crash_outer + 0x") != std::string::npos);
+	REQUIRE(machine.backtrace_addresses(1).size() == 1);
+}
+
+TEST_CASE("Per-VM CPU time and exit counts", "[Output]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+}
+extern long spin(long n) {
+	for (volatile long i = 0; i < n; i++);
+	return n;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"program"}, env);
+	machine.run(2.0f);
+	const auto before = machine.cpu_stats();
+	REQUIRE(before.runs >= 1);
+
+	machine.timed_vmcall(machine.address_of("spin"), 2.0f, 10'000'000);
+	const auto after = machine.cpu_stats();
+	REQUIRE(after.runs > before.runs);
+	REQUIRE(after.cpu_time_ns > before.cpu_time_ns);
+	// The KVM counters only ever grow (and are 0 without them)
+	REQUIRE(after.exits >= before.exits);
+	REQUIRE(after.io_exits >= before.io_exits);
+}
+
+TEST_CASE("Per-system-call statistics", "[Output]")
+{
+	const auto binary = build_and_load(R"M(
+#include <unistd.h>
+#include <sys/syscall.h>
+int main() {
+	return 0;
+}
+extern long do_syscalls() {
+	syscall(SYS_getpid);
+	syscall(SYS_getpid);
+	return syscall(SYS_write, 1, "Hello World!", 12);
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"stats"}, env);
+	machine.run(4.0f);
+	machine.set_printer([] (const char*, size_t) {});
+
+	machine.set_syscall_profiling(true);
+	REQUIRE(machine.is_profiling());
+	machine.timed_vmcall(machine.address_of("do_syscalls"), 4.0f);
+	REQUIRE(machine.return_value() == 12);
+
+	const auto& stats = machine.profiling()->syscalls;
+	REQUIRE(stats.at(SYS_getpid).count == 2);
+	REQUIRE(stats.at(SYS_write).count == 1);
+	unsigned visited = 0;
+	machine.profiling()->for_each_syscall([&] (unsigned, const auto& s) {
+		REQUIRE(s.count > 0);
+		visited++;
+	});
+	REQUIRE(visited >= 2);
+
+	machine.set_syscall_profiling(false);
+	REQUIRE(!machine.profiling()->has_syscall_stats());
+}
+
+TEST_CASE("Binary system call trace", "[Output]")
+{
+	using SyscallTrace = tinykvm::SyscallTrace;
+	SyscallTrace ring { 3 };
+	REQUIRE(ring.capacity() == 4);
+	tinykvm::tinykvm_x86regs regs {};
+	for (unsigned i = 0; i < 6; i++) {
+		regs.rdi = i;
+		auto& rec = ring.begin(0, 100 + i, regs);
+		if (i != 5)
+			ring.end(rec, rec.seq, i * 2);
+	}
+	REQUIRE(ring.recorded() == 6);
+	REQUIRE(ring.size() == 4);
+	std::vector<unsigned> numbers;
+	ring.for_each([&] (const SyscallTrace::Record& rec) {
+		REQUIRE(rec.args[0] == rec.nr - 100);
+		numbers.push_back(rec.nr);
+	});
+	REQUIRE(numbers == std::vector<unsigned>{ 102, 103, 104, 105 });
+
+	FILE* dump = tmpfile();
+	REQUIRE(ring.dump(dump));
+	rewind(dump);
+	char* text = nullptr; size_t text_len = 0;
+	FILE* out = open_memstream(&text, &text_len);
+	REQUIRE(SyscallTrace::decode(dump, out) == 4);
+	fclose(out);
+	fclose(dump);
+	const std::string decoded { text, text_len };
+	free(text);
+	REQUIRE(decoded.find("2 older system calls were overwritten") != std::string::npos);
+	REQUIRE(decoded.find("cpu0 104 (0x4, ") != std::string::npos);
+	REQUIRE(decoded.find(" = 0x8 (") != std::string::npos);
+	REQUIRE(decoded.find("cpu0 105 (0x5, ") != std::string::npos);
+	REQUIRE(decoded.find("did not return") != std::string::npos);
+	ring.reset();
+	REQUIRE(ring.size() == 0);
+
+	const auto binary = build_and_load(R"M(
+#include <unistd.h>
+#include <sys/syscall.h>
+int main() {
+	return 0;
+}
+extern long do_syscalls() {
+	syscall(SYS_getpid);
+	return syscall(SYS_write, 1, "Traced", 6);
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"trace"}, env);
+	machine.run(4.0f);
+	machine.set_printer([] (const char*, size_t) {});
+
+	machine.set_syscall_trace(true, 16);
+	REQUIRE(machine.syscall_trace() != nullptr);
+	machine.timed_vmcall(machine.address_of("do_syscalls"), 4.0f);
+	REQUIRE(machine.return_value() == 6);
+
+	bool found_write = false;
+	machine.syscall_trace()->for_each([&] (const SyscallTrace::Record& rec) {
+		if (rec.nr == SYS_write) {
+			REQUIRE(rec.args[0] == 1);
+			REQUIRE(rec.args[2] == 6);
+			REQUIRE(rec.result == 6);
+			REQUIRE(rec.tsc_end >= rec.tsc_start);
+			found_write = true;
+		}
+	});
+	REQUIRE(found_write);
+
+	machine.set_syscall_trace(false);
+	REQUIRE(machine.syscall_trace() == nullptr);
+}
+
+TEST_CASE("Count VM exits by reason", "[Output]")
+{
+	using ExitCounters = tinykvm::ExitCounters;
+	ExitCounters a, b;
+	a.count_syscall(SYS_write);
+	a.count_syscall(SYS_write);
+	a.count_syscall(0x1F714); // Custom system calls share one counter
+	b.count_syscall(SYS_getpid);
+	b.page_faults = 3;
+	b.page_fault_kinds[ExitCounters::PF_COPY_ON_WRITE] = 2;
+	b.page_fault_kinds[ExitCounters::PF_ZERO] = 1;
+	a.merge(b);
+	REQUIRE(a.syscalls == 4);
+	REQUIRE(a.syscall_count(SYS_write) == 2);
+	REQUIRE(a.syscall_count(SYS_getpid) == 1);
+	REQUIRE(a.syscall_count(0x1F777) == 1);
+	REQUIRE(a.page_faults == 3);
+	REQUIRE(a.page_fault_kinds[ExitCounters::PF_COPY_ON_WRITE] == 2);
+	a.reset();
+	REQUIRE(a.syscalls == 0);
+	REQUIRE(a.syscall_count(SYS_write) == 0);
+
+	const auto binary = build_and_load(R"M(
+#include <unistd.h>
+int main() {
+	write(1, "exits\n", 6);
+	return 0;
+})M");
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	REQUIRE(machine.exit_counters().total == 0);
+	machine.setup_linux({"exits"}, env);
+	machine.run(2.0f);
+	const auto& exits = machine.exit_counters();
+	REQUIRE(exits.total > 0);
+	REQUIRE(exits.syscall_count(SYS_write) == 1);
+	REQUIRE(exits.syscall_count(SYS_exit_group) + exits.syscall_count(SYS_exit) == 1);
+	REQUIRE(exits.page_faults == exits.page_fault_kinds[ExitCounters::PF_COPY_ON_WRITE]
+		+ exits.page_fault_kinds[ExitCounters::PF_ZERO]
+		+ exits.page_fault_kinds[ExitCounters::PF_HUGEPAGE]
+		+ exits.page_fault_kinds[ExitCounters::PF_SPLIT_HUGEPAGE]
+		+ exits.page_fault_kinds[ExitCounters::PF_REMOTE]
+		+ exits.page_fault_kinds[ExitCounters::PF_OTHER]);
+	machine.reset_exit_counters();
+	REQUIRE(machine.exit_counters().total == 0);
+}
+
+TEST_CASE("Bounded profiling histograms", "[Instantiate]")
+{
+	using Histogram = tinykvm::MachineProfiling::Histogram;
+	// Bucket boundaries round-trip
+	for (unsigned i = 0; i < Histogram::BUCKETS - 1; i++) {
+		REQUIRE(Histogram::bucket_of(Histogram::value_of(i)) == i);
+	}
+	REQUIRE(Histogram::bucket_of(UINT64_MAX) == Histogram::BUCKETS - 1);
+
+	Histogram a, b;
+	for (uint64_t i = 1; i <= 1000; i++)
+		a.record(i * 1000);
+	REQUIRE(a.count == 1000);
+	REQUIRE(a.min == 1000);
+	REQUIRE(a.max == 1000000);
+	// Within the relative error of a bucket
+	const uint64_t p50 = a.percentile(50.0);
+	REQUIRE(p50 >= 500000 * 7 / 8);
+	REQUIRE(p50 <= 500000);
+	REQUIRE(a.percentile(100.0) <= a.max);
+
+	b.record(5);
+	b.record(2000000);
+	a.merge(b);
+	REQUIRE(a.count == 1002);
+	REQUIRE(a.min == 5);
+	REQUIRE(a.max == 2000000);
+	REQUIRE(a.percentile(0.0) == 5);
+
+	// Histogram mode in a machine, merged across VMs
+	tinykvm::MachineProfiling p1, p2;
+	p1.use_histograms = p2.use_histograms = true;
+	p1.histograms[tinykvm::MachineProfiling::Syscall].record(100);
+	p2.histograms[tinykvm::MachineProfiling::Syscall].record(300);
+	p1.merge(p2);
+	REQUIRE(p1.histograms[tinykvm::MachineProfiling::Syscall].count == 2);
+	REQUIRE(p1.histograms[tinykvm::MachineProfiling::Syscall].total == 400);
+	p1.reset();
+	REQUIRE(p1.histograms[tinykvm::MachineProfiling::Syscall].count == 0);
+
+	// Per-system-call statistics are merged by number
+	p1.enable_syscall_stats();
+	p2.enable_syscall_stats();
+	p1.record_syscall(SYS_write, 100);
+	p2.record_syscall(SYS_write, 3000);
+	p2.record_syscall(TINYKVM_MAX_SYSCALLS, 1); // Out of range: ignored
+	p1.merge(p2);
+	REQUIRE(p1.syscalls[SYS_write].count == 2);
+	REQUIRE(p1.syscalls[SYS_write].total_ns == 3100);
+	REQUIRE(p1.syscalls[SYS_write].max_ns == 3000);
+	REQUIRE(p1.syscalls[SYS_write].log2_buckets[7] == 1);  // 64..127
+	REQUIRE(p1.syscalls[SYS_write].log2_buckets[12] == 1); // 2048..4095
+
+	// The calibrated TSC advances at roughly nanosecond granularity
+	tinykvm::MachineProfiling::calibrate_tsc();
+	const uint64_t t0 = tinykvm::MachineProfiling::tsc();
+	const uint64_t n0 = tinykvm::MachineProfiling::monotonic_ns();
+	while (tinykvm::MachineProfiling::monotonic_ns() - n0 < 2'000'000);
+	const uint64_t elapsed = tinykvm::MachineProfiling::tsc_to_ns(
+		tinykvm::MachineProfiling::tsc() - t0);
+	REQUIRE(elapsed >= 1'000'000);
+	REQUIRE(elapsed <= 20'000'000);
+}
+
+TEST_CASE("Sample guest call stacks for flame graphs", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+__attribute__((noinline)) int compute(int x) {
+	return x * 3;
+}
+int main(int argc, char** argv) {
+	return compute(argc);
+})M");
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.set_sampling_profiler(true, 1000);
+	auto* sampler = machine.sampling_profiler();
+	REQUIRE(sampler != nullptr);
+	REQUIRE(sampler->frequency() == 1000);
+
+	// A stopped vCPU inside compute(), called from main()
+	const uint64_t compute = machine.address_of("compute");
+	const uint64_t main = machine.address_of("main");
+	REQUIRE(compute != 0);
+	REQUIRE(main != 0);
+	const uint64_t fp = machine.stack_address() - 0x1000;
+	const uint64_t frames[4] = { fp + 0x100, main + 4, 0, 0 };
+	machine.copy_to_guest(fp, frames, sizeof(frames));
+	auto regs = machine.registers();
+	regs.rip = compute + 1;
+	regs.rbp = fp;
+	machine.set_registers(regs);
+	sampler->sample(machine.cpu());
+	sampler->sample(machine.cpu());
+	REQUIRE(sampler->samples() == 2);
+	REQUIRE(sampler->unique_stacks() == 1);
+	REQUIRE(sampler->collapsed_stacks(machine) == "main;compute 2\n");
+
+	// Different addresses in the same functions are aggregated
+	const uint64_t other[2] = { compute + 2, main + 4 };
+	sampler->record(other, 2);
+	REQUIRE(sampler->unique_stacks() == 2);
+	REQUIRE(sampler->collapsed_stacks(machine) == "main;compute 3\n");
+
+	// Memory use is bounded by the number of unique stacks
+	sampler->max_stacks = 2;
+	sampler->record(&main, 1);
+	REQUIRE(sampler->dropped_samples() == 1);
+	sampler->reset();
+	REQUIRE(sampler->samples() == 0);
+	REQUIRE(sampler->collapsed_stacks(machine).empty());
+	machine.set_sampling_profiler(false);
+	REQUIRE(machine.sampling_profiler() == nullptr);
+}
+
+TEST_CASE("Look up symbols through a shared index", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+__attribute__((noinline)) int compute(int x) {
+	return x * 3;
+}
+int main(int argc, char** argv) {
+	return compute(argc);
+})M");
+	tinykvm::Machine master { binary, { .max_mem = MAX_MEMORY } };
+	master.prepare_copy_on_write();
+	const uint64_t compute = master.address_of("compute");
+	REQUIRE(compute != 0);
+	REQUIRE(master.address_of("no_such_symbol") == 0);
+	// A name is looked up by its length, not by a terminator
+	REQUIRE(master.address_of(std::string_view("compute_x", 7)) == compute);
+	REQUIRE(master.resolve(compute) == "compute + 0x0");
+	REQUIRE(master.resolve(compute + 1) == "compute + 0x1");
+
+	// Forks share the index of their master
+	tinykvm::Machine fork { master, { .max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM } };
+	REQUIRE(fork.symbol_index() == master.symbol_index());
+	REQUIRE(fork.address_of("compute") == compute);
+	const auto index = master.symbol_index();
+	REQUIRE(index->symbols() > 0);
+	REQUIRE(index->functions() > 0);
+	REQUIRE(index->error() == nullptr);
+
+	// A copy of the binary elsewhere gets its own index
+	const std::vector<uint8_t> copy = binary;
+	REQUIRE(master.address_of("compute", copy) == compute);
+	REQUIRE(master.symbol_index(std::string_view((const char*)copy.data(), copy.size())) != index);
+}
+
+TEST_CASE("Write guest functions to a perf map", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+__attribute__((noinline)) int compute(int x) {
+	return x * 3;
+}
+int main(int argc, char** argv) {
+	return compute(argc);
+})M");
+	char path[] = "/tmp/tinykvm-perf-XXXXXX.map";
+	const int fd = mkstemps(path, 4);
+	REQUIRE(fd >= 0);
+	close(fd);
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	REQUIRE(machine.write_perf_map(path) > 0);
+	// The same program is only written once per file
+	tinykvm::Machine other { binary, { .max_mem = MAX_MEMORY } };
+	REQUIRE(other.write_perf_map(path) == 0);
+
+	char expected[64];
+	snprintf(expected, sizeof(expected), "%lx ", (unsigned long)machine.address_of("compute"));
+	FILE* file = fopen(path, "r");
+	REQUIRE(file != nullptr);
+	char line[512];
+	bool found = false;
+	while (fgets(line, sizeof(line), file) != nullptr) {
+		if (strncmp(line, expected, strlen(expected)) == 0)
+			found = strstr(line, " compute\n") != nullptr;
+	}
+	fclose(file);
+	unlink(path);
+	REQUIRE(found);
+}
+
+TEST_CASE("Dynamic work distribution over SMP vCPUs", "[Output]")
+{
+	const auto binary = build_and_load(R"M(
+#include <stdint.h>
+int main() {
+	return 0;
+}
+extern void process(uint32_t* item, uint32_t size, uint32_t idx) {
+	/* Skewed work: every 16th item is much more expensive */
+	volatile uint32_t spin = (idx % 16 == 0) ? 1000000 : 10;
+	while (spin) spin--;
+	*item = idx * 2 + size;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"dynamic"}, env);
+	machine.run(4.0f);
+
+	static constexpr size_t CPUS = 4;
+	static constexpr uint32_t STACK_SIZE = 65536;
+	static constexpr uint32_t ITEMS = 100;
+	const auto stacks = machine.mmap_allocate(CPUS * STACK_SIZE);
+	const auto array = machine.mmap_allocate(ITEMS * sizeof(uint32_t));
+
+	machine.smp().timed_smpcall_dynamic(CPUS, stacks, STACK_SIZE,
+		machine.address_of("process"), 4.0f,
+		array, sizeof(uint32_t), ITEMS, 3);
+	machine.smp_wait();
+
+	std::array<uint32_t, ITEMS> results;
+	machine.copy_from_guest(results.data(), array, sizeof(results));
+	for (uint32_t i = 0; i < ITEMS; i++)
+		REQUIRE(results[i] == i * 2 + sizeof(uint32_t));
+
+	uint32_t items = 0;
+	uint32_t chunks = 0;
+	for (const auto& stats : machine.smp().work_stats(CPUS)) {
+		items += stats.items;
+		chunks += stats.chunks;
+	}
+	REQUIRE(items == ITEMS);
+	REQUIRE(chunks == (ITEMS + 2) / 3);
+}
+
+TEST_CASE("Pin SMP vCPU threads to host CPUs", "[Output]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+}
+extern long quick(long x) {
+	return x + 1;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"placement"}, env);
+	machine.run(4.0f);
+
+	static constexpr size_t CPUS = 2;
+	static constexpr uint32_t STACK_SIZE = 65536;
+	const auto stacks = machine.mmap_allocate(CPUS * STACK_SIZE);
+
+	// vCPUs created after set_placement are pinned in prepare_cpus
+	machine.smp().set_placement({ .host_cpus = { 0 } });
+	machine.smp().timed_smpcall(CPUS, stacks, STACK_SIZE,
+		machine.address_of("quick"), 1.0f, 1);
+	machine.smp_wait();
+	for (const long result : machine.smp().gather_return_values(CPUS))
+		REQUIRE(result == 2);
+
+	for (const auto& info : machine.smp().placement()) {
+		REQUIRE(info.pinned_cpu == 0);
+		REQUIRE(info.host_cpu == 0);
+		REQUIRE(info.numa_node >= 0);
+	}
+}
+
+TEST_CASE("Parallel guest threads on SMP vCPUs", "[Output]")
+{
+	const auto binary = build_and_load(R"M(
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+static atomic_long total;
+static void* work(void* arg) {
+	for (long i = 0; i < 100000; i++)
+		atomic_fetch_add(&total, (long)(intptr_t)arg);
+	return arg;
+}
+int main() {
+	return 0;
+}
+extern long run_threads(long n) {
+	pthread_t threads[8];
+	total = 0;
+	for (long i = 0; i < n; i++)
+		pthread_create(&threads[i], NULL, work, (void*)(intptr_t)(i + 1));
+	long joined = 0;
+	for (long i = 0; i < n; i++) {
+		void* result;
+		pthread_join(threads[i], &result);
+		joined += (intptr_t)result;
+	}
+	return (total == joined * 100000) ? joined : -1;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"parallel"}, env);
+	machine.run(4.0f);
+
+	machine.set_parallel_threads(4, 4.0f);
+	REQUIRE(machine.has_parallel_threads());
+	machine.timed_vmcall(machine.address_of("run_threads"), 8.0f, 4);
+	REQUIRE(machine.return_value() == 1 + 2 + 3 + 4);
+	machine.smp_wait();
+	REQUIRE(machine.threads().parallel_threads() == 0);
+}
+
+TEST_CASE("Parallel guest threads block in host calls independently", "[Output]")
+{
+	const auto binary = build_and_load(R"M(
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+static int pipefd[2];
+static void* reader(void* arg) {
+	char buffer[16];
+	return (void*)read(pipefd[0], buffer, sizeof(buffer));
+}
+int main() {
+	return 0;
+}
+extern long pipe_between_threads() {
+	if (pipe(pipefd) < 0)
+		return -1;
+	pthread_t thread;
+	pthread_create(&thread, NULL, reader, NULL);
+	/* The reader is blocked in read() by now */
+	const struct timespec ts = { 0, 50000000 };
+	nanosleep(&ts, NULL);
+	if (write(pipefd[1], "Hello", 5) != 5)
+		return -2;
+	void* result;
+	pthread_join(thread, &result);
+	return (long)result;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"parallel"}, env);
+	machine.run(4.0f);
+
+	machine.set_parallel_threads(2, 4.0f);
+	machine.timed_vmcall(machine.address_of("pipe_between_threads"), 4.0f);
+	REQUIRE(machine.return_value() == 5);
+	machine.smp_wait();
+}
+
+TEST_CASE("Dispatch through a command slot", "[Instantiate]")
+{
+	tinykvm::CommandSlot slot;
+	size_t counter = 0;
+	for (size_t i = 0; i < 1000; i++) {
+		slot.post([] (void* arg) {
+			(*static_cast<size_t*> (arg))++;
+		}, &counter);
+	}
+	slot.wait();
+	REQUIRE(slot.idle());
+	REQUIRE(counter == 1000);
+
+	std::thread::id worker_id;
+	slot.call([&] { worker_id = std::this_thread::get_id(); });
+	REQUIRE(worker_id != std::this_thread::get_id());
+	// Exceptions are forwarded to the caller
+	REQUIRE_THROWS_AS(slot.call([] {
+		throw tinykvm::MachineException("From the worker");
+	}), tinykvm::MachineException);
+}
+
+TEST_CASE("Reserve zeroed pages for SMP page faults", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.prepare_copy_on_write(65536);
+	const tinykvm::MachineOptions options {
+		.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM
+	};
+	tinykvm::Machine fork { machine, options };
+	auto& memory = fork.main_memory();
+
+	tinykvm::PageReserve reserve;
+	memory.refill_page_reserve(reserve);
+	REQUIRE(reserve.count == tinykvm::PageReserve::PAGES);
+	for (const auto& page : reserve.pages) {
+		REQUIRE(!page.dirty);
+		for (size_t i = 0; i < 512; i++)
+			REQUIRE(page.pmem[i] == 0);
+	}
+
+	// new_page() takes from the reserve of the current thread
+	tinykvm::vMemory::current_page_reserve = &reserve;
+	const auto page = memory.new_page();
+	tinykvm::vMemory::current_page_reserve = nullptr;
+	REQUIRE(reserve.count == tinykvm::PageReserve::PAGES - 1);
+	REQUIRE(page.addr == reserve.pages[reserve.count].addr);
+	// Above the low-water mark, nothing is taken from the banks
+	memory.refill_page_reserve(reserve);
+	REQUIRE(reserve.count == tinykvm::PageReserve::PAGES - 1);
+
+	// Resetting the banks makes the reserve stale
+	fork.reset_to(machine, options);
+	tinykvm::vMemory::current_page_reserve = &reserve;
+	memory.new_page();
+	tinykvm::vMemory::current_page_reserve = nullptr;
+	REQUIRE(reserve.count == tinykvm::PageReserve::PAGES - 1);
+	memory.refill_page_reserve(reserve);
+	REQUIRE(reserve.count == tinykvm::PageReserve::PAGES);
+}
+
+TEST_CASE("Suspend a coroutine vmcall on guest I/O", "[Output]")
+{
+	const auto binary = build_and_load(R"M(
+#include <poll.h>
+#include <unistd.h>
+int main() {
+	return 0;
+}
+extern long wait_and_read(int fd) {
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	if (poll(&pfd, 1, -1) != 1)
+		return -1;
+	char buffer[64];
+	return read(fd, buffer, sizeof(buffer));
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"co_vmcall"}, env);
+	machine.run(4.0f);
+
+	int pipefd[2];
+	REQUIRE(pipe(pipefd) == 0);
+	const int vfd = machine.fds().manage(pipefd[0], false);
+
+	int waited_fd = -1;
+	std::coroutine_handle<> waiting;
+	auto task = tinykvm::co_vmcall(machine,
+		[&] (const tinykvm::Machine::IOWait& wait, std::coroutine_handle<> h) {
+			waited_fd = wait.fds.at(0).fd;
+			waiting = h;
+		}, machine.address_of("wait_and_read"), 4.0f, vfd);
+	// The guest is suspended in poll(), and the host thread is free
+	REQUIRE(!task.done());
+	REQUIRE(machine.io_pending());
+	REQUIRE(waited_fd == pipefd[0]);
+
+	REQUIRE(write(pipefd[1], "Hello", 5) == 5);
+	waiting.resume();
+	REQUIRE(task.done());
+	REQUIRE(!machine.io_pending());
+	REQUIRE(task.result() == 5);
+	close(pipefd[1]);
+}
+
+TEST_CASE("Resume waiters from a shared epoll reactor", "[Instantiate]")
+{
+	tinykvm::EpollReactor reactor;
+	auto io_reactor = reactor.reactor();
+	// Stands in for co_vmcall(), suspending on the given wait
+	struct Awaiter {
+		const tinykvm::IOReactor& reactor;
+		const tinykvm::Machine::IOWait& wait;
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> h) { reactor(wait, h); }
+		void await_resume() const noexcept {}
+	};
+	auto waiter = [&] (const tinykvm::Machine::IOWait& wait) -> tinykvm::VMTask {
+		co_await Awaiter{io_reactor, wait};
+		co_return 1;
+	};
+
+	int pipe1[2], pipe2[2];
+	REQUIRE(pipe(pipe1) == 0);
+	REQUIRE(pipe(pipe2) == 0);
+	tinykvm::Machine::IOWait readable, timed;
+	readable.fds = { { pipe1[0], POLLIN, 0 } };
+	timed.fds = { { pipe2[0], POLLIN, 0 } };
+	timed.timeout_ms = 10;
+
+	auto task1 = waiter(readable);
+	auto task2 = waiter(timed);
+	REQUIRE(reactor.waiting() == 2);
+	REQUIRE(reactor.run_once(0) == 0);
+
+	// Only the VM whose events fired is resumed
+	REQUIRE(write(pipe1[1], "x", 1) == 1);
+	REQUIRE(reactor.run_once(0) == 1);
+	REQUIRE(task1.done());
+	REQUIRE(task1.result() == 1);
+	REQUIRE(!task2.done());
+
+	// The other one is resumed when its timeout expires
+	REQUIRE(reactor.run_once(1000) == 1);
+	REQUIRE(task2.done());
+	REQUIRE(reactor.waiting() == 0);
+
+	// Several VMs can wait on the same fd, without waking up early
+	char buffer[4];
+	REQUIRE(read(pipe1[0], buffer, sizeof(buffer)) == 1);
+	auto task3 = waiter(readable);
+	auto task4 = waiter(readable);
+	REQUIRE(reactor.waiting() == 2);
+	REQUIRE(reactor.run_once(0) == 0);
+	REQUIRE(write(pipe1[1], "x", 1) == 1);
+	REQUIRE(reactor.run_once(0) == 2);
+	REQUIRE(task3.done());
+	REQUIRE(task4.done());
+	// The fd is registered again by the next waiter
+	auto task5 = waiter(readable);
+	REQUIRE(reactor.run_once(0) == 1);
+	REQUIRE(task5.done());
+
+	for (const int fd : { pipe1[0], pipe1[1], pipe2[0], pipe2[1] })
+		close(fd);
+}
+
+TEST_CASE("Block cooperative threads on futex wait queues", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	auto& cpu = machine.cpu();
+	auto& mt = machine.threads();
+	mt.create(2);
+	const uint64_t addr = machine.stack_address() - 4096;
+
+	// When nothing else can run, the thread is not blocked
+	REQUIRE(!mt.futex_block(cpu, addr, FUTEX_BITSET_MATCH_ANY, -1));
+	REQUIRE(mt.futex_waiters() == 0);
+	mt.set_to_and_suspend_others(1);
+
+	// Blocking runs the other thread, and a wake targets the waiter
+	REQUIRE(mt.futex_block(cpu, addr, 0x1, -1));
+	REQUIRE(mt.gettid() == 2);
+	REQUIRE(mt.futex_waiters() == 1);
+	REQUIRE(mt.futex_wake(addr + 4, 1) == 0);
+	REQUIRE(mt.futex_wake(addr, 1, 0x2) == 0);
+	REQUIRE(mt.futex_wake(addr, 1) == 1);
+	REQUIRE(mt.futex_waiters() == 0);
+
+	// With nothing else to run, the host sleeps until the timeout
+	REQUIRE(mt.futex_block(cpu, addr, FUTEX_BITSET_MATCH_ANY, 5'000'000));
+	REQUIRE(mt.gettid() == 1);
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	REQUIRE(mt.futex_block(cpu, addr + 4, FUTEX_BITSET_MATCH_ANY, -1));
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	REQUIRE(mt.gettid() == 2);
+	REQUIRE(int64_t(machine.registers().rax) == -ETIMEDOUT);
+	const int64_t elapsed = (t1.tv_sec - t0.tv_sec) * 1'000'000'000LL + (t1.tv_nsec - t0.tv_nsec);
+	REQUIRE(elapsed >= 4'000'000);
+	REQUIRE(mt.futex_waiters() == 1);
+
+	REQUIRE(mt.futex_wake(addr + 4, INT32_MAX) == 1);
+	REQUIRE(mt.gettid() == 2);
+	REQUIRE(mt.futex_waiters() == 0);
+}
+
+TEST_CASE("Block on emulated pipes by running other threads", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux_system_calls();
+	machine.fds().set_emulated_channels(true);
+	int vfds[2];
+	machine.fds().create_emulated(tinykvm::FileDescriptors::SocketType::PIPE2, false, vfds);
+	auto& cpu = machine.cpu();
+	const uint64_t buffer = machine.stack_address() - 4096;
+	static constexpr uint64_t RETURN_ADDR = 0x1002; // After the syscall instruction
+	auto read_pipe = [&] {
+		auto regs = cpu.registers();
+		regs.rax = SYS_read;
+		regs.rdi = vfds[0];
+		regs.rsi = buffer;
+		regs.rdx = 4;
+		regs.rcx = RETURN_ADDR;
+		cpu.set_registers(regs);
+		machine.system_call(cpu, SYS_read);
+	};
+
+	// A lone thread would wait on itself forever
+	REQUIRE_THROWS_AS(read_pipe(), tinykvm::MachineException);
+	REQUIRE(cpu.registers().rcx == RETURN_ADDR);
+
+	// Otherwise the reader yields, and reads again when resumed
+	auto& mt = machine.threads();
+	mt.create(2);
+	mt.set_to_and_suspend_others(1);
+	read_pipe();
+	REQUIRE(mt.gettid() == 2);
+	const auto& reader = *mt.get_thread(1);
+	REQUIRE(reader.stored_regs.rax == SYS_read);
+	REQUIRE(reader.stored_regs.rcx == RETURN_ADDR - 2);
+	REQUIRE(reader.stored_regs.rdi == uint64_t(vfds[0]));
+}
+
+TEST_CASE("Reuse per-vCPU scratch iovecs", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	auto& cpu = machine.cpu();
+	const uint64_t addr = machine.stack_address() - 8192;
+
+	// Identity-mapped memory merges into a single inline buffer
+	auto& buffers = cpu.io_buffers();
+	REQUIRE(machine.gather_buffers_from_range(buffers, addr, 8192) == 1);
+	REQUIRE(buffers[0].len == 8192);
+	auto& wrbuffers = cpu.io_wrbuffers();
+	REQUIRE(machine.writable_buffers_from_range(wrbuffers, addr, 8192) == 1);
+	REQUIRE(wrbuffers[0].ptr == buffers[0].ptr);
+	// Getting the array again empties it, but keeps the storage
+	REQUIRE(&cpu.io_buffers() == &buffers);
+	REQUIRE(buffers.empty());
+
+	// Long lists spill over to the heap, keeping their contents
+	tinykvm::ScratchIOVec<tinykvm::IOBuffer, 4> scratch;
+	const auto* inline_data = scratch.data();
+	for (size_t i = 0; i < 10; i++)
+		scratch.emplace_back().len = i;
+	REQUIRE(scratch.size() == 10);
+	REQUIRE(scratch.data() != inline_data);
+	for (size_t i = 0; i < 10; i++)
+		REQUIRE(scratch[i].len == i);
+	scratch.clear();
+	scratch.emplace_back().len = 1;
+	REQUIRE(scratch.data() == inline_data);
+}
+
+TEST_CASE("Transfer between host fds with sendfile and copy_file_range", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux_system_calls();
+	auto& cpu = machine.cpu();
+
+	char in_path[] = "/tmp/tinykvm-sendfile-XXXXXX";
+	const int in_fd = mkstemp(in_path);
+	REQUIRE(in_fd >= 0);
+	unlink(in_path);
+	REQUIRE(write(in_fd, "Hello Zero Copy!", 16) == 16);
+	int pipefd[2];
+	REQUIRE(pipe(pipefd) == 0);
+	const int in_vfd = machine.fds().manage(in_fd, false);
+	const int out_vfd = machine.fds().manage(pipefd[1], false, true);
+
+	// sendfile() from an offset, which is updated in guest memory
+	const uint64_t g_offset = machine.stack_address() - 4096;
+	const int64_t offset = 6;
+	machine.copy_to_guest(g_offset, &offset, sizeof(offset));
+	auto regs = cpu.registers();
+	regs.rax = SYS_sendfile;
+	regs.rdi = out_vfd;
+	regs.rsi = in_vfd;
+	regs.rdx = g_offset;
+	regs.r10 = 4;
+	cpu.set_registers(regs);
+	machine.system_call(cpu, SYS_sendfile);
+	REQUIRE(cpu.registers().rax == 4);
+	char text[16] {};
+	REQUIRE(read(pipefd[0], text, sizeof(text)) == 4);
+	REQUIRE(std::string(text, 4) == "Zero");
+	int64_t new_offset = 0;
+	machine.copy_from_guest(&new_offset, g_offset, sizeof(new_offset));
+	REQUIRE(new_offset == 10);
+
+	// sendfile() to stdout goes to the printer
+	std::string output;
+	machine.set_printer([&] (const char* data, size_t size) {
+		output.append(data, size);
+	});
+	regs.rdi = 1;
+	regs.rdx = 0x0;
+	regs.r10 = 64;
+	REQUIRE(lseek(in_fd, 0, SEEK_SET) == 0);
+	cpu.set_registers(regs);
+	machine.system_call(cpu, SYS_sendfile);
+	REQUIRE(cpu.registers().rax == 16);
+	REQUIRE(output == "Hello Zero Copy!");
+
+	// copy_file_range() into a writable file
+	char out_path[] = "/tmp/tinykvm-copy-XXXXXX";
+	const int copy_fd = mkstemp(out_path);
+	REQUIRE(copy_fd >= 0);
+	unlink(out_path);
+	const int copy_vfd = machine.fds().manage(copy_fd, false, true);
+	REQUIRE(lseek(in_fd, 0, SEEK_SET) == 0);
+	regs.rdi = in_vfd;
+	regs.rsi = 0x0;
+	regs.rdx = copy_vfd;
+	regs.r10 = 0x0;
+	regs.r8 = 5;
+	regs.r9 = 0;
+	cpu.set_registers(regs);
+	machine.system_call(cpu, SYS_copy_file_range);
+	REQUIRE(cpu.registers().rax == 5);
+	REQUIRE(pread(copy_fd, text, sizeof(text), 0) == 5);
+	REQUIRE(std::string(text, 5) == "Hello");
+
+	// The output must be writable
+	regs.rdx = in_vfd;
+	cpu.set_registers(regs);
+	REQUIRE_THROWS(machine.system_call(cpu, SYS_copy_file_range));
+	close(pipefd[0]);
+}
+
+TEST_CASE("Receive a batch of datagrams with recvmmsg", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux_system_calls();
+	auto& cpu = machine.cpu();
+
+	int sv[2];
+	REQUIRE(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == 0);
+	const int vfd = machine.fds().manage(sv[0], true);
+	for (const char* text : {"one", "two", "three"})
+		REQUIRE(send(sv[1], text, strlen(text), 0) == ssize_t(strlen(text)));
+
+	// Four message headers, each with one 16-byte iovec
+	const uint64_t g_msgs = machine.stack_address() - 8192;
+	const uint64_t g_iovs = g_msgs + 1024;
+	const uint64_t g_data = g_msgs + 2048;
+	struct mmsghdr msgs[4] {};
+	struct { uint64_t base, len; } iovs[4];
+	for (int i = 0; i < 4; i++) {
+		iovs[i].base = g_data + i * 16;
+		iovs[i].len = 16;
+		msgs[i].msg_hdr.msg_iov = (struct iovec *)(g_iovs + i * sizeof(iovs[0]));
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	machine.copy_to_guest(g_msgs, msgs, sizeof(msgs));
+	machine.copy_to_guest(g_iovs, iovs, sizeof(iovs));
+
+	auto regs = cpu.registers();
+	regs.rdi = vfd;
+	regs.rsi = g_msgs;
+	regs.rdx = 4;
+	regs.r10 = MSG_DONTWAIT;
+	regs.r8 = 0x0;
+	cpu.set_registers(regs);
+	machine.system_call(cpu, SYS_recvmmsg);
+	REQUIRE(cpu.registers().rax == 3);
+
+	machine.copy_from_guest(msgs, g_msgs, sizeof(msgs));
+	REQUIRE(msgs[0].msg_len == 3);
+	REQUIRE(msgs[1].msg_len == 3);
+	REQUIRE(msgs[2].msg_len == 5);
+	char data[64];
+	machine.copy_from_guest(data, g_data, sizeof(data));
+	REQUIRE(std::string(&data[0], 3) == "one");
+	REQUIRE(std::string(&data[16], 3) == "two");
+	REQUIRE(std::string(&data[32], 5) == "three");
+
+	// Nothing left to receive
+	cpu.set_registers(regs);
+	machine.system_call(cpu, SYS_recvmmsg);
+	REQUIRE(int64_t(cpu.registers().rax) == -EAGAIN);
+	close(sv[1]);
+}
+
+TEST_CASE("Flat file descriptor table", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	auto& fds = machine.fds();
+	using FDs = tinykvm::FileDescriptors;
+
+	// stdin/stdout/stderr are always there
+	REQUIRE(fds.get_current_fds_opened() == 3);
+	REQUIRE(fds.entry_for_vfd(1).has_value());
+	REQUIRE(fds.entry_for_vfd(1).value()->is_writable);
+
+	const int vfd1 = fds.manage(dup(0), false);
+	const int vfd2 = fds.manage(dup(0), false, true);
+	REQUIRE(vfd1 == FDs::VFD_START);
+	REQUIRE(vfd2 == FDs::VFD_START + 1);
+	REQUIRE(fds.get_current_fds_opened() == 5);
+	REQUIRE(fds.translate(vfd2) == fds.entry_for_vfd(vfd2).value()->real_fd);
+	REQUIRE_THROWS(fds.translate_writable_vfd(vfd1));
+	REQUIRE(fds.translate(vfd2 + 1) == -1);
+
+	// Closed vfds are not reused by default
+	const int real_fd1 = fds.translate(vfd1);
+	REQUIRE(!fds.free(vfd1));
+	close(real_fd1);
+	REQUIRE(!fds.entry_for_vfd(vfd1).has_value());
+	REQUIRE(fds.get_current_fds_opened() == 4);
+	REQUIRE(fds.manage(dup(0), false) == vfd2 + 1);
+
+	// Unless enabled
+	fds.set_reuse_closed_vfds(true);
+	const int real_fd2 = fds.translate(vfd2);
+	REQUIRE(!fds.free(vfd2));
+	close(real_fd2);
+	REQUIRE(fds.manage(dup(0), false) == vfd2);
+	REQUIRE(fds.manage(dup(0), false) == vfd2 + 2);
+
+	// A vfd far away from the others
+	const int far_vfd = 0x7FFF0000;
+	fds.manage_as(far_vfd, dup(0), false, true);
+	REQUIRE(fds.translate_writable_vfd(far_vfd) >= 0);
+	REQUIRE(fds.get_current_fds_opened() == 7);
+	REQUIRE(fds.manage(dup(0), false) == far_vfd + 1);
+}
+
+TEST_CASE("Share read-only file mappings between VMs", "[Instantiate]")
+{
+	auto& cache = tinykvm::FileMappingCache::get();
+	char path[] = "/tmp/tinykvm_mapping_XXXXXX";
+	const int fd = mkstemp(path);
+	REQUIRE(fd >= 0);
+	unlink(path);
+	const std::string data(65536, 'x');
+	REQUIRE(write(fd, data.data(), data.size()) == ssize_t(data.size()));
+	struct stat st;
+	REQUIRE(fstat(fd, &st) == 0);
+
+	// The same range of the same file is only mapped once
+	const size_t mappings = cache.mappings();
+	const uint64_t hits = cache.hits();
+	char* p1 = cache.acquire(fd, st, 0, data.size());
+	char* p2 = cache.acquire(fd, st, 0, data.size());
+	REQUIRE(p1 != nullptr);
+	REQUIRE(p1 == p2);
+	REQUIRE(p1[100] == 'x');
+	REQUIRE(cache.hits() == hits + 1);
+	REQUIRE(cache.mappings() == mappings + 1);
+
+	// A modified file gets a new mapping
+	struct stat st2 = st;
+	st2.st_mtim.tv_nsec ^= 1;
+	char* p3 = cache.acquire(fd, st2, 0, data.size());
+	REQUIRE(p3 != nullptr);
+	REQUIRE(p3 != p1);
+	REQUIRE(cache.mappings() == mappings + 2);
+
+	// Unreferenced mappings are kept until the idle limit is exceeded
+	cache.release(p1);
+	cache.release(p2);
+	cache.release(p3);
+	REQUIRE(cache.mappings() == mappings + 2);
+	REQUIRE(cache.idle_bytes() >= 2 * data.size());
+	cache.set_max_idle_bytes(0);
+	REQUIRE(cache.mappings() == mappings);
+	REQUIRE(cache.idle_bytes() == 0);
+	cache.set_max_idle_bytes(tinykvm::FileMappingCache::DEFAULT_MAX_IDLE_BYTES);
+	close(fd);
+}
+
+TEST_CASE("Serve guest file access from a virtual filesystem", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+
+	auto vfs = std::make_shared<tinykvm::VirtualFileSystem>();
+	vfs->add_file("/etc/app/config.txt", "Hello VFS!");
+	unsigned loads = 0;
+	vfs->set_loader([&] (const std::string& path, std::string& contents) {
+		loads++;
+		if (path != "/etc/app/lazy.txt")
+			return false;
+		contents = "lazy";
+		return true;
+	});
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux_system_calls();
+	machine.fds().set_virtual_filesystem(vfs);
+	// Nothing from the host is readable
+	machine.fds().set_open_readable_callback([] (std::string&) {
+		return false;
+	});
+	auto& cpu = machine.cpu();
+	const uint64_t g_path = machine.stack_address() - 8192;
+	const uint64_t g_buf = machine.stack_address() - 4096;
+	auto syscall = [&] (unsigned nr, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3 = 0) {
+		auto regs = cpu.registers();
+		regs.rax = nr;
+		regs.rdi = a0;
+		regs.rsi = a1;
+		regs.rdx = a2;
+		regs.r10 = a3;
+		cpu.set_registers(regs);
+		machine.system_call(cpu, nr);
+		return int64_t(cpu.registers().rax);
+	};
+	auto open_path = [&] (const char* path, int flags) {
+		machine.copy_to_guest(g_path, path, strlen(path) + 1);
+		return syscall(SYS_openat, AT_FDCWD, g_path, flags);
+	};
+
+	// Open and read a preloaded file, without a host fd
+	const int64_t vfd = open_path("/etc/app/../app//config.txt", O_RDONLY);
+	REQUIRE(vfd >= tinykvm::FileDescriptors::VFD_START);
+	REQUIRE(machine.fds().translate(vfd) == -1);
+	char text[16] {};
+	REQUIRE(syscall(SYS_read, vfd, g_buf, 5) == 5);
+	REQUIRE(syscall(SYS_read, vfd, g_buf + 5, 16) == 5);
+	REQUIRE(syscall(SYS_read, vfd, g_buf, 16) == 0);
+	machine.copy_from_guest(text, g_buf, 10);
+	REQUIRE(std::string(text, 10) == "Hello VFS!");
+	REQUIRE(syscall(SYS_lseek, vfd, 0, SEEK_END) == 10);
+	REQUIRE(syscall(SYS_pread64, vfd, g_buf, 3, 6) == 3);
+	machine.copy_from_guest(text, g_buf, 3);
+	REQUIRE(std::string(text, 3) == "VFS");
+	struct stat st;
+	REQUIRE(syscall(SYS_fstat, vfd, g_buf, 0) == 0);
+	machine.copy_from_guest(&st, g_buf, sizeof(st));
+	REQUIRE(S_ISREG(st.st_mode));
+	REQUIRE(st.st_size == 10);
+	REQUIRE(syscall(SYS_close, vfd, 0, 0) == 0);
+	REQUIRE(syscall(SYS_close, vfd, 0, 0) == -EBADF);
+
+	// Lazily loaded files, relative to the working directory
+	machine.fds().set_current_working_directory("/etc/app");
+	const int64_t lazy_vfd = open_path("lazy.txt", O_RDONLY);
+	REQUIRE(lazy_vfd >= 0);
+	REQUIRE(syscall(SYS_read, lazy_vfd, g_buf, 16) == 4);
+	REQUIRE(open_path("missing.txt", O_RDONLY) == -EACCES);
+	REQUIRE(open_path("missing.txt", O_RDONLY) == -EACCES);
+	REQUIRE(loads == 2);
+	REQUIRE(syscall(SYS_close, lazy_vfd, 0, 0) == 0);
+
+	// List a directory
+	const int64_t dir_vfd = open_path("/etc/app", O_RDONLY | O_DIRECTORY);
+	REQUIRE(dir_vfd >= 0);
+	const int64_t len = syscall(SYS_getdents64, dir_vfd, g_buf, 4096);
+	REQUIRE(len > 0);
+	std::vector<char> dents(len);
+	machine.copy_from_guest(dents.data(), g_buf, len);
+	std::string names;
+	for (int64_t pos = 0; pos < len; ) {
+		auto* dent = (struct dirent64 *)&dents[pos];
+		names += std::string(" ") + dent->d_name;
+		pos += dent->d_reclen;
+	}
+	REQUIRE(names == " . .. config.txt lazy.txt");
+	REQUIRE(syscall(SYS_getdents64, dir_vfd, g_buf, 4096) == 0);
+	REQUIRE(open_path("/etc/app/config.txt", O_RDONLY | O_DIRECTORY) == -ENOTDIR);
+	REQUIRE(syscall(SYS_close, dir_vfd, 0, 0) == 0);
+	REQUIRE(machine.fds().get_current_fds_opened() == 3);
+
+	// Only the most recent misses are remembered
+	loads = 0;
+	size_t misses = 0;
+	for (size_t i = 0; i <= tinykvm::VirtualFileSystem::MAX_MISSES; i++)
+		misses += vfs->find("/miss/" + std::to_string(i)) == nullptr;
+	REQUIRE(misses == tinykvm::VirtualFileSystem::MAX_MISSES + 1);
+	REQUIRE(loads == tinykvm::VirtualFileSystem::MAX_MISSES + 1);
+	REQUIRE(vfs->find("/miss/1") == nullptr);
+	REQUIRE(loads == tinykvm::VirtualFileSystem::MAX_MISSES + 1);
+	REQUIRE(vfs->find("/miss/0") == nullptr);
+	REQUIRE(loads == tinykvm::VirtualFileSystem::MAX_MISSES + 2);
+}
+
+TEST_CASE("Cache path lookups and stat results", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux_system_calls();
+	auto cache = std::make_shared<tinykvm::PathCache>(std::chrono::milliseconds(0));
+	machine.fds().set_path_cache(cache);
+	unsigned callbacks = 0;
+	machine.fds().set_open_readable_callback([&] (std::string& path) {
+		callbacks++;
+		return path.rfind("/tmp/", 0) == 0;
+	});
+	char path[] = "/tmp/tinykvm-pathcache-XXXXXX";
+	const int fd = mkstemp(path);
+	REQUIRE(fd >= 0);
+	REQUIRE(write(fd, "12345", 5) == 5);
+	close(fd);
+
+	auto& cpu = machine.cpu();
+	const uint64_t g_path = machine.stack_address() - 8192;
+	const uint64_t g_buf = machine.stack_address() - 4096;
+	auto syscall = [&] (unsigned nr, uint64_t a0, uint64_t a1) {
+		auto regs = cpu.registers();
+		regs.rax = nr;
+		regs.rdi = a0;
+		regs.rsi = a1;
+		cpu.set_registers(regs);
+		machine.system_call(cpu, nr);
+		return int64_t(cpu.registers().rax);
+	};
+	machine.copy_to_guest(g_path, path, sizeof(path));
+	REQUIRE(syscall(SYS_stat, g_path, g_buf) == 0);
+	REQUIRE(syscall(SYS_access, g_path, R_OK) == 0);
+	REQUIRE(callbacks == 1);
+
+	// Repeated probes are answered from the cache, even after the file is gone
+	unlink(path);
+	REQUIRE(syscall(SYS_stat, g_path, g_buf) == 0);
+	REQUIRE(syscall(SYS_access, g_path, R_OK) == 0);
+	struct stat st;
+	machine.copy_from_guest(&st, g_buf, sizeof(st));
+	REQUIRE(st.st_size == 5);
+	REQUIRE(callbacks == 1);
+	REQUIRE(cache->hits() >= 4);
+
+	// Denied paths are remembered too
+	machine.copy_to_guest(g_path, "/etc/passwd", 12);
+	REQUIRE(syscall(SYS_stat, g_path, g_buf) == -EACCES);
+	REQUIRE(syscall(SYS_stat, g_path, g_buf) == -EACCES);
+	REQUIRE(callbacks == 2);
+
+	// Clearing the cache goes back to the host
+	cache->clear();
+	machine.copy_to_guest(g_path, path, sizeof(path));
+	REQUIRE(syscall(SYS_stat, g_path, g_buf) == -ENOENT);
+	REQUIRE(callbacks == 3);
+
+	// Relative paths depend on the working directory, and are not cached
+	machine.copy_to_guest(g_path, "passwd", 7);
+	REQUIRE(syscall(SYS_stat, g_path, g_buf) == -EACCES);
+	REQUIRE(syscall(SYS_stat, g_path, g_buf) == -EACCES);
+	REQUIRE(callbacks == 5);
+
+	// Entries expire after their time-to-live
+	tinykvm::PathCache short_cache(std::chrono::milliseconds(1));
+	short_cache.set_access("/tmp", R_OK, 0);
+	REQUIRE(short_cache.access("/tmp", R_OK) == 0);
+	REQUIRE(!short_cache.access("/tmp", W_OK).has_value());
+	usleep(2000);
+	REQUIRE(!short_cache.access("/tmp", R_OK).has_value());
+}
+
+TEST_CASE("Offload reads that miss the page cache", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux_system_calls();
+	machine.set_io_suspend(true);
+	machine.set_file_read_pool(std::make_shared<tinykvm::ThreadPool>(1, 0, false));
+	auto& cpu = machine.cpu();
+
+	char path[] = "/var/tmp/tinykvm-offload-XXXXXX";
+	const int fd = mkstemp(path);
+	REQUIRE(fd >= 0);
+	unlink(path);
+	std::string data(1u << 20, '\0');
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = 'a' + (i % 26);
+	REQUIRE(write(fd, data.data(), data.size()) == ssize_t(data.size()));
+	const int vfd = machine.fds().manage(fd, false);
+	const uint64_t g_buf = machine.stack_address() - 8192;
+	auto pread64 = [&] (uint64_t offset) {
+		auto regs = cpu.registers();
+		regs.rax = SYS_pread64;
+		regs.rdi = vfd;
+		regs.rsi = g_buf;
+		regs.rdx = 4096;
+		regs.r10 = offset;
+		cpu.set_registers(regs);
+		machine.system_call(cpu, SYS_pread64);
+	};
+
+	// Cached data is read right away
+	pread64(1);
+	REQUIRE(!machine.io_pending());
+	REQUIRE(cpu.registers().rax == 4096);
+	char text[4];
+	machine.copy_from_guest(text, g_buf, sizeof(text));
+	REQUIRE(std::string(text, 4) == "bcde");
+
+	// Evicted data is read on the pool, while the vCPU waits for an event
+	REQUIRE(fdatasync(fd) == 0);
+	REQUIRE(posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0);
+	pread64(2);
+	if (machine.io_pending()) {
+		const auto& wait = machine.io_wait();
+		REQUIRE(wait.fds.size() == 1);
+		REQUIRE(wait.syscall_nr == SYS_pread64);
+		struct pollfd pfd = wait.fds.at(0);
+		REQUIRE(poll(&pfd, 1, 5000) == 1);
+	} else {
+		// The filesystem does not support RWF_NOWAIT misses
+		REQUIRE(cpu.registers().rax == 4096);
+	}
+	machine.copy_from_guest(text, g_buf, sizeof(text));
+	REQUIRE(std::string(text, 4) == "cdef");
+
+	// A short read at the end of a cached file does not suspend
+	char tail[100];
+	REQUIRE(pread(fd, tail, sizeof(tail), data.size() - 100) == 100);
+	pread64(data.size() - 100);
+	REQUIRE(!machine.io_pending());
+	REQUIRE(cpu.registers().rax == 100);
+	REQUIRE(ftruncate(fd, 10) == 0);
+	pread64(0);
+	REQUIRE(!machine.io_pending());
+	REQUIRE(cpu.registers().rax == 10);
+	machine.copy_from_guest(text, g_buf, sizeof(text));
+	REQUIRE(std::string(text, 4) == "abcd");
+}
+
+TEST_CASE("Non-blocking accept is not suspended", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux_system_calls();
+	machine.set_io_suspend(true);
+	auto& cpu = machine.cpu();
+
+	const int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	REQUIRE(listener >= 0);
+	struct sockaddr_in addr {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	REQUIRE(bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+	REQUIRE(listen(listener, 4) == 0);
+	const int vfd = machine.fds().manage(listener, true, true);
+	auto accept4 = [&] {
+		auto regs = cpu.registers();
+		regs.rax = SYS_accept4;
+		regs.rdi = vfd;
+		regs.rsi = 0;
+		regs.rdx = 0;
+		regs.r10 = 0;
+		cpu.set_registers(regs);
+		machine.system_call(cpu, SYS_accept4);
+	};
+
+	// An epoll-driven server expects EAGAIN
+	accept4();
+	REQUIRE(!machine.io_pending());
+	REQUIRE(int64_t(cpu.registers().rax) == -EAGAIN);
+
+	// A blocking listener suspends until a connection arrives
+	REQUIRE(fcntl(listener, F_SETFL, 0) == 0);
+	accept4();
+	REQUIRE(machine.io_pending());
+}
+
+TEST_CASE("Buffer guest output in batches", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux_system_calls();
+	auto& cpu = machine.cpu();
+	const uint64_t g_buf = machine.stack_address() - 4096;
+	auto write_line = [&] (const std::string& text) {
+		machine.copy_to_guest(g_buf, text.data(), text.size());
+		auto regs = cpu.registers();
+		regs.rax = SYS_write;
+		regs.rdi = 1;
+		regs.rsi = g_buf;
+		regs.rdx = text.size();
+		cpu.set_registers(regs);
+		machine.system_call(cpu, SYS_write);
+		REQUIRE(cpu.registers().rax == text.size());
+	};
+	std::vector<std::string> batches;
+	machine.set_batch_printer([&] (const struct iovec* iov, size_t count) {
+		std::string batch;
+		for (size_t i = 0; i < count; i++)
+			batch.append((const char *)iov[i].iov_base, iov[i].iov_len);
+		batches.push_back(batch);
+	});
+	machine.set_output_buffering(16);
+
+	// Lines are coalesced until the buffer is full
+	write_line("line 1\n");
+	write_line("line 2\n");
+	REQUIRE(batches.empty());
+	write_line("line 3\n");
+	REQUIRE(batches.size() == 1);
+	REQUIRE(batches.at(0) == "line 1\nline 2\nline 3\n");
+	write_line("tail");
+	machine.flush_output();
+	REQUIRE(batches.size() == 2);
+	REQUIRE(batches.at(1) == "tail");
+	machine.flush_output();
+	REQUIRE(batches.size() == 2);
+
+	// Batches handed over early end at a newline
+	machine.set_output_buffering(16, true);
+	write_line("line 4\nline 5");
+	write_line("\nline 6\npartial");
+	REQUIRE(batches.size() == 3);
+	REQUIRE(batches.at(2) == "line 4\nline 5\nline 6\n");
+	machine.flush_output();
+	REQUIRE(batches.at(3) == "partial");
+
+	// Without buffering, the printer gets every write
+	std::string output;
+	machine.set_printer([&] (const char* data, size_t size) {
+		output.append(data, size);
+	});
+	machine.set_batch_printer(nullptr);
+	machine.set_output_buffering(0);
+	write_line("direct");
+	REQUIRE(output == "direct");
+	REQUIRE(batches.size() == 4);
+}
+
+TEST_CASE("Stack delta snapshots on a base snapshot", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const std::string base = "/tmp/tinykvm-base-" + std::to_string(getpid());
+	const std::string delta1 = base + ".delta1";
+	const std::string delta2 = base + ".delta2";
+	unlink(base.c_str());
+	auto options = [&] (std::vector<std::string> deltas) {
+		return tinykvm::MachineOptions{ .max_mem = MAX_MEMORY,
+			.snapshot_file = base, .snapshot_deltas = std::move(deltas) };
+	};
+	auto read_string = [] (tinykvm::Machine& machine, uint64_t addr) {
+		char buffer[16] {};
+		machine.copy_from_guest(buffer, addr, sizeof(buffer) - 1);
+		return std::string(buffer);
+	};
+	uint64_t g_addr = 0;
+	{
+		tinykvm::Machine machine { binary, options({}) };
+		g_addr = machine.stack_address() - 8192;
+		machine.copy_to_guest(g_addr, "base", 5);
+		machine.save_snapshot_state_now();
+		// A newly created snapshot file is the base itself
+		REQUIRE_THROWS(machine.save_snapshot_delta(delta1));
+	}
+	{
+		tinykvm::Machine machine { binary, options({}) };
+		REQUIRE(machine.has_snapshot_state());
+		REQUIRE(read_string(machine, g_addr) == "base");
+		machine.copy_to_guest(g_addr, "delta1", 7);
+		const size_t pages = machine.save_snapshot_delta(delta1);
+		REQUIRE(pages > 0);
+		REQUIRE(pages < MAX_MEMORY / 4096 / 8);
+	}
+	{
+		tinykvm::Machine machine { binary, options({delta1}) };
+		REQUIRE(machine.has_snapshot_state());
+		REQUIRE(read_string(machine, g_addr) == "delta1");
+		machine.copy_to_guest(g_addr + 4096, "delta2", 7);
+		machine.save_snapshot_delta(delta2);
+	}
+	{
+		tinykvm::Machine machine { binary, options({delta1, delta2}) };
+		REQUIRE(read_string(machine, g_addr) == "delta1");
+		REQUIRE(read_string(machine, g_addr + 4096) == "delta2");
+	}
+	// Deltas only stack on top of the snapshots they were saved on
+	REQUIRE_THROWS(tinykvm::Machine { binary, options({delta2}) });
+	{
+		tinykvm::Machine machine { binary, options({}) };
+		REQUIRE(read_string(machine, g_addr) == "base");
+	}
+	unlink(base.c_str());
+	unlink(delta1.c_str());
+	unlink(delta2.c_str());
+}
+
+TEST_CASE("Restore a snapshot on demand", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const std::string base = "/tmp/tinykvm-lazy-" + std::to_string(getpid());
+	unlink(base.c_str());
+	uint64_t g_addr = 0;
+	{
+		tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY, .snapshot_file = base } };
+		g_addr = machine.stack_address() - 8192;
+		machine.copy_to_guest(g_addr, "restored", 9);
+		machine.save_snapshot_state_now({{g_addr, 4096}});
+	}
+	tinykvm::Machine machine { binary,
+		{ .max_mem = MAX_MEMORY, .snapshot_file = base, .snapshot_lazy_restore = true } };
+	REQUIRE(machine.has_snapshot_state());
+	auto* restore = machine.main_memory().snapshot_restore.get();
+	REQUIRE(restore != nullptr);
+	char buffer[16] {};
+	machine.copy_from_guest(buffer, g_addr, 9);
+	REQUIRE(std::string(buffer) == "restored");
+	// Only what has been touched (or prefetched) is resident
+	while (restore->prefetching())
+		std::this_thread::yield();
+	REQUIRE(restore->pages_faulted() > 0);
+	REQUIRE(restore->pages_faulted() + restore->pages_prefetched() < MAX_MEMORY / 4096 / 4);
+	REQUIRE_THROWS(machine.save_snapshot_delta(base + ".delta"));
+	unlink(base.c_str());
+}
+
+TEST_CASE("Prefault snapshot pages with threads", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const std::string base = "/tmp/tinykvm-prefault-" + std::to_string(getpid());
+	unlink(base.c_str());
+	uint64_t g_addr = 0;
+	{
+		tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY, .snapshot_file = base } };
+		g_addr = machine.stack_address() - 8192;
+		machine.copy_to_guest(g_addr, "prefaulted", 11);
+		machine.save_snapshot_state_now({{g_addr - 0x10000, 0x10000}, {g_addr, 4096}});
+	}
+	// Host page faults taken by this thread when reading the accessed ranges
+	auto faults_on_first_touch = [&] (tinykvm::Machine& machine) {
+		// Look up the pages first, as the page tables were not prefaulted
+		std::vector<const char*> pages;
+		for (uint64_t addr = g_addr - 0x10000; addr <= g_addr; addr += 4096)
+			pages.push_back(machine.main_memory().get_userpage_at(addr));
+		struct rusage before, after;
+		getrusage(RUSAGE_THREAD, &before);
+		for (const char* page : pages)
+			*(volatile const char*)page;
+		getrusage(RUSAGE_THREAD, &after);
+		return after.ru_minflt - before.ru_minflt + after.ru_majflt - before.ru_majflt;
+	};
+	tinykvm::Machine machine { binary,
+		{ .max_mem = MAX_MEMORY, .snapshot_file = base, .snapshot_prefault_threads = 4 } };
+	REQUIRE(machine.has_snapshot_state());
+	REQUIRE(machine.snapshot_prefault_time() > 0.0f);
+	// The accessed ranges are already mapped in
+	REQUIRE(faults_on_first_touch(machine) == 0);
+	char buffer[16] {};
+	machine.copy_from_guest(buffer, g_addr, 11);
+	REQUIRE(std::string(buffer) == "prefaulted");
+
+	// Without prefaulting, the first touch faults
+	tinykvm::Machine baseline { binary, { .max_mem = MAX_MEMORY, .snapshot_file = base } };
+	REQUIRE(baseline.has_snapshot_state());
+	REQUIRE(faults_on_first_touch(baseline) > 0);
+	unlink(base.c_str());
+}
+
+TEST_CASE("Save and load a packed snapshot", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const std::string base = "/tmp/tinykvm-packed-" + std::to_string(getpid());
+	const std::string packed = base + ".packed";
+	unlink(base.c_str());
+	uint64_t g_addr = 0;
+	size_t packed_size = 0;
+	{
+		tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY, .snapshot_file = base } };
+		g_addr = machine.stack_address() - 16384;
+		// Identical pages are stored once
+		std::vector<char> page(4096, 'x');
+		machine.copy_to_guest(g_addr, page.data(), page.size());
+		machine.copy_to_guest(g_addr + 4096, page.data(), page.size());
+		machine.copy_to_guest(g_addr + 8192, "packed", 7);
+		packed_size = machine.save_packed_snapshot(packed);
+	}
+	struct stat st;
+	REQUIRE(stat(base.c_str(), &st) == 0);
+	REQUIRE(packed_size < size_t(st.st_size) / 5);
+
+	tinykvm::Machine machine { binary,
+		{ .max_mem = MAX_MEMORY, .snapshot_packed_file = packed } };
+	REQUIRE(machine.has_snapshot_state());
+	char buffer[16] {};
+	machine.copy_from_guest(buffer, g_addr + 8192, 7);
+	REQUIRE(std::string(buffer) == "packed");
+	machine.copy_from_guest(buffer, g_addr + 4096, 8);
+	REQUIRE(std::string(buffer, 8) == "xxxxxxxx");
+	// The memory is the same as when loading the raw snapshot,
+	// apart from the fixed pages the VM sets up on every load
+	tinykvm::Machine raw { binary, { .max_mem = MAX_MEMORY, .snapshot_file = base } };
+	REQUIRE(std::memcmp(raw.main_memory().ptr + 0x9000, machine.main_memory().ptr + 0x9000,
+		st.st_size - 0x9000) == 0);
+	REQUIRE_THROWS(machine.save_snapshot_delta(base + ".delta"));
+	unlink(base.c_str());
+	unlink(packed.c_str());
+}
+
+TEST_CASE("Attach to a master shared through a memory file", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const uint64_t GUEST_MEMORY = 32ULL << 20; /* 32MB */
+	tinykvm::Machine master { binary, { .max_mem = GUEST_MEMORY, .memfd_main_memory = true } };
+	master.setup_linux({"master"}, env);
+	const auto addr = master.mmap_allocate(4ULL << 20);
+	master.copy_to_guest(addr, "Shared", 7);
+	master.prepare_copy_on_write();
+	const int memfd = master.share_memory();
+	REQUIRE(master.share_memory() == memfd);
+	// The master keeps working on private copies of its pages
+	REQUIRE(master.buffer_to_string(addr, 6) == "Shared");
+	tinykvm::Machine local { master, { .max_mem = GUEST_MEMORY, .max_cow_mem = MAX_COWMEM } };
+	REQUIRE(local.buffer_to_string(addr, 6) == "Shared");
+
+	int sockets[2];
+	REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+	tinykvm::Machine::send_memory_fd(sockets[0], memfd);
+	const int received = tinykvm::Machine::receive_memory_fd(sockets[1]);
+	close(sockets[0]);
+	close(sockets[1]);
+	REQUIRE(received != memfd);
+
+	tinykvm::Machine peer { binary, { .max_mem = GUEST_MEMORY, .snapshot_memfd = received } };
+	REQUIRE(peer.has_snapshot_state());
+	REQUIRE(peer.buffer_to_string(addr, 6) == "Shared");
+	tinykvm::Machine fork { peer, { .max_mem = GUEST_MEMORY, .max_cow_mem = MAX_COWMEM } };
+	REQUIRE(fork.buffer_to_string(addr, 6) == "Shared");
+	fork.copy_to_guest(addr, "Forked", 7);
+	REQUIRE(fork.buffer_to_string(addr, 6) == "Forked");
+	REQUIRE(peer.buffer_to_string(addr, 6) == "Shared");
+	close(received);
+
+	// Only sealed memory files can be attached to
+	const int unsealed = memfd_create("unsealed", MFD_CLOEXEC);
+	REQUIRE(ftruncate(unsealed, GUEST_MEMORY + tinykvm::vMemory::ColdStartStateSize()) == 0);
+	REQUIRE_THROWS(tinykvm::Machine { binary, { .max_mem = GUEST_MEMORY, .snapshot_memfd = unsealed } });
+	close(unsealed);
+}
+
+TEST_CASE("Construct machines from a program image", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const tinykvm::MachineOptions options { .max_mem = MAX_MEMORY };
+	const tinykvm::ProgramImage image { {(const char*)binary.data(), binary.size()}, options };
+	REQUIRE(image.memory_size() > 0);
+	REQUIRE(image.memory_size() < MAX_MEMORY / 4);
+
+	tinykvm::Machine cold { binary, options };
+	for (int i = 0; i < 2; i++)
+	{
+		tinykvm::Machine machine { image, options };
+		REQUIRE(machine.binary().data() == image.binary().data());
+		REQUIRE(machine.start_address() == cold.start_address());
+		REQUIRE(machine.stack_address() == cold.stack_address());
+		REQUIRE(machine.heap_address() == cold.heap_address());
+		REQUIRE(machine.kernel_end_address() == cold.kernel_end_address());
+		REQUIRE(machine.mmap_cache().current() == cold.mmap_cache().current());
+		REQUIRE(machine.registers().rip == cold.registers().rip);
+		REQUIRE(machine.registers().rsp == cold.registers().rsp);
+		REQUIRE(machine.address_of("main") == cold.address_of("main"));
+		// The same memory, apart from the KVM clock in the interrupt page
+		const auto& mem = machine.main_memory();
+		const auto& cold_mem = cold.main_memory();
+		REQUIRE(std::memcmp(mem.ptr, cold_mem.ptr, 0x2000) == 0);
+		REQUIRE(std::memcmp(mem.ptr + 0x3000, cold_mem.ptr + 0x3000, mem.size - 0x3000) == 0);
+	}
+	// The memory layout must match the image
+	REQUIRE_THROWS([&] {
+		tinykvm::Machine machine { image, { .max_mem = MAX_MEMORY * 2 } };
+	}());
+}
+
+TEST_CASE("Cache relocated dynamic executables", "[Instantiate]")
+{
+	extern std::vector<uint8_t> load_file(const std::string& filename);
+	const auto ld_so = load_file("/lib64/ld-linux-x86-64.so.2");
+	tinykvm::ProgramImage::clear_cache();
+
+	tinykvm::Machine cold { ld_so, { .max_mem = MAX_MEMORY } };
+	REQUIRE(cold.is_dynamic());
+	const tinykvm::MachineOptions options {
+		.max_mem = MAX_MEMORY, .cache_dynamic_images = true };
+	tinykvm::Machine first { ld_so, options };
+	tinykvm::Machine second { ld_so, options };
+	REQUIRE(tinykvm::ProgramImage::cache_size() == 1);
+	// Both machines use the same relocated image
+	REQUIRE(first.binary().data() == second.binary().data());
+	REQUIRE(first.binary() == cold.binary());
+	for (auto* machine : { &first, &second }) {
+		REQUIRE(machine->is_dynamic());
+		REQUIRE(machine->image_base() == cold.image_base());
+		REQUIRE(machine->start_address() == cold.start_address());
+		REQUIRE(machine->registers().rip == cold.registers().rip);
+		const auto& mem = machine->main_memory();
+		REQUIRE(std::memcmp(mem.ptr + 0x3000, cold.main_memory().ptr + 0x3000, mem.size - 0x3000) == 0);
+	}
+	// A different layout is a different image
+	tinykvm::Machine other { ld_so, { .max_mem = MAX_MEMORY,
+		.dylink_address_hint = 0x400000, .cache_dynamic_images = true } };
+	REQUIRE(other.image_base() == 0x400000);
+	REQUIRE(tinykvm::ProgramImage::cache_size() == 2);
+	// Machines keep their image alive
+	tinykvm::ProgramImage::clear_cache();
+	REQUIRE(first.address_of("_dl_start") == cold.address_of("_dl_start"));
+}
+
+TEST_CASE("Fill in page tables lazily", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const uint64_t GUEST_MEMORY = 4ULL << 30; /* 4GB */
+	tinykvm::Machine eager { binary, { .max_mem = GUEST_MEMORY } };
+	tinykvm::Machine lazy { binary, { .max_mem = GUEST_MEMORY, .lazy_page_tables = true } };
+	REQUIRE(eager.kernel_end_address() == lazy.kernel_end_address());
+	auto page_tables = [] (tinykvm::Machine& machine) {
+		const uint64_t begin = 0x9000; /* PT_ADDR */
+		const auto* ptr = machine.main_memory().ptr;
+		return std::string(ptr + begin, ptr + machine.kernel_end_address());
+	};
+	REQUIRE(page_tables(eager) != page_tables(lazy));
+
+	// The host fills in a gigapage when it is first used
+	const uint64_t addr = (3ULL << 30) + 0x1000;
+	REQUIRE(lazy.main_memory().get_userpage_at(addr) == lazy.main_memory().ptr + addr);
+	lazy.copy_to_guest(addr, "lazy", 5);
+	char buffer[8] {};
+	lazy.copy_from_guest(buffer, addr, 5);
+	REQUIRE(std::string(buffer) == "lazy");
+
+	// Forks share the page tables, which are completed first
+	eager.prepare_copy_on_write();
+	lazy.prepare_copy_on_write();
+	REQUIRE(page_tables(eager) == page_tables(lazy));
+	tinykvm::Machine fork { lazy, { .max_mem = GUEST_MEMORY, .max_cow_mem = MAX_COWMEM } };
+	fork.copy_from_guest(buffer, addr, 5);
+	REQUIRE(std::string(buffer) == "lazy");
+}
+
+TEST_CASE("Take pre-created VMs from the KVM pool", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	tinykvm::Machine cold { binary, { .max_mem = MAX_MEMORY } };
+
+	auto& pool = tinykvm::KvmPool::get();
+	REQUIRE(!pool.running());
+	pool.start(4);
+	pool.wait_until_full();
+	REQUIRE(pool.stats().ready == 4);
+	{
+		tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+		REQUIRE(pool.stats().taken == 1);
+		REQUIRE(machine.registers().rip == cold.registers().rip);
+		REQUIRE(machine.get_special_registers().cr3 == cold.get_special_registers().cr3);
+
+		machine.prepare_copy_on_write();
+		tinykvm::Machine fork { machine, { .max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM } };
+		REQUIRE(pool.stats().taken == 2);
+		REQUIRE(fork.registers().rip == machine.registers().rip);
+	}
+	// The pool is refilled in the background
+	pool.wait_until_full();
+	REQUIRE(pool.stats().ready == 4);
+	REQUIRE(pool.stats().created >= 6);
+
+	pool.stop();
+	REQUIRE(!pool.running());
+	REQUIRE(pool.stats().ready == 0);
+	// Machines create their own VMs when the pool is stopped
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	REQUIRE(pool.stats().taken == 2);
+}
+
+TEST_CASE("Present a CPU baseline to the guest", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	auto get_cpuid = [] (const tinykvm::Machine& machine, uint32_t function, uint32_t index) {
+		struct {
+			__u32 nent;
+			__u32 padding;
+			struct kvm_cpuid_entry2 entries[100];
+		} cpuid {};
+		cpuid.nent = 100;
+		REQUIRE(ioctl(machine.cpu().fd, KVM_GET_CPUID2, &cpuid) == 0);
+		for (uint32_t i = 0; i < cpuid.nent; i++)
+			if (cpuid.entries[i].function == function && cpuid.entries[i].index == index)
+				return cpuid.entries[i];
+		return kvm_cpuid_entry2 {};
+	};
+	auto get_xcr0 = [] (const tinykvm::Machine& machine) {
+		struct kvm_xcrs xcrs {};
+		REQUIRE(ioctl(machine.cpu().fd, KVM_GET_XCRS, &xcrs) == 0);
+		return xcrs.xcrs[0].value;
+	};
+	REQUIRE(tinykvm::Machine::cpu_baseline_supported(tinykvm::CPUBaseline::Host));
+	if (!tinykvm::Machine::cpu_baseline_supported(tinykvm::CPUBaseline::X86_64_V2)) {
+		// Eg. nested KVM that hides most of the host CPU features
+		REQUIRE_THROWS([&] {
+			tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY,
+				.cpu_baseline = tinykvm::CPUBaseline::X86_64_V2 } };
+		}());
+		return;
+	}
+	const std::string base = "/tmp/tinykvm-baseline-" + std::to_string(getpid());
+	unlink(base.c_str());
+	{
+		tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY,
+			.cpu_baseline = tinykvm::CPUBaseline::X86_64_V2, .snapshot_file = base } };
+		REQUIRE(machine.cpu_baseline() == tinykvm::CPUBaseline::X86_64_V2);
+		// SSE4.2 is in the baseline, AVX and AVX2 are not
+		REQUIRE((get_cpuid(machine, 0x1, 0).ecx & (1u << 20)) != 0);
+		REQUIRE((get_cpuid(machine, 0x1, 0).ecx & (1u << 28)) == 0);
+		REQUIRE((get_cpuid(machine, 0x7, 0).ebx & (1u << 5)) == 0);
+		REQUIRE((get_cpuid(machine, 0xD, 0).eax & ~0x3u) == 0);
+		REQUIRE(get_xcr0(machine) == 0x3);
+
+		// Forks present the baseline of the master
+		machine.prepare_copy_on_write();
+		tinykvm::Machine fork { machine, { .max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM } };
+		REQUIRE(fork.cpu_baseline() == tinykvm::CPUBaseline::X86_64_V2);
+		REQUIRE((get_cpuid(fork, 0x1, 0).ecx & (1u << 28)) == 0);
+		REQUIRE(get_xcr0(fork) == 0x3);
+	}
+	{
+		tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY,
+			.cpu_baseline = tinykvm::CPUBaseline::X86_64_V2, .snapshot_file = base } };
+		machine.save_snapshot_state_now();
+	}
+	// The snapshot can only be loaded with the same baseline
+	{
+		tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY,
+			.cpu_baseline = tinykvm::CPUBaseline::X86_64_V2, .snapshot_file = base } };
+		REQUIRE(machine.has_snapshot_state());
+		REQUIRE(get_xcr0(machine) == 0x3);
+	}
+	REQUIRE_THROWS([&] {
+		tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY, .snapshot_file = base } };
+	}());
+	unlink(base.c_str());
+
+	// The host default is unchanged
+	tinykvm::Machine host { binary, { .max_mem = MAX_MEMORY } };
+	REQUIRE(host.cpu_baseline() == tinykvm::CPUBaseline::Host);
+	REQUIRE((get_xcr0(host) & 0x7) == 0x7);
+}
+
+TEST_CASE("Stream through a ring channel between VMs", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const uint64_t GUEST_MEMORY = 32ULL << 20; /* 32MB */
+	tinykvm::Machine producer { binary, { .max_mem = GUEST_MEMORY } };
+	tinykvm::Machine consumer { binary, { .max_mem = GUEST_MEMORY } };
+	producer.setup_linux({"producer"}, env);
+	consumer.setup_linux({"consumer"}, env);
+	tinykvm::Channel channel { 64 * 1024 };
+	REQUIRE(channel.size() == 2ULL << 20);
+	REQUIRE(channel.capacity() == channel.size() - tinykvm::Channel::HEADER_SIZE);
+
+	const auto paddr = producer.map_channel(channel);
+	const auto caddr = consumer.map_channel(channel);
+	REQUIRE((paddr & 0x1FFFFF) == 0);
+	REQUIRE((caddr & 0x1FFFFF) == 0);
+	// Both VMs see the same memory, without copies
+	REQUIRE(producer.main_memory().get_userpage_at(paddr) == channel.ptr());
+	REQUIRE(consumer.main_memory().get_userpage_at(caddr) == channel.ptr());
+	const auto data_offset = tinykvm::Channel::HEADER_SIZE;
+	auto* ppage = producer.main_memory().get_userpage_at(paddr + data_offset);
+	auto* cpage = consumer.main_memory().get_userpage_at(caddr + data_offset);
+	std::memcpy(ppage, "Hello Channel", 14);
+	REQUIRE(std::string(cpage) == "Hello Channel");
+	const auto& header = *(const tinykvm::Channel::Header *)consumer.main_memory().get_userpage_at(caddr);
+	REQUIRE(header.magic == tinykvm::Channel::MAGIC);
+	REQUIRE(header.capacity == channel.capacity());
+
+	// The ring wraps around, and never overfills
+	std::vector<uint8_t> data(channel.capacity() - 100);
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = i & 0xFF;
+	REQUIRE(channel.write(data.data(), data.size()) == data.size());
+	std::vector<uint8_t> result(data.size());
+	REQUIRE(channel.read(result.data(), result.size()) == result.size());
+	REQUIRE(result == data);
+	REQUIRE(channel.write(data.data(), data.size()) == data.size());
+	REQUIRE(channel.write(data.data(), data.size()) == 100);
+	REQUIRE(channel.writable() == 0);
+	REQUIRE(channel.read(result.data(), result.size()) == result.size());
+	REQUIRE(result == data);
+	REQUIRE(channel.readable() == 100);
+	REQUIRE(header.head - header.tail == 100);
+}
+
+TEST_CASE("Chain VMs in a pipeline", "[Pipeline]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+}
+extern long upper(const char* in, unsigned long len, char* out, unsigned long cap) {
+	if (len > cap)
+		return -1;
+	for (unsigned long i = 0; i < len; i++)
+		out[i] = (in[i] >= 'a' && in[i] <= 'z') ? in[i] - 32 : in[i];
+	return len;
+}
+extern long reverse(const char* in, unsigned long len, char* out, unsigned long cap) {
+	if (len > cap)
+		return -1;
+	for (unsigned long i = 0; i < len; i++)
+		out[i] = in[len - 1 - i];
+	return len;
+}
+extern long fail(const char* in, unsigned long len, char* out, unsigned long cap) {
+	return -1;
+})M");
+	const uint64_t GUEST_MEMORY = 32ULL << 20; /* 32MB */
+	tinykvm::Machine decode { binary, { .max_mem = GUEST_MEMORY } };
+	tinykvm::Machine encode { binary, { .max_mem = GUEST_MEMORY } };
+	decode.setup_linux({"decode"}, env);
+	encode.setup_linux({"encode"}, env);
+	decode.run(4.0f);
+	encode.run(4.0f);
+
+	const size_t ITEMS = 20;
+	std::vector<std::string> results(ITEMS);
+	{
+		tinykvm::Pipeline pipeline {{
+			{ &decode, decode.address_of("upper") },
+			{ &encode, encode.address_of("reverse") },
+		}, { .depth = 2, .slot_size = 4096, .threads = 2 }};
+		REQUIRE(pipeline.stages() == 2);
+
+		std::mutex mtx;
+		for (size_t i = 0; i < ITEMS; i++) {
+			pipeline.submit("item-" + std::to_string(i),
+				[&, i] (std::string_view output, std::exception_ptr error) {
+					std::scoped_lock lock(mtx);
+					results[i] = error ? "error" : std::string(output);
+				});
+			/* Backpressure */
+			REQUIRE(pipeline.in_flight() <= 2);
+		}
+		pipeline.wait_idle();
+		REQUIRE(pipeline.in_flight() == 0);
+	}
+	for (size_t i = 0; i < ITEMS; i++) {
+		std::string expected = "ITEM-" + std::to_string(i);
+		std::reverse(expected.begin(), expected.end());
+		REQUIRE(results[i] == expected);
+	}
+
+	/* A failing stage ends the item with an error */
+	tinykvm::Machine broken { binary, { .max_mem = GUEST_MEMORY } };
+	broken.setup_linux({"broken"}, env);
+	broken.run(4.0f);
+	tinykvm::Pipeline pipeline {{
+		{ &broken, broken.address_of("fail") },
+		{ &encode, encode.address_of("reverse") },
+	}, { .depth = 1, .slot_size = 4096 }};
+	bool failed = false;
+	pipeline.submit("data", [&] (std::string_view output, std::exception_ptr error) {
+		failed = error != nullptr && output.empty();
+	});
+	pipeline.wait_idle();
+	REQUIRE(failed);
+	REQUIRE_THROWS_AS(pipeline.submit(std::string(8192, 'x'), nullptr), tinykvm::MachineException);
+}
+
+TEST_CASE("Large host-side copies and gathers across page tables", "[Memory]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const uint64_t GUEST_MEMORY = 64ULL << 20; /* 64MB */
+	const size_t LEN = 6ULL << 20; /* Crosses several page tables */
+	tinykvm::Machine master { binary, { .max_mem = MAX_MEMORY } };
+	master.setup_linux({"master"}, env);
+	const auto addr = master.mmap_allocate(LEN + 4096) + 123;
+
+	std::vector<uint8_t> pattern(LEN);
+	for (size_t i = 0; i < LEN; i++)
+		pattern[i] = uint8_t(i * 7 + (i >> 12));
+	master.copy_to_guest(addr, pattern.data(), LEN);
+	master.prepare_copy_on_write();
+
+	tinykvm::Machine fork { master, {
+		.max_mem = GUEST_MEMORY, .max_cow_mem = MAX_COWMEM, .split_hugepages = true
+	} };
+	std::vector<uint8_t> result(LEN);
+	fork.copy_from_guest(result.data(), addr, LEN);
+	REQUIRE(result == pattern);
+
+	std::vector<tinykvm::Machine::Buffer> buffers;
+	fork.gather_buffers_from_range(buffers, addr, LEN);
+	size_t offset = 0;
+	for (const auto& buffer : buffers) {
+		REQUIRE(std::memcmp(buffer.ptr, &pattern[offset], buffer.len) == 0);
+		offset += buffer.len;
+	}
+	REQUIRE(offset == LEN);
+
+	// Some pages are already private, the rest are copied on write
+	fork.copy_to_guest(addr + 3 * 4096, "Private", 8);
+	for (size_t i = 0; i < LEN; i++)
+		pattern[i] = uint8_t(i * 13);
+	fork.copy_to_guest(addr, pattern.data(), LEN);
+	fork.copy_from_guest(result.data(), addr, LEN);
+	REQUIRE(result == pattern);
+
+	tinykvm::Machine::Buffer array[1024];
+	const size_t count = fork.gather_buffers_from_range(1024, array, addr, LEN);
+	offset = 0;
+	for (size_t i = 0; i < count; i++) {
+		REQUIRE(std::memcmp(array[i].ptr, &pattern[offset], array[i].len) == 0);
+		offset += array[i].len;
+	}
+	REQUIRE(offset == LEN);
+
+	// The master is unchanged
+	master.copy_from_guest(result.data(), addr, LEN);
+	REQUIRE(result[0] == uint8_t(0));
+	REQUIRE(result[LEN - 1] == uint8_t((LEN - 1) * 7 + ((LEN - 1) >> 12)));
+}
+
+TEST_CASE("Harvest accessed pages incrementally", "[Output]")
+{
+	const auto binary = build_and_load(R"M(
+char buffer[4 * 4096];
+int main() {
+	return 0;
+}
+extern void touch(int page) {
+	buffer[page * 4096] = 1;
+})M");
+
+	tinykvm::Machine master { binary, { .max_mem = MAX_MEMORY } };
+	master.setup_linux({"harvest"}, env);
+	master.run(4.0f);
+	master.prepare_copy_on_write();
+	tinykvm::Machine fork { master, {
+		.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM, .split_hugepages = true
+	} };
+	const auto buffer = fork.address_of("buffer");
+
+	std::array<tinykvm::AccessedPage, 4096> pages;
+	const auto harvest = [&] (size_t max) {
+		std::vector<tinykvm::AccessedPage> result;
+		size_t count;
+		do {
+			count = fork.harvest_accessed_pages(pages.data(), max);
+			result.insert(result.end(), pages.begin(), pages.begin() + count);
+		} while (count == max);
+		return result;
+	};
+	const auto find = [] (const auto& result, uint64_t addr) -> const tinykvm::AccessedPage* {
+		for (const auto& page : result) {
+			if (addr >= page.addr && addr < page.addr + page.size)
+				return &page;
+		}
+		return nullptr;
+	};
+
+	fork.timed_vmcall(fork.address_of("touch"), 4.0f, 2);
+	auto result = harvest(pages.size());
+	REQUIRE(find(result, buffer + 2 * 4096) != nullptr);
+	REQUIRE(find(result, buffer + 2 * 4096)->dirty);
+	REQUIRE(find(result, buffer + 3 * 4096) == nullptr);
+
+	// The accessed and dirty bits were cleared by the harvest
+	fork.timed_vmcall(fork.address_of("touch"), 4.0f, 1);
+	fork.timed_vmcall(fork.address_of("touch"), 4.0f, 3);
+	// A small buffer continues where the previous call stopped
+	result = harvest(1);
+	REQUIRE(find(result, buffer + 1 * 4096) != nullptr);
+	REQUIRE(find(result, buffer + 3 * 4096) != nullptr);
+	REQUIRE(find(result, buffer + 3 * 4096)->dirty);
+	REQUIRE(find(result, buffer + 2 * 4096) == nullptr);
+}
+
+TEST_CASE("Every page kernel copies and zeroes pages", "[Memory]")
+{
+	static constexpr size_t PAGES = 64;
+	std::vector<uint64_t> buffer(2 * PAGES * 512 + 512);
+	// Page-aligned source and destination
+	auto* src = (uint64_t *)(((uintptr_t)buffer.data() + 4095) & ~uintptr_t(4095));
+	auto* dst = src + PAGES * 512;
+	for (size_t i = 0; i < PAGES * 512; i++)
+		src[i] = i * 0x9E3779B97F4A7C15ULL;
+	const auto zeroed = [] (const uint64_t* page, size_t pages) {
+		return std::all_of(page, page + pages * 512, [] (uint64_t v) { return v == 0; });
+	};
+
+	for (const bool streaming : { false, true }) {
+		const auto kernels = tinykvm::page_kernels(streaming);
+		REQUIRE(!kernels.empty());
+		// The selected kernel is the best one this CPU can run
+		const auto& selected = streaming ? tinykvm::page_stream_kernel : tinykvm::page_kernel;
+		REQUIRE(std::string(selected.name) == kernels.front().name);
+		for (const auto& kernel : kernels) {
+			std::fill(dst, dst + 3 * 512, ~0ULL);
+			kernel.duplicate(dst + 512, src + 512);
+			tinykvm::page_stream_fence();
+			REQUIRE(std::memcmp(dst + 512, src + 512, 4096) == 0);
+			// Neighbouring pages are untouched
+			REQUIRE(dst[511] == ~0ULL);
+			REQUIRE(dst[1024] == ~0ULL);
+			kernel.memzero(dst + 512);
+			tinykvm::page_stream_fence();
+			REQUIRE(zeroed(dst + 512, 1));
+			REQUIRE(dst[1024] == ~0ULL);
+		}
+	}
+	// Small batches stay in the cache, big ones are streamed
+	for (const size_t pages : { size_t(2), PAGES }) {
+		std::fill(dst, dst + PAGES * 512, ~0ULL);
+		tinykvm::pages_duplicate(dst, src, pages);
+		REQUIRE(std::memcmp(dst, src, pages * 4096) == 0);
+		tinykvm::pages_memzero(dst, pages);
+		REQUIRE(zeroed(dst, pages));
+	}
+}
+
+TEST_CASE("Masters share identical pages after deduplication", "[Memory]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const uint64_t GUEST_MEMORY = 32ULL << 20; /* 32MB */
+	auto& store = tinykvm::PageDedupStore::get();
+	const size_t references = store.references();
+	std::vector<char> pattern(16 * 4096);
+	for (size_t i = 0; i < pattern.size(); i++)
+		pattern[i] = char(i * 7 + (i >> 12));
+	{
+		std::unique_ptr<tinykvm::Machine> masters[2];
+		uint64_t addr = 0;
+		for (auto& master : masters) {
+			master.reset(new tinykvm::Machine { binary, { .max_mem = GUEST_MEMORY } });
+			master->setup_linux({"master"}, env);
+			addr = master->mmap_allocate(pattern.size());
+			master->copy_to_guest(addr, pattern.data(), pattern.size());
+			master->prepare_copy_on_write();
+		}
+		masters[0]->deduplicate_pages();
+		// Everything the second master has in common is now shared
+		REQUIRE(masters[1]->deduplicate_pages() >= pattern.size() / 4096);
+		REQUIRE(store.references() > store.pool_pages());
+
+		tinykvm::Machine fork { *masters[1], {
+			.max_mem = GUEST_MEMORY, .max_cow_mem = MAX_COWMEM
+		} };
+		std::vector<char> readback(pattern.size());
+		fork.copy_from_guest(readback.data(), addr, readback.size());
+		REQUIRE(readback == pattern);
+		// Writes make private copies
+		fork.copy_to_guest(addr, "Forked", 7);
+		REQUIRE(fork.buffer_to_string(addr, 6) == "Forked");
+		for (auto& master : masters) {
+			master->copy_from_guest(readback.data(), addr, readback.size());
+			REQUIRE(readback == pattern);
+		}
+		// The host can still write to a master
+		std::memcpy(masters[0]->main_memory().ptr + (addr - masters[0]->main_memory().physbase), "Master", 7);
+		REQUIRE(masters[0]->buffer_to_string(addr, 6) == "Master");
+		masters[1]->copy_from_guest(readback.data(), addr, readback.size());
+		REQUIRE(readback == pattern);
+	}
+	// Destroying the masters releases their pool pages
+	REQUIRE(store.references() == references);
+}
+
+TEST_CASE("Released pages read as zeroes and are reused", "[Memory]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const uint64_t GUEST_MEMORY = 32ULL << 20; /* 32MB */
+	tinykvm::Machine master { binary, { .max_mem = MAX_MEMORY } };
+	master.setup_linux({"master"}, env);
+	const auto addr = master.mmap_allocate(4ULL << 20);
+	const uint64_t huge = (addr + (2ULL << 20) - 1) & ~((2ULL << 20) - 1);
+	master.copy_to_guest(addr, "Master", 7);
+	master.prepare_copy_on_write();
+	const auto zeroed = [] (const std::vector<char>& v) {
+		return std::all_of(v.begin(), v.end(), [] (char c) { return c == 0; });
+	};
+
+	tinykvm::MachineOptions options {
+		.max_mem = GUEST_MEMORY, .max_cow_mem = MAX_COWMEM, .split_hugepages = true
+	};
+	tinykvm::Machine fork { master, options };
+	std::vector<char> data(64 * 4096, 'x');
+	fork.copy_to_guest(addr, data.data(), data.size());
+	const size_t used = fork.banked_memory_pages();
+	const size_t allocated = fork.banked_memory_allocated_pages();
+
+	// Only whole pages are released, and the first page is kept
+	REQUIRE(fork.release_pages(addr + 4096, 63 * 4096 - 1) == 62);
+	REQUIRE(fork.banked_memory_pages() == used - 62);
+	REQUIRE(fork.buffer_to_string(addr, 4) == "xxxx");
+	std::vector<char> readback(62 * 4096, 'y');
+	fork.copy_from_guest(readback.data(), addr + 4096, readback.size());
+	REQUIRE(zeroed(readback));
+	REQUIRE(fork.buffer_to_string(addr + 63 * 4096, 4) == "xxxx");
+	// Nothing private is left to release
+	REQUIRE(fork.release_pages(addr + 4096, 62 * 4096) == 0);
+
+	// Writing again takes the released pages before anything new
+	fork.copy_to_guest(addr + 4096, data.data(), 62 * 4096);
+	REQUIRE(fork.banked_memory_pages() == used);
+	REQUIRE(fork.banked_memory_allocated_pages() == allocated);
+	REQUIRE(fork.buffer_to_string(addr + 4096, 4) == "xxxx");
+
+	fork.release_pages(addr, 64 * 4096);
+	REQUIRE(fork.reset_to(master, options));
+	REQUIRE(fork.buffer_to_string(addr, 6) == "Master");
+
+	// Forks that copy whole 2MB pages give them back too
+	options.split_hugepages = false;
+	tinykvm::Machine hfork { master, options };
+	hfork.copy_to_guest(huge, data.data(), data.size());
+	REQUIRE(hfork.release_pages(huge, 2ULL << 20) == 512);
+	readback.resize(2ULL << 20, 'y');
+	hfork.copy_from_guest(readback.data(), huge, readback.size());
+	REQUIRE(zeroed(readback));
+	hfork.copy_to_guest(huge + 4096, "Forked", 7);
+	REQUIRE(hfork.buffer_to_string(huge + 4096, 6) == "Forked");
+	REQUIRE(master.buffer_to_string(addr, 6) == "Master");
+}
+
+TEST_CASE("Memory stats break down the working memory", "[Memory]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const uint64_t GUEST_MEMORY = 32ULL << 20; /* 32MB */
+	tinykvm::Machine master { binary, { .max_mem = MAX_MEMORY } };
+	master.setup_linux({"master"}, env);
+	const auto addr = master.mmap_allocate(4ULL << 20);
+	master.copy_to_guest(addr, "Master", 7);
+	master.prepare_copy_on_write();
+
+	tinykvm::MachineOptions options {
+		.max_mem = GUEST_MEMORY, .max_cow_mem = MAX_COWMEM, .split_hugepages = true
+	};
+	tinykvm::Machine fork { master, options };
+	const auto before = fork.memory_stats();
+	// Two pages written by the host, each either copied or zeroed
+	fork.copy_to_guest(addr, "Forked", 7);
+	std::vector<char> page(4096, 'x');
+	fork.copy_to_guest(addr + 0x10000, page.data(), page.size());
+	const auto stats = fork.memory_stats();
+	REQUIRE(stats.used_pages == fork.banked_memory_pages());
+	REQUIRE(stats.peak_used_pages == stats.used_pages);
+	REQUIRE(stats.capacity_pages == fork.banked_memory_capacity_pages());
+	REQUIRE((stats.copied_pages + stats.zeroed_pages)
+		- (before.copied_pages + before.zeroed_pages) == 2);
+	REQUIRE(stats.table_pages > 0);
+	REQUIRE(stats.copied_pages + stats.zeroed_pages + stats.table_pages == stats.used_pages);
+	REQUIRE(stats.mmap_pages - before.mmap_pages == 2);
+	REQUIRE(stats.mapped_table_pages > 0);
+
+	// The high-water mark survives released pages, until the next reset
+	REQUIRE(fork.release_pages(addr, 0x20000) == 2);
+	const auto released = fork.memory_stats();
+	REQUIRE(released.used_pages == stats.used_pages - 2);
+	REQUIRE(released.peak_used_pages == stats.used_pages);
+	REQUIRE(released.mmap_pages == before.mmap_pages);
+	REQUIRE(fork.reset_to(master, options));
+	const auto reset = fork.memory_stats();
+	REQUIRE(reset.copied_pages == 0);
+	REQUIRE(reset.peak_used_pages == reset.used_pages);
+}
+
+TEST_CASE("Memory pressure is relieved by handing back pages", "[Memory]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const uint64_t GUEST_MEMORY = 32ULL << 20; /* 32MB */
+	tinykvm::Machine master { binary, { .max_mem = MAX_MEMORY } };
+	master.setup_linux({"master"}, env);
+	const auto addr = master.mmap_allocate(4ULL << 20);
+	master.prepare_copy_on_write();
+
+	tinykvm::MachineOptions options {
+		.max_mem = GUEST_MEMORY, .max_cow_mem = MAX_COWMEM,
+		.split_hugepages = true, .shared_bank_arena = true
+	};
+	tinykvm::Machine fork { master, options };
+	std::vector<char> data(64 * 4096, 'x');
+	fork.copy_to_guest(addr, data.data(), data.size());
+	REQUIRE(fork.memory_pressure() == 0);
+
+	// The guest polls the pressure, and hands back a range
+	fork.set_memory_pressure(100);
+	auto& regs = fork.registers();
+	regs.rdi = 0;
+	fork.memory_balloon(fork.cpu());
+	REQUIRE(fork.registers().rax == 100);
+	regs = fork.registers();
+	regs.rdi = 1;
+	regs.rsi = addr;
+	regs.rdx = 32 * 4096;
+	fork.memory_balloon(fork.cpu());
+	REQUIRE(fork.registers().rax == 32);
+	REQUIRE(fork.memory_pressure() == 68);
+	// Pages unmapped by the guest count too
+	REQUIRE(fork.release_pages(addr + 32 * 4096, 32 * 4096) == 32);
+	REQUIRE(fork.memory_pressure() == 36);
+
+	// Arena banks keep their pages across resets, until trimmed
+	fork.copy_to_guest(addr, data.data(), data.size());
+	REQUIRE(fork.reset_to(master, options));
+	const size_t reclaimable = fork.reclaimable_pages();
+	REQUIRE(reclaimable >= 64);
+	REQUIRE(fork.trim_working_memory() == reclaimable);
+	REQUIRE(fork.reclaimable_pages() == 0);
+	fork.copy_to_guest(addr + 4096, "Forked", 7);
+	REQUIRE(fork.buffer_to_string(addr + 4096, 6) == "Forked");
+	REQUIRE(fork.buffer_to_string(addr, 4) == std::string(4, '\0'));
+}
+
+TEST_CASE("Sparse main memory only costs what is used", "[Memory]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const uint64_t GUEST_MEMORY = 1ULL << 30; /* 1GB */
+	tinykvm::Machine master { binary, {
+		.max_mem = GUEST_MEMORY, .sparse_main_memory = true
+	} };
+	master.setup_linux({"master"}, env);
+	master.run(4.0f);
+	const size_t baseline = master.memory_stats().resident_main_pages;
+	REQUIRE(baseline < GUEST_MEMORY / 4096 / 8);
+
+	// Large zeroed ranges stay unpopulated
+	const auto addr = master.mmap_allocate(256ULL << 20);
+	master.memzero(addr, 256ULL << 20);
+	REQUIRE(master.memory_stats().resident_main_pages < baseline + 16);
+
+	// Unmapped ranges are given back
+	std::vector<char> data(64 * 4096, 'x');
+	master.copy_to_guest(addr, data.data(), data.size());
+	REQUIRE(master.release_pages(addr + 32 * 4096, 32 * 4096) == 32);
+	REQUIRE(master.buffer_to_string(addr + 31 * 4096, 4) == "xxxx");
+	REQUIRE(master.buffer_to_string(addr + 32 * 4096, 4) == std::string(4, '\0'));
+
+	// Pages that were written back to zero are reclaimed when forking
+	std::vector<char> zeroes(16 * 4096, 0);
+	master.copy_to_guest(addr + 0x100000, data.data(), zeroes.size());
+	master.copy_to_guest(addr + 0x100000, zeroes.data(), zeroes.size());
+	const size_t resident = master.memory_stats().resident_main_pages;
+	master.prepare_copy_on_write();
+	REQUIRE(master.memory_stats().resident_main_pages <= resident - 16);
+
+	tinykvm::Machine fork { master, {
+		.max_mem = GUEST_MEMORY, .max_cow_mem = MAX_COWMEM
+	} };
+	REQUIRE(fork.buffer_to_string(addr, 4) == "xxxx");
+	REQUIRE(fork.buffer_to_string(addr + 0x100000, 4) == std::string(4, '\0'));
+	fork.timed_vmcall(fork.address_of("main"), 4.0f);
+	REQUIRE(fork.return_value() == 0);
+}
@@ -8,8 +8,10 @@ static constexpr bool VERBOSE_COMPILER = true;
 
 std::string compile_command(const std::string& cc,
 	const std::string& outfile, const std::string& codefile,
-	const std::string& arguments)
+	const std::string& arguments, bool cxx)
 {
+	if (cxx)
+		return cc + " -O2 -static -std=c++17 " + arguments + " -x c++ -o " + outfile + " " + codefile;
 	return cc + " -O2 -static -std=c11 " + arguments + " -x c -o " + outfile + " " + codefile;
 }
 std::string env_with_default(const char* var, const std::string& defval) {
@@ -38,7 +40,7 @@ std::vector<uint8_t> load_file(const std::string& filename)
 	return result;
 }
 
-std::string build(const std::string& code, const std::string& compiler_args)
+std::string build(const std::string& code, const std::string& compiler_args, bool cxx = false)
 {
 	// Create temporary filenames for code and binary
 	char code_filename[64];
@@ -62,7 +64,7 @@ std::string build(const std::string& code, const std::string& compiler_args)
 		"/tmp/binary-%08X", checksum);
 
 	auto cc = env_with_default("CC", "gcc");
-	auto command = compile_command(cc, bin_filename, code_filename, compiler_args);
+	auto command = compile_command(cc, bin_filename, code_filename, compiler_args, cxx);
 	if constexpr (VERBOSE_COMPILER) {
 		printf("Command: %s\n", command.c_str());
 	}
@@ -89,3 +91,8 @@ std::pair<
 	const auto file = build(code, args);
 	return {file, load_file(file)};
 }
+/* C++ guest programs that use the guest API in guest/src/api.hpp */
+std::vector<uint8_t> build_and_load_guest_api(const std::string& code)
+{
+	return load_file(build(code, "-I" GUEST_API_DIR, true));
+}
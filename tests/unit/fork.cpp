@@ -1,8 +1,16 @@
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/matchers/catch_matchers_string.hpp>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
+#include <tinykvm/amd64/amd64.hpp>
+#include <tinykvm/amd64/paging.hpp>
+#include <tinykvm/channel.hpp>
 #include <tinykvm/machine.hpp>
+#include <tinykvm/shared_data.hpp>
+#include <tinykvm/smp.hpp>
 extern std::vector<uint8_t> build_and_load(const std::string& code);
+extern std::vector<uint8_t> build_and_load_guest_api(const std::string& code);
 static const uint64_t MAX_MEMORY = 8ul << 20; /* 8MB */
 static const uint64_t MAX_COWMEM = 3ul << 20; /* 1MB */
 static const std::vector<std::string> env {
@@ -99,6 +107,366 @@ extern void callable_function() {
 	}());
 }
 
+TEST_CASE("Copy whole hugepages in the mmap arena", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+}
+extern long touch(char *area, unsigned long size) {
+	long sum = 0;
+	for (unsigned long i = 0; i < size; i += 4096) {
+		sum += area[i];
+		area[i] = 1;
+	}
+	return sum;
+})M");
+
+	tinykvm::Machine machine { binary, {
+		.max_mem = MAX_MEMORY,
+		.split_hugepages = true,
+	} };
+	machine.setup_linux({"fork"}, env);
+	machine.run(4.0f);
+	machine.prepare_copy_on_write(0);
+
+	const size_t size = 2UL << 20;
+	const auto area = machine.mmap_allocate(size);
+	const tinykvm::MachineOptions split_options {
+		.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM,
+		.split_hugepages = true,
+	};
+	tinykvm::MachineOptions hugepage_options = split_options;
+	hugepage_options.hugepage_cow_mmap = true;
+
+	auto fork1 = tinykvm::Machine { machine, split_options };
+	auto fork2 = tinykvm::Machine { machine, hugepage_options };
+	const auto n1 = fork1.banked_memory_pages();
+	const auto n2 = fork2.banked_memory_pages();
+
+	fork1.timed_vmcall(fork1.address_of("touch"), 4.0f, area, size);
+	REQUIRE(fork1.return_value() == 0);
+	fork2.timed_vmcall(fork2.address_of("touch"), 4.0f, area, size);
+	REQUIRE(fork2.return_value() == 0);
+
+	// Both forks see the same memory, but the hugepage fork
+	// copied at least one whole 2MB page, which the other did not
+	REQUIRE(fork2.banked_memory_pages() - n2 >= 512);
+	REQUIRE(fork1.banked_memory_pages() - n1 < fork2.banked_memory_pages() - n2);
+}
+
+TEST_CASE("Fault around sequential writes in a fork", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+}
+extern long touch(char *area, unsigned long size) {
+	long sum = 0;
+	/* Not at the start of each page */
+	for (unsigned long i = 100; i < size; i += 4096) {
+		sum += area[i];
+		area[i] = 1;
+	}
+	return sum;
+})M");
+
+	tinykvm::Machine machine { binary, {
+		.max_mem = MAX_MEMORY,
+		.split_hugepages = true,
+	} };
+	machine.setup_linux({"fork"}, env);
+	machine.run(4.0f);
+	machine.prepare_copy_on_write(0);
+
+	const size_t size = 2UL << 20;
+	const auto area = machine.mmap_allocate(size);
+	auto fork = tinykvm::Machine { machine, {
+		.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM,
+		.split_hugepages = true,
+		.page_fault_around = 32,
+	} };
+	auto baseline = tinykvm::Machine { machine, {
+		.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM,
+		.split_hugepages = true,
+		.page_fault_around = 0,
+	} };
+
+	// Pages prepared ahead of the guest keep their contents
+	fork.timed_vmcall(fork.address_of("touch"), 4.0f, area, size);
+	REQUIRE(fork.return_value() == 0);
+	const uint64_t fork_faults = fork.exit_counters().page_faults;
+	fork.timed_vmcall(fork.address_of("touch"), 4.0f, area, size);
+	REQUIRE(fork.return_value() == long(size / 4096));
+
+	// Without fault-around, every page is a page fault exit
+	baseline.timed_vmcall(baseline.address_of("touch"), 4.0f, area, size);
+	REQUIRE(baseline.return_value() == 0);
+	const uint64_t baseline_faults = baseline.exit_counters().page_faults;
+	REQUIRE(baseline_faults >= size / 4096);
+	REQUIRE(fork_faults * 4 < baseline_faults);
+}
+
+TEST_CASE("Map the shared zero page for zeroed memory in a fork", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+extern int madvise(void*, unsigned long, int);
+int main() {
+}
+extern long fill(char *area, unsigned long size, int value) {
+	long sum = 0;
+	for (unsigned long i = 0; i < size; i += 4096) {
+		sum += area[i];
+		area[i] = value;
+	}
+	return sum;
+}
+extern long discard(char *area, unsigned long size) {
+	madvise(area, size, 4 /* MADV_DONTNEED */);
+	long sum = 0;
+	for (unsigned long i = 0; i < size; i += 4096) {
+		sum += area[i];
+	}
+	return sum;
+})M");
+
+	tinykvm::Machine machine { binary, {
+		.max_mem = MAX_MEMORY,
+		.split_hugepages = true,
+	} };
+	machine.setup_linux({"fork"}, env);
+	machine.run(4.0f);
+
+	const size_t size = 2UL << 20;
+	const auto area = machine.mmap_allocate(size);
+	machine.timed_vmcall(machine.address_of("fill"), 4.0f, area, size, 1);
+	machine.prepare_copy_on_write(0);
+
+	auto fork = tinykvm::Machine { machine, {
+		.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM,
+		.split_hugepages = true,
+		.shared_zero_page = true,
+	} };
+	const auto n = fork.banked_memory_pages();
+
+	// Reading discarded memory sees zeroes without private pages
+	fork.timed_vmcall(fork.address_of("discard"), 4.0f, area, size);
+	REQUIRE(fork.return_value() == 0);
+	REQUIRE(fork.banked_memory_pages() - n < size / 4096 / 2);
+
+	// Writing allocates private pages, which start out zeroed
+	fork.timed_vmcall(fork.address_of("fill"), 4.0f, area, size, 2);
+	REQUIRE(fork.return_value() == 0);
+	fork.timed_vmcall(fork.address_of("fill"), 4.0f, area, size, 3);
+	REQUIRE(fork.return_value() == long(2 * (size / 4096)));
+}
+
+TEST_CASE("Flatten warmed-up master before forking", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+static int counter = 0;
+int main() {
+}
+extern int increment() {
+	return ++counter;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"fork"}, env);
+	machine.run(4.0f);
+
+	// Warm up the master using working memory
+	machine.prepare_copy_on_write(1UL << 20);
+	machine.timed_vmcall(machine.address_of("increment"), 4.0f);
+	machine.timed_vmcall(machine.address_of("increment"), 4.0f);
+	REQUIRE(machine.return_value() == 2);
+	REQUIRE(machine.banked_memory_pages() > 0);
+
+	// Flatten the banked pages back into main memory
+	machine.prepare_copy_on_write(0);
+	REQUIRE(machine.banked_memory_pages() == 0);
+
+	auto fork = tinykvm::Machine { machine, {
+		.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM
+	} };
+	// The fork sees the state the master had when flattened
+	fork.timed_vmcall(fork.address_of("increment"), 4.0f);
+	REQUIRE(fork.return_value() == 3);
+}
+
+TEST_CASE("Flatten every page written in working memory", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+static char buffer[16 * 4096];
+int main() {
+}
+extern char* fill(char value) {
+	for (unsigned i = 0; i < sizeof(buffer); i += 512)
+		buffer[i] = value;
+	return buffer;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"fork"}, env);
+	machine.run(4.0f);
+
+	// The writes land in banked pages
+	machine.prepare_copy_on_write(1UL << 20);
+	machine.timed_vmcall(machine.address_of("fill"), 4.0f, 'x');
+	const auto buffer = machine.return_value();
+	REQUIRE(machine.banked_memory_pages() >= 16);
+
+	machine.prepare_copy_on_write(0);
+	REQUIRE(machine.banked_memory_pages() == 0);
+
+	// No page is left behind in the banks
+	auto fork = tinykvm::Machine { machine, {
+		.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM
+	} };
+	std::vector<char> data(16 * 4096);
+	fork.copy_from_guest(data.data(), buffer, data.size());
+	for (size_t i = 0; i < data.size(); i += 512)
+		REQUIRE(data[i] == 'x');
+}
+
+TEST_CASE("Flatten banked pages with their own permissions", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+#include <sys/mman.h>
+static char buffer[4 * 4096] __attribute__((aligned(4096)));
+int main() {
+}
+extern char* fill(char value) {
+	for (unsigned i = 0; i < sizeof(buffer); i += 4096)
+		buffer[i] = value;
+	return buffer;
+}
+extern void protect() {
+	mprotect(&buffer[4096], 4096, PROT_READ);
+}
+extern void write_page(int page, char value) {
+	buffer[page * 4096] = value;
+})M");
+
+	// mprotect() is otherwise ignored, so this one changes the page table entries
+	const auto mprotect_handler = tinykvm::Machine::get_syscall_handler(SYS_mprotect);
+	tinykvm::Machine::install_syscall_handler(SYS_mprotect, [] (tinykvm::vCPU& cpu) {
+		auto regs = cpu.registers();
+		for (uint64_t addr = regs.rdi; addr < regs.rdi + regs.rsi; addr += 4096) {
+			tinykvm::page_at(cpu.machine().main_memory(), addr,
+				[&] (uint64_t, uint64_t& entry, size_t) {
+					if (!(regs.rdx & PROT_WRITE))
+						entry &= ~PDE64_RW;
+				});
+		}
+		regs.rax = 0;
+		cpu.set_registers(regs);
+	});
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"fork"}, env);
+	machine.run(4.0f);
+
+	// The writes land in banked pages, and one of them is made read-only
+	machine.prepare_copy_on_write(1UL << 20);
+	machine.timed_vmcall(machine.address_of("fill"), 4.0f, 'x');
+	const auto buffer = machine.return_value();
+	machine.timed_vmcall(machine.address_of("protect"), 4.0f);
+	tinykvm::Machine::install_syscall_handler(SYS_mprotect, mprotect_handler);
+
+	machine.prepare_copy_on_write(0);
+	REQUIRE(machine.banked_memory_pages() == 0);
+
+	auto fork = tinykvm::Machine { machine, {
+		.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM
+	} };
+	char value = 0;
+	fork.copy_from_guest(&value, buffer + 4096, 1);
+	REQUIRE(value == 'x');
+	// The read-only page stays read-only after flattening
+	fork.timed_vmcall(fork.address_of("write_page"), 4.0f, 0, 'y');
+	REQUIRE_THROWS([&] () {
+		fork.timed_vmcall(fork.address_of("write_page"), 4.0f, 1, 'y');
+	}());
+}
+
+TEST_CASE("Recycle fork memory banks through the shared arena", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+static int counter = 0;
+int main() {
+}
+extern int increment() {
+	return ++counter;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"fork"}, env);
+	machine.run(4.0f);
+	machine.prepare_copy_on_write(0);
+
+	auto& arena = tinykvm::MemoryBankArena::get();
+	arena.trim();
+	const tinykvm::MachineOptions options {
+		.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM,
+		.shared_bank_arena = true,
+	};
+	{
+		tinykvm::Machine fork { machine, options };
+		fork.timed_vmcall(fork.address_of("increment"), 4.0f);
+		REQUIRE(fork.return_value() == 1);
+	}
+	// The banks of the destroyed fork are now cached
+	const size_t allocated = arena.allocated_banks();
+	REQUIRE(arena.cached_banks() > 0);
+
+	for (int i = 0; i < 10; i++) {
+		tinykvm::Machine fork { machine, options };
+		fork.timed_vmcall(fork.address_of("increment"), 4.0f);
+		// Recycled banks must not leak state between forks
+		REQUIRE(fork.return_value() == 1);
+	}
+	REQUIRE(arena.allocated_banks() == allocated);
+	arena.trim();
+	REQUIRE(arena.cached_banks() == 0);
+}
+
+TEST_CASE("Zero recycled arena banks in the background", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+static int counter = 0;
+int main() {
+}
+extern int increment() {
+	return ++counter;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"fork"}, env);
+	machine.run(4.0f);
+	machine.prepare_copy_on_write(0);
+
+	auto& arena = tinykvm::MemoryBankArena::get();
+	arena.trim();
+	arena.configure(1024, false, 4);
+	const tinykvm::MachineOptions options {
+		.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM,
+		.shared_bank_arena = true,
+	};
+	for (int i = 0; i < 10; i++) {
+		{
+			tinykvm::Machine fork { machine, options };
+			fork.timed_vmcall(fork.address_of("increment"), 4.0f);
+			REQUIRE(fork.return_value() == 1);
+		}
+		// Every cached bank is zeroed ahead of the next fork
+		arena.wait_for_zeroing();
+		REQUIRE(arena.cached_banks() > 0);
+		REQUIRE(arena.zeroed_banks() == std::min<size_t>(arena.cached_banks(), 4));
+	}
+	arena.configure(1024, false, 0);
+	arena.trim();
+	REQUIRE(arena.cached_banks() == 0);
+}
+
 TEST_CASE("Execute function in forkable VM", "[Fork]")
 {
 	bool output_is_hello_world = false;
@@ -566,3 +934,382 @@ int func2() {
 		REQUIRE(fork2.return_value() == 22222);
 	}
 }
+
+TEST_CASE("SMP vCPUs in a fork across reset_to", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+}
+
+static long items[8][512];
+extern long* get_items() {
+	return &items[0][0];
+}
+extern long touch(long* item, unsigned size) {
+	item[0] += 1;
+	item[size / sizeof(long) - 1] = item[0];
+	return item[0];
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"fork"}, env);
+	machine.run(4.0f);
+	machine.prepare_copy_on_write(65536);
+
+	const tinykvm::MachineOptions options {
+		.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM
+	};
+	auto fork = tinykvm::Machine { machine, options };
+	fork.vmcall("get_items");
+	const uint64_t items = fork.return_value();
+	static constexpr uint32_t ITEM_SIZE = 512 * sizeof(long);
+	static constexpr size_t CPUS = 4;
+	static constexpr uint32_t STACK_SIZE = 65536;
+	const auto touch = fork.address_of("touch");
+
+	for (int round = 0; round < 3; round++) {
+		// Stacks come from the work memory of the fork
+		const auto stacks = fork.mmap_allocate((CPUS + 1) * STACK_SIZE);
+		fork.smp().timed_smpcall_array(CPUS, stacks, STACK_SIZE,
+			touch, 4.0f, items, ITEM_SIZE);
+		fork.smp_wait();
+		// Every vCPU sees a clean copy of the master after a reset
+		for (const long result : fork.smp().gather_return_values(CPUS))
+			REQUIRE(result == 1);
+		// The main vCPU sees the writes of the SMP vCPUs
+		for (size_t c = 1; c <= CPUS; c++) {
+			long value = 0;
+			fork.copy_from_guest(&value, items + c * ITEM_SIZE, sizeof(value));
+			REQUIRE(value == 1);
+		}
+		// The master is not written to
+		long value = -1;
+		machine.copy_from_guest(&value, items + ITEM_SIZE, sizeof(value));
+		REQUIRE(value == 0);
+
+		fork.reset_to(machine, options);
+	}
+}
+
+TEST_CASE("Publish versioned shared data to forks", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+struct shared_data {
+	unsigned magic;
+	unsigned slot_offset;
+	unsigned long slot_size;
+	_Alignas(64) unsigned long version;
+	unsigned long length[2];
+};
+int main() {
+	return 0;
+}
+extern long read_shared(const struct shared_data* sd) {
+	const unsigned long v = __atomic_load_n(&sd->version, __ATOMIC_ACQUIRE);
+	const char* data = (const char *)sd + sd->slot_offset + (v % 2) * sd->slot_size;
+	return v * 256 + (sd->length[v % 2] ? data[0] : 0);
+})M");
+	const uint64_t GUEST_MEMORY = 32ULL << 20; /* 32MB */
+	tinykvm::Machine master { binary, { .max_mem = MAX_MEMORY } };
+	master.setup_linux({"master"}, env);
+	master.run(4.0f);
+
+	tinykvm::SharedData shared { master, 4096 };
+	REQUIRE((shared.address() & 0x1FFFFF) == 0);
+	REQUIRE(shared.version() == 0);
+	REQUIRE(shared.current().empty());
+	master.prepare_copy_on_write(0, shared.address());
+	REQUIRE(master.shared_memory_boundary() == shared.address());
+
+	const tinykvm::MachineOptions options {
+		.max_mem = GUEST_MEMORY, .max_cow_mem = 8ULL << 20
+	};
+	auto fork = tinykvm::Machine { master, options };
+	const auto read_shared = fork.address_of("read_shared");
+	fork.timed_vmcall(read_shared, 2.0f, shared.address());
+	REQUIRE(fork.return_value() == 0);
+
+	/* A running fork picks up each new version */
+	REQUIRE(shared.publish("Alpha") == 1);
+	fork.timed_vmcall(read_shared, 2.0f, shared.address());
+	REQUIRE(fork.return_value() == 1 * 256 + 'A');
+	REQUIRE(shared.publish("Bravo") == 2);
+	REQUIRE(shared.current() == "Bravo");
+	fork.timed_vmcall(read_shared, 2.0f, shared.address());
+	REQUIRE(fork.return_value() == 2 * 256 + 'B');
+	/* A reset does not roll the data back */
+	fork.reset_to(master, options);
+	fork.timed_vmcall(read_shared, 2.0f, shared.address());
+	REQUIRE(fork.return_value() == 2 * 256 + 'B');
+
+	REQUIRE_THROWS_AS(shared.publish(std::string(8192, 'x')), tinykvm::MachineException);
+	/* Copy-on-write pages are not shared with forks */
+	tinykvm::Machine other { binary, { .max_mem = GUEST_MEMORY } };
+	other.setup_linux({"other"}, env);
+	other.run(4.0f);
+	other.prepare_copy_on_write(0);
+	REQUIRE_THROWS_AS(tinykvm::SharedData(other, 4096), tinykvm::MachineException);
+}
+
+TEST_CASE("Alias pages between forks instead of copying", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const uint64_t GUEST_MEMORY = 32ULL << 20; /* 32MB */
+	tinykvm::Machine master { binary, { .max_mem = MAX_MEMORY } };
+	master.setup_linux({"master"}, env);
+	const size_t SIZE = 256 * 1024;
+	const auto src = master.mmap_allocate(SIZE);
+	const auto dst = master.mmap_allocate(SIZE + 4096);
+	std::vector<uint8_t> data(SIZE);
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = (i * 7) & 0xFF;
+	master.copy_to_guest(src, data.data(), data.size());
+	master.prepare_copy_on_write();
+
+	tinykvm::Machine producer { master, { .max_mem = GUEST_MEMORY, .max_cow_mem = MAX_COWMEM } };
+	// Forks alias 4k pages, which requires splitting hugepages
+	tinykvm::Machine consumer { master, { .max_mem = GUEST_MEMORY, .max_cow_mem = MAX_COWMEM, .split_hugepages = true } };
+	const size_t pages_before = consumer.banked_memory_pages();
+
+	// Whole pages are aliased, the unaligned edges are copied
+	const size_t aliased = consumer.alias_from_machine(dst + 100, producer, src + 100, SIZE - 200);
+	REQUIRE(aliased == SIZE - 2 * 4096);
+	std::vector<uint8_t> result(SIZE - 200);
+	consumer.copy_from_guest(result.data(), dst + 100, result.size());
+	REQUIRE(std::equal(result.begin(), result.end(), data.begin() + 100));
+	// Only the edges (and page tables) took working memory
+	REQUIRE(consumer.banked_memory_pages() - pages_before < 16);
+
+	// Writing to an aliased page copies it first
+	consumer.copy_to_guest(dst + 4096, "Written", 8);
+	consumer.copy_from_guest(result.data(), dst, 4096 + 16);
+	REQUIRE(std::string((const char *)&result[4096]) == "Written");
+	REQUIRE(result[4096 + 8] == data[4096 + 8]);
+	std::vector<uint8_t> original(SIZE);
+	producer.copy_from_guest(original.data(), src, original.size());
+	REQUIRE(original == data);
+
+	// Pages that are not immutable in the source are copied
+	producer.copy_to_guest(src, "Private", 8);
+	REQUIRE(consumer.alias_from_machine(dst, producer, src, 4096) == 0);
+	consumer.copy_from_guest(result.data(), dst, 8);
+	REQUIRE(std::string((const char *)result.data()) == "Private");
+
+	// A reset restores the original page tables
+	consumer.reset_to(master, { .max_mem = GUEST_MEMORY, .max_cow_mem = MAX_COWMEM,
+		.split_hugepages = true, .reset_keep_all_work_memory = true });
+	consumer.copy_from_guest(result.data(), dst + 4096, 8);
+	REQUIRE(result[0] == 0);
+}
+
+TEST_CASE("Forks share the channels of their master", "[Fork]")
+{
+	const auto binary = build_and_load_guest_api(R"M(
+#include "api.hpp"
+int main() {
+	return 0;
+}
+PUBLIC(size_t produce(kvm_channel* ch, const char* text, size_t len)) {
+	return kvm_channel_write(ch, text, len);
+})M");
+	const uint64_t GUEST_MEMORY = 32ULL << 20; /* 32MB */
+	tinykvm::Machine master { binary, { .max_mem = GUEST_MEMORY } };
+	master.setup_linux({"master"}, env);
+	master.run(4.0f);
+	tinykvm::Channel channel { 64 * 1024 };
+	const auto addr = master.map_channel(channel);
+	master.prepare_copy_on_write(0);
+
+	tinykvm::Machine fork { master, { .max_mem = GUEST_MEMORY, .max_cow_mem = GUEST_MEMORY } };
+	const auto text_addr = fork.stack_address() - 4096;
+	auto produce = [&] (const std::string& text) {
+		fork.copy_to_guest(text_addr, text.c_str(), text.size());
+		fork.timed_vmcall(fork.address_of("produce"), 4.0f, addr, text_addr, text.size());
+		return fork.return_value();
+	};
+	// The guest writes into the ring that the host reads
+	REQUIRE(produce("Hello from a fork") == 17);
+	REQUIRE(fork.main_memory().get_userpage_at(addr) == channel.ptr());
+	char buffer[32] {};
+	REQUIRE(channel.read(buffer, sizeof(buffer)) == 17);
+	REQUIRE(std::string(buffer) == "Hello from a fork");
+
+	// Resetting the fork does not roll back the channel
+	fork.reset_to(master, { .max_mem = GUEST_MEMORY, .max_cow_mem = GUEST_MEMORY });
+	REQUIRE(produce("Again") == 5);
+	REQUIRE(channel.readable() == 5);
+	const auto& header = *(const tinykvm::Channel::Header *)channel.ptr();
+	REQUIRE(header.head == 22);
+	REQUIRE(header.tail == 17);
+}
+
+TEST_CASE("Host-side accesses see copy-on-write and reset changes", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const uint64_t GUEST_MEMORY = 32ULL << 20; /* 32MB */
+	tinykvm::Machine master { binary, { .max_mem = MAX_MEMORY } };
+	master.setup_linux({"master"}, env);
+	const auto addr = master.mmap_allocate(4 * 4096);
+	master.copy_to_guest(addr, "Master", 7);
+	master.prepare_copy_on_write();
+
+	const tinykvm::MachineOptions fork_options {
+		.max_mem = GUEST_MEMORY, .max_cow_mem = MAX_COWMEM, .split_hugepages = true
+	};
+	tinykvm::Machine fork { master, fork_options };
+	char buffer[8] = {};
+	// Reading resolves (and remembers) the page of the master
+	fork.copy_from_guest(buffer, addr, sizeof(buffer));
+	REQUIRE(std::string(buffer) == "Master");
+	// Writing copies the page, which must be seen by the next read
+	fork.copy_to_guest(addr, "Forked", 7);
+	fork.copy_from_guest(buffer, addr, sizeof(buffer));
+	REQUIRE(std::string(buffer) == "Forked");
+	REQUIRE(fork.buffer_to_string(addr, 6) == "Forked");
+	// Writing through a view copies the page behind the reads too
+	fork.copy_from_guest(buffer, addr + 4096, sizeof(buffer));
+	auto view = fork.writable_memview(addr + 4096, 7);
+	std::memcpy(view.data(), "Viewed", 7);
+	fork.copy_from_guest(buffer, addr + 4096, sizeof(buffer));
+	REQUIRE(std::string(buffer) == "Viewed");
+	// Repeated writes to the now private page stay private
+	for (int i = 0; i < 100; i++) {
+		const int value = i;
+		fork.copy_to_guest(addr + 8, &value, sizeof(value));
+		int result = -1;
+		fork.copy_from_guest(&result, addr + 8, sizeof(result));
+		REQUIRE(result == i);
+	}
+	master.copy_from_guest(buffer, addr, sizeof(buffer));
+	REQUIRE(std::string(buffer) == "Master");
+
+	// A reset returns to the pages of the master
+	for (const bool keep_memory : { true, false }) {
+		auto options = fork_options;
+		options.reset_keep_all_work_memory = keep_memory;
+		fork.copy_to_guest(addr, "Forked", 7);
+		fork.reset_to(master, options);
+		fork.copy_from_guest(buffer, addr, sizeof(buffer));
+		REQUIRE(std::string(buffer) == "Master");
+	}
+}
+
+TEST_CASE("Preparing a master again protects its updated pages", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const uint64_t GUEST_MEMORY = 64ULL << 20; /* 64MB */
+	for (const bool incremental : { false, true }) {
+		tinykvm::Machine master { binary, { .max_mem = MAX_MEMORY } };
+		master.setup_linux({"master"}, env);
+		master.set_copy_on_write_preparation(4, incremental);
+		const auto addr = master.mmap_allocate(8ULL << 20);
+		master.copy_to_guest(addr, "Master", 7);
+		master.prepare_copy_on_write(16ULL << 20);
+
+		// Update the master, and prepare it again
+		master.set_main_memory_writable(true);
+		master.copy_to_guest(addr + (4ULL << 20), "Updated", 8);
+		master.set_main_memory_writable(false);
+		master.prepare_copy_on_write();
+
+		tinykvm::Machine fork { master, {
+			.max_mem = GUEST_MEMORY, .max_cow_mem = MAX_COWMEM
+		} };
+		REQUIRE(fork.buffer_to_string(addr, 6) == "Master");
+		REQUIRE(fork.buffer_to_string(addr + (4ULL << 20), 7) == "Updated");
+		fork.copy_to_guest(addr, "Forked", 7);
+		fork.copy_to_guest(addr + (4ULL << 20), "Forked!", 8);
+		REQUIRE(master.buffer_to_string(addr, 6) == "Master");
+		REQUIRE(master.buffer_to_string(addr + (4ULL << 20), 7) == "Updated");
+	}
+}
+
+TEST_CASE("Gigapages of main memory are split on copy-on-write", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const uint64_t GB = 1ULL << 30;
+	const uint64_t GUEST_MEMORY = 3 * GB;
+	tinykvm::Machine master { binary, { .max_mem = MAX_MEMORY } };
+	master.setup_linux({"master"}, env);
+	if (!tinykvm::Machine::gigapages_supported()) {
+		REQUIRE_THROWS(master.map_gigapages(GB, 2 * GB));
+		return;
+	}
+	// The first gigapage has the page tables and the program
+	REQUIRE(master.map_gigapages(0, GUEST_MEMORY) == 2);
+	REQUIRE(master.map_gigapages(GB, 2 * GB) == 0);
+	master.copy_to_guest(GB + 4096, "Master", 7);
+	master.copy_to_guest(2 * GB - 8, "Crossing", 9);
+	master.prepare_copy_on_write();
+	REQUIRE_THROWS(master.map_gigapages(GB, GB));
+
+	tinykvm::Machine fork { master, {
+		.max_mem = GUEST_MEMORY, .max_cow_mem = MAX_COWMEM, .split_hugepages = true
+	} };
+	REQUIRE(fork.buffer_to_string(GB + 4096, 6) == "Master");
+	char crossing[9];
+	fork.copy_from_guest(crossing, 2 * GB - 8, sizeof(crossing));
+	REQUIRE(std::memcmp(crossing, "Crossing", 9) == 0);
+
+	fork.copy_to_guest(GB + 8192, "Forked", 7);
+	REQUIRE(fork.buffer_to_string(GB + 8192, 6) == "Forked");
+	REQUIRE(master.buffer_to_string(GB + 8192, 6) != "Forked");
+	// The rest of the gigapage is still shared with the master
+	REQUIRE(fork.buffer_to_string(GB + 4096, 6) == "Master");
+	fork.copy_to_guest(2 * GB - 4, "Both", 5);
+	REQUIRE(fork.buffer_to_string(2 * GB - 4, 4) == "Both");
+	REQUIRE(master.buffer_to_string(2 * GB - 8, 8) == "Crossing");
+}
+
+TEST_CASE("Forks read a replica of the master on their NUMA node", "[Fork]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const uint64_t GUEST_MEMORY = 32ULL << 20; /* 32MB */
+	tinykvm::Machine master { binary, { .max_mem = MAX_MEMORY } };
+	master.setup_linux({"master"}, env);
+	const auto addr = master.mmap_allocate(4ULL << 20);
+	master.copy_to_guest(addr, "Master", 7);
+	master.prepare_copy_on_write();
+
+	tinykvm::MachineOptions options {
+		.max_mem = GUEST_MEMORY, .max_cow_mem = MAX_COWMEM,
+		.numa_node = 0, .numa_replicate_master = true
+	};
+	tinykvm::Machine fork1 { master, options };
+	if (fork1.main_memory().ptr == master.main_memory().ptr) {
+		WARN("NUMA policies are not available");
+		return;
+	}
+	// Every fork on the node shares the one replica
+	tinykvm::Machine fork2 { master, options };
+	REQUIRE(fork2.main_memory().ptr == fork1.main_memory().ptr);
+	REQUIRE(fork1.buffer_to_string(addr, 6) == "Master");
+	fork1.copy_to_guest(addr, "Forked", 7);
+	REQUIRE(fork1.buffer_to_string(addr, 6) == "Forked");
+	REQUIRE(fork2.buffer_to_string(addr, 6) == "Master");
+	REQUIRE(master.buffer_to_string(addr, 6) == "Master");
+	REQUIRE(fork1.reset_to(master, options));
+	REQUIRE(fork1.buffer_to_string(addr, 6) == "Master");
+
+	// Forks of a master on the same node need no replica
+	tinykvm::Machine bound { binary, { .max_mem = GUEST_MEMORY, .numa_node = 0 } };
+	bound.setup_linux({"bound"}, env);
+	bound.prepare_copy_on_write();
+	tinykvm::Machine fork3 { bound, options };
+	REQUIRE(fork3.main_memory().ptr == bound.main_memory().ptr);
+}
@@ -232,3 +232,52 @@ int do_munmap(void* addr, size_t size) {
 		}
 	}
 }
+
+TEST_CASE("MMapCache keeps ordered free and used ranges", "[MMAP]")
+{
+	tinykvm::MMapCache cache;
+	cache.current() = 0x100000;
+	for (uint64_t addr = 0x10000; addr < 0x20000; addr += 0x1000)
+		cache.insert_used(addr, 0x1000);
+	// Adjacent used ranges are merged
+	REQUIRE(cache.used_ranges().size() == 1);
+
+	// Free ranges of different sizes, with gaps between them
+	cache.insert_free(0x20000, 0x4000);
+	cache.insert_free(0x30000, 0x2000);
+	cache.insert_free(0x40000, 0x8000);
+	REQUIRE(cache.free_ranges().size() == 3);
+	REQUIRE_THROWS(cache.insert_free(0x31000, 0x1000));
+	// Best fit takes the smallest range that fits
+	auto range = cache.find(0x2000);
+	REQUIRE(range.addr == 0x30000);
+	REQUIRE(range.size == 0x2000);
+	range = cache.find(0x3000);
+	REQUIRE(range.addr == 0x20000);
+	REQUIRE(cache.free_ranges().at(0x23000).size == 0x1000);
+	REQUIRE(cache.find(0x10000).empty());
+	// Freeing between two free ranges joins all three
+	cache.insert_free(0x24000, 0x1C000);
+	REQUIRE(cache.free_ranges().size() == 1);
+	REQUIRE(cache.free_ranges().at(0x23000).size == 0x25000);
+
+	// Removing the middle of a range keeps both ends
+	cache.remove_used(0x14000, 0x2000);
+	REQUIRE(cache.used_ranges().size() == 2);
+	REQUIRE(cache.used_ranges().at(0x10000).size == 0x4000);
+	REQUIRE(cache.used_ranges().at(0x16000).size == 0xA000);
+	REQUIRE(cache.find_collision(cache.used_ranges(), {0x13000, 0x1000}) != nullptr);
+	REQUIRE(cache.find_collision(cache.used_ranges(), {0x14000, 0x2000}) == nullptr);
+	REQUIRE(cache.find_collision(cache.used_ranges(), {0x15000, 0x2000}) != nullptr);
+
+	// Restoring only copies ranges that changed
+	tinykvm::MMapCache fork = cache;
+	fork.insert_used(0x14000, 0x1000);
+	fork.current() = 0x200000;
+	fork.restore_from(cache);
+	REQUIRE(fork.current() == cache.current());
+	REQUIRE(fork.used_ranges().size() == 2);
+	REQUIRE(fork.find_collision(fork.used_ranges(), {0x14000, 0x1000}) == nullptr);
+	REQUIRE(fork.find(0x1000).addr == 0x23000);
+	REQUIRE(cache.free_ranges().at(0x23000).size == 0x25000);
+}
@@ -2,6 +2,7 @@
 #include <catch2/matchers/catch_matchers_string.hpp>
 
 #include <tinykvm/machine.hpp>
+#include <thread>
 extern std::pair<
 	std::string,
 	std::vector<uint8_t>
@@ -467,3 +468,299 @@ int main() {
 		REQUIRE(is_waiting);
 	}
 }
+
+TEST_CASE("Batched remote calls", "[Remote]")
+{
+	const auto storage_binary = build_and_load(R"M(
+int main() {
+	return 1234;
+}
+int remote_counter = 0;
+extern long remote_add(long a, long b) {
+	remote_counter++;
+	return a + b;
+}
+extern long remote_counter_get() {
+	return remote_counter;
+}
+)M", "-Wl,-Ttext-segment=0x40400000");
+
+	// Extract storage remote symbols
+	const std::string command = "objcopy -w --extract-symbol --strip-symbol=!remote* --strip-symbol=* " + storage_binary.first + " storage.syms";
+	FILE* f = popen(command.c_str(), "r");
+	if (f == nullptr) {
+		throw std::runtime_error("Unable to extract remote symbols");
+	}
+	pclose(f);
+
+	const auto main_binary = build_and_load(R"M(
+#include <unistd.h>
+struct RemoteCallEntry {
+	void* function;
+	long args[4];
+	long result;
+};
+extern long remote_add(long, long);
+extern long remote_counter_get();
+static long local_function() { return 0; }
+int main() {
+	struct RemoteCallEntry entries[17];
+	for (int i = 0; i < 16; i++) {
+		entries[i].function = (void*)remote_add;
+		entries[i].args[0] = i;
+		entries[i].args[1] = 1000;
+		entries[i].result = -1;
+	}
+	entries[16].function = (void*)local_function;
+	entries[16].result = 0;
+	long completed = syscall(0x1F711, entries, 17);
+	if (completed != 17)
+		return 1;
+	for (int i = 0; i < 16; i++) {
+		if (entries[i].result != i + 1000)
+			return 2;
+	}
+	/* Calls into the main VM are refused */
+	if (entries[16].result >= 0)
+		return 3;
+	if (remote_counter_get() != 16)
+		return 4;
+	return 2345;
+}
+)M", "-Wl,--just-symbols=storage.syms");
+
+	tinykvm::Machine storage { storage_binary.second, {
+		.max_mem = 16ULL << 20, // MB
+		.vmem_base_address = 1ULL << 30, // 1GB
+	} };
+	storage.setup_linux({"storage"}, env);
+	storage.run(4.0f);
+	REQUIRE(storage.return_value() == 1234);
+
+	tinykvm::Machine machine { main_binary.second, {
+		.max_mem = MAX_MEMORY
+	} };
+	machine.setup_linux({"main"}, env);
+	machine.remote_connect(storage);
+	machine.set_remote_allow_page_faults(true);
+
+	machine.run(4.0f);
+	REQUIRE(machine.return_value() == 2345);
+	REQUIRE(!machine.is_remote_connected());
+	// One connection for the whole batch, one for remote_counter_get()
+	REQUIRE(machine.remote_connection_count() == 2);
+
+	// Host-driven calls in a single session
+	const auto remote_add = storage.address_of("remote_add");
+	machine.remote_session_begin();
+	REQUIRE(machine.in_remote_session());
+	for (long i = 0; i < 10; i++) {
+		REQUIRE(machine.remote_session_call(remote_add, i, 1) == i + 1);
+	}
+	machine.remote_session_end();
+	REQUIRE(!machine.in_remote_session());
+	REQUIRE(!machine.is_remote_connected());
+	REQUIRE(machine.remote_connection_count() == 3);
+}
+
+TEST_CASE("Asynchronous remote calls", "[Remote]")
+{
+	const auto storage_binary = build_and_load(R"M(
+int main() {
+	return 1234;
+}
+extern long remote_mul(long a, long b) {
+	return a * b;
+}
+extern long remote_crash() {
+	*(volatile long*)0 = 1;
+	return 0;
+}
+)M", "-Wl,-Ttext-segment=0x40400000");
+
+	// Extract storage remote symbols
+	const std::string command = "objcopy -w --extract-symbol --strip-symbol=!remote* --strip-symbol=* " + storage_binary.first + " storage.syms";
+	FILE* f = popen(command.c_str(), "r");
+	if (f == nullptr) {
+		throw std::runtime_error("Unable to extract remote symbols");
+	}
+	pclose(f);
+
+	const auto main_binary = build_and_load(R"M(
+#include <unistd.h>
+#include <errno.h>
+struct RemoteCallEntry {
+	void* function;
+	long args[4];
+	long result;
+};
+extern long remote_mul(long, long);
+static long local_function() { return 0; }
+int main() {
+	long tickets[8];
+	for (int i = 0; i < 8; i++) {
+		struct RemoteCallEntry entry = {
+			.function = (void*)remote_mul, .args = { i, 3 }
+		};
+		tickets[i] = syscall(0x1F712, &entry);
+		if (tickets[i] <= 0)
+			return 1;
+	}
+	/* Calls into the main VM are refused */
+	struct RemoteCallEntry local = { .function = (void*)local_function };
+	if (syscall(0x1F712, &local) != -1 || errno != EFAULT)
+		return 2;
+	/* Overlap some local work with the remote calls */
+	volatile long sum = 0;
+	for (int i = 0; i < 100000; i++)
+		sum += i;
+	for (int i = 0; i < 8; i++) {
+		long result = -1;
+		if (syscall(0x1F713, tickets[i], &result, 1) != 0)
+			return 3;
+		if (result != i * 3)
+			return 4;
+	}
+	/* Tickets can only be collected once */
+	if (syscall(0x1F713, tickets[0], 0, 0) != -1 || errno != ENOENT)
+		return 5;
+	return 2345;
+}
+)M", "-Wl,--just-symbols=storage.syms");
+
+	tinykvm::Machine storage { storage_binary.second, {
+		.max_mem = 16ULL << 20, // MB
+		.vmem_base_address = 1ULL << 30, // 1GB
+	} };
+	storage.setup_linux({"storage"}, env);
+	storage.run(4.0f);
+	REQUIRE(storage.return_value() == 1234);
+	// Several vCPUs may not share the TLS of the main thread
+	REQUIRE_THROWS(storage.remote_enable_async(2));
+	storage.remote_enable_concurrency();
+	storage.remote_enable_async(2);
+	REQUIRE(storage.has_remote_async());
+
+	tinykvm::Machine machine { main_binary.second, {
+		.max_mem = MAX_MEMORY
+	} };
+	machine.setup_linux({"main"}, env);
+	machine.remote_connect(storage);
+	machine.set_remote_allow_page_faults(true);
+
+	machine.run(4.0f);
+	REQUIRE(machine.return_value() == 2345);
+	REQUIRE(machine.remote_async_pending() == 0);
+	// The calls ran on the storage vCPUs, never connecting
+	REQUIRE(machine.remote_connection_count() == 0);
+
+	// Host-driven asynchronous calls
+	const auto remote_mul = storage.address_of("remote_mul");
+	const auto ticket = machine.remote_call_async(remote_mul, {6, 7});
+	int64_t result = 0;
+	REQUIRE(machine.remote_async_result(ticket, result, true) == 0);
+	REQUIRE(result == 42);
+	REQUIRE(machine.remote_async_result(ticket, result, true) == -ENOENT);
+
+	// A failing call is reported, and the vCPU keeps serving calls
+	const auto crash = machine.remote_call_async(storage.address_of("remote_crash"));
+	REQUIRE(machine.remote_async_result(crash, result, true) == -EIO);
+	const auto again = machine.remote_call_async(remote_mul, {2, 21});
+	REQUIRE(machine.remote_async_result(again, result, true) == 0);
+	REQUIRE(result == 42);
+}
+
+TEST_CASE("Concurrent callers into one remote VM", "[Remote]")
+{
+	const auto storage_binary = build_and_load(R"M(
+int main() {
+	return 1234;
+}
+static long remote_value = 42;
+extern long remote_value_get() {
+	return remote_value;
+}
+extern void remote_value_add(long n) {
+	remote_value += n;
+}
+)M", "-Wl,-Ttext-segment=0x40400000");
+
+	// Extract storage remote symbols
+	const std::string command = "objcopy -w --extract-symbol --strip-symbol=!remote* --strip-symbol=* " + storage_binary.first + " storage.syms";
+	FILE* f = popen(command.c_str(), "r");
+	if (f == nullptr) {
+		throw std::runtime_error("Unable to extract remote symbols");
+	}
+	pclose(f);
+
+	const auto main_binary = build_and_load(R"M(
+extern long remote_value_get();
+extern void remote_value_add(long);
+int main() {
+	return 2345;
+}
+extern long test_reads() {
+	long sum = 0;
+	for (int i = 0; i < 100; i++)
+		sum += remote_value_get();
+	return sum;
+}
+extern long test_writes() {
+	for (int i = 0; i < 100; i++)
+		remote_value_add(1);
+	return 0;
+}
+)M", "-Wl,--just-symbols=storage.syms");
+
+	tinykvm::Machine storage { storage_binary.second, {
+		.max_mem = 16ULL << 20, // MB
+		.vmem_base_address = 1ULL << 30, // 1GB
+	} };
+	storage.setup_linux({"storage"}, env);
+	storage.run(4.0f);
+	REQUIRE(storage.return_value() == 1234);
+
+	storage.remote_enable_concurrency();
+	REQUIRE(storage.has_remote_concurrency());
+	storage.remote_add_shared_entry(storage.address_of("remote_value_get"));
+
+	tinykvm::Machine machine { main_binary.second, {
+		.max_mem = MAX_MEMORY
+	} };
+	machine.setup_linux({"main"}, env);
+	machine.remote_connect(storage);
+	machine.set_remote_allow_page_faults(true);
+	machine.run(4.0f);
+	REQUIRE(machine.return_value() == 2345);
+	machine.prepare_copy_on_write(1UL << 20);
+
+	// Forks of the same main VM call into the remote from their own threads
+	std::vector<std::thread> threads;
+	std::array<long, 4> results {};
+	std::array<uint32_t, 4> connections {};
+	for (size_t i = 0; i < results.size(); i++) {
+		threads.emplace_back([&, i] {
+			tinykvm::Machine fork(machine, {
+				.max_mem = MAX_MEMORY,
+				.max_cow_mem = MAX_COWMEM,
+				.split_hugepages = true
+			});
+			fork.set_remote_allow_page_faults(true);
+			fork.vmcall("test_reads");
+			results[i] = fork.return_value();
+			connections[i] = fork.remote_connection_count();
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+	for (size_t i = 0; i < results.size(); i++) {
+		REQUIRE(results[i] == 4200);
+		REQUIRE(connections[i] == 100);
+	}
+
+	// Calls into other entry points run one at a time
+	machine.vmcall("test_writes");
+	REQUIRE(!machine.is_remote_connected());
+	machine.vmcall("test_reads");
+	REQUIRE(machine.return_value() == 14200);
+}
@@ -1,7 +1,14 @@
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/matchers/catch_matchers_string.hpp>
+#include <csignal>
+#include <fcntl.h>
+#include <linux/kvm.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #include <tinykvm/machine.hpp>
+#include <tinykvm/machine_pool.hpp>
 extern std::vector<uint8_t> build_and_load(const std::string& code);
 static const uint64_t MAX_MEMORY = 32ul << 20; /* 32MB */
 static const uint64_t MAX_COWMEM =  8ul << 20; /* 8MB */
@@ -76,6 +83,166 @@ extern long get_mmap(int *z) {
 	}
 }
 
+TEST_CASE("Reset VM using dirty page logging", "[Reset]")
+{
+	const auto binary = build_and_load(R"M(
+static int a = 0;
+int main() {
+}
+extern long get_a() {
+	int ta = a;
+	a = 333;
+	return ta;
+}
+extern long get_mmap(int *z) {
+	int total = z[100] + z[200];
+	z[100] = 22;
+	z[200] = 44;
+	return total;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"reset"}, env);
+	machine.run(4.0f);
+	machine.prepare_copy_on_write(0);
+
+	auto maddr = machine.mmap_allocate(0x1000);
+
+	const tinykvm::MachineOptions options {
+		.max_mem = MAX_MEMORY,
+		.max_cow_mem = MAX_COWMEM,
+		.reset_keep_all_work_memory = true,
+		.reset_dirty_page_logging = true,
+	};
+	auto fork = tinykvm::Machine { machine, options };
+
+	for (size_t i = 0; i < 15; i++)
+	{
+		fork.timed_vmcall(fork.address_of("get_a"), 2.0f);
+		REQUIRE(fork.return_value() == 0);
+
+		fork.timed_vmcall(fork.address_of("get_mmap"), 2.0f, (uint64_t)maddr);
+		REQUIRE(fork.return_value() == 0);
+
+		// Pages written only by the host must be restored too
+		const int value = 1234;
+		fork.copy_to_guest(maddr + 400 * sizeof(int), &value, sizeof(value));
+
+		REQUIRE(!fork.reset_to(machine, options));
+
+		int restored = -1;
+		fork.copy_from_guest(&restored, maddr + 400 * sizeof(int), sizeof(restored));
+		REQUIRE(restored == 0);
+	}
+}
+
+TEST_CASE("Prefetch working set on reset", "[Reset]")
+{
+	const auto binary = build_and_load(R"M(
+static int a = 0;
+int main() {
+}
+extern long get_a() {
+	int ta = a;
+	a = 333;
+	return ta;
+}
+extern long get_mmap(int *z) {
+	int total = z[100] + z[200];
+	z[100] = 22;
+	z[200] = 44;
+	return total;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"reset"}, env);
+	machine.run(4.0f);
+	machine.prepare_copy_on_write(0);
+
+	auto maddr = machine.mmap_allocate(0x1000);
+
+	const tinykvm::MachineOptions options {
+		.max_mem = MAX_MEMORY,
+		.max_cow_mem = MAX_COWMEM,
+		.reset_prefetch_pages = 64,
+		.reset_prefetch_history = 2,
+	};
+	tinykvm::MachineOptions no_prefetch = options;
+	no_prefetch.reset_prefetch_pages = 0;
+	auto fork = tinykvm::Machine { machine, options };
+	auto baseline = tinykvm::Machine { machine, no_prefetch };
+
+	// Page faults during the requests after the first one
+	auto run_requests = [&] (tinykvm::Machine& vm, const tinykvm::MachineOptions& opts) {
+		uint64_t page_faults = 0;
+		for (size_t i = 0; i < 15; i++)
+		{
+			vm.reset_exit_counters();
+			vm.timed_vmcall(vm.address_of("get_a"), 2.0f);
+			REQUIRE(vm.return_value() == 0);
+
+			vm.timed_vmcall(vm.address_of("get_mmap"), 2.0f, (uint64_t)maddr);
+			REQUIRE(vm.return_value() == 0);
+			if (i > 0)
+				page_faults += vm.exit_counters().page_faults;
+
+			vm.reset_to(machine, opts);
+		}
+		return page_faults;
+	};
+	const uint64_t prefetched_faults = run_requests(fork, options);
+	// The working set is already present after the reset
+	REQUIRE(fork.banked_memory_pages() > 0);
+	const uint64_t baseline_faults = run_requests(baseline, no_prefetch);
+	// Without prefetching, every request faults in its pages again
+	REQUIRE(baseline_faults > 0);
+	REQUIRE(prefetched_faults < baseline_faults);
+}
+
+TEST_CASE("Acquire and release pooled VMs", "[Reset]")
+{
+	const auto binary = build_and_load(R"M(
+static int a = 0;
+int main() {
+}
+extern long get_a() {
+	int ta = a;
+	a = 333;
+	return ta;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"reset"}, env);
+	machine.run(4.0f);
+	machine.prepare_copy_on_write(0);
+
+	tinykvm::MachinePool pool { machine, {
+		.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM
+	}, 2, 1 };
+	REQUIRE(pool.size() == 2);
+	REQUIRE(pool.depth() == 2);
+
+	for (size_t i = 0; i < 15; i++)
+	{
+		auto& m = pool.acquire();
+		m.timed_vmcall(m.address_of("get_a"), 2.0f);
+		// Every VM handed out must have been reset
+		REQUIRE(m.return_value() == 0);
+		pool.release(m);
+	}
+	// A VM can only be released once per acquire
+	auto& m = pool.acquire();
+	pool.release(m);
+	REQUIRE_THROWS(pool.release(m));
+	pool.wait_for_resets();
+	REQUIRE(pool.depth() == 2);
+
+	const auto stats = pool.stats();
+	REQUIRE(stats.resets == 16);
+	REQUIRE(stats.acquired == 0);
+	REQUIRE(stats.failed_resets == 0);
+}
+
 TEST_CASE("Execute function in VM (crash recovery)", "[Reset]")
 {
 	const auto binary = build_and_load(R"M(
@@ -169,3 +336,363 @@ extern void crash(const char *arg) {
 		});
 	}
 }
+
+TEST_CASE("Reset only modified signals and file descriptors", "[Reset]")
+{
+	const auto binary = build_and_load(R"M(
+#include <signal.h>
+#include <unistd.h>
+static void handler(int sig) { (void)sig; }
+int main() {
+}
+extern long nothing() {
+	return 1;
+}
+extern long install_handler() {
+	return signal(SIGUSR1, handler) == SIG_ERR;
+}
+extern long make_pipe() {
+	int fds[2];
+	return pipe(fds);
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"reset"}, env);
+	machine.run(4.0f);
+	machine.prepare_copy_on_write(0);
+
+	const tinykvm::MachineOptions options {
+		.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM
+	};
+	auto fork = tinykvm::Machine { machine, options };
+	const auto fds = fork.fds().get_current_fds_opened();
+
+	/* Requests that don't touch the state */
+	for (size_t i = 0; i < 3; i++) {
+		fork.timed_vmcall(fork.address_of("nothing"), 2.0f);
+		REQUIRE(fork.return_value() == 1);
+		fork.reset_to(machine, options);
+		REQUIRE(fork.fds().get_current_fds_opened() == fds);
+	}
+
+	/* A signal handler installed by a request is removed */
+	fork.timed_vmcall(fork.address_of("install_handler"), 2.0f);
+	REQUIRE(fork.return_value() == 0);
+	REQUIRE(!fork.sigaction(SIGUSR1).is_unset());
+	fork.reset_to(machine, options);
+	REQUIRE(fork.sigaction(SIGUSR1).is_unset());
+
+	/* A pipe opened by a request is closed */
+	fork.timed_vmcall(fork.address_of("make_pipe"), 2.0f);
+	REQUIRE(fork.return_value() == 0);
+	REQUIRE(fork.fds().get_current_fds_opened() == fds + 2);
+	fork.reset_to(machine, options);
+	REQUIRE(fork.fds().get_current_fds_opened() == fds);
+}
+
+TEST_CASE("Rebase a fork onto a new master", "[Reset]")
+{
+	const auto binary_v1 = build_and_load(R"M(
+static long counter = 100;
+int main() {
+}
+extern long version() {
+	return 1 + counter++;
+})M");
+	const auto binary_v2 = build_and_load(R"M(
+static char padding[3 * 4096] = { 1 };
+static long counter = 200;
+int main() {
+}
+extern long version() {
+	return 2 + padding[0] + counter++;
+}
+extern long only_in_v2() {
+	return 42;
+})M");
+
+	const tinykvm::MachineOptions options {
+		.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM,
+		.allow_reset_to_new_master = true,
+	};
+	tinykvm::Machine master_v1 { binary_v1, { .max_mem = MAX_MEMORY } };
+	master_v1.setup_linux({"rebase"}, env);
+	master_v1.run(4.0f);
+	master_v1.prepare_copy_on_write(0);
+	master_v1.mmap_allocate(0x1000);
+
+	tinykvm::Machine master_v2 { binary_v2, { .max_mem = MAX_MEMORY } };
+	master_v2.setup_linux({"rebase"}, env);
+	master_v2.run(4.0f);
+	master_v2.prepare_copy_on_write(0);
+
+	auto fork = tinykvm::Machine { master_v1, options };
+	fork.timed_vmcall(fork.address_of("version"), 2.0f);
+	REQUIRE(fork.return_value() == 101);
+	REQUIRE(fork.address_of("only_in_v2") == 0x0);
+
+	/* The fork now runs the new program, from its initial state */
+	fork.reset_to(master_v2, options);
+	REQUIRE(fork.address_of("only_in_v2") != 0x0);
+	for (size_t i = 0; i < 3; i++) {
+		fork.timed_vmcall(fork.address_of("version"), 2.0f);
+		REQUIRE(fork.return_value() == 203);
+		fork.timed_vmcall(fork.address_of("only_in_v2"), 2.0f);
+		REQUIRE(fork.return_value() == 42);
+		fork.reset_to(master_v2, options);
+	}
+
+	/* And back again */
+	fork.reset_to(master_v1, options);
+	fork.timed_vmcall(fork.address_of("version"), 2.0f);
+	REQUIRE(fork.return_value() == 101);
+
+	/* Without the option, a new master is refused */
+	const tinykvm::MachineOptions strict {
+		.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM
+	};
+	REQUIRE_THROWS_AS(fork.reset_to(master_v2, strict), tinykvm::MachineException);
+}
+
+TEST_CASE("Emulated pipes, socketpairs and eventfds", "[Reset]")
+{
+	const auto binary = build_and_load(R"M(
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+static int pipefd[2], sv[2], efd;
+int main() {
+	if (pipe(pipefd) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		return 1;
+	efd = eventfd(0, EFD_NONBLOCK);
+	if (efd < 0)
+		return 2;
+	/* The master leaves data in the pipe */
+	return write(pipefd[1], "Hello", 5) != 5;
+}
+extern long read_pipe() {
+	char buffer[8];
+	if (read(pipefd[0], buffer, sizeof(buffer)) != 5)
+		return -1;
+	return memcmp(buffer, "Hello", 5) == 0;
+}
+extern long ping_pong() {
+	char buffer[4];
+	if (write(sv[0], "ping", 4) != 4 || read(sv[1], buffer, 4) != 4)
+		return -1;
+	return memcmp(buffer, "ping", 4) == 0;
+}
+extern long count_events() {
+	uint64_t value = 2;
+	if (read(efd, &value, sizeof(value)) >= 0)
+		return -1; /* Empty, and non-blocking */
+	write(efd, &value, sizeof(value));
+	write(efd, &value, sizeof(value));
+	value = 0;
+	read(efd, &value, sizeof(value));
+	return value;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.fds().set_emulated_channels(true);
+	machine.setup_linux({"emulated"}, env);
+	machine.run(4.0f);
+	REQUIRE(machine.return_value() == 0);
+	REQUIRE(machine.fds().has_emulated_fds());
+	machine.prepare_copy_on_write(0);
+
+	const tinykvm::MachineOptions options {
+		.max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM
+	};
+	auto fork = tinykvm::Machine { machine, options };
+	REQUIRE(fork.fds().emulated_channels());
+
+	for (size_t i = 0; i < 3; i++) {
+		/* Each reset restores the data that the master left */
+		fork.timed_vmcall(fork.address_of("read_pipe"), 2.0f);
+		REQUIRE(fork.return_value() == 1);
+		fork.timed_vmcall(fork.address_of("ping_pong"), 2.0f);
+		REQUIRE(fork.return_value() == 1);
+		fork.timed_vmcall(fork.address_of("count_events"), 2.0f);
+		REQUIRE(fork.return_value() == 4);
+		fork.reset_to(machine, options);
+	}
+}
+
+TEST_CASE("Forks keep their page tables across full resets", "[Reset]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+	const uint64_t GUEST_MEMORY = 32ULL << 20; /* 32MB */
+	tinykvm::Machine master { binary, { .max_mem = MAX_MEMORY } };
+	master.setup_linux({"master"}, env);
+	const auto addr = master.mmap_allocate(4ULL << 20);
+	const uint64_t second = addr + (2ULL << 20) + 4096;
+	master.copy_to_guest(addr, "Master", 7);
+	master.copy_to_guest(second, "Second", 7);
+	master.prepare_copy_on_write();
+
+	tinykvm::MachineOptions options {
+		.max_mem = GUEST_MEMORY, .max_cow_mem = MAX_COWMEM, .split_hugepages = true
+	};
+	tinykvm::Machine plain { master, options };
+	options.reset_keep_page_tables = true;
+	tinykvm::Machine fork { master, options };
+
+	size_t kept_pages = 0;
+	for (int i = 0; i < 4; i++) {
+		for (auto* vm : { &plain, &fork }) {
+			const auto cr3 = vm->get_special_registers().cr3;
+			vm->copy_to_guest(addr, "Forked", 7);
+			vm->copy_to_guest(second, "Forked", 7);
+			REQUIRE(vm->buffer_to_string(addr, 6) == "Forked");
+			REQUIRE(vm->buffer_to_string(second, 6) == "Forked");
+			// A full reset returns to the pages of the master
+			REQUIRE(vm->reset_to(master, options));
+			REQUIRE(vm->buffer_to_string(addr, 6) == "Master");
+			REQUIRE(vm->buffer_to_string(second, 6) == "Second");
+			// The root page table stays, so KVM sees no CR3 change
+			REQUIRE(vm->get_special_registers().cr3 == cr3);
+		}
+		// Only the page tables are kept, and they are reused
+		REQUIRE(fork.banked_memory_pages() > plain.banked_memory_pages());
+		if (i == 1)
+			kept_pages = fork.banked_memory_pages();
+		else if (i > 1)
+			REQUIRE(fork.banked_memory_pages() == kept_pages);
+	}
+	REQUIRE(master.buffer_to_string(addr, 6) == "Master");
+	REQUIRE(master.buffer_to_string(second, 6) == "Second");
+}
+
+TEST_CASE("Reset pooled fds in place", "[Reset]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+
+	using FD = tinykvm::FileDescriptors;
+	tinykvm::Machine master { binary, { .max_mem = MAX_MEMORY } };
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	auto& mfds = master.fds();
+	auto& fds = machine.fds();
+	// The master VM created an eventfd and a pipe, and waits on both
+	const int event_vfd = mfds.manage(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK), false, true);
+	mfds.add_socket_pair({event_vfd, -1, FD::SocketType::EVENTFD});
+	int pipefd[2];
+	REQUIRE(pipe2(pipefd, 0) == 0);
+	const int read_vfd = mfds.manage(pipefd[0], false, true);
+	const int write_vfd = mfds.manage(pipefd[1], false, true);
+	mfds.add_socket_pair({read_vfd, write_vfd, FD::SocketType::PIPE2});
+	const int epoll_vfd = mfds.manage(epoll_create1(0), false, true);
+	auto& ee = mfds.get_epoll_entry_for_vfd(epoll_vfd);
+	ee.epoll_fds[event_vfd] = { .events = EPOLLIN, .data = { .fd = event_vfd } };
+	ee.epoll_fds[read_vfd] = { .events = EPOLLIN | EPOLLONESHOT, .data = { .fd = read_vfd } };
+	fds.set_find_readonly_master_vm_fd_callback([&] (int vfd) { return mfds.entry_for_vfd(vfd); });
+
+	auto epoll_ready = [&] {
+		struct epoll_event events[4];
+		return epoll_wait(fds.translate(epoll_vfd), events, 4, 0);
+	};
+	auto signal = [&] {
+		const uint64_t one = 1;
+		REQUIRE(write(fds.translate(event_vfd), &one, sizeof(one)) == sizeof(one));
+		REQUIRE(write(fds.translate(write_vfd), "data", 4) == 4);
+	};
+
+	fds.reset_to(mfds);
+	const int event_fd = fds.translate(event_vfd);
+	const int read_fd = fds.translate(read_vfd);
+	const int epoll_fd = fds.translate(epoll_vfd);
+	REQUIRE(epoll_ready() == 0);
+	signal();
+	REQUIRE(epoll_ready() == 2);
+	// The one-shot pipe is disarmed until the next reset
+	REQUIRE(epoll_ready() == 1);
+
+	// The same host objects come back drained and re-armed
+	fds.reset_to(mfds);
+	REQUIRE(fds.translate(event_vfd) == event_fd);
+	REQUIRE(fds.translate(read_vfd) == read_fd);
+	REQUIRE(fds.translate(epoll_vfd) == epoll_fd);
+	REQUIRE(fds.pooled_fds() == 4);
+	REQUIRE(epoll_ready() == 0);
+	signal();
+	REQUIRE(epoll_ready() == 2);
+
+	// Registrations made by the guest are undone
+	int extra[2];
+	REQUIRE(pipe2(extra, 0) == 0);
+	const int extra_vfd = 0x5000; // A host fd that stays open
+	struct epoll_event ev { .events = EPOLLIN, .data = { .fd = extra_vfd } };
+	REQUIRE(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, extra[0], &ev) == 0);
+	fds.record_epoll_ctl(epoll_vfd, EPOLL_CTL_ADD, extra_vfd, extra[0]);
+	REQUIRE(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fds.translate(event_vfd), nullptr) == 0);
+	fds.record_epoll_ctl(epoll_vfd, EPOLL_CTL_DEL, event_vfd, -1);
+	fds.reset_to(mfds);
+	REQUIRE(fds.translate(epoll_vfd) == epoll_fd);
+	REQUIRE(write(extra[1], "x", 1) == 1);
+	REQUIRE(epoll_ready() == 0);
+	signal();
+	REQUIRE(epoll_ready() == 2);
+	close(extra[0]);
+	close(extra[1]);
+
+	// Objects changed by the guest are recreated
+	const int old_event_fd = dup(fds.translate(event_vfd));
+	fds.unpool(event_vfd);
+	fds.reset_to(mfds);
+	const uint64_t one = 1;
+	REQUIRE(write(old_event_fd, &one, sizeof(one)) == sizeof(one));
+	uint64_t count = 0;
+	REQUIRE(read(fds.translate(event_vfd), &count, sizeof(count)) < 0);
+	REQUIRE(errno == EAGAIN);
+	close(old_event_fd);
+	signal();
+	REQUIRE(epoll_ready() == 2);
+}
+
+TEST_CASE("Re-arm edge triggered fds of the master VM", "[Reset]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+})M");
+
+	tinykvm::Machine master { binary, { .max_mem = MAX_MEMORY } };
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	auto& mfds = master.fds();
+	auto& fds = machine.fds();
+	// The master VM shares a pipe with pending data, which no reset drains
+	int pipefd[2];
+	REQUIRE(pipe2(pipefd, O_NONBLOCK) == 0);
+	const int read_vfd = mfds.manage(pipefd[0], false, true);
+	const int epoll_vfd = mfds.manage(epoll_create1(0), false, true);
+	auto& ee = mfds.get_epoll_entry_for_vfd(epoll_vfd);
+	ee.epoll_fds[read_vfd] = { .events = EPOLLIN | EPOLLET, .data = { .fd = read_vfd } };
+	fds.set_find_readonly_master_vm_fd_callback([&] (int vfd) { return mfds.entry_for_vfd(vfd); });
+	REQUIRE(write(pipefd[1], "x", 1) == 1);
+
+	auto epoll_ready = [&] {
+		struct epoll_event events[4];
+		return epoll_wait(fds.translate(epoll_vfd), events, 4, 0);
+	};
+	fds.reset_to(mfds);
+	const int epoll_fd = fds.translate(epoll_vfd);
+	REQUIRE(epoll_ready() == 1);
+	// The edge is consumed for the rest of this request
+	REQUIRE(epoll_ready() == 0);
+
+	// Every request sees the data that is still pending
+	for (int i = 0; i < 2; i++) {
+		fds.reset_to(mfds);
+		REQUIRE(fds.translate(epoll_vfd) == epoll_fd);
+		REQUIRE(epoll_ready() == 1);
+		REQUIRE(epoll_ready() == 0);
+	}
+	close(pipefd[1]);
+}
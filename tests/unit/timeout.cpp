@@ -1,9 +1,18 @@
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/matchers/catch_matchers_string.hpp>
+#include <atomic>
 #include <thread>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <tinykvm/machine.hpp>
+#include <tinykvm/machine_scheduler.hpp>
+#include <tinykvm/smp.hpp>
 extern std::vector<uint8_t> build_and_load(const std::string& code);
+extern std::pair<
+	std::string,
+	std::vector<uint8_t>
+> build_and_load(const std::string& code, const std::string& args);
 static const uint64_t MAX_MEMORY = 32ul << 20; /* 32MB */
 static const uint64_t MAX_COWMEM =  8ul << 20; /* 8MB */
 static const std::vector<std::string> env {
@@ -93,3 +102,448 @@ int main() {
 	for (auto& thread : threads)
 		thread.join();
 }
+
+TEST_CASE("Timeouts through the shared timeout engine", "[Timeout]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	while (1);
+})M");
+
+	std::vector<std::thread> threads;
+	std::atomic<size_t> timeouts = 0;
+
+	for (size_t i = 0; i < 100; i++)
+	{
+		threads.push_back(std::thread([&] {
+			tinykvm::Machine machine { binary, {
+				.max_mem = MAX_MEMORY,
+				.shared_timeout_engine = true,
+			} };
+			machine.setup_linux({"timeout"}, env);
+			// This must cause a timeout exception
+			try {
+				machine.run(0.5f);
+			} catch (const tinykvm::MachineTimeoutException& e) {
+				timeouts++;
+			}
+		}));
+	}
+	for (auto& thread : threads)
+		thread.join();
+
+	REQUIRE(timeouts == 100);
+	// Every timer was disarmed after the timeout
+	REQUIRE(tinykvm::TimeoutEngine::get().armed_timers() == 0);
+}
+
+/* Run by the test below, in a process of its own */
+TEST_CASE("Shared timeout engine in a new process", "[.][TimeoutChild]")
+{
+	tinykvm::Machine::init();
+	const auto binary = build_and_load(R"M(
+int main() {
+	while (1);
+})M");
+	tinykvm::Machine machine { binary, {
+		.max_mem = MAX_MEMORY,
+		.shared_timeout_engine = true,
+	} };
+	machine.setup_linux({"timeout"}, env);
+	REQUIRE_THROWS_AS(machine.run(0.2f), tinykvm::MachineTimeoutException);
+}
+
+TEST_CASE("Shared timeout engine without any per-vCPU timers", "[Timeout]")
+{
+	/* The signal handlers are reset by exec(), so that no
+	   per-vCPU timer has installed the SIGUSR2 handler */
+	const pid_t pid = fork();
+	REQUIRE(pid >= 0);
+	if (pid == 0) {
+		execl("/proc/self/exe", "timeout", "Shared timeout engine in a new process", (char*)nullptr);
+		_exit(127);
+	}
+	int status = 0;
+	REQUIRE(waitpid(pid, &status, 0) == pid);
+	REQUIRE(WIFEXITED(status));
+	REQUIRE(WEXITSTATUS(status) == 0);
+}
+
+static const char* fast_timeout_program = R"M(
+#include <time.h>
+int main() {
+	return 0;
+}
+extern long quick(long x) {
+	return x + 1;
+}
+extern void loop_forever() {
+	while (1);
+}
+extern long busy_ms(long ms) {
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+	} while ((t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000 < ms);
+	return ms;
+})M";
+
+TEST_CASE("Fast execution timeout", "[Timeout]")
+{
+	const auto binary = build_and_load(fast_timeout_program);
+
+	tinykvm::Machine machine { binary, {
+		.max_mem = MAX_MEMORY,
+		.fast_execution_timeout = true,
+	} };
+	machine.setup_linux({"timeout"}, env);
+	machine.run(4.0f);
+
+	// Every looping call must time out, even though the
+	// timer is left armed between calls
+	for (int i = 0; i < 10; i++) {
+		REQUIRE_THROWS_AS(
+			machine.timed_vmcall(machine.address_of("loop_forever"), 0.05f),
+			tinykvm::MachineTimeoutException);
+		machine.timed_vmcall(machine.address_of("quick"), 1.0f, i);
+		REQUIRE(machine.return_value() == i + 1);
+	}
+}
+
+TEST_CASE("Fast execution timeout ignores early and stale signals", "[Timeout]")
+{
+	const auto binary = build_and_load(fast_timeout_program);
+
+	tinykvm::Machine machine { binary, {
+		.max_mem = MAX_MEMORY,
+		.fast_execution_timeout = true,
+	} };
+	machine.setup_linux({"timeout"}, env);
+	machine.run(4.0f);
+
+	// The timer from this call expires while no VM is running
+	machine.timed_vmcall(machine.address_of("quick"), 0.02f, 1);
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	machine.timed_vmcall(machine.address_of("busy_ms"), 1.0f, 100);
+	REQUIRE(machine.return_value() == 100);
+
+	// The timer from this call expires early, during the next call
+	machine.timed_vmcall(machine.address_of("quick"), 0.1f, 1);
+	machine.timed_vmcall(machine.address_of("busy_ms"), 1.0f, 200);
+	REQUIRE(machine.return_value() == 200);
+
+	// The timer from this call expires during a call in another VM
+	tinykvm::Machine other { binary, { .max_mem = MAX_MEMORY } };
+	other.setup_linux({"timeout"}, env);
+	other.run(4.0f);
+	machine.timed_vmcall(machine.address_of("quick"), 0.05f, 1);
+	other.timed_vmcall(other.address_of("busy_ms"), 1.0f, 150);
+	REQUIRE(other.return_value() == 150);
+}
+
+TEST_CASE("Local APIC execution timeout", "[Timeout]")
+{
+	const auto binary = build_and_load(fast_timeout_program);
+
+	tinykvm::Machine machine { binary, {
+		.max_mem = MAX_MEMORY,
+		.lapic_timer = true,
+	} };
+	machine.setup_linux({"timeout"}, env);
+	machine.run(4.0f);
+
+	for (int i = 0; i < 10; i++) {
+		REQUIRE_THROWS_AS(
+			machine.timed_vmcall(machine.address_of("loop_forever"), 0.05f),
+			tinykvm::MachineTimeoutException);
+		machine.timed_vmcall(machine.address_of("quick"), 1.0f, i);
+		REQUIRE(machine.return_value() == i + 1);
+	}
+	// An earlier deadline left armed must not time out this call
+	machine.timed_vmcall(machine.address_of("quick"), 0.02f, 1);
+	machine.timed_vmcall(machine.address_of("busy_ms"), 1.0f, 100);
+	REQUIRE(machine.return_value() == 100);
+
+	// Forks get their own local APIC
+	machine.prepare_copy_on_write();
+	tinykvm::Machine fork { machine, {
+		.max_mem = MAX_MEMORY,
+		.max_cow_mem = MAX_COWMEM,
+		.lapic_timer = true,
+	} };
+	REQUIRE_THROWS_AS(
+		fork.timed_vmcall(fork.address_of("loop_forever"), 0.05f),
+		tinykvm::MachineTimeoutException);
+}
+
+TEST_CASE("Fast execution timeout on SMP vCPUs", "[Timeout]")
+{
+	const auto binary = build_and_load(fast_timeout_program);
+
+	tinykvm::Machine machine { binary, {
+		.max_mem = MAX_MEMORY,
+		.fast_execution_timeout = true,
+	} };
+	machine.setup_linux({"timeout"}, env);
+	machine.run(4.0f);
+
+	static constexpr size_t CPUS = 4;
+	static constexpr uint32_t STACK_SIZE = 65536;
+	const auto stacks = machine.mmap_allocate(CPUS * STACK_SIZE);
+	for (int i = 0; i < 10; i++) {
+		machine.smp().timed_smpcall(CPUS, stacks, STACK_SIZE,
+			machine.address_of("quick"), 0.05f, i);
+		machine.smp_wait();
+		for (const long result : machine.smp().gather_return_values(CPUS))
+			REQUIRE(result == i + 1);
+		// Let the timers from this round expire between calls
+		std::this_thread::sleep_for(std::chrono::milliseconds(60));
+	}
+}
+
+TEST_CASE("Fast execution timeout in remote calls", "[Timeout]")
+{
+	const auto storage_binary = build_and_load(R"M(
+int main() {
+	return 1234;
+}
+extern long remote_quick(long x) {
+	return x + 1;
+}
+extern void remote_loop_forever() {
+	while (1);
+}
+)M", "-Wl,-Ttext-segment=0x40400000");
+
+	const std::string command = "objcopy -w --extract-symbol --strip-symbol=!remote* --strip-symbol=* " + storage_binary.first + " timeout_storage.syms";
+	FILE* f = popen(command.c_str(), "r");
+	if (f == nullptr) {
+		throw std::runtime_error("Unable to extract remote symbols");
+	}
+	pclose(f);
+
+	const auto main_binary = build_and_load(R"M(
+extern long remote_quick(long);
+extern void remote_loop_forever();
+int main() {
+	return 0;
+}
+extern long call_quick(long x) {
+	return remote_quick(x);
+}
+extern void call_loop_forever() {
+	remote_loop_forever();
+}
+)M", "-Wl,--just-symbols=timeout_storage.syms");
+
+	tinykvm::Machine storage { storage_binary.second, {
+		.max_mem = 16ULL << 20, // MB
+		.vmem_base_address = 1ULL << 30, // 1GB
+	} };
+	storage.setup_linux({"storage"}, env);
+	storage.run(4.0f);
+
+	tinykvm::Machine machine { main_binary.second, {
+		.max_mem = MAX_MEMORY,
+		.fast_execution_timeout = true,
+	} };
+	machine.setup_linux({"main"}, env);
+	machine.remote_connect(storage);
+	machine.run(4.0f);
+
+	machine.timed_vmcall(machine.address_of("call_quick"), 1.0f, 41);
+	REQUIRE(machine.return_value() == 42);
+	// A call that loops in the remote VM times out too
+	REQUIRE_THROWS_AS(
+		machine.timed_vmcall(machine.address_of("call_loop_forever"), 0.05f),
+		tinykvm::MachineTimeoutException);
+}
+
+TEST_CASE("Time-slice calls from many VMs over one thread", "[Timeout]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+}
+extern long spin(long iterations) {
+	for (volatile long i = 0; i < iterations; i++);
+	return 1;
+}
+extern long quick() {
+	return 2;
+})M");
+
+	tinykvm::Machine heavy { binary, { .max_mem = MAX_MEMORY } };
+	heavy.setup_linux({"scheduler"}, env);
+	heavy.run(4.0f);
+	tinykvm::Machine light { binary, { .max_mem = MAX_MEMORY } };
+	light.setup_linux({"scheduler"}, env);
+	light.run(4.0f);
+	tinykvm::Machine forever { binary, { .max_mem = MAX_MEMORY } };
+	forever.setup_linux({"scheduler"}, env);
+	forever.run(4.0f);
+
+	std::atomic<int> order = 0;
+	int heavy_done = 0, light_done = 0;
+	long heavy_result = 0, light_result = 0;
+	bool forever_timed_out = false;
+	std::atomic<int> errors = 0;
+	{
+		tinykvm::MachineScheduler scheduler({ .threads = 1, .time_slice = 0.001f });
+		scheduler.submit_vmcall(heavy, heavy.address_of("spin"), 1, 0,
+			[&] (tinykvm::Machine& vm, std::exception_ptr error) {
+				errors += (error != nullptr);
+				heavy_result = vm.return_value();
+				heavy_done = ++order;
+			}, 200'000'000L);
+		// A CPU limit turns into a timeout instead of running forever
+		scheduler.submit({
+			.vm = &forever,
+			.setup = [] (tinykvm::Machine& vm) {
+				auto& regs = vm.registers();
+				vm.setup_call(regs, vm.address_of("spin"), vm.stack_address(), INT64_MAX);
+				vm.set_registers(regs);
+			},
+			.done = [&] (tinykvm::Machine&, std::exception_ptr error) {
+				try {
+					std::rethrow_exception(error);
+				} catch (const tinykvm::MachineTimeoutException&) {
+					forever_timed_out = true;
+				}
+			},
+			.tenant = 1,
+			.cpu_limit = 0.05f,
+		});
+		// Let the heavy tenant use some CPU, then submit a short request
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		scheduler.submit_vmcall(light, light.address_of("quick"), 2, 0,
+			[&] (tinykvm::Machine& vm, std::exception_ptr error) {
+				errors += (error != nullptr);
+				light_result = vm.return_value();
+				light_done = ++order;
+			});
+		scheduler.wait_idle();
+
+		const auto heavy_stats = scheduler.tenant_stats(1);
+		REQUIRE(heavy_stats.calls == 2);
+		REQUIRE(heavy_stats.preemptions > 0);
+		REQUIRE(scheduler.tenant_stats(2).calls == 1);
+		REQUIRE(scheduler.active() == 0);
+	}
+	REQUIRE(errors == 0);
+	REQUIRE(heavy_result == 1);
+	REQUIRE(light_result == 2);
+	REQUIRE(forever_timed_out);
+	// The short request did not wait for the heavy tenant
+	REQUIRE(light_done < heavy_done);
+}
+
+TEST_CASE("Instruction budget", "[Timeout]")
+{
+	const auto binary = build_and_load(R"M(
+extern long spin(long n) {
+	for (volatile long i = 0; i < n; i++);
+	return n;
+}
+int main() {
+	return 0;
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"budget"}, env);
+	machine.run(4.0f);
+	try {
+		machine.set_instruction_budget(10'000'000);
+	} catch (const tinykvm::MachineException&) {
+		// No guest instruction counter on this host (eg. no vPMU)
+		WARN("Guest instruction counters are not available");
+		return;
+	}
+	REQUIRE(machine.instruction_budget() == 10'000'000);
+
+	// A short call finishes within the budget
+	machine.timed_vmcall(machine.address_of("spin"), 4.0f, 1000);
+	REQUIRE(machine.return_value() == 1000);
+	REQUIRE(machine.instructions_executed() > 1000);
+	REQUIRE(machine.instructions_executed() < 10'000'000);
+
+	// A long call is stopped by the budget, long before the timeout
+	bool exceeded = false;
+	try {
+		machine.timed_vmcall(machine.address_of("spin"), 4.0f, INT64_MAX);
+	} catch (const tinykvm::MachineTimeoutException& e) {
+		REQUIRE(std::string(e.what()) == "Instruction budget exceeded");
+		REQUIRE(e.instructions() >= 10'000'000);
+		exceeded = true;
+	}
+	REQUIRE(exceeded);
+
+	// Without a budget, the timeout applies as before
+	machine.set_instruction_budget(0);
+	machine.timed_vmcall(machine.address_of("spin"), 4.0f, 1000);
+	REQUIRE(machine.return_value() == 1000);
+}
+
+TEST_CASE("Cancel a running request", "[Timeout]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+}
+extern void spin() {
+	while (1);
+})M");
+
+	tinykvm::Machine machine { binary, { .max_mem = MAX_MEMORY } };
+	machine.setup_linux({"cancel"}, env);
+	machine.run(4.0f);
+
+	// Cancelled from another thread, long before the timeout
+	std::thread canceller([&machine] {
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		machine.cancel();
+	});
+	const auto t0 = std::chrono::steady_clock::now();
+	bool cancelled = false;
+	try {
+		machine.timed_vmcall(machine.address_of("spin"), 8.0f);
+	} catch (const tinykvm::MachineCancelledException&) {
+		cancelled = true;
+	}
+	canceller.join();
+	REQUIRE(cancelled);
+	REQUIRE(std::chrono::steady_clock::now() - t0 < std::chrono::seconds(4));
+
+	// A cancellation without a running request applies to the next one
+	machine.cancel();
+	REQUIRE_THROWS_AS(machine.timed_vmcall(machine.address_of("spin"), 8.0f),
+		tinykvm::MachineCancelledException);
+}
+
+TEST_CASE("Drop a cancellation between runs on reset", "[Timeout]")
+{
+	const auto binary = build_and_load(R"M(
+int main() {
+	return 0;
+}
+extern int get() {
+	return 1234;
+})M");
+
+	tinykvm::Machine master { binary, { .max_mem = MAX_MEMORY } };
+	master.setup_linux({"cancel"}, env);
+	master.run(4.0f);
+	master.prepare_copy_on_write();
+
+	tinykvm::Machine fork { master, { .max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM } };
+	fork.timed_vmcall(fork.address_of("get"), 4.0f);
+	REQUIRE(fork.return_value() == 1234);
+
+	// Cancelled after the request has ended, and then reset
+	fork.cancel();
+	fork.reset_to(master, { .max_mem = MAX_MEMORY, .max_cow_mem = MAX_COWMEM });
+	// The next request runs normally
+	fork.timed_vmcall(fork.address_of("get"), 4.0f);
+	REQUIRE(fork.return_value() == 1234);
+}